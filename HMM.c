@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 #include <htslib/hts.h>
 #include "HMM.h"
 
@@ -48,6 +49,7 @@ struct _hmm_t
     double *vprob, *vprob_tmp;  // viterbi probs [nstates]
     uint8_t *vpath;             // viterbi path [nstates*nvpath]
     double *bwd, *bwd_tmp;      // bwd probs [nstates]
+    double *bwd_eprob;          // bwd*eprob products [nstates]
     double *fwd;                // fwd probs [nstates*(nfwd+1)]
     int nvpath, nfwd;
 
@@ -57,6 +59,8 @@ struct _hmm_t
     double *tprob_arr;          // Array of transition matrices, precalculated to ntprob_arr
                                 //  positions. The first matrix is the initial tprob matrix
                                 //  set by hmm_init() or hmm_set_tprob()
+    double *tprob_pow;          // Powers of the last precalculated matrix, B^(2^i) for B=tprob_arr[ntprob_arr-1],
+    int npow, mpow;             //  calculated on demand for long jumps between sites
     set_tprob_f set_tprob;      // Optional user function to set / modify transition probabilities
                                 //  at each site (one step of Viterbi algorithm)
     void *set_tprob_data;
@@ -164,6 +168,7 @@ void *hmm_snapshot(hmm_t *hmm, void *_snapshot, uint32_t pos)
 void hmm_restore(hmm_t *hmm, void *_snapshot)
 {
     snapshot_t *snapshot = (snapshot_t*) _snapshot;
+    hmm->snapshot = NULL;   // drop any pending request, it may belong to another sample
     if ( !snapshot || !snapshot->snap_at_pos ) 
     {
         hmm->state.snap_at_pos = 0;
@@ -181,6 +186,7 @@ void hmm_reset(hmm_t *hmm, void *_snapshot)
 {
     snapshot_t *snapshot = (snapshot_t*) _snapshot;
     if ( snapshot ) snapshot->snap_at_pos = 0;
+    hmm->snapshot = NULL;
     hmm->state.snap_at_pos = 0;
     memcpy(hmm->state.vit_prob,hmm->init.vit_prob,sizeof(double)*hmm->nstates);
     memcpy(hmm->state.fwd_prob,hmm->init.fwd_prob,sizeof(double)*hmm->nstates);
@@ -199,6 +205,8 @@ void hmm_set_tprob(hmm_t *hmm, double *tprob, int ntprob)
     int i;
     for (i=1; i<ntprob; i++)
         multiply_matrix(hmm->nstates, hmm->tprob_arr, hmm->tprob_arr+(i-1)*hmm->nstates*hmm->nstates, hmm->tprob_arr+i*hmm->nstates*hmm->nstates, hmm->tmp);
+
+    hmm->npow = 0;  // the powers must be recalculated
 }
 
 void hmm_set_tprob_func(hmm_t *hmm, set_tprob_f set_tprob, void *data)
@@ -207,21 +215,40 @@ void hmm_set_tprob_func(hmm_t *hmm, set_tprob_f set_tprob, void *data)
     hmm->set_tprob_data = data;
 }
 
-static void _set_tprob(hmm_t *hmm, int pos_diff)
+/*
+ *  Returns the transition matrix for a jump of pos_diff sites. Without the user
+ *  callback and for short jumps this is directly one of the precalculated
+ *  matrices, otherwise the matrix is assembled in curr_tprob. Long jumps of
+ *  n full blocks are calculated from the cached powers B^(2^i) in O(log n)
+ *  multiplications instead of n.
+ */
+static double *_set_tprob(hmm_t *hmm, int pos_diff, uint32_t prev_pos, uint32_t pos)
 {
     assert( pos_diff>=0 );
 
-    int i, n;
+    int i, n, nn = hmm->nstates*hmm->nstates;
 
     n = hmm->ntprob_arr ? pos_diff % hmm->ntprob_arr : 0;  // n-th precalculated matrix
-    memcpy(hmm->curr_tprob, hmm->tprob_arr+n*hmm->nstates*hmm->nstates, sizeof(*hmm->curr_tprob)*hmm->nstates*hmm->nstates);
+    int nblk = hmm->ntprob_arr > 0 ? pos_diff / hmm->ntprob_arr : 0;  // number of full blocks to jump
+    if ( !nblk && !hmm->set_tprob ) return hmm->tprob_arr + n*nn;
 
-    if ( hmm->ntprob_arr > 0  )
+    memcpy(hmm->curr_tprob, hmm->tprob_arr+n*nn, sizeof(*hmm->curr_tprob)*nn);
+    for (i=0; nblk; i++, nblk>>=1)
     {
-        n = pos_diff / hmm->ntprob_arr;  // number of full blocks to jump
-        for (i=0; i<n; i++)
-            multiply_matrix(hmm->nstates, hmm->tprob_arr+(hmm->ntprob_arr-1)*hmm->nstates*hmm->nstates, hmm->curr_tprob, hmm->curr_tprob, hmm->tmp);
+        if ( i>=hmm->npow )
+        {
+            hts_expand(double, (i+1)*nn, hmm->mpow, hmm->tprob_pow);
+            if ( !i )
+                memcpy(hmm->tprob_pow, hmm->tprob_arr+(hmm->ntprob_arr-1)*nn, sizeof(double)*nn);
+            else
+                multiply_matrix(hmm->nstates, hmm->tprob_pow+(i-1)*nn, hmm->tprob_pow+(i-1)*nn, hmm->tprob_pow+i*nn, hmm->tmp);
+            hmm->npow = i+1;
+        }
+        if ( nblk & 1 )
+            multiply_matrix(hmm->nstates, hmm->tprob_pow+i*nn, hmm->curr_tprob, hmm->curr_tprob, hmm->tmp);
     }
+    if ( hmm->set_tprob ) hmm->set_tprob(hmm, prev_pos, pos, hmm->set_tprob_data, hmm->curr_tprob);
+    return hmm->curr_tprob;
 }
 
 void hmm_run_viterbi(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
@@ -250,8 +277,7 @@ void hmm_run_viterbi(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         double *eprob  = &eprobs[i*nstates];
 
         int pos_diff = sites[i] == prev_pos ? 0 : sites[i] - prev_pos - 1;
-        _set_tprob(hmm, pos_diff);
-        if ( hmm->set_tprob ) hmm->set_tprob(hmm, prev_pos, sites[i], hmm->set_tprob_data, hmm->curr_tprob);
+        double *tprob = _set_tprob(hmm, pos_diff, prev_pos, sites[i]);
         prev_pos = sites[i];
 
         double vnorm = 0;
@@ -261,7 +287,7 @@ void hmm_run_viterbi(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
             int k, k_vmax = 0;
             for (k=0; k<nstates; k++)
             {
-                double pval = hmm->vprob[k] * MAT(hmm->curr_tprob,hmm->nstates,j,k);
+                double pval = hmm->vprob[k] * MAT(tprob,nstates,j,k);
                 if ( vmax < pval ) { vmax = pval; k_vmax = k; }
             }
             vpath[j] = k_vmax;
@@ -289,6 +315,64 @@ void hmm_run_viterbi(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
     }
 }
 
+// One step of the forward algorithm: fwd_prev at prev_pos to fwd at pos
+static inline void _fwd_step(hmm_t *hmm, double *fwd_prev, double *fwd, double *eprob, uint32_t prev_pos, uint32_t pos)
+{
+    int j, k, nstates = hmm->nstates;
+    int pos_diff = pos == prev_pos ? 0 : pos - prev_pos - 1;
+    double *tprob = _set_tprob(hmm, pos_diff, prev_pos, pos);
+
+    double norm = 0;
+    for (j=0; j<nstates; j++)
+    {
+        double pval = 0;
+        for (k=0; k<nstates; k++)
+            pval += fwd_prev[k] * MAT(tprob,nstates,j,k);
+        fwd[j] = pval * eprob[j];
+        norm += fwd[j];
+    }
+    for (j=0; j<nstates; j++) fwd[j] /= norm;
+}
+
+// One step of the backward algorithm: bwd at next_pos to bwd_tmp at pos, fwd
+// is overwritten with the normalized fwd*bwd
+static inline void _bwd_step(hmm_t *hmm, double *bwd, double *bwd_tmp, double *fwd, double *eprob, uint32_t pos, uint32_t next_pos)
+{
+    int j, k, nstates = hmm->nstates;
+    int pos_diff = pos == next_pos ? 0 : next_pos - pos - 1;
+    double *tprob = _set_tprob(hmm, pos_diff, pos, next_pos);
+
+    // the products bwd*eprob do not depend on j, calculate them only once
+    double *bwd_eprob = hmm->bwd_eprob;
+    for (k=0; k<nstates; k++) bwd_eprob[k] = bwd[k] * eprob[k];
+
+    double bwd_norm = 0;
+    for (j=0; j<nstates; j++)
+    {
+        double pval = 0;
+        for (k=0; k<nstates; k++)
+            pval += bwd_eprob[k] * MAT(tprob,nstates,k,j);
+        bwd_tmp[j] = pval;
+        bwd_norm += pval;
+    }
+    double norm = 0;
+    for (j=0; j<nstates; j++)
+    {
+        bwd_tmp[j] /= bwd_norm;
+        fwd[j] *= bwd_tmp[j];   // fwd now stores fwd*bwd
+        norm += fwd[j];
+    }
+    for (j=0; j<nstates; j++) fwd[j] /= norm;
+}
+
+static void _init_bwd(hmm_t *hmm)
+{
+    if ( hmm->bwd ) return;
+    hmm->bwd       = (double*) malloc(sizeof(double)*hmm->nstates);
+    hmm->bwd_tmp   = (double*) malloc(sizeof(double)*hmm->nstates);
+    hmm->bwd_eprob = (double*) malloc(sizeof(double)*hmm->nstates);
+}
+
 void hmm_run_fwd_bwd(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
 {
     // Init arrays when run for the first time
@@ -297,14 +381,9 @@ void hmm_run_fwd_bwd(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         hmm->nfwd = n;
         hmm->fwd  = (double*) realloc(hmm->fwd, sizeof(double)*(hmm->nfwd+1)*hmm->nstates);
     }
-    if ( !hmm->bwd )
-    {
-        hmm->bwd     = (double*) malloc(sizeof(double)*hmm->nstates);
-        hmm->bwd_tmp = (double*) malloc(sizeof(double)*hmm->nstates);
-    }
-
+    _init_bwd(hmm);
 
-    int i,j,k, nstates = hmm->nstates;
+    int i, nstates = hmm->nstates;
     memcpy(hmm->fwd, hmm->state.fwd_prob, sizeof(*hmm->state.fwd_prob)*nstates);
     memcpy(hmm->bwd, hmm->state.bwd_prob, sizeof(*hmm->state.bwd_prob)*nstates);
     uint32_t prev_pos = hmm->state.snap_at_pos ? hmm->state.snap_at_pos : sites[0];
@@ -312,27 +391,10 @@ void hmm_run_fwd_bwd(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
     // Run fwd 
     for (i=0; i<n; i++)
     {
-        double *fwd_prev = &hmm->fwd[i*nstates];
-        double *fwd      = &hmm->fwd[(i+1)*nstates];
-        double *eprob    = &eprobs[i*nstates];
-
-        int pos_diff = sites[i] == prev_pos ? 0 : sites[i] - prev_pos - 1;
-
-        _set_tprob(hmm, pos_diff);
-        if ( hmm->set_tprob ) hmm->set_tprob(hmm, prev_pos, sites[i], hmm->set_tprob_data, hmm->curr_tprob);
+        double *fwd = &hmm->fwd[(i+1)*nstates];
+        _fwd_step(hmm, &hmm->fwd[i*nstates], fwd, &eprobs[i*nstates], prev_pos, sites[i]);
         prev_pos = sites[i];
 
-        double norm = 0;
-        for (j=0; j<nstates; j++)
-        {
-            double pval = 0;
-            for (k=0; k<nstates; k++)
-                pval += fwd_prev[k] * MAT(hmm->curr_tprob,hmm->nstates,j,k);
-            fwd[j] = pval * eprob[j];
-            norm += fwd[j];
-        }
-        for (j=0; j<nstates; j++) fwd[j] /= norm;
-
         if ( hmm->snapshot && sites[i]==hmm->snapshot->snap_at_pos )
             memcpy(hmm->snapshot->fwd_prob, fwd, sizeof(*fwd)*nstates);
     }
@@ -342,34 +404,76 @@ void hmm_run_fwd_bwd(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
     prev_pos = sites[n-1];
     for (i=0; i<n; i++)
     {
-        double *fwd   = &hmm->fwd[(n-i)*nstates];
-        double *eprob = &eprobs[(n-i-1)*nstates];
-        
-        int pos_diff = sites[n-i-1] == prev_pos ? 0 : prev_pos - sites[n-i-1] - 1;
-
-        _set_tprob(hmm, pos_diff);
-        if ( hmm->set_tprob ) hmm->set_tprob(hmm, sites[n-i-1], prev_pos, hmm->set_tprob_data, hmm->curr_tprob);
+        _bwd_step(hmm, bwd, bwd_tmp, &hmm->fwd[(n-i)*nstates], &eprobs[(n-i-1)*nstates], sites[n-i-1], prev_pos);
         prev_pos = sites[n-i-1];
+        double *tmp = bwd_tmp; bwd_tmp = bwd; bwd = tmp;
+    }
+}
 
-        double bwd_norm = 0;
-        for (j=0; j<nstates; j++)
+void hmm_run_fwd_bwd_ckpt(hmm_t *hmm, int n, double *eprobs, uint32_t *sites, hmm_fwd_bwd_f callback, void *data)
+{
+    if ( n<=0 ) return;
+    _init_bwd(hmm);
+
+    int i, iseg, nstates = hmm->nstates;
+    int seg_len = ceil(sqrt(n)), nseg = (n + seg_len - 1) / seg_len;
+
+    // forward probabilities at the segment starts and the previous positions
+    double *ckpt = (double*) malloc(sizeof(double)*nseg*nstates);
+    uint32_t *ckpt_pos = (uint32_t*) malloc(sizeof(uint32_t)*nseg);
+    double *seg = (double*) malloc(sizeof(double)*(seg_len+1)*nstates);
+
+    // Run fwd, keeping only the checkpoints
+    memcpy(seg, hmm->state.fwd_prob, sizeof(*hmm->state.fwd_prob)*nstates);
+    uint32_t prev_pos = hmm->state.snap_at_pos ? hmm->state.snap_at_pos : sites[0];
+    double *fwd_prev = seg, *fwd = seg + nstates;
+    for (i=0; i<n; i++)
+    {
+        if ( i % seg_len == 0 )
         {
-            double pval = 0;
-            for (k=0; k<nstates; k++)
-                pval += bwd[k] * eprob[k] * MAT(hmm->curr_tprob,hmm->nstates,k,j);
-            bwd_tmp[j] = pval;
-            bwd_norm += pval;
+            memcpy(ckpt + (i/seg_len)*nstates, fwd_prev, sizeof(double)*nstates);
+            ckpt_pos[i/seg_len] = prev_pos;
         }
-        double norm = 0;
-        for (j=0; j<nstates; j++)
+        _fwd_step(hmm, fwd_prev, fwd, &eprobs[i*nstates], prev_pos, sites[i]);
+        prev_pos = sites[i];
+
+        if ( hmm->snapshot && sites[i]==hmm->snapshot->snap_at_pos )
+            memcpy(hmm->snapshot->fwd_prob, fwd, sizeof(*fwd)*nstates);
+
+        double *tmp = fwd_prev; fwd_prev = fwd; fwd = tmp;
+    }
+
+    // Run bwd, recalculating fwd probabilities of one segment at a time
+    double *bwd = hmm->bwd, *bwd_tmp = hmm->bwd_tmp;
+    memcpy(bwd, hmm->state.bwd_prob, sizeof(*hmm->state.bwd_prob)*nstates);
+    prev_pos = sites[n-1];
+    for (iseg=nseg-1; iseg>=0; iseg--)
+    {
+        int beg = iseg*seg_len, end = beg + seg_len < n ? beg + seg_len : n;
+        uint32_t fwd_pos = ckpt_pos[iseg];
+        memcpy(seg, ckpt + iseg*nstates, sizeof(double)*nstates);
+        for (i=beg; i<end; i++)
         {
-            bwd_tmp[j] /= bwd_norm;
-            fwd[j] *= bwd_tmp[j];   // fwd now stores fwd*bwd
-            norm += fwd[j];
+            _fwd_step(hmm, &seg[(i-beg)*nstates], &seg[(i-beg+1)*nstates], &eprobs[i*nstates], fwd_pos, sites[i]);
+            fwd_pos = sites[i];
+        }
+        for (i=end-1; i>=beg; i--)
+        {
+            double *fwd_bwd = &seg[(i-beg+1)*nstates];
+            _bwd_step(hmm, bwd, bwd_tmp, fwd_bwd, &eprobs[i*nstates], sites[i], prev_pos);
+            prev_pos = sites[i];
+            double *tmp = bwd_tmp; bwd_tmp = bwd; bwd = tmp;
+
+            // hmm_get_fwd_bwd_prob() is offset by one site, the fwd*bwd of i-th site
+            // comes at (i+1)-th and the first site gets the initial state
+            if ( i+1<n ) callback(hmm, i+1, fwd_bwd, data);
         }
-        for (j=0; j<nstates; j++) fwd[j] /= norm;
-        double *tmp = bwd_tmp; bwd_tmp = bwd; bwd = tmp;
     }
+    memcpy(seg, hmm->state.fwd_prob, sizeof(*hmm->state.fwd_prob)*nstates);
+    callback(hmm, 0, seg, data);
+    free(seg);
+    free(ckpt);
+    free(ckpt_pos);
 }
 
 double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
@@ -380,11 +484,7 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         hmm->nfwd = n;
         hmm->fwd  = (double*) realloc(hmm->fwd, sizeof(double)*(hmm->nfwd+1)*hmm->nstates);
     }
-    if ( !hmm->bwd )
-    {
-        hmm->bwd     = (double*) malloc(sizeof(double)*hmm->nstates);
-        hmm->bwd_tmp = (double*) malloc(sizeof(double)*hmm->nstates);
-    }
+    _init_bwd(hmm);
 
     // Init all states with equal likelihood
     int i,j,k, nstates = hmm->nstates;
@@ -406,8 +506,7 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
 
         int pos_diff = sites[i] == prev_pos ? 0 : sites[i] - prev_pos - 1;
 
-        _set_tprob(hmm, pos_diff);
-        if ( hmm->set_tprob ) hmm->set_tprob(hmm, prev_pos, sites[i], hmm->set_tprob_data, hmm->curr_tprob);
+        double *tprob = _set_tprob(hmm, pos_diff, prev_pos, sites[i]);
         prev_pos = sites[i];
 
         double norm = 0;
@@ -415,7 +514,7 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         {
             double pval = 0;
             for (k=0; k<nstates; k++)
-                pval += fwd_prev[k] * MAT(hmm->curr_tprob,hmm->nstates,j,k);
+                pval += fwd_prev[k] * MAT(tprob,nstates,j,k);
             fwd[j] = pval * eprob[j];
             norm += fwd[j];
         }
@@ -423,7 +522,7 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
     }
 
     // Run bwd
-    double *bwd = hmm->bwd, *bwd_tmp = hmm->bwd_tmp;
+    double *bwd = hmm->bwd, *bwd_tmp = hmm->bwd_tmp, *bwd_eprob = hmm->bwd_eprob;
     prev_pos = sites[n-1];
     for (i=0; i<n; i++)
     {
@@ -432,16 +531,18 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         
         int pos_diff = sites[n-i-1] == prev_pos ? 0 : prev_pos - sites[n-i-1] - 1;
 
-        _set_tprob(hmm, pos_diff);
-        if ( hmm->set_tprob ) hmm->set_tprob(hmm, sites[n-i-1], prev_pos, hmm->set_tprob_data, hmm->curr_tprob);
+        double *tprob = _set_tprob(hmm, pos_diff, sites[n-i-1], prev_pos);
         prev_pos = sites[n-i-1];
 
+        // the products bwd*eprob do not depend on j, calculate them only once
+        for (k=0; k<nstates; k++) bwd_eprob[k] = bwd[k] * eprob[k];
+
         double bwd_norm = 0;
         for (j=0; j<nstates; j++)
         {
             double pval = 0;
             for (k=0; k<nstates; k++)
-                pval += bwd[k] * eprob[k] * MAT(hmm->curr_tprob,hmm->nstates,k,j);
+                pval += bwd_eprob[k] * MAT(tprob,nstates,k,j);
             bwd_tmp[j] = pval;
             bwd_norm += pval;
         }
@@ -501,9 +602,11 @@ void hmm_destroy(hmm_t *hmm)
     free(hmm->curr_tprob);
     free(hmm->tmp);
     free(hmm->tprob_arr);
+    free(hmm->tprob_pow);
     free(hmm->fwd);
     free(hmm->bwd);
     free(hmm->bwd_tmp);
+    free(hmm->bwd_eprob);
     free(hmm);
 }
 
@@ -71,6 +71,8 @@ void *hmm_snapshot(hmm_t *hmm, void *snapshot, uint32_t pos);
  *   @isite:    take the snapshot at i-th step
  *
  *   If both restore() and snapshot() are needed, restore() must be called first.
+ *   Any snapshot requested earlier is detached from the model by restore(), so
+ *   that a single hmm_t can be reused for multiple samples.
  */
 void hmm_restore(hmm_t *hmm, void *snapshot);
 void hmm_reset(hmm_t *hmm, void *snapshot);
@@ -120,6 +122,26 @@ void hmm_run_fwd_bwd(hmm_t *hmm, int nsites, double *eprob, uint32_t *sites);
  */
 double *hmm_get_fwd_bwd_prob(hmm_t *hmm);
 
+/**
+ *   hmm_run_fwd_bwd_ckpt() - memory-bounded forward-backward algorithm
+ *   @nsites:   number of sites
+ *   @eprob:    emission probabilities for each site and state (nsites x nstates)
+ *   @sites:    list of positions
+ *   @callback: called for each site, in the reverse order of the sites, with the
+ *              values hmm_get_fwd_bwd_prob() would give at isite*nstates after
+ *              hmm_run_fwd_bwd(). The array is valid only for the duration of the call
+ *
+ *   The same as hmm_run_fwd_bwd() but instead of keeping the forward probabilities
+ *   of all sites, only every sqrt(nsites)-th is kept and the rest is recalculated
+ *   in the backward pass. The memory is O(sqrt(nsites)*nstates) rather than
+ *   O(nsites*nstates) for the cost of running the forward algorithm twice. The
+ *   results are identical and hmm_get_fwd_bwd_prob() is not set. When the callback
+ *   is called for isite, the emission probabilities of isite and all later sites
+ *   are no longer used and can be overwritten.
+ */
+typedef void (*hmm_fwd_bwd_f) (hmm_t *hmm, int isite, double *fwd_bwd, void *data);
+void hmm_run_fwd_bwd_ckpt(hmm_t *hmm, int nsites, double *eprob, uint32_t *sites, hmm_fwd_bwd_f callback, void *data);
+
 /**
  *   hmm_run_baum_welch() - run one iteration of Baum-Welch algorithm
  *   @nsites:   number of sites 
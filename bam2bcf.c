@@ -62,6 +62,8 @@ bcf_callaux_t *bcf_call_init(double theta, int min_baseQ)
     bca->alt_bq  = (int*) malloc(bca->nqual*sizeof(int));
     bca->fwd_mqs = (int*) malloc(bca->nqual*sizeof(int));
     bca->rev_mqs = (int*) malloc(bca->nqual*sizeof(int));
+    int i;
+    for (i=0; i<60; i++) bca->qual_bin[i] = i/60. * bca->nqual;
     return bca;
 }
 
@@ -73,44 +75,17 @@ void bcf_call_destroy(bcf_callaux_t *bca)
     free(bca->ref_mq); free(bca->alt_mq); free(bca->ref_bq); free(bca->alt_bq);
     free(bca->fwd_mqs); free(bca->rev_mqs);
     bca->nqual = 0;
+    free(bca->rd_bq); free(bca->rd_mq); free(bca->rd_dist); free(bca->rd_epos); free(bca->rd_flag);
     free(bca->bases); free(bca->inscns); free(bca);
 }
 
-// position in the sequence with respect to the aligned part of the read
-static int get_position(const bam_pileup1_t *p, int *len)
+// position in the sequence with respect to the aligned part of the read, from the
+// lengths cached by the pileup constructor
+static inline int get_position(const bam_pileup1_t *p, int *len)
 {
-    int icig, n_tot_bases = 0, iread = 0, edist = p->qpos + 1;
-    for (icig=0; icig<p->b->core.n_cigar; icig++)
-    {
-        int cig  = bam_get_cigar(p->b)[icig] & BAM_CIGAR_MASK;
-        int ncig = bam_get_cigar(p->b)[icig] >> BAM_CIGAR_SHIFT;
-        if ( cig==BAM_CMATCH || cig==BAM_CEQUAL || cig==BAM_CDIFF )
-        {
-            n_tot_bases += ncig;
-            iread += ncig;
-            continue;
-        }
-        if ( cig==BAM_CINS )
-        {
-            n_tot_bases += ncig;
-            iread += ncig;
-            continue;
-        }
-        if ( cig==BAM_CSOFT_CLIP )
-        {
-            iread += ncig;
-            if ( iread<=p->qpos ) edist -= ncig;
-            continue;
-        }
-        if ( cig==BAM_CDEL ) continue;
-        if ( cig==BAM_CHARD_CLIP ) continue;
-        if ( cig==BAM_CPAD ) continue;
-        if ( cig==BAM_CREF_SKIP ) continue;
-        fprintf(stderr,"todo: cigar %d\n", cig);
-        assert(0);
-    }
-    *len = n_tot_bases;
-    return edist;
+    const plp_read_t *rd = PLP_READ(p);
+    *len = rd->alen;
+    return p->qpos + 1 - rd->lsclip;
 }
 
 void bcf_callaux_clean(bcf_callaux_t *bca, bcf_call_t *call)
@@ -164,7 +139,12 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
     if (bca->max_bases < _n) {
         bca->max_bases = _n;
         kroundup32(bca->max_bases);
-        bca->bases = (uint16_t*)realloc(bca->bases, 2 * bca->max_bases);
+        bca->bases   = (uint16_t*)realloc(bca->bases, 2 * bca->max_bases);
+        bca->rd_bq   = (int*)realloc(bca->rd_bq, sizeof(int) * bca->max_bases);
+        bca->rd_mq   = (int*)realloc(bca->rd_mq, sizeof(int) * bca->max_bases);
+        bca->rd_dist = (int*)realloc(bca->rd_dist, sizeof(int) * bca->max_bases);
+        bca->rd_epos = (int*)realloc(bca->rd_epos, sizeof(int) * bca->max_bases);
+        bca->rd_flag = (uint8_t*)realloc(bca->rd_flag, bca->max_bases);
     }
     // fill the bases array
     for (i = n = 0; i < _n; ++i) {
@@ -200,45 +180,69 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
         if (q > mapQ) q = mapQ;
         if (q > 63) q = 63;
         if (q < 4) q = 4;       // MQ=0 reads count as BQ=4
-        bca->bases[n++] = q<<5 | (int)bam_is_rev(p->b)<<4 | b;
-        if ( bca->fmt_flag&(B2B_INFO_SCR|B2B_FMT_SCR) && PLP_HAS_SOFT_CLIP(p->cd.i) ) r->SCR++;
-        // collect annotations
+        int is_rev = bam_is_rev(p->b);
+        bca->bases[n] = q<<5 | is_rev<<4 | b;
+        if ( bca->fmt_flag&(B2B_INFO_SCR|B2B_FMT_SCR) && PLP_HAS_SOFT_CLIP(p) ) r->SCR++;
         if (b < 4)
         {
             r->qsum[b] += q;
             if ( r->ADF )
             {
-                if ( bam_is_rev(p->b) )
+                if ( is_rev )
                     r->ADR[b]++;
                 else
                     r->ADF[b]++;
             }
         }
-        ++r->anno[0<<2|is_diff<<1|bam_is_rev(p->b)];
         min_dist = p->b->core.l_qseq - 1 - p->qpos;
         if (min_dist > p->qpos) min_dist = p->qpos;
         if (min_dist > CAP_DIST) min_dist = CAP_DIST;
-        r->anno[1<<2|is_diff<<1|0] += baseQ;
-        r->anno[1<<2|is_diff<<1|1] += baseQ * baseQ;
-        r->anno[2<<2|is_diff<<1|0] += mapQ;
-        r->anno[2<<2|is_diff<<1|1] += mapQ * mapQ;
-        r->anno[3<<2|is_diff<<1|0] += min_dist;
-        r->anno[3<<2|is_diff<<1|1] += min_dist * min_dist;
-
-        // collect for bias tests
-        if ( baseQ > 59 ) baseQ = 59;
-        if ( mapQ > 59 ) mapQ = 59;
         int len, epos = 0;
         if ( bca->fmt_flag & (B2B_INFO_RPB|B2B_INFO_VDB) )
         {
             int pos = get_position(p, &len);
             epos = (double)pos/(len+1) * bca->npos;
         }
-        int ibq  = baseQ/60. * bca->nqual;
-        int imq  = mapQ/60. * bca->nqual;
-        if ( bam_is_rev(p->b) ) bca->rev_mqs[imq]++;
+        int is_ref = bam_seqi(bam_get_seq(p->b),p->qpos) == ref_base ? 1 : 0;
+        bca->rd_bq[n]   = baseQ;
+        bca->rd_mq[n]   = mapQ;
+        bca->rd_dist[n] = min_dist;
+        bca->rd_epos[n] = epos;
+        bca->rd_flag[n] = is_ref<<2 | is_diff<<1 | is_rev;
+        n++;
+    }
+    r->ori_depth = ori_depth;
+
+    // collect annotations: the sums over all reads and over the non-reference reads
+    // are plain reductions, the reference sums are their difference
+    int64_t nrev = 0, ndiff = 0, ndiff_rev = 0, bq[2] = {0,0}, bq2[2] = {0,0}, mq[2] = {0,0}, mq2[2] = {0,0}, dist[2] = {0,0}, dist2[2] = {0,0};
+    for (i = 0; i < n; ++i) {
+        int is_rev = bca->rd_flag[i] & 1, is_diff = bca->rd_flag[i]>>1 & 1;
+        int x = bca->rd_bq[i], y = bca->rd_mq[i], z = bca->rd_dist[i];
+        nrev += is_rev; ndiff += is_diff; ndiff_rev += is_diff & is_rev;
+        bq[0] += x; bq2[0] += x*x; bq[1] += is_diff*x; bq2[1] += is_diff*x*x;
+        mq[0] += y; mq2[0] += y*y; mq[1] += is_diff*y; mq2[1] += is_diff*y*y;
+        dist[0] += z; dist2[0] += z*z; dist[1] += is_diff*z; dist2[1] += is_diff*z*z;
+    }
+    r->anno[0] = n - ndiff - (nrev - ndiff_rev);
+    r->anno[1] = nrev - ndiff_rev;
+    r->anno[2] = ndiff - ndiff_rev;
+    r->anno[3] = ndiff_rev;
+    r->anno[4]  = bq[0] - bq[1];     r->anno[5]  = bq2[0] - bq2[1];
+    r->anno[6]  = bq[1];             r->anno[7]  = bq2[1];
+    r->anno[8]  = mq[0] - mq[1];     r->anno[9]  = mq2[0] - mq2[1];
+    r->anno[10] = mq[1];             r->anno[11] = mq2[1];
+    r->anno[12] = dist[0] - dist[1]; r->anno[13] = dist2[0] - dist2[1];
+    r->anno[14] = dist[1];           r->anno[15] = dist2[1];
+
+    // collect for bias tests
+    for (i = 0; i < n; ++i) {
+        int baseQ = bca->rd_bq[i] > 59 ? 59 : bca->rd_bq[i];
+        int mapQ  = bca->rd_mq[i] > 59 ? 59 : bca->rd_mq[i];
+        int ibq = bca->qual_bin[baseQ], imq = bca->qual_bin[mapQ], epos = bca->rd_epos[i];
+        if ( bca->rd_flag[i] & 1 ) bca->rev_mqs[imq]++;
         else bca->fwd_mqs[imq]++;
-        if ( bam_seqi(bam_get_seq(p->b),p->qpos) == ref_base )
+        if ( bca->rd_flag[i] & 4 )
         {
             bca->ref_pos[epos]++;
             bca->ref_bq[ibq]++;
@@ -251,7 +255,6 @@ int bcf_call_glfgen(int _n, const bam_pileup1_t *pl, int ref_base, bcf_callaux_t
             bca->alt_mq[imq]++;
         }
     }
-    r->ori_depth = ori_depth;
     // glfgen
     errmod_cal(bca->e, n, 5, bca->bases, r->p); // calculate PL of each genotype
     return n;
@@ -62,8 +62,24 @@ DEALINGS IN THE SOFTWARE.  */
 
 #define B2B_MAX_ALLELES 5
 
-#define PLP_HAS_SOFT_CLIP(i) ((i)&1)
-#define PLP_SAMPLE_ID(i)     ((i)>>1)
+// Per-read data cached when the read enters the pileup, kept in bam_pileup1_t.cd.p
+typedef struct {
+    int32_t beg, end, qbeg;     // reference and query coordinates of a reference-consuming CIGAR operation
+    int is_match;               // M, =, X; otherwise D or N
+} plp_cigop_t;
+
+typedef struct {
+    int sample_id, has_soft_clip, has_ref_skip;
+    int qlen;                   // query length implied by CIGAR
+    int alen, lsclip;           // the aligned (M/=/X/I) query length and the leading soft clip, for RPB and VDB
+    int nops, mops;
+    plp_cigop_t *ops;           // reference-consuming operations, sorted by coordinate
+    int32_t end, last_qend;     // reference end of the alignment; query end of the last M/=/X
+} plp_read_t;
+
+#define PLP_READ(plp)        ((plp_read_t*)(plp)->cd.p)
+#define PLP_HAS_SOFT_CLIP(plp) (PLP_READ(plp)->has_soft_clip)
+#define PLP_SAMPLE_ID(plp)   (PLP_READ(plp)->sample_id)
 
 typedef struct __bcf_callaux_t {
     int fmt_flag;
@@ -81,6 +97,9 @@ typedef struct __bcf_callaux_t {
     int read_len;
     char *inscns;
     uint16_t *bases;        // 5bit: unused, 6:quality, 1:is_rev, 4:2-bit base or indel allele (index to bcf_callaux_t.indel_types)
+    int *rd_bq, *rd_mq, *rd_dist, *rd_epos; // per-read values of bcf_call_glfgen(), kept as separate arrays so
+    uint8_t *rd_flag;                       //  that the annotation sums vectorize; rd_flag: is_ref<<2|is_diff<<1|is_rev
+    int qual_bin[60];       // the bias tests bin of a base or mapping quality
     errmod_t *e;
     void *rghash;
 } bcf_callaux_t;
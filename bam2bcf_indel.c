@@ -33,36 +33,45 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/ksort.h>
 KSORT_INIT_GENERIC(uint32_t)
+KHASH_MAP_INIT_INT64(realn, int)
 
 #define MINUS_CONST 0x10000000
 #define INDEL_WINDOW_SIZE 50
 
-static int tpos2qpos(const bam1_core_t *c, const uint32_t *cigar, int32_t tpos, int is_left, int32_t *_tpos)
+// The input to the realignment of a read, it does not depend on the indel type
+typedef struct
 {
-    int k, x = c->pos, y = 0, last_y = 0;
-    *_tpos = c->pos;
-    for (k = 0; k < c->n_cigar; ++k) {
-        int op = cigar[k] & BAM_CIGAR_MASK;
-        int l = cigar[k] >> BAM_CIGAR_SHIFT;
-        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
-            if (c->pos > tpos) return y;
-            if (x + l > tpos) {
-                *_tpos = tpos;
-                return y + (tpos - x);
-            }
-            x += l; y += l;
-            last_y = y;
-        } else if (op == BAM_CINS || op == BAM_CSOFT_CLIP) y += l;
-        else if (op == BAM_CDEL || op == BAM_CREF_SKIP) {
-            if (x + l > tpos) {
-                *_tpos = is_left? x : x + l;
-                return y;
-            }
-            x += l;
+    int qbeg, qend, tbeg, tend;
+    int dup;                // -2: not realigned; >=0: an earlier read of the sample with identical input
+    uint8_t *query, *qq;    // 0-4 coded sequence and capped qualities of [qbeg,qend)
+}
+realn_read_t;
+
+// Binary search in the reference-consuming CIGAR operations cached by the pileup
+// constructor, the first operation which ends after tpos determines the query position
+static int tpos2qpos(const plp_read_t *rd, int32_t pos, int32_t tpos, int is_left, int32_t *_tpos)
+{
+    int lo = 0, hi = rd->nops;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (rd->ops[mid].end > tpos) hi = mid;
+        else lo = mid + 1;
+    }
+    if (lo == rd->nops) {
+        *_tpos = rd->end;
+        return rd->last_qend;
+    }
+    const plp_cigop_t *op = &rd->ops[lo];
+    if (op->is_match) {
+        if (pos > tpos) {
+            *_tpos = pos;
+            return op->qbeg;
         }
+        *_tpos = tpos;
+        return op->qbeg + (tpos - op->beg);
     }
-    *_tpos = x;
-    return last_y;
+    *_tpos = is_left? op->beg : op->end;
+    return op->qbeg;
 }
 // FIXME: check if the inserted sequence is consistent with the homopolymer run
 // l is the relative gap length and l_run is the length of the homopolymer on the reference
@@ -100,7 +109,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
 {
     int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
     int N, K, l_run, ref_type, n_alt;
-    char *inscns = 0, *ref2, *query, **ref_sample;
+    char *inscns = 0, *ref2, **ref_sample;
     if (ref == 0 || bca == 0) return -1;
 
     // determine if there is a gap
@@ -127,7 +136,7 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                     ++na;
                     aux[m++] = MINUS_CONST + p->indel;
                 }
-                j = bam_cigar2qlen(p->b->core.n_cigar, bam_get_cigar(p->b));
+                j = PLP_READ(p)->qlen;
                 if (j > max_rd_len) max_rd_len = j;
             }
             double frac = (double)na/nt;
@@ -281,10 +290,65 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         }
         free(inscns_aux);
     }
+    // Prepare the query sequences and qualities once for all indel types. Reads of the same
+    // sample with the same sequence, qualities and window would realign to the same scores,
+    // only the first of them is realigned and the scores are copied to the rest.
+    realn_read_t *rd = (realn_read_t*) calloc(N, sizeof(realn_read_t));
+    uint8_t *rd_buf;
+    size_t buf_len = 0;
+    for (s = K = 0; s < n; ++s) {
+        for (i = 0; i < n_plp[s]; ++i, ++K) {
+            bam1_t *b = plp[s][i].b;
+            const plp_read_t *prd = PLP_READ(&plp[s][i]);
+            rd[K].dup = -2;
+            if (b->core.flag&4) continue; // unmapped reads
+            if (prd->has_ref_skip) continue;
+            // FIXME: the following skips soft clips, but using them may be more sensitive.
+            // determine the start and end of sequences for alignment
+            rd[K].qbeg = tpos2qpos(prd, b->core.pos, left,  0, &rd[K].tbeg);
+            rd[K].qend = tpos2qpos(prd, b->core.pos, right, 1, &rd[K].tend);
+            rd[K].dup  = -1;
+            if (rd[K].qend > rd[K].qbeg) buf_len += rd[K].qend - rd[K].qbeg;
+        }
+    }
+    rd_buf = (uint8_t*) malloc(2*buf_len + 1);
+    buf_len = 0;
+    khash_t(realn) *rd_hash = kh_init(realn);
+    for (s = K = 0; s < n; ++s) {
+        kh_clear(realn, rd_hash);
+        for (i = 0; i < n_plp[s]; ++i, ++K) {
+            realn_read_t *r = &rd[K];
+            if (r->dup == -2) continue;
+            bam1_t *b = plp[s][i].b;
+            const uint8_t *seq = bam_get_seq(b), *qual = bam_get_qual(b), *bq;
+            int l, qlen = r->qend > r->qbeg ? r->qend - r->qbeg : 0;
+            r->query = rd_buf + buf_len;
+            r->qq = r->query + qlen;
+            buf_len += 2*qlen;
+            bq = (uint8_t*)bam_aux_get(b, "ZQ");
+            if (bq) ++bq; // skip type
+            uint64_t hash = 14695981039346656037ULL;    // FNV-1a over the window and the query
+            hash = (hash ^ (uint32_t)r->tbeg) * 1099511628211ULL;
+            hash = (hash ^ (uint32_t)r->tend) * 1099511628211ULL;
+            for (l = 0; l < qlen; ++l) {
+                int q = bq? qual[r->qbeg+l] + (bq[r->qbeg+l] - 64) : qual[r->qbeg+l];
+                r->query[l] = seq_nt16_int[bam_seqi(seq, r->qbeg+l)];
+                r->qq[l] = q > 30 ? 30 : (q < 7 ? 7 : q);
+                hash = (hash ^ (r->query[l]<<5 | r->qq[l])) * 1099511628211ULL;
+            }
+            int ret;
+            khint_t kh = kh_put(realn, rd_hash, hash, &ret);
+            if (ret) { kh_val(rd_hash, kh) = K; continue; }
+            realn_read_t *r0 = &rd[kh_val(rd_hash, kh)];
+            if ( r0->tbeg==r->tbeg && r0->tend==r->tend && r0->qend-r0->qbeg==r->qend-r->qbeg
+                    && !memcmp(r0->query, r->query, 2*qlen) ) r->dup = kh_val(rd_hash, kh);
+        }
+    }
+    kh_destroy(realn, rd_hash);
+
     // compute the likelihood given each type of indel for each read
     max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
     ref2  = (char*) calloc(max_ref2, 1);
-    query = (char*) calloc(right - left + max_rd_len + max_ins + 2, 1);
     score1 = (int*) calloc(N * n_types, sizeof(int));
     score2 = (int*) calloc(N * n_types, sizeof(int));
     bca->indelreg = 0;
@@ -309,66 +373,45 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             for (; j < right && ref[j]; ++j)
                 ref2[k++] = seq_nt16_int[(int)ref_sample[s][j-left]];
             for (; k < max_ref2; ++k) ref2[k] = 4;
-            if (j < right) right = j;
-            // align each read to ref2
+            // align each read to ref2; note that right cannot change here, ref[] was checked above
             for (i = 0; i < n_plp[s]; ++i, ++K) {
-                bam_pileup1_t *p = plp[s] + i;
-                int qbeg, qend, tbeg, tend, sc, kk;
-                uint8_t *seq = bam_get_seq(p->b);
-                uint32_t *cigar = bam_get_cigar(p->b);
-                if (p->b->core.flag&4) continue; // unmapped reads
-                // FIXME: the following loop should be better moved outside; nonetheless, realignment should be much slower anyway.
-                for (kk = 0; kk < p->b->core.n_cigar; ++kk)
-                    if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
-                if (kk < p->b->core.n_cigar) continue;
-                // FIXME: the following skips soft clips, but using them may be more sensitive.
-                // determine the start and end of sequences for alignment
-                qbeg = tpos2qpos(&p->b->core, bam_get_cigar(p->b), left,  0, &tbeg);
-                qend = tpos2qpos(&p->b->core, bam_get_cigar(p->b), right, 1, &tend);
+                realn_read_t *r = &rd[K];
+                int tbeg = r->tbeg, tend = r->tend, qlen = r->qend - r->qbeg, sc;
+                if (r->dup == -2) continue; // unmapped or spliced reads
+                if (r->dup >= 0) {
+                    score1[K*n_types + t] = score1[r->dup*n_types + t];
+                    score2[K*n_types + t] = score2[r->dup*n_types + t];
+                    continue;
+                }
                 if (types[t] < 0) {
                     int l = -types[t];
                     tbeg = tbeg - l > left?  tbeg - l : left;
                 }
-                // write the query sequence
-                for (l = qbeg; l < qend; ++l)
-                    query[l - qbeg] = seq_nt16_int[bam_seqi(seq, l)];
-                { // do realignment; this is the bottleneck
-                    const uint8_t *qual = bam_get_qual(p->b), *bq;
-                    uint8_t *qq;
-                    qq = (uint8_t*) calloc(qend - qbeg, 1);
-                    bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
-                    if (bq) ++bq; // skip type
-                    for (l = qbeg; l < qend; ++l) {
-                        qq[l - qbeg] = bq? qual[l] + (bq[l] - 64) : qual[l];
-                        if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
-                        if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
-                    }
+                // do realignment; this is the bottleneck
+                sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
+                                    r->query, qlen, r->qq, &apf1, 0, 0);
+                l = (int)(100. * sc / qlen + .499); // used for adjusting indelQ below
+                if (l > 255) l = 255;
+                score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
+                if (sc > 5) {
                     sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                        (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
-                    l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
+                                        r->query, qlen, r->qq, &apf2, 0, 0);
+                    l = (int)(100. * sc / qlen + .499);
                     if (l > 255) l = 255;
-                    score1[K*n_types + t] = score2[K*n_types + t] = sc<<8 | l;
-                    if (sc > 5) {
-                        sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
-                                            (uint8_t*)query, qend - qbeg, qq, &apf2, 0, 0);
-                        l = (int)(100. * sc / (qend - qbeg) + .499);
-                        if (l > 255) l = 255;
-                        score2[K*n_types + t] = sc<<8 | l;
-                    }
-                    free(qq);
+                    score2[K*n_types + t] = sc<<8 | l;
                 }
 #if 0
                 for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
                     fputc("ACGTN"[(int)ref2[tbeg-left+l]], stderr);
                 fputc('\n', stderr);
-                for (l = 0; l < qend - qbeg; ++l) fputc("ACGTN"[(int)query[l]], stderr);
+                for (l = 0; l < qlen; ++l) fputc("ACGTN"[(int)r->query[l]], stderr);
                 fputc('\n', stderr);
-                fprintf(stderr, "pos=%d type=%d read=%d:%d name=%s qbeg=%d tbeg=%d score=%d\n", pos, types[t], s, i, bam_get_qname(p->b), qbeg, tbeg, sc);
+                fprintf(stderr, "pos=%d type=%d read=%d:%d name=%s qbeg=%d tbeg=%d score=%d\n", pos, types[t], s, i, bam_get_qname(plp[s][i].b), r->qbeg, tbeg, sc);
 #endif
             }
         }
     }
-    free(ref2); free(query);
+    free(ref2); free(rd); free(rd_buf);
     { // compute indelQ
         int sc_a[16], sumq_a[16];
         int tmp, *sc = sc_a, *sumq = sumq_a;
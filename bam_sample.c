@@ -39,6 +39,7 @@ typedef struct
     char *fname;
     void *rg2idx;       // hash: read group name to BCF output sample index. Maintained by bsmpl_add_readgroup
     int default_idx;    // default BCF output sample index, set only when all readgroups are treated as one sample
+    int null_idx;       // BCF output sample index of reads with no or unknown read group, the "?" entry of rg2idx
 }
 file_t;
 
@@ -110,6 +111,7 @@ static void bsmpl_add_readgroup(bam_smpl_t *bsmpl, file_t *file, const char *rg_
     if ( !file->rg2idx ) file->rg2idx = khash_str2int_init();
     if ( khash_str2int_has_key(file->rg2idx,rg_id) ) return;    // duplicate @RG:ID
     khash_str2int_set(file->rg2idx, strdup(rg_id), ismpl);
+    if ( !strcmp("?",rg_id) ) file->null_idx = ismpl;
 }
 static int bsmpl_keep_readgroup(bam_smpl_t *bsmpl, file_t *file, const char *rg_id, const char **smpl_name)
 {
@@ -156,6 +158,7 @@ int bam_smpl_add_bam(bam_smpl_t *bsmpl, char *bam_hdr, const char *fname)
     memset(file,0,sizeof(file_t));
     file->fname  = strdup(fname);
     file->default_idx = -1;
+    file->null_idx = -1;
 
     if ( bsmpl->ignore_rg || !bam_hdr )
     {
@@ -265,13 +268,13 @@ int bam_smpl_get_sample_id(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec)
     file_t *file = &bsmpl->files[bam_id];
     if ( file->default_idx >= 0 ) return file->default_idx;
 
+    // reads with no or unknown read group go to the "?" sample, resolved in bsmpl_add_readgroup
     char *aux_rg = (char*) bam_aux_get(bam_rec, "RG");
-    aux_rg = aux_rg ? aux_rg+1 : "?";
+    if ( !aux_rg ) return file->null_idx;
 
     int rg_id;
-    if ( khash_str2int_get(file->rg2idx, aux_rg, &rg_id)==0 ) return rg_id;
-    if ( khash_str2int_get(file->rg2idx, "?", &rg_id)==0 ) return rg_id;
-    return -1;
+    if ( khash_str2int_get(file->rg2idx, aux_rg+1, &rg_id)==0 ) return rg_id;
+    return file->null_idx;
 }
 
 int bam_smpl_add_samples(bam_smpl_t *bsmpl, char *list, int is_file)
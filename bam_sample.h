@@ -43,6 +43,10 @@ void bam_smpl_ignore_readgroups(bam_smpl_t* bsmpl);
 int bam_smpl_add_bam(bam_smpl_t *bsmpl, char *bam_hdr, const char *fname);
 
 const char **bam_smpl_get_samples(bam_smpl_t *bsmpl, int *nsmpl);
+
+// Returns the BCF output sample index of the read or -1 if the read should be
+// skipped. The lookup does not modify bsmpl and can be called from multiple
+// threads once all bams were added.
 int bam_smpl_get_sample_id(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec);
 
 void bam_smpl_destroy(bam_smpl_t *bsmpl);
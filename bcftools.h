@@ -26,8 +26,11 @@ THE SOFTWARE.  */
 #define BCFTOOLS_H
 
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <htslib/hts_defs.h>
 #include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
 #include <math.h>
 
 #define FT_TAB_TEXT 0       // custom tab-delimited text file
@@ -40,6 +43,9 @@ THE SOFTWARE.  */
 
 char *bcftools_version(void);
 
+// Version of the optional batch interface of plugins, see process_batch() in vcfplugin.c
+#define BCFTOOLS_PLUGIN_BATCH_API 1
+
 /// Report an error and exit -1
 void error(const char *format, ...) HTS_NORETURN HTS_FORMAT(HTS_PRINTF_FMT, 1, 2);
 
@@ -53,6 +59,93 @@ const char *hts_bcf_wmode(int file_type);
 
 void *smalloc(size_t size);     // safe malloc
 
+/// Returns 1 if the file name is a URL such as http://, s3:// or gs://
+int is_url(const char *fname);
+
+/*
+ *  Read-ahead of remote inputs. Reading a URL synchronously stalls on the
+ *  round trip of each request, and with many readers on each reader in turn.
+ *  htslib reads BGZF files ahead in a background thread of each file when
+ *  the file has a thread pool, the blocks are decompressed in the pool. This
+ *  sets up the pool of the synced reader for that, it must be called after
+ *  bcf_sr_set_threads() and before the readers are added:
+ *
+ *      if ( bcf_sr_set_threads(sr, n_threads)<0 ) error(..);
+ *      if ( sr_set_readahead(sr, fnames, nfnames, nblocks)<0 ) error(..);
+ *      for (i=0; i<nfnames; i++) bcf_sr_add_reader(sr, fnames[i]);
+ *
+ *  When no threads were requested and some of the files are URLs, a pool of
+ *  one thread per remote file, at most READAHEAD_MAX_THREADS, is created.
+ *  nblocks is the number of decompressed blocks kept ready per reader, 0
+ *  disables the read-ahead. Nothing is changed when all files are local.
+ *  Returns 0 on success, -1 on error.
+ */
+#define READAHEAD_NBLOCKS     16
+#define READAHEAD_MAX_THREADS 8
+int sr_set_readahead(bcf_srs_t *sr, char **fnames, int nfnames, int nblocks);
+
+/*
+ *  Lightweight per-stage profiling, enabled with --profile[=json]. Commands
+ *  keep a profile_t, zeroed (disabled) by default, and mark the stage
+ *  boundaries with profile_lap(), which attributes the time elapsed since
+ *  the previous lap to the given stage:
+ *
+ *      profile_mark(prof);
+ *      while ( bcf_sr_next_line(sr) )
+ *      {
+ *          profile_lap(prof, PROF_READ);
+ *          ...
+ *          profile_lap(prof, PROF_PROCESS);
+ *      }
+ *      profile_lap(prof, PROF_READ);
+ *
+ *  When disabled, the cost is a single branch per call. Decompression and
+ *  parsing happen both inside htslib and are reported together as "read".
+ *  Time not attributed to any stage, such as the initialization or waiting
+ *  for worker threads, is reported as "other".
+ */
+#define PROF_READ    0  // reading, decompression, parsing, unpacking
+#define PROF_FILTER  1  // -i/-e expressions
+#define PROF_PROCESS 2  // the command's own logic
+#define PROF_WRITE   3  // formatting, encoding, compression
+#define PROF_NSTAGE  4
+
+#define PROF_FMT_TEXT 1
+#define PROF_FMT_JSON 2
+
+typedef struct
+{
+    int format;             // 0 if disabled, otherwise PROF_FMT_TEXT or PROF_FMT_JSON
+    const char *cmd;
+    uint64_t start, last, nsec[PROF_NSTAGE], ncalls[PROF_NSTAGE];
+    uint64_t nrec_in, nrec_out, nsmpl;
+}
+profile_t;
+
+uint64_t profile_clock(void);   // monotonic clock, nanoseconds
+
+/// Enable profiling, the format is NULL or "text" for a table, or "json". Returns -1 on unknown format
+int profile_init(profile_t *prof, const char *cmd, const char *format);
+
+/// Print the collected times and counters to fp, does nothing if disabled
+void profile_report(profile_t *prof, FILE *fp);
+
+/// Start timing from now, the time since the last lap is left unattributed
+static inline void profile_mark(profile_t *prof)
+{
+    if ( prof->format ) prof->last = profile_clock();
+}
+
+/// Attribute the time since the last lap or mark to the stage
+static inline void profile_lap(profile_t *prof, int stage)
+{
+    if ( !prof->format ) return;
+    uint64_t now = profile_clock();
+    prof->nsec[stage] += now - prof->last;
+    prof->ncalls[stage]++;
+    prof->last = now;
+}
+
 static inline char gt2iupac(char a, char b)
 {
     static const char iupac[4][4] = { {'A','M','R','W'},{'M','C','S','Y'},{'R','S','G','K'},{'W','Y','K','T'} };
@@ -101,4 +194,16 @@ static inline double phred_score(double prob)
     return prob>99 ? 99 : prob;
 }
 
+static inline int popcount64(uint64_t x)
+{
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (x * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
 #endif
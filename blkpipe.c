@@ -0,0 +1,166 @@
+/*  blkpipe.c -- ordered processing of jobs and blocks of records in threads
+
+   Copyright (C) 2020 Genome Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+#include <htslib/thread_pool.h>
+#include "bcftools.h"
+#include "blkpipe.h"
+
+struct _blkpipe_t
+{
+    hts_tpool *pool;
+    hts_tpool_process *queue;   // NULL without the pool
+    blkpipe_process_f process;
+    blkpipe_output_f output;
+    void *usr;
+    int njobs, nfree;
+    void **free_jobs;
+    blkpipe_blk_t *blks, *blk;  // the record blocks and the block being filled, see blkpipe_blocks_init()
+};
+
+blkpipe_t *blkpipe_init(hts_tpool *pool, int njobs, void **jobs, blkpipe_process_f process, blkpipe_output_f output, void *usr)
+{
+    blkpipe_t *pipe = (blkpipe_t*) calloc(1,sizeof(blkpipe_t));
+    pipe->pool    = pool;
+    pipe->process = process;
+    pipe->output  = output;
+    pipe->usr     = usr;
+    pipe->njobs   = pipe->nfree = njobs;
+    pipe->free_jobs = (void**) malloc(sizeof(void*)*njobs);
+    int i;
+    for (i=0; i<njobs; i++) pipe->free_jobs[i] = jobs[i];
+
+    // the queue is large enough to hold all jobs, dispatching never blocks
+    if ( pool ) pipe->queue = hts_tpool_process_init(pool, njobs, 0);
+    return pipe;
+}
+
+// Output the oldest job in flight, returns 0 if not ready and wait is not set
+static int next_result(blkpipe_t *pipe, int wait)
+{
+    hts_tpool_result *res = wait ? hts_tpool_next_result_wait(pipe->queue) : hts_tpool_next_result(pipe->queue);
+    if ( !res )
+    {
+        if ( wait ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        return 0;
+    }
+    void *job = hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    pipe->output(pipe->usr, job);
+    pipe->free_jobs[pipe->nfree++] = job;
+    return 1;
+}
+
+void *blkpipe_get(blkpipe_t *pipe)
+{
+    // all jobs are in flight, wait for the oldest one
+    if ( !pipe->nfree ) next_result(pipe, 1);
+    return pipe->free_jobs[--pipe->nfree];
+}
+
+void blkpipe_release(blkpipe_t *pipe, void *job)
+{
+    pipe->free_jobs[pipe->nfree++] = job;
+}
+
+void blkpipe_dispatch(blkpipe_t *pipe, void *job)
+{
+    if ( !pipe->queue )
+    {
+        pipe->output(pipe->usr, pipe->process(job));
+        pipe->free_jobs[pipe->nfree++] = job;
+        return;
+    }
+    if ( hts_tpool_dispatch(pipe->pool, pipe->queue, pipe->process, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+
+    // output whatever is ready, in the order of dispatch
+    while ( pipe->nfree<pipe->njobs && next_result(pipe, 0) ) ;
+}
+
+void blkpipe_flush(blkpipe_t *pipe)
+{
+    if ( pipe->blk )
+    {
+        if ( pipe->blk->nrec ) blkpipe_dispatch(pipe, pipe->blk);
+        else blkpipe_release(pipe, pipe->blk);
+        pipe->blk = NULL;
+    }
+    while ( pipe->nfree<pipe->njobs ) next_result(pipe, 1);
+}
+
+void blkpipe_destroy(blkpipe_t *pipe)
+{
+    if ( !pipe ) return;
+    if ( pipe->queue ) hts_tpool_process_destroy(pipe->queue);
+    if ( pipe->blks )
+    {
+        int i, j;
+        for (i=0; i<pipe->njobs; i++)
+            for (j=0; j<BLKPIPE_NREC; j++)
+                if ( pipe->blks[i].recs[j] ) bcf_destroy1(pipe->blks[i].recs[j]);
+        free(pipe->blks);
+    }
+    free(pipe->free_jobs);
+    free(pipe);
+}
+
+blkpipe_t *blkpipe_blocks_init(hts_tpool *pool, int nblk, void **data, blkpipe_process_f process, blkpipe_output_f output, void *usr)
+{
+    blkpipe_blk_t *blks = (blkpipe_blk_t*) calloc(nblk, sizeof(blkpipe_blk_t));
+    void **jobs = (void**) malloc(sizeof(void*)*nblk);
+    int i;
+    for (i=0; i<nblk; i++)
+    {
+        blks[i].data = data ? data[i] : NULL;
+        jobs[i] = &blks[i];
+    }
+    blkpipe_t *pipe = blkpipe_init(pool, nblk, jobs, process, output, usr);
+    pipe->blks = blks;
+    free(jobs);
+    return pipe;
+}
+
+blkpipe_blk_t *blkpipe_block(blkpipe_t *pipe)
+{
+    if ( !pipe->blk )
+    {
+        pipe->blk = (blkpipe_blk_t*) blkpipe_get(pipe);
+        pipe->blk->nrec   = 0;
+        pipe->blk->nbytes = 0;
+    }
+    return pipe->blk;
+}
+
+void blkpipe_push(blkpipe_t *pipe, bcf_srs_t *sr, int ireader)
+{
+    blkpipe_blk_t *blk = blkpipe_block(pipe);
+    if ( !blk->recs[blk->nrec] ) blk->recs[blk->nrec] = bcf_init1();
+    bcf_sr_swap_line(sr, ireader, blk->recs[blk->nrec]);
+    blk->nbytes += blk->recs[blk->nrec]->shared.l + blk->recs[blk->nrec]->indiv.l;
+    if ( ++blk->nrec < BLKPIPE_NREC && blk->nbytes < BLKPIPE_MEM ) return;
+    pipe->blk = NULL;
+    blkpipe_dispatch(pipe, blk);
+}
@@ -0,0 +1,111 @@
+/*  blkpipe.h -- ordered processing of jobs and blocks of records in threads
+
+   Copyright (C) 2020 Genome Research Ltd.
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    A fixed set of jobs is processed by worker threads and the results are
+    passed back to the main thread in the order the jobs were dispatched. The
+    queue is large enough to hold all jobs, so dispatching never blocks; when
+    all jobs are in flight, the oldest one is waited for. Without a thread
+    pool the jobs are processed and output immediately by the main thread.
+
+        blkpipe_t *pipe = blkpipe_init(pool, njobs, jobs, process, output, usr);
+        while ( ... )
+        {
+            job_t *job = blkpipe_get(pipe);     // a free job, outputs the oldest if needed
+            ...                                 // fill the job
+            blkpipe_dispatch(pipe, job);
+        }
+        blkpipe_flush(pipe);                    // wait for and output all jobs in flight
+        blkpipe_destroy(pipe);
+
+    The most common jobs are blocks of VCF records taken from a synced reader,
+    up to BLKPIPE_NREC records or BLKPIPE_MEM bytes per block:
+
+        blkpipe_t *pipe = blkpipe_blocks_init(pool, nblk, data, process, output, usr);
+        while ( bcf_sr_next_line(sr) )
+        {
+            blkpipe_blk_t *blk = blkpipe_block(pipe);   // the block being filled
+            ...                                         // per-record data of blk->recs[blk->nrec]
+            blkpipe_push(pipe, sr, 0);                  // dispatched once full
+        }
+        blkpipe_flush(pipe);
+        blkpipe_destroy(pipe);
+*/
+
+#ifndef __BLKPIPE_H__
+#define __BLKPIPE_H__
+
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+#include <htslib/thread_pool.h>
+
+#define BLKPIPE_NREC 1000       // maximum number of records in a block
+#define BLKPIPE_MEM  (8<<20)    // maximum size of the packed records in a block
+
+typedef struct _blkpipe_t blkpipe_t;
+
+typedef struct
+{
+    int nrec;
+    size_t nbytes;                  // size of the packed records in the block
+    bcf1_t *recs[BLKPIPE_NREC];     // allocated on demand
+    void *data;                     // the caller's data of the block
+}
+blkpipe_blk_t;
+
+typedef void *(*blkpipe_process_f)(void *job);              // called by a worker thread, returns the job
+typedef void (*blkpipe_output_f)(void *usr, void *job);     // called by the main thread, in the order of dispatch
+
+/*
+ *  blkpipe_init() - create the pipeline of jobs
+ *  @pool:      the thread pool or NULL to process the jobs serially
+ *  @njobs:     the number of jobs, typically twice the number of threads
+ *  @jobs:      the jobs, owned by the caller
+ */
+blkpipe_t *blkpipe_init(hts_tpool *pool, int njobs, void **jobs, blkpipe_process_f process, blkpipe_output_f output, void *usr);
+void *blkpipe_get(blkpipe_t *pipe);
+void blkpipe_dispatch(blkpipe_t *pipe, void *job);
+void blkpipe_release(blkpipe_t *pipe, void *job);   // return a job obtained by blkpipe_get() without dispatching it
+void blkpipe_flush(blkpipe_t *pipe);
+void blkpipe_destroy(blkpipe_t *pipe);
+
+/*
+ *  blkpipe_blocks_init() - create the pipeline of record blocks
+ *  @data:      the caller's data of each block or NULL, owned by the caller
+ *
+ *  The jobs passed to process() and output() are blkpipe_blk_t pointers.
+ *  The blocks and their records are freed by blkpipe_destroy().
+ */
+blkpipe_t *blkpipe_blocks_init(hts_tpool *pool, int nblk, void **data, blkpipe_process_f process, blkpipe_output_f output, void *usr);
+blkpipe_blk_t *blkpipe_block(blkpipe_t *pipe);
+
+/*
+ *  blkpipe_push() - move the current record of the reader to the block
+ *
+ *  The record is swapped with bcf_sr_swap_line(), the block is dispatched
+ *  when full. The last, incomplete, block is dispatched by blkpipe_flush().
+ */
+void blkpipe_push(blkpipe_t *pipe, bcf_srs_t *sr, int ireader);
+
+#endif
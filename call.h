@@ -80,6 +80,7 @@ typedef struct
     int npdg;
     int *als_map, nals_map; // mapping from full set of alleles to trimmed set of alleles (old -> new)
     int *pl_map, npl_map;   // same as above for PLs, but reverse (new -> old)
+    int map_als, map_nals;  // the allele set and count the two maps were built for, see init_allele_trimming_maps()
     char **als;             // array to hold the trimmed set of alleles to appear on output
     int nals;               // size of the als array
     family_t *fams;         // list of families and samples for trio calling
@@ -146,6 +147,14 @@ void mcall_destroy(call_t *call);
 void ccall_destroy(call_t *call);
 void qcall_destroy(call_t *call);
 
+/*
+ *  mcall_clone() - copy of an initialized -m caller for use in another thread.
+ *  The copy has its own scratch buffers and shares the read-only data with
+ *  the original, which must outlive it. Not available with CALL_CONSTR_ALLELES.
+ */
+call_t *mcall_clone(call_t *call);
+void mcall_destroy_clone(call_t *call);
+
 void call_init_pl2p(call_t *call);
 uint32_t *call_trio_prep(int is_x, int is_son);
 
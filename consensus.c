@@ -42,6 +42,7 @@
 #include "bcftools.h"
 #include "rbuf.h"
 #include "filter.h"
+#include "smpl_ilist.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -59,9 +60,11 @@
 typedef struct
 {
     int num;                // number of ungapped blocks in this chain
-    int *block_lengths;     // length of the ungapped blocks in this chain
-    int *ref_gaps;          // length of the gaps on the reference sequence between blocks
-    int *alt_gaps;          // length of the gaps on the alternative sequence between blocks
+    int block_length;       // length of the last ungapped block, can be still extended by back-to-back variants
+    int ref_gap;            // length of the gap on the reference sequence following the last block
+    int alt_gap;            // length of the gap on the alternative sequence following the last block
+    int score;              // sum of the lengths of all ungapped blocks so far
+    FILE *fp_blocks;        // the finished blocks, streamed to a temporary file until the chain header can be printed
     int ori_pos;
     int ref_last_block_ori; // start position on the reference sequence of the following ungapped block (0-based)
     int alt_last_block_ori; // start position on the alternative sequence of the following ungapped block (0-based)
@@ -71,71 +74,79 @@ chain_t;
 typedef struct
 {
     kstring_t fa_buf;   // buffered reference sequence
+    int fa_gap, fa_ngap; // gap buffer: fa_buf.s[fa_gap,fa_gap+fa_ngap) is unused, indels are applied at its start
     int fa_ori_pos;     // start position of the fa_buffer (wrt original sequence)
     int fa_frz_pos;     // protected position to avoid conflicting variants (last pos for SNPs/ins)
     int fa_mod_off;     // position difference of fa_frz_pos in the ori and modified sequence (ins positive)
     int fa_frz_mod;     // the fa_buf offset of the protected fa_frz_pos position, includes the modified sequence
-    int fa_end_pos;     // region's end position in the original sequence
-    int fa_length;      // region's length in the original sequence (in case end_pos not provided in the FASTA header)
     int fa_case;        // output upper case or lower case: TO_UPPER|TO_LOWER
-    int fa_src_pos;     // last genomic coordinate read from the input fasta (0-based)
     char prev_base;     // this is only to validate the REF allele in the VCF - the modified fa_buf cannot be used for inserts following deletions, see 600#issuecomment-383186778
     int prev_base_pos;  // the position of prev_base
     int prev_is_insert;
 
+    int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
+    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
+                        // Note that the chain is re-initialised for each chromosome/seq_region
+
+    FILE *fp_out;
+    FILE *fp_chain;
+    FILE *fp_chain_tmp; // the blocks of the current chain
+    int isample, napplied;
+    char *output_fname, *chain_fname;
+}
+sample_t;   // the consensus sequence of one sample, the VCF records and the reference are shared by all samples
+
+typedef struct
+{
+    int fa_end_pos;     // region's end position in the original sequence
+    int fa_length;      // region's length in the original sequence (in case end_pos not provided in the FASTA header)
+    int fa_src_pos;     // last genomic coordinate read from the input fasta (0-based)
+
     rbuf_t vcf_rbuf;
     bcf1_t **vcf_buf;
     int nvcf_buf, rid;
     char *chr, *chr_prefix;
 
     regidx_t *mask;
-    regitr_t *itr;
-
-    int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
-    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
-                        // Note that the chain is re-initialised for each chromosome/seq_region
+    regitr_t *itr;      // cursor for masking the fasta lines
+    regitr_t *rec_itr;  // cursor for skipping masked VCF records, both advance in sorted order
 
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
 
+    sample_t *smpl;     // one consensus sequence is created for each sample
+    int nsmpl;
+    kstring_t alt;      // the allele being applied, the VCF record is shared by all samples and is not modified
+
     bcf_srs_t *files;
     bcf_hdr_t *hdr;
-    FILE *fp_out;
-    FILE *fp_chain;
     char **argv;
-    int argc, output_iupac, haplotype, allele, isample, napplied;
+    int argc, output_iupac, haplotype, allele, sample_is_file;
     char *fname, *ref_fname, *sample, *output_fname, *mask_fname, *chain_fname, missing_allele, absent_allele;
 }
 args_t;
 
-static chain_t* init_chain(chain_t *chain, int ref_ori_pos)
+static chain_t* init_chain(FILE *fp_blocks, int ref_ori_pos)
 {
-//     fprintf(stderr, "init_chain(*chain, ref_ori_pos=%d)\n", ref_ori_pos);
-    chain = (chain_t*) calloc(1,sizeof(chain_t));
+//     fprintf(stderr, "init_chain(*fp_blocks, ref_ori_pos=%d)\n", ref_ori_pos);
+    chain_t *chain = (chain_t*) calloc(1,sizeof(chain_t));
     chain->num = 0;
-    chain->block_lengths = NULL;
-    chain->ref_gaps = NULL;
-    chain->alt_gaps = NULL;
+    chain->score = 0;
+    chain->fp_blocks = fp_blocks;
     chain->ori_pos = ref_ori_pos;
     chain->ref_last_block_ori = ref_ori_pos;
     chain->alt_last_block_ori = ref_ori_pos;
     return chain;
 }
 
-static void destroy_chain(args_t *args)
+static void destroy_chain(sample_t *smpl)
 {
-    chain_t *chain = args->chain;
-    free(chain->ref_gaps);
-    free(chain->alt_gaps);
-    free(chain->block_lengths);
-    free(chain);
-    chain = NULL;
-    free(args->chr);
-    args->chr = NULL;
+    free(smpl->chain);
+    smpl->chain = NULL;
 }
 
-static void print_chain(args_t *args)
+static void print_chain(args_t *args, sample_t *smpl)
 {
     /*
         Example chain format (see: https://genome.ucsc.edu/goldenPath/help/chain.html):
@@ -164,21 +175,30 @@ static void print_chain(args_t *args)
         - gap on the ref sequence between this and the next block (all but the last line)
         - gap on the alt sequence between this and the next block (all but the last line)
     */
-    chain_t *chain = args->chain;
-    int n = chain->num;
+    chain_t *chain = smpl->chain;
     int ref_end_pos = args->fa_length + chain->ori_pos;
     int last_block_size = ref_end_pos - chain->ref_last_block_ori;
     int alt_end_pos = chain->alt_last_block_ori + last_block_size;
-    int score = 0;
-    for (n=0; n<chain->num; n++) {
-        score += chain->block_lengths[n];
-    }
-    score += last_block_size;
-    fprintf(args->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, args->chr, ref_end_pos, chain->ori_pos, ref_end_pos, args->chr, alt_end_pos, chain->ori_pos, alt_end_pos, ++args->chain_id);
-    for (n=0; n<chain->num; n++) {
-        fprintf(args->fp_chain, "%d %d %d\n", chain->block_lengths[n], chain->ref_gaps[n], chain->alt_gaps[n]);
+    int score = chain->score + last_block_size;
+    fprintf(smpl->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, args->chr, ref_end_pos, chain->ori_pos, ref_end_pos, args->chr, alt_end_pos, chain->ori_pos, alt_end_pos, ++smpl->chain_id);
+
+    // copy the finished blocks, the temporary file is reused by the next chain
+    long nbytes = ftell(chain->fp_blocks);
+    if ( nbytes < 0 ) error("Failed to read the temporary chain file: %s\n", strerror(errno));
+    rewind(chain->fp_blocks);
+    char buf[BUFSIZ];
+    while ( nbytes > 0 )
+    {
+        size_t n = nbytes < BUFSIZ ? nbytes : BUFSIZ;
+        if ( fread(buf,1,n,chain->fp_blocks) != n ) error("Failed to read the temporary chain file\n");
+        if ( fwrite(buf,1,n,smpl->fp_chain) != n ) error("Could not write: %s\n", smpl->chain_fname);
+        nbytes -= n;
     }
-    fprintf(args->fp_chain, "%d\n\n", last_block_size);
+    rewind(chain->fp_blocks);
+
+    if ( chain->num )
+        fprintf(smpl->fp_chain, "%d %d %d\n", chain->block_length, chain->ref_gap, chain->alt_gap);
+    fprintf(smpl->fp_chain, "%d\n\n", last_block_size);
 }
 
 static void push_chain_gap(chain_t *chain, int ref_start, int ref_len, int alt_start, int alt_len)
@@ -190,17 +210,16 @@ static void push_chain_gap(chain_t *chain, int ref_start, int ref_len, int alt_s
         // In case this variant is back-to-back with the previous one
         chain->ref_last_block_ori = ref_start + ref_len;
         chain->alt_last_block_ori = alt_start + alt_len;
-        chain->ref_gaps[num-1] += ref_len;
-        chain->alt_gaps[num-1] += alt_len;
+        chain->ref_gap += ref_len;
+        chain->alt_gap += alt_len;
 
     } else {
-        // Extend the ungapped blocks, store the gap length
-        chain->block_lengths = (int*) realloc(chain->block_lengths, (num + 1) * sizeof(int));
-        chain->ref_gaps = (int*) realloc(chain->ref_gaps, (num + 1) * sizeof(int));
-        chain->alt_gaps = (int*) realloc(chain->alt_gaps, (num + 1) * sizeof(int));
-        chain->block_lengths[num] = ref_start - chain->ref_last_block_ori;
-        chain->ref_gaps[num] = ref_len;
-        chain->alt_gaps[num] = alt_len;
+        // The previous block cannot change anymore, write it out and store the new block and the gap length
+        if ( num ) fprintf(chain->fp_blocks, "%d %d %d\n", chain->block_length, chain->ref_gap, chain->alt_gap);
+        chain->block_length = ref_start - chain->ref_last_block_ori;
+        chain->ref_gap = ref_len;
+        chain->alt_gap = alt_len;
+        chain->score += chain->block_length;
         // Update the start positions of the next block
         chain->ref_last_block_ori = ref_start + ref_len;
         chain->alt_last_block_ori = alt_start + alt_len;
@@ -215,38 +234,64 @@ static void init_data(args_t *args)
     args->files->require_index = 1;
     if ( !bcf_sr_add_reader(args->files,args->fname) ) error("Failed to read from %s: %s\n", !strcmp("-",args->fname)?"standard input":args->fname, bcf_sr_strerror(args->files->errnum));
     args->hdr = args->files->readers[0].header;
-    args->isample = -1;
+    smpl_ilist_t *ilist = NULL;
     if ( args->sample )
     {
-        args->isample = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->sample);
-        if ( args->isample<0 ) error("No such sample: %s\n", args->sample);
+        ilist = smpl_ilist_init(args->hdr,args->sample,args->sample_is_file,SMPL_STRICT);
+        if ( !ilist->n ) error("No samples given with --sample\n");
+        args->nsmpl = ilist->n;
     }
-    if ( (args->haplotype || args->allele) && args->isample<0 )
+    else
+        args->nsmpl = 1;
+    args->smpl = (sample_t*) calloc(args->nsmpl,sizeof(sample_t));
+    int i;
+    for (i=0; i<args->nsmpl; i++)
+        args->smpl[i].isample = ilist ? ilist->idx[i] : -1;
+    if ( ilist ) smpl_ilist_destroy(ilist);
+    if ( (args->haplotype || args->allele) && args->smpl[0].isample<0 )
     {
         if ( bcf_hdr_nsamples(args->hdr) > 1 ) error("The --sample option is expected with --haplotype\n");
-        args->isample = 0;
+        args->smpl[0].isample = 0;
     }
+    if ( args->nsmpl > 1 && !args->output_fname ) error("The --output option is required with multiple samples\n");
     if ( args->mask_fname )
     {
         args->mask = regidx_init(args->mask_fname,NULL,NULL,0,NULL);
         if ( !args->mask ) error("Failed to initialize mask regions\n");
         args->itr = regitr_init(args->mask);
+        args->rec_itr = regitr_init(args->mask);
     }
-    // In case we want to store the chains
-    if ( args->chain_fname )
+    for (i=0; i<args->nsmpl; i++)
     {
-        args->fp_chain = fopen(args->chain_fname,"w");
-        if ( ! args->fp_chain ) error("Failed to create %s: %s\n", args->chain_fname, strerror(errno));
-        args->chain_id = 0;
+        // With multiple samples the -o and -c file names are prefixes of per-sample files
+        sample_t *smpl = &args->smpl[i];
+        const char *name = args->nsmpl > 1 ? args->hdr->samples[smpl->isample] : NULL;
+        kstring_t str = {0,0,0};
+        if ( args->chain_fname )
+        {
+            if ( name ) ksprintf(&str, "%s%s.chain", args->chain_fname, name);
+            else kputs(args->chain_fname, &str);
+            smpl->chain_fname = str.s;
+            smpl->fp_chain = fopen(smpl->chain_fname,"w");
+            if ( ! smpl->fp_chain ) error("Failed to create %s: %s\n", smpl->chain_fname, strerror(errno));
+            smpl->chain_id = 0;
+            smpl->fp_chain_tmp = tmpfile();
+            if ( ! smpl->fp_chain_tmp ) error("Failed to create a temporary file: %s\n", strerror(errno));
+        }
+        if ( args->output_fname )
+        {
+            str.s = NULL; str.l = str.m = 0;
+            if ( name ) ksprintf(&str, "%s%s.fa", args->output_fname, name);
+            else kputs(args->output_fname, &str);
+            smpl->output_fname = str.s;
+            smpl->fp_out = fopen(smpl->output_fname,"w");
+            if ( ! smpl->fp_out ) error("Failed to create %s: %s\n", smpl->output_fname, strerror(errno));
+        }
+        else smpl->fp_out = stdout;
     }
     rbuf_init(&args->vcf_rbuf, 100);
     args->vcf_buf = (bcf1_t**) calloc(args->vcf_rbuf.m, sizeof(bcf1_t*));
-    if ( args->output_fname ) {
-        args->fp_out = fopen(args->output_fname,"w");
-        if ( ! args->fp_out ) error("Failed to create %s: %s\n", args->output_fname, strerror(errno));
-    }
-    else args->fp_out = stdout;
-    if ( args->isample<0 ) fprintf(stderr,"Note: the --sample option not given, applying all records regardless of the genotype\n");
+    if ( args->smpl[0].isample<0 ) fprintf(stderr,"Note: the --sample option not given, applying all records regardless of the genotype\n");
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
     args->rid = -1;
@@ -260,13 +305,22 @@ static void destroy_data(args_t *args)
     for (i=0; i<args->vcf_rbuf.m; i++)
         if ( args->vcf_buf[i] ) bcf_destroy1(args->vcf_buf[i]);
     free(args->vcf_buf);
-    free(args->fa_buf.s);
     free(args->chr);
+    free(args->alt.s);
     if ( args->mask ) regidx_destroy(args->mask);
     if ( args->itr ) regitr_destroy(args->itr);
-    if ( args->chain_fname )
-        if ( fclose(args->fp_chain) ) error("Close failed: %s\n", args->chain_fname);
-    if ( fclose(args->fp_out) ) error("Close failed: %s\n", args->output_fname);
+    if ( args->rec_itr ) regitr_destroy(args->rec_itr);
+    for (i=0; i<args->nsmpl; i++)
+    {
+        sample_t *smpl = &args->smpl[i];
+        free(smpl->fa_buf.s);
+        if ( smpl->fp_chain && fclose(smpl->fp_chain) ) error("Close failed: %s\n", smpl->chain_fname);
+        if ( smpl->fp_chain_tmp ) fclose(smpl->fp_chain_tmp);
+        if ( fclose(smpl->fp_out) ) error("Close failed: %s\n", smpl->output_fname);
+        free(smpl->chain_fname);
+        free(smpl->output_fname);
+    }
+    free(args->smpl);
 }
 
 static void init_region(args_t *args, char *line)
@@ -294,25 +348,32 @@ static void init_region(args_t *args, char *line)
     args->chr = strdup(line);
     args->rid = bcf_hdr_name2id(args->hdr,line);
     if ( args->rid<0 ) fprintf(stderr,"Warning: Sequence \"%s\" not in %s\n", line,args->fname);
-    args->prev_base_pos = -1;
-    args->fa_buf.l  = 0;
     args->fa_length = 0;
     args->fa_end_pos = to;
-    args->fa_ori_pos = from;
     args->fa_src_pos = from;
-    args->fa_mod_off = 0;
-    args->fa_frz_pos = -1;
-    args->fa_frz_mod = -1;
-    args->fa_case    = -1;
     args->vcf_rbuf.n = 0;
-    bcf_sr_seek(args->files,line,args->fa_ori_pos);
+    bcf_sr_seek(args->files,line,from);
     if ( tmp_ptr ) *tmp_ptr = tmp;
-    fprintf(args->fp_out,">%s%s\n",args->chr_prefix?args->chr_prefix:"",line);
-    if (args->chain_fname )
+
+    int i;
+    for (i=0; i<args->nsmpl; i++)
     {
-        args->chain = init_chain(args->chain, args->fa_ori_pos);
-    } else {
-        args->chain = NULL;
+        sample_t *smpl = &args->smpl[i];
+        smpl->prev_base_pos = -1;
+        smpl->fa_buf.l  = 0;
+        smpl->fa_ngap   = 0;
+        smpl->fa_ori_pos = from;
+        smpl->fa_mod_off = 0;
+        smpl->fa_frz_pos = -1;
+        smpl->fa_frz_mod = -1;
+        smpl->fa_case    = -1;
+        fprintf(smpl->fp_out,">%s%s\n",args->chr_prefix?args->chr_prefix:"",line);
+        if (args->chain_fname )
+        {
+            smpl->chain = init_chain(smpl->fp_chain_tmp, smpl->fa_ori_pos);
+        } else {
+            smpl->chain = NULL;
+        }
     }
 }
 
@@ -348,73 +409,108 @@ static void unread_vcf_line(args_t *args, bcf1_t **rec_ptr)
     if ( !args->vcf_buf[i] ) args->vcf_buf[i] = bcf_init1();
     bcf1_t *tmp = rec; *rec_ptr = args->vcf_buf[i]; args->vcf_buf[i] = tmp;
 }
-static void flush_fa_buffer(args_t *args, int len)
+// The length of the buffered sequence, without the gap
+static inline int fa_buf_len(sample_t *smpl)
 {
-    if ( !args->fa_buf.l ) return;
+    return smpl->fa_buf.l - smpl->fa_ngap;
+}
+// Move the gap to the position pos of the buffered sequence. The variants are applied
+// in increasing order, so the bytes are moved only once, rather than shifting the rest
+// of the buffer with each indel.
+static void fa_gap_move(sample_t *smpl, int pos)
+{
+    char *s = smpl->fa_buf.s;
+    if ( smpl->fa_ngap && pos > smpl->fa_gap )
+        memmove(s + smpl->fa_gap, s + smpl->fa_gap + smpl->fa_ngap, pos - smpl->fa_gap);
+    else if ( smpl->fa_ngap && pos < smpl->fa_gap )
+        memmove(s + pos + smpl->fa_ngap, s + pos, smpl->fa_gap - pos);
+    smpl->fa_gap = pos;
+}
+// Make the gap at least len bytes long
+static void fa_gap_grow(sample_t *smpl, int len)
+{
+    if ( smpl->fa_ngap >= len ) return;
+    int n = len - smpl->fa_ngap;
+    if ( n < smpl->fa_buf.l ) n = smpl->fa_buf.l;
+    ks_resize(&smpl->fa_buf, smpl->fa_buf.l + n + 1);
+    char *tail = smpl->fa_buf.s + smpl->fa_gap + smpl->fa_ngap;
+    memmove(tail + n, tail, smpl->fa_buf.l - smpl->fa_gap - smpl->fa_ngap);
+    smpl->fa_ngap  += n;
+    smpl->fa_buf.l += n;
+    smpl->fa_buf.s[smpl->fa_buf.l] = 0;
+}
+static void fa_gap_close(sample_t *smpl)
+{
+    if ( !smpl->fa_ngap ) return;
+    fa_gap_move(smpl, fa_buf_len(smpl));
+    smpl->fa_buf.l -= smpl->fa_ngap;
+    smpl->fa_buf.s[smpl->fa_buf.l] = 0;
+    smpl->fa_ngap = 0;
+}
+static void flush_fa_buffer(sample_t *smpl, int len)
+{
+    if ( !smpl->fa_buf.l ) return;
+    fa_gap_close(smpl);
     int nwr = 0;
-    while ( nwr + 60 <= args->fa_buf.l )
+    while ( nwr + 60 <= smpl->fa_buf.l )
     {
-        if ( fwrite(args->fa_buf.s+nwr,1,60,args->fp_out) != 60 ) error("Could not write: %s\n", args->output_fname);
-        if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+        if ( fwrite(smpl->fa_buf.s+nwr,1,60,smpl->fp_out) != 60 ) error("Could not write: %s\n", smpl->output_fname);
+        if ( fwrite("\n",1,1,smpl->fp_out) != 1 ) error("Could not write: %s\n", smpl->output_fname);
         nwr += 60;
     }
     if ( nwr )
-        args->fa_ori_pos += nwr;
+        smpl->fa_ori_pos += nwr;
 
-    args->fa_frz_mod -= nwr;
+    smpl->fa_frz_mod -= nwr;
 
     if ( len )
     {
         // not finished on this chr yet and the buffer cannot be emptied completely
-        if ( nwr && nwr < args->fa_buf.l )
-            memmove(args->fa_buf.s,args->fa_buf.s+nwr,args->fa_buf.l-nwr);
-        args->fa_buf.l -= nwr;
+        if ( nwr && nwr < smpl->fa_buf.l )
+            memmove(smpl->fa_buf.s,smpl->fa_buf.s+nwr,smpl->fa_buf.l-nwr);
+        smpl->fa_buf.l -= nwr;
         return;
     }
 
     // empty the whole buffer
-    if ( nwr == args->fa_buf.l ) { args->fa_buf.l = 0; return; }
+    if ( nwr == smpl->fa_buf.l ) { smpl->fa_buf.l = 0; return; }
 
-    if ( fwrite(args->fa_buf.s+nwr,1,args->fa_buf.l - nwr,args->fp_out) != args->fa_buf.l - nwr ) error("Could not write: %s\n", args->output_fname);
-    if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+    if ( fwrite(smpl->fa_buf.s+nwr,1,smpl->fa_buf.l - nwr,smpl->fp_out) != smpl->fa_buf.l - nwr ) error("Could not write: %s\n", smpl->output_fname);
+    if ( fwrite("\n",1,1,smpl->fp_out) != 1 ) error("Could not write: %s\n", smpl->output_fname);
 
-    args->fa_ori_pos += args->fa_buf.l - nwr - args->fa_mod_off;
-    args->fa_mod_off = 0;
-    args->fa_buf.l = 0;
+    smpl->fa_ori_pos += smpl->fa_buf.l - nwr - smpl->fa_mod_off;
+    smpl->fa_mod_off = 0;
+    smpl->fa_buf.l = 0;
 }
-static void apply_absent(args_t *args, hts_pos_t pos)
+static void apply_absent(args_t *args, sample_t *smpl, hts_pos_t pos)
 {
-    if ( !args->fa_buf.l || pos <= args->fa_frz_pos + 1 || pos <= args->fa_ori_pos ) return;
+    int len = fa_buf_len(smpl);
+    if ( !len || pos <= smpl->fa_frz_pos + 1 || pos <= smpl->fa_ori_pos ) return;
 
-    int ie = pos && pos - args->fa_ori_pos + args->fa_mod_off < args->fa_buf.l ? pos - args->fa_ori_pos + args->fa_mod_off : args->fa_buf.l;
-    int ib = args->fa_frz_mod < 0 ? 0 : args->fa_frz_mod;
+    int ie = pos && pos - smpl->fa_ori_pos + smpl->fa_mod_off < len ? pos - smpl->fa_ori_pos + smpl->fa_mod_off : len;
+    int ib = smpl->fa_frz_mod < 0 ? 0 : smpl->fa_frz_mod;
     int i;
+    if ( ib < ie ) fa_gap_move(smpl, ie);
     for (i=ib; i<ie; i++)
-        args->fa_buf.s[i] = args->absent_allele;
+        smpl->fa_buf.s[i] = args->absent_allele;
 }
-static void freeze_ref(args_t *args, bcf1_t *rec)
+static void freeze_ref(sample_t *smpl, bcf1_t *rec, int rlen)
 {
-    if ( args->fa_frz_pos >= rec->pos + rec->rlen - 1 ) return;
-    args->fa_frz_pos = rec->pos + rec->rlen - 1;
-    args->fa_frz_mod = rec->pos - args->fa_ori_pos + args->fa_mod_off + rec->rlen;
+    if ( smpl->fa_frz_pos >= rec->pos + rlen - 1 ) return;
+    smpl->fa_frz_pos = rec->pos + rlen - 1;
+    smpl->fa_frz_mod = rec->pos - smpl->fa_ori_pos + smpl->fa_mod_off + rlen;
 }
-static void apply_variant(args_t *args, bcf1_t *rec)
+static void apply_variant(args_t *args, sample_t *smpl, bcf1_t *rec, int is_masked)
 {
     static int warned_haplotype = 0;
 
-    if ( args->absent_allele ) apply_absent(args, rec->pos);
+    if ( args->absent_allele ) apply_absent(args, smpl, rec->pos);
     if ( rec->n_allele==1 && !args->missing_allele && !args->absent_allele ) { return; }
-
-    if ( args->mask )
-    {
-        char *chr = (char*)bcf_hdr_id2name(args->hdr,args->rid);
-        int start = rec->pos;
-        int end   = rec->pos + rec->rlen - 1;
-        if ( regidx_overlap(args->mask, chr,start,end,NULL) ) return;
-    }
+    if ( is_masked ) return;
 
     int i, ialt = 1;    // the alternate allele
-    if ( args->isample >= 0 )
+    char iupac = 0;     // the first base of the alternate allele replaced with an IUPAC code
+    if ( smpl->isample >= 0 )
     {
         bcf_unpack(rec, BCF_UN_FMT);
         bcf_fmt_t *fmt = bcf_get_fmt(args->hdr, rec, "GT");
@@ -422,7 +518,7 @@ static void apply_variant(args_t *args, bcf1_t *rec)
 
         if ( fmt->type!=BCF_BT_INT8 )
             error("Todo: GT field represented with BCF_BT_INT8, too many alleles at %s:%"PRId64"?\n",bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
-        uint8_t *ptr = fmt->p + fmt->size*args->isample;
+        uint8_t *ptr = fmt->p + fmt->size*smpl->isample;
 
         enum { use_hap, use_iupac, pick_one } action = use_hap;
         if ( args->allele==PICK_IUPAC )
@@ -497,7 +593,7 @@ static void apply_variant(args_t *args, bcf1_t *rec)
                     char ial = rec->d.allele[ialt][0];
                     char jal = rec->d.allele[jalt][0];
                     if ( !ialt ) ialt = jalt;   // only ialt is used, make sure 0/1 is not ignored
-                    rec->d.allele[ialt][0] = gt2iupac(ial,jal);
+                    iupac = gt2iupac(ial,jal);
                 }
             }
         }
@@ -547,7 +643,7 @@ static void apply_variant(args_t *args, bcf1_t *rec)
         if ( !ialt )
         {
             // ref allele
-            if ( args->absent_allele ) freeze_ref(args,rec);
+            if ( args->absent_allele ) freeze_ref(smpl,rec,rec->rlen);
             return;
         }
         if ( rec->n_allele <= ialt ) error("Broken VCF, too few alts at %s:%"PRId64"\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
@@ -556,35 +652,43 @@ static void apply_variant(args_t *args, bcf1_t *rec)
     {
         char ial = rec->d.allele[0][0];
         char jal = rec->d.allele[1][0];
-        rec->d.allele[1][0] = gt2iupac(ial,jal);
+        iupac = gt2iupac(ial,jal);
     }
 
     if ( rec->n_allele==1 && ialt!=-1 )
     {
         // non-missing reference
-        if ( args->absent_allele ) freeze_ref(args,rec);
+        if ( args->absent_allele ) freeze_ref(smpl,rec,rec->rlen);
         return;
     }
+
+    // The record is shared by all samples, the allele to apply and its length on
+    // the reference are kept aside
+    char *ref = rec->d.allele[0];
+    int rlen = rec->rlen;
+    kstring_t *alt = &args->alt;
+    alt->l = 0;
     if ( ialt==-1 )
     {
-        char alleles[4];
-        alleles[0] = rec->d.allele[0][0];
-        alleles[1] = ',';
-        alleles[2] = args->missing_allele;
-        alleles[3] = 0;
-        bcf_update_alleles_str(args->hdr, rec, alleles);
-        ialt = 1;
+        // missing allele, replace the first reference base
+        kputc(args->missing_allele, alt);
+        rlen = 1;
+    }
+    else
+    {
+        kputs(rec->d.allele[ialt], alt);
+        if ( iupac ) alt->s[0] = iupac;
     }
 
     // Overlapping variant?
-    if ( rec->pos <= args->fa_frz_pos )
+    if ( rec->pos <= smpl->fa_frz_pos )
     {
         // Can be still OK iff this is an insertion (and which does not follow another insertion, see #888).
         // This still may not be enough for more complicated cases with multiple duplicate positions
         // and other types in between. In such case let the user normalize the VCF and remove duplicates.
         int overlap = 0;
-        if ( rec->pos < args->fa_frz_pos || !(bcf_get_variant_type(rec,ialt) & VCF_INDEL) ) overlap = 1;
-        else if ( rec->d.var[ialt].n <= 0 || args->prev_is_insert ) overlap = 1;
+        if ( rec->pos < smpl->fa_frz_pos || ialt==-1 || !(bcf_get_variant_type(rec,ialt) & VCF_INDEL) ) overlap = 1;
+        else if ( rec->d.var[ialt].n <= 0 || smpl->prev_is_insert ) overlap = 1;
 
         if ( overlap )
         {
@@ -595,49 +699,53 @@ static void apply_variant(args_t *args, bcf1_t *rec)
     }
 
     int len_diff = 0, alen = 0;
-    int idx = rec->pos - args->fa_ori_pos + args->fa_mod_off;
+    int idx = rec->pos - smpl->fa_ori_pos + smpl->fa_mod_off;
     if ( idx<0 )
     {
         fprintf(stderr,"Warning: ignoring overlapping variant starting at %s:%"PRId64"\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
         return;
     }
-    if ( rec->rlen > args->fa_buf.l - idx )
+    if ( rlen > fa_buf_len(smpl) - idx )
     {
-        rec->rlen = args->fa_buf.l - idx;
-        alen = strlen(rec->d.allele[ialt]);
-        if ( alen > rec->rlen )
+        rlen = fa_buf_len(smpl) - idx;
+        if ( (int)alt->l > rlen )
         {
-            rec->d.allele[ialt][rec->rlen] = 0;
+            alt->s[rlen] = 0;
+            alt->l = rlen;
             fprintf(stderr,"Warning: trimming variant starting at %s:%"PRId64"\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
         }
     }
-    if ( idx>=args->fa_buf.l ) 
-        error("FIXME: %s:%"PRId64" .. idx=%d, ori_pos=%d, len=%"PRIu64", off=%d\n",bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,idx,args->fa_ori_pos,(uint64_t)args->fa_buf.l,args->fa_mod_off);
+    if ( idx>=fa_buf_len(smpl) ) 
+        error("FIXME: %s:%"PRId64" .. idx=%d, ori_pos=%d, len=%"PRIu64", off=%d\n",bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,idx,smpl->fa_ori_pos,(uint64_t)fa_buf_len(smpl),smpl->fa_mod_off);
+
+    // the sequence up to the end of the variant must be contiguous
+    fa_gap_move(smpl, idx + rlen);
 
     // sanity check the reference base
-    if ( rec->d.allele[ialt][0]=='<' )
+    if ( alt->s[0]=='<' )
     {
         // TODO: symbolic deletions probably need more work above with PICK_SHORT|PICK_LONG
 
-        if ( strcasecmp(rec->d.allele[ialt],"<DEL>") && strcasecmp(rec->d.allele[ialt],"<*>") && strcasecmp(rec->d.allele[ialt],"<NON_REF>") )
+        if ( strcasecmp(alt->s,"<DEL>") && strcasecmp(alt->s,"<*>") && strcasecmp(alt->s,"<NON_REF>") )
             error("Symbolic alleles other than <DEL>, <*> or <NON_REF> are currently not supported, e.g. %s at %s:%"PRId64".\n"
                   "Please use filtering expressions to exclude such sites, for example by running with: -e 'ALT~\"<.*>\"'\n",
-                rec->d.allele[ialt],bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
-        assert( rec->d.allele[0][1]==0 );           // todo: for now expecting strlen(REF) = 1
-        if ( !strcasecmp(rec->d.allele[ialt],"<DEL>") )
+                alt->s,bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
+        assert( ref[1]==0 );           // todo: for now expecting strlen(REF) = 1
+        if ( !strcasecmp(alt->s,"<DEL>") )
         {
-            len_diff = 1-rec->rlen;
-            rec->d.allele[ialt] = rec->d.allele[0];     // according to VCF spec, REF must precede the event
-            alen = strlen(rec->d.allele[ialt]);
+            len_diff = 1-rlen;
+            alt->l = 0;
+            kputs(ref, alt);     // according to VCF spec, REF must precede the event
+            alen = alt->l;
         }
         else
         {
             // <*>  or <NON_REF> .. gVCF, evidence for the reference allele throughout the whole block
-            freeze_ref(args,rec);
+            freeze_ref(smpl,rec,rlen);
             return;
         }
     }
-    else if ( strncasecmp(rec->d.allele[0],args->fa_buf.s+idx,rec->rlen) )
+    else if ( strncasecmp(ref,smpl->fa_buf.s+idx,rlen) )
     {
         // This is hacky, handle a special case: if SNP or an insert follows a deletion (AAC>A, C>CAA),
         // the reference base in fa_buf is lost and the check fails. We do not keep a buffer
@@ -645,66 +753,75 @@ static void apply_variant(args_t *args, bcf1_t *rec)
         // one base overlap
 
         int fail = 1;
-        if ( args->prev_base_pos==rec->pos && toupper(rec->d.allele[0][0])==toupper(args->prev_base) )
+        if ( smpl->prev_base_pos==rec->pos && toupper(ref[0])==toupper(smpl->prev_base) )
         {
-            if ( rec->rlen==1 ) fail = 0;
-            else if ( !strncasecmp(rec->d.allele[0]+1,args->fa_buf.s+idx+1,rec->rlen-1) ) fail = 0;
+            if ( rlen==1 ) fail = 0;
+            else if ( !strncasecmp(ref+1,smpl->fa_buf.s+idx+1,rlen-1) ) fail = 0;
         }
 
         if ( fail )
         {
             char tmp = 0;
-            if ( args->fa_buf.l - idx > rec->rlen ) 
+            fa_gap_close(smpl);
+            if ( smpl->fa_buf.l - idx > rlen ) 
             { 
-                tmp = args->fa_buf.s[idx+rec->rlen];
-                args->fa_buf.s[idx+rec->rlen] = 0;
+                tmp = smpl->fa_buf.s[idx+rlen];
+                smpl->fa_buf.s[idx+rlen] = 0;
             }
             error(
                     "The fasta sequence does not match the REF allele at %s:%"PRId64":\n"
                     "   .vcf: [%s] <- (REF)\n" 
                     "   .vcf: [%s] <- (ALT)\n" 
                     "   .fa:  [%s]%c%s\n",
-                    bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1, rec->d.allele[0], rec->d.allele[ialt], args->fa_buf.s+idx,
-                    tmp?tmp:' ',tmp?args->fa_buf.s+idx+rec->rlen+1:""
+                    bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1, ref, alt->s, smpl->fa_buf.s+idx,
+                    tmp?tmp:' ',tmp?smpl->fa_buf.s+idx+rlen+1:""
                  );
         }
-        alen = strlen(rec->d.allele[ialt]);
-        len_diff = alen - rec->rlen;
+        alen = alt->l;
+        len_diff = alen - rlen;
     }
     else
     {
-        alen = strlen(rec->d.allele[ialt]);
-        len_diff = alen - rec->rlen;
+        alen = alt->l;
+        len_diff = alen - rlen;
     }
 
-    args->fa_case = toupper(args->fa_buf.s[idx])==args->fa_buf.s[idx] ? TO_UPPER : TO_LOWER;
-    if ( args->fa_case==TO_UPPER )
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = toupper(rec->d.allele[ialt][i]);
+    smpl->fa_case = toupper(smpl->fa_buf.s[idx])==smpl->fa_buf.s[idx] ? TO_UPPER : TO_LOWER;
+    if ( smpl->fa_case==TO_UPPER )
+        for (i=0; i<alen; i++) alt->s[i] = toupper(alt->s[i]);
     else
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = tolower(rec->d.allele[ialt][i]);
+        for (i=0; i<alen; i++) alt->s[i] = tolower(alt->s[i]);
 
     if ( len_diff <= 0 )
     {
         // deletion or same size event
         for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+            smpl->fa_buf.s[idx+i] = alt->s[i];
 
         if ( len_diff )
-            memmove(args->fa_buf.s+idx+alen,args->fa_buf.s+idx+rec->rlen,args->fa_buf.l-idx-rec->rlen);
+        {
+            // the deleted bases become part of the gap
+            smpl->fa_gap   = idx + alen;
+            smpl->fa_ngap -= len_diff;
+        }
 
-        args->prev_base = rec->d.allele[0][rec->rlen - 1];
-        args->prev_base_pos = rec->pos + rec->rlen - 1;
-        args->prev_is_insert = 0;
-        args->fa_frz_mod = idx + alen;
+        smpl->prev_base = ref[rlen - 1];
+        smpl->prev_base_pos = rec->pos + rlen - 1;
+        smpl->prev_is_insert = 0;
+        smpl->fa_frz_mod = idx + alen;
     }
     else
     {
-        args->prev_is_insert = 1;
-        args->prev_base_pos = rec->pos;
+        smpl->prev_is_insert = 1;
+        smpl->prev_base_pos = rec->pos;
 
-        // insertion
-        ks_resize(&args->fa_buf, args->fa_buf.l + len_diff);
-        memmove(args->fa_buf.s + idx + rec->rlen + len_diff, args->fa_buf.s + idx + rec->rlen, args->fa_buf.l - idx - rec->rlen);
+        // insertion, take the new bases from the gap and initialize them with the following
+        // sequence, as if the rest of the buffer was shifted
+        fa_gap_grow(smpl, len_diff);
+        int ntail = smpl->fa_buf.l - smpl->fa_gap - smpl->fa_ngap;
+        memcpy(smpl->fa_buf.s + smpl->fa_gap, smpl->fa_buf.s + smpl->fa_gap + smpl->fa_ngap, ntail < len_diff ? ntail : len_diff);
+        smpl->fa_gap  += len_diff;
+        smpl->fa_ngap -= len_diff;
 
         // This can get tricky, make sure the bases unchanged by the insertion do not overwrite preceeding variants.
         // For example, here we want to get TAA:
@@ -712,39 +829,50 @@ static void apply_variant(args_t *args, bcf1_t *rec)
         //      1   C   T
         //      1   C   CAA
         int ibeg = 0;
-        while ( ibeg<alen && rec->d.allele[0][ibeg]==rec->d.allele[ialt][ibeg] && rec->pos + ibeg <= args->prev_base_pos  ) ibeg++;
+        while ( ibeg<alen && ref[ibeg]==alt->s[ibeg] && rec->pos + ibeg <= smpl->prev_base_pos  ) ibeg++;
         for (i=ibeg; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+            smpl->fa_buf.s[idx+i] = alt->s[i];
 
-        args->fa_frz_mod = idx + alen - ibeg + 1;
+        smpl->fa_frz_mod = idx + alen - ibeg + 1;
     }
-    if (args->chain && len_diff != 0)
+    if (smpl->chain && len_diff != 0)
     {
         // If first nucleotide of both REF and ALT are the same... (indels typically include the nucleotide before the variant)
-        if ( strncasecmp(rec->d.allele[0],rec->d.allele[ialt],1) == 0)
+        if ( strncasecmp(ref,alt->s,1) == 0)
         {
             // ...extend the block by 1 bp: start is 1 bp further and alleles are 1 bp shorter
-            push_chain_gap(args->chain, rec->pos + 1, rec->rlen - 1, rec->pos + 1 + args->fa_mod_off, alen - 1);
+            push_chain_gap(smpl->chain, rec->pos + 1, rlen - 1, rec->pos + 1 + smpl->fa_mod_off, alen - 1);
         }
         else
         {
             // otherwise, just the coordinates of the variant as given
-            push_chain_gap(args->chain, rec->pos, rec->rlen, rec->pos + args->fa_mod_off, alen);
+            push_chain_gap(smpl->chain, rec->pos, rlen, rec->pos + smpl->fa_mod_off, alen);
         }
     }
-    args->fa_buf.l += len_diff;
-    args->fa_mod_off += len_diff;
-    args->fa_frz_pos  = rec->pos + rec->rlen - 1;
-    args->napplied++;
+    smpl->fa_mod_off += len_diff;
+    smpl->fa_frz_pos  = rec->pos + rlen - 1;
+    smpl->napplied++;
+}
+static void apply_record(args_t *args, bcf1_t *rec)
+{
+    int i, is_masked = 0;
+    if ( args->mask )
+    {
+        char *chr = (char*)bcf_hdr_id2name(args->hdr,args->rid);
+        int start = rec->pos;
+        int end   = rec->pos + rec->rlen - 1;
+        is_masked = regidx_overlap_sorted(args->mask, chr,start,end,args->rec_itr);
+    }
+    for (i=0; i<args->nsmpl; i++)
+        apply_variant(args, &args->smpl[i], rec, is_masked);
 }
-
 
 static void mask_region(args_t *args, char *seq, int len)
 {
     int start = args->fa_src_pos - len;
     int end   = args->fa_src_pos;
 
-    if ( !regidx_overlap(args->mask, args->chr,start,end, args->itr) ) return;
+    if ( !regidx_overlap_sorted(args->mask, args->chr,start,end, args->itr) ) return;
 
     int idx_start, idx_end, i;
     while ( regitr_overlap(args->itr) )
@@ -762,14 +890,17 @@ static void consensus(args_t *args)
     BGZF *fasta = bgzf_open(args->ref_fname, "r");
     if ( !fasta ) error("Error reading %s\n", args->ref_fname);
     kstring_t str = {0,0,0};
+    int i;
     while ( bgzf_getline(fasta, '\n', &str) > 0 )
     {
         if ( str.s[0]=='>' )
         {
             // new sequence encountered
-            if (args->chain) {
-                print_chain(args);
-                destroy_chain(args);
+            for (i=0; i<args->nsmpl; i++)
+            {
+                if ( !args->smpl[i].chain ) continue;
+                print_chain(args, &args->smpl[i]);
+                destroy_chain(&args->smpl[i]);
             }
             // apply all cached variants and variants that might have been missed because of short fasta (see test/consensus.9.*)
             bcf1_t **rec_ptr = NULL;
@@ -777,28 +908,31 @@ static void consensus(args_t *args)
             {
                 bcf1_t *rec = *rec_ptr;
                 if ( rec->rid!=args->rid || ( args->fa_end_pos && rec->pos > args->fa_end_pos ) ) break;
-                apply_variant(args, rec);
+                apply_record(args, rec);
             }
-            if ( args->absent_allele )
+            for (i=0; i<args->nsmpl; i++)
             {
-                int pos = 0;
-                if ( args->vcf_rbuf.n && args->vcf_buf[args->vcf_rbuf.f]->rid==args->rid )
-                    pos = args->vcf_buf[args->vcf_rbuf.f]->pos;
-                apply_absent(args, pos);
+                if ( args->absent_allele )
+                {
+                    int pos = 0;
+                    if ( args->vcf_rbuf.n && args->vcf_buf[args->vcf_rbuf.f]->rid==args->rid )
+                        pos = args->vcf_buf[args->vcf_rbuf.f]->pos;
+                    apply_absent(args, &args->smpl[i], pos);
+                }
+                flush_fa_buffer(&args->smpl[i], 0);
             }
-            flush_fa_buffer(args, 0);
             init_region(args, str.s+1);
             continue;
         }
         args->fa_length  += str.l;
         args->fa_src_pos += str.l;
 
-        // determine if uppercase or lowercase is used in this fasta file
-        if ( args->fa_case==-1 ) args->fa_case = toupper(str.s[0])==str.s[0] ? 1 : 0;
-
         if ( args->mask && args->rid>=0) mask_region(args, str.s, str.l);
-        kputs(str.s, &args->fa_buf);
+        for (i=0; i<args->nsmpl; i++)
+            kputs(str.s, &args->smpl[i].fa_buf);
 
+        // Note that fa_src_pos is the end of the buffered sequence in the original coordinates,
+        // for all samples it equals to fa_ori_pos + fa_buf_len - fa_mod_off
         bcf1_t **rec_ptr = NULL;
         while ( args->rid>=0 && (rec_ptr = next_vcf_line(args)) )
         {
@@ -814,7 +948,7 @@ static void consensus(args_t *args)
             }
 
             // is the vcf record well beyond cached fasta buffer? if yes, the buf can be flushed
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos )
+            if ( args->fa_src_pos <= rec->pos )
             {
                 unread_vcf_line(args, rec_ptr);
                 rec_ptr = NULL;
@@ -822,17 +956,20 @@ static void consensus(args_t *args)
             }
 
             // is the cached fasta buffer full enough? if not, read more fasta, no flushing
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off < rec->pos + rec->rlen )
+            if ( args->fa_src_pos < rec->pos + rec->rlen )
             {
                 unread_vcf_line(args, rec_ptr);
                 break;
             }
-            apply_variant(args, rec);
+            apply_record(args, rec);
         }
         if ( !rec_ptr )
         {
-            if ( args->absent_allele ) apply_absent(args, args->fa_ori_pos - args->fa_mod_off + args->fa_buf.l);
-            flush_fa_buffer(args, 60);
+            for (i=0; i<args->nsmpl; i++)
+            {
+                if ( args->absent_allele ) apply_absent(args, &args->smpl[i], args->fa_src_pos);
+                flush_fa_buffer(&args->smpl[i], 60);
+            }
         }
     }
     bcf1_t **rec_ptr = NULL;
@@ -841,19 +978,27 @@ static void consensus(args_t *args)
         bcf1_t *rec = *rec_ptr;
         if ( rec->rid!=args->rid ) break;
         if ( args->fa_end_pos && rec->pos > args->fa_end_pos ) break;
-        if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos ) break;
-        apply_variant(args, rec);
+        if ( args->fa_src_pos <= rec->pos ) break;
+        apply_record(args, rec);
     }
-    if (args->chain)
+    for (i=0; i<args->nsmpl; i++)
     {
-        print_chain(args);
-        destroy_chain(args);
+        sample_t *smpl = &args->smpl[i];
+        if ( smpl->chain )
+        {
+            print_chain(args, smpl);
+            destroy_chain(smpl);
+        }
+        if ( args->absent_allele ) apply_absent(args, smpl, HTS_POS_MAX);
+        flush_fa_buffer(smpl, 0);
     }
-    if ( args->absent_allele ) apply_absent(args, HTS_POS_MAX);
-    flush_fa_buffer(args, 0);
     bgzf_close(fasta);
     free(str.s);
-    fprintf(stderr,"Applied %d variants\n", args->napplied);
+    if ( args->nsmpl==1 )
+        fprintf(stderr,"Applied %d variants\n", args->smpl[0].napplied);
+    else
+        for (i=0; i<args->nsmpl; i++)
+            fprintf(stderr,"Applied %d variants to %s\n", args->smpl[i].napplied, args->hdr->samples[args->smpl[i].isample]);
 }
 
 static void usage(args_t *args)
@@ -866,7 +1011,7 @@ static void usage(args_t *args)
     fprintf(stderr, "       information, such as INFO/AD or FORMAT/AD.\n");
     fprintf(stderr, "Usage:   bcftools consensus [OPTIONS] <file.vcf.gz>\n");
     fprintf(stderr, "Options:\n");
-    fprintf(stderr, "    -c, --chain <file>         write a chain file for liftover\n");
+    fprintf(stderr, "    -c, --chain <file>         write a chain file for liftover, file name prefix with multiple samples\n");
     fprintf(stderr, "    -a, --absent <char>        replace positions absent from VCF with <char>\n");
     fprintf(stderr, "    -e, --exclude <expr>       exclude sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -f, --fasta-ref <file>     reference sequence in fasta format\n");
@@ -883,14 +1028,19 @@ static void usage(args_t *args)
     fprintf(stderr, "    -I, --iupac-codes          output variants in the form of IUPAC ambiguity codes\n");
     fprintf(stderr, "    -m, --mask <file>          replace regions with N\n");
     fprintf(stderr, "    -M, --missing <char>       output <char> instead of skipping a missing genotype \"./.\"\n");
-    fprintf(stderr, "    -o, --output <file>        write output to a file [standard output]\n");
+    fprintf(stderr, "    -o, --output <file>        write output to a file [standard output], file name prefix with multiple samples\n");
     fprintf(stderr, "    -p, --prefix <string>      prefix to add to output sequence names\n");
-    fprintf(stderr, "    -s, --sample <name>        apply variants of the given sample\n");
+    fprintf(stderr, "    -s, --sample <list>        apply variants of the given sample, comma-separated list for multiple samples\n");
+    fprintf(stderr, "    -S, --samples-file <file>  file of samples to apply variants of, one consensus per sample\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "   # Get the consensus for one region. The fasta header lines are then expected\n");
     fprintf(stderr, "   # in the form \">chr:from-to\".\n");
     fprintf(stderr, "   samtools faidx ref.fa 8:11870-11890 | bcftools consensus in.vcf.gz > out.fa\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "   # Create consensus of multiple samples in one pass, the output files are\n");
+    fprintf(stderr, "   # named dir/NA001.fa, dir/NA002.fa and dir/NA001.chain, dir/NA002.chain\n");
+    fprintf(stderr, "   bcftools consensus -s NA001,NA002 -f ref.fa -o dir/ -c dir/ in.vcf.gz\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -904,6 +1054,7 @@ int main_consensus(int argc, char *argv[])
         {"exclude",required_argument,NULL,'e'},
         {"include",required_argument,NULL,'i'},
         {"sample",1,0,'s'},
+        {"samples-file",1,0,'S'},
         {"iupac-codes",0,0,'I'},
         {"haplotype",1,0,'H'},
         {"output",1,0,'o'},
@@ -916,12 +1067,13 @@ int main_consensus(int argc, char *argv[])
         {0,0,0,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "h?s:1Ii:e:H:f:o:m:c:M:p:a:",loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "h?s:S:1Ii:e:H:f:o:m:c:M:p:a:",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case 'p': args->chr_prefix = optarg; break;
             case 's': args->sample = optarg; break;
+            case 'S': args->sample = optarg; args->sample_is_file = 1; break;
             case 'o': args->output_fname = optarg; break;
             case 'I': args->output_iupac = 1; break;
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
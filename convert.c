@@ -34,10 +34,12 @@ THE SOFTWARE.  */
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/kfunc.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "variantkey.h"
 #include "convert.h"
@@ -80,6 +82,7 @@ THE SOFTWARE.  */
 typedef struct _fmt_t
 {
     int type, id, is_gt_field, ready, subscript;
+    int id_ready;               // the FORMAT header id is resolved, see init_format()
     char *key;
     bcf_fmt_t *fmt;
     void *usr;                  // user data (optional)
@@ -88,6 +91,23 @@ typedef struct _fmt_t
 }
 fmt_t;
 
+// Binary columnar output, see convert_columns_header()
+#define COL_INT32  1
+#define COL_FLOAT  2
+#define COL_STR    3
+#define COL_DICT   4
+
+typedef struct
+{
+    int type, ifmt, isample;    // the column type, the index of the tag in convert->fmt, the sample or -1 for site columns
+    char *name;
+    kstring_t dat, off;         // the values of the current batch; string offsets
+    void *dict;                 // dictionary of strings for DICT columns
+    int ndict, nnew;            // the total number of dictionary entries and those new in this batch
+    kstring_t dict_new;
+}
+col_t;
+
 struct _convert_t
 {
     fmt_t *fmt;
@@ -103,6 +123,9 @@ struct _convert_t
     char *undef_info_tag;
     int allow_undef_tags;
     uint8_t **subset_samples;
+    col_t *cols;
+    int ncols, nrows;
+    kstring_t tmp;
 };
 
 typedef struct
@@ -302,8 +325,16 @@ static void process_info(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isamp
 }
 static void init_format(convert_t *convert, bcf1_t *line, fmt_t *fmt)
 {
-    fmt->id = bcf_hdr_id2int(convert->header, BCF_DT_ID, fmt->key);
-    if ( !bcf_hdr_idinfo_exists(convert->header,BCF_HL_FMT,fmt->id) ) fmt->id = -1;
+    // The header lookup is done once, only the position of the tag in the record is
+    // searched for each new record
+    if ( !fmt->id_ready )
+    {
+        fmt->id = bcf_hdr_id2int(convert->header, BCF_DT_ID, fmt->key);
+        if ( !bcf_hdr_idinfo_exists(convert->header,BCF_HL_FMT,fmt->id) ) fmt->id = -1;
+        if ( fmt->id < 0 && !convert->allow_undef_tags )
+            error("Error: no such tag defined in the VCF header: FORMAT/%s\n", fmt->key);
+        fmt->id_ready = 1;
+    }
     fmt->fmt = NULL;
     if ( fmt->id >= 0 )
     {
@@ -311,8 +342,6 @@ static void init_format(convert_t *convert, bcf1_t *line, fmt_t *fmt)
         for (i=0; i<(int)line->n_fmt; i++)
             if ( line->d.fmt[i].id==fmt->id ) { fmt->fmt = &line->d.fmt[i]; break; }
     }
-    else if ( !convert->allow_undef_tags )
-        error("Error: no such tag defined in the VCF header: FORMAT/%s\n", fmt->key);
 
     fmt->ready = 1;
 }
@@ -397,6 +426,15 @@ static void process_format(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isa
             _copy_field((char*)(fmt->fmt->p + isample*fmt->fmt->size), fmt->fmt->size, fmt->subscript, str);
         else error("TODO: %s:%d .. fmt->type=%d\n", __FILE__,__LINE__, fmt->fmt->type);
     }
+    else if ( fmt->fmt->n==1 && fmt->fmt->type!=BCF_BT_FLOAT && fmt->fmt->type!=BCF_BT_CHAR )
+    {
+        // single integer values such as DP or GQ, the most common case, skip the generic bcf_fmt_array
+        int32_t ival = bcf_array_ivalue(fmt->fmt->p+isample*fmt->fmt->size,fmt->fmt->type,0);
+        if ( ival==bcf_int32_missing || ival==bcf_int32_vector_end )
+            kputc('.', str);
+        else
+            kputw(ival, str);
+    }
     else
         bcf_fmt_array(str, fmt->fmt->n, fmt->fmt->type, fmt->fmt->p + isample*fmt->fmt->size);
 }
@@ -660,6 +698,41 @@ static void process_chrom_pos_id(convert_t *convert, bcf1_t *line, fmt_t *fmt, i
         kputw(line->pos+1, str);
     }
 }
+// Same as ksprintf(str,"%f",val) but without the printf machinery, the
+// probabilities are printed for each sample and this is where the time goes.
+// Values whose rounding is borderline or which are out of range go through
+// printf so that the output is identical.
+static inline void kput_prob(double val, kstring_t *str)
+{
+    if ( !(val>=0 && val<1e9) || signbit(val) ) { ksprintf(str,"%f",val); return; }
+    double x = val*1e6, ix = floor(x), frac = x - ix;
+    if ( fabs(frac-0.5) < 1e-6 ) { ksprintf(str,"%f",val); return; }
+    int64_t ival = (int64_t)ix + (frac > 0.5 ? 1 : 0);
+    kputll(ival/1000000, str);
+    ks_resize(str, str->l+8);
+    char *p = str->s + str->l;
+    int i, dec = ival%1000000;
+    p[0] = '.';
+    for (i=6; i>0; i--) { p[i] = '0' + dec%10; dec /= 10; }
+    str->l += 7;
+    str->s[str->l] = 0;
+}
+
+// The PL to probability conversion, pow(10,-0.1*PL), tabulated for common PL values
+#define PL2PROB_MAX 1024
+static double *pl2prob_tbl = NULL;
+static pthread_once_t pl2prob_once = PTHREAD_ONCE_INIT;
+static void pl2prob_init(void)
+{
+    int i;
+    pl2prob_tbl = (double*) malloc(sizeof(double)*PL2PROB_MAX);
+    for (i=0; i<PL2PROB_MAX; i++) pl2prob_tbl[i] = pow(10,-0.1*i);
+}
+static inline double pl2prob(int32_t pl)
+{
+    return pl>=0 && pl<PL2PROB_MAX ? pl2prob_tbl[pl] : pow(10,-0.1*pl);
+}
+
 static void process_gt_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
 {
     int m,n,i;
@@ -729,6 +802,8 @@ static void process_pl_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, in
         error("Error parsing PL tag at %s:%"PRId64"\n", bcf_seqname(convert->header,line),(int64_t) line->pos+1);
     }
 
+    pthread_once(&pl2prob_once, pl2prob_init);
+
     n /= convert->nsamples;
     for (i=0; i<convert->nsamples; i++)
     {
@@ -738,25 +813,25 @@ static void process_pl_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, in
         for (j=0; j<n; j++)
         {
             if ( ptr[j]==bcf_int32_vector_end ) break;
-            sum += pow(10,-0.1*ptr[j]);
+            sum += pl2prob(ptr[j]);
         }
         if ( j==line->n_allele )
         {
             // haploid
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[0])/sum);
+            kput_prob(pl2prob(ptr[0])/sum, str);
             kputs(" 0 ", str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[1])/sum);
+            kput_prob(pl2prob(ptr[1])/sum, str);
         }
         else
         {
             // diploid
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[0])/sum);
+            kput_prob(pl2prob(ptr[0])/sum, str);
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[1])/sum);
+            kput_prob(pl2prob(ptr[1])/sum, str);
             kputc(' ',str);
-            ksprintf(str,"%f",pow(10,-0.1*ptr[2])/sum);
+            kput_prob(pl2prob(ptr[2])/sum, str);
         }
     }
 }
@@ -790,10 +865,22 @@ static void process_gp_to_prob3(convert_t *convert, bcf1_t *line, fmt_t *fmt, in
             if ( ptr[j]<0 || ptr[j]>1 ) error("[%s:%"PRId64":%f] GP value outside range [0,1]; bcftools convert expects the VCF4.3+ spec for the GP field encoding genotype posterior probabilities", bcf_seqname(convert->header,line),(int64_t) line->pos+1,ptr[j]);
             sum+=ptr[j];
         }
+        kputc(' ',str);
+        kput_prob(ptr[0], str);
         if ( j==line->n_allele )
-            ksprintf(str," %f %f %f",ptr[0],0.,ptr[1]); // haploid
+        {
+            // haploid
+            kputs(" 0.000000 ", str);
+            kput_prob(ptr[1], str);
+        }
         else
-            ksprintf(str," %f %f %f",ptr[0],ptr[1],ptr[2]); // diploid
+        {
+            // diploid
+            kputc(' ',str);
+            kput_prob(ptr[1], str);
+            kputc(' ',str);
+            kput_prob(ptr[2], str);
+        }
     }
 }
 
@@ -1109,20 +1196,48 @@ static void process_rsid_hex(convert_t *convert, bcf1_t *line, fmt_t *fmt, int i
 {
     char *ptr = line->d.id;
     ptr += 2; // remove 'rs'
-    ksprintf(str, "%08" PRIx32 "", (uint32_t)strtoul(ptr, NULL, 10));
+    ks_resize(str, str->l+9);
+    str->l += hex_uint32_t((uint32_t)strtoul(ptr, NULL, 10), str->s+str->l);
+}
+
+// Chromosome codes of the header contigs, encoded once per contig rather than for each record
+typedef struct
+{
+    uint8_t *code;
+    int n;
+}
+vk_chrom_t;
+
+static void destroy_variantkey_hex(void *usr)
+{
+    vk_chrom_t *chr = (vk_chrom_t*) usr;
+    if ( !chr ) return;
+    free(chr->code);
+    free(chr);
 }
 
 static void process_variantkey_hex(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
 {
-    uint64_t vk = variantkey(
-        convert->header->id[BCF_DT_CTG][line->rid].key,
-        strlen(convert->header->id[BCF_DT_CTG][line->rid].key),
+    vk_chrom_t *chr = (vk_chrom_t*) fmt->usr;
+    if ( !chr ) fmt->usr = chr = (vk_chrom_t*) calloc(1,sizeof(vk_chrom_t));
+    if ( line->rid >= chr->n )
+    {
+        // contigs can be added to the header on the fly when reading VCF
+        int i, n = convert->header->n[BCF_DT_CTG];
+        chr->code = (uint8_t*) realloc(chr->code, n);
+        for (i=chr->n; i<n; i++)
+        {
+            const char *key = convert->header->id[BCF_DT_CTG][i].key;
+            chr->code[i] = encode_chrom(key, strlen(key));
+        }
+        chr->n = n;
+    }
+    uint64_t vk = encode_variantkey(
+        chr->code[line->rid],
         line->pos,
-        line->d.allele[0],
-        strlen(line->d.allele[0]),
-        line->d.allele[1],
-        strlen(line->d.allele[1]));
-    ksprintf(str, "%016" PRIx64 "", vk);
+        encode_refalt(line->d.allele[0], strlen(line->d.allele[0]), line->d.allele[1], strlen(line->d.allele[1])));
+    ks_resize(str, str->l+17);
+    str->l += variantkey_hex(vk, str->s+str->l);
 }
 
 static void process_npass(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
@@ -1218,6 +1333,7 @@ static fmt_t *register_tag(convert_t *convert, int type, char *key, int is_gtf)
     fmt->key   = key ? strdup(key) : NULL;
     fmt->is_gt_field = is_gtf;
     fmt->subscript = -1;
+    fmt->id_ready  = 0;
     fmt->usr     = NULL;
     fmt->destroy = NULL;
 
@@ -1288,7 +1404,7 @@ static fmt_t *register_tag(convert_t *convert, int type, char *key, int is_gtf)
         case T_TBCSQ: fmt->handler = &process_tbcsq; fmt->destroy = &destroy_tbcsq; convert->max_unpack |= BCF_UN_FMT; break;
         case T_LINE: fmt->handler = &process_line; convert->max_unpack |= BCF_UN_FMT; break;
         case T_RSX: fmt->handler = &process_rsid_hex; break;
-        case T_VKX: fmt->handler = &process_variantkey_hex; break;
+        case T_VKX: fmt->handler = &process_variantkey_hex; fmt->destroy = &destroy_variantkey_hex; break;
         case T_PBINOM: fmt->handler = &process_pbinom; convert->max_unpack |= BCF_UN_FMT; break;
         case T_NPASS: fmt->handler = &process_npass; fmt->destroy = &destroy_npass; break;
         default: error("TODO: handler for type %d\n", fmt->type);
@@ -1520,6 +1636,17 @@ void convert_destroy(convert_t *convert)
         free(convert->fmt[i].key);
     }
     free(convert->fmt);
+    for (i=0; i<convert->ncols; i++)
+    {
+        col_t *col = &convert->cols[i];
+        free(col->name);
+        free(col->dat.s);
+        free(col->off.s);
+        free(col->dict_new.s);
+        if ( col->dict ) khash_str2int_destroy_free(col->dict);
+    }
+    free(convert->cols);
+    free(convert->tmp.s);
     free(convert->undef_info_tag);
     free(convert->dat);
     free(convert->samples);
@@ -1576,18 +1703,22 @@ int convert_header(convert_t *convert, kstring_t *str)
     return str->l - l_ori;
 }
 
-int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
+static void check_undef_info_tag(convert_t *convert)
 {
-    if ( !convert->allow_undef_tags && convert->undef_info_tag )
-    {
-        kstring_t msg = {0,0,0};
-        ksprintf(&msg,"Error: no such tag defined in the VCF header: INFO/%s", convert->undef_info_tag);
+    if ( convert->allow_undef_tags || !convert->undef_info_tag ) return;
 
-        int hdr_id = bcf_hdr_id2int(convert->header,BCF_DT_ID,convert->undef_info_tag);
-        if ( hdr_id>=0 && bcf_hdr_idinfo_exists(convert->header,BCF_HL_FMT,hdr_id) )
-            ksprintf(&msg,". FORMAT fields must be enclosed in square brackets, e.g. \"[ %%%s]\"", convert->undef_info_tag);
-        error("%s\n", msg.s);
-    }
+    kstring_t msg = {0,0,0};
+    ksprintf(&msg,"Error: no such tag defined in the VCF header: INFO/%s", convert->undef_info_tag);
+
+    int hdr_id = bcf_hdr_id2int(convert->header,BCF_DT_ID,convert->undef_info_tag);
+    if ( hdr_id>=0 && bcf_hdr_idinfo_exists(convert->header,BCF_HL_FMT,hdr_id) )
+        ksprintf(&msg,". FORMAT fields must be enclosed in square brackets, e.g. \"[ %%%s]\"", convert->undef_info_tag);
+    error("%s\n", msg.s);
+}
+
+int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
+{
+    check_undef_info_tag(convert);
 
     int l_ori = str->l;
     bcf_unpack(line, convert->max_unpack);
@@ -1649,6 +1780,248 @@ int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
     return str->l - l_ori;
 }
 
+static inline void kput_u32le(uint32_t val, kstring_t *str)
+{
+    ks_resize(str, str->l+4);
+    uint8_t *p = (uint8_t*) str->s + str->l;
+    p[0] = val; p[1] = val>>8; p[2] = val>>16; p[3] = val>>24;
+    str->l += 4;
+}
+static inline void kput_f32le(float val, kstring_t *str)
+{
+    union { float f; uint32_t u; } x;
+    x.f = val;
+    kput_u32le(x.u, str);
+}
+
+// Numeric INFO and FORMAT tags with a single value per record (or sample) or
+// subscripted, such as DP or AD{1}, and Flags are output as typed columns
+static int tag_col_type(convert_t *convert, fmt_t *fmt)
+{
+    if ( !fmt->key ) return COL_STR;
+    int hl = fmt->type==T_INFO ? BCF_HL_INFO : BCF_HL_FMT;
+    int id = bcf_hdr_id2int(convert->header, BCF_DT_ID, fmt->key);
+    if ( id<0 || !bcf_hdr_idinfo_exists(convert->header,hl,id) ) return COL_STR;
+    int type = bcf_hdr_id2type(convert->header,hl,id);
+    if ( type==BCF_HT_FLAG ) return COL_INT32;
+    if ( type!=BCF_HT_INT && type!=BCF_HT_REAL ) return COL_STR;
+    if ( fmt->subscript<0 && (bcf_hdr_id2length(convert->header,hl,id)!=BCF_VL_FIXED || bcf_hdr_id2number(convert->header,hl,id)!=1) ) return COL_STR;
+    return type==BCF_HT_INT ? COL_INT32 : COL_FLOAT;
+}
+
+static void init_columns(convert_t *convert)
+{
+    int i, j, js, mcols = 0;
+    for (i=0; i<convert->nfmt; i++)
+    {
+        int jbeg = i, jend = i+1, nsmpl = 1;
+        if ( convert->fmt[i].is_gt_field )
+        {
+            while ( jend<convert->nfmt && convert->fmt[jend].is_gt_field ) jend++;
+            nsmpl = convert->nsamples;
+        }
+        for (js=0; js<nsmpl; js++)
+        {
+            for (j=jbeg; j<jend; j++)
+            {
+                fmt_t *fmt = &convert->fmt[j];
+                if ( fmt->type==T_SEP ) continue;
+
+                hts_expand0(col_t, convert->ncols+1, mcols, convert->cols);
+                col_t *col = &convert->cols[convert->ncols++];
+                col->ifmt = j;
+                col->isample = fmt->is_gt_field ? js : -1;
+                switch (fmt->type)
+                {
+                    case T_CHROM:
+                    case T_FILTER: col->type = COL_DICT; col->dict = khash_str2int_init(); break;
+                    case T_POS:
+                    case T_POS0:
+                    case T_END:
+                    case T_END0: col->type = COL_INT32; break;
+                    case T_QUAL: col->type = COL_FLOAT; break;
+                    case T_INFO:
+                    case T_FORMAT: col->type = tag_col_type(convert, fmt); break;
+                    default: col->type = COL_STR; break;
+                }
+                kstring_t str = {0,0,0};
+                if ( col->isample>=0 && fmt->type!=T_SAMPLE )
+                    ksprintf(&str, "%s:%s", convert->header->samples[convert->samples[js]], fmt->key);
+                else
+                    kputs(fmt->key ? fmt->key : "", &str);
+                col->name = str.s;
+            }
+        }
+        i = jend-1;
+    }
+}
+
+int convert_columns_header(convert_t *convert, kstring_t *str)
+{
+    if ( !convert->cols ) init_columns(convert);
+
+    int i, l_ori = str->l;
+    kputsn("BCFCOL1\0", 8, str);
+    kput_u32le(convert->ncols, str);
+    for (i=0; i<convert->ncols; i++)
+    {
+        col_t *col = &convert->cols[i];
+        int len = strlen(col->name);
+        kputc(col->type, str);
+        kput_u32le(len, str);
+        kputsn(col->name, len, str);
+    }
+    return str->l - l_ori;
+}
+
+static void push_numeric(convert_t *convert, col_t *col, fmt_t *fmt, bcf1_t *line, int isample)
+{
+    int n = 0, type = 0, idx = fmt->subscript>=0 ? fmt->subscript : 0;
+    void *ptr = NULL;
+    switch (fmt->type)
+    {
+        case T_POS:  kput_u32le(line->pos+1, &col->dat); return;
+        case T_POS0: kput_u32le(line->pos, &col->dat); return;
+        case T_END:  kput_u32le(line->pos+line->rlen, &col->dat); return;
+        case T_END0: kput_u32le(line->pos+line->rlen-1, &col->dat); return;
+        case T_QUAL: kput_f32le(line->qual, &col->dat); return;
+        case T_INFO:
+        {
+            int i;
+            for (i=0; i<line->n_info; i++)
+                if ( line->d.info[i].key == fmt->id ) break;
+            if ( bcf_hdr_id2type(convert->header,BCF_HL_INFO,fmt->id)==BCF_HT_FLAG )
+            {
+                kput_u32le(i<line->n_info ? 1 : 0, &col->dat);
+                return;
+            }
+            if ( i<line->n_info ) { n = line->d.info[i].len; type = line->d.info[i].type; ptr = line->d.info[i].vptr; }
+            break;
+        }
+        case T_FORMAT:
+            if ( !fmt->ready ) init_format(convert, line, fmt);
+            if ( fmt->fmt ) { n = fmt->fmt->n; type = fmt->fmt->type; ptr = fmt->fmt->p + isample*fmt->fmt->size; }
+            break;
+    }
+    if ( idx>=n || type==BCF_BT_CHAR ) ptr = NULL;
+
+    if ( col->type==COL_INT32 )
+    {
+        int32_t val = bcf_int32_missing;
+        if ( ptr && type==BCF_BT_FLOAT )
+        {
+            float f = ((float*)ptr)[idx];
+            if ( !bcf_float_is_missing(f) && !bcf_float_is_vector_end(f) ) val = f;
+        }
+        else if ( ptr )
+        {
+            val = bcf_array_ivalue(ptr, type, idx);
+            if ( val==bcf_int32_vector_end ) val = bcf_int32_missing;
+        }
+        kput_u32le(val, &col->dat);
+    }
+    else
+    {
+        float val;
+        bcf_float_set_missing(val);
+        if ( ptr && type==BCF_BT_FLOAT )
+        {
+            val = ((float*)ptr)[idx];
+            if ( bcf_float_is_vector_end(val) ) bcf_float_set_missing(val);
+        }
+        else if ( ptr )
+        {
+            int32_t ival = bcf_array_ivalue(ptr, type, idx);
+            if ( ival!=bcf_int32_missing && ival!=bcf_int32_vector_end ) val = ival;
+        }
+        kput_f32le(val, &col->dat);
+    }
+}
+
+int convert_columns_line(convert_t *convert, bcf1_t *line)
+{
+    check_undef_info_tag(convert);
+    bcf_unpack(line, convert->max_unpack);
+
+    int i, ir;
+    for (i=0; i<convert->nfmt; i++) convert->fmt[i].ready = 0;
+    for (i=0; i<convert->ncols; i++)
+    {
+        col_t *col = &convert->cols[i];
+        fmt_t *fmt = &convert->fmt[col->ifmt];
+        int ks = col->isample>=0 ? convert->samples[col->isample] : -1;
+        int skip = col->isample>=0 && convert->subset_samples && *convert->subset_samples && !(*convert->subset_samples)[col->isample];
+
+        if ( col->type==COL_INT32 || col->type==COL_FLOAT )
+        {
+            if ( !skip ) push_numeric(convert, col, fmt, line, ks);
+            else if ( col->type==COL_INT32 ) kput_u32le(bcf_int32_missing, &col->dat);
+            else { float val; bcf_float_set_missing(val); kput_f32le(val, &col->dat); }
+            continue;
+        }
+
+        kstring_t *str = col->type==COL_DICT ? &convert->tmp : &col->dat;
+        if ( col->type==COL_DICT ) str->l = 0;
+        if ( !convert->nrows && col->type==COL_STR ) kput_u32le(0, &col->off);
+        if ( skip ) kputc('.', str);
+        else if ( fmt->type==T_MASK )
+        {
+            for (ir=0; ir<convert->nreaders; ir++)
+                kputc(bcf_sr_has_line(convert->readers,ir)?'1':'0', str);
+        }
+        else if ( fmt->handler )
+            fmt->handler(convert, line, fmt, ks, str);
+
+        if ( col->type==COL_STR )
+        {
+            kput_u32le(str->l, &col->off);
+            continue;
+        }
+
+        int idx;
+        kputc(0, str);  // make sure the string is terminated even when empty
+        if ( khash_str2int_get(col->dict, str->s, &idx)!=0 )
+        {
+            idx = col->ndict++;
+            khash_str2int_set(col->dict, strdup(str->s), idx);
+            kput_u32le(str->l-1, &col->dict_new);
+            kputsn(str->s, str->l-1, &col->dict_new);
+            col->nnew++;
+        }
+        kput_u32le(idx, &col->dat);
+    }
+    convert->nrows++;
+    return convert->nrows;
+}
+
+int convert_columns_flush(convert_t *convert, kstring_t *str)
+{
+    int i, l_ori = str->l;
+    if ( !convert->nrows ) return 0;
+
+    kput_u32le(convert->nrows, str);
+    for (i=0; i<convert->ncols; i++)
+    {
+        col_t *col = &convert->cols[i];
+        if ( col->type==COL_STR )
+        {
+            kputsn(col->off.s, col->off.l, str);
+            col->off.l = 0;
+        }
+        else if ( col->type==COL_DICT )
+        {
+            kput_u32le(col->nnew, str);
+            kputsn(col->dict_new.s, col->dict_new.l, str);
+            col->dict_new.l = 0;
+            col->nnew = 0;
+        }
+        kputsn(col->dat.s, col->dat.l, str);
+        col->dat.l = 0;
+    }
+    convert->nrows = 0;
+    return str->l - l_ori;
+}
+
 int convert_set_option(convert_t *convert, enum convert_option opt, ...)
 {
     int ret = 0;
@@ -41,5 +41,28 @@ int convert_header(convert_t *convert, kstring_t *str);
 int convert_line(convert_t *convert, bcf1_t *rec, kstring_t *str);
 int convert_max_unpack(convert_t *convert);
 
+/*
+ *  Binary columnar output. The same format string is used but the separators
+ *  are ignored and each tag makes a column, one per sample for tags in square
+ *  brackets. All numbers are little-endian.
+ *
+ *  convert_columns_header() - initializes the columns and writes the header:
+ *      char[8] "BCFCOL1\0", uint32 ncols, and for each column
+ *      uint8 type (1:int32, 2:float, 3:string, 4:dictionary-encoded string),
+ *      uint32 name length, the name
+ *  convert_columns_line()   - adds one record to the current batch, returns
+ *      the number of records in the batch
+ *  convert_columns_flush()  - writes the batch and starts a new one:
+ *      uint32 nrows, and for each column
+ *          int32, float:   nrows values, missing values as in BCF
+ *          string:         uint32 offsets[nrows+1], the concatenated strings
+ *          dictionary:     uint32 nnew, nnew strings (uint32 length, the string)
+ *                          appended to the column's dictionary, int32 indexes[nrows]
+ *      The dictionary of a column grows over the batches.
+ */
+int convert_columns_header(convert_t *convert, kstring_t *str);
+int convert_columns_line(convert_t *convert, bcf1_t *line);
+int convert_columns_flush(convert_t *convert, kstring_t *str);
+
 #endif
 
@@ -143,16 +143,19 @@
 #include <htslib/khash.h>
 #include <htslib/khash_str2int.h>
 #include <htslib/kseq.h>
-#include <htslib/faidx.h>
+#include <htslib/tbx.h>
+#include <htslib/thread_pool.h>
 #include <errno.h>
 #include <unistd.h>
 #include <ctype.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "regidx.h"
+#include "regplan.h"
 #include "kheap.h"
 #include "smpl_ilist.h"
 #include "rbuf.h"
+#include "refseq.h"
 
 #ifndef __FUNCTION__
 #  define __FUNCTION__ __func__
@@ -168,6 +171,8 @@
 #define N_SPLICE_REGION_INTRON 8 
 
 #define N_REF_PAD 10    // number of bases to avoid boundary effects
+#define REF_WIN_SIZE (1<<20)    // the minimum length of reference sequence to fetch at once, see tscript_init_ref()
+#define HAP_NODE_BLOCK 1024     // the number of haplotype nodes allocated at once, see hap_node_alloc()
 
 #define STRAND_REV 0
 #define STRAND_FWD 1
@@ -417,9 +422,31 @@ struct _vbuf_t
     vrec_t **vrec;   // buffer of VCF lines with the same position
     int n, m;
     uint32_t keep_until;    // the maximum transcript end position
+    size_t mem;             // approximate size of the buffered lines and sample bitmasks
+    int nspill;             // the number of lines moved out of memory by vbuf_spill()
 };
 KHASH_MAP_INIT_INT(pos2vbuf, vbuf_t*)
 
+/*
+    With --max-buffer-mem, VCF lines which are fully annotated but cannot be
+    output yet because an earlier line is still waiting for its transcripts
+    are written to temporary files and read back in vbuf_flush(). The lines
+    are spilled in the order of the buffer and each temporary file (run) is
+    read sequentially, a new run is started when the reading starts.
+*/
+typedef struct
+{
+    size_t max_mem, mem, peak_mem;  // the limit, the current and the peak size of the buffer
+    uint64_t nspilled;              // the total number of spilled lines
+    int ibuf;                       // vcf_rbuf offset of the first vbuf that can be spilled
+    char *dir;                      // directory for the temporary files
+    char **run;                     // the temporary files, the first is being read, the last written
+    int nrun, mrun;
+    htsFile *wfh, *rfh;             // the run being written, read
+    bcf1_t *rec;
+}
+vbuf_spill_t;
+
 
 /*
     Structures related to haplotype-aware consequences in coding regions
@@ -553,10 +580,37 @@ typedef struct
     // ignored biotypes
     void *ignored_biotypes;
 
+    // contigs to load, str2int hash, NULL for all; see init_gff_seqs()
+    void *seq_filter;
+
     id_tbl_t gene_ids;   // temporary table for mapping between gene id (eg. Zm00001d027245) and a numeric idx
 }
 aux_t;
 
+typedef struct
+{
+    vrec_t *vrec;
+    uint32_t iword, mask;       // the word of vrec->smpl and its bits to set
+}
+hap_mask_t;
+typedef struct
+{
+    hap_node_t *node;           // the haplotype leaf the masks were built for
+    hap_mask_t *dat;
+    int n, m;
+    csq_t *trunc;               // the first consequence which did not fit in FMT/BCSQ
+}
+hap_masks_t;
+
+typedef struct
+{
+    hap_node_t **free;  // retired nodes, their child, cur_child and csq_list buffers are kept for reuse
+    int nfree, mfree;
+    hap_node_t **blk;   // nodes are allocated in blocks of HAP_NODE_BLOCK
+    int nblk, mblk, nused;
+}
+hap_pool_t;
+
 typedef struct _args_t
 {
     // the main regidx lookups, from chr:beg-end to overlapping features and
@@ -597,9 +651,12 @@ typedef struct _args_t
     int rid;                    // current chromosome
     tr_heap_t *active_tr;       // heap of active transcripts for quick flushing
     hap_t *hap;                 // transcript haplotype recursion
+    hap_pool_t hap_pool;        // haplotype tree nodes
+    hap_masks_t hmask[2];       // FMT/BCSQ bits of the last staged haplotype, one for each ihap
     vbuf_t **vcf_buf;           // buffered VCF lines to annotate with CSQ and flush
     rbuf_t vcf_rbuf;            // round buffer indexes to vcf_buf
     kh_pos2vbuf_t *pos2vbuf;    // fast lookup of buffered lines by position
+    vbuf_spill_t spill;         // the buffered lines over the --max-buffer-mem limit
     tscript_t **rm_tr;          // buffer of transcripts to clean
     int nrm_tr, mrm_tr;
     csq_t *csq_buf;             // pool of csq not managed by hap_node_t, i.e. non-CDS csqs
@@ -607,10 +664,16 @@ typedef struct _args_t
     id_tbl_t tscript_ids;       // mapping between transcript id (eg. Zm00001d027245_T001) and a numeric idx
     int force;                  // force run under various conditions. Currently only to skip out-of-phase transcripts
     int n_threads;              // extra compression/decompression threads
+    int32_t prev_rid, prev_pos; // the previous record, to check the sort order
+    int split_contigs;          // call groups of contigs in parallel, see csq_split()
+    char *tmp_dir, *targets_list;
+    int targets_is_file;
+    char *dump_cache;           // write the parsed GFF to this file, see gff_cache_dump()
 
-    faidx_t *fai;
+    refseq_t *ref;              // read in windows shared by overlapping transcripts
     kstring_t str, str2;
     int32_t *gt_arr, mgt_arr;
+    profile_t prof;
 }
 args_t;
 
@@ -969,6 +1032,14 @@ int gff_parse(args_t *args, char *line, ftr_t *ftr)
 
     char *chr_beg, *chr_end;
     gff_parse_chr(line, &chr_beg, &chr_end);
+    if ( args->init.seq_filter )
+    {
+        char c = chr_end[1];
+        chr_end[1] = 0;
+        int skip = khash_str2int_has_key(args->init.seq_filter, chr_beg) ? 0 : 1;
+        chr_end[1] = c;
+        if ( skip ) return -1;
+    }
     ss = gff_skip(line, chr_end + 2);
 
     // 3. column: is this a CDS, transcript, gene, etc.
@@ -1254,6 +1325,206 @@ void tscript_init_cds(args_t *args)
 void regidx_free_gf(void *payload) { free(*((gf_cds_t**)payload)); }
 void regidx_free_tscript(void *payload) { tscript_t *tr = *((tscript_t**)payload); free(tr->cds); free(tr); }
 
+/*
+    Binary cache of the parsed GFF, created with --dump-cache and recognised
+    by its magic string when given in place of the GFF with -g. It stores the
+    result of the text parsing in gff_parse(): the sequence names, transcript
+    ids, genes, transcripts and the list of exons, CDS and UTRs. The indexes
+    consist of pointers and are rebuilt on loading, which is fast compared to
+    parsing the text. The file is written in the native byte order and is
+    not portable between architectures.
+*/
+#define GFF_CACHE_MAGIC   "BCSQGFF"
+#define GFF_CACHE_VERSION 1
+
+static void gff_cache_write(FILE *fp, const void *dat, size_t size, const char *fname)
+{
+    if ( size && fwrite(dat, size, 1, fp)!=1 ) error("Failed to write to %s: %s\n", fname,strerror(errno));
+}
+static void gff_cache_write_u32(FILE *fp, uint32_t val, const char *fname)
+{
+    gff_cache_write(fp, &val, sizeof(val), fname);
+}
+static void gff_cache_write_str(FILE *fp, const char *str, const char *fname)
+{
+    // the length includes the terminating null byte, zero is reserved for NULL
+    uint32_t len = str ? strlen(str) + 1 : 0;
+    gff_cache_write_u32(fp, len, fname);
+    gff_cache_write(fp, str, len, fname);
+}
+static void gff_cache_read(FILE *fp, void *dat, size_t size, const char *fname)
+{
+    if ( size && fread(dat, size, 1, fp)!=1 ) error("Failed to read %s, the cache is truncated\n", fname);
+}
+static uint32_t gff_cache_read_u32(FILE *fp, const char *fname)
+{
+    uint32_t val;
+    gff_cache_read(fp, &val, sizeof(val), fname);
+    return val;
+}
+static char *gff_cache_read_str(FILE *fp, const char *fname)
+{
+    uint32_t len = gff_cache_read_u32(fp, fname);
+    if ( !len ) return NULL;
+    char *str = (char*) malloc(len);
+    gff_cache_read(fp, str, len, fname);
+    if ( str[len-1] ) error("Failed to read %s, the cache is corrupted\n", fname);
+    return str;
+}
+static int cmp_gene_ptr(const void *a, const void *b)
+{
+    uintptr_t pa = (uintptr_t) *((gf_gene_t**)a);
+    uintptr_t pb = (uintptr_t) *((gf_gene_t**)b);
+    if ( pa < pb ) return -1;
+    if ( pa > pb ) return 1;
+    return 0;
+}
+static void gff_cache_header(uint32_t *hdr)
+{
+    memcpy(hdr, GFF_CACHE_MAGIC, 8);
+    hdr[2] = GFF_CACHE_VERSION;
+    hdr[3] = 0x01020304;    // byte order
+    hdr[4] = sizeof(ftr_t);
+}
+static void gff_cache_dump(args_t *args)
+{
+    aux_t *aux = &args->init;
+    FILE *fp = fopen(args->dump_cache, "w");
+    if ( !fp ) error("Failed to write to %s: %s\n", args->dump_cache,strerror(errno));
+
+    uint32_t hdr[5];
+    gff_cache_header(hdr);
+    gff_cache_write(fp, hdr, sizeof(hdr), args->dump_cache);
+
+    int i;
+    gff_cache_write_u32(fp, aux->nseq, args->dump_cache);
+    for (i=0; i<aux->nseq; i++) gff_cache_write_str(fp, aux->seq[i], args->dump_cache);
+
+    gff_cache_write_u32(fp, args->tscript_ids.nstr, args->dump_cache);
+    for (i=0; i<args->tscript_ids.nstr; i++) gff_cache_write_str(fp, args->tscript_ids.str[i], args->dump_cache);
+
+    // genes are numbered by their position in an array sorted by address so
+    // that transcripts can refer to them
+    khint_t k;
+    int ngenes = 0;
+    gf_gene_t **genes = (gf_gene_t**) malloc(sizeof(*genes)*(kh_size(aux->gid2gene)+1));
+    for (k=0; k<kh_end(aux->gid2gene); k++)
+        if ( kh_exist(aux->gid2gene, k) ) genes[ngenes++] = kh_val(aux->gid2gene, k);
+    qsort(genes, ngenes, sizeof(*genes), cmp_gene_ptr);
+    gff_cache_write_u32(fp, ngenes, args->dump_cache);
+    for (i=0; i<ngenes; i++)
+    {
+        gff_cache_write_u32(fp, genes[i]->iseq, args->dump_cache);
+        gff_cache_write_str(fp, genes[i]->name, args->dump_cache);
+    }
+
+    gff_cache_write_u32(fp, kh_size(aux->id2tr), args->dump_cache);
+    for (k=0; k<kh_end(aux->id2tr); k++)
+    {
+        if ( !kh_exist(aux->id2tr, k) ) continue;
+        tscript_t *tr = kh_val(aux->id2tr, k);
+        gf_gene_t **gene = (gf_gene_t**) bsearch(&tr->gene, genes, ngenes, sizeof(*genes), cmp_gene_ptr);
+        uint32_t dat[6] = { tr->id, gene - genes, tr->beg, tr->end, tr->strand, tr->type };
+        gff_cache_write(fp, dat, sizeof(dat), args->dump_cache);
+    }
+    free(genes);
+
+    // features of unknown transcripts would be discarded anyway
+    int nftr = 0;
+    for (i=0; i<aux->nftr; i++)
+        if ( kh_get(int2tscript, aux->id2tr, (int)aux->ftr[i].trid)!=kh_end(aux->id2tr) ) nftr++;
+    gff_cache_write_u32(fp, nftr, args->dump_cache);
+    for (i=0; i<aux->nftr; i++)
+        if ( kh_get(int2tscript, aux->id2tr, (int)aux->ftr[i].trid)!=kh_end(aux->id2tr) )
+            gff_cache_write(fp, &aux->ftr[i], sizeof(ftr_t), args->dump_cache);
+
+    khash_t(str2int) *ign = (khash_t(str2int)*)aux->ignored_biotypes;
+    gff_cache_write_u32(fp, khash_str2int_size(aux->ignored_biotypes), args->dump_cache);
+    for (k = kh_begin(ign); k < kh_end(ign); k++)
+    {
+        if ( !kh_exist(ign,k) ) continue;
+        gff_cache_write_str(fp, kh_key(ign,k), args->dump_cache);
+        gff_cache_write_u32(fp, kh_value(ign,k), args->dump_cache);
+    }
+
+    if ( fclose(fp)!=0 ) error("Close failed: %s\n", args->dump_cache);
+}
+static int gff_cache_load(args_t *args)
+{
+    aux_t *aux = &args->init;
+    const char *fname = args->gff_fname;
+    FILE *fp = fopen(fname, "r");
+    if ( !fp ) return 0;    // let hts_open() report the error
+
+    uint32_t hdr[5], exp[5];
+    gff_cache_header(exp);
+    if ( fread(hdr, sizeof(hdr), 1, fp)!=1 || memcmp(hdr, exp, 8) ) { fclose(fp); return 0; }   // not a cache
+    if ( memcmp(hdr, exp, sizeof(hdr)) ) error("The GFF cache %s was created by an incompatible version or on a different architecture\n", fname);
+
+    int i, n = gff_cache_read_u32(fp, fname);
+    for (i=0; i<n; i++)
+    {
+        hts_expand(char*, aux->nseq+1, aux->mseq, aux->seq);
+        aux->seq[aux->nseq] = gff_cache_read_str(fp, fname);
+        khash_str2int_inc(aux->seq2int, aux->seq[aux->nseq]);
+        aux->nseq++;
+    }
+
+    n = gff_cache_read_u32(fp, fname);
+    id_tbl_t *tbl = &args->tscript_ids;
+    for (i=0; i<n; i++)
+    {
+        hts_expand(char*, tbl->nstr+1, tbl->mstr, tbl->str);
+        tbl->str[tbl->nstr] = gff_cache_read_str(fp, fname);
+        khash_str2int_set(tbl->str2id, tbl->str[tbl->nstr], tbl->nstr);
+        tbl->nstr++;
+    }
+
+    int ngenes = gff_cache_read_u32(fp, fname);
+    gf_gene_t **genes = (gf_gene_t**) malloc(sizeof(*genes)*(ngenes+1));
+    for (i=0; i<ngenes; i++)
+    {
+        genes[i] = gene_init(aux, i);
+        genes[i]->iseq = gff_cache_read_u32(fp, fname);
+        genes[i]->name = gff_cache_read_str(fp, fname);
+        if ( genes[i]->iseq >= aux->nseq ) error("Failed to read %s, the cache is corrupted\n", fname);
+    }
+
+    n = gff_cache_read_u32(fp, fname);
+    for (i=0; i<n; i++)
+    {
+        uint32_t dat[6];
+        gff_cache_read(fp, dat, sizeof(dat), fname);
+        if ( dat[0] >= tbl->nstr || dat[1] >= ngenes ) error("Failed to read %s, the cache is corrupted\n", fname);
+        tscript_t *tr = (tscript_t*) calloc(1,sizeof(tscript_t));
+        tr->id     = dat[0];
+        tr->gene   = genes[dat[1]];
+        tr->beg    = dat[2];
+        tr->end    = dat[3];
+        tr->strand = dat[4];
+        tr->type   = dat[5];
+
+        int ret;
+        khint_t k = kh_put(int2tscript, aux->id2tr, (int)tr->id, &ret);
+        kh_val(aux->id2tr,k) = tr;
+    }
+    free(genes);
+
+    aux->nftr = gff_cache_read_u32(fp, fname);
+    hts_expand(ftr_t, aux->nftr, aux->mftr, aux->ftr);
+    gff_cache_read(fp, aux->ftr, sizeof(ftr_t)*aux->nftr, fname);
+
+    n = gff_cache_read_u32(fp, fname);
+    for (i=0; i<n; i++)
+    {
+        char *key = gff_cache_read_str(fp, fname);
+        khash_str2int_set(aux->ignored_biotypes, key, gff_cache_read_u32(fp, fname));
+    }
+
+    if ( fclose(fp)!=0 ) error("Close failed: %s\n", fname);
+    return 1;
+}
+
 void init_gff(args_t *args)
 {
     aux_t *aux = &args->init;
@@ -1266,17 +1537,21 @@ void init_gff(args_t *args)
     gff_id_init(&args->tscript_ids);
 
     // parse gff
-    kstring_t str = {0,0,0};
-    htsFile *fp = hts_open(args->gff_fname,"r");
-    if ( !fp ) error("Failed to read %s\n", args->gff_fname);
-    while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
+    if ( !gff_cache_load(args) )
     {
-        hts_expand(ftr_t, aux->nftr+1, aux->mftr, aux->ftr);
-        int ret = gff_parse(args, str.s, aux->ftr + aux->nftr);
-        if ( !ret ) aux->nftr++;
+        kstring_t str = {0,0,0};
+        htsFile *fp = hts_open(args->gff_fname,"r");
+        if ( !fp ) error("Failed to read %s\n", args->gff_fname);
+        while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
+        {
+            hts_expand(ftr_t, aux->nftr+1, aux->mftr, aux->ftr);
+            int ret = gff_parse(args, str.s, aux->ftr + aux->nftr);
+            if ( !ret ) aux->nftr++;
+        }
+        free(str.s);
+        if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->gff_fname);
     }
-    free(str.s);
-    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->gff_fname);
+    if ( args->dump_cache ) gff_cache_dump(args);
 
 
     // process gff information: connect CDS and exons to transcripts
@@ -1346,24 +1621,100 @@ void init_gff(args_t *args)
     khash_str2int_destroy_free(aux->ignored_biotypes);
 }
 
-void init_data(args_t *args)
+static void init_calling(args_t *args)
 {
-    args->nfmt_bcsq = 1 + (args->ncsq_max - 1) / 32; 
-
-    if ( args->verbosity > 0 ) fprintf(stderr,"Parsing %s ...\n", args->gff_fname);
-    init_gff(args);
-
     args->rid = -1;
+    args->prev_rid = args->prev_pos = -1;
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
 
-    args->fai = fai_load(args->fa_fname);
-    if ( !args->fai ) error("Failed to load the fai index: %s\n", args->fa_fname);
+    args->ref = refseq_init(args->fa_fname);
+    if ( !args->ref ) error("Failed to load the fai index: %s\n", args->fa_fname);
+    refseq_set_window(args->ref, REF_WIN_SIZE, 0);
 
     args->pos2vbuf  = kh_init(pos2vbuf);
     args->active_tr = khp_init(trhp);
+
+    // the limit and the directory are set by the main thread, the rest is per worker
+    vbuf_spill_t *spill = &args->spill;
+    size_t max_mem = spill->max_mem;
+    char *dir = spill->dir;
+    memset(spill, 0, sizeof(*spill));
+    spill->max_mem = max_mem;
+    spill->dir = dir;
     args->hap = (hap_t*) calloc(1,sizeof(hap_t));
+}
+
+static void init_header(args_t *args)
+{
+    bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=.,Type=String,Description=\"%s consequence annotation from BCFtools/csq, see http://samtools.github.io/bcftools/howtos/csq-calling.html for details. Format: Consequence|gene|transcript|biotype|strand|amino_acid_change|dna_change\">",args->bcsq_tag, args->local_csq ? "Local" : "Haplotype-aware");
+    if ( args->hdr_nsmpl ) 
+        bcf_hdr_printf(args->hdr,"##FORMAT=<ID=%s,Number=.,Type=Integer,Description=\"Bitmask of indexes to INFO/BCSQ, with interleaved first/second haplotype. Use \\\"bcftools query -f'[%%CHROM\\t%%POS\\t%%SAMPLE\\t%%TBCSQ\\n]'\\\" to translate.\">",args->bcsq_tag);
+}
+
+/*
+    Only the contigs which can appear in the output need to be loaded from
+    the GFF: the -r/-R regions or, if the input is indexed, the contigs with
+    records. Not applied when the GFF is saved with --dump-cache.
+*/
+static void init_gff_seqs(args_t *args)
+{
+    if ( args->dump_cache ) return;
+
+    bcf_sr_regions_t *regs = args->sr->regions;
+    int i;
+    if ( regs )
+    {
+        args->init.seq_filter = khash_str2int_init();
+        for (i=0; i<regs->nseqs; i++)
+            if ( !khash_str2int_has_key(args->init.seq_filter, regs->seq_names[i]) )
+                khash_str2int_inc(args->init.seq_filter, strdup(regs->seq_names[i]));
+        return;
+    }
+
+    bcf_sr_t *reader = &args->sr->readers[0];
+    if ( !strcmp("-",reader->fname) ) return;
+    tbx_t *tbx = reader->tbx_idx;
+    hts_idx_t *idx = reader->bcf_idx;
+    int own_idx = 0;
+    if ( !tbx && !idx )
+    {
+        const htsFormat *fmt = hts_get_format(reader->file);
+        if ( fmt->format==bcf ) idx = bcf_index_load(reader->fname);
+        else if ( fmt->format==vcf && fmt->compression==bgzf ) tbx = tbx_index_load(reader->fname);
+        own_idx = 1;
+    }
+    if ( !tbx && !idx ) return;     // not indexed, load all
+
+    int nseq;
+    const char **names = tbx ? tbx_seqnames(tbx, &nseq) : bcf_index_seqnames(idx, args->hdr, &nseq);
+    args->init.seq_filter = khash_str2int_init();
+    for (i=0; i<nseq; i++)
+    {
+        uint64_t mapped, unmapped;
+        if ( hts_idx_get_stat(tbx ? tbx->idx : idx, i, &mapped, &unmapped)==0 && !mapped ) continue;
+        if ( !khash_str2int_has_key(args->init.seq_filter, names[i]) )
+            khash_str2int_inc(args->init.seq_filter, strdup(names[i]));
+    }
+    free(names);
+    if ( own_idx )
+    {
+        if ( tbx ) tbx_destroy(tbx);
+        else hts_idx_destroy(idx);
+    }
+}
+
+void init_data(args_t *args)
+{
+    args->nfmt_bcsq = 1 + (args->ncsq_max - 1) / 32; 
+
+    if ( args->verbosity > 0 ) fprintf(stderr,"Parsing %s ...\n", args->gff_fname);
+    init_gff_seqs(args);
+    init_gff(args);
+    if ( args->init.seq_filter ) khash_str2int_destroy_free(args->init.seq_filter);
+    args->init.seq_filter = NULL;
+    init_calling(args);
 
     // init samples
     if ( !bcf_hdr_nsamples(args->hdr) ) args->phase = PHASE_DROP_GT;
@@ -1409,44 +1760,32 @@ void init_data(args_t *args)
         if ( args->n_threads > 0)
             hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->sr->p);
         if ( args->record_cmd_line ) bcf_hdr_append_version(args->hdr,args->argc,args->argv,"bcftools/csq");
-        bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=.,Type=String,Description=\"%s consequence annotation from BCFtools/csq, see http://samtools.github.io/bcftools/howtos/csq-calling.html for details. Format: Consequence|gene|transcript|biotype|strand|amino_acid_change|dna_change\">",args->bcsq_tag, args->local_csq ? "Local" : "Haplotype-aware");
-        if ( args->hdr_nsmpl ) 
-            bcf_hdr_printf(args->hdr,"##FORMAT=<ID=%s,Number=.,Type=Integer,Description=\"Bitmask of indexes to INFO/BCSQ, with interleaved first/second haplotype. Use \\\"bcftools query -f'[%%CHROM\\t%%POS\\t%%SAMPLE\\t%%TBCSQ\\n]'\\\" to translate.\">",args->bcsq_tag);
+        init_header(args);
         if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
     }
     if ( args->verbosity > 0 ) fprintf(stderr,"Calling...\n");
 }
 
-void destroy_data(args_t *args)
+static void destroy_calling(args_t *args)
 {
-    regidx_destroy(args->idx_cds);
-    regidx_destroy(args->idx_utr);
-    regidx_destroy(args->idx_exon);
-    regidx_destroy(args->idx_tscript);
-    regitr_destroy(args->itr);
-
-    khint_t k,i,j;
-    for (k=0; k<kh_end(args->init.gid2gene); k++)
-    {
-        if ( !kh_exist(args->init.gid2gene, k) ) continue;
-        gf_gene_t *gene = (gf_gene_t*) kh_val(args->init.gid2gene, k);
-        free(gene->name);
-        free(gene);
-    }
-    kh_destroy(int2gene,args->init.gid2gene);
-
+    khint_t i,j;
     if ( args->filter )
         filter_destroy(args->filter);
 
     khp_destroy(trhp,args->active_tr);
     kh_destroy(pos2vbuf,args->pos2vbuf);
-    if ( args->smpl ) smpl_ilist_destroy(args->smpl);
-    int ret;
-    if ( args->out_fh )
-        ret = hts_close(args->out_fh);
-    else
-        ret = fclose(args->out);
-    if ( ret ) error("Error: close failed .. %s\n", args->output_fname?args->output_fname:"stdout");
+    vbuf_spill_t *spill = &args->spill;
+    if ( spill->max_mem && spill->peak_mem && args->verbosity > 0 )
+        fprintf(stderr,"Buffered VCF lines: peak %.1fMB, %"PRIu64" lines spilled to temporary files\n", spill->peak_mem/1e6,spill->nspilled);
+    if ( spill->wfh ) hts_close(spill->wfh);
+    if ( spill->rfh ) hts_close(spill->rfh);
+    for (i=0; i<spill->nrun; i++)
+    {
+        unlink(spill->run[i]);
+        free(spill->run[i]);
+    }
+    free(spill->run);
+    if ( spill->rec ) bcf_destroy(spill->rec);
     for (i=0; i<args->vcf_rbuf.m; i++)
     {
         vbuf_t *vbuf = args->vcf_buf[i];
@@ -1465,18 +1804,62 @@ void destroy_data(args_t *args)
     free(args->vcf_buf);
     free(args->rm_tr);
     free(args->csq_buf);
+    hap_pool_t *pool = &args->hap_pool;
+    for (i=0; i<pool->nfree; i++)
+    {
+        free(pool->free[i]->child);
+        free(pool->free[i]->cur_child);
+        free(pool->free[i]->csq_list);
+    }
+    free(pool->free);
+    for (i=0; i<pool->nblk; i++) free(pool->blk[i]);
+    free(pool->blk);
+    free(args->hmask[0].dat);
+    free(args->hmask[1].dat);
     free(args->hap->stack);
     free(args->hap->sseq.s);
     free(args->hap->tseq.s);
     free(args->hap->tref.s);
     free(args->hap);
-    fai_destroy(args->fai);
+    refseq_destroy(args->ref);
     free(args->gt_arr);
     free(args->str.s);
     free(args->str2.s);
+}
+
+static void destroy_gff(args_t *args)
+{
+    regidx_destroy(args->idx_cds);
+    regidx_destroy(args->idx_utr);
+    regidx_destroy(args->idx_exon);
+    regidx_destroy(args->idx_tscript);
+    regitr_destroy(args->itr);
+
+    khint_t k;
+    for (k=0; k<kh_end(args->init.gid2gene); k++)
+    {
+        if ( !kh_exist(args->init.gid2gene, k) ) continue;
+        gf_gene_t *gene = (gf_gene_t*) kh_val(args->init.gid2gene, k);
+        free(gene->name);
+        free(gene);
+    }
+    kh_destroy(int2gene,args->init.gid2gene);
     gff_id_destroy(&args->tscript_ids);
 }
 
+void destroy_data(args_t *args)
+{
+    destroy_gff(args);
+    if ( args->smpl ) smpl_ilist_destroy(args->smpl);
+    int ret;
+    if ( args->out_fh )
+        ret = hts_close(args->out_fh);
+    else
+        ret = fclose(args->out);
+    if ( ret ) error("Error: close failed .. %s\n", args->output_fname?args->output_fname:"stdout");
+    destroy_calling(args);
+}
+
 /*
     The splice_* functions are for consquences around splice sites: start,stop,splice_*
  */
@@ -2298,18 +2681,41 @@ fprintf(stderr,"cds splice_csq: %d [%s][%s] .. beg,end=%d %d, ret=%d, csq=%d\n\n
     free(splice.kalt.s);
     return 0;
 }
-void hap_destroy(hap_node_t *hap)
+static hap_node_t *hap_node_alloc(args_t *args)
+{
+    hap_pool_t *pool = &args->hap_pool;
+    if ( pool->nfree ) return pool->free[--pool->nfree];
+    if ( !pool->nblk || pool->nused==HAP_NODE_BLOCK )
+    {
+        hts_expand(hap_node_t*, pool->nblk+1, pool->mblk, pool->blk);
+        pool->blk[pool->nblk++] = (hap_node_t*) calloc(HAP_NODE_BLOCK, sizeof(hap_node_t));
+        pool->nused = 0;
+    }
+    return &pool->blk[pool->nblk-1][pool->nused++];
+}
+void hap_destroy(args_t *args, hap_node_t *hap)
 {
     int i;
     for (i=0; i<hap->nchild; i++)
-        if ( hap->child[i] ) hap_destroy(hap->child[i]);
+        if ( hap->child[i] ) hap_destroy(args, hap->child[i]);
     for (i=0; i<hap->mcsq_list; i++) free(hap->csq_list[i].type.vstr.s);
-    free(hap->csq_list);
-    free(hap->child);
-    free(hap->cur_child);
     free(hap->seq);
     free(hap->var);
-    free(hap);
+
+    // return the node to the pool, cleared as if newly allocated but with the buffers kept
+    hap_node_t **child = hap->child, tmp;
+    int *cur_child = hap->cur_child;
+    csq_t *csq_list = hap->csq_list;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.child = child; tmp.mchild = hap->mchild;
+    tmp.cur_child = cur_child; tmp.mcur_child = hap->mcur_child;
+    tmp.csq_list = csq_list; tmp.mcsq_list = hap->mcsq_list;
+    if ( csq_list ) memset(csq_list, 0, sizeof(*csq_list)*hap->mcsq_list);
+    *hap = tmp;
+
+    hap_pool_t *pool = &args->hap_pool;
+    hts_expand(hap_node_t*, pool->nfree+1, pool->mfree, pool->free);
+    pool->free[pool->nfree++] = hap;
 }
 
 
@@ -3087,27 +3493,53 @@ static inline void hap_stage_vcf(args_t *args, tscript_t *tr, int ismpl, int iha
 {
     if ( !node || !node->ncsq_list || ismpl<0 ) return;
 
+    // Samples with the same haplotype share the leaf node. The bits are
+    // collected once per node, merged by word, and then only scattered to
+    // the samples
     int i;
-    for (i=0; i<node->ncsq_list; i++)
+    hap_masks_t *hmask = &args->hmask[ihap];
+    if ( hmask->node!=node )
     {
-        csq_t *csq = node->csq_list + i;
-        vrec_t *vrec = csq->vrec;
-        int icsq = 2*csq->idx + ihap;
-        if ( icsq >= args->ncsq_max ) // more than ncsq_max consequences, so can't fit it in FMT
+        hmask->node  = node;
+        hmask->n     = 0;
+        hmask->trunc = NULL;
+        for (i=0; i<node->ncsq_list; i++)
         {
-            if ( args->verbosity && (!args->ncsq_small_warned || args->verbosity > 1) )
+            csq_t *csq = node->csq_list + i;
+            vrec_t *vrec = csq->vrec;
+            int icsq = 2*csq->idx + ihap;
+            if ( icsq >= args->ncsq_max ) // more than ncsq_max consequences, so can't fit it in FMT
             {
-                fprintf(stderr,
-                    "Warning: Too many consequences for sample %s at %s:%"PRId64", keeping the first %d and skipping the rest.\n",
-                    args->hdr->samples[ismpl],bcf_hdr_id2name(args->hdr,args->rid),(int64_t) vrec->line->pos+1,csq->idx);
-                if ( !args->ncsq_small_warned )
-                    fprintf(stderr,"         The limit can be increased by setting the --ncsq parameter. This warning is printed only once.\n");
-                args->ncsq_small_warned = 1;
+                hmask->trunc = csq;
+                break;
             }
-            break;
+            if ( vrec->nfmt < 1 + icsq/32 ) vrec->nfmt = 1 + icsq/32;
+            hap_mask_t *last = hmask->n ? &hmask->dat[hmask->n-1] : NULL;
+            if ( last && last->vrec==vrec && last->iword==icsq/32 )
+            {
+                last->mask |= 1 << (icsq % 32);
+                continue;
+            }
+            hts_expand(hap_mask_t, hmask->n+1, hmask->m, hmask->dat);
+            last = &hmask->dat[hmask->n++];
+            last->vrec  = vrec;
+            last->iword = icsq/32;
+            last->mask  = 1 << (icsq % 32);
         }
-        if ( vrec->nfmt < 1 + icsq/32 ) vrec->nfmt = 1 + icsq/32;
-        vrec->smpl[ismpl*args->nfmt_bcsq + icsq/32] |= 1 << (icsq % 32);
+    }
+    for (i=0; i<hmask->n; i++)
+    {
+        hap_mask_t *mask = &hmask->dat[i];
+        mask->vrec->smpl[ismpl*args->nfmt_bcsq + mask->iword] |= mask->mask;
+    }
+    if ( hmask->trunc && args->verbosity && (!args->ncsq_small_warned || args->verbosity > 1) )
+    {
+        fprintf(stderr,
+            "Warning: Too many consequences for sample %s at %s:%"PRId64", keeping the first %d and skipping the rest.\n",
+            args->hdr->samples[ismpl],bcf_hdr_id2name(args->hdr,args->rid),(int64_t) hmask->trunc->vrec->line->pos+1,hmask->trunc->idx);
+        if ( !args->ncsq_small_warned )
+            fprintf(stderr,"         The limit can be increased by setting the --ncsq parameter. This warning is printed only once.\n");
+        args->ncsq_small_warned = 1;
     }
 }
 
@@ -3139,6 +3571,8 @@ void hap_flush(args_t *args, uint32_t pos)
             }
             else if ( args->phase!=PHASE_DROP_GT )
             {
+                // the nodes are freed with the transcript and their addresses can be reused
+                args->hmask[0].node = args->hmask[1].node = NULL;
                 for (i=0; i<args->smpl->n; i++)
                 {
                     for (j=0; j<2; j++)
@@ -3174,6 +3608,8 @@ vbuf_t *vbuf_push(args_t *args, bcf1_t **rec_ptr)
         if ( !args->vcf_buf[i] ) args->vcf_buf[i] = (vbuf_t*) calloc(1,sizeof(vbuf_t));
         args->vcf_buf[i]->n = 0;
         args->vcf_buf[i]->keep_until = 0;
+        args->vcf_buf[i]->mem = 0;
+        args->vcf_buf[i]->nspill = 0;
     }
     vbuf_t *vbuf = args->vcf_buf[i];
     vbuf->n++;
@@ -3190,6 +3626,12 @@ vbuf_t *vbuf_push(args_t *args, bcf1_t **rec_ptr)
     if ( !vrec->line ) vrec->line = bcf_init1();
     SWAP(bcf1_t*, (*rec_ptr), vrec->line);
 
+    size_t mem = sizeof(bcf1_t) + vrec->line->shared.l + vrec->line->indiv.l;
+    if ( vrec->smpl ) mem += args->hdr_nsmpl*sizeof(*vrec->smpl)*args->nfmt_bcsq;
+    vbuf->mem += mem;
+    args->spill.mem += mem;
+    if ( args->spill.peak_mem < args->spill.mem ) args->spill.peak_mem = args->spill.mem;
+
     int ret;
     khint_t k = kh_put(pos2vbuf, args->pos2vbuf, (int)rec->pos, &ret);
     kh_val(args->pos2vbuf,k) = vbuf;
@@ -3197,9 +3639,142 @@ vbuf_t *vbuf_push(args_t *args, bcf1_t **rec_ptr)
     return vbuf;
 }
 
+static inline void write_line(args_t *args, bcf1_t *line)
+{
+    profile_lap(&args->prof, PROF_PROCESS);
+    if ( bcf_write(args->out_fh, args->hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
+    profile_lap(&args->prof, PROF_WRITE);
+    args->prof.nrec_out++;
+}
+
+// add INFO/BCSQ and FORMAT/BCSQ to the line
+static void vrec_annotate(args_t *args, vrec_t *vrec)
+{
+    int j;
+    args->str.l = 0;
+    kput_vcsq(args, &vrec->vcsq[0], &args->str);
+    for (j=1; j<vrec->nvcsq; j++)
+    {
+        kputc_(',', &args->str);
+        kput_vcsq(args, &vrec->vcsq[j], &args->str);
+    }
+    bcf_update_info_string(args->hdr, vrec->line, args->bcsq_tag, args->str.s);
+    if ( args->hdr_nsmpl )
+    {
+        if ( vrec->nfmt < args->nfmt_bcsq )
+            for (j=1; j<args->hdr_nsmpl; j++)
+                memmove(&vrec->smpl[j*vrec->nfmt], &vrec->smpl[j*args->nfmt_bcsq], vrec->nfmt*sizeof(*vrec->smpl));
+        bcf_update_format_int32(args->hdr, vrec->line, args->bcsq_tag, vrec->smpl, args->hdr_nsmpl*vrec->nfmt);
+    }
+}
+
+static void vbuf_spill_write(args_t *args, vrec_t *vrec)
+{
+    vbuf_spill_t *spill = &args->spill;
+    if ( !spill->wfh )
+    {
+        kstring_t str = {0,0,0};
+        ksprintf(&str, "%s/bcftools-csq-spill.XXXXXX", spill->dir ? spill->dir : "/tmp");
+        int fd = mkstemp(str.s);
+        if ( fd==-1 ) error("Error: failed to create a temporary file %s: %s\n", str.s,strerror(errno));
+        close(fd);
+        spill->wfh = hts_open(str.s, "wbu");
+        if ( !spill->wfh ) error("[%s] Error: cannot write to %s: %s\n", __func__,str.s,strerror(errno));
+        if ( bcf_hdr_write(spill->wfh, args->hdr)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,str.s);
+        hts_expand(char*, spill->nrun+1, spill->mrun, spill->run);
+        spill->run[spill->nrun++] = str.s;
+    }
+    if ( bcf_write(spill->wfh, args->hdr, vrec->line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,spill->run[spill->nrun-1]);
+}
+
+// copy the next n spilled lines to the output
+static void vbuf_spill_read(args_t *args, int n)
+{
+    vbuf_spill_t *spill = &args->spill;
+    if ( !spill->rec ) spill->rec = bcf_init1();
+    while ( n > 0 )
+    {
+        if ( !spill->rfh )
+        {
+            assert( spill->nrun );
+            if ( spill->nrun==1 && spill->wfh )
+            {
+                // new lines will be spilled into a new run
+                if ( hts_close(spill->wfh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,spill->run[0]);
+                spill->wfh = NULL;
+            }
+            spill->rfh = hts_open(spill->run[0], "r");
+            if ( !spill->rfh ) error("[%s] Error: cannot read %s: %s\n", __func__,spill->run[0],strerror(errno));
+            bcf_hdr_t *hdr = bcf_hdr_read(spill->rfh);
+            if ( !hdr ) error("[%s] Error: cannot read the header of %s\n", __func__,spill->run[0]);
+            bcf_hdr_destroy(hdr);
+        }
+        int ret = bcf_read(spill->rfh, args->hdr, spill->rec);
+        if ( ret < -1 ) error("[%s] Error: cannot read from %s\n", __func__,spill->run[0]);
+        if ( ret == -1 )
+        {
+            // the run is exhausted, continue with the next one
+            hts_close(spill->rfh);
+            spill->rfh = NULL;
+            unlink(spill->run[0]);
+            free(spill->run[0]);
+            memmove(spill->run, spill->run+1, (spill->nrun-1)*sizeof(*spill->run));
+            spill->nrun--;
+            continue;
+        }
+        write_line(args, spill->rec);
+        n--;
+    }
+}
+
+/*
+    Move the fully annotated vbufs queued behind the first vbuf, which
+    still waits for its transcripts, out of memory until the buffer is under
+    the --max-buffer-mem limit. The last vbuf is kept so that duplicate
+    positions can be appended to it. Only the lines' data are released,
+    vrec_t and the line's position remain, because later consequences can
+    refer to it (CSQ_PRINTED_UPSTREAM).
+*/
+static void vbuf_spill(args_t *args, uint32_t pos)
+{
+    vbuf_spill_t *spill = &args->spill;
+    if ( spill->ibuf < 1 ) spill->ibuf = 1;
+    while ( spill->mem > spill->max_mem && spill->ibuf < args->vcf_rbuf.n - 1 )
+    {
+        vbuf_t *vbuf = args->vcf_buf[ rbuf_kth(&args->vcf_rbuf, spill->ibuf) ];
+        if ( vbuf->keep_until > pos ) break;  // can be spilled only in order, when the transcripts are done
+        spill->ibuf++;
+        if ( !vbuf->n ) continue;
+
+        int i, vpos = vbuf->vrec[0]->line->pos;
+        for (i=0; i<vbuf->n; i++)
+        {
+            vrec_t *vrec = vbuf->vrec[i];
+            if ( args->out_fh )     // with text output the lines are no longer needed
+            {
+                if ( vrec->nvcsq ) vrec_annotate(args, vrec);
+                vbuf_spill_write(args, vrec);
+                spill->nspilled++;
+            }
+            vrec->nvcsq = 0;
+            int save_pos = vrec->line->pos;
+            bcf_empty(vrec->line);
+            vrec->line->pos = save_pos;
+            free(vrec->smpl);
+            vrec->smpl = NULL;
+        }
+        khint_t k = kh_get(pos2vbuf, args->pos2vbuf, vpos);
+        if ( k != kh_end(args->pos2vbuf) ) kh_del(pos2vbuf, args->pos2vbuf, k);
+        if ( args->out_fh ) vbuf->nspill = vbuf->n;
+        vbuf->n = 0;
+        spill->mem -= vbuf->mem;
+        vbuf->mem = 0;
+    }
+}
+
 void vbuf_flush(args_t *args, uint32_t pos)
 {
-    int i,j;
+    int i;
     while ( args->vcf_rbuf.n )
     {
         vbuf_t *vbuf;
@@ -3209,12 +3784,17 @@ void vbuf_flush(args_t *args, uint32_t pos)
             // cannot output buffered VCF lines (args.vbuf) until the active transcripts are gone
             vbuf = args->vcf_buf[ args->vcf_rbuf.f ];
             if ( vbuf->keep_until > pos ) break;
-            assert( vbuf->n );
         }
 
         i = rbuf_shift(&args->vcf_rbuf);
         assert( i>=0 );
+        if ( args->spill.ibuf > 0 ) args->spill.ibuf--;
         vbuf = args->vcf_buf[i];
+        if ( vbuf->nspill )
+        {
+            vbuf_spill_read(args, vbuf->nspill);
+            vbuf->nspill = 0;
+        }
         int pos = vbuf->n ? vbuf->vrec[0]->line->pos : -1;
         for (i=0; i<vbuf->n; i++)
         {
@@ -3224,35 +3804,12 @@ void vbuf_flush(args_t *args, uint32_t pos)
                 vrec->nvcsq = 0;
                 continue;
             }
-            if ( !vrec->nvcsq )
-            {
-                if ( bcf_write(args->out_fh, args->hdr, vrec->line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
-                int save_pos = vrec->line->pos;
-                bcf_empty(vrec->line);
-                vrec->line->pos = save_pos;  // this is necessary for compound variants
-                continue;
-            }
-            
-            args->str.l = 0;
-            kput_vcsq(args, &vrec->vcsq[0], &args->str);
-            for (j=1; j<vrec->nvcsq; j++)
-            {
-                kputc_(',', &args->str);
-                kput_vcsq(args, &vrec->vcsq[j], &args->str);
-            }
-            bcf_update_info_string(args->hdr, vrec->line, args->bcsq_tag, args->str.s);
-            if ( args->hdr_nsmpl )
-            {
-                if ( vrec->nfmt < args->nfmt_bcsq )
-                    for (j=1; j<args->hdr_nsmpl; j++)
-                        memmove(&vrec->smpl[j*vrec->nfmt], &vrec->smpl[j*args->nfmt_bcsq], vrec->nfmt*sizeof(*vrec->smpl));
-                bcf_update_format_int32(args->hdr, vrec->line, args->bcsq_tag, vrec->smpl, args->hdr_nsmpl*vrec->nfmt);
-            }
+            if ( vrec->nvcsq ) vrec_annotate(args, vrec);
             vrec->nvcsq = 0;
-            if ( bcf_write(args->out_fh, args->hdr, vrec->line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
+            write_line(args, vrec->line);
             int save_pos = vrec->line->pos;
             bcf_empty(vrec->line);
-            vrec->line->pos = save_pos;
+            vrec->line->pos = save_pos;  // this is necessary for compound variants
         }
         if ( pos!=-1 )
         {
@@ -3260,13 +3817,16 @@ void vbuf_flush(args_t *args, uint32_t pos)
             if ( k != kh_end(args->pos2vbuf) ) kh_del(pos2vbuf, args->pos2vbuf, k);
         }
         vbuf->n = 0;
+        args->spill.mem -= vbuf->mem;
+        vbuf->mem = 0;
     }
+    if ( args->spill.max_mem && args->spill.mem > args->spill.max_mem ) vbuf_spill(args, pos);
     if ( args->active_tr->ndat ) return;
 
     for (i=0; i<args->nrm_tr; i++)
     {
         tscript_t *tr = args->rm_tr[i];
-        if ( tr->root ) hap_destroy(tr->root);
+        if ( tr->root ) hap_destroy(args, tr->root);
         tr->root = NULL;
         free(tr->hap);
         free(tr->ref);
@@ -3281,22 +3841,20 @@ void tscript_init_ref(args_t *args, tscript_t *tr, const char *chr)
     int i, len;
     int pad_beg = tr->beg >= N_REF_PAD ? N_REF_PAD : tr->beg;
 
-    tr->ref = faidx_fetch_seq(args->fai, chr, tr->beg - pad_beg, tr->end + N_REF_PAD, &len);
-    if ( !tr->ref )
-        error("faidx_fetch_seq failed %s:%d-%d\n", chr,tr->beg+1,tr->end+1);
+    // the transcripts are initialized in the order of VCF records and mostly reuse the same window
+    hts_pos_t nseq;
+    const char *seq = refseq_fetch(args->ref, chr, tr->beg - pad_beg, tr->end + N_REF_PAD, &nseq);
+    if ( !seq ) error("Failed to fetch the reference sequence %s:%d-%d\n", chr,tr->beg-pad_beg+1,tr->end+N_REF_PAD+1);
+    len = nseq;
 
+    // pad with N's at the contig ends
     int pad_end = len - (tr->end - tr->beg + 1 + pad_beg);
-    if ( pad_beg + pad_end != 2*N_REF_PAD )
-    {
-        char *ref = (char*) malloc(tr->end - tr->beg + 1 + 2*N_REF_PAD + 1);
-        for (i=0; i < N_REF_PAD - pad_beg; i++) ref[i] = 'N';
-        memcpy(ref+i, tr->ref, len);
-        len += i;
-        for (i=0; i < N_REF_PAD - pad_end; i++) ref[i+len] = 'N';
-        ref[i+len] = 0;
-        free(tr->ref);
-        tr->ref = ref;
-    }
+    tr->ref = (char*) malloc(tr->end - tr->beg + 1 + 2*N_REF_PAD + 1);
+    for (i=0; i < N_REF_PAD - pad_beg; i++) tr->ref[i] = 'N';
+    memcpy(tr->ref+i, seq, len);
+    len += i;
+    for (i=0; i < N_REF_PAD - pad_end; i++) tr->ref[i+len] = 'N';
+    tr->ref[i+len] = 0;
 }
 
 static void sanity_check_ref(args_t *args, tscript_t *tr, bcf1_t *rec)
@@ -3468,7 +4026,7 @@ int test_cds_local(args_t *args, bcf1_t *rec)
 
                     // all this only to clean vstr when vrec is flushed
                     if ( !tr->root )
-                        tr->root = (hap_node_t*) calloc(1,sizeof(hap_node_t));
+                        tr->root = hap_node_alloc(args);
                     tr->root->ncsq_list++;
                     hts_expand0(csq_t,tr->root->ncsq_list,tr->root->mcsq_list,tr->root->csq_list);
                     csq_t *rm_csq = tr->root->csq_list + tr->root->ncsq_list - 1;
@@ -3508,7 +4066,7 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
             // initialize the transcript and its haplotype tree, fetch the reference sequence
             tscript_init_ref(args, tr, chr);
 
-            tr->root = (hap_node_t*) calloc(1,sizeof(hap_node_t));
+            tr->root = hap_node_alloc(args);
             tr->nhap = args->phase==PHASE_DROP_GT ? 1 : 2*args->smpl->n;     // maximum ploidy = diploid
             tr->hap  = (hap_node_t**) malloc(tr->nhap*sizeof(hap_node_t*));
             for (i=0; i<tr->nhap; i++) tr->hap[i] = NULL;
@@ -3524,7 +4082,7 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
         {
             if ( rec->d.allele[1][0]=='<' || rec->d.allele[1][0]=='*' ) { continue; }
             hap_node_t *parent = tr->hap[0] ? tr->hap[0] : tr->root;
-            hap_node_t *child  = (hap_node_t*)calloc(1,sizeof(hap_node_t));
+            hap_node_t *child  = hap_node_alloc(args);
             hap_ret = hap_init(args, parent, child, cds, rec, 1);
             if ( hap_ret!=0 )
             {
@@ -3544,7 +4102,7 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
                         fprintf(args->out,"LOG\tWarning: Skipping overlapping variants at %s:%"PRId64"\t%s>%s\n", chr,(int64_t) rec->pos+1,rec->d.allele[0],rec->d.allele[1]);
                 }
                 else ret = 1;   // prevent reporting as intron in test_tscript
-                hap_destroy(child);
+                hap_destroy(args, child);
                 continue;
             }
             if ( child->type==HAP_SSS )
@@ -3558,14 +4116,13 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
                 csq.type.gene    = tr->gene->name;
                 csq.type.type = child->csq;
                 csq_stage(args, &csq, rec);
-                hap_destroy(child);
+                hap_destroy(args, child);
                 ret = 1;
                 continue;
             }
             parent->nend--;
             parent->nchild = 1;
-            parent->mchild = 1;
-            parent->child  = (hap_node_t**) malloc(sizeof(hap_node_t*));
+            hts_expand(hap_node_t*, 1, parent->mchild, parent->child);
             parent->child[0] = child;
             tr->hap[0] = child;
             tr->hap[0]->nend = 1;
@@ -3636,7 +4193,7 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
                     continue;
                 }
 
-                hap_node_t *child = (hap_node_t*)calloc(1,sizeof(hap_node_t));
+                hap_node_t *child = hap_node_alloc(args);
                 hap_ret = hap_init(args, parent, child, cds, rec, ial);
                 if ( hap_ret!=0 )
                 {
@@ -3656,7 +4213,7 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
                             fprintf(args->out,"LOG\tWarning: Skipping overlapping variants at %s:%"PRId64", sample %s\t%s>%s\n",
                                     chr,(int64_t) rec->pos+1,args->hdr->samples[args->smpl->idx[ismpl]],rec->d.allele[0],rec->d.allele[ial]);
                     }
-                    hap_destroy(child);
+                    hap_destroy(args, child);
                     continue;
                 }
                 if ( child->type==HAP_SSS )
@@ -3670,7 +4227,7 @@ int test_cds(args_t *args, bcf1_t *rec, vbuf_t *vbuf)
                     csq.type.gene    = tr->gene->name;
                     csq.type.type = child->csq;
                     csq_stage(args, &csq, rec);
-                    hap_destroy(child);
+                    hap_destroy(args, child);
                     continue;
                 }
                 if ( parent->cur_rec!=rec )
@@ -3992,10 +4549,9 @@ static void process(args_t *args, bcf1_t **rec_ptr)
     }
 
     bcf1_t *rec = *rec_ptr;
-    static int32_t prev_rid = -1, prev_pos = -1;
-    if ( prev_rid!=rec->rid ) { prev_rid = rec->rid; prev_pos = rec->pos; }
-    if ( prev_pos > rec->pos )
-        error("Error: The file is not sorted, %s:%d comes before %s:%"PRId64"\n",bcf_seqname(args->hdr,rec),prev_pos+1,bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
+    if ( args->prev_rid!=rec->rid ) { args->prev_rid = rec->rid; args->prev_pos = rec->pos; }
+    if ( args->prev_pos > rec->pos )
+        error("Error: The file is not sorted, %s:%d comes before %s:%"PRId64"\n",bcf_seqname(args->hdr,rec),args->prev_pos+1,bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
 
     int call_csq = 1;
     if ( rec->n_allele < 2 ) call_csq = 0;   // no alternate allele
@@ -4006,8 +4562,10 @@ static void process(args_t *args, bcf1_t **rec_ptr)
     }
     if ( call_csq && args->filter )
     {
+        profile_lap(&args->prof, PROF_PROCESS);
         call_csq = filter_test(args->filter, rec, NULL);
         if ( args->filter_logic==FLT_EXCLUDE ) call_csq = call_csq ? 0 : 1;
+        profile_lap(&args->prof, PROF_FILTER);
     }
     if ( !call_csq )
     {
@@ -4045,6 +4603,177 @@ static void process(args_t *args, bcf1_t **rec_ptr)
     return;
 }
 
+static void csq_records(args_t *args)
+{
+    profile_t *prof = &args->prof;
+    prof->nsmpl = bcf_hdr_nsamples(args->hdr);
+    profile_mark(prof);
+    while ( bcf_sr_next_line(args->sr) )
+    {
+        profile_lap(prof, PROF_READ);
+        prof->nrec_in++;
+        process(args, &args->sr->readers[0].buffer[0]);
+        profile_lap(prof, PROF_PROCESS);
+    }
+    profile_lap(prof, PROF_READ);
+    process(args,NULL);
+    profile_lap(prof, PROF_PROCESS);
+}
+
+/*
+    Parallel calling: the contigs of the indexed input file are split into
+    groups of about the same number of records and each group is called by
+    a worker thread into a temporary file. The transcript model is parsed
+    only once and shared: transcripts and the per-contig regidx lists, which
+    are modified during calling, never span contigs and are therefore only
+    ever touched by one worker. Each worker has its own reader, filter, fasta
+    index and VCF/haplotype buffers. The main thread copies the temporary
+    files to the output in the original order of contigs.
+*/
+typedef struct
+{
+    args_t *args;       // the main thread's data, initialized by init_data()
+    const char *fname;  // the input file
+    char *regions;      // comma-separated list of contigs
+    char *tmp_fname;    // temporary output file
+}
+csq_chunk_t;
+
+static void *csq_chunk(void *arg)
+{
+    csq_chunk_t *chunk = (csq_chunk_t*) arg;
+    args_t *args = (args_t*) malloc(sizeof(args_t));
+    *args = *chunk->args;
+    args->prof.format = 0;
+
+    // reset the per-worker data, the rest is shared read-only with the main thread
+    args->sr = bcf_sr_init();
+    args->sr->require_index = 1;
+    if ( args->targets_list && bcf_sr_set_targets(args->sr, args->targets_list, args->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", args->targets_list);
+    if ( bcf_sr_set_regions(args->sr, chunk->regions, 0)<0 ) error("Failed to set the regions: %s\n", chunk->regions);
+    if ( !bcf_sr_add_reader(args->sr, chunk->fname) ) error("Failed to read from %s: %s\n", chunk->fname,bcf_sr_strerror(args->sr->errnum));
+    args->hdr = bcf_sr_get_header(args->sr,0);
+    args->itr = regitr_init(NULL);
+    args->filter = NULL;
+    args->vcf_buf = NULL;
+    memset(&args->vcf_rbuf, 0, sizeof(args->vcf_rbuf));
+    args->rm_tr = NULL; args->nrm_tr = args->mrm_tr = 0;
+    args->csq_buf = NULL; args->ncsq_buf = args->mcsq_buf = 0;
+    memset(&args->str, 0, sizeof(args->str));
+    memset(&args->str2, 0, sizeof(args->str2));
+    args->gt_arr = NULL; args->mgt_arr = 0;
+    memset(args->hmask, 0, sizeof(args->hmask));
+    memset(&args->hap_pool, 0, sizeof(args->hap_pool));
+    init_calling(args);
+
+    args->out = NULL;
+    args->out_fh = NULL;
+    if ( args->output_type==FT_TAB_TEXT )
+    {
+        if ( args->sample_list && !strcmp("-",args->sample_list) && bcf_hdr_set_samples(args->hdr,NULL,0) < 0 )
+            error_errno("[%s] Couldn't build sample filter", __func__);
+        args->out = fopen(chunk->tmp_fname,"w");
+        if ( !args->out ) error("Failed to write to %s: %s\n", chunk->tmp_fname,strerror(errno));
+    }
+    else
+    {
+        args->out_fh = hts_open(chunk->tmp_fname,"wbu");
+        if ( !args->out_fh ) error("[%s] Error: cannot write to %s: %s\n", __func__,chunk->tmp_fname,strerror(errno));
+        init_header(args);
+        if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,chunk->tmp_fname);
+    }
+
+    csq_records(args);
+
+    int ret = args->out_fh ? hts_close(args->out_fh) : fclose(args->out);
+    if ( ret ) error("Error: close failed .. %s\n", chunk->tmp_fname);
+    destroy_calling(args);
+    regitr_destroy(args->itr);
+    bcf_sr_destroy(args->sr);
+    free(args);
+    return chunk;
+}
+
+static void csq_split(args_t *args, const char *fname)
+{
+    bcf_sr_t *reader = &args->sr->readers[0];
+    if ( !reader->tbx_idx && !reader->bcf_idx ) error("The --split-contigs option requires an indexed input file\n");
+
+    // consecutive groups of contigs with similar number of records, empty contigs are skipped
+    int i, nchunks;
+    regplan_chunk_t *plan = regplan_contigs(args->sr, 4*args->n_threads, &nchunks);
+    char *tmp_dir = regplan_tmpdir(args->tmp_dir, "/tmp/bcftools-csq.XXXXXX");
+    args->spill.dir = tmp_dir;
+    csq_chunk_t *chunks = (csq_chunk_t*) calloc(nchunks ? nchunks : 1, sizeof(csq_chunk_t));
+    kstring_t str = {0,0,0};
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].args  = args;
+        chunks[i].fname = fname;
+        chunks[i].regions = plan[i].regions;
+        str.l = 0;
+        ksprintf(&str, "%s/%05d.%s", tmp_dir, i, args->output_type==FT_TAB_TEXT ? "txt" : "bcf");
+        chunks[i].tmp_fname = strdup(str.s);
+    }
+    free(str.s);
+
+    hts_tpool *pool = nchunks ? hts_tpool_init(args->n_threads) : NULL;
+    hts_tpool_process *queue = NULL;
+    if ( nchunks )
+    {
+        if ( !pool ) error("Failed to initialize %d threads\n", args->n_threads);
+        queue = hts_tpool_process_init(pool, nchunks, 0);
+        for (i=0; i<nchunks; i++)
+            if ( hts_tpool_dispatch(pool, queue, csq_chunk, &chunks[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    }
+
+    // copy the chunks to the output in order
+    bcf1_t *rec = bcf_init1();
+    char *buf = args->output_type==FT_TAB_TEXT ? (char*) malloc(1<<16) : NULL;
+    for (i=0; i<nchunks; i++)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        csq_chunk_t *chunk = (csq_chunk_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        if ( args->output_type==FT_TAB_TEXT )
+        {
+            FILE *fp = fopen(chunk->tmp_fname, "r");
+            if ( !fp ) error("Could not read %s: %s\n", chunk->tmp_fname, strerror(errno));
+            size_t nread;
+            while ( (nread=fread(buf, 1, 1<<16, fp)) > 0 )
+                if ( fwrite(buf, 1, nread, args->out)!=nread ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
+            if ( ferror(fp) ) error("Error reading %s\n", chunk->tmp_fname);
+            fclose(fp);
+        }
+        else
+        {
+            htsFile *fh = hts_open(chunk->tmp_fname, "r");
+            if ( !fh ) error("Could not read %s: %s\n", chunk->tmp_fname, strerror(errno));
+            bcf_hdr_t *hdr = bcf_hdr_read(fh);
+            if ( !hdr ) error("Could not read the header of %s\n", chunk->tmp_fname);
+            int ret;
+            while ( (ret=bcf_read(fh, hdr, rec))==0 )
+                if ( bcf_write1(args->out_fh, args->hdr, rec)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
+            if ( ret < -1 ) error("Error reading %s\n", chunk->tmp_fname);
+            bcf_hdr_destroy(hdr);
+            if ( hts_close(fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->tmp_fname);
+        }
+        unlink(chunk->tmp_fname);
+        free(chunk->tmp_fname);
+    }
+    free(buf);
+    bcf_destroy1(rec);
+    if ( queue ) hts_tpool_process_destroy(queue);
+    if ( pool ) hts_tpool_destroy(pool);
+    free(chunks);
+    regplan_destroy(plan, nchunks);
+    regplan_tmpdir_destroy(tmp_dir);
+    args->spill.dir = NULL;
+}
+
 static const char *usage(void)
 {
     return 
@@ -4069,18 +4798,23 @@ static const char *usage(void)
         "                                     s: skip unphased hets\n"
         "Options:\n"
         "   -e, --exclude <expr>            exclude sites for which the expression is true\n"
+        "       --dump-cache <file>         save the parsed GFF to a binary file which can be given to -g in later runs\n"
         "       --force                     run even if some sanity checks fail\n"
         "   -i, --include <expr>            select sites for which the expression is true\n"
         "       --no-version                do not append version and command line to the header\n"
         "   -o, --output <file>             write output to a file [standard output]\n"
         "   -O, --output-type <b|u|z|v|t>   b: compressed BCF, u: uncompressed BCF, z: compressed VCF\n"
         "                                   v: uncompressed VCF, t: plain tab-delimited text output [v]\n"
+        "       --profile[=json]            print time spent in reading, filtering, calling and writing to stderr\n"
         "   -r, --regions <region>          restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
         "   -s, --samples <-|list>          samples to include or \"-\" to apply all variants and ignore samples\n"
         "   -S, --samples-file <file>       samples to include\n"
         "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n"
+        "       --split-contigs             call groups of contigs in parallel in --threads worker threads\n"
+        "       --max-buffer-mem <float>[kMG]  spill annotated records waiting for output to temporary files above this limit\n"
+        "       --temp-dir <dir>            directory for temporary files with --split-contigs and --max-buffer-mem [/tmp/bcftools-csq.XXXXXX]\n"
         "       --threads <int>             use multithreading with <int> worker threads [0]\n"
         "   -v, --verbose <int>             verbosity level 0-2 [1]\n"
         "\n"
@@ -4093,6 +4827,8 @@ static const char *usage(void)
         "\n";
 }
 
+size_t parse_mem_string(const char *str);
+
 int main_csq(int argc, char *argv[])
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -4128,6 +4864,11 @@ int main_csq(int argc, char *argv[])
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
         {"no-version",no_argument,NULL,3},
+        {"split-contigs",no_argument,NULL,4},
+        {"temp-dir",required_argument,NULL,5},
+        {"dump-cache",required_argument,NULL,6},
+        {"profile",optional_argument,NULL,7},
+        {"max-buffer-mem",required_argument,NULL,8},
         {0,0,0,0}
     };
     int c, targets_is_file = 0, regions_is_file = 0; 
@@ -4142,6 +4883,13 @@ int main_csq(int argc, char *argv[])
                 if ( *tmp ) error("Could not parse argument: --threads  %s\n", optarg);
                 break;
             case  3 : args->record_cmd_line = 0; break;
+            case  4 : args->split_contigs = 1; break;
+            case  5 : args->tmp_dir = optarg; break;
+            case  6 : args->dump_cache = optarg; break;
+            case  7 :
+                if ( profile_init(&args->prof, "csq", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
+            case  8 : args->spill.max_mem = parse_mem_string(optarg); break;
             case 'b': args->brief_predictions = 1; break;
             case 'l': args->local_csq = 1; break;
             case 'c': args->bcsq_tag = optarg; break;
@@ -4191,6 +4939,16 @@ int main_csq(int argc, char *argv[])
             default: error("The option not recognised: %s\n\n", optarg); break;
         }
     }
+    if ( args->dump_cache && optind==argc )
+    {
+        // only create the cache
+        if ( !args->gff_fname ) error("Missing the --gff option\n");
+        if ( args->verbosity > 0 ) fprintf(stderr,"Parsing %s ...\n", args->gff_fname);
+        init_gff(args);
+        destroy_gff(args);
+        free(args);
+        return 0;
+    }
     char *fname = NULL;
     if ( optind==argc )
     {
@@ -4201,7 +4959,22 @@ int main_csq(int argc, char *argv[])
     if ( argc - optind>1 ) error("%s", usage());
     if ( !args->fa_fname ) error("Missing the --fa-ref option\n");
     if ( !args->gff_fname ) error("Missing the --gff option\n");
+    if ( args->split_contigs )
+    {
+        if ( args->n_threads<=0 ) error("The --split-contigs option requires --threads\n");
+        if ( regions_list ) error("The --split-contigs option cannot be combined with -r/-R\n");
+        if ( !strcmp("-",fname) ) error("The --split-contigs option requires an indexed input file\n");
+    }
+    else if ( args->tmp_dir )
+    {
+        // a template is meant for --split-contigs, the spilled records go to /tmp then
+        size_t len = strlen(args->tmp_dir);
+        if ( len<6 || strcmp("XXXXXX",args->tmp_dir+len-6) ) args->spill.dir = args->tmp_dir;
+    }
+    args->targets_list = targets_list;
+    args->targets_is_file = targets_is_file;
     args->sr = bcf_sr_init();
+    if ( args->split_contigs ) args->sr->require_index = 1;
     if ( targets_list && bcf_sr_set_targets(args->sr, targets_list, targets_is_file, 0)<0 )
         error("Failed to read the targets: %s\n", targets_list);
     if ( regions_list && bcf_sr_set_regions(args->sr, regions_list, regions_is_file)<0 )
@@ -4212,13 +4985,13 @@ int main_csq(int argc, char *argv[])
     args->hdr = bcf_sr_get_header(args->sr,0);
 
     init_data(args);
-    while ( bcf_sr_next_line(args->sr) )
-    {
-        process(args, &args->sr->readers[0].buffer[0]);
-    }
-    process(args,NULL);
+    if ( args->split_contigs )
+        csq_split(args, fname);
+    else
+        csq_records(args);
 
     destroy_data(args);
+    profile_report(&args->prof, stderr);
     bcf_sr_destroy(args->sr);
     free(args);
     return 0;
@@ -32,16 +32,23 @@
 #ifdef _WIN32
 #include <windows.h>
 #endif
+#include <htslib/bgzf.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "extsort.h"
 #include "kheap.h"
 
+#define IO_BUF_SIZE (1<<20)     // the temporary files are written and read in chunks of this size
+
 typedef struct
 {
     extsort_t *es;  // this is to get access to extsort_cmp_f from kheap
     int fd;
+    BGZF *bgzf;     // with COMPRESSION_LEVEL, the temporary file is read via BGZF
     char *fname;
     void *dat;
+    uint8_t *rbuf;  // read-ahead buffer
+    size_t nrbuf, irbuf;
 }
 blk_t;
 
@@ -53,6 +60,10 @@ struct _extsort_t
     size_t dat_size, mem, max_mem;
     char *tmp_prefix;
     extsort_cmp_f cmp;
+    int clevel;         // BGZF compression level of the temporary files or -1
+    hts_tpool *pool;    // optional, for parallel sorting and (de)compression
+    uint8_t *wbuf;
+    size_t nwbuf, rbuf_size;
 
     size_t nbuf, mbuf, nblk;
     blk_t **blk;
@@ -108,12 +119,20 @@ void extsort_set(extsort_t *es, extsort_opt_t key, void *value)
     }
     if ( key==TMP_PREFIX ) { _init_tmp_prefix(es, *((const char**)value)); return; }
     if ( key==FUNC_CMP ) { es->cmp = *((extsort_cmp_f*)value); return; }
+    if ( key==COMPRESSION_LEVEL )
+    {
+        es->clevel = *((int*)value);
+        if ( es->clevel < -1 || es->clevel > 9 ) error("The compression level must be in the range 0-9 or -1 for none: %d\n", es->clevel);
+        return;
+    }
+    if ( key==THREAD_POOL ) { es->pool = *((hts_tpool**)value); return; }
 }
 
 extsort_t *extsort_alloc(void)
 {
     extsort_t *es = (extsort_t*) calloc(1,sizeof(*es));
     es->max_mem = 100e6;
+    es->clevel  = -1;
     return es;
 }
 void extsort_init(extsort_t *es)
@@ -122,6 +141,7 @@ void extsort_init(extsort_t *es)
     assert( es->dat_size );
     if ( !es->tmp_prefix ) _init_tmp_prefix(es, NULL);
     es->tmp_dat = malloc(es->dat_size);
+    es->wbuf = (uint8_t*) malloc(IO_BUF_SIZE > es->dat_size ? IO_BUF_SIZE : es->dat_size);
 }
 
 void extsort_destroy(extsort_t *es)
@@ -130,7 +150,9 @@ void extsort_destroy(extsort_t *es)
     for (i=0; i<es->nblk; i++)
     {
         blk_t *blk = es->blk[i];
-        if ( blk->fd!=-1 )
+        if ( blk->bgzf )
+            bgzf_close(blk->bgzf);
+        else if ( blk->fd!=-1 )
 #ifdef _WIN32
             _close(blk->fd);
 #else
@@ -138,22 +160,122 @@ void extsort_destroy(extsort_t *es)
 #endif
         free(blk->fname);
         free(blk->dat);
+        free(blk->rbuf);
         free(blk);
     }
     free(es->tmp_dat);
+    free(es->wbuf);
     free(es->tmp_prefix);
     free(es->blk);
     khp_destroy(blk, es->bhp);
     free(es);
 }
 
+static void _write_all(blk_t *blk, const uint8_t *dat, size_t len)
+{
+    while ( len )
+    {
+#ifdef _WIN32
+        ssize_t ret = _write(blk->fd, dat, len);
+#else
+        ssize_t ret = write(blk->fd, dat, len);
+#endif
+        if ( ret<=0 ) error("Error: failed to write %zu bytes to the temporary file %s\n",len,blk->fname);
+        dat += ret;
+        len -= ret;
+    }
+}
+
+// Items are collected into large chunks rather than written one by one
+static void _blk_write(extsort_t *es, blk_t *blk, BGZF *bgzf, void *dat)
+{
+    if ( dat )
+    {
+        memcpy(es->wbuf + es->nwbuf, dat, es->dat_size);
+        es->nwbuf += es->dat_size;
+        if ( es->nwbuf + es->dat_size <= IO_BUF_SIZE ) return;
+    }
+    if ( !es->nwbuf ) return;
+    if ( bgzf )
+    {
+        if ( bgzf_write(bgzf, es->wbuf, es->nwbuf)!=es->nwbuf ) error("Error: failed to write %zu bytes to the temporary file %s\n",es->nwbuf,blk->fname);
+    }
+    else
+        _write_all(blk, es->wbuf, es->nwbuf);
+    es->nwbuf = 0;
+}
+
+// A range of the buffer sorted by one thread
+typedef struct
+{
+    extsort_t *es;
+    size_t beg, end;
+}
+sort_job_t;
+
+static void *_sort_job(void *arg)
+{
+    sort_job_t *job = (sort_job_t*) arg;
+    qsort(job->es->buf + job->beg, job->end - job->beg, sizeof(void*), job->es->cmp);
+    return NULL;
+}
+
+/*
+    Sort the buffer and write it to the temporary file. With a thread pool, the buffer is split
+    into one chunk per thread, the chunks are sorted in parallel and merged while writing
+*/
+static void _buf_sort_write(extsort_t *es, blk_t *blk, BGZF *bgzf)
+{
+    size_t i;
+    int j, nchunk = es->pool ? hts_tpool_size(es->pool) : 1;
+    if ( es->nbuf < 10000 ) nchunk = 1;
+    if ( nchunk<=1 )
+    {
+        qsort(es->buf, es->nbuf, sizeof(void*), es->cmp);
+        for (i=0; i<es->nbuf; i++)
+        {
+            _blk_write(es, blk, bgzf, es->buf[i]);
+            free(es->buf[i]);
+        }
+        _blk_write(es, blk, bgzf, NULL);
+        return;
+    }
+
+    sort_job_t *job = (sort_job_t*) malloc(sizeof(*job)*nchunk);
+    hts_tpool_process *queue = hts_tpool_process_init(es->pool, nchunk, 1);
+    if ( !queue ) error("Error: failed to initialize the thread pool queue\n");
+    for (j=0; j<nchunk; j++)
+    {
+        job[j].es  = es;
+        job[j].beg = es->nbuf*j/nchunk;
+        job[j].end = es->nbuf*(j+1)/nchunk;
+        if ( hts_tpool_dispatch(es->pool, queue, _sort_job, &job[j])!=0 ) error("Error: failed to dispatch a sorting job\n");
+    }
+    if ( hts_tpool_process_flush(queue)!=0 ) error("Error: failed to sort the buffer\n");
+    hts_tpool_process_destroy(queue);
+
+    // the number of chunks is small, a linear scan of the chunk heads is enough
+    while ( 1 )
+    {
+        int jmin = -1;
+        for (j=0; j<nchunk; j++)
+        {
+            if ( job[j].beg >= job[j].end ) continue;
+            if ( jmin<0 || es->cmp(&es->buf[job[j].beg], &es->buf[job[jmin].beg]) < 0 ) jmin = j;
+        }
+        if ( jmin<0 ) break;
+        void *dat = es->buf[job[jmin].beg++];
+        _blk_write(es, blk, bgzf, dat);
+        free(dat);
+    }
+    _blk_write(es, blk, bgzf, NULL);
+    free(job);
+}
+
 static void _buf_flush(extsort_t *es)
 {
-    int i;
     if ( !es->nbuf ) return;
 
-    qsort(es->buf, es->nbuf, sizeof(void*), es->cmp);
-
     es->nblk++;
     es->blk = (blk_t**) realloc(es->blk, sizeof(blk_t*)*es->nblk);
     es->blk[es->nblk-1] = (blk_t*) calloc(1,sizeof(blk_t));
@@ -162,6 +284,7 @@ static void _buf_flush(extsort_t *es)
     blk->dat   = malloc(es->dat_size);
     blk->fname = strdup(es->tmp_prefix);
     #ifdef _WIN32
+        int i;
         for (i=0; i<100000; i++)
         {
             memcpy(blk->fname,es->tmp_prefix,strlen(es->tmp_prefix));
@@ -183,15 +306,23 @@ static void _buf_flush(extsort_t *es)
         unlink(blk->fname); // should auto delete when closed on linux, the descriptor remains open
     #endif
 
-    for (i=0; i<es->nbuf; i++)
+    BGZF *bgzf = NULL;
+    if ( es->clevel >= 0 )
     {
-        #ifdef _WIN32
-            if ( _write(blk->fd, es->buf[i], es->dat_size)!=es->dat_size ) error("Error: failed to write %zu bytes to the temporary file %s\n",es->dat_size,blk->fname);
-        #else
-            if ( write(blk->fd, es->buf[i], es->dat_size)!=es->dat_size ) error("Error: failed to write %zu bytes to the temporary file %s\n",es->dat_size,blk->fname);
-        #endif
-        free(es->buf[i]);
+        // bgzf_close() closes the descriptor, write via a duplicate so that the file can be read back
+        char mode[4] = "w0";
+        mode[1] = '0' + es->clevel;
+#ifdef _WIN32
+        int fd = _dup(blk->fd);
+#else
+        int fd = dup(blk->fd);
+#endif
+        if ( fd<0 || !(bgzf = bgzf_dopen(fd, mode)) ) error("Error: failed to open the temporary file %s\n",blk->fname);
+        if ( es->pool ) bgzf_thread_pool(bgzf, es->pool, 0);
     }
+    _buf_sort_write(es, blk, bgzf);
+    if ( bgzf && bgzf_close(bgzf)!=0 ) error("Error: failed to write to the temporary file %s\n",blk->fname);
+
 #ifdef _WIN32
     if ( _lseek(blk->fd,0,SEEK_SET)!=0 ) error("Error: failed to lseek() to the start of the temporary file %s\n", blk->fname);
 #else
@@ -215,26 +346,60 @@ void extsort_push(extsort_t *es, void *dat)
 // return number of elements read
 static ssize_t _blk_read(extsort_t *es, blk_t *blk)
 {
-    ssize_t ret = 0;
-    if ( blk->fd==-1 ) return ret;
+    if ( blk->irbuf < blk->nrbuf )
+    {
+        memcpy(blk->dat, blk->rbuf + blk->irbuf, es->dat_size);
+        blk->irbuf += es->dat_size;
+        return es->dat_size;
+    }
+    if ( blk->fd==-1 )
+    {
+        free(blk->rbuf);
+        blk->rbuf = NULL;
+        return 0;
+    }
+
+    // refill the read-ahead buffer, it holds a whole number of items
+    size_t size = es->rbuf_size / es->dat_size;
+    if ( !size ) size = 1;
+    size *= es->dat_size;
+    if ( !blk->rbuf ) blk->rbuf = (uint8_t*) malloc(size);
+    blk->nrbuf = blk->irbuf = 0;
+    while ( blk->nrbuf < size )
+    {
+        ssize_t ret;
+        if ( blk->bgzf )
+            ret = bgzf_read(blk->bgzf, blk->rbuf + blk->nrbuf, size - blk->nrbuf);
+        else
 #ifdef _WIN32
-    ret = _read(blk->fd, blk->dat, es->dat_size);
+            ret = _read(blk->fd, blk->rbuf + blk->nrbuf, size - blk->nrbuf);
 #else
-    ret = read(blk->fd, blk->dat, es->dat_size);
+            ret = read(blk->fd, blk->rbuf + blk->nrbuf, size - blk->nrbuf);
 #endif
-    if ( ret < 0 ) error("Error: failed to read from the temporary file %s\n", blk->fname);
-    if ( ret == 0 )
+        if ( ret < 0 ) error("Error: failed to read from the temporary file %s\n", blk->fname);
+        if ( ret == 0 ) break;
+        blk->nrbuf += ret;
+    }
+    if ( blk->nrbuf < size )
     {
+        int ret = blk->bgzf ? bgzf_close(blk->bgzf) :
 #ifdef _WIN32
-        if ( _close(blk->fd)!=0 ) error("Error: failed to close the temporary file %s\n", blk->fname);
+            _close(blk->fd);
 #else
-        if ( close(blk->fd)!=0 ) error("Error: failed to close the temporary file %s\n", blk->fname);
+            close(blk->fd);
 #endif
+        if ( ret!=0 ) error("Error: failed to close the temporary file %s\n", blk->fname);
+        blk->bgzf = NULL;
         blk->fd = -1;
-        return ret;
+        if ( blk->nrbuf % es->dat_size ) error("Error: failed to read %zu bytes from the temporary file %s\n",es->dat_size,blk->fname);
+        if ( !blk->nrbuf )
+        {
+            free(blk->rbuf);
+            blk->rbuf = NULL;
+            return 0;
+        }
     }
-    if ( ret < es->dat_size ) error("Error: failed to read %zu bytes from the temporary file %s\n",es->dat_size,blk->fname);
-    return ret;
+    return _blk_read(es, blk);
 }
 
 void extsort_sort(extsort_t *es)
@@ -244,6 +409,11 @@ void extsort_sort(extsort_t *es)
     es->buf = NULL;
     es->bhp = khp_init(blk);
 
+    // the read-ahead buffers of all blocks together should stay within the memory limit
+    es->rbuf_size = es->nblk ? es->max_mem / es->nblk : IO_BUF_SIZE;
+    if ( es->rbuf_size > IO_BUF_SIZE ) es->rbuf_size = IO_BUF_SIZE;
+    if ( es->rbuf_size < 4096 ) es->rbuf_size = 4096;
+
     // open all blocks, read one record from each, create a heap
     int i;
     for (i=0; i<es->nblk; i++)
@@ -254,6 +424,12 @@ void extsort_sort(extsort_t *es)
 #else
         if ( lseek(blk->fd,0,SEEK_SET)!=0 ) error("Error: failed to lseek() to the start of the temporary file %s\n", blk->fname);
 #endif
+        if ( es->clevel >= 0 )
+        {
+            // with a thread pool the blocks are decompressed ahead of time in the background
+            if ( !(blk->bgzf = bgzf_dopen(blk->fd, "r")) ) error("Error: failed to open the temporary file %s\n", blk->fname);
+            if ( es->pool ) bgzf_thread_pool(blk->bgzf, es->pool, 0);
+        }
         int ret = _blk_read(es, blk);
         if ( ret ) khp_insert(blk, es->bhp, &blk);
     }
@@ -40,6 +40,8 @@ typedef enum
     TMP_PREFIX,     // const char*   .. prefix of temporary files, XXXXXX will be appended
     MAX_MEM,        // const char*   .. maximum memory to use, e.g. 100MB
     FUNC_CMP,       // extsort_cmp_f .. sort function
+    COMPRESSION_LEVEL,  // int       .. compress the temporary files with BGZF at this level, -1 for no compression [-1]
+    THREAD_POOL,    // hts_tpool*    .. sort the buffers and (de)compress the temporary files in parallel [NULL]
 }
 extsort_opt_t;
 
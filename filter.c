@@ -78,10 +78,29 @@ static inline int bcf_double_test(double d, uint64_t value)
 #define bcf_double_is_missing_or_vector_end(x)     (bcf_double_test((x),bcf_double_missing) || bcf_double_test((x),bcf_double_vector_end))
 
 
+// The state of a PERL.BATCH subroutine in filter_test_batch(): the arguments of all
+// records in the block are collected first, then the subroutine is called once
+typedef struct
+{
+    char *name;         // the subroutine
+    int nrec, mrec;     // the number of collected records and the size of the arrays
+    int *irec;          // the index of the record in the block to the collected index, -1 if not collected
+    int nargs;
+    void **args;        // one AV per subroutine argument with the values of the collected records
+    int *ival, *nval;   // the values of the collected record k are val[ival[k]..ival[k]+nval[k]-1]
+    double *val;
+    int nval_tot, mval;
+}
+perl_batch_t;
+
 typedef struct _token_t
 {
     // read-only values, same for all VCF lines
     int tok_type;       // one of the TOK_* keys below
+    int eval_op;        // one of the EVAL_* opcodes below, how is the token evaluated by filter_test()
+    int unpack;         // BCF_UN_FMT if the token needs FORMAT fields unpacked, 0 otherwise
+    int skip_to;        // if >=0, the token starts the right operand of the &&,|| operator at this index
+    int rhs_smpl;       // set for logical operators if the right operand queries FORMAT fields
     int nargs;          // with TOK_PERLSUB the first argument is the name of the subroutine
     char *key;          // set only for string constants, otherwise NULL
     char *tag;          // for debugging and printout only, VCF tag name
@@ -99,6 +118,10 @@ typedef struct _token_t
     void (*comparator)(struct _token_t *, struct _token_t *, struct _token_t *rtok, bcf1_t *);
     void *hash;         // test presence of str value in the hash via comparator
     regex_t *regex;     // precompiled regex for string comparison
+    void *regex_cache;  // cached regex results of previously seen strings, see regex_match_cached()
+    int nregex_cache;
+    struct _token_t *shared;    // identical query of another expression in the filter set, evaluated in its stead
+    perl_batch_t *batch;        // set for PERL.BATCH subroutines, see filter_test_batch()
 
     // modified on filter evaluation at each VCF line
     double *values;
@@ -108,6 +131,7 @@ typedef struct _token_t
     uint8_t *pass_samples;  // status of individual samples
     int nvalues, mvalues;   // number of used values: n=0 for missing values, n=1 for scalars, for strings n=str_value.l
     int nval1;              // number of per-sample fields or string length
+    uint64_t eval_rec;      // the filter set record the values were last evaluated for, see filter_set_test()
 }
 token_t;
 
@@ -119,8 +143,13 @@ struct _filter_t
     token_t *filters, **flt_stack;  // filtering input tokens (in RPN) and evaluation stack
     int32_t *tmpi;
     float   *tmpf;
+    double  *tmpd;      // scratch buffer for order statistics, the token values are left intact
     kstring_t tmps;
-    int max_unpack, mtmpi, mtmpf, nsamples;
+    int max_unpack, mtmpi, mtmpf, mtmpd, nsamples;
+    uint64_t *nrec;     // record counter shared by members of a filter set, NULL for standalone filters
+    double *binom_cache;    // memoized binom() values for small depths, see calc_binom_cached()
+    int nbatch;             // the number of PERL.BATCH subroutines
+    int batch_mode, batch_rec;  // one of the BATCH_* modes and the record in the block being evaluated
 #if ENABLE_PERL_FILTERS
     PerlInterpreter *perl;
 #endif
@@ -171,6 +200,23 @@ struct _filter_t
 static int op_prec[] = {0,1,1,5,5,5,5,5,5,2,3, 6, 6, 7, 7, 8, 8, 8, 3, 2, 5, 5, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8 };
 #define TOKEN_STRING "x()[<=>]!|&+-*/MmaAO~^S.lfcpis"       // this is only for debugging, not maintained diligently
 
+// The RPN tokens are compiled into these opcodes by filter_init() so that filter_test() can
+// dispatch each token with a single switch. Constants are prepared once and only pushed.
+#define EVAL_CONST  0       // numeric or string constant, values are set at initialization
+#define EVAL_SETTER 1       // variable, query the VCF line
+#define EVAL_FUNC   2       // function or logical operator, see token_t.func
+#define EVAL_ADD    3
+#define EVAL_SUB    4
+#define EVAL_MULT   5
+#define EVAL_DIV    6
+#define EVAL_CMP    7       // comparison of the two topmost values
+#define EVAL_CMP_FMT 8      // comparison of a single-value numeric FORMAT field with a constant, see cmp_format_scalar()
+
+// How PERL.BATCH subroutines are evaluated, see filter_test_batch()
+#define BATCH_OFF     0     // called for each record as PERL subroutines are
+#define BATCH_COLLECT 1     // the arguments are collected, the result is missing
+#define BATCH_REPLAY  2     // the result of the batched call is returned
+
 // Return negative values if it is a function with variable number of arguments
 static int filters_next_token(char **str, int *len)
 {
@@ -687,132 +733,103 @@ static void filters_set_info_flag(filter_t *flt, bcf1_t *line, token_t *tok)
     tok->nvalues = 1;
 }
 
-static void filters_set_format_int(filter_t *flt, bcf1_t *line, token_t *tok)
-{
-    if ( line->n_sample != tok->nsamples )
-        error("Incorrect number of FORMAT fields at %s:%"PRId64" .. %s, %d vs %d\n", bcf_seqname(flt->hdr,line),(int64_t) line->pos+1,tok->tag,line->n_sample,tok->nsamples);
-
-    int nvals;
-    if ( (nvals=bcf_get_format_int32(flt->hdr,line,tok->tag,&flt->tmpi,&flt->mtmpi))<0 )
-    {
-        tok->nvalues = 0;
-        return;
-    }
-    int i, nsrc1 = nvals / tok->nsamples;
-    tok->nval1 = tok->idx >= 0 ? 1 : (tok->nuidxs ? tok->nuidxs : nsrc1);
-    tok->nvalues = tok->nval1*tok->nsamples;
-    hts_expand(double, tok->nvalues, tok->mvalues, tok->values);
-
-    if ( tok->idx >= 0 )    // scalar or vector index
-    {
-        for (i=0; i<tok->nsamples; i++)
-        {
-            if ( !tok->usmpl[i] ) continue;
-            int32_t *ptr = flt->tmpi + i*nsrc1;
-            if ( tok->idx>=nsrc1 || ptr[tok->idx]==bcf_int32_missing )
-                bcf_double_set_missing(tok->values[i]);
-            else if ( ptr[tok->idx]==bcf_int32_vector_end )
-                bcf_double_set_vector_end(tok->values[i]);
-            else
-                tok->values[i] = ptr[tok->idx];
-        }
-    }
-    else
-    {
-        int kend = tok->idxs[tok->nidxs-1] < 0 ? tok->nval1 : tok->nidxs;
-        for (i=0; i<tok->nsamples; i++)
-        {
-            if ( !tok->usmpl[i] ) continue;
-            int32_t *src = flt->tmpi + i*nsrc1;
-            double  *dst = tok->values + i*tok->nval1;
-            int k, j = 0;
-            for (k=0; k<kend; k++)
-            {
-                if ( k<tok->nidxs && !tok->idxs[k] ) continue;
-                if ( src[k]==bcf_int32_missing )
-                    bcf_double_set_missing(dst[j]);
-                else if ( src[k]==bcf_int32_vector_end )
-                    bcf_double_set_vector_end(dst[j]);
-                else
-                    dst[j] = src[k];
-                j++;
-            }
-            if ( j==0 )
-            {
-                bcf_double_set_missing(dst[j]);
-                j++;
-            }
-            while (j < tok->nval1)
-            {
-                bcf_double_set_vector_end(dst[j]);
-                j++;
-            }
-        }
-    }
+// Decode FORMAT/INT or FORMAT/FLOAT values directly from the BCF buffer, only for the samples and
+// the vector indexes the expression uses. For example FMT/DP[0] converts a single value regardless
+// of the number of samples.
+#define BRANCH_FMT(type_t,is_missing,is_vector_end) \
+{ \
+    if ( tok->idx >= 0 )    /* scalar or vector index */ \
+    { \
+        for (i=0; i<tok->nsamples; i++) \
+        { \
+            if ( !tok->usmpl[i] ) continue; \
+            type_t *ptr = (type_t*)(fmt->p + i*fmt->size); \
+            if ( tok->idx>=nsrc1 || is_missing(ptr[tok->idx]) ) \
+                bcf_double_set_missing(tok->values[i]); \
+            else if ( is_vector_end(ptr[tok->idx]) ) \
+                bcf_double_set_vector_end(tok->values[i]); \
+            else \
+                tok->values[i] = ptr[tok->idx]; \
+        } \
+    } \
+    else \
+    { \
+        int kend = tok->idxs[tok->nidxs-1] < 0 ? tok->nval1 : tok->nidxs; \
+        for (i=0; i<tok->nsamples; i++) \
+        { \
+            if ( !tok->usmpl[i] ) continue; \
+            type_t *src = (type_t*)(fmt->p + i*fmt->size); \
+            double *dst = tok->values + i*tok->nval1; \
+            int k, j = 0; \
+            for (k=0; k<kend; k++) \
+            { \
+                if ( k<tok->nidxs && !tok->idxs[k] ) continue; \
+                if ( k>=nsrc1 || is_missing(src[k]) ) \
+                    bcf_double_set_missing(dst[j]); \
+                else if ( is_vector_end(src[k]) ) \
+                    bcf_double_set_vector_end(dst[j]); \
+                else \
+                    dst[j] = src[k]; \
+                j++; \
+            } \
+            if ( j==0 ) \
+            { \
+                bcf_double_set_missing(dst[j]); \
+                j++; \
+            } \
+            while (j < tok->nval1) \
+            { \
+                bcf_double_set_vector_end(dst[j]); \
+                j++; \
+            } \
+        } \
+    } \
 }
-static void filters_set_format_float(filter_t *flt, bcf1_t *line, token_t *tok)
+#define int8_is_missing(x)     ((x)==bcf_int8_missing)
+#define int8_is_vector_end(x)  ((x)==bcf_int8_vector_end)
+#define int16_is_missing(x)    ((x)==bcf_int16_missing)
+#define int16_is_vector_end(x) ((x)==bcf_int16_vector_end)
+#define int32_is_missing(x)    ((x)==bcf_int32_missing)
+#define int32_is_vector_end(x) ((x)==bcf_int32_vector_end)
+static void _filters_set_format_numeric(filter_t *flt, bcf1_t *line, token_t *tok, int is_float)
 {
     if ( line->n_sample != tok->nsamples )
         error("Incorrect number of FORMAT fields at %s:%"PRId64" .. %s, %d vs %d\n", bcf_seqname(flt->hdr,line),(int64_t) line->pos+1,tok->tag,line->n_sample,tok->nsamples);
 
-    int nvals;
-    if ( (nvals=bcf_get_format_float(flt->hdr,line,tok->tag,&flt->tmpf,&flt->mtmpf))<0 )
+    if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
+    bcf_fmt_t *fmt = NULL;
+    int i;
+    for (i=0; i<line->n_fmt; i++)
+        if ( line->d.fmt[i].id==tok->hdr_id ) { fmt = &line->d.fmt[i]; break; }
+    if ( !fmt || !fmt->p || (fmt->type==BCF_BT_FLOAT)!=is_float )
     {
         tok->nvalues = 0;
         return;
     }
-    int i, nsrc1 = nvals / tok->nsamples;
+
+    int nsrc1 = fmt->n;
     tok->nval1 = tok->idx >= 0 ? 1 : (tok->nuidxs ? tok->nuidxs : nsrc1);
     tok->nvalues = tok->nval1*tok->nsamples;
     hts_expand(double, tok->nvalues, tok->mvalues, tok->values);
 
-    if ( tok->idx >= 0 )    // scalar or vector index
+    switch (fmt->type)
     {
-        for (i=0; i<tok->nsamples; i++)
-        {
-            if ( !tok->usmpl[i] ) continue;
-            float *ptr = flt->tmpf + i*nsrc1;
-            if ( tok->idx>=nsrc1 || bcf_float_is_missing(ptr[tok->idx]) )
-                bcf_double_set_missing(tok->values[i]);
-            else if ( bcf_float_is_vector_end(ptr[tok->idx]) )
-                bcf_double_set_vector_end(tok->values[i]);
-            else
-                tok->values[i] = ptr[tok->idx];
-        }
-    }
-    else
-    {
-        int kend = tok->idxs[tok->nidxs-1] < 0 ? tok->nval1 : tok->nidxs;
-        for (i=0; i<tok->nsamples; i++)
-        {
-            if ( !tok->usmpl[i] ) continue;
-            float *src = flt->tmpf + i*nsrc1;
-            double  *dst = tok->values + i*tok->nval1;
-            int k, j = 0;
-            for (k=0; k<kend; k++)
-            {
-                if ( k<tok->nidxs && !tok->idxs[k] ) continue;
-                if ( bcf_float_is_missing(src[k]) )
-                    bcf_double_set_missing(dst[j]);
-                else if ( bcf_float_is_vector_end(src[k]) )
-                    bcf_double_set_vector_end(dst[j]);
-                else
-                    dst[j] = src[k];
-                j++;
-            }
-            if ( j==0 )
-            {
-                bcf_double_set_missing(dst[j]);
-                j++;
-            }
-            while (j < tok->nval1)
-            {
-                bcf_double_set_vector_end(dst[j]);
-                j++;
-            }
-        }
+        case BCF_BT_INT8:  BRANCH_FMT(int8_t, int8_is_missing, int8_is_vector_end); break;
+        case BCF_BT_INT16: BRANCH_FMT(int16_t, int16_is_missing, int16_is_vector_end); break;
+        case BCF_BT_INT32: BRANCH_FMT(int32_t, int32_is_missing, int32_is_vector_end); break;
+        case BCF_BT_FLOAT: BRANCH_FMT(float, bcf_float_is_missing, bcf_float_is_vector_end); break;
+        default: error("Unexpected type %d of FORMAT/%s at %s:%"PRId64"\n",fmt->type,tok->tag,bcf_seqname(flt->hdr,line),(int64_t) line->pos+1);
     }
 }
+#undef BRANCH_FMT
+#undef int8_is_missing
+#undef int8_is_vector_end
+#undef int16_is_missing
+#undef int16_is_vector_end
+#undef int32_is_missing
+#undef int32_is_vector_end
+static void filters_set_format_int(filter_t *flt, bcf1_t *line, token_t *tok) { _filters_set_format_numeric(flt, line, tok, 0); }
+static void filters_set_format_float(filter_t *flt, bcf1_t *line, token_t *tok) { _filters_set_format_numeric(flt, line, tok, 1); }
 static void filters_set_format_string(filter_t *flt, bcf1_t *line, token_t *tok)
 {
     if ( line->n_sample != tok->nsamples )
@@ -1181,6 +1198,28 @@ static void filters_set_maf(filter_t *flt, bcf1_t *line, token_t *tok)
     }
 }
 
+// Initialize the output token of SMPL_* functions. Most FORMAT fields have a single value per
+// sample, then the per-sample aggregate is the value itself and is filled in a single pass:
+// returns 1 if done, 0 if the caller has to reduce the per-sample vectors.
+static int func_smpl_init(token_t *tok, token_t *rtok, int is_stddev)
+{
+    rtok->nsamples = tok->nsamples;
+    rtok->nvalues  = tok->nsamples;
+    rtok->nval1 = 1;
+    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
+    assert(tok->usmpl);
+    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
+    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( tok->nval1!=1 ) return 0;
+    int i;
+    for (i=0; i<tok->nsamples; i++)
+    {
+        if ( !rtok->usmpl[i] ) continue;
+        if ( bcf_double_is_missing_or_vector_end(tok->values[i]) ) bcf_double_set_missing(rtok->values[i]);
+        else rtok->values[i] = is_stddev ? 0 : tok->values[i];
+    }
+    return 1;
+}
 static int func_max(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stack, int nstack)
 {
     token_t *tok = stack[nstack - 1];
@@ -1222,13 +1261,7 @@ static int func_smpl_max(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **s
 {
     token_t *tok = stack[nstack - 1];
     if ( !tok->nsamples ) return func_max(flt,line,rtok,stack,nstack);
-    rtok->nsamples = tok->nsamples;
-    rtok->nvalues  = tok->nsamples;
-    rtok->nval1 = 1;
-    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
-    assert(tok->usmpl);
-    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
-    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( func_smpl_init(tok,rtok,0) ) return 1;
     int i, j, has_value;
     double val, *ptr;
     for (i=0; i<tok->nsamples; i++)
@@ -1289,13 +1322,7 @@ static int func_smpl_min(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **s
 {
     token_t *tok = stack[nstack - 1];
     if ( !tok->nsamples ) return func_min(flt,line,rtok,stack,nstack);
-    rtok->nsamples = tok->nsamples;
-    rtok->nvalues  = tok->nsamples;
-    rtok->nval1 = 1;
-    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
-    assert(tok->usmpl);
-    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
-    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( func_smpl_init(tok,rtok,0) ) return 1;
     int i, j, has_value;
     double val, *ptr;
     for (i=0; i<tok->nsamples; i++)
@@ -1352,13 +1379,7 @@ static int func_smpl_avg(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **s
 {
     token_t *tok = stack[nstack - 1];
     if ( !tok->nsamples ) return func_avg(flt,line,rtok,stack,nstack);
-    rtok->nsamples = tok->nsamples;
-    rtok->nvalues  = tok->nsamples;
-    rtok->nval1 = 1;
-    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
-    assert(tok->usmpl);
-    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
-    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( func_smpl_init(tok,rtok,0) ) return 1;
     int i, j, n;
     double val, *ptr;
     for (i=0; i<tok->nsamples; i++)
@@ -1376,20 +1397,40 @@ static int func_smpl_avg(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **s
     }
     return 1;
 }
-static int compare_doubles(const void *lhs, const void *rhs)
+// Median by partial partitioning (quickselect) rather than by sorting all values
+static double median_select(double *arr, int n)
 {
-    double arg1 = *(const double*) lhs;
-    double arg2 = *(const double*) rhs;
-    if (arg1 < arg2) return -1;
-    if (arg1 > arg2) return 1;
-    return 0;
+    int k = n/2, lo = 0, hi = n - 1;
+    while ( lo < hi )
+    {
+        double pivot = arr[lo + (hi-lo)/2];
+        int i = lo, j = hi;
+        while ( i<=j )
+        {
+            while ( arr[i] < pivot ) i++;
+            while ( arr[j] > pivot ) j--;
+            if ( i<=j ) { double tmp = arr[i]; arr[i] = arr[j]; arr[j] = tmp; i++; j--; }
+        }
+        if ( k<=j ) hi = j;
+        else if ( k>=i ) lo = i;
+        else break;
+    }
+    if ( n % 2 ) return arr[k];
+
+    // even number of values: the other middle value is the largest of the lower partition
+    double max = arr[0];
+    for (lo=1; lo<k; lo++)
+        if ( max < arr[lo] ) max = arr[lo];
+    return (max + arr[k]) * 0.5;
 }
 static int func_median(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stack, int nstack)
 {
     token_t *tok = stack[nstack - 1];
     rtok->nvalues = 0;
     if ( !tok->nvalues ) return 1;
-    // sweep through all tok->values and while excluding all missing values reuse the very same array
+    // collect all non-missing values in the scratch buffer, tok->values can be shared by other tokens
+    hts_expand(double,tok->nvalues,flt->mtmpd,flt->tmpd);
+    double *arr = flt->tmpd;
     int i,j,k = 0, n = 0;
     if ( tok->nsamples )
     {
@@ -1399,8 +1440,7 @@ static int func_median(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **sta
             for (j=0; j<tok->nval1; k++,j++)
             {
                 if ( bcf_double_is_missing_or_vector_end(tok->values[k]) ) continue;
-                if ( n < k ) tok->values[n] = tok->values[k];
-                n++;
+                arr[n++] = tok->values[k];
             }
         }
     }
@@ -1409,17 +1449,11 @@ static int func_median(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **sta
         for (i=0; i<tok->nvalues; i++)
         {
             if ( bcf_double_is_missing_or_vector_end(tok->values[i]) ) continue;
-            if ( n < i ) tok->values[n] = tok->values[i];
-            n++;
+            arr[n++] = tok->values[i];
         }
     }
     if ( !n ) return 1;
-    if ( n==1 ) rtok->values[0] = tok->values[0];
-    else
-    {
-        qsort(tok->values, n, sizeof(double), compare_doubles);
-        rtok->values[0] = n % 2 ? tok->values[n/2] : (tok->values[n/2-1] + tok->values[n/2]) * 0.5;
-    }
+    rtok->values[0] = n==1 ? arr[0] : median_select(arr, n);
     rtok->nvalues = 1;
     return 1;
 }
@@ -1427,15 +1461,10 @@ static int func_smpl_median(filter_t *flt, bcf1_t *line, token_t *rtok, token_t
 {
     token_t *tok = stack[nstack - 1];
     if ( !tok->nsamples ) return func_avg(flt,line,rtok,stack,nstack);
-    rtok->nsamples = tok->nsamples;
-    rtok->nvalues  = tok->nsamples;
-    rtok->nval1 = 1;
-    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
-    assert(tok->usmpl);
-    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
-    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( func_smpl_init(tok,rtok,0) ) return 1;
+    hts_expand(double,tok->nval1,flt->mtmpd,flt->tmpd);
     int i, j, n;
-    double *ptr;
+    double *ptr, *arr = flt->tmpd;
     for (i=0; i<tok->nsamples; i++)
     {
         if ( !rtok->usmpl[i] ) continue;
@@ -1444,18 +1473,12 @@ static int func_smpl_median(filter_t *flt, bcf1_t *line, token_t *rtok, token_t
         for (j=0; j<tok->nval1; j++)
         {
             if ( bcf_double_is_missing_or_vector_end(ptr[j]) ) continue;
-            if ( n < j ) ptr[n] = ptr[j];
-            n++;
+            arr[n++] = ptr[j];
         }
         if ( n==0 )
             bcf_double_set_missing(rtok->values[i]);
-        else if ( n==1 )
-            rtok->values[i] = ptr[0];
         else
-        {
-            qsort(ptr, n, sizeof(double), compare_doubles);
-            rtok->values[i] = n % 2 ? ptr[n/2] : (ptr[n/2-1] + ptr[n/2]) * 0.5;
-        }
+            rtok->values[i] = n==1 ? arr[0] : median_select(arr, n);
     }
     return 1;
 }
@@ -1464,7 +1487,9 @@ static int func_stddev(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **sta
     token_t *tok = stack[nstack - 1];
     rtok->nvalues = 0;
     if ( !tok->nvalues ) return 1;
-    // sweep through all tok->values and while excluding all missing values reuse the very same array
+    // collect all non-missing values in the scratch buffer, tok->values can be shared by other tokens
+    hts_expand(double,tok->nvalues,flt->mtmpd,flt->tmpd);
+    double *arr = flt->tmpd;
     int i,j,k = 0, n = 0;
     if ( tok->nsamples )
     {
@@ -1474,8 +1499,7 @@ static int func_stddev(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **sta
             for (j=0; j<tok->nval1; k++,j++)
             {
                 if ( bcf_double_is_missing_or_vector_end(tok->values[k]) ) continue;
-                if ( n < k ) tok->values[n] = tok->values[k];
-                n++;
+                arr[n++] = tok->values[k];
             }
         }
     }
@@ -1484,8 +1508,7 @@ static int func_stddev(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **sta
         for (i=0; i<tok->nvalues; i++)
         {
             if ( bcf_double_is_missing_or_vector_end(tok->values[i]) ) continue;
-            if ( n < i ) tok->values[n] = tok->values[i];
-            n++;
+            arr[n++] = tok->values[i];
         }
     }
     if ( !n ) return 1;
@@ -1493,9 +1516,9 @@ static int func_stddev(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **sta
     else
     {
         double sdev = 0, avg = 0;
-        for (i=0; i<n; i++) avg += tok->values[i];
+        for (i=0; i<n; i++) avg += arr[i];
         avg /= n;
-        for (i=0; i<n; i++) sdev += (tok->values[i] - avg) * (tok->values[i] - avg);
+        for (i=0; i<n; i++) sdev += (arr[i] - avg) * (arr[i] - avg);
         rtok->values[0] = sqrt(sdev/n);
     }
     rtok->nvalues = 1;
@@ -1505,13 +1528,8 @@ static int func_smpl_stddev(filter_t *flt, bcf1_t *line, token_t *rtok, token_t
 {
     token_t *tok = stack[nstack - 1];
     if ( !tok->nsamples ) return func_avg(flt,line,rtok,stack,nstack);
-    rtok->nsamples = tok->nsamples;
-    rtok->nvalues  = tok->nsamples;
-    rtok->nval1 = 1;
-    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
-    assert(tok->usmpl);
-    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
-    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( func_smpl_init(tok,rtok,1) ) return 1;
+    hts_expand(double,tok->nval1,flt->mtmpd,flt->tmpd);
     int i, j, n;
     double *ptr;
     for (i=0; i<tok->nsamples; i++)
@@ -1522,9 +1540,9 @@ static int func_smpl_stddev(filter_t *flt, bcf1_t *line, token_t *rtok, token_t
         for (j=0; j<tok->nval1; j++)
         {
             if ( bcf_double_is_missing_or_vector_end(ptr[j]) ) continue;
-            if ( n < j ) ptr[n] = ptr[j];
-            n++;
+            flt->tmpd[n++] = ptr[j];
         }
+        ptr = flt->tmpd;
         if ( n==0 )
             bcf_double_set_missing(rtok->values[i]);
         else if ( n==1 )
@@ -1577,13 +1595,7 @@ static int func_smpl_sum(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **s
 {
     token_t *tok = stack[nstack - 1];
     if ( !tok->nsamples ) return func_avg(flt,line,rtok,stack,nstack);
-    rtok->nsamples = tok->nsamples;
-    rtok->nvalues  = tok->nsamples;
-    rtok->nval1 = 1;
-    hts_expand(double,rtok->nvalues,rtok->mvalues,rtok->values);
-    assert(tok->usmpl);
-    if ( !rtok->usmpl ) rtok->usmpl = (uint8_t*) malloc(tok->nsamples);
-    memcpy(rtok->usmpl, tok->usmpl, tok->nsamples);
+    if ( func_smpl_init(tok,rtok,0) ) return 1;
     int i, j, has_value;
     double val, *ptr;
     for (i=0; i<tok->nsamples; i++)
@@ -1727,6 +1739,20 @@ static inline double calc_binom(int na, int nb)
 
     return pval;
 }
+#define BINOM_CACHE_MAX 256     // binom() values are memoized for read counts smaller than this
+static inline double calc_binom_cached(filter_t *flt, int na, int nb)
+{
+    if ( na<0 || nb<0 || na>=BINOM_CACHE_MAX || nb>=BINOM_CACHE_MAX ) return calc_binom(na,nb);
+    if ( !flt->binom_cache )
+    {
+        int i;
+        flt->binom_cache = (double*) malloc(sizeof(*flt->binom_cache)*BINOM_CACHE_MAX*BINOM_CACHE_MAX);
+        for (i=0; i<BINOM_CACHE_MAX*BINOM_CACHE_MAX; i++) flt->binom_cache[i] = -2;    // not computed yet
+    }
+    double *pval = &flt->binom_cache[na*BINOM_CACHE_MAX + nb];
+    if ( *pval==-2 ) *pval = calc_binom(na,nb);
+    return *pval;
+}
 static int func_binom(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stack, int nstack)
 {
     int i, istack = nstack - rtok->nargs;
@@ -1794,7 +1820,7 @@ static int func_binom(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stac
                     bcf_double_set_missing(rtok->values[i]);
                     continue;
                 }
-                rtok->values[i] = calc_binom(vals[idx1],vals[idx2]);
+                rtok->values[i] = calc_binom_cached(flt,vals[idx1],vals[idx2]);
                 if ( rtok->values[i] < 0 )
                 {
                     bcf_double_set_missing(rtok->values[i]);
@@ -1818,7 +1844,7 @@ static int func_binom(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stac
                     bcf_double_set_missing(rtok->values[i]);
                     continue;
                 }
-                rtok->values[i] = calc_binom(ptr1[0],ptr2[0]);
+                rtok->values[i] = calc_binom_cached(flt,ptr1[0],ptr2[0]);
                 if ( rtok->values[i] < 0 )
                 {
                     bcf_double_set_missing(rtok->values[i]);
@@ -1857,7 +1883,7 @@ static int func_binom(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stac
             bcf_double_set_missing(rtok->values[0]);
         else
         {
-            rtok->values[0] = calc_binom(ptr1[0],ptr2[0]);
+            rtok->values[0] = calc_binom_cached(flt,ptr1[0],ptr2[0]);
             if ( rtok->values[0] < 0 )
                 bcf_double_set_missing(rtok->values[0]);
         }
@@ -2234,7 +2260,114 @@ static int vector_logic_and(filter_t *filter, bcf1_t *line, token_t *rtok, token
         } \
     } \
 }
-static int _regex_vector_strings(regex_t *regex, char *str, size_t len, int logic, int *missing_logic)
+
+// Comparison of a single-value FORMAT field with a numeric constant, e.g. FMT/GQ>20, evaluated
+// directly on the BCF-encoded values. The result is the same as of filters_set_format_int() or
+// filters_set_format_float() followed by CMP_VECTORS, but there is no conversion of all samples to
+// double. The loops are branch-free so that the compiler can vectorize them.
+#define CMP_FMT_SCALAR(type_t,is_missing,CMP_OP) \
+{ \
+    for (i=0; i<line->n_sample; i++) \
+    { \
+        type_t val = ((type_t*)(fmt->p + i*fmt->size))[idx]; \
+        int miss = is_missing(val); \
+        int pass = (val > 16777216 || dthr > 16777216) ? ((double)val CMP_OP dthr) : ((float)val CMP_OP fthr); \
+        rtok->pass_samples[i] = rtok->usmpl[i] & (miss ? miss_pass : pass); \
+        npass += rtok->pass_samples[i]; \
+    } \
+}
+#define CMP_FMT_OPS(type_t,is_missing) \
+{ \
+    switch (rtok->tok_type) \
+    { \
+        case TOK_EQ: CMP_FMT_SCALAR(type_t,is_missing,==); break; \
+        case TOK_NE: CMP_FMT_SCALAR(type_t,is_missing,!=); break; \
+        case TOK_LE: CMP_FMT_SCALAR(type_t,is_missing,<=); break; \
+        case TOK_LT: CMP_FMT_SCALAR(type_t,is_missing,<); break; \
+        case TOK_BT: CMP_FMT_SCALAR(type_t,is_missing,>); break; \
+        case TOK_BE: CMP_FMT_SCALAR(type_t,is_missing,>=); break; \
+        default: error("todo: %s:%d .. type=%d\n", __FILE__,__LINE__,rtok->tok_type); \
+    } \
+}
+#define int8_is_missing(x)  ((x)==bcf_int8_missing || (x)==bcf_int8_vector_end)
+#define int16_is_missing(x) ((x)==bcf_int16_missing || (x)==bcf_int16_vector_end)
+#define int32_is_missing(x) ((x)==bcf_int32_missing || (x)==bcf_int32_vector_end)
+#define float_is_missing(x) (bcf_float_is_missing(x) || bcf_float_is_vector_end(x))
+static void cmp_format_scalar(filter_t *flt, bcf1_t *line, token_t *atok, token_t *btok, token_t *rtok)
+{
+    // Note that, as in CMP_VECTORS, the FORMAT value is always the left-hand side of the comparison
+    token_t *xtok = atok->setter ? atok : btok;
+    token_t *ytok = atok->setter ? btok : atok;
+    tok_init_samples(atok, btok, rtok);
+
+    if ( line->n_sample != xtok->nsamples )
+        error("Incorrect number of FORMAT fields at %s:%"PRId64" .. %s, %d vs %d\n", bcf_seqname(flt->hdr,line),(int64_t) line->pos+1,xtok->tag,line->n_sample,xtok->nsamples);
+
+    if ( !(line->unpacked & BCF_UN_FMT) ) bcf_unpack(line, BCF_UN_FMT);
+    bcf_fmt_t *fmt = NULL;
+    int i;
+    for (i=0; i<line->n_fmt; i++)
+        if ( line->d.fmt[i].id==xtok->hdr_id ) { fmt = &line->d.fmt[i]; break; }
+
+    int is_float = xtok->setter==filters_set_format_float ? 1 : 0;
+    if ( fmt && (!fmt->p || (fmt->type==BCF_BT_FLOAT)!=is_float) ) fmt = NULL;
+    if ( !fmt )
+    {
+        // the tag is not present, only != evaluates to true
+        if ( rtok->tok_type!=TOK_NE ) return;
+        for (i=0; i<rtok->nsamples; i++)
+            if ( rtok->usmpl[i] ) { rtok->pass_samples[i] = 1; rtok->pass_site = 1; }
+        return;
+    }
+
+    int idx = xtok->idx, npass = 0;
+    uint8_t miss_pass = rtok->tok_type==TOK_NE ? 1 : 0;
+    double dthr = ytok->values[0];
+    float fthr = dthr;
+    if ( idx >= fmt->n )
+    {
+        for (i=0; i<line->n_sample; i++)
+        {
+            rtok->pass_samples[i] = rtok->usmpl[i] & miss_pass;
+            npass += rtok->pass_samples[i];
+        }
+    }
+    else
+    {
+        switch (fmt->type)
+        {
+            case BCF_BT_INT8:  CMP_FMT_OPS(int8_t, int8_is_missing); break;
+            case BCF_BT_INT16: CMP_FMT_OPS(int16_t, int16_is_missing); break;
+            case BCF_BT_INT32: CMP_FMT_OPS(int32_t, int32_is_missing); break;
+            case BCF_BT_FLOAT: CMP_FMT_OPS(float, float_is_missing); break;
+            default: error("Unexpected type %d of FORMAT/%s at %s:%"PRId64"\n",fmt->type,xtok->tag,bcf_seqname(flt->hdr,line),(int64_t) line->pos+1);
+        }
+    }
+    if ( npass ) rtok->pass_site = 1;
+}
+#undef CMP_FMT_SCALAR
+#undef CMP_FMT_OPS
+#undef int8_is_missing
+#undef int16_is_missing
+#undef int32_is_missing
+#undef float_is_missing
+
+// String fields such as FILTER or INFO/CSQ consequences typically have only a few distinct
+// values, remember the regexec() result for each. The size of the cache is limited so that
+// high-cardinality fields do not consume unbounded memory.
+#define REGEX_CACHE_MAX 10000
+static inline int regex_match_cached(token_t *tok, char *str)
+{
+    int match;
+    if ( tok->regex_cache && khash_str2int_get(tok->regex_cache, str, &match)==0 ) return match;
+    match = regexec(tok->regex, str, 0,NULL,0) ? 0 : 1;
+    if ( tok->nregex_cache >= REGEX_CACHE_MAX ) return match;
+    if ( !tok->regex_cache ) tok->regex_cache = khash_str2int_init();
+    khash_str2int_set(tok->regex_cache, strdup(str), match);
+    tok->nregex_cache++;
+    return match;
+}
+static int _regex_vector_strings(token_t *regex_tok, char *str, size_t len, int logic, int *missing_logic)
 {
     char *end = str + len;
     while ( str < end && *str )
@@ -2244,7 +2377,7 @@ static int _regex_vector_strings(regex_t *regex, char *str, size_t len, int logi
         int miss = mid - str == 1 && str[0]=='.' ? 1 : 0;
         if ( miss && missing_logic[miss] ) return 1;
         char tmp = *mid; *mid = 0;
-        int match = regexec(regex, str, 0,NULL,0) ? 0 : 1;
+        int match = regex_match_cached(regex_tok, str);
         *mid = tmp;
         if ( logic==TOK_NLIKE ) match = match ? 0 : 1;
         if ( match ) return 1;
@@ -2307,6 +2440,7 @@ static void cmp_vector_strings(token_t *atok, token_t *btok, token_t *rtok)
 
     int i, logic = rtok->tok_type;     // TOK_EQ, TOK_NE, TOK_LIKE, TOK_NLIKE
     regex_t *regex = atok->regex ? atok->regex : (btok->regex ? btok->regex : NULL);
+    token_t *regex_tok = atok->regex ? atok : btok;
 
     assert( atok->nvalues==atok->str_value.l && btok->nvalues==btok->str_value.l );
     assert( !atok->nsamples || !btok->nsamples );
@@ -2330,7 +2464,7 @@ static void cmp_vector_strings(token_t *atok, token_t *btok, token_t *rtok)
         else
         {
             token_t *tok = atok->regex ? btok : atok;
-            rtok->pass_site = _regex_vector_strings(regex, tok->str_value.s, tok->str_value.l, logic, missing_logic);
+            rtok->pass_site = _regex_vector_strings(regex_tok, tok->str_value.s, tok->str_value.l, logic, missing_logic);
         }
         return;
     }
@@ -2375,7 +2509,7 @@ static void cmp_vector_strings(token_t *atok, token_t *btok, token_t *rtok)
         if ( !rtok->usmpl[i] ) continue;
         int match;
         if ( regex )
-            match = _regex_vector_strings(regex, xtok->str_value.s + i*xtok->nval1, xtok->nval1, logic, missing_logic);
+            match = _regex_vector_strings(regex_tok, xtok->str_value.s + i*xtok->nval1, xtok->nval1, logic, missing_logic);
         else
             match = _match_vector_strings(xtok->str_value.s + i*xtok->nval1, xtok->nval1, ytok->str_value.s, ytok->str_value.l, logic, missing_logic);
         if ( match ) { rtok->pass_samples[i] = 1; rtok->pass_site = 1; }
@@ -2905,39 +3039,156 @@ static void str_to_lower(char *str)
 {
     while ( *str ) { *str = tolower(*str); str++; }
 }
+#if ENABLE_PERL_FILTERS
+// A new SV with the token's values: a string, a number or a reference to an array of numbers
+static SV *perl_new_sv(filter_t *flt, token_t *tok)
+{
+    PerlInterpreter *perl = flt->perl;
+    if ( tok->is_str ) return newSVpvn(tok->str_value.s,tok->str_value.l);
+    if ( tok->nvalues==1 ) return newSVnv(tok->values[0]);
+    if ( tok->nvalues>1 )
+    {
+        int j;
+        AV *av = newAV();
+        for (j=0; j<tok->nvalues; j++) av_push(av, newSVnv(tok->values[j]));
+        return newRV_noinc((SV*)av);
+    }
+    double missing;
+    bcf_double_set_missing(missing);
+    return newSVnv(missing);
+}
+
+static void perl_batch_collect(filter_t *flt, perl_batch_t *batch, token_t **args, int nargs)
+{
+    PerlInterpreter *perl = flt->perl;
+    int i;
+    if ( !batch->args )
+    {
+        batch->name  = args[0]->str_value.s;
+        batch->nargs = nargs - 1;
+        batch->args  = (void**) malloc(sizeof(*batch->args)*batch->nargs);
+        for (i=0; i<batch->nargs; i++) batch->args[i] = newAV();
+    }
+    batch->irec[flt->batch_rec] = batch->nrec++;
+    for (i=0; i<batch->nargs; i++) av_push((AV*)batch->args[i], perl_new_sv(flt, args[i+1]));
+}
+#endif
+
+static void perl_batch_reset(filter_t *flt, int nrec)
+{
+#if ENABLE_PERL_FILTERS
+    PerlInterpreter *perl = flt->perl;
+    if ( !perl ) error("Error: perl expression without a perl script name\n");
+    PERL_SET_CONTEXT(perl);
+    int i, j;
+    for (i=0; i<flt->nfilters; i++)
+    {
+        perl_batch_t *batch = flt->filters[i].batch;
+        if ( !batch ) continue;
+        if ( batch->mrec < nrec )
+        {
+            batch->mrec = nrec;
+            batch->irec = (int*) realloc(batch->irec, sizeof(*batch->irec)*nrec);
+            batch->ival = (int*) realloc(batch->ival, sizeof(*batch->ival)*nrec);
+            batch->nval = (int*) realloc(batch->nval, sizeof(*batch->nval)*nrec);
+        }
+        for (j=0; j<nrec; j++) batch->irec[j] = -1;
+        for (j=0; j<batch->nargs; j++) av_clear((AV*)batch->args[j]);
+        batch->nrec = 0;
+        batch->nval_tot = 0;
+    }
+#else
+    error("\nPerl filtering requires running `configure --enable-perl-filters` at compile time.\n\n");
+#endif
+}
+
+// Call each PERL.BATCH subroutine once with the arguments collected by perl_batch_collect().
+// The subroutine receives one array reference per argument, with the values of all records,
+// and must return one value per record: a number, an array reference or undef for missing
+static void perl_batch_call(filter_t *flt)
+{
+#if ENABLE_PERL_FILTERS
+    PerlInterpreter *perl = flt->perl;
+    int i, j, k;
+    for (i=0; i<flt->nfilters; i++)
+    {
+        perl_batch_t *batch = flt->filters[i].batch;
+        if ( !batch || !batch->nrec ) continue;
+
+        dSP;
+        ENTER;
+        SAVETMPS;
+
+        PUSHMARK(SP);
+        for (j=0; j<batch->nargs; j++) XPUSHs(sv_2mortal(newRV_inc((SV*)batch->args[j])));
+        PUTBACK;
+
+        int nret = call_pv(batch->name, G_ARRAY);
+
+        SPAGAIN;
+
+        if ( nret!=batch->nrec )
+            error("Error: the perl subroutine %s returned %d values for %d records\n", batch->name,nret,batch->nrec);
+        SV **ret = SP - nret + 1;
+        for (k=0; k<nret; k++)
+        {
+            batch->ival[k] = batch->nval_tot;
+            SV *sv = ret[k];
+            AV *av = SvROK(sv) && SvTYPE(SvRV(sv))==SVt_PVAV ? (AV*)SvRV(sv) : NULL;
+            int n = av ? av_len(av) + 1 : (SvOK(sv) ? 1 : 0);
+            hts_expand(double, batch->nval_tot + n, batch->mval, batch->val);
+            for (j=0; j<n; j++)
+            {
+                SV **elem = av ? av_fetch(av, j, 0) : &sv;
+                double *val = &batch->val[batch->nval_tot + j];
+                *val = elem && SvOK(*elem) ? SvNV(*elem) : NAN;
+                if ( isnan(*val) ) bcf_double_set_missing(*val);
+            }
+            batch->nval[k] = n;
+            batch->nval_tot += n;
+        }
+        SP -= nret;
+
+        PUTBACK;
+        FREETMPS;
+        LEAVE;
+    }
+#endif
+}
+
 static int perl_exec(filter_t *flt, bcf1_t *line, token_t *rtok, token_t **stack, int nstack)
 {
 #if ENABLE_PERL_FILTERS
 
     PerlInterpreter *perl = flt->perl;
     if ( !perl ) error("Error: perl expression without a perl script name\n");
+    PERL_SET_CONTEXT(perl);     // filters can be evaluated by worker threads
+
+    int i, istack = nstack - rtok->nargs;
+    perl_batch_t *batch = rtok->batch;
+    if ( batch && flt->batch_mode==BATCH_COLLECT )
+    {
+        perl_batch_collect(flt, batch, stack + istack, rtok->nargs);
+        rtok->nvalues = 0;
+        return rtok->nargs;
+    }
+    if ( batch && flt->batch_mode==BATCH_REPLAY && batch->irec[flt->batch_rec]>=0 )
+    {
+        // records not reached in the collecting pass, because of short-circuiting, are evaluated below
+        int k = batch->irec[flt->batch_rec];
+        rtok->nvalues = batch->nval[k];
+        hts_expand(double, rtok->nvalues, rtok->mvalues, rtok->values);
+        memcpy(rtok->values, batch->val + batch->ival[k], sizeof(double)*batch->nval[k]);
+        return rtok->nargs;
+    }
 
     dSP;
     ENTER;
     SAVETMPS;
 
     PUSHMARK(SP);
-    int i,j, istack = nstack - rtok->nargs;
     for (i=istack+1; i<nstack; i++)
-    {
-        token_t *tok = stack[i];
-        if ( tok->is_str )
-            XPUSHs(sv_2mortal(newSVpvn(tok->str_value.s,tok->str_value.l)));
-        else if ( tok->nvalues==1 )
-            XPUSHs(sv_2mortal(newSVnv(tok->values[0])));
-        else if ( tok->nvalues>1 )
-        {
-            AV *av = newAV();
-            for (j=0; j<tok->nvalues; j++) av_push(av, newSVnv(tok->values[j]));
-            SV *rv = newRV_inc((SV*)av);
-            XPUSHs(rv);
-        }
-        else
-        {
-            bcf_double_set_missing(tok->values[0]);
-            XPUSHs(sv_2mortal(newSVnv(tok->values[0])));
-        }
-    }
+        XPUSHs(sv_2mortal(perl_new_sv(flt, stack[i])));
     PUTBACK;
 
     // A possible future todo: provide a means to select samples and indexes,
@@ -3016,6 +3267,14 @@ static void perl_destroy(filter_t *filter)
     if ( !filter->perl ) return;
 
     PerlInterpreter *perl = filter->perl;
+    PERL_SET_CONTEXT(perl);
+    int i, j;
+    for (i=0; i<filter->nfilters; i++)
+    {
+        perl_batch_t *batch = filter->filters[i].batch;
+        if ( !batch ) continue;
+        for (j=0; j<batch->nargs; j++) SvREFCNT_dec((SV*)batch->args[j]);
+    }
     perl_destruct(perl);
     perl_free(perl);
     if ( --filter_ninit <= 0  )
@@ -3027,6 +3286,158 @@ static void perl_destroy(filter_t *filter)
 }
 
 
+static void token_destroy(token_t *tok)
+{
+    if ( tok->key ) free(tok->key);
+    free(tok->str_value.s);
+    free(tok->tag);
+    free(tok->idxs);
+    free(tok->usmpl);
+    free(tok->values);
+    free(tok->pass_samples);
+    if ( tok->hash ) khash_str2int_destroy_free(tok->hash);
+    if ( tok->regex_cache ) khash_str2int_destroy_free(tok->regex_cache);
+    if ( tok->regex )
+    {
+        regfree(tok->regex);
+        free(tok->regex);
+    }
+    if ( tok->batch )
+    {
+        free(tok->batch->irec);
+        free(tok->batch->args);
+        free(tok->batch->ival);
+        free(tok->batch->nval);
+        free(tok->batch->val);
+        free(tok->batch);
+    }
+}
+static inline int is_numeric_constant(token_t *tok)
+{
+    if ( tok->tok_type!=TOK_VAL ) return 0;
+    if ( tok->setter || tok->comparator || tok->key || tok->tag || tok->hash || tok->nsamples ) return 0;
+    return 1;
+}
+
+// Evaluate arithmetic operations on numeric constants, such as the unary minus
+// "-1*(5)" or "2*3", once at initialization rather than at each VCF line
+static void filters_fold_constants(token_t *out, int *nout)
+{
+    int i;
+    for (i=2; i<*nout; i++)
+    {
+        int type = out[i].tok_type;
+        if ( type!=TOK_ADD && type!=TOK_SUB && type!=TOK_MULT && type!=TOK_DIV ) continue;
+        if ( !is_numeric_constant(&out[i-2]) || !is_numeric_constant(&out[i-1]) ) continue;
+
+        double a = out[i-2].threshold, b = out[i-1].threshold;
+        if ( type==TOK_ADD ) out[i-2].threshold = a + b;
+        else if ( type==TOK_SUB ) out[i-2].threshold = a - b;
+        else if ( type==TOK_MULT ) out[i-2].threshold = a * b;
+        else out[i-2].threshold = a / b;
+        out[i-2].is_constant = 1;
+
+        token_destroy(&out[i-1]);
+        token_destroy(&out[i]);
+        memmove(&out[i-1], &out[i+1], sizeof(*out)*(*nout-i-1));
+        *nout -= 2;
+        i -= 2;     // revisit the next operator, the folded value can be its operand
+    }
+}
+
+static int vector_logic_or(filter_t *filter, bcf1_t *line, token_t *rtok, token_t **stack, int nstack);
+static int vector_logic_and(filter_t *filter, bcf1_t *line, token_t *rtok, token_t **stack, int nstack);
+
+static inline int token_needs_format(token_t *tok)
+{
+    if ( tok->tag_type==BCF_HL_FMT || tok->nsamples ) return 1;
+    if ( tok->setter==filters_set_nmissing || tok->setter==filters_set_an || tok->setter==filters_set_ac ) return 1;
+    if ( tok->setter==filters_set_mac || tok->setter==filters_set_af || tok->setter==filters_set_maf ) return 1;
+    return 0;
+}
+
+// Find the operands of the logical operators so that the right operand can be skipped
+// when the left operand alone determines the result, see filters_short_circuit()
+static void filters_init_short_circuit(token_t *out, int nout)
+{
+    int i, j, nstart = 0, *start = (int*) malloc(sizeof(int)*nout);    // first token of each subexpression on the stack
+    for (i=0; i<nout; i++) out[i].skip_to = -1;
+    for (i=0; i<nout; i++)
+    {
+        token_t *tok = &out[i];
+        int nargs = 0;
+        if ( tok->tok_type!=TOK_VAL )
+        {
+            if ( tok->func==vector_logic_or || tok->func==vector_logic_and || !tok->func ) nargs = 2;
+            else nargs = tok->nargs ? tok->nargs : 1;
+        }
+        if ( nargs > nstart ) break;    // malformed expression, will be reported by filter_test()
+        if ( nargs==2 && (tok->func==vector_logic_or || tok->func==vector_logic_and) )
+        {
+            int rhs = start[nstart-1];
+            out[rhs].skip_to = i;
+            for (j=rhs; j<i; j++)
+                if ( out[j].unpack & BCF_UN_FMT ) tok->rhs_smpl = 1;
+        }
+        int beg = nargs ? start[nstart-nargs] : i;
+        nstart -= nargs;
+        start[nstart++] = beg;
+    }
+    free(start);
+}
+
+// Determine how is each token evaluated and set the values of constants so that filter_test()
+// does not need to repeat it for every VCF line
+static void filters_compile(token_t *out, int nout)
+{
+    int i;
+    for (i=0; i<nout; i++)
+    {
+        token_t *tok = &out[i];
+        tok->unpack = token_needs_format(tok) ? BCF_UN_FMT : 0;
+        if ( tok->tok_type==TOK_VAL )
+        {
+            if ( tok->setter ) { tok->eval_op = EVAL_SETTER; continue; }
+            tok->eval_op = EVAL_CONST;
+            if ( tok->key )     // string constant
+            {
+                tok->str_value.l = 0;
+                kputs(tok->key, &tok->str_value);
+                tok->nvalues = tok->str_value.l;
+            }
+            else                // numeric constant
+            {
+                tok->values[0] = tok->threshold;
+                tok->nvalues   = 1;
+            }
+        }
+        else if ( tok->func ) tok->eval_op = EVAL_FUNC;
+        else if ( tok->tok_type==TOK_ADD ) tok->eval_op = EVAL_ADD;
+        else if ( tok->tok_type==TOK_SUB ) tok->eval_op = EVAL_SUB;
+        else if ( tok->tok_type==TOK_MULT ) tok->eval_op = EVAL_MULT;
+        else if ( tok->tok_type==TOK_DIV ) tok->eval_op = EVAL_DIV;
+        else tok->eval_op = EVAL_CMP;
+    }
+
+    // Merge single-value FORMAT fields with their numeric comparison. The FORMAT token is then only
+    // a placeholder on the stack, the comparison reads the values directly.
+    for (i=2; i<nout; i++)
+    {
+        token_t *tok = &out[i];
+        if ( tok->eval_op!=EVAL_CMP || tok->comparator ) continue;
+        if ( tok->tok_type<TOK_LE || tok->tok_type>TOK_NE ) continue;
+        token_t *atok = &out[i-2], *btok = &out[i-1];
+        token_t *xtok = is_numeric_constant(atok) ? btok : atok;
+        if ( !is_numeric_constant(xtok==atok ? btok : atok) ) continue;
+        if ( xtok->setter!=filters_set_format_int && xtok->setter!=filters_set_format_float ) continue;
+        if ( xtok->idx < 0 || xtok->comparator ) continue;
+        tok->eval_op  = EVAL_CMP_FMT;
+        xtok->eval_op = EVAL_CONST;
+    }
+    filters_init_short_circuit(out, nout);
+}
+
+
 // Parse filter expression and convert to reverse polish notation. Dijkstra's shunting-yard algorithm
 filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
 {
@@ -3119,10 +3530,11 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
                 tmp += len;
                 char *beg = tmp;
                 kstring_t rmme = {0,0,0};
-                int i, margs, nargs = 0;
+                int i, margs, nargs = 0, is_batch = 0;
 
                 if ( ret == TOK_PERLSUB )
                 {
+                    if ( !strncasecmp(tmp,"BATCH.",6) ) { is_batch = 1; tmp += 6; beg = tmp; }
                     while ( *beg && ((isalnum(*beg) && !ispunct(*beg)) || *beg=='_') ) beg++;
                     if ( *beg!='(' ) error("Could not parse the expression: %s\n", str);
 
@@ -3162,6 +3574,11 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
                 tok->hdr_id    = -1;
                 tok->pass_site = -1;
                 tok->threshold = -1.0;
+                if ( is_batch )
+                {
+                    tok->batch = (perl_batch_t*) calloc(1,sizeof(perl_batch_t));
+                    filter->nbatch++;
+                }
 
                 tmp = end + 1;
                 continue;
@@ -3356,6 +3773,8 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
             continue;
         }
     }
+    filters_fold_constants(out, &nout);
+
     filter->nsamples = filter->max_unpack&BCF_UN_FMT ? bcf_hdr_nsamples(filter->hdr) : 0;
     for (i=0; i<nout; i++)
     {
@@ -3387,6 +3806,8 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
         }
     }
 
+    filters_compile(out, nout);
+
     if (0) filter_debug_print(out, NULL, nout);
 
     if ( mops ) free(ops);
@@ -3401,97 +3822,102 @@ void filter_destroy(filter_t *filter)
     perl_destroy(filter);
     int i;
     for (i=0; i<filter->nfilters; i++)
-    {
-        if ( filter->filters[i].key ) free(filter->filters[i].key);
-        free(filter->filters[i].str_value.s);
-        free(filter->filters[i].tag);
-        free(filter->filters[i].idxs);
-        free(filter->filters[i].usmpl);
-        free(filter->filters[i].values);
-        free(filter->filters[i].pass_samples);
-        if (filter->filters[i].hash) khash_str2int_destroy_free(filter->filters[i].hash);
-        if (filter->filters[i].regex)
-        {
-            regfree(filter->filters[i].regex);
-            free(filter->filters[i].regex);
-        }
-    }
+        token_destroy(&filter->filters[i]);
     free(filter->filters);
     free(filter->flt_stack);
     free(filter->str);
     free(filter->tmpi);
     free(filter->tmpf);
+    free(filter->tmpd);
     free(filter->tmps.s);
+    free(filter->binom_cache);
     free(filter);
 }
 
+// Site-level left operand of && or || which decides the outcome: set the result and skip
+// the evaluation of the right operand, which can involve expensive FORMAT unpacking
+static int filters_short_circuit(filter_t *filter, token_t *rtok, token_t **stack, int nstack)
+{
+    token_t *atok = stack[nstack-1];
+    if ( atok->nsamples ) return 0;
+    if ( rtok->func==vector_logic_and )
+    {
+        if ( atok->pass_site ) return 0;
+        rtok->pass_site = 0;
+    }
+    else
+    {
+        if ( !atok->pass_site || rtok->rhs_smpl ) return 0;
+        rtok->pass_site = 1;
+    }
+    tok_init_samples(atok, rtok-1, rtok);     // the token preceding the operator is the right operand
+    stack[nstack-1] = rtok;
+    return 1;
+}
+
 int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
 {
-    bcf_unpack(line, filter->max_unpack);
+    bcf_unpack(line, filter->max_unpack & ~BCF_UN_FMT);     // FORMAT fields are unpacked only when queried
 
     int i, nstack = 0;
     for (i=0; i<filter->nfilters; i++)
     {
-        filter->filters[i].pass_site = 0;
-        if ( filter->filters[i].tok_type == TOK_VAL )
+        token_t *tok = &filter->filters[i];
+        if ( tok->skip_to>=0 && filters_short_circuit(filter, &filter->filters[tok->skip_to], filter->flt_stack, nstack) )
+        {
+            i = tok->skip_to;
+            continue;
+        }
+        tok->pass_site = 0;
+        switch ( tok->eval_op )
         {
-            if ( filter->filters[i].setter )    // variable, query the VCF line
-                filter->filters[i].setter(filter, line, &filter->filters[i]);
-            else if ( filter->filters[i].key )  // string constant
+            case EVAL_CONST:
+                filter->flt_stack[nstack++] = tok;
+                continue;
+            case EVAL_SETTER:
             {
-                filter->filters[i].str_value.l = 0;
-                kputs(filter->filters[i].key, &filter->filters[i].str_value);
-                filter->filters[i].nvalues = filter->filters[i].str_value.l;
+                // in a filter set, queries shared with other expressions are evaluated once per record
+                token_t *stok = tok->shared ? tok->shared : tok;
+                if ( !filter->nrec || stok->eval_rec!=*filter->nrec )
+                {
+                    if ( stok->unpack & ~line->unpacked ) bcf_unpack(line, stok->unpack);
+                    stok->setter(filter, line, stok);
+                    if ( filter->nrec ) stok->eval_rec = *filter->nrec;
+                }
+                filter->flt_stack[nstack++] = stok;
+                continue;
             }
-            else    // numeric constant
+            case EVAL_FUNC:
             {
-                filter->filters[i].values[0] = filter->filters[i].threshold;
-                filter->filters[i].nvalues   = 1;
+                int nargs = tok->func(filter, line, tok, filter->flt_stack, nstack);
+                filter->flt_stack[nstack-nargs] = tok;
+                if ( --nargs > 0 ) nstack -= nargs;
+                continue;
             }
-            filter->flt_stack[nstack++] = &filter->filters[i];
-            continue;
-        }
-        else if ( filter->filters[i].func )
-        {
-            int nargs = filter->filters[i].func(filter, line, &filter->filters[i], filter->flt_stack, nstack);
-            filter->flt_stack[nstack-nargs] = &filter->filters[i];
-            if ( --nargs > 0 ) nstack -= nargs;
-            continue;
+            default: break;
         }
         if ( nstack<2 )
             error("Error occurred while processing the filter \"%s\" (1:%d)\n", filter->str,nstack);  // too few values left on the stack
 
-        int is_str  = filter->flt_stack[nstack-1]->is_str + filter->flt_stack[nstack-2]->is_str;
-
-        if ( filter->filters[i].tok_type == TOK_ADD )
+        switch ( tok->eval_op )
         {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],&filter->filters[i],+);
-            filter->flt_stack[nstack-2] = &filter->filters[i];
-            nstack--;
-            continue;
+            case EVAL_ADD:  VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],tok,+); break;
+            case EVAL_SUB:  VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],tok,-); break;
+            case EVAL_MULT: VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],tok,*); break;
+            case EVAL_DIV:  VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],tok,/); break;
+            default: break;
         }
-        else if ( filter->filters[i].tok_type == TOK_SUB )
+        if ( tok->eval_op==EVAL_CMP_FMT )
+            cmp_format_scalar(filter, line, filter->flt_stack[nstack-2], filter->flt_stack[nstack-1], tok);
+        if ( tok->eval_op!=EVAL_CMP )
         {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],&filter->filters[i],-);
-            filter->flt_stack[nstack-2] = &filter->filters[i];
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_MULT )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],&filter->filters[i],*);
-            filter->flt_stack[nstack-2] = &filter->filters[i];
-            nstack--;
-            continue;
-        }
-        else if ( filter->filters[i].tok_type == TOK_DIV )
-        {
-            VECTOR_ARITHMETICS(filter->flt_stack[nstack-2],filter->flt_stack[nstack-1],&filter->filters[i],/);
-            filter->flt_stack[nstack-2] = &filter->filters[i];
+            filter->flt_stack[nstack-2] = tok;
             nstack--;
             continue;
         }
 
+        int is_str  = filter->flt_stack[nstack-1]->is_str + filter->flt_stack[nstack-2]->is_str;
+
         // ideally, these comparators would become func, but this would require more work in init1()
         if ( filter->filters[i].comparator )
         {
@@ -3549,6 +3975,38 @@ int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
     return filter->flt_stack[0]->pass_site;
 }
 
+int filter_test_batch(filter_t *filter, bcf1_t **recs, int nrec, int *pass, uint8_t *smpl_pass)
+{
+    int i, npass = 0;
+    if ( filter->nbatch )
+    {
+        // PERL.BATCH subroutines: a first pass collects the arguments of all records, the
+        // subroutines are called once for the block and the second pass uses their results
+        perl_batch_reset(filter, nrec);
+        filter->batch_mode = BATCH_COLLECT;
+        for (i=0; i<nrec; i++)
+        {
+            filter->batch_rec = i;
+            filter_test(filter, recs[i], NULL);
+        }
+        perl_batch_call(filter);
+        filter->batch_mode = BATCH_REPLAY;
+    }
+    for (i=0; i<nrec; i++)
+    {
+        filter->batch_rec = i;
+        const uint8_t *smpl = NULL;
+        pass[i] = filter_test(filter, recs[i], smpl_pass ? &smpl : NULL);
+        if ( pass[i] ) npass++;
+        if ( !smpl_pass ) continue;
+        uint8_t *dst = smpl_pass + (size_t)i*filter->nsamples;
+        if ( smpl ) memcpy(dst, smpl, filter->nsamples);
+        else memset(dst, pass[i] ? 1 : 0, filter->nsamples);
+    }
+    filter->batch_mode = BATCH_OFF;
+    return npass;
+}
+
 int filter_max_unpack(filter_t *flt)
 {
     return flt->max_unpack;
@@ -3556,10 +4014,90 @@ int filter_max_unpack(filter_t *flt)
 
 const double *filter_get_doubles(filter_t *filter, int *nval, int *nval1)
 {
-    token_t *tok = filter->flt_stack[filter->nfilters-1];
+    token_t *tok = filter->flt_stack[0];
     *nval  = tok->nvalues;
     *nval1 = tok->nval1;
     return tok->values;
 }
 
 
+
+struct _filter_set_t
+{
+    int nflt;
+    filter_t **flt;
+    uint64_t nrec;
+};
+
+// Two VCF queries are identical if they read the same field, indexes and samples
+static int tokens_same_query(token_t *atok, token_t *btok)
+{
+    if ( atok->setter!=btok->setter || atok->comparator!=btok->comparator ) return 0;
+    if ( atok->hash || btok->hash || atok->key || btok->key ) return 0;
+    if ( atok->hdr_id!=btok->hdr_id || atok->tag_type!=btok->tag_type || atok->is_str!=btok->is_str ) return 0;
+    if ( atok->idx!=btok->idx || atok->nidxs!=btok->nidxs || atok->nuidxs!=btok->nuidxs ) return 0;
+    if ( atok->nidxs && memcmp(atok->idxs,btok->idxs,sizeof(*atok->idxs)*atok->nidxs) ) return 0;
+    if ( atok->nsamples!=btok->nsamples ) return 0;
+    if ( atok->nsamples && memcmp(atok->usmpl,btok->usmpl,atok->nsamples) ) return 0;
+    if ( !atok->tag || !btok->tag ) return atok->tag==btok->tag ? 1 : 0;
+    return strcmp(atok->tag,btok->tag) ? 0 : 1;
+}
+
+filter_set_t *filter_set_init(bcf_hdr_t *hdr, int nexpr, char **expr)
+{
+    filter_set_t *fset = (filter_set_t*) calloc(1,sizeof(filter_set_t));
+    fset->nflt = nexpr;
+    fset->flt  = (filter_t**) calloc(nexpr,sizeof(filter_t*));
+    int i,j,k,l;
+    for (i=0; i<nexpr; i++)
+    {
+        filter_t *flt = fset->flt[i] = filter_init(hdr, expr[i]);
+        flt->nrec = &fset->nrec;
+        for (j=0; j<flt->nfilters; j++)
+        {
+            token_t *tok = &flt->filters[j];
+            if ( tok->eval_op!=EVAL_SETTER ) continue;
+            for (k=0; k<=i && !tok->shared; k++)
+            {
+                filter_t *prev = fset->flt[k];
+                int nprev = k==i ? j : prev->nfilters;
+                for (l=0; l<nprev; l++)
+                {
+                    token_t *ptok = &prev->filters[l];
+                    if ( ptok->eval_op!=EVAL_SETTER || ptok->shared ) continue;
+                    if ( !tokens_same_query(ptok,tok) ) continue;
+                    tok->shared = ptok;
+                    break;
+                }
+            }
+        }
+    }
+    return fset;
+}
+
+void filter_set_destroy(filter_set_t *fset)
+{
+    int i;
+    for (i=0; i<fset->nflt; i++) filter_destroy(fset->flt[i]);
+    free(fset->flt);
+    free(fset);
+}
+
+int filter_set_test(filter_set_t *fset, bcf1_t *rec, int *pass, const uint8_t **samples)
+{
+    fset->nrec++;
+    int i, npass = 0;
+    for (i=0; i<fset->nflt; i++)
+    {
+        pass[i] = filter_test(fset->flt[i], rec, samples ? &samples[i] : NULL);
+        if ( pass[i] ) npass++;
+    }
+    return npass;
+}
+
+int filter_set_max_unpack(filter_set_t *fset)
+{
+    int i, max_unpack = 0;
+    for (i=0; i<fset->nflt; i++) max_unpack |= fset->flt[i]->max_unpack;
+    return max_unpack;
+}
@@ -46,6 +46,17 @@ void filter_destroy(filter_t *filter);
   */
 int filter_test(filter_t *filter, bcf1_t *rec, const uint8_t **samples);
 
+/**
+  *  filter_test_batch() - test a block of BCF records
+  *  @recs:      array of nrec records
+  *  @pass:      array of nrec results, see filter_test()
+  *  @smpl_pass: NULL or array of nrec*nsamples sample statuses, filled record by
+  *              record. When the FORMAT fields are not queried, the status of all
+  *              samples is set to the record's result.
+  *  Returns the number of records for which the expression is true.
+  */
+int filter_test_batch(filter_t *filter, bcf1_t **recs, int nrec, int *pass, uint8_t *smpl_pass);
+
 /**
   *  filter_get_doubles() - return a pointer to values from the last filter_test() evaluation
   */
@@ -54,4 +65,22 @@ const double *filter_get_doubles(filter_t *filter, int *nval, int *nval1);
 void filter_expression_info(FILE *fp);
 int filter_max_unpack(filter_t *filter);
 
+/**
+  *  A set of expressions evaluated on the same records, VCF fields queried
+  *  by several expressions are retrieved only once per record.
+  */
+typedef struct _filter_set_t filter_set_t;
+
+filter_set_t *filter_set_init(bcf_hdr_t *hdr, int nexpr, char **expr);
+void filter_set_destroy(filter_set_t *fset);
+
+/**
+  *  filter_set_test() - test the BCF record against all expressions of the set
+  *  @pass:     array of nexpr results, see filter_test()
+  *  @samples:  NULL or array of nexpr sample status pointers, see filter_test()
+  *  Returns the number of expressions which are true.
+  */
+int filter_set_test(filter_set_t *fset, bcf1_t *rec, int *pass, const uint8_t **samples);
+int filter_set_max_unpack(filter_set_t *fset);
+
 #endif
@@ -85,6 +85,38 @@ void gvcf_destroy(gvcf_t *gvcf)
     free(gvcf);
 }
 
+// The comparisons below are written as conditional moves rather than branches
+// so that the compiler can vectorize the loops, nearly all sites of a gVCF
+// take this path
+static inline int32_t min_int32(int32_t *arr, int n)
+{
+    int i;
+    int32_t min = arr[0];
+    for (i=1; i<n; i++) min = arr[i] < min ? arr[i] : min;
+    return min;
+}
+
+// Lower the block's DP to the per-sample minimum
+static inline void merge_dp(int32_t *dp, int32_t *rec_dp, int n)
+{
+    int i;
+    for (i=0; i<n; i++) dp[i] = rec_dp[i] < dp[i] ? rec_dp[i] : dp[i];
+}
+
+// Keep the per-sample PL of the block as the minimum of (PL[1],PL[2]) pairs,
+// compared by PL[1] first and by PL[2] if equal
+static inline void merge_pl(int32_t *pl, int32_t *rec_pl, int n)
+{
+    int i;
+    for (i=0; i<n; i++)
+    {
+        int32_t *a = pl + 3*i, *b = rec_pl + 3*i;
+        int take = (b[1] < a[1]) | ((b[1]==a[1]) & (b[2] < a[2]));
+        a[1] = take ? b[1] : a[1];
+        a[2] = take ? b[2] : a[2];
+    }
+}
+
 bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int is_ref)
 {
     int i, ret, nsmpl = bcf_hdr_nsamples(hdr);
@@ -108,9 +140,7 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
         ret = bcf_get_format_int32(hdr, rec, "DP", &gvcf->tmp, &gvcf->mtmp);
         if ( ret==nsmpl )
         {
-            min_dp = gvcf->tmp[0];
-            for (i=1; i<nsmpl; i++)
-                if ( min_dp > gvcf->tmp[i] ) min_dp = gvcf->tmp[i];
+            min_dp = min_int32(gvcf->tmp, nsmpl);
 
             for (i=0; i<gvcf->ndp_range; i++)
                 if ( min_dp < gvcf->dp_range[i] ) break;
@@ -191,22 +221,12 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
         else
         {
             if ( gvcf->min_dp > min_dp ) gvcf->min_dp = min_dp;
-            for (i=0; i<nsmpl; i++)
-                if ( gvcf->dp[i] > gvcf->tmp[i] ) gvcf->dp[i] = gvcf->tmp[i];
+            merge_dp(gvcf->dp, gvcf->tmp, nsmpl);
             ret = bcf_get_format_int32(hdr, rec, "PL", &gvcf->tmp, &gvcf->mtmp);
             if ( ret>=0 )
             {
                 if ( ret!=nsmpl*3 ) error("Unexpected number of PL fields\n");
-                for (i=0; i<nsmpl; i++)
-                {
-                    if ( gvcf->pl[3*i+1] > gvcf->tmp[3*i+1] )
-                    {
-                        gvcf->pl[3*i+1] = gvcf->tmp[3*i+1];
-                        gvcf->pl[3*i+2] = gvcf->tmp[3*i+2];
-                    }
-                    else if ( gvcf->pl[3*i+1]==gvcf->tmp[3*i+1] && gvcf->pl[3*i+2] > gvcf->tmp[3*i+2] )
-                        gvcf->pl[3*i+2] = gvcf->tmp[3*i+2];
-                }
+                merge_pl(gvcf->pl, gvcf->tmp, nsmpl);
             }
             else
                 gvcf->npl = 0;
@@ -33,7 +33,7 @@
 
 typedef struct _node_t
 {
-    struct _node_t *akid, *bkid, *next, *prev, *parent;
+    struct _node_t *akid, *bkid, *parent;
     int id, idx;    // id: unique node id; idx: current index to pdist
     float value;    // max pairwise dist of elements within the node
 }
@@ -43,46 +43,27 @@ struct _hclust_t
 {
     int ndat, nclust;       // ndat: number of elements (pdist matrix size); nclust: current number of clusters
     float *pdist;           // pairwise cluster distances, diagonal matrix accessed via the PDIST macro
-    node_t *first, *last;   // clusters are maintained in a double-linked list
-    node_t **rmme;          // convenience array to remove all allocated nodes at the end
+    node_t *nodes, *root;   // all 2*ndat-1 nodes allocated in one block; root of the tree
+    node_t **rmme;          // nodes in the order of creation, the leaves first
     int nrmme;
+    node_t **idx2node;      // the active cluster which occupies the idx-th row of pdist or NULL
+    int *active;            // pdist indexes of the active clusters, the first nclust are valid
     kstring_t str;          // (for debugging) pointer to str.s is returned by create_dot()
     char **dbg;             // (for debugging) created by create_list() via set_threshold() and returned by explain()
     int ndbg, mdbg;
 };
 
-node_t *append_node(hclust_t *clust, int idx)
+static node_t *append_node(hclust_t *clust, int idx)
 {
-    node_t *node = (node_t*) calloc(1,sizeof(node_t));
+    if ( clust->nrmme >= clust->ndat*2 ) error("hclust fixme: %d vs %d\n",clust->nrmme,clust->ndat);
 
-    clust->nclust++;
+    node_t *node = &clust->nodes[clust->nrmme];
     node->id  = clust->nrmme;
     node->idx = idx;
-    if ( !clust->first )
-    {
-        clust->first = node; 
-        clust->last  = node; 
-    }
-    else
-    {
-        node->prev = clust->last;
-        clust->last->next = node; 
-        clust->last = node; 
-    }
-    
-    if ( clust->nrmme >= clust->ndat*2 ) error("hclust fixme: %d vs %d\n",clust->nrmme,clust->ndat);
     clust->rmme[clust->nrmme++] = node;
-
+    clust->idx2node[idx] = node;
     return node;
 }
-void remove_node(hclust_t *clust, node_t *node)
-{
-    if ( node==clust->first ) clust->first = node->next;
-    if ( node==clust->last ) clust->last = node->prev;
-    if ( node->next ) node->next->prev = node->prev;
-    if ( node->prev ) node->prev->next = node->next;
-    clust->nclust--;
-}
 
 #if DEBUG
 void hclust_debug(hclust_t *clust)
@@ -102,13 +83,7 @@ void hclust_debug(hclust_t *clust)
     int j;
     for (i=1; i<clust->ndat; i++)
     {
-        int active = 0;
-        node_t *node = clust->first;
-        while (node)
-        {
-            if ( node->idx==i ) { active=1; break; }
-            node = node->next;
-        }
+        int active = clust->idx2node[i] ? 1 : 0;
         fprintf(stderr,"%2d%c ",i,active?'*':' ');
         for (j=0; j<i; j++)
         {
@@ -123,71 +98,100 @@ void hclust_debug(hclust_t *clust)
 }
 #endif
 
+/*
+    Complete-linkage clustering by the nearest-neighbour chain algorithm. The
+    chain is grown from an active cluster to its nearest neighbour until two
+    clusters are mutual nearest neighbours, these are merged and the search
+    continues from the rest of the chain. The linkage is reducible, therefore
+    the tree is the same as when always merging the globally closest pair,
+    only the merges are found in a different order. This takes O(n^2) time
+    instead of O(n^3) and no memory beyond the pdist matrix.
+ */
 hclust_t *hclust_init(int n, float *pdist)
 {
     hclust_t *clust = (hclust_t*) calloc(1,sizeof(hclust_t));
     clust->ndat  = n;
     clust->pdist = pdist;
-    clust->rmme = (node_t**) calloc(n*2,sizeof(node_t*));
+    clust->nodes = (node_t*) calloc(n*2,sizeof(node_t));
+    clust->rmme  = (node_t**) calloc(n*2,sizeof(node_t*));
+    clust->idx2node = (node_t**) calloc(n,sizeof(node_t*));
+    clust->active = (int*) malloc(sizeof(int)*n);
+    int *chain = (int*) malloc(sizeof(int)*n);
 
     // init clusters
-    int i;
-    for (i=0; i<clust->ndat; i++) append_node(clust,i);
+    int i, j, nchain = 0;
+    for (i=0; i<clust->ndat; i++)
+    {
+        append_node(clust,i);
+        clust->active[i] = i;
+    }
+    clust->nclust = clust->ndat;
 
     // build the tree
     while ( clust->nclust>1 )
     {
-        // find two clusters with minimum distance
-        float min_value = HUGE_VAL;
-        node_t *iclust = clust->first->next;
-        node_t *min_iclust = NULL, *min_jclust = NULL;
-        while ( iclust )
+        if ( !nchain ) chain[nchain++] = clust->active[0];
+
+        // find the nearest neighbour of the cluster at the top of the chain. In case
+        // of ties the previous cluster in the chain wins, so that the chain cannot cycle
+        int iidx = chain[nchain-1];
+        int jidx = nchain>1 ? chain[nchain-2] : -1;
+        float min_value = jidx<0 ? HUGE_VAL : PDIST(clust->pdist,iidx,jidx);
+        for (i=0; i<clust->nclust; i++)
         {
-            node_t *jclust = clust->first;
-            while ( jclust!=iclust )
+            int idx = clust->active[i];
+            if ( idx==iidx ) continue;
+            float value = PDIST(clust->pdist,iidx,idx);
+            if ( value < min_value )
             {
-                float value = PDIST(clust->pdist,iclust->idx,jclust->idx);
-                if ( value < min_value ) 
-                { 
-                    min_value  = value;
-                    min_iclust = iclust;
-                    min_jclust = jclust; 
-                }
-                jclust = jclust->next;
+                min_value = value;
+                jidx = idx;
             }
-            iclust = iclust->next;
         }
-        assert( min_iclust && min_jclust ); // pdist contains inf or nan, fix the caller
-        remove_node(clust,min_iclust);
-        remove_node(clust,min_jclust);
+        assert( jidx>=0 );  // pdist contains inf or nan, fix the caller
 
-        // update the pairwise distances. We keep the matrix and as we are moving up the
+        if ( nchain<2 || jidx!=chain[nchain-2] )
+        {
+            chain[nchain++] = jidx;
+            continue;
+        }
+        nchain -= 2;
+
+        // merge the two mutual nearest neighbours. We keep the matrix and as we are moving up the
         // tree, we use fewer columns/rows as the number of clusters decreases: we reuse
         // i-th and leave j-th unused. Inter-cluster distance is defined as maximum distance
         // between pairwise distances of elements within the cluster.
-        iclust = clust->first;
-        while ( iclust )
+        node_t *min_iclust = clust->idx2node[iidx];
+        node_t *min_jclust = clust->idx2node[jidx];
+        clust->idx2node[jidx] = NULL;
+        for (i=0, j=-1; i<clust->nclust; i++)
         {
-            if ( PDIST(clust->pdist,iclust->idx,min_iclust->idx) < PDIST(clust->pdist,iclust->idx,min_jclust->idx) )
-                PDIST(clust->pdist,iclust->idx,min_iclust->idx) = PDIST(clust->pdist,iclust->idx,min_jclust->idx);
-            iclust = iclust->next;
+            int idx = clust->active[i];
+            if ( idx==jidx ) { j = i; continue; }
+            if ( idx==iidx ) continue;
+            if ( PDIST(clust->pdist,idx,iidx) < PDIST(clust->pdist,idx,jidx) )
+                PDIST(clust->pdist,idx,iidx) = PDIST(clust->pdist,idx,jidx);
         }
+        clust->active[j] = clust->active[--clust->nclust];
 
-        node_t *node = append_node(clust,min_iclust->idx);
+        node_t *node = append_node(clust,iidx);
         node->akid  = min_iclust;
         node->bkid  = min_jclust;
         node->value = min_value;
         node->akid->parent = node;
         node->bkid->parent = node;
     }
+    clust->root = clust->nrmme ? clust->rmme[clust->nrmme-1] : NULL;
+    free(chain);
 
     return clust;
 }
 void hclust_destroy(hclust_t *clust)
 {
-    int i;
-    for (i=0; i<clust->nrmme; i++) free(clust->rmme[i]);
+    free(clust->nodes);
     free(clust->rmme);
+    free(clust->idx2node);
+    free(clust->active);
     free(clust->dbg);
     free(clust->str.s);
     free(clust);
@@ -349,7 +353,7 @@ cluster_t *hclust_create_list(hclust_t *clust, float min_inter_dist, float *max_
 
     node_t **stack = (node_t**) malloc(sizeof(node_t*)*clust->ndat);
     node_t **tmp = (node_t**) malloc(sizeof(node_t*)*clust->ndat);
-    stack[0] = clust->first;
+    stack[0] = clust->root;
     int nstack = 1;
     
     cluster_t *cluster = NULL;
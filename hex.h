@@ -55,7 +55,36 @@
  */
 static inline size_t hex_uint64_t(uint64_t n, char *str)
 {
-    return sprintf(str, "%016" PRIx64, n);
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 15; i >= 0; i--)
+    {
+        str[i] = digits[n & 0xf];
+        n >>= 4;
+    }
+    str[16] = 0;
+    return 16;
+}
+
+/** @brief Returns uint32_t hexadecimal string (8 characters).
+ *
+ * @param n     Number to parse
+ * @param str   String buffer to be returned (it must be sized 9 bytes at least).
+ *
+ * @return      Upon successful return, these function returns the number of characters processed
+ *              (excluding the null byte used to end output to strings).
+ */
+static inline size_t hex_uint32_t(uint32_t n, char *str)
+{
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 7; i >= 0; i--)
+    {
+        str[i] = digits[n & 0xf];
+        n >>= 4;
+    }
+    str[8] = 0;
+    return 8;
 }
 
 /** @brief Parses a 16 chars hexadecimal string and returns the code.
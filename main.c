@@ -60,6 +60,7 @@ int main_consensus(int argc, char *argv[]);
 int main_csq(int argc, char *argv[]);
 int bam_mpileup(int argc, char *argv[]);
 int main_sort(int argc, char *argv[]);
+int main_refimage(int argc, char *argv[]);
 
 typedef struct
 {
@@ -78,6 +79,10 @@ static cmd_t cmds[] =
       .alias = "index",
       .help = "index VCF/BCF files"
     },
+    { .func = main_refimage,
+      .alias = "refimage",
+      .help = "create a memory-mappable reference image"
+    },
     { .func = main_tabix,
       .alias = "tabix",
       .help = "-tabix for BGZF'd BED, GFF, SAM, VCF and more" // do not advertise; only keep here for testing
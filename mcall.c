@@ -308,6 +308,44 @@ static void init_sample_groups(call_t *call)
         free(lines);
     }
 }
+
+// Preallocate the per-site buffers for sites with up to PREALLOC_NALS alleles,
+// so that they are not reallocated when calling ordinary pileup output (ACGT
+// and <*>). Sites with more alleles still grow them with hts_expand().
+#define PREALLOC_NALS 5
+static void mcall_init_scratch(call_t *call)
+{
+    int i, nsmpl = bcf_hdr_nsamples(call->hdr), ngts = PREALLOC_NALS*(PREALLOC_NALS+1)/2;
+    call->npdg = nsmpl*ngts;
+    call->pdg  = (double*) malloc(sizeof(double)*call->npdg);
+    call->mPLs = nsmpl*ngts;
+    call->PLs  = (int32_t*) malloc(sizeof(int32_t)*call->mPLs);
+    call->n_itmp = nsmpl*ngts;
+    call->itmp   = (int32_t*) malloc(sizeof(int32_t)*call->n_itmp);
+    if ( call->output_tags & CALL_FMT_GP )
+    {
+        call->nGPs = nsmpl*ngts;
+        call->GPs  = (float*) malloc(sizeof(float)*call->nGPs);
+    }
+    if ( call->sample_groups )
+    {
+        call->nADs = nsmpl*PREALLOC_NALS;
+        call->ADs  = (int32_t*) malloc(sizeof(int32_t)*call->nADs);
+    }
+    call->n16    = 16;
+    call->anno16 = (float*) malloc(sizeof(float)*call->n16);
+    call->nac  = call->nqsum = call->nals = PREALLOC_NALS;
+    call->ac   = (int*) malloc(sizeof(int)*call->nac);
+    call->qsum = (float*) malloc(sizeof(float)*call->nqsum);
+    call->als  = (char**) malloc(sizeof(char*)*call->nals);
+    for (i=0; i<call->smpl_grp.ngrp; i++)
+    {
+        call->smpl_grp.grp[i].nqsum = PREALLOC_NALS;
+        call->smpl_grp.grp[i].qsum  = (float*) malloc(sizeof(float)*PREALLOC_NALS);
+    }
+    call->map_nals = 0;
+}
+
 static void destroy_sample_groups(call_t *call)
 {
     int i;
@@ -375,6 +413,7 @@ void mcall_init(call_t *call)
     }
 
     init_sample_groups(call);
+    mcall_init_scratch(call);
 }
 
 void mcall_destroy(call_t *call)
@@ -399,6 +438,57 @@ void mcall_destroy(call_t *call)
     return;
 }
 
+call_t *mcall_clone(call_t *src)
+{
+    int i, nsmpl = bcf_hdr_nsamples(src->hdr);
+    call_t *call = (call_t*) malloc(sizeof(call_t));
+    memcpy(call, src, sizeof(call_t));
+
+    // shared read-only: the header, the prior, trio tables, families, sample groups mapping and pl2p
+    call->als_map = (int*) malloc(sizeof(int)*call->nals_map);
+    call->pl_map  = (int*) malloc(sizeof(int)*call->npl_map);
+    call->gts = (int32_t*) calloc(nsmpl*2,sizeof(int32_t));
+    if ( src->cgts ) call->cgts = (int32_t*) calloc(nsmpl,sizeof(int32_t));
+    if ( src->ugts ) call->ugts = (int32_t*) calloc(nsmpl,sizeof(int32_t));
+    if ( src->GQs ) call->GQs = (int32_t*) malloc(sizeof(int32_t)*nsmpl);
+    call->GLs = src->GLs ? (double*) calloc(nsmpl*10,sizeof(double)) : NULL;
+    call->GPs = NULL; call->nGPs = 0;
+    call->ADs = NULL; call->nADs = 0;
+    call->vcmp = NULL;
+    call->smpl_grp.grp = (grp1_t*) calloc(call->smpl_grp.ngrp, sizeof(grp1_t));
+    mcall_init_scratch(call);
+    call->ploidy = NULL;
+    if ( src->ploidy )
+    {
+        call->ploidy = (uint8_t*) malloc(nsmpl);
+        for (i=0; i<nsmpl; i++) call->ploidy[i] = src->ploidy[i];
+    }
+    return call;
+}
+
+void mcall_destroy_clone(call_t *call)
+{
+    int i;
+    for (i=0; i<call->smpl_grp.ngrp; i++)
+        free(call->smpl_grp.grp[i].qsum);
+    free(call->smpl_grp.grp);
+    free(call->itmp);
+    free(call->GPs);
+    free(call->ADs);
+    free(call->GLs);
+    free(call->GQs);
+    free(call->anno16);
+    free(call->PLs);
+    free(call->als_map);
+    free(call->pl_map);
+    free(call->gts); free(call->cgts); free(call->ugts);
+    free(call->pdg);
+    free(call->als);
+    free(call->ac);
+    free(call->qsum);
+    free(call->ploidy);
+    free(call);
+}
 
 // Inits P(D|G): convert PLs from log space and normalize. In case of zero
 // depth, missing PLs are all zero. In this case, pdg's are set to 0
@@ -410,6 +500,15 @@ void mcall_destroy(call_t *call)
 // the original samtools -c calling code uses pdgs in reverse order (AA comes
 // first, RR last).
 // NB: Ploidy is not taken into account here, which is incorrect.
+
+// PL to probability for any PL, 10^(-PL/10) = pl2p[PL%256] * 10^(-25.6*(PL/256))
+static inline double pl2prob(double *pl2p, int pl)
+{
+    if ( pl < 256 ) return pl2p[pl];
+    double p = pl2p[pl & 255];
+    for (pl >>= 8; pl>0 && p; pl--) p *= 2.5118864315095796e-26;
+    return p;
+}
 void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unseen)
 {
     int i, j, nals;
@@ -431,7 +530,7 @@ void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unse
                 break;
             }
             if ( PLs[j]==bcf_int32_missing ) break;
-            pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
+            pdg[j] = pl2prob(pl2p, PLs[j]);
             sum += pdg[j];
         }
 
@@ -450,7 +549,7 @@ void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unse
             {
                 assert( PLs[j]!=bcf_int32_vector_end );
                 if ( PLs[j]==bcf_int32_missing ) PLs[j] = 255;
-                pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
+                pdg[j] = pl2prob(pl2p, PLs[j]);
                 sum += pdg[j];
             }
         }
@@ -508,6 +607,11 @@ void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unse
 // Create mapping between old and new (trimmed) alleles
 void init_allele_trimming_maps(call_t *call, int als, int nals)
 {
+    // the maps do not change as long as the same alleles are kept
+    if ( call->map_nals==nals && call->map_als==als ) return;
+    call->map_nals = nals;
+    call->map_als  = als;
+
     int i, j;
 
     // als_map: old(i) -> new(j)
@@ -600,6 +704,23 @@ float calc_HOB(int nref, int nalt, int nhets, int ndiploid)
 
 //     return log(sum) + max_exp;
 // }
+/*
+ *  Sum of logs of many probabilities, accumulated as a product scaled by
+ *  frexp() to stay clear of underflow, which saves a log() per sample.
+ */
+typedef struct { double m; int e; } lkprod_t;
+static inline void lkprod_mul(lkprod_t *lk, double val)
+{
+    int e;
+    if ( val < 1e-150 ) { val = frexp(val,&e); lk->e += e; }
+    lk->m *= val;
+    if ( lk->m < 1e-150 ) { lk->m = frexp(lk->m,&e); lk->e += e; }
+}
+static inline double lkprod_log(lkprod_t *lk)
+{
+    return log(lk->m) + lk->e*M_LN2;
+}
+
 /** log(exp(a)+exp(b)) */
 static inline double logsumexp2(double a, double b)
 {
@@ -632,16 +753,17 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
     // Single allele
     for (ia=0; ia<nals; ia++)
     {
-        double lk_tot  = 0;
+        lkprod_t lk = {1,0};
         int lk_tot_set = 0;
         int iaa = (ia+1)*(ia+2)/2-1;    // index in PL which corresponds to the homozygous "ia/ia" genotype
         int isample;
         double *pdg = call->pdg + iaa;
         for (isample=0; isample<nsmpl; isample++)
         {
-            if ( *pdg ) { lk_tot += log(*pdg); lk_tot_set = 1; }
+            if ( *pdg ) { lkprod_mul(&lk, *pdg); lk_tot_set = 1; }
             pdg += ngts;
         }
+        double lk_tot = lkprod_log(&lk);
         if ( ia==0 ) ref_lk = lk_tot;   // likelihood of 0/0 for all samples
         else lk_tot += call->theta; // the prior
         UPDATE_MAX_LKs(1<<ia, ia>0 && lk_tot_set);
@@ -659,7 +781,7 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
             for (ib=0; ib<ia; ib++)
             {
                 if ( grps->ngrp==1 && grps->grp[0].qsum[ib]==0 ) continue;
-                double lk_tot  = 0;
+                lkprod_t lk = {1,0};
                 int lk_tot_set = 0;
                 int ia_cov = 0, ib_cov = 0;
                 for (j=0; j<grps->ngrp; j++)
@@ -687,9 +809,10 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                         val = grp->fa2*pdg[iaa] + grp->fb2*pdg[ibb] + grp->fab*pdg[iab];
                     else if ( call->ploidy && call->ploidy[isample]==1 )
                         val = grp->fa*pdg[iaa] + grp->fb*pdg[ibb];
-                    if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
+                    if ( val ) { lkprod_mul(&lk, val); lk_tot_set = 1; }
                     pdg += ngts;
                 }
+                double lk_tot = lkprod_log(&lk);
                 if ( ia!=0 ) lk_tot += call->theta;    // the prior
                 if ( ib!=0 ) lk_tot += call->theta;
                 UPDATE_MAX_LKs(1<<ia|1<<ib, lk_tot_set);
@@ -712,7 +835,7 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                 for (ic=0; ic<ib; ic++)
                 {
                     if (  grps->ngrp==1 && grps->grp[0].qsum[ic]==0 ) continue;
-                    double lk_tot  = 0;
+                    lkprod_t lk = {1,0};
                     int lk_tot_set = 1;
                     int ia_cov = 0, ib_cov = 0, ic_cov = 0;
                     for (j=0; j<grps->ngrp; j++)
@@ -744,9 +867,10 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                             val = grp->fa2*pdg[iaa] + grp->fb2*pdg[ibb] + grp->fc2*pdg[icc] + grp->fab*pdg[iab] + grp->fac*pdg[iac] + grp->fbc*pdg[ibc];
                         else if ( call->ploidy && call->ploidy[isample]==1 )
                             val = grp->fa*pdg[iaa] + grp->fb*pdg[ibb] + grp->fc*pdg[icc];
-                        if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
+                        if ( val ) { lkprod_mul(&lk, val); lk_tot_set = 1; }
                         pdg += ngts;
                     }
+                    double lk_tot = lkprod_log(&lk);
                     if ( ia!=0 ) lk_tot += call->theta;    // the prior
                     if ( ib!=0 ) lk_tot += call->theta;    // the prior
                     if ( ic!=0 ) lk_tot += call->theta;    // the prior
@@ -1349,6 +1473,7 @@ static int mcall_constrain_alleles(call_t *call, bcf1_t *rec, int *unseen)
     int has_new = 0;
 
     int i, j, nals = 1;
+    call->map_nals = 0;     // the maps are reused below, invalidate
     for (i=1; i<call->nals_map; i++) call->als_map[i] = -1;
 
     if ( vcmp_set_ref(call->vcmp, rec->d.allele[0], call->tgt_als->allele[0]) < 0 )
@@ -73,6 +73,18 @@ sub severity
     return $max;
 }
 
+# The batched variant, invoked as "perl.batch.severity_batch(INFO/CSQ)". With
+# `bcftools filter --threads` it is called once for a block of records: each argument
+# is a reference to an array of per-record values and one value per record must be
+# returned. When called for a single record, the arguments are the record's values.
+#
+sub severity_batch
+{
+    my ($csq) = @_;
+    if ( ref($csq) ne 'ARRAY' ) { return severity($csq); }
+    return map { severity($_) } @$csq;
+}
+
 sub error
 {
     my (@msg) = @_;
@@ -36,15 +36,18 @@ DEALINGS IN THE SOFTWARE.  */
 #include <sys/stat.h>
 #include <getopt.h>
 #include <htslib/sam.h>
-#include <htslib/faidx.h>
 #include <htslib/kstring.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/thread_pool.h>
 #include <assert.h>
 #include "regidx.h"
 #include "bcftools.h"
 #include "bam2bcf.h"
 #include "bam_sample.h"
 #include "gvcf.h"
+#include "regplan.h"
+#include "kheap.h"
+#include "refseq.h"
 
 #define MPLP_BCF        1
 #define MPLP_VCF        (1<<1)
@@ -61,6 +64,17 @@ DEALINGS IN THE SOFTWARE.  */
 #define MPLP_SMART_OVERLAPS (1<<12)
 
 typedef struct _mplp_aux_t mplp_aux_t;
+
+static inline int end_is_smaller(int32_t *a, int32_t *b) { return *a < *b ? 1 : 0; }
+KHEAP_INIT(end, int32_t, end_is_smaller)
+
+// Per-sample state of --downsample: the end positions of the reads which overlap the current position
+typedef struct
+{
+    int tid;
+    khp_end_t *ends;
+}
+mplp_dsmpl_t;
 typedef struct _mplp_pileup_t mplp_pileup_t;
 
 // Data shared by all bam files
@@ -71,11 +85,19 @@ typedef struct {
     double min_frac; // for indels
     char *reg_fname, *pl_list, *fai_fname, *output_fname;
     int reg_is_file, record_cmd_line, n_threads;
-    faidx_t *fai;
+    refseq_t *ref;
     regidx_t *bed, *reg;    // bed: skipping regions, reg: index-jump to regions
     regitr_t *bed_itr, *reg_itr;
     int bed_logic;          // 1: include region, 0: exclude region
+    char *targets;          // the -t/-T argument without the leading '^', see init_targets()
+    int targets_is_file;
     gvcf_t *gvcf;
+    char *gvcf_ranges;      // the -g argument, each --split-regions worker needs its own gvcf_t
+    int split_regions;      // --split-regions, process groups of regions in n_threads workers
+    int is_chunk;           // set in the --split-regions workers, the samples are known already
+    char *tmp_dir;
+    int downsample;         // --downsample, the target per-sample depth
+    mplp_dsmpl_t *dsmpl;
 
     // auxiliary structures for calling
     bcf_callaux_t *bca;
@@ -97,23 +119,17 @@ typedef struct {
     char **argv;
 } mplp_conf_t;
 
-typedef struct {
-    char *ref[2];
-    int ref_id[2];
-    int ref_len[2];
-} mplp_ref_t;
-
-#define MPLP_REF_INIT {{NULL,NULL},{-1,-1},{0,0}}
-
 // Data specific to each bam file
 struct _mplp_aux_t {
     samFile *fp;
     hts_itr_t *iter;
     bam_hdr_t *h;
-    mplp_ref_t *ref;
     const mplp_conf_t *conf;
     int bam_id;
     hts_idx_t *idx;     // maintained only with more than one -r regions
+    plp_read_t **reads, **free_reads;   // per-read data of pileup_constructor, all allocated and the reusable
+    int nreads, mreads, nfree, mfree;
+    int smpl_id;        // sample of the read last returned by mplp_func, see pileup_constructor
 };
 
 // Data passed to htslib/mpileup
@@ -123,61 +139,47 @@ struct _mplp_pileup_t {
     bam_pileup1_t **plp;
 };
 
-static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
-    mplp_ref_t *r = ma->ref;
-
-    //printf("get ref %d {%d/%p, %d/%p}\n", tid, r->ref_id[0], r->ref[0], r->ref_id[1], r->ref[1]);
-
-    if (!r || !ma->conf->fai) {
+/*
+ *  The reference of the two most recently used contigs is kept by refseq, the
+ *  pileup may still be on the previous contig while reads of the next one are
+ *  being read.
+ */
+static int mplp_get_ref(mplp_aux_t *ma, int tid, const char **ref, int *ref_len) {
+    if (!ma->conf->ref || tid < 0) {
         *ref = NULL;
         return 0;
     }
+    hts_pos_t len;
+    *ref = refseq_fetch(ma->conf->ref, ma->h->target_name[tid], 0, INT_MAX, &len);
+    if (!*ref) return 0;
+    *ref_len = len;
+    return 1;
+}
 
-    // Do we need to reference count this so multiple mplp_aux_t can
-    // track which references are in use?
-    // For now we just cache the last two. Sufficient?
-    if (tid == r->ref_id[0]) {
-        *ref = r->ref[0];
-        *ref_len = r->ref_len[0];
-        return 1;
-    }
-    if (tid == r->ref_id[1]) {
-        // Last, swap over
-        int tmp;
-        tmp = r->ref_id[0];  r->ref_id[0]  = r->ref_id[1];  r->ref_id[1]  = tmp;
-        tmp = r->ref_len[0]; r->ref_len[0] = r->ref_len[1]; r->ref_len[1] = tmp;
-
-        char *tc;
-        tc = r->ref[0]; r->ref[0] = r->ref[1]; r->ref[1] = tc;
-        *ref = r->ref[0];
-        *ref_len = r->ref_len[0];
-        return 1;
-    }
-
-    // New, so migrate to old and load new
-    free(r->ref[1]);
-    r->ref[1]     = r->ref[0];
-    r->ref_id[1]  = r->ref_id[0];
-    r->ref_len[1] = r->ref_len[0];
-
-    r->ref_id[0] = tid;
-    r->ref[0] = faidx_fetch_seq(ma->conf->fai,
-                                ma->h->target_name[r->ref_id[0]],
-                                0,
-                                INT_MAX,
-                                &r->ref_len[0]);
-
-    if (!r->ref[0]) {
-        r->ref[0] = NULL;
-        r->ref_id[0] = -1;
-        r->ref_len[0] = 0;
-        *ref = NULL;
-        return 0;
+/*
+ *  --downsample: a read is kept with the probability downsample/depth, where depth is
+ *  the number of reads of the sample which overlap the read's start. The decision is
+ *  made by a hash of the read name, therefore it is deterministic and the same for
+ *  mates with comparable depth.
+ */
+static int downsample_read(mplp_aux_t *ma, bam1_t *b)
+{
+    mplp_dsmpl_t *ds = &ma->conf->dsmpl[ma->smpl_id];
+    if ( ds->tid != b->core.tid )
+    {
+        ds->tid = b->core.tid;
+        ds->ends->ndat = 0;
     }
-
-    *ref = r->ref[0];
-    *ref_len = r->ref_len[0];
-    return 1;
+    while ( ds->ends->ndat && ds->ends->dat[0] <= b->core.pos ) khp_delete(end, ds->ends);
+    int32_t end = bam_endpos(b);
+    khp_insert(end, ds->ends, &end);
+    if ( ds->ends->ndat <= ma->conf->downsample ) return 1;
+
+    const unsigned char *qname = (const unsigned char*) bam_get_qname(b);
+    uint32_t hash = 2166136261u;    // FNV-1a with a final mix for the low bits
+    while ( *qname ) hash = (hash ^ *qname++) * 16777619u;
+    hash ^= hash >> 16; hash *= 0x85ebca6b; hash ^= hash >> 13;
+    return (double)hash < (double)ma->conf->downsample / ds->ends->ndat * 4294967296.0 ? 1 : 0;
 }
 
 static int mplp_func(void *data, bam1_t *b)
@@ -212,7 +214,15 @@ static int mplp_func(void *data, bam1_t *b)
             }
             if ( !overlap ) continue;
         }
-        if ( bam_smpl_get_sample_id(ma->conf->bsmpl,ma->bam_id,b)<0 ) continue;
+        if ( (ma->smpl_id = bam_smpl_get_sample_id(ma->conf->bsmpl,ma->bam_id,b))<0 ) continue;
+        if ( ma->conf->downsample )
+        {
+            // the filters which do not depend on BAQ or the adjusted mapQ come first,
+            // then the downsampling and only then the expensive per-read work
+            if ( b->core.qual < ma->conf->min_mq ) continue;
+            if ((ma->conf->flag&MPLP_NO_ORPHAN) && (b->core.flag&BAM_FPAIRED) && !(b->core.flag&BAM_FPROPER_PAIR)) continue;
+            if ( !downsample_read(ma, b) ) continue;
+        }
         if (ma->conf->flag & MPLP_ILLUMINA13) {
             int i;
             uint8_t *qual = bam_get_qual(b);
@@ -220,7 +230,7 @@ static int mplp_func(void *data, bam1_t *b)
                 qual[i] = qual[i] > 31? qual[i] - 31 : 0;
         }
 
-        if (ma->conf->fai && b->core.tid >= 0) {
+        if (ma->conf->ref && b->core.tid >= 0) {
             has_ref = mplp_get_ref(ma, b->core.tid, &ref, &ref_len);
             if (has_ref && ref_len <= b->core.pos) { // exclude reads outside of the reference sequence
                 fprintf(stderr,"[%s] Skipping because %"PRId64" is outside of %d [ref:%d]\n",
@@ -247,28 +257,73 @@ static int mplp_func(void *data, bam1_t *b)
 
 // Called once per new bam added to the pileup.
 // We cache sample information here so we don't have to keep recomputing this
-// on each and every pileup column. If FMT/SCR annotation is requested, a flag
-// is set to indicate the presence of a soft clip.
+// on each and every pileup column, together with the presence of a soft clip
+// for FMT/SCR and an index of the CIGAR operations for the indel caller, which
+// would otherwise walk the CIGAR from the start at each candidate position.
 //
 // Cd is an arbitrary block of data we can write into, which ends up in
-// the pileup structures. We stash the sample ID there:
-//      has_soft_clip .. cd->i & 1
-//      sample_id     .. cd->i >> 1
+// the pileup structures. We stash a pointer to plp_read_t there, the structures
+// are recycled by pileup_destructor.
 static int pileup_constructor(void *data, const bam1_t *b, bam_pileup_cd *cd)
 {
     mplp_aux_t *ma = (mplp_aux_t *)data;
-    cd->i = bam_smpl_get_sample_id(ma->conf->bsmpl, ma->bam_id, (bam1_t *)b) << 1;
-    if ( ma->conf->fmt_flag & (B2B_INFO_SCR|B2B_FMT_SCR) )
+    plp_read_t *rd;
+    if ( ma->nfree ) rd = ma->free_reads[--ma->nfree];
+    else
+    {
+        rd = (plp_read_t*) calloc(1, sizeof(plp_read_t));
+        hts_expand(plp_read_t*, ma->nreads+1, ma->mreads, ma->reads);
+        ma->reads[ma->nreads++] = rd;
+    }
+    cd->p = rd;
+    // The pileup calls the constructor for the read mplp_func has just returned,
+    // the read group lookup done there is not repeated
+    rd->sample_id = ma->smpl_id;
+    rd->has_soft_clip = rd->has_ref_skip = 0;
+    rd->qlen = rd->nops = 0;
+    rd->alen = rd->lsclip = 0;
+
+    int i, x = b->core.pos, y = 0;
+    uint32_t *cigar = bam_get_cigar(b);
+    hts_expand(plp_cigop_t, b->core.n_cigar, rd->mops, rd->ops);
+    rd->last_qend = 0;
+    for (i=0; i<b->core.n_cigar; i++)
     {
-        int i;
-        for (i=0; i<b->core.n_cigar; i++)
+        int op = cigar[i] & BAM_CIGAR_MASK;
+        int len = cigar[i] >> BAM_CIGAR_SHIFT;
+        if ( op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF || op==BAM_CDEL || op==BAM_CREF_SKIP )
         {
-            int cig = bam_get_cigar(b)[i] & BAM_CIGAR_MASK;
-            if ( cig!=BAM_CSOFT_CLIP ) continue;
-            cd->i |= 1;
-            break;
+            plp_cigop_t *cop = &rd->ops[rd->nops++];
+            cop->beg  = x;
+            cop->end  = x + len;
+            cop->qbeg = y;
+            cop->is_match = op==BAM_CDEL || op==BAM_CREF_SKIP ? 0 : 1;
+            x += len;
+            if ( cop->is_match ) { y += len; rd->last_qend = y; }
+            else if ( op==BAM_CREF_SKIP ) rd->has_ref_skip = 1;
+        }
+        else if ( op==BAM_CINS || op==BAM_CSOFT_CLIP )
+        {
+            y += len;
+            if ( op==BAM_CSOFT_CLIP )
+            {
+                rd->has_soft_clip = 1;
+                if ( y==len ) rd->lsclip = len;
+            }
         }
+        if ( op==BAM_CMATCH || op==BAM_CEQUAL || op==BAM_CDIFF || op==BAM_CINS ) rd->alen += len;
     }
+    rd->end  = x;
+    rd->qlen = y;
+    return 0;
+}
+
+static int pileup_destructor(void *data, const bam1_t *b, bam_pileup_cd *cd)
+{
+    mplp_aux_t *ma = (mplp_aux_t *)data;
+    hts_expand(plp_read_t*, ma->nfree+1, ma->mfree, ma->free_reads);
+    ma->free_reads[ma->nfree++] = (plp_read_t*) cd->p;
+    cd->p = NULL;
     return 0;
 }
 
@@ -281,7 +336,7 @@ static void group_smpl(mplp_pileup_t *m, bam_smpl_t *bsmpl, int n, int *n_plp, c
         for (j = 0; j < n_plp[i]; ++j)  // iterate over all reads available at this position
         {
             const bam_pileup1_t *p = plp[i] + j;
-            int id = PLP_SAMPLE_ID(p->cd.i);
+            int id = PLP_SAMPLE_ID(p);
             if (m->n_plp[id] == m->m_plp[id]) 
             {
                 m->m_plp[id] = m->m_plp[id]? m->m_plp[id]<<1 : 8;
@@ -322,7 +377,7 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
     bam_hdr_t *hdr = conf->mplp_data[0]->h; // header of first file in input list
 
     int ret, i, tid, pos, ref_len;
-    char *ref;
+    const char *ref;
 
     while ( (ret=bam_mplp_auto(conf->iter, &tid, &pos, conf->n_plp, conf->plp)) > 0) 
     {
@@ -368,6 +423,271 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
     return 0;
 }
 
+/*
+ *  With --split-regions, the regions (or the contigs when no regions are given)
+ *  are grouped into chunks, each chunk is processed by a worker thread into a
+ *  temporary BCF, and the main thread copies the chunks to the output in order.
+ *  The workers share the sample mapping and the options, and open their own
+ *  alignment files, reference and targets.
+ */
+typedef struct
+{
+    const mplp_conf_t *opts;
+    char *regions, *tmp_fname;
+}
+mplp_chunk_t;
+
+static int mpileup(mplp_conf_t *conf);
+
+static int init_targets(mplp_conf_t *conf)
+{
+    if ( conf->targets_is_file )
+        conf->bed = regidx_init(conf->targets,NULL,NULL,0,NULL);
+    else
+    {
+        conf->bed = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
+        if ( regidx_insert_list(conf->bed,conf->targets,',')!=0 )
+        {
+            regidx_destroy(conf->bed);
+            conf->bed = NULL;
+        }
+    }
+    if ( !conf->bed ) return -1;
+    conf->bed_itr = regitr_init(conf->bed);
+    return 0;
+}
+
+static void *mpileup_chunk(void *arg)
+{
+    mplp_chunk_t *chunk = (mplp_chunk_t*) arg;
+    mplp_conf_t *conf = (mplp_conf_t*) malloc(sizeof(mplp_conf_t));
+    *conf = *chunk->opts;
+    conf->is_chunk = 1;
+    conf->split_regions = 0;
+    conf->n_threads = 0;
+    conf->reg_fname = chunk->regions;
+    conf->reg_is_file = 0;
+    conf->output_fname = chunk->tmp_fname;
+    conf->output_type  = FT_BCF;
+    if ( conf->ref && !(conf->ref = refseq_init(conf->fai_fname)) ) error("Could not load the reference %s\n", conf->fai_fname);
+    if ( conf->bed && init_targets(conf)!=0 ) error("Could not parse the targets: %s\n", conf->targets);
+    if ( conf->gvcf ) conf->gvcf = gvcf_init(conf->gvcf_ranges);
+
+    mpileup(conf);      // destroys the gvcf
+
+    if ( conf->ref ) refseq_destroy(conf->ref);
+    if ( conf->bed ) regidx_destroy(conf->bed);
+    if ( conf->bed_itr ) regitr_destroy(conf->bed_itr);
+    if ( conf->reg ) regidx_destroy(conf->reg);
+    free(conf);
+    return chunk;
+}
+
+static void mpileup_split(mplp_conf_t *conf, const mplp_conf_t *opts, bam_hdr_t *hdr)
+{
+    char *tmp_dir = regplan_tmpdir(conf->tmp_dir, "/tmp/bcftools-mpileup.XXXXXX");
+
+    // With -r/-R, the units are the regions weighted by their length, grouped into
+    // consecutive chunks of similar weight. Otherwise the chunks are planned from the
+    // first file's index and large contigs are split, see regplan.h
+    int i, nchunks = 0, mchunks = 4*conf->n_threads;
+    mplp_chunk_t *chunks = NULL;
+    kstring_t str = {0,0,0};
+    if ( conf->reg )
+    {
+        int n = 0, m = 0;
+        char **units = NULL;
+        uint64_t *weight = NULL, ntot = 0, nsum = 0;
+        regitr_t *itr = regitr_init(conf->reg);
+        while ( regitr_loop(itr) )
+        {
+            hts_expand(char*, n+1, m, units);
+            weight = (uint64_t*) realloc(weight, m*sizeof(*weight));
+            str.l = 0;
+            ksprintf(&str, "%s:%u-%u", itr->seq, itr->beg+1, itr->end+1);
+            units[n] = strdup(str.s);
+            ntot += weight[n++] = itr->end - itr->beg + 1;
+        }
+        regitr_destroy(itr);
+
+        chunks = (mplp_chunk_t*) calloc(n ? n : 1, sizeof(mplp_chunk_t));
+        uint64_t target = ntot / mchunks + 1;
+        str.l = 0;
+        for (i=0; i<n; i++)
+        {
+            if ( str.l ) kputc(',',&str);
+            kputs(units[i], &str);
+            nsum += weight[i];
+            free(units[i]);
+            if ( (nsum < target && i+1<n) || (nchunks+1==mchunks && i+1<n) ) continue;    // the last chunk takes the rest
+            chunks[nchunks++].regions = strdup(str.s);
+            str.l = 0;
+            nsum = 0;
+        }
+        free(units);
+        free(weight);
+    }
+    else
+    {
+        hts_idx_t *idx = sam_index_load(conf->mplp_data[0]->fp, conf->files[0]);
+        if ( !idx ) error("The --split-regions option requires indexed alignment files: %s\n", conf->files[0]);
+        uint64_t *len = (uint64_t*) malloc(sizeof(*len)*(hdr->n_targets ? hdr->n_targets : 1));
+        for (i=0; i<hdr->n_targets; i++) len[i] = hdr->target_len[i];
+        regplan_chunk_t *plan = regplan_index(idx, hdr->n_targets, (const char**)hdr->target_name, len, mchunks, &nchunks);
+        free(len);
+        hts_idx_destroy(idx);
+
+        chunks = (mplp_chunk_t*) calloc(nchunks ? nchunks : 1, sizeof(mplp_chunk_t));
+        for (i=0; i<nchunks; i++)
+        {
+            chunks[i].regions = plan[i].regions;
+            plan[i].regions = NULL;
+        }
+        regplan_destroy(plan, nchunks);
+    }
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].opts = opts;
+        str.l = 0;
+        ksprintf(&str, "%s/%05d.bcf", tmp_dir, i);
+        chunks[i].tmp_fname = strdup(str.s);
+    }
+    free(str.s);
+
+    hts_tpool *pool = nchunks ? hts_tpool_init(conf->n_threads) : NULL;
+    hts_tpool_process *queue = NULL;
+    if ( nchunks )
+    {
+        if ( !pool ) error("Failed to initialize %d threads\n", conf->n_threads);
+        queue = hts_tpool_process_init(pool, nchunks, 0);
+        for (i=0; i<nchunks; i++)
+            if ( hts_tpool_dispatch(pool, queue, mpileup_chunk, &chunks[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    }
+
+    // copy the chunks to the output in order
+    bcf1_t *rec = bcf_init1();
+    for (i=0; i<nchunks; i++)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        mplp_chunk_t *chunk = (mplp_chunk_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        htsFile *fh = hts_open(chunk->tmp_fname, "r");
+        if ( !fh ) error("Could not read %s: %s\n", chunk->tmp_fname, strerror(errno));
+        bcf_hdr_t *hdr = bcf_hdr_read(fh);
+        if ( !hdr ) error("Could not read the header of %s\n", chunk->tmp_fname);
+        int ret;
+        while ( (ret=bcf_read(fh, hdr, rec))==0 )
+            if ( bcf_write1(conf->bcf_fp, conf->bcf_hdr, rec)!=0 ) error("[%s] Error: failed to write the record to %s\n", __func__,conf->output_fname?conf->output_fname:"standard output");
+        if ( ret < -1 ) error("Error reading %s\n", chunk->tmp_fname);
+        bcf_hdr_destroy(hdr);
+        if ( hts_close(fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->tmp_fname);
+        unlink(chunk->tmp_fname);
+        free(chunk->tmp_fname);
+        free(chunk->regions);
+    }
+    bcf_destroy1(rec);
+    if ( queue ) hts_tpool_process_destroy(queue);
+    if ( pool ) hts_tpool_destroy(pool);
+    free(chunks);
+    regplan_tmpdir_destroy(tmp_dir);
+}
+
+// Opening the input files. With thousands of files on a network storage the
+// startup is dominated by waiting for the headers and indexes, with --threads
+// they are read in worker threads ahead of time. The results are consumed in
+// the input order so the sample list and messages are the same as without
+// threads.
+typedef struct
+{
+    const mplp_conf_t *conf;
+    char *fname;
+    samFile *fp;
+    bam_hdr_t *h;
+    hts_idx_t *idx;     // loaded only with -r, NULL if not present
+    int err, errnum;    // which step failed and errno
+}
+mplp_input_t;
+
+#define INPUT_ERR_OPEN 1
+#define INPUT_ERR_MD   2
+#define INPUT_ERR_FAI  3
+#define INPUT_ERR_HDR  4
+
+typedef struct
+{
+    mplp_input_t *inputs;
+    int ninputs, ndispatch, nread;
+    hts_tpool *pool;
+    hts_tpool_process *queue;
+    int qsize;
+}
+mplp_inputs_t;
+
+static void *open_input(void *arg)
+{
+    mplp_input_t *in = (mplp_input_t*) arg;
+    const mplp_conf_t *conf = in->conf;
+    errno = 0;
+    if ( !(in->fp = sam_open(in->fname, "rb")) ) { in->err = INPUT_ERR_OPEN; in->errnum = errno; return in; }
+    if ( hts_set_opt(in->fp, CRAM_OPT_DECODE_MD, 0) ) { in->err = INPUT_ERR_MD; return in; }
+    if ( conf->fai_fname && hts_set_fai_filename(in->fp, conf->fai_fname)!=0 ) { in->err = INPUT_ERR_FAI; in->errnum = errno; return in; }
+    if ( !(in->h = sam_hdr_read(in->fp)) ) { in->err = INPUT_ERR_HDR; return in; }
+
+    // the index is not needed if the file has no usable readgroups, a missing index is reported later
+    if ( conf->reg ) in->idx = sam_index_load(in->fp, in->fname);
+    return in;
+}
+
+static void inputs_init(mplp_inputs_t *inputs, mplp_conf_t *conf)
+{
+    int i;
+    memset(inputs, 0, sizeof(*inputs));
+    inputs->ninputs = conf->nfiles;
+    inputs->inputs  = (mplp_input_t*) calloc(conf->nfiles, sizeof(mplp_input_t));
+    for (i=0; i<conf->nfiles; i++)
+    {
+        inputs->inputs[i].conf  = conf;
+        inputs->inputs[i].fname = conf->files[i];
+    }
+
+    // not in the --split-regions workers, they run in the pool already
+    if ( conf->n_threads <= 0 || conf->nfiles < 2 || conf->is_chunk ) return;
+    inputs->pool = hts_tpool_init(conf->n_threads);
+    if ( !inputs->pool ) error("Failed to initialize %d threads\n", conf->n_threads);
+    inputs->qsize = conf->n_threads * 4;
+    inputs->queue = hts_tpool_process_init(inputs->pool, inputs->qsize, 0);
+}
+
+// Returns the next input in order, the caller takes over fp, h and idx
+static mplp_input_t *inputs_next(mplp_inputs_t *inputs)
+{
+    if ( inputs->nread >= inputs->ninputs ) return NULL;
+    if ( !inputs->pool ) return open_input(&inputs->inputs[inputs->nread++]);
+
+    // keep the queue full, there is never more than qsize inputs pending
+    while ( inputs->ndispatch < inputs->ninputs && inputs->ndispatch - inputs->nread < inputs->qsize )
+    {
+        if ( hts_tpool_dispatch(inputs->pool, inputs->queue, open_input, &inputs->inputs[inputs->ndispatch])!=0 )
+            error("[%s] Error: failed to dispatch a job\n", __func__);
+        inputs->ndispatch++;
+    }
+    hts_tpool_result *res = hts_tpool_next_result_wait(inputs->queue);
+    if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+    mplp_input_t *in = (mplp_input_t*) hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    inputs->nread++;
+    return in;
+}
+
+static void inputs_destroy(mplp_inputs_t *inputs)
+{
+    if ( inputs->queue ) hts_tpool_process_destroy(inputs->queue);
+    if ( inputs->pool ) hts_tpool_destroy(inputs->pool);
+    free(inputs->inputs);
+}
+
 static int mpileup(mplp_conf_t *conf)
 {
     if (conf->nfiles == 0) {
@@ -375,7 +695,14 @@ static int mpileup(mplp_conf_t *conf)
         exit(EXIT_FAILURE);
     }
 
-    mplp_ref_t mp_ref = MPLP_REF_INIT;
+    // the workers of --split-regions start from the options as they were given
+    mplp_conf_t *opts = NULL;
+    if ( conf->split_regions )
+    {
+        opts = (mplp_conf_t*) malloc(sizeof(mplp_conf_t));
+        *opts = *conf;
+    }
+
     conf->gplp = (mplp_pileup_t *) calloc(1,sizeof(mplp_pileup_t));
     conf->mplp_data = (mplp_aux_t**) calloc(conf->nfiles, sizeof(mplp_aux_t*));
     conf->plp = (const bam_pileup1_t**) calloc(conf->nfiles, sizeof(bam_pileup1_t*));
@@ -413,36 +740,38 @@ static int mpileup(mplp_conf_t *conf)
     // beware: mpileup has always assumed that tid's are consistent in the headers, add sanity check at least!
     bam_hdr_t *hdr = NULL;      // header of first file in input list
     int i;
+    mplp_inputs_t inputs;
+    inputs_init(&inputs, conf);
     for (i = 0; i < conf->nfiles; ++i) {
         bam_hdr_t *h_tmp;
-        conf->mplp_data[i] = (mplp_aux_t*) calloc(1, sizeof(mplp_aux_t));
-        conf->mplp_data[i]->fp = sam_open(conf->files[i], "rb");
-        if ( !conf->mplp_data[i]->fp )
-        {
-            fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, conf->files[i], strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-        if (hts_set_opt(conf->mplp_data[i]->fp, CRAM_OPT_DECODE_MD, 0)) {
-            fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
-            exit(EXIT_FAILURE);
-        }
-        if (conf->fai_fname && hts_set_fai_filename(conf->mplp_data[i]->fp, conf->fai_fname) != 0) {
-            fprintf(stderr, "[%s] failed to process %s: %s\n",
-                    __func__, conf->fai_fname, strerror(errno));
-            exit(EXIT_FAILURE);
+        mplp_input_t *in = inputs_next(&inputs);
+        assert( in->fname==conf->files[i] );
+        switch (in->err) {
+            case INPUT_ERR_OPEN:
+                fprintf(stderr, "[%s] failed to open %s: %s\n", __func__, conf->files[i], strerror(in->errnum));
+                exit(EXIT_FAILURE);
+            case INPUT_ERR_MD:
+                fprintf(stderr, "Failed to set CRAM_OPT_DECODE_MD value\n");
+                exit(EXIT_FAILURE);
+            case INPUT_ERR_FAI:
+                fprintf(stderr, "[%s] failed to process %s: %s\n",
+                        __func__, conf->fai_fname, strerror(in->errnum));
+                exit(EXIT_FAILURE);
+            case INPUT_ERR_HDR:
+                fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, conf->files[i]);
+                exit(EXIT_FAILURE);
         }
+        conf->mplp_data[i] = (mplp_aux_t*) calloc(1, sizeof(mplp_aux_t));
+        conf->mplp_data[i]->fp = in->fp;
         conf->mplp_data[i]->conf = conf;
-        conf->mplp_data[i]->ref = &mp_ref;
-        h_tmp = sam_hdr_read(conf->mplp_data[i]->fp);
-        if ( !h_tmp ) {
-            fprintf(stderr,"[%s] fail to read the header of %s\n", __func__, conf->files[i]);
-            exit(EXIT_FAILURE);
-        }
+        h_tmp = in->h;
         conf->mplp_data[i]->h = i ? hdr : h_tmp; // for j==0, "h" has not been set yet
-        conf->mplp_data[i]->bam_id = bam_smpl_add_bam(conf->bsmpl,h_tmp->text,conf->files[i]);
+        // the workers share the sample mapping of the main thread, unusable files were removed there
+        conf->mplp_data[i]->bam_id = conf->is_chunk ? i : bam_smpl_add_bam(conf->bsmpl,h_tmp->text,conf->files[i]);
         if ( conf->mplp_data[i]->bam_id<0 )
         {
             // no usable readgroups in this bam, it can be skipped
+            if ( in->idx ) hts_idx_destroy(in->idx);
             sam_close(conf->mplp_data[i]->fp);
             free(conf->mplp_data[i]);
             bam_hdr_destroy(h_tmp);
@@ -453,7 +782,7 @@ static int mpileup(mplp_conf_t *conf)
             continue;
         }
         if (conf->reg) {
-            hts_idx_t *idx = sam_index_load(conf->mplp_data[i]->fp, conf->files[i]);
+            hts_idx_t *idx = in->idx;
             if (idx == NULL) {
                 fprintf(stderr, "[%s] fail to load index for %s\n", __func__, conf->files[i]);
                 exit(EXIT_FAILURE);
@@ -487,13 +816,14 @@ static int mpileup(mplp_conf_t *conf)
             conf->mplp_data[i]->h = hdr;
         }
     }
+    inputs_destroy(&inputs);
     // allocate data storage proportionate to number of samples being studied sm->n
     bam_smpl_get_samples(conf->bsmpl, &conf->gplp->n);
     conf->gplp->n_plp = (int*) calloc(conf->gplp->n, sizeof(int));
     conf->gplp->m_plp = (int*) calloc(conf->gplp->n, sizeof(int));
     conf->gplp->plp = (bam_pileup1_t**) calloc(conf->gplp->n, sizeof(bam_pileup1_t*));  
 
-    fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, conf->gplp->n, conf->nfiles);
+    if ( !conf->is_chunk ) fprintf(stderr, "[%s] %d samples in %d input files\n", __func__, conf->gplp->n, conf->nfiles);
     // write the VCF header
     conf->bcf_fp = hts_open(conf->output_fname?conf->output_fname:"-", hts_bcf_wmode(conf->output_type));
     if (conf->bcf_fp == NULL) {
@@ -629,18 +959,38 @@ static int mpileup(mplp_conf_t *conf)
     // init mpileup
     conf->iter = bam_mplp_init(conf->nfiles, mplp_func, (void**)conf->mplp_data);
     if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(conf->iter);
-    fprintf(stderr, "[%s] maximum number of reads per input file set to -d %d\n",  __func__, conf->max_depth);
-    if ( (double)conf->max_depth * conf->nfiles > 1<<20)
-        fprintf(stderr, "Warning: Potential memory hog, up to %.0fM reads in the pileup!\n", (double)conf->max_depth*conf->nfiles);
-    if ( (double)conf->max_depth * conf->nfiles / nsmpl < 250 )
-        fprintf(stderr, "Note: The maximum per-sample depth with -d %d is %.1fx\n", conf->max_depth,(double)conf->max_depth * conf->nfiles / nsmpl);
+    if ( !conf->is_chunk )
+    {
+        fprintf(stderr, "[%s] maximum number of reads per input file set to -d %d\n",  __func__, conf->max_depth);
+        if ( (double)conf->max_depth * conf->nfiles > 1<<20)
+            fprintf(stderr, "Warning: Potential memory hog, up to %.0fM reads in the pileup!\n", (double)conf->max_depth*conf->nfiles);
+        if ( (double)conf->max_depth * conf->nfiles / nsmpl < 250 )
+            fprintf(stderr, "Note: The maximum per-sample depth with -d %d is %.1fx\n", conf->max_depth,(double)conf->max_depth * conf->nfiles / nsmpl);
+    }
     bam_mplp_set_maxcnt(conf->iter, conf->max_depth);
+    if ( conf->downsample )
+    {
+        conf->dsmpl = (mplp_dsmpl_t*) malloc(sizeof(mplp_dsmpl_t)*nsmpl);
+        for (i=0; i<nsmpl; i++)
+        {
+            conf->dsmpl[i].tid  = -1;
+            conf->dsmpl[i].ends = khp_init(end);
+        }
+    }
     conf->max_indel_depth = conf->max_indel_depth * nsmpl;
     conf->bcf_rec = bcf_init1();
     bam_mplp_constructor(conf->iter, pileup_constructor);
+    bam_mplp_destructor(conf->iter, pileup_destructor);
 
+    if ( conf->split_regions )
+    {
+        opts->files  = conf->files;     // without the files with no usable read groups
+        opts->nfiles = conf->nfiles;
+        mpileup_split(conf, opts, hdr);
+        free(opts);
+    }
     // Run mpileup for multiple regions
-    if ( nregs )
+    else if ( nregs )
     {
         int ireg = 0;
         do 
@@ -694,6 +1044,11 @@ static int mpileup(mplp_conf_t *conf)
         free(conf->bcr);
     }
     if ( conf->gvcf ) gvcf_destroy(conf->gvcf);
+    if ( conf->dsmpl )
+    {
+        for (i=0; i<conf->gplp->n; i++) khp_destroy(end, conf->dsmpl[i].ends);
+        free(conf->dsmpl);
+    }
     free(conf->buf.s);
     for (i = 0; i < conf->gplp->n; ++i) free(conf->gplp->plp[i]);
     free(conf->gplp->plp); free(conf->gplp->n_plp); free(conf->gplp->m_plp); free(conf->gplp);
@@ -703,22 +1058,21 @@ static int mpileup(mplp_conf_t *conf)
         if ( nregs>1 ) hts_idx_destroy(conf->mplp_data[i]->idx);
         sam_close(conf->mplp_data[i]->fp);
         if ( conf->mplp_data[i]->iter) hts_itr_destroy(conf->mplp_data[i]->iter);
+        int j;
+        for (j = 0; j < conf->mplp_data[i]->nreads; ++j)
+        {
+            free(conf->mplp_data[i]->reads[j]->ops);
+            free(conf->mplp_data[i]->reads[j]);
+        }
+        free(conf->mplp_data[i]->reads);
+        free(conf->mplp_data[i]->free_reads);
         free(conf->mplp_data[i]);
     }
     if ( conf->reg_itr ) regitr_destroy(conf->reg_itr);
     free(conf->mplp_data); free(conf->plp); free(conf->n_plp);
-    free(mp_ref.ref[0]);
-    free(mp_ref.ref[1]);
     return 0;
 }
 
-static int is_url(const char *s)
-{
-    static const char uri_scheme_chars[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+.-";
-    return s[strspn(s, uri_scheme_chars)] == ':';
-}
-
 #define MAX_PATH_LEN 1024
 int read_file_list(const char *file_list,int *n,char **argv[])
 {
@@ -854,6 +1208,7 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -C, --adjust-MQ INT     adjust mapping quality; recommended:50, disable:0 [0]\n"
 "  -d, --max-depth INT     max raw per-file depth; avoids excessive memory usage [%d]\n", mplp->max_depth);
     fprintf(fp,
+"      --downsample INT    downsample reads to about INT per sample, before BAQ\n"
 "  -E, --redo-BAQ          recalculate BAQ on the fly, ignore existing BQs\n"
 "  -f, --fasta-ref FILE    faidx indexed reference sequence file\n"
 "      --no-reference      do not require fasta reference file\n"
@@ -885,6 +1240,8 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -O, --output-type TYPE  'b' compressed BCF; 'u' uncompressed BCF;\n"
 "                          'z' compressed VCF; 'v' uncompressed VCF [v]\n"
 "      --threads INT       use multithreading with INT worker threads [0]\n"
+"      --split-regions     process groups of regions in parallel in --threads workers\n"
+"      --temp-dir DIR      temporary files with --split-regions [/tmp/bcftools-mpileup.XXXXXX]\n"
 "\n"
 "SNP/INDEL genotype likelihoods options:\n"
 "  -e, --ext-prob INT      Phred-scaled gap extension seq error probability [%d]\n", mplp->extQ);
@@ -951,6 +1308,9 @@ int bam_mpileup(int argc, char *argv[])
         {"no-reference", no_argument, NULL, 7},
         {"no-version", no_argument, NULL, 8},
         {"threads",required_argument,NULL,9},
+        {"split-regions",no_argument,NULL,10},
+        {"temp-dir",required_argument,NULL,11},
+        {"downsample",required_argument,NULL,12},
         {"illumina1.3+", no_argument, NULL, '6'},
         {"count-orphans", no_argument, NULL, 'A'},
         {"bam-list", required_argument, NULL, 'b'},
@@ -1005,15 +1365,25 @@ int bam_mpileup(int argc, char *argv[])
         case 'g':
             mplp.gvcf = gvcf_init(optarg);
             if ( !mplp.gvcf ) error("Could not parse: --gvcf %s\n", optarg);
+            mplp.gvcf_ranges = optarg;
             break;
         case 'f':
-            mplp.fai = fai_load(optarg);
-            if (mplp.fai == NULL) return 1;
+            mplp.ref = refseq_init(optarg);
+            if (mplp.ref == NULL) return 1;
             mplp.fai_fname = optarg;
             break;
         case  7 : noref = 1; break;
         case  8 : mplp.record_cmd_line = 0; break;
         case  9 : mplp.n_threads = strtol(optarg, 0, 0); break;
+        case 10 : mplp.split_regions = 1; break;
+        case 11 : mplp.tmp_dir = optarg; break;
+        case 12 :
+            {
+                char *tmp;
+                mplp.downsample = strtol(optarg,&tmp,10);
+                if ( *tmp || mplp.downsample<=0 ) error("Could not parse --downsample %s\n", optarg);
+            }
+            break;
         case 'd': mplp.max_depth = atoi(optarg); break;
         case 'r': mplp.reg_fname = strdup(optarg); break;
         case 'R': mplp.reg_fname = strdup(optarg); mplp.reg_is_file = 1; break;
@@ -1023,9 +1393,9 @@ int bam_mpileup(int argc, char *argv[])
                   //  best strategy, that is streaming or jumping.
                   if ( optarg[0]=='^' ) optarg++;
                   else mplp.bed_logic = 1;
-                  mplp.bed = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
-                  mplp.bed_itr = regitr_init(mplp.bed);
-                  if ( regidx_insert_list(mplp.bed,optarg,',') !=0 )
+                  mplp.targets = optarg;
+                  mplp.targets_is_file = 0;
+                  if ( init_targets(&mplp)!=0 )
                   {
                       fprintf(stderr,"Could not parse the targets: %s\n", optarg);
                       exit(EXIT_FAILURE);
@@ -1034,8 +1404,9 @@ int bam_mpileup(int argc, char *argv[])
         case 'T':
                   if ( optarg[0]=='^' ) optarg++;
                   else mplp.bed_logic = 1;
-                  mplp.bed = regidx_init(optarg,NULL,NULL,0,NULL);
-                  if (!mplp.bed) { fprintf(stderr, "bcftools mpileup: Could not read file \"%s\"", optarg); return 1; }
+                  mplp.targets = optarg;
+                  mplp.targets_is_file = 1;
+                  if ( init_targets(&mplp)!=0 ) { fprintf(stderr, "bcftools mpileup: Could not read file \"%s\"", optarg); return 1; }
                   break;
         case 'P': mplp.pl_list = strdup(optarg); break;
         case 'p': mplp.flag |= MPLP_PER_SAMPLE; break;
@@ -1110,12 +1481,17 @@ int bam_mpileup(int argc, char *argv[])
         return 1;
     }
     if (use_orphan) mplp.flag &= ~MPLP_NO_ORPHAN;
+    if ( mplp.split_regions && mplp.n_threads<=0 )
+    {
+        fprintf(stderr,"Error: The --split-regions option requires --threads\n");
+        return 1;
+    }
     if (argc == 1)
     {
         print_usage(stderr, &mplp);
         return 1;
     }
-    if (!mplp.fai && !noref) {
+    if (!mplp.ref && !noref) {
         fprintf(stderr,"Error: mpileup requires the --fasta-ref option by default; use --no-reference to run without a fasta reference\n");
         return 1;
     }
@@ -1137,7 +1513,7 @@ int bam_mpileup(int argc, char *argv[])
     for (i=0; i<mplp.nfiles; i++) free(mplp.files[i]);
     free(mplp.files);
     free(mplp.reg_fname); free(mplp.pl_list);
-    if (mplp.fai) fai_destroy(mplp.fai);
+    if (mplp.ref) refseq_destroy(mplp.ref);
     if (mplp.bed) regidx_destroy(mplp.bed);
     if (mplp.bed_itr) regitr_destroy(mplp.bed_itr);
     if (mplp.reg) regidx_destroy(mplp.reg);
@@ -59,6 +59,10 @@ struct _peakfit_t
     double *xvals, *yvals, *vals;
     kstring_t str;
     int verbose, nmc_iter;
+    unsigned short seed[3];             // monte-carlo random state, private to each peakfit_t for thread safety
+    gsl_multifit_fdfsolver *solver;     // solver workspace, reused while the problem size stays the same
+    gsl_vector *grad;
+    size_t solver_n, solver_p;
 };
 
 
@@ -375,6 +379,8 @@ void peakfit_reset(peakfit_t *pkf)
 
 void peakfit_destroy(peakfit_t *pkf)
 {
+    if ( pkf->solver ) gsl_multifit_fdfsolver_free(pkf->solver);
+    if ( pkf->grad ) gsl_vector_free(pkf->grad);
     free(pkf->str.s);
     free(pkf->vals);
     free(pkf->params);
@@ -486,7 +492,9 @@ void peakfit_set_mc(peakfit_t *pkf, double xmin, double xmax, int iparam, int ni
 
 double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
 {
-    srand(0);   // for reproducibility
+    // for reproducibility
+    pkf->seed[0] = 0x330e;
+    pkf->seed[1] = pkf->seed[2] = 0;
 
     pkf->nvals = nvals;
     pkf->xvals = xvals;
@@ -502,11 +510,16 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
     mfunc.p   = pkf->nparams;
     mfunc.params = pkf;
 
-    const gsl_multifit_fdfsolver_type *solver_type;
-    gsl_multifit_fdfsolver *solver;
-    solver_type = gsl_multifit_fdfsolver_lmsder;
-    solver = gsl_multifit_fdfsolver_alloc(solver_type, nvals, mfunc.p);
-    gsl_vector *grad = gsl_vector_alloc(pkf->nparams);
+    if ( !pkf->solver || pkf->solver_n!=mfunc.n || pkf->solver_p!=mfunc.p )
+    {
+        if ( pkf->solver ) gsl_multifit_fdfsolver_free(pkf->solver);
+        if ( pkf->grad ) gsl_vector_free(pkf->grad);
+        pkf->solver = gsl_multifit_fdfsolver_alloc(gsl_multifit_fdfsolver_lmsder, mfunc.n, mfunc.p);
+        pkf->grad   = gsl_vector_alloc(mfunc.p);
+        pkf->solver_n = mfunc.n;
+        pkf->solver_p = mfunc.p;
+    }
+    gsl_multifit_fdfsolver *solver = pkf->solver;
 
     int imc_iter, i,j, iparam;
     double best_fit = HUGE_VAL;
@@ -522,7 +535,7 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
                 pk->params[j] = pk->ori_params[j];
                 if ( pk->mc[j].scan )
                 {
-                    pk->params[j] = rand()*(pk->mc[j].max - pk->mc[j].min)/RAND_MAX + pk->mc[j].min;
+                    pk->params[j] = hts_erand48(pkf->seed)*(pk->mc[j].max - pk->mc[j].min) + pk->mc[j].min;
                     if ( pk->convert_set ) pk->params[j] = pk->convert_set(pk, j, pk->params[j]);
                 }
                 if ( !(pk->fit_mask & (1<<j)) ) continue;
@@ -555,8 +568,8 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
             int info;
             test1 = gsl_multifit_fdfsolver_test(solver, 1e-8,1e-8, 0.0, &info);
 #else
-            gsl_multifit_gradient(solver->J, solver->f, grad);
-            test1 = gsl_multifit_test_gradient(grad, 1e-8);
+            gsl_multifit_gradient(solver->J, solver->f, pkf->grad);
+            test1 = gsl_multifit_test_gradient(pkf->grad, 1e-8);
             test2 = gsl_multifit_test_delta(solver->dx, solver->x, 1e-8, 1e-8);
 #endif
         }
@@ -591,8 +604,6 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
         }
         if ( fit<best_fit ) best_fit = fit;
     }
-    gsl_multifit_fdfsolver_free(solver);
-    gsl_vector_free(grad);
 
     for (i=0; i<pkf->npeaks; i++)
     {
@@ -38,8 +38,36 @@ struct _ploidy_t
     void *sex2id;
     char **id2sex;
     kstring_t tmp_str;
+
+    // Queries are answered from the regions compiled into per-contig segments,
+    // see ploidy_compile()
+    int ncontig, icontig;   // icontig: contig of the last query or -1 if not listed
+    void *seq2contig;
+    struct _contig_t *contig;
+    int *dflt_row;          // the query result for unlisted contigs
+    kstring_t seq;          // name of the contig of the last query
 };
 
+/*
+    The ploidy is constant between the positions where a region starts or ends.
+    The contig is split into segments at these positions, for each the result of
+    the query is stored in a row of PLD_NROW(ploidy) values:
+        [0] .. whether the segment overlaps a region
+        [1] .. minimum ploidy
+        [2] .. maximum ploidy
+        [3..] .. sex2ploidy
+ */
+#define PLD_NROW(ploidy) (3+(ploidy)->nsex)
+
+typedef struct _contig_t
+{
+    char *name;
+    int nseg, mseg, iseg;   // iseg: segment of the last query
+    uint32_t *beg;          // the i-th segment spans beg[i] .. beg[i+1]-1, beg[0] is always 0
+    int *row;
+}
+contig_t;
+
 typedef struct
 {
     int sex, ploidy;
@@ -178,8 +206,28 @@ ploidy_t *ploidy_init_string(const char *str, int dflt)
     return pld;
 }
 
+static void ploidy_uncompile(ploidy_t *ploidy)
+{
+    int i;
+    for (i=0; i<ploidy->ncontig; i++)
+    {
+        free(ploidy->contig[i].beg);
+        free(ploidy->contig[i].row);
+    }
+    free(ploidy->contig);
+    free(ploidy->dflt_row);
+    if ( ploidy->seq2contig ) khash_str2int_destroy(ploidy->seq2contig);
+    ploidy->contig = NULL;
+    ploidy->dflt_row = NULL;
+    ploidy->seq2contig = NULL;
+    ploidy->ncontig = 0;
+    ploidy->seq.l = 0;
+}
+
 void ploidy_destroy(ploidy_t *ploidy)
 {
+    ploidy_uncompile(ploidy);
+    free(ploidy->seq.s);
     if ( ploidy->sex2id ) khash_str2int_destroy_free(ploidy->sex2id);
     if ( ploidy->itr ) regitr_destroy(ploidy->itr);
     if ( ploidy->idx ) regidx_destroy(ploidy->idx);
@@ -189,7 +237,8 @@ void ploidy_destroy(ploidy_t *ploidy)
     free(ploidy);
 }
 
-int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max)
+// The query without the compiled segments, used to fill the segment rows
+static int ploidy_query_regidx(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max)
 {
     int i, ret = regidx_overlap(ploidy->idx, seq,pos,pos, ploidy->itr);
 
@@ -226,6 +275,110 @@ int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min
     return 1;
 }
 
+static int cmp_uint32(const void *aptr, const void *bptr)
+{
+    uint32_t a = *((const uint32_t*)aptr);
+    uint32_t b = *((const uint32_t*)bptr);
+    if ( a < b ) return -1;
+    if ( a > b ) return 1;
+    return 0;
+}
+
+static void ploidy_compile(ploidy_t *ploidy)
+{
+    int i, j, nrow = PLD_NROW(ploidy);
+
+    ploidy->dflt_row = (int*) malloc(sizeof(int)*nrow);
+    ploidy->dflt_row[0] = 0;
+    ploidy->dflt_row[1] = ploidy->dflt_row[2] = ploidy->dflt;
+    for (i=0; i<ploidy->nsex; i++) ploidy->dflt_row[3+i] = ploidy->sex2dflt[i];
+
+    // collect the segment boundaries
+    ploidy->seq2contig = khash_str2int_init();
+    regitr_t *itr = regitr_init(ploidy->idx);
+    while ( regitr_loop(itr) )
+    {
+        if ( khash_str2int_get(ploidy->seq2contig, itr->seq, &i)!=0 )
+        {
+            i = ploidy->ncontig++;
+            ploidy->contig = (contig_t*) realloc(ploidy->contig,sizeof(contig_t)*ploidy->ncontig);
+            contig_t *ctg = &ploidy->contig[i];
+            memset(ctg,0,sizeof(*ctg));
+            ctg->name = itr->seq;
+            khash_str2int_set(ploidy->seq2contig, ctg->name, i);
+            ctg->nseg = 1;
+            hts_expand(uint32_t,ctg->nseg,ctg->mseg,ctg->beg);
+            ctg->beg[0] = 0;
+        }
+        contig_t *ctg = &ploidy->contig[i];
+        hts_expand(uint32_t,ctg->nseg+2,ctg->mseg,ctg->beg);
+        ctg->beg[ctg->nseg++] = itr->beg;
+        if ( itr->end < REGIDX_MAX ) ctg->beg[ctg->nseg++] = itr->end + 1;
+    }
+    regitr_destroy(itr);
+
+    // sort and fill the segments with the query results
+    for (i=0; i<ploidy->ncontig; i++)
+    {
+        contig_t *ctg = &ploidy->contig[i];
+        qsort(ctg->beg, ctg->nseg, sizeof(*ctg->beg), cmp_uint32);
+        int n = 1;
+        for (j=1; j<ctg->nseg; j++)
+            if ( ctg->beg[j]!=ctg->beg[n-1] ) ctg->beg[n++] = ctg->beg[j];
+        ctg->nseg = n;
+        ctg->row  = (int*) malloc(sizeof(int)*nrow*ctg->nseg);
+        for (j=0; j<ctg->nseg; j++)
+        {
+            int *row = ctg->row + j*nrow;
+            row[0] = ploidy_query_regidx(ploidy, ctg->name, ctg->beg[j], row+3, row+1, row+2);
+        }
+    }
+    ploidy->icontig = -1;
+}
+
+static inline int *ploidy_find_row(ploidy_t *ploidy, char *seq, uint32_t pos)
+{
+    if ( !ploidy->dflt_row ) ploidy_compile(ploidy);
+
+    if ( !ploidy->seq.l || strcmp(seq,ploidy->seq.s) )
+    {
+        ploidy->seq.l = 0;
+        kputs(seq, &ploidy->seq);
+        if ( khash_str2int_get(ploidy->seq2contig, seq, &ploidy->icontig)!=0 ) ploidy->icontig = -1;
+    }
+    if ( ploidy->icontig < 0 ) return ploidy->dflt_row;
+
+    // the sites come sorted, check the last and the next segment before resorting to binary search
+    contig_t *ctg = &ploidy->contig[ploidy->icontig];
+    int i = ctg->iseg;
+    if ( pos < ctg->beg[i] || (i+1<ctg->nseg && pos >= ctg->beg[i+1]) )
+    {
+        if ( pos >= ctg->beg[i] && (i+2>=ctg->nseg || pos < ctg->beg[i+2]) ) i++;
+        else
+        {
+            int lo = 0, hi = ctg->nseg - 1;
+            while ( lo < hi )
+            {
+                int mid = (lo + hi + 1) / 2;
+                if ( ctg->beg[mid] <= pos ) lo = mid;
+                else hi = mid - 1;
+            }
+            i = lo;
+        }
+        ctg->iseg = i;
+    }
+    return ctg->row + i*PLD_NROW(ploidy);
+}
+
+int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max)
+{
+    int *row = ploidy_find_row(ploidy, seq, pos);
+    if ( sex2ploidy ) memcpy(sex2ploidy, row+3, sizeof(int)*ploidy->nsex);
+    if ( min ) *min = row[1];
+    if ( max ) *max = row[2];
+    return row[0];
+}
+
 int ploidy_nsex(ploidy_t *ploidy)
 {
     return ploidy->nsex;
@@ -253,6 +406,7 @@ int ploidy_add_sex(ploidy_t *ploidy, const char *sex)
     ploidy->id2sex[ploidy->nsex-1] = strdup(sex);
     ploidy->sex2dflt = (int*) realloc(ploidy->sex2dflt,sizeof(int)*ploidy->nsex);
     ploidy->sex2dflt[ploidy->nsex-1] = ploidy->dflt;
+    ploidy_uncompile(ploidy);   // the rows must be extended
     return khash_str2int_inc(ploidy->sex2id, ploidy->id2sex[ploidy->nsex-1]);
 }
 
@@ -84,7 +84,8 @@ void ploidy_destroy(ploidy_t *ploidy);
  *  @param min: if not NULL, minimum encountered encountered will be set
  *  @param max: if not NULL, maximum encountered encountered will be set
  *
- *  Returns 1 if the position is listed in the regions or 0 otherwise.
+ *  Returns 1 if the position is listed in the regions or 0 otherwise. The lookup
+ *  is fastest when the positions come sorted, as in a VCF.
  */
 int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max);
 
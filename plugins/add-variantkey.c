@@ -32,6 +32,26 @@ DEALINGS IN THE SOFTWARE.  */
 
 bcf_hdr_t *in_hdr, *out_hdr;
 
+// Chromosome codes of the header contigs, encoded once per contig rather than for each record
+static uint8_t *chrom_code;
+static int nchrom_code;
+
+static inline uint8_t rid2chrom_code(bcf_hdr_t *hdr, int rid)
+{
+    if ( rid >= nchrom_code )
+    {
+        int i, n = hdr->n[BCF_DT_CTG];
+        chrom_code = (uint8_t*) realloc(chrom_code, n);
+        for (i=nchrom_code; i<n; i++)
+        {
+            const char *key = hdr->id[BCF_DT_CTG][i].key;
+            chrom_code[i] = encode_chrom(key, strlen(key));
+        }
+        nchrom_code = n;
+    }
+    return chrom_code[rid];
+}
+
 const char *about(void)
 {
     return "Add VariantKey INFO fields VKX and RSX.\n";
@@ -62,25 +82,22 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 
 bcf1_t *process(bcf1_t *rec)
 {
-    uint64_t vk = variantkey(
-                      in_hdr->id[BCF_DT_CTG][rec->rid].key,
-                      strlen(in_hdr->id[BCF_DT_CTG][rec->rid].key),
+    uint64_t vk = encode_variantkey(
+                      rid2chrom_code(in_hdr, rec->rid),
                       rec->pos,
-                      rec->d.allele[0],
-                      strlen(rec->d.allele[0]),
-                      rec->d.allele[1],
-                      strlen(rec->d.allele[1]));
+                      encode_refalt(rec->d.allele[0], strlen(rec->d.allele[0]), rec->d.allele[1], strlen(rec->d.allele[1])));
     char vs[17];
     variantkey_hex(vk, vs);
     bcf_update_info_string(out_hdr, rec, "VKX", vs);
     char rsid[9];
     char *ptr = rec->d.id;
     ptr += 2; // remove 'rs'
-    sprintf(rsid, "%08" PRIx32, (uint32_t)strtoul(ptr, NULL, 10));
+    hex_uint32_t((uint32_t)strtoul(ptr, NULL, 10), rsid);
     bcf_update_info_string(out_hdr, rec, "RSX", rsid);
     return rec;
 }
 
 void destroy(void)
 {
+    free(chrom_code);
 }
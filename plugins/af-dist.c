@@ -33,14 +33,22 @@
 #include "bcftools.h"
 #include "bin.h"
 
+// Per-thread buffers and counts, the counts are added up in merge_ctx()
+typedef struct
+{
+    int32_t *gt, ngt, naf;
+    float *af;
+    uint64_t *dev_dist, *prob_dist;
+}
+dist_t;
+
 typedef struct
 {
     char *af_tag;
     bcf_hdr_t *hdr;
-    int32_t *gt, ngt, naf;
-    float *af, list_min, list_max;
+    float list_min, list_max;
     bin_t *dev_bins, *prob_bins;
-    uint64_t *dev_dist, *prob_dist;
+    dist_t dist;    // the totals, also used by process() when not running in parallel
 }
 args_t;
 
@@ -75,6 +83,20 @@ const char *usage(void)
         "\n";
 }
 
+static void init_dist(dist_t *dist)
+{
+    dist->dev_dist  = (uint64_t*)calloc(bin_get_size(args->dev_bins),sizeof(*dist->dev_dist));
+    dist->prob_dist = (uint64_t*)calloc(bin_get_size(args->prob_bins),sizeof(*dist->prob_dist));
+}
+
+static void destroy_dist(dist_t *dist)
+{
+    free(dist->dev_dist);
+    free(dist->prob_dist);
+    free(dist->gt);
+    free(dist->af);
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     args = (args_t*) calloc(1,sizeof(args_t));
@@ -114,13 +136,9 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
     }
 
-    args->dev_bins = bin_init(dev_bins,0,1);
-    int nbins = bin_get_size(args->dev_bins);
-    args->dev_dist = (uint64_t*)calloc(nbins,sizeof(*args->dev_dist));
-
+    args->dev_bins  = bin_init(dev_bins,0,1);
     args->prob_bins = bin_init(prob_bins,0,1);
-    nbins = bin_get_size(args->prob_bins);
-    args->prob_dist = (uint64_t*)calloc(nbins,sizeof(*args->prob_dist));
+    init_dist(&args->dist);
 
     printf("# This file was produced by: bcftools +af-dist(%s+htslib-%s)\n", bcftools_version(),hts_version());
     printf("# The command line was:\tbcftools +af-dist %s", argv[0]);
@@ -133,11 +151,11 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 1;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_dist(dist_t *dist, bcf1_t *rec)
 {
-    int naf = bcf_get_info_float(args->hdr,rec,args->af_tag,&args->af,&args->naf);
-    if ( naf<=0 ) return NULL;
-    float af = args->af[0];
+    int naf = bcf_get_info_float(args->hdr,rec,args->af_tag,&dist->af,&dist->naf);
+    if ( naf<=0 ) return;
+    float af = dist->af[0];
 
     float pRA = 2*af*(1-af);
     float pAA = af*af;
@@ -148,47 +166,106 @@ bcf1_t *process(bcf1_t *rec)
     int list_AA = args->list_min==-1 || pAA < args->list_min || pAA > args->list_max ? 0 : 1;
     const char *chr = bcf_seqname(args->hdr,rec);
 
-    int ngt = bcf_get_genotypes(args->hdr, rec, &args->gt, &args->ngt);
+    int ngt = bcf_get_genotypes(args->hdr, rec, &dist->gt, &dist->ngt);
     int i, j, nsmpl = bcf_hdr_nsamples(args->hdr);
     int nals = 0, nalt = 0;
     ngt /= nsmpl;
-    for (i=0; i<nsmpl; i++)
+
+    // Histogram of alt allele dosages, the genotypes are listed afterwards only
+    // if requested. The diploid case is by far the most common, it has a fast path
+    uint64_t ndosage[3] = {0,0,0};
+    if ( ngt==2 && !list_RA && !list_AA )
     {
-        int32_t *ptr = args->gt + i*ngt;
-        int dosage = 0;
-        for (j=0; j<ngt; j++)
+        int32_t *ptr = dist->gt;
+        for (i=0; i<nsmpl; i++, ptr+=2)
         {
-            if ( bcf_gt_is_missing(ptr[j]) ) break;
-            if ( ptr[j]==bcf_int32_vector_end ) break;
-            if ( bcf_gt_allele(ptr[j])==1 ) dosage++;
+            if ( bcf_gt_is_missing(ptr[0]) || bcf_gt_is_missing(ptr[1]) || ptr[1]==bcf_int32_vector_end ) continue;
+            ndosage[ (bcf_gt_allele(ptr[0])==1) + (bcf_gt_allele(ptr[1])==1) ]++;
         }
-        if ( j!=ngt ) continue;
+        nals = 2*(ndosage[0] + ndosage[1] + ndosage[2]);
+        nalt = ndosage[1] + 2*ndosage[2];
+    }
+    else
+    {
+        for (i=0; i<nsmpl; i++)
+        {
+            int32_t *ptr = dist->gt + i*ngt;
+            int dosage = 0;
+            for (j=0; j<ngt; j++)
+            {
+                if ( bcf_gt_is_missing(ptr[j]) ) break;
+                if ( ptr[j]==bcf_int32_vector_end ) break;
+                if ( bcf_gt_allele(ptr[j])==1 ) dosage++;
+            }
+            if ( j!=ngt ) continue;
 
-        nals += j;
-        nalt += dosage;
+            nals += j;
+            nalt += dosage;
 
-        if ( dosage==1 )
-        {
-            args->prob_dist[iRA]++;
-            if ( list_RA ) printf("GT\t%s\t%"PRId64"\t%s\t1\t%f\n",chr,(int64_t) rec->pos+1,args->hdr->samples[i],pRA);
-        }
-        else if ( dosage==2 )
-        {
-            args->prob_dist[iAA]++;
-            if ( list_AA ) printf("GT\t%s\t%"PRId64"\t%s\t2\t%f\n",chr,(int64_t) rec->pos+1,args->hdr->samples[i],pAA);
+            if ( dosage==1 )
+            {
+                ndosage[1]++;
+                if ( list_RA ) printf("GT\t%s\t%"PRId64"\t%s\t1\t%f\n",chr,(int64_t) rec->pos+1,args->hdr->samples[i],pRA);
+            }
+            else if ( dosage==2 )
+            {
+                ndosage[2]++;
+                if ( list_AA ) printf("GT\t%s\t%"PRId64"\t%s\t2\t%f\n",chr,(int64_t) rec->pos+1,args->hdr->samples[i],pAA);
+            }
         }
     }
+    dist->prob_dist[iRA] += ndosage[1];
+    dist->prob_dist[iAA] += ndosage[2];
 
     if ( nals && (nalt || af) )
     {
         float af_dev = fabs(af - (float)nalt/nals);
         int iAF = bin_get_idx(args->dev_bins,af_dev);
-        args->dev_dist[iAF]++;
+        dist->dev_dist[iAF]++;
     }
+}
 
+bcf1_t *process(bcf1_t *rec)
+{
+    process_dist(&args->dist, rec);
     return NULL;
 }
 
+/*
+    With --threads each thread collects the distributions in its own context,
+    the contexts are added up in merge_ctx(). The listing of genotypes with
+    --list would come out in random order, therefore it is not allowed.
+*/
+int parallel_safe(void)
+{
+    return 1;
+}
+
+void *init_thread(void)
+{
+    if ( args->list_min!=-1 ) error("The --list option cannot be combined with --threads\n");
+    dist_t *dist = (dist_t*) calloc(1,sizeof(dist_t));
+    init_dist(dist);
+    return dist;
+}
+
+bcf1_t *process_ctx(void *ctx, bcf1_t *rec)
+{
+    process_dist((dist_t*)ctx, rec);
+    return NULL;
+}
+
+void merge_ctx(void *ctx)
+{
+    dist_t *dist = (dist_t*) ctx;
+    int i, n = bin_get_size(args->prob_bins);
+    for (i=0; i<n; i++) args->dist.prob_dist[i] += dist->prob_dist[i];
+    n = bin_get_size(args->dev_bins);
+    for (i=0; i<n; i++) args->dist.dev_dist[i] += dist->dev_dist[i];
+    destroy_dist(dist);
+    free(dist);
+}
+
 void destroy(void)
 {
     printf("# PROB_DIST, genotype probability distribution, assumes HWE\n");
@@ -198,7 +275,7 @@ void destroy(void)
     {
         float min = bin_get_value(args->prob_bins,i);
         float max = bin_get_value(args->prob_bins,i+1);
-        printf("PROB_DIST\t%f\t%f\t%"PRId64"\n", min,max,args->prob_dist[i]);
+        printf("PROB_DIST\t%f\t%f\t%"PRId64"\n", min,max,args->dist.prob_dist[i]);
     }
     printf("# DEV_DIST, distribution of AF deviation, based on %s and INFO/AN, AC calculated on the fly\n", args->af_tag);
     n = bin_get_size(args->dev_bins);
@@ -206,14 +283,11 @@ void destroy(void)
     {
         float min = bin_get_value(args->dev_bins,i);
         float max = bin_get_value(args->dev_bins,i+1);
-        printf("DEV_DIST\t%f\t%f\t%"PRId64"\n", min,max,args->dev_dist[i]);
+        printf("DEV_DIST\t%f\t%f\t%"PRId64"\n", min,max,args->dist.dev_dist[i]);
     }
     bin_destroy(args->dev_bins);
     bin_destroy(args->prob_bins);
-    free(args->dev_dist);
-    free(args->prob_dist);
-    free(args->gt);
-    free(args->af);
+    destroy_dist(&args->dist);
     free(args);
 }
 
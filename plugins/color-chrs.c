@@ -65,6 +65,8 @@
 #include <math.h>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include <htslib/thread_pool.h>
 #include <errno.h>
 #include "bcftools.h"
 #include "HMM.h"
@@ -91,19 +93,34 @@
 #define TRIO_CB 6
 #define TRIO_DB 7
 
-typedef struct _args_t
+// Chromosomes are independent: the sites of one chromosome are collected
+// into a job, the Viterbi path is run and formatted by a worker thread with
+// its own HMM, and the output is written in the order of chromosomes
+typedef struct
 {
-    bcf_hdr_t *hdr;
     hmm_t *hmm;
-    double *eprob, *tprob, pij, pgt_err;
+    double *eprob;
     uint32_t *sites;
+    int rid, nsites, msites, nhet_father, nhet_mother;
+    kstring_t str;  // the formatted output
+}
+chr_job_t;
+
+typedef struct _args_t
+{
+    bcf_hdr_t *hdr;
+    double *tprob, pij, pgt_err;
     int32_t *gt_arr;
-    int nsites, msites, ngt_arr, prev_rid;
-    int mode, nstates, nhet_father, nhet_mother;
+    int ngt_arr, prev_rid;
+    int mode, nstates;
     int imother,ifather,ichild, isample,jsample;
     void (*set_observed_prob) (bcf1_t *rec);
     char *prefix;
     FILE *fp;
+    chr_job_t *jobs, *job;
+    int njob, ijob, n_threads, ndispatched, nwritten;
+    hts_tpool *pool;
+    hts_tpool_process *queue;
 }
 args_t;
 
@@ -117,6 +134,7 @@ static void set_observed_prob_trio(bcf1_t *rec);
 static void set_observed_prob_unrelated(bcf1_t *rec);
 static void init_hmm_trio(args_t *args);
 static void init_hmm_unrelated(args_t *args);
+static void open_output(args_t *args);
 
 
 const char *about(void)
@@ -137,6 +155,7 @@ const char *usage(void)
         "Plugin options:\n"
         "   -p, --prefix <path>     output files prefix\n"
         "   -t, --trio <m,f,c>      names of mother, father and the child\n"
+        "       --threads <int>     process chromosomes in parallel [0]\n"
         "   -u, --unrelated <a,b>   names of two unrelated samples\n"
         "\n"
         "Example:\n"
@@ -158,9 +177,11 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         {"prefix",1,0,'p'},
         {"trio",1,0,'t'},
         {"unrelated",1,0,'u'},
+        {"threads",1,0,1},
         {0,0,0,0}
     };
     int c;
+    char *tmp;
     while ((c = getopt_long(argc, argv, "?ht:u:p:",loptions,NULL)) >= 0)
     {
         switch (c) 
@@ -168,6 +189,10 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
             case 'p': args.prefix = optarg; break;
             case 't': trio_samples = optarg; break;
             case 'u': unrelated_samples = optarg; break;
+            case  1 :
+                args.n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args.n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'h':
             case '?':
             default: error("%s", usage()); break;
@@ -209,6 +234,20 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         args.mode = C_UNRL;
         init_hmm_unrelated(&args);
     }
+
+    int i;
+    args.njob = args.n_threads ? 2*args.n_threads : 1;
+    args.jobs = (chr_job_t*) calloc(args.njob, sizeof(chr_job_t));
+    for (i=0; i<args.njob; i++)
+        args.jobs[i].hmm = hmm_init(args.nstates, args.tprob, 10000);
+    if ( args.n_threads )
+    {
+        args.pool = hts_tpool_init(args.n_threads);
+        if ( !args.pool ) error("Could not initialize threading\n");
+        args.queue = hts_tpool_process_init(args.pool, args.njob, 0);
+    }
+    open_output(&args);
+
     return 1;
 }
 
@@ -284,8 +323,6 @@ static void init_hmm_trio(args_t *args)
         fprintf(stderr,"\n");
     }
     #endif
-
-    args->hmm = hmm_init(args->nstates, args->tprob, 10000);
 }
 static void init_hmm_unrelated(args_t *args)
 {
@@ -329,8 +366,6 @@ static void init_hmm_unrelated(args_t *args)
         fprintf(stderr,"\n");
     }
     #endif
-
-    args->hmm = hmm_init(args->nstates, args->tprob, 10000);
 }
 static inline double prob_shared(float af, int a, int b)
 {
@@ -364,13 +399,14 @@ static void set_observed_prob_unrelated(bcf1_t *rec)
     c = bcf_gt_allele(c);
     d = bcf_gt_allele(d);
 
-    int m = args.msites;
-    args.nsites++;
-    hts_expand(uint32_t,args.nsites,args.msites,args.sites);
-    if ( m!=args.msites ) args.eprob = (double*) realloc(args.eprob, sizeof(double)*args.msites*args.nstates);
+    chr_job_t *job = args.job;
+    int m = job->msites;
+    job->nsites++;
+    hts_expand(uint32_t,job->nsites,job->msites,job->sites);
+    if ( m!=job->msites ) job->eprob = (double*) realloc(job->eprob, sizeof(double)*job->msites*args.nstates);
 
-    args.sites[args.nsites-1] = rec->pos;
-    double *prob = args.eprob + args.nstates*(args.nsites-1);
+    job->sites[job->nsites-1] = rec->pos;
+    double *prob = job->eprob + args.nstates*(job->nsites-1);
     prob[UNRL_xxxx] = prob_not_shared(af,a,c) * prob_not_shared(af,a,d) * prob_not_shared(af,b,c) * prob_not_shared(af,b,d);
     prob[UNRL_0x0x] = prob_shared(af,a,c) * prob_not_shared(af,b,d);
     prob[UNRL_0xx0] = prob_shared(af,a,d) * prob_not_shared(af,b,c);
@@ -423,16 +459,17 @@ static void set_observed_prob_trio(bcf1_t *rec)
     int child  = (1<<e) | (1<<f);
     if ( !(mother&child) || !(father&child) )  return;      // Mendelian-inconsistent site, skip
 
-    if ( a!=b ) args.nhet_mother++;
-    if ( c!=d ) args.nhet_father++;
+    chr_job_t *job = args.job;
+    if ( a!=b ) job->nhet_mother++;
+    if ( c!=d ) job->nhet_father++;
 
-    int m = args.msites;
-    args.nsites++;
-    hts_expand(uint32_t,args.nsites,args.msites,args.sites);
-    if ( m!=args.msites ) args.eprob = (double*) realloc(args.eprob, sizeof(double)*args.msites*args.nstates);
+    int m = job->msites;
+    job->nsites++;
+    hts_expand(uint32_t,job->nsites,job->msites,job->sites);
+    if ( m!=job->msites ) job->eprob = (double*) realloc(job->eprob, sizeof(double)*job->msites*args.nstates);
 
-    args.sites[args.nsites-1] = rec->pos;
-    double *prob = args.eprob + args.nstates*(args.nsites-1);
+    job->sites[job->nsites-1] = rec->pos;
+    double *prob = job->eprob + args.nstates*(job->nsites-1);
     prob[TRIO_AC] = prob_shared(0,e,a) * prob_shared(0,f,c);
     prob[TRIO_AD] = prob_shared(0,e,a) * prob_shared(0,f,d);
     prob[TRIO_BC] = prob_shared(0,e,b) * prob_shared(0,f,c);
@@ -443,61 +480,77 @@ static void set_observed_prob_trio(bcf1_t *rec)
     prob[TRIO_DB] = prob_shared(0,e,d) * prob_shared(0,f,b);
 }
 
-void flush_viterbi(args_t *args)
+static void sample_names(args_t *args, const char **s1, const char **s2, const char **s3)
 {
-    const char *s1, *s2, *s3 = NULL;
+    *s3 = NULL;
     if ( args->mode==C_UNRL )
     {
-        s1 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->isample);
-        s2 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->jsample);
+        *s1 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->isample);
+        *s2 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->jsample);
     }
     else if ( args->mode==C_TRIO )
     {
-        s1 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->imother);
-        s3 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->ifather);
-        s2 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->ichild);
+        *s1 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->imother);
+        *s3 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->ifather);
+        *s2 = bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,args->ichild);
     }
     else abort();
+}
+
+static void open_output(args_t *args)
+{
+    const char *s1, *s2, *s3;
+    sample_names(args, &s1, &s2, &s3);
+
+    kstring_t str = {0,0,0};
+    kputs(args->prefix, &str);
+    kputs(".dat", &str);
+    args->fp = fopen(str.s,"w");
+    if ( !args->fp ) error("%s: %s\n", str.s,strerror(errno));
+    free(str.s);
+    fprintf(args->fp,"# SG, shared segment\t[2]Chromosome\t[3]Start\t[4]End\t[5]%s:1\t[6]%s:2\n",s2,s2);
+    fprintf(args->fp,"# SW, number of switches\t[3]Sample\t[4]Chromosome\t[5]nHets\t[5]nSwitches\t[6]switch rate\n");
+}
 
-    if ( !args->fp )
+// Runs in a worker thread, only reads the global state
+static void format_viterbi(args_t *args, chr_job_t *job)
+{
+    const char *s1, *s2, *s3;
+    sample_names(args, &s1, &s2, &s3);
+
+    kstring_t *str = &job->str;
+    str->l = 0;
+    uint8_t *vpath = NULL;
+    if ( job->nsites )
     {
-        kstring_t str = {0,0,0};
-        kputs(args->prefix, &str);
-        kputs(".dat", &str);
-        args->fp = fopen(str.s,"w");
-        if ( !args->fp ) error("%s: %s\n", str.s,strerror(errno));
-        free(str.s);
-        fprintf(args->fp,"# SG, shared segment\t[2]Chromosome\t[3]Start\t[4]End\t[5]%s:1\t[6]%s:2\n",s2,s2);
-        fprintf(args->fp,"# SW, number of switches\t[3]Sample\t[4]Chromosome\t[5]nHets\t[5]nSwitches\t[6]switch rate\n");
+        hmm_run_viterbi(job->hmm,job->nsites,job->eprob,job->sites);
+        vpath = hmm_get_viterbi_path(job->hmm);
     }
-
-    hmm_run_viterbi(args->hmm,args->nsites,args->eprob,args->sites);
-    uint8_t *vpath = hmm_get_viterbi_path(args->hmm);
-    int i, iprev = -1, prev_state = -1, nstates = hmm_get_nstates(args->hmm);
+    int i, iprev = -1, prev_state = -1, nstates = hmm_get_nstates(job->hmm);
     int nswitch_mother = 0, nswitch_father = 0;
-    for (i=0; i<args->nsites; i++)
+    const char *chr = bcf_hdr_id2name(args->hdr,job->rid);
+    for (i=0; i<job->nsites; i++)
     {
         int state = vpath[i*nstates];
-        if ( state!=prev_state || i+1==args->nsites )
+        if ( state!=prev_state || i+1==job->nsites )
         {
-            uint32_t start = iprev>=0 ? args->sites[iprev]+1 : 1, end = i>0 ? args->sites[i-1] : 1;
-            const char *chr = bcf_hdr_id2name(args->hdr,args->prev_rid);
+            uint32_t start = iprev>=0 ? job->sites[iprev]+1 : 1, end = i>0 ? job->sites[i-1] : 1;
             if ( args->mode==C_UNRL )
             {
                 switch (prev_state)
                 {
                     case UNRL_0x0x:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:1\t-\n", chr,start,end,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:1\t-\n", chr,start,end,s1); break;
                     case UNRL_0xx0:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t-\t%s:1\n", chr,start,end,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t-\t%s:1\n", chr,start,end,s1); break;
                     case UNRL_x00x:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:2\t-\n", chr,start,end,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:2\t-\n", chr,start,end,s1); break;
                     case UNRL_x0x0:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t-\t%s:2\n", chr,start,end,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t-\t%s:2\n", chr,start,end,s1); break;
                     case UNRL_0101:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:1\t%s:2\n", chr,start,end,s1,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:1\t%s:2\n", chr,start,end,s1,s1); break;
                     case UNRL_0110:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:2\t%s:1\n", chr,start,end,s1,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:2\t%s:1\n", chr,start,end,s1,s1); break;
                 }
             }
             else if ( args->mode==C_TRIO )
@@ -505,21 +558,21 @@ void flush_viterbi(args_t *args)
                 switch (prev_state)
                 {
                     case TRIO_AC:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:1\t%s:1\n", chr,start,end,s1,s3); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:1\t%s:1\n", chr,start,end,s1,s3); break;
                     case TRIO_AD:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:1\t%s:2\n", chr,start,end,s1,s3); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:1\t%s:2\n", chr,start,end,s1,s3); break;
                     case TRIO_BC:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:2\t%s:1\n", chr,start,end,s1,s3); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:2\t%s:1\n", chr,start,end,s1,s3); break;
                     case TRIO_BD:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:2\t%s:2\n", chr,start,end,s1,s3); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:2\t%s:2\n", chr,start,end,s1,s3); break;
                     case TRIO_CA:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:1\t%s:1\n", chr,start,end,s3,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:1\t%s:1\n", chr,start,end,s3,s1); break;
                     case TRIO_DA:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:2\t%s:1\n", chr,start,end,s3,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:2\t%s:1\n", chr,start,end,s3,s1); break;
                     case TRIO_CB:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:1\t%s:2\n", chr,start,end,s3,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:1\t%s:2\n", chr,start,end,s3,s1); break;
                     case TRIO_DB:
-                        fprintf(args->fp,"SG\t%s\t%d\t%d\t%s:2\t%s:2\n", chr,start,end,s3,s1); break;
+                        ksprintf(str,"SG\t%s\t%d\t%d\t%s:2\t%s:2\n", chr,start,end,s3,s1); break;
                 }
                 if ( hap_switch[state][prev_state] & SW_MOTHER ) nswitch_mother++;
                 if ( hap_switch[state][prev_state] & SW_FATHER ) nswitch_father++;
@@ -528,18 +581,64 @@ void flush_viterbi(args_t *args)
         }
         prev_state = state;
     }
-    float mrate = args->nhet_mother>1 ? (float)nswitch_mother/(args->nhet_mother-1) : 0;
-    float frate = args->nhet_father>1 ? (float)nswitch_father/(args->nhet_father-1) : 0;
-    fprintf(args->fp,"SW\t%s\t%s\t%d\t%d\t%f\n", s1,bcf_hdr_id2name(args->hdr,args->prev_rid),args->nhet_mother,nswitch_mother,mrate);
-    fprintf(args->fp,"SW\t%s\t%s\t%d\t%d\t%f\n", s3,bcf_hdr_id2name(args->hdr,args->prev_rid),args->nhet_father,nswitch_father,frate);
-    args->nsites = 0;
-    args->nhet_father = args->nhet_mother = 0;
+    float mrate = job->nhet_mother>1 ? (float)nswitch_mother/(job->nhet_mother-1) : 0;
+    float frate = job->nhet_father>1 ? (float)nswitch_father/(job->nhet_father-1) : 0;
+    ksprintf(str,"SW\t%s\t%s\t%d\t%d\t%f\n", s1,chr,job->nhet_mother,nswitch_mother,mrate);
+    ksprintf(str,"SW\t%s\t%s\t%d\t%d\t%f\n", s3,chr,job->nhet_father,nswitch_father,frate);
+}
+static void *run_viterbi(void *arg)
+{
+    format_viterbi(&args, (chr_job_t*) arg);
+    return arg;
+}
+
+static void write_job(args_t *args, chr_job_t *job)
+{
+    if ( fwrite(job->str.s, 1, job->str.l, args->fp)!=job->str.l ) error("Failed to write to %s.dat\n", args->prefix);
+}
+
+static void write_result(args_t *args)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(args->queue);
+    if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+    write_job(args, (chr_job_t*) hts_tpool_result_data(res));
+    hts_tpool_delete_result(res, 0);
+    args->nwritten++;
+}
+
+// The job slots are used round robin and the results come back in the order
+// of dispatch, so a slot can be reused once the oldest result was written
+static void start_job(args_t *args, int rid)
+{
+    if ( args->ndispatched - args->nwritten == args->njob ) write_result(args);
+    args->job = &args->jobs[args->ijob];
+    args->job->rid = rid;
+    args->job->nsites = 0;
+    args->job->nhet_father = args->job->nhet_mother = 0;
+}
+
+static void flush_viterbi(args_t *args)
+{
+    chr_job_t *job = args->job;
+    args->job = NULL;
+    if ( !args->pool )
+    {
+        run_viterbi(job);
+        write_job(args, job);
+        return;
+    }
+    if ( hts_tpool_dispatch(args->pool, args->queue, run_viterbi, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    args->ndispatched++;
+    args->ijob = (args->ijob + 1) % args->njob;
 }
     
 bcf1_t *process(bcf1_t *rec)
 {
-    if ( args.prev_rid==-1 ) args.prev_rid = rec->rid;
-    if ( args.prev_rid!=rec->rid ) flush_viterbi(&args);
+    if ( args.prev_rid!=rec->rid )
+    {
+        if ( args.prev_rid!=-1 ) flush_viterbi(&args);
+        start_job(&args, rec->rid);
+    }
     args.prev_rid = rec->rid;
     args.set_observed_prob(rec);
     return NULL;
@@ -547,15 +646,24 @@ bcf1_t *process(bcf1_t *rec)
 
 void destroy(void)
 {
-    flush_viterbi(&args);
+    if ( args.job ) flush_viterbi(&args);
+    if ( args.pool )
+    {
+        while ( args.nwritten < args.ndispatched ) write_result(&args);
+        hts_tpool_process_destroy(args.queue);
+        hts_tpool_destroy(args.pool);
+    }
     fclose(args.fp);
 
+    int i;
+    for (i=0; i<args.njob; i++)
+    {
+        hmm_destroy(args.jobs[i].hmm);
+        free(args.jobs[i].sites);
+        free(args.jobs[i].eprob);
+        free(args.jobs[i].str.s);
+    }
+    free(args.jobs);
     free(args.gt_arr);
     free(args.tprob);
-    free(args.sites);
-    free(args.eprob);
-    hmm_destroy(args.hmm);
 }
-
-
-
@@ -51,6 +51,22 @@
 #define PRINT_NOVELAL (1<<3)
 #define PRINT_NOVELGT (1<<4)
 
+// Genotypes are stored as bitmasks of alleles and, with ploidy at most two,
+// have one or two bits set. The set of control genotypes is a bitset indexed
+// by the allele pair, see gt_mask_idx()
+#define MAX_ALLELES 32
+#define GT_SET_NWORDS ((MAX_ALLELES*(MAX_ALLELES+1)/2 + 63)/64)
+
+// Fisher's exact test is expensive with biobank-size allele counts, while the
+// same count tuples, of rare variants in particular, keep recurring
+#define FISHER_CACHE_BITS 16
+typedef struct
+{
+    int32_t nals[4];
+    double fisher;
+}
+fisher_cache_t;
+
 typedef struct
 {
     int argc, filter_logic, regions_is_file, targets_is_file, output_type, force_samples;
@@ -64,8 +80,9 @@ typedef struct
     htsFile *out_fh;
     int32_t *gts;
     int mgts;
-    uint32_t *control_gts;
-    int ncontrol_gts, mcontrol_gts, ntotal, nskipped, ntested, ncase_al, ncase_gt;
+    uint64_t control_gts[GT_SET_NWORDS];
+    fisher_cache_t *fisher_cache;
+    int ntotal, nskipped, ntested, ncase_al, ncase_gt;
     kstring_t case_als_smpl, case_gts_smpl;
     int max_AC, nals[4];    // nals: number of control-ref, control-alt, case-ref and case-alt alleles in the region
 }
@@ -230,6 +247,12 @@ static void init_data(args_t *args)
             if ( !args->max_AC ) args->max_AC = 1;
         }
     }
+
+    if ( args->annots & PRINT_PASSOC )
+    {
+        args->fisher_cache = (fisher_cache_t*) malloc(sizeof(*args->fisher_cache)*(1<<FISHER_CACHE_BITS));
+        memset(args->fisher_cache, 0xff, sizeof(*args->fisher_cache)*(1<<FISHER_CACHE_BITS));
+    }
 }
 static void destroy_data(args_t *args)
 {
@@ -238,44 +261,43 @@ static void destroy_data(args_t *args)
     free(args->case_als_smpl.s);
     free(args->case_gts_smpl.s);
     free(args->gts);
-    free(args->control_gts);
+    free(args->fisher_cache);
     free(args->control_smpl);
     free(args->case_smpl);
     if ( args->filter ) filter_destroy(args->filter);
     bcf_sr_destroy(args->sr);
     free(args);
 }
-static inline int binary_search(uint32_t val, uint32_t *dat, int ndat)
+static inline int gt_mask_idx(uint32_t gt)
 {
-    int i = -1, imin = 0, imax = ndat - 1;
-    while ( imin<=imax )
-    {
-        i = (imin+imax)/2;
-        if ( dat[i] < val ) imin = i + 1;
-        else if ( dat[i] > val ) imax = i - 1;
-        else return 1;
-    }
-    return 0;
+    int lo = 0, hi = MAX_ALLELES - 1;
+    while ( !(gt & (1U<<lo)) ) lo++;
+    while ( !(gt & (1U<<hi)) ) hi--;
+    return hi*(hi+1)/2 + lo;
 }
-static inline void binary_insert(uint32_t val, uint32_t **dat, int *ndat, int *mdat)
+static inline void gt_set_insert(uint64_t *set, uint32_t gt)
 {
-    int i = -1, imin = 0, imax = *ndat - 1;
-    while ( imin<=imax )
+    int idx = gt_mask_idx(gt);
+    set[idx>>6] |= 1ULL<<(idx&63);
+}
+static inline int gt_set_contains(uint64_t *set, uint32_t gt)
+{
+    int idx = gt_mask_idx(gt);
+    return set[idx>>6] & (1ULL<<(idx&63)) ? 1 : 0;
+}
+static double calc_fisher_cached(args_t *args, int32_t *nals)
+{
+    uint64_t hash = 0;
+    int i;
+    for (i=0; i<4; i++) hash = (hash ^ (uint32_t)nals[i]) * 0x9e3779b97f4a7c15ULL;
+    fisher_cache_t *slot = &args->fisher_cache[hash >> (64 - FISHER_CACHE_BITS)];
+    if ( memcmp(slot->nals, nals, sizeof(slot->nals)) )
     {
-        i = (imin+imax)/2;
-        if ( (*dat)[i] < val ) imin = i + 1;
-        else if ( (*dat)[i] > val ) imax = i - 1;
-        else return;
+        double left, right;
+        kt_fisher_exact(nals[0],nals[1],nals[2],nals[3], &left,&right,&slot->fisher);
+        memcpy(slot->nals, nals, sizeof(slot->nals));
     }
-    while ( i>=0 && (*dat)[i]>val ) i--;
-
-    (*ndat)++;
-    hts_expand(uint32_t, (*ndat), (*mdat), (*dat));
-
-    if ( *ndat > 1 )
-        memmove(*dat + i + 1, *dat + i, sizeof(uint32_t)*(*ndat - i - 1));
-
-    (*dat)[i+1] = val;
+    return slot->fisher;
 }
 static int process_record(args_t *args, bcf1_t *rec)
 {
@@ -286,7 +308,7 @@ static int process_record(args_t *args, bcf1_t *rec)
     ngts /= rec->n_sample;
     if ( ngts>2 ) error("todo: ploidy=%d\n", ngts);
 
-    args->ncontrol_gts = 0;
+    memset(args->control_gts, 0, sizeof(args->control_gts));
     uint32_t control_als = 0;
     int32_t nals[4] = {0,0,0,0};    // ctrl-ref, ctrl-alt, case-ref, case-alt
     int i,j;
@@ -299,7 +321,7 @@ static int process_record(args_t *args, bcf1_t *rec)
             if ( ptr[j]==bcf_int32_vector_end ) break;
             if ( bcf_gt_is_missing(ptr[j]) ) continue; 
             int ial = bcf_gt_allele(ptr[j]);
-            if ( ial > 31 )
+            if ( ial >= MAX_ALLELES )
             {
                 if ( !warned )
                 {
@@ -309,13 +331,13 @@ static int process_record(args_t *args, bcf1_t *rec)
                 args->nskipped++;
                 return -1;
             }
-            control_als |= 1<<ial;
-            gt |= 1<<ial;
+            control_als |= 1U<<ial;
+            gt |= 1U<<ial;
             if ( ial ) nals[1]++;
             else nals[0]++;
         }
-        if ( args->annots & PRINT_NOVELGT )
-            binary_insert(gt, &args->control_gts, &args->ncontrol_gts, &args->mcontrol_gts);
+        if ( gt && (args->annots & PRINT_NOVELGT) )
+            gt_set_insert(args->control_gts, gt);
     }
     if ( !control_als )
     {
@@ -338,7 +360,7 @@ static int process_record(args_t *args, bcf1_t *rec)
             if ( ptr[j]==bcf_int32_vector_end ) break;
             if ( bcf_gt_is_missing(ptr[j]) ) continue; 
             int ial = bcf_gt_allele(ptr[j]);
-            if ( ial > 31 )
+            if ( ial >= MAX_ALLELES )
             {
                 if ( !warned )
                 {
@@ -348,8 +370,8 @@ static int process_record(args_t *args, bcf1_t *rec)
                 args->nskipped++;
                 return -1;
             }
-            if ( !(control_als & (1<<ial)) ) case_al = 1; 
-            gt |= 1<<ial;
+            if ( !(control_als & (1U<<ial)) ) case_al = 1; 
+            gt |= 1U<<ial;
             if ( ial ) nals[3]++;
             else nals[2]++;
         }
@@ -365,7 +387,7 @@ static int process_record(args_t *args, bcf1_t *rec)
                 kputs(smpl, &args->case_als_smpl);
             }
         }
-        else if ( (args->annots & PRINT_NOVELGT) && !binary_search(gt, args->control_gts, args->ncontrol_gts) )
+        else if ( (args->annots & PRINT_NOVELGT) && !gt_set_contains(args->control_gts, gt) )
         {
             if ( args->case_gts_smpl.l ) kputc(',', &args->case_gts_smpl);
             kputs(smpl, &args->case_gts_smpl);
@@ -400,9 +422,7 @@ static int process_record(args_t *args, bcf1_t *rec)
     float vals[2];
     if ( args->annots & PRINT_PASSOC )
     {
-        double left, right, fisher;
-        kt_fisher_exact(nals[0],nals[1],nals[2],nals[3], &left,&right,&fisher);
-        vals[0] = fisher;
+        vals[0] = calc_fisher_cached(args, nals);
         bcf_update_info_float(args->hdr_out, rec, "PASSOC", vals, 1);
     }
     if ( args->annots & PRINT_FASSOC )
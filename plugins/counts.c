@@ -24,10 +24,18 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <htslib/vcf.h>
 
-uint64_t nsamples, nsnps, nindels, nmnps, nothers, nsites;
+typedef struct
+{
+    uint64_t nsnps, nindels, nmnps, nothers, nsites;
+}
+counts_t;
+
+uint64_t nsamples;
+counts_t counts;    // the totals, also used by process() when not running in parallel
 
 /*
     This short description is used to generate the output of `bcftools plugin -l`.
@@ -46,10 +54,20 @@ const char *about(void)
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     nsamples = bcf_hdr_nsamples(in);
-    nsnps = nindels = nmnps = nothers = nsites = 0;
+    memset(&counts,0,sizeof(counts));
     return 1;
 }
 
+static void count_record(counts_t *cnt, bcf1_t *rec)
+{
+    int type = bcf_get_variant_types(rec);
+    if ( type & VCF_SNP ) cnt->nsnps++;
+    if ( type & VCF_INDEL ) cnt->nindels++;
+    if ( type & VCF_MNP ) cnt->nmnps++;
+    if ( type & VCF_OTHER ) cnt->nothers++;
+    cnt->nsites++;
+}
+
 
 /*
     Called for each VCF record. Return rec to output the line or NULL
@@ -57,27 +75,54 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 */
 bcf1_t *process(bcf1_t *rec)
 {
-    int type = bcf_get_variant_types(rec);
-    if ( type & VCF_SNP ) nsnps++;
-    if ( type & VCF_INDEL ) nindels++;
-    if ( type & VCF_MNP ) nmnps++;
-    if ( type & VCF_OTHER ) nothers++;
-    nsites++;
+    count_record(&counts, rec);
     return NULL;
 }
 
 
+/*
+    Optional, allows to run the plugin with --threads: each thread counts
+    in its own context, the contexts are added up in merge_ctx().
+*/
+int parallel_safe(void)
+{
+    return 1;
+}
+
+void *init_thread(void)
+{
+    return calloc(1,sizeof(counts_t));
+}
+
+bcf1_t *process_ctx(void *ctx, bcf1_t *rec)
+{
+    count_record((counts_t*)ctx, rec);
+    return NULL;
+}
+
+void merge_ctx(void *ptr)
+{
+    counts_t *cnt = (counts_t*) ptr;
+    counts.nsnps   += cnt->nsnps;
+    counts.nindels += cnt->nindels;
+    counts.nmnps   += cnt->nmnps;
+    counts.nothers += cnt->nothers;
+    counts.nsites  += cnt->nsites;
+    free(cnt);
+}
+
+
 /*
     Clean up.
 */
 void destroy(void)
 {
     printf("Number of samples: %"PRIu64"\n", nsamples);
-    printf("Number of SNPs:    %"PRIu64"\n", nsnps);
-    printf("Number of INDELs:  %"PRIu64"\n", nindels);
-    printf("Number of MNPs:    %"PRIu64"\n", nmnps);
-    printf("Number of others:  %"PRIu64"\n", nothers);
-    printf("Number of sites:   %"PRIu64"\n", nsites);
+    printf("Number of SNPs:    %"PRIu64"\n", counts.nsnps);
+    printf("Number of INDELs:  %"PRIu64"\n", counts.nindels);
+    printf("Number of MNPs:    %"PRIu64"\n", counts.nmnps);
+    printf("Number of others:  %"PRIu64"\n", counts.nothers);
+    printf("Number of sites:   %"PRIu64"\n", counts.nsites);
 }
 
 
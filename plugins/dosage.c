@@ -25,6 +25,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <htslib/vcf.h>
+#include <htslib/kstring.h>
 #include <math.h>
 #include <getopt.h>
 #include <inttypes.h>
@@ -64,75 +65,70 @@ char **tags = NULL;
 int ntags = 0;
 float *vals = NULL, *dsg = NULL;
 int mvals, mdsg;
+kstring_t str = {0,0,0};    // the output line, printed at once
+
+// Integer PL values are converted via a lookup table, the values are
+// small in practice and pow() dominated the run time
+#define PL2PROB_MAX 255
+float pl2prob[PL2PROB_MAX+1];
 
 typedef int (*dosage_f) (bcf1_t *);
 dosage_f *handlers = NULL;
 int nhandlers = 0;
 
 
-int calc_dosage_PL(bcf1_t *rec)
+static inline float phred2prob(int32_t pl)
 {
-    int i, j, nret = bcf_get_format_values(in_hdr,rec,"PL",(void**)&buf,&nbuf,pl_type);
-    if ( nret<0 ) return -1;
+    if ( pl>=0 && pl<=PL2PROB_MAX ) return pl2prob[pl];
+    return pow(10,-0.1*pl);
+}
 
-    nret /= rec->n_sample;
-    if ( nret != rec->n_allele*(rec->n_allele+1)/2 ) return -1;     // not diploid
-    hts_expand(float, nret, mvals, vals);
-    hts_expand(float, rec->n_allele, mdsg, dsg);
-    #define BRANCH(type_t,is_missing,is_vector_end) \
-    { \
-        type_t *ptr = (type_t*) buf; \
-        for (i=0; i<rec->n_sample; i++) \
-        { \
-            float sum = 0; \
-            for (j=0; j<nret; j++) \
-            { \
-                if ( is_missing || is_vector_end ) break; \
-                vals[j] = pow(10,-0.1*ptr[j]); \
-                sum += vals[j]; \
-            } \
-            if ( j<nret ) \
-                for (j=0; j<rec->n_allele; j++) dsg[j] = -1; \
-            else \
-            { \
-                if ( sum ) for (j=0; j<nret; j++) vals[j] /= sum; \
-                vals[0] = 0; \
-                memset(dsg, 0, sizeof(float)*rec->n_allele); \
-                int k, l = 0; \
-                for (j=0; j<rec->n_allele; j++) \
-                { \
-                    for (k=0; k<=j; k++) \
-                    { \
-                        dsg[j] += vals[l]; \
-                        dsg[k] += vals[l]; \
-                        l++; \
-                    } \
-                } \
-            } \
-            for (j=1; j<rec->n_allele; j++) \
-                printf("%c%f",j==1?'\t':',',dsg[j]); \
-            ptr += nret; \
-        } \
-    }
-    switch (pl_type)
+// Equivalent to ksprintf(s,"%f",val) for values within the range of dosages.
+// The float multiplied by 1e6 is exact in double, therefore rint() rounds
+// the same way as printf does
+static inline void kput_dosage(kstring_t *s, float val)
+{
+    if ( !(val > -1e6 && val < 1e6) ) { ksprintf(s,"%f",val); return; }
+    double x = rint(fabs((double)val*1e6));
+    int64_t ival = (int64_t)x;
+    if ( signbit(val) ) kputc('-', s);
+    kputw(ival/1000000, s);
+    kputc('.', s);
+    ival %= 1000000;
+    char tmp[6];
+    int i;
+    for (i=5; i>=0; i--) { tmp[i] = '0' + ival%10; ival /= 10; }
+    kputsn(tmp, 6, s);
+}
+
+// Genotype probabilities to dosages, vals[] must be normalized
+static void probs_to_dosage(int nals)
+{
+    vals[0] = 0;
+    memset(dsg, 0, sizeof(float)*nals);
+    int j, k, l = 0;
+    for (j=0; j<nals; j++)
     {
-        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
+        for (k=0; k<=j; k++)
+        {
+            dsg[j] += vals[l];
+            dsg[k] += vals[l];
+            l++;
+        }
     }
-    #undef BRANCH
-    return 0;
 }
 
-int calc_dosage_GL(bcf1_t *rec)
+// Dosages from PL (is_gl=0) or GL (is_gl=1) values
+static int calc_dosage_probs(bcf1_t *rec, const char *tag, int type, int is_gl)
 {
-    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,gl_type);
+    int i, j, nret = bcf_get_format_values(in_hdr,rec,tag,(void**)&buf,&nbuf,type);
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
     if ( nret != rec->n_allele*(rec->n_allele+1)/2 ) return -1;     // not diploid
     hts_expand(float, nret, mvals, vals);
     hts_expand(float, rec->n_allele, mdsg, dsg);
-    #define BRANCH(type_t,is_missing,is_vector_end) \
+    #define BRANCH(type_t,is_missing,is_vector_end,to_prob) \
     { \
         type_t *ptr = (type_t*) buf; \
         for (i=0; i<rec->n_sample; i++) \
@@ -141,7 +137,7 @@ int calc_dosage_GL(bcf1_t *rec)
             for (j=0; j<nret; j++) \
             { \
                 if ( is_missing || is_vector_end ) break; \
-                vals[j] = pow(10,ptr[j]); \
+                vals[j] = to_prob; \
                 sum += vals[j]; \
             } \
             if ( j<nret ) \
@@ -149,33 +145,40 @@ int calc_dosage_GL(bcf1_t *rec)
             else \
             { \
                 if ( sum ) for (j=0; j<nret; j++) vals[j] /= sum; \
-                vals[0] = 0; \
-                memset(dsg, 0, sizeof(float)*rec->n_allele); \
-                int k, l = 0; \
-                for (j=0; j<rec->n_allele; j++) \
-                { \
-                    for (k=0; k<=j; k++) \
-                    { \
-                        dsg[j] += vals[l]; \
-                        dsg[k] += vals[l]; \
-                        l++; \
-                    } \
-                } \
+                probs_to_dosage(rec->n_allele); \
             } \
             for (j=1; j<rec->n_allele; j++) \
-                printf("%c%f",j==1?'\t':',',dsg[j]); \
+            { \
+                kputc(j==1?'\t':',', &str); \
+                kput_dosage(&str, dsg[j]); \
+            } \
             ptr += nret; \
         } \
     }
-    switch (gl_type)
+    if ( type==BCF_HT_INT )
     {
-        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
+        if ( is_gl ) BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end,pow(10,ptr[j]))
+        else BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end,phred2prob(ptr[j]))
+    }
+    else
+    {
+        if ( is_gl ) BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j]),pow(10,ptr[j]))
+        else BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j]),pow(10,-0.1*ptr[j]))
     }
     #undef BRANCH
     return 0;
 }
 
+int calc_dosage_PL(bcf1_t *rec)
+{
+    return calc_dosage_probs(rec, "PL", pl_type, 0);
+}
+
+int calc_dosage_GL(bcf1_t *rec)
+{
+    return calc_dosage_probs(rec, "GL", gl_type, 1);
+}
+
 int calc_dosage_GT(bcf1_t *rec)
 {
     int i, j, nret = bcf_get_genotypes(in_hdr,rec,(void**)&buf,&nbuf);
@@ -197,7 +200,12 @@ int calc_dosage_GT(bcf1_t *rec)
         if ( !j )
             for (j=0; j<rec->n_allele; j++) dsg[j] = -1;
         for (j=1; j<rec->n_allele; j++)
-            printf("%c%.1f",j==1?'\t':',',dsg[j]);
+        {
+            // the GT dosages are whole numbers
+            kputc(j==1?'\t':',', &str);
+            kputw((int)dsg[j], &str);
+            kputs(".0", &str);
+        }
         ptr += nret;
     }
     return 0;
@@ -245,6 +253,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     }
     tags = split_list(tags_str, &ntags);
 
+    for (i=0; i<=PL2PROB_MAX; i++) pl2prob[i] = pow(10,-0.1*i);
+
     in_hdr = in;
     for (i=0; i<ntags; i++)
     {
@@ -304,27 +314,31 @@ bcf1_t *process(bcf1_t *rec)
 {
     int i,j, ret;
 
-    printf("%s\t%"PRId64"\t%s", bcf_seqname(in_hdr,rec),(int64_t) rec->pos+1,rec->d.allele[0]);
-    if ( rec->n_allele == 1 ) printf("\t.");
-    else for (i=1; i<rec->n_allele; i++) printf("%c%s", i==1?'\t':',', rec->d.allele[i]);
+    str.l = 0;
+    ksprintf(&str, "%s\t%"PRId64"\t%s", bcf_seqname(in_hdr,rec),(int64_t) rec->pos+1,rec->d.allele[0]);
+    if ( rec->n_allele == 1 ) kputs("\t.", &str);
+    else for (i=1; i<rec->n_allele; i++) { kputc(i==1?'\t':',', &str); kputs(rec->d.allele[i], &str); }
     if ( rec->n_allele==1 )
     {
-        for (j=0; j<rec->n_sample; j++) printf("\t0.0");
+        for (j=0; j<rec->n_sample; j++) kputs("\t0.0", &str);
     }
     else
     {
+        size_t len = str.l;
         for (i=0; i<nhandlers; i++)
         {
             ret = handlers[i](rec);
             if ( !ret ) break;  // successfully printed
+            str.l = len;
         }
         if ( i==nhandlers )
         {
             // none of the annotations present
-            for (i=0; i<rec->n_sample; i++) printf("\t-1.0");
+            for (i=0; i<rec->n_sample; i++) kputs("\t-1.0", &str);
         }
     }
-    printf("\n");
+    kputc('\n', &str);
+    if ( fwrite(str.s, 1, str.l, stdout)!=str.l ) error("Failed to write to stdout\n");
 
     return NULL;
 }
@@ -336,6 +350,7 @@ void destroy(void)
     free(dsg);
     free(handlers);
     free(buf);
+    free(str.s);
 }
 
 
@@ -29,7 +29,6 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 
 bcf_hdr_t *in_hdr, *out_hdr;
-int *arr = NULL, marr = 0;
 
 const char *about(void)
 {
@@ -45,23 +44,54 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 0;
 }
 
-bcf1_t *process(bcf1_t *rec)
+typedef struct
 {
-    hts_expand(int,rec->n_allele,marr,arr);
-    int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+    int *arr, marr;
+}
+ctx_t;
+ctx_t global_ctx;   // used by process() when not running in parallel
+
+static bcf1_t *fill_an_ac(ctx_t *ctx, bcf1_t *rec)
+{
+    hts_expand(int,rec->n_allele,ctx->marr,ctx->arr);
+    int ret = bcf_calc_ac(in_hdr,rec,ctx->arr,BCF_UN_FMT);
     if ( ret>0 )
     {
         int i, an = 0;
-        for (i=0; i<rec->n_allele; i++) an += arr[i];
+        for (i=0; i<rec->n_allele; i++) an += ctx->arr[i];
         bcf_update_info_int32(out_hdr, rec, "AN", &an, 1);
-        bcf_update_info_int32(out_hdr, rec, "AC", arr+1, rec->n_allele-1);
+        bcf_update_info_int32(out_hdr, rec, "AC", ctx->arr+1, rec->n_allele-1);
     }
     return rec;
 }
 
-void destroy(void)
+bcf1_t *process(bcf1_t *rec)
+{
+    return fill_an_ac(&global_ctx, rec);
+}
+
+int parallel_safe(void)
+{
+    return 1;
+}
+
+void *init_thread(void)
+{
+    return calloc(1,sizeof(ctx_t));
+}
+
+bcf1_t *process_ctx(void *ctx, bcf1_t *rec)
 {
-    free(arr);
+    return fill_an_ac((ctx_t*)ctx, rec);
 }
 
+void merge_ctx(void *ctx)
+{
+    free(((ctx_t*)ctx)->arr);
+    free(ctx);
+}
 
+void destroy(void)
+{
+    free(global_ctx.arr);
+}
@@ -29,10 +29,11 @@ DEALINGS IN THE SOFTWARE.  */
 #include <getopt.h>
 #include <inttypes.h>
 #include <htslib/vcf.h>
-#include <htslib/faidx.h>
+#include <htslib/kstring.h>
 #include <htslib/kseq.h>
 #include "filter.h"
 #include "bcftools.h"
+#include "refseq.h"
 
 const char *about(void)
 {
@@ -74,7 +75,8 @@ const char *usage(void)
 }
 
 bcf_hdr_t *in_hdr = NULL, *out_hdr = NULL;
-faidx_t *faidx;
+refseq_t *refseq;
+kstring_t fa = {0,0,0};
 int anno = 0;
 char *column = NULL;
 int replace_nonACGTN = 0;
@@ -164,7 +166,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         fprintf(stderr,"No fasta given.\n");
         return -1;
     }
-    faidx = fai_load(ref_fname);
+    refseq = refseq_init(ref_fname);
+    if ( !refseq )
+    {
+        fprintf(stderr,"Failed to load the reference: %s\n", ref_fname);
+        return -1;
+    }
     if ( filter_str )
         filter = filter_init(in, filter_str);
     return 0;
@@ -184,33 +191,34 @@ bcf1_t *process(bcf1_t *rec)
     int i;
     char *ref = rec->d.allele[0];
     int ref_len = strlen(ref);
-    int fa_len;
-    // could be sped up here by fetching the whole chromosome? could assume
-    // sorted, but revert to this when non-sorted records found?
-    char *fa = faidx_fetch_seq(faidx, bcf_seqname(in_hdr,rec), rec->pos, rec->pos+ref_len-1, &fa_len);
-    if ( !fa ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_hdr_id2name(in_hdr,rec->rid),(int64_t) rec->pos+1);
+    hts_pos_t fa_len;
+    // the sorted records are served from the reference window, see refseq.h
+    const char *seq = refseq_fetch(refseq, bcf_seqname(in_hdr,rec), rec->pos, rec->pos+ref_len-1, &fa_len);
+    if ( !seq ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_hdr_id2name(in_hdr,rec->rid),(int64_t) rec->pos+1);
+    fa.l = 0;
+    kputsn(seq, fa_len, &fa);
     for (i=0; i<fa_len; i++)
     {
-        if ( (int)fa[i]>96 ) fa[i] -= 32;
-        if ( replace_nonACGTN && fa[i]!='A' && fa[i]!='C' && fa[i]!='G' && fa[i]!='T' && fa[i]!='N' ) fa[i] = 'N';
+        if ( (int)fa.s[i]>96 ) fa.s[i] -= 32;
+        if ( replace_nonACGTN && fa.s[i]!='A' && fa.s[i]!='C' && fa.s[i]!='G' && fa.s[i]!='T' && fa.s[i]!='N' ) fa.s[i] = 'N';
     }
 
     assert(ref_len == fa_len);
     if (anno==ANNO_REF)
-        strncpy(rec->d.allele[0], fa, fa_len);
+        strncpy(rec->d.allele[0], fa.s, fa_len);
     else if (anno==ANNO_STRING)
-        bcf_update_info_string(out_hdr, rec, column, fa);
+        bcf_update_info_string(out_hdr, rec, column, fa.s);
     else if (anno==ANNO_INT && ref_len==1)
     {
-        int val = atoi(&fa[0]);
+        int val = atoi(fa.s);
         bcf_update_info_int32(out_hdr, rec, column, &val, 1);
     }
-    free(fa);
     return rec;
 }
 
 void destroy(void)
 {
-    fai_destroy(faidx);
+    refseq_destroy(refseq);
+    free(fa.s);
     if (filter) filter_destroy(filter);
 }
@@ -1,2 +1,2 @@
-plugins/fill-from-fasta.so: plugins/fill-from-fasta.c version.h version.c filter.h filter.c
-	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(ALL_CPPFLAGS) $(EXTRA_CPPFLAGS) $(PERL_CFLAGS) $(LDFLAGS) -o $@ filter.c version.c $< $(PLUGIN_LIBS) $(LIBS)
+plugins/fill-from-fasta.so: plugins/fill-from-fasta.c version.h version.c filter.h filter.c refseq.h refseq.c
+	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(ALL_CPPFLAGS) $(EXTRA_CPPFLAGS) $(PERL_CFLAGS) $(LDFLAGS) -o $@ filter.c refseq.c version.c $< $(PLUGIN_LIBS) $(LIBS)
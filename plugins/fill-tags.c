@@ -52,6 +52,18 @@
 #define SET_END     (1<<11)
 #define SET_TYPE    (1<<12)
 
+// genotype classes of biallelic sites, see process_fmt()
+#define GT_HOM0   0
+#define GT_HOM1   1
+#define GT_HEMI0  2
+#define GT_HEMI1  3
+#define GT_HALF0  4
+#define GT_HALF1  5
+#define GT_HET    6
+#define GT_NCLASS 7
+
+#define HWE_CACHE_BITS 16
+
 typedef struct _args_t args_t;
 typedef struct _ftf_t ftf_t;
 typedef int (*fill_tag_f)(args_t *, bcf1_t *, ftf_t *);
@@ -71,11 +83,19 @@ typedef struct
 }
 counts_t;
 
+typedef struct
+{
+    uint64_t key;   // nref,nalt,nhet packed by calc_hwe_cached()
+    float hwe, exc_het;
+}
+hwe_cache_t;
+
 typedef struct
 {
     int ns;
     int ncounts, mcounts;
     counts_t *counts;
+    int hist[GT_NCLASS];    // genotype class counts at biallelic sites
     char *name, *suffix;
     int nsmpl, *smpl;
 }
@@ -90,6 +110,7 @@ struct _args_t
     int32_t *iarr, niarr, miarr, nfarr, mfarr, unpack;
     double *hwe_probs;
     int mhwe_probs;
+    hwe_cache_t *hwe_cache;
     kstring_t str;
     kbitset_t *bset;
     ftf_t *ftf;
@@ -485,6 +506,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( args->tags & SET_TYPE ) bcf_hdr_printf(args->out_hdr, "##INFO=<ID=TYPE,Number=.,Type=String,Description=\"Variant type\">");
     if ( args->tags & SET_ExcHet ) hdr_append(args, "##INFO=<ID=ExcHet%s,Number=A,Type=Float,Description=\"Test excess heterozygosity%s%s; 1=good, 0=bad\">");
 
+    if ( args->tags & (SET_HWE|SET_ExcHet) )
+    {
+        args->hwe_cache = (hwe_cache_t*) malloc(sizeof(*args->hwe_cache)*(1<<HWE_CACHE_BITS));
+        memset(args->hwe_cache, 0xff, sizeof(*args->hwe_cache)*(1<<HWE_CACHE_BITS));
+    }
+
     return 0;
 }
 
@@ -562,6 +589,29 @@ void calc_hwe(args_t *args, int nref, int nalt, int nhet, float *p_hwe, float *p
     *p_hwe = prob;
 }
 
+/*
+    The same (nref,nalt,nhet) triplets keep coming back, across sites and
+    populations, especially for rare variants. Remember the last result
+    in each slot of a direct-mapped cache.
+*/
+static void calc_hwe_cached(args_t *args, int nref, int nalt, int nhet, float *p_hwe, float *p_exc_het)
+{
+    if ( nref >= 1<<21 || nalt >= 1<<21 )
+    {
+        calc_hwe(args, nref, nalt, nhet, p_hwe, p_exc_het);
+        return;
+    }
+    uint64_t key = (uint64_t)nref<<42 | (uint64_t)nalt<<21 | nhet;     // nhet <= nalt
+    hwe_cache_t *slot = &args->hwe_cache[(key * 0x9e3779b97f4a7c15ULL) >> (64 - HWE_CACHE_BITS)];
+    if ( slot->key != key )
+    {
+        calc_hwe(args, nref, nalt, nhet, &slot->hwe, &slot->exc_het);
+        slot->key = key;
+    }
+    *p_hwe     = slot->hwe;
+    *p_exc_het = slot->exc_het;
+}
+
 static inline void set_counts(pop_t *pop, int is_half, int is_hom, int is_hemi, kbitset_t *bset)
 {
     kbitset_iter_t itr;
@@ -580,6 +630,19 @@ static void clean_counts(pop_t *pop, int nals)
 {
     pop->ns = 0;
     memset(pop->counts,0,sizeof(counts_t)*nals);
+    memset(pop->hist,0,sizeof(pop->hist));
+}
+static void hist_to_counts(pop_t *pop, int nals)
+{
+    int i;
+    for (i=0; i<GT_NCLASS; i++) pop->ns += pop->hist[i];
+    for (i=0; i<nals; i++)
+    {
+        pop->counts[i].nhom  = 2*pop->hist[GT_HOM0+i];
+        pop->counts[i].nhet  = pop->hist[GT_HET];
+        pop->counts[i].nhemi = pop->hist[GT_HEMI0+i];
+        pop->counts[i].nac   = pop->hist[GT_HALF0+i];
+    }
 }
 
 bcf1_t *process_fmt(bcf1_t *rec)
@@ -606,6 +669,28 @@ bcf1_t *process_fmt(bcf1_t *rec)
 
     if ( kbs_resize(&args->bset, rec->n_allele) < 0 ) error("kbs_resize: failed to store %d bits\n", rec->n_allele);
 
+    // Haploid and diploid biallelic sites, by far the most common case: classify
+    // each genotype once and increment only a small per-population histogram,
+    // the allele counts are derived from it afterwards
+    #define BRANCH_BIALLELIC(type_t,vector_end) \
+    { \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            type_t *p = (type_t*) (fmt_gt->p + i*fmt_gt->size); \
+            if ( p[0]==vector_end ) continue; /* missing genotype */ \
+            int cls, a = bcf_gt_is_missing(p[0]) ? -1 : bcf_gt_allele(p[0]); \
+            int b = fmt_gt->n < 2 || p[1]==vector_end ? -2 : (bcf_gt_is_missing(p[1]) ? -1 : bcf_gt_allele(p[1])); \
+            if ( a >= rec->n_allele || b >= rec->n_allele ) \
+                error("Incorrect allele (\"%d\") in %s at %s:%"PRId64"\n",a > b ? a : b,args->in_hdr->samples[i],bcf_seqname(args->in_hdr,rec),(int64_t) rec->pos+1); \
+            if ( a<0 && b<0 ) continue; /* missing genotype */ \
+            if ( b==-2 ) cls = GT_HEMI0 + a; \
+            else if ( a<0 || b<0 ) cls = (a<0 ? b : a) + (args->drop_missing ? GT_HALF0 : GT_HEMI0); \
+            else if ( a!=b ) cls = GT_HET; \
+            else cls = GT_HOM0 + a; \
+            pop_t **pop = &args->smpl2pop[i*(args->npop+1)]; \
+            while ( *pop ) { (*pop)->hist[cls]++; pop++; } \
+        } \
+    }
     #define BRANCH_INT(type_t,vector_end) \
     { \
         for (i=0; i<nsmpl; i++) \
@@ -638,12 +723,27 @@ bcf1_t *process_fmt(bcf1_t *rec)
             while ( *pop ) { set_counts(*pop,is_half,is_hom,is_hemi,args->bset); pop++; } \
         } \
     }
-    switch (fmt_gt->type) {
-        case BCF_BT_INT8:  BRANCH_INT(int8_t,  bcf_int8_vector_end); break;
-        case BCF_BT_INT16: BRANCH_INT(int16_t, bcf_int16_vector_end); break;
-        case BCF_BT_INT32: BRANCH_INT(int32_t, bcf_int32_vector_end); break;
-        default: error("The GT type is not recognised: %d at %s:%"PRId64"\n",fmt_gt->type, bcf_seqname(args->in_hdr,rec),(int64_t) rec->pos+1); break;
+    if ( rec->n_allele <= 2 && fmt_gt->n <= 2 )
+    {
+        switch (fmt_gt->type) {
+            case BCF_BT_INT8:  BRANCH_BIALLELIC(int8_t,  bcf_int8_vector_end); break;
+            case BCF_BT_INT16: BRANCH_BIALLELIC(int16_t, bcf_int16_vector_end); break;
+            case BCF_BT_INT32: BRANCH_BIALLELIC(int32_t, bcf_int32_vector_end); break;
+            default: error("The GT type is not recognised: %d at %s:%"PRId64"\n",fmt_gt->type, bcf_seqname(args->in_hdr,rec),(int64_t) rec->pos+1); break;
+        }
+        for (i=0; i<args->npop; i++)
+            hist_to_counts(&args->pop[i], rec->n_allele);
     }
+    else
+    {
+        switch (fmt_gt->type) {
+            case BCF_BT_INT8:  BRANCH_INT(int8_t,  bcf_int8_vector_end); break;
+            case BCF_BT_INT16: BRANCH_INT(int16_t, bcf_int16_vector_end); break;
+            case BCF_BT_INT32: BRANCH_INT(int32_t, bcf_int32_vector_end); break;
+            default: error("The GT type is not recognised: %d at %s:%"PRId64"\n",fmt_gt->type, bcf_seqname(args->in_hdr,rec),(int64_t) rec->pos+1); break;
+        }
+    }
+    #undef BRANCH_BIALLELIC
     #undef BRANCH_INT
 
     if ( args->tags & SET_NS )
@@ -796,7 +896,7 @@ bcf1_t *process_fmt(bcf1_t *rec)
                     int nalt = pop->counts[j].nhet + pop->counts[j].nhom;
                     int nhet = pop->counts[j].nhet;
                     if ( nref>0 && nalt>0 )
-                        calc_hwe(args, nref, nalt, nhet, &fhwe[j-1], &fexc_het[j-1]);
+                        calc_hwe_cached(args, nref, nalt, nhet, &fhwe[j-1], &fexc_het[j-1]);
                     else
                         fhwe[j-1] = fexc_het[j-1] = 1;
                 }
@@ -852,6 +952,22 @@ bcf1_t *process(bcf1_t *rec)
     return rec;
 }
 
+/*
+    All records are modified in place, a block of records is processed in one
+    call without the per-record dispatch of process()
+*/
+int batch_api_version(void)
+{
+    return BCFTOOLS_PLUGIN_BATCH_API;
+}
+
+int process_batch(bcf1_t **rec, int nrec, bcf1_t **out)
+{
+    int i;
+    for (i=0; i<nrec; i++) out[i] = process(rec[i]);
+    return nrec;
+}
+
 void destroy(void)
 {
     int i; 
@@ -869,6 +985,7 @@ void destroy(void)
     free(args->iarr);
     free(args->farr);
     free(args->hwe_probs);
+    free(args->hwe_cache);
     ftf_destroy(args);
     free(args);
 }
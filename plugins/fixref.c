@@ -73,7 +73,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <unistd.h>
 #include <assert.h>
 #include <getopt.h>
 #include <math.h>
@@ -83,10 +86,10 @@
 #include <htslib/kstring.h>
 #include <htslib/kseq.h>
 #include <htslib/kfunc.h>
-#include <htslib/faidx.h>
 #include <htslib/khash.h>
 #include <htslib/synced_bcf_reader.h>
 #include "bcftools.h"
+#include "refseq.h"
 
 #define MODE_STATS    1
 #define MODE_TOP2FWD  2
@@ -104,12 +107,25 @@ marker_t;
 KHASH_MAP_INIT_INT(i2m, marker_t)
 typedef khash_t(i2m) i2m_t;
 
+// The records are usually sorted, the reference is fetched in windows
+// rather than a base at a time, with the flanks needed by sequence walking
+#define REF_WIN_SIZE 65536
+#define REF_WIN_FLANK 100
+
+// Binary cache of the -i file: the header followed by blocks of
+//      uint32 name_len, char name[name_len], uint32 nrec, nrec x {uint32 id, uint32 pos, uint8 ref}
+// in the native byte order. A block is usually one chromosome
+#define ID_CACHE_MAGIC "FIXREFID"
+#define ID_CACHE_VERSION 1
+#define ID_CACHE_REC_SIZE 9
+
 typedef struct
 {
-    char *dbsnp_fname;
+    char *dbsnp_fname, *id_cache_fname;
+    FILE *id_cache;
     int mode, discard;
     bcf_hdr_t *hdr;
-    faidx_t *fai;
+    refseq_t *ref;
     int rid, skip_rid;
     i2m_t *i2m;
     int32_t *gts, ngts, pos;
@@ -155,6 +171,7 @@ const char *usage(void)
         "   -i, --use-id <file.vcf>     Swap REF/ALT using the ID column to determine the REF allele, implies -m id.\n"
         "                               Download the dbSNP file from\n"
         "                                   https://www.ncbi.nlm.nih.gov/variation/docs/human_variation_vcf\n"
+        "       --id-cache <file>       Binary cache of the -i file for fast repeated runs, created from -i if it does not exist, implies -m id\n"
         "   -m, --mode <string>         Collect stats (\"stats\") or convert (\"flip\", \"id\", \"ref-alt\", \"top\") [stats]\n"
         "\n"
         "Examples:\n"
@@ -167,11 +184,120 @@ const char *usage(void)
         "   # match the REF/ALT alleles based on the ID column, discard unknown sites\n"
         "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -i All_20151104.vcf.gz\n"
         "\n"
+        "   # same as above, but parse the large dbSNP file only once and reuse the cache in subsequent runs\n"
+        "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -i All_20151104.vcf.gz --id-cache All_20151104.bin\n"
+        "\n"
         "   # assuming the reference build is correct, just flip to fwd, discarding the rest\n"
         "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -m flip\n"
         "\n";
 }
 
+static inline int nt2int(char nt)
+{
+    nt = toupper(nt);
+    if ( nt=='A' ) return 0;
+    if ( nt=='C' ) return 1;
+    if ( nt=='G' ) return 2;
+    if ( nt=='T' ) return 3;
+    return -1;
+}
+#define int2nt(x) "ACGT"[x]
+#define revint(x) ("3210"[x]-'0')
+
+static inline uint32_t parse_rsid(char *name)
+{
+    if ( name[0]!='r' || name[1]!='s' ) 
+    {
+        name = strstr(name, "rs");
+        if ( !name ) return 0;
+    }
+    char *tmp;
+    name += 2;
+    uint64_t id = strtol(name, &tmp, 10);
+    if ( tmp==name || *tmp ) return 0;
+    if ( id > UINT32_MAX ) error("FIXME: the ID is too big for uint32_t: %s\n", name-2);
+    return id;
+}
+
+static void id_cache_write(FILE *fp, const void *ptr, size_t size, const char *fname)
+{
+    if ( fwrite(ptr, size, 1, fp)!=1 ) error("Failed to write to %s\n", fname);
+}
+
+static void id_cache_end_block(args_t *args, FILE *fp, long offset, uint32_t nrec)
+{
+    if ( offset<0 ) return;
+    long cur = ftell(fp);
+    if ( cur<0 || fseek(fp, offset, SEEK_SET)!=0 ) error("Failed to seek in %s\n", args->id_cache_fname);
+    id_cache_write(fp, &nrec, sizeof(nrec), args->id_cache_fname);
+    if ( fseek(fp, cur, SEEK_SET)!=0 ) error("Failed to seek in %s\n", args->id_cache_fname);
+}
+
+// Stream the whole -i file once and write the biallelic SNPs with a valid rsID
+static void id_cache_build(args_t *args)
+{
+    if ( !args->dbsnp_fname ) error("The file %s does not exist, use -i/--use-id to create it\n", args->id_cache_fname);
+    FILE *fp = fopen(args->id_cache_fname, "wb");
+    if ( !fp ) error("Failed to open %s: %s\n", args->id_cache_fname, strerror(errno));
+    uint32_t version = ID_CACHE_VERSION;
+    id_cache_write(fp, ID_CACHE_MAGIC, strlen(ID_CACHE_MAGIC), args->id_cache_fname);
+    id_cache_write(fp, &version, sizeof(version), args->id_cache_fname);
+
+    bcf_srs_t *sr = bcf_sr_init();
+    if ( !bcf_sr_add_reader(sr,args->dbsnp_fname) ) error("Failed to open %s: %s\n", args->dbsnp_fname,bcf_sr_strerror(sr->errnum));
+    bcf_hdr_t *hdr = bcf_sr_get_header(sr, 0);
+    int rid = -1;
+    long offset = -1;   // where the record count of the current block is stored
+    uint32_t nrec = 0;
+    while ( bcf_sr_next_line(sr) )
+    {
+        bcf1_t *rec = bcf_sr_get_line(sr, 0);
+        if ( rec->n_allele < 2 ) continue;
+        if ( rec->d.allele[0][1]!=0 || rec->d.allele[1][1]!=0 ) continue;   // skip non-snps
+
+        int ref = nt2int(rec->d.allele[0][0]);
+        if ( ref<0 ) continue;     // non-[ACGT] base
+
+        uint32_t id = parse_rsid(rec->d.id);
+        if ( !id ) continue;
+
+        if ( rid!=rec->rid )
+        {
+            id_cache_end_block(args, fp, offset, nrec);
+            const char *chr = bcf_seqname(hdr, rec);
+            uint32_t len = strlen(chr);
+            id_cache_write(fp, &len, sizeof(len), args->id_cache_fname);
+            id_cache_write(fp, chr, len, args->id_cache_fname);
+            offset = ftell(fp);
+            nrec = 0;
+            id_cache_write(fp, &nrec, sizeof(nrec), args->id_cache_fname);
+            rid = rec->rid;
+        }
+        uint8_t buf[ID_CACHE_REC_SIZE];
+        uint32_t pos = rec->pos;
+        memcpy(buf, &id, 4);
+        memcpy(buf+4, &pos, 4);
+        buf[8] = ref;
+        id_cache_write(fp, buf, ID_CACHE_REC_SIZE, args->id_cache_fname);
+        nrec++;
+    }
+    id_cache_end_block(args, fp, offset, nrec);
+    bcf_sr_destroy(sr);
+    if ( fclose(fp)!=0 ) error("Failed to close %s\n", args->id_cache_fname);
+}
+
+static void id_cache_open(args_t *args)
+{
+    args->id_cache = fopen(args->id_cache_fname, "rb");
+    if ( !args->id_cache ) error("Failed to open %s: %s\n", args->id_cache_fname, strerror(errno));
+    char magic[sizeof(ID_CACHE_MAGIC)];
+    uint32_t version;
+    if ( fread(magic, strlen(ID_CACHE_MAGIC), 1, args->id_cache)!=1 || memcmp(magic, ID_CACHE_MAGIC, strlen(ID_CACHE_MAGIC)) )
+        error("The file %s is not a fixref ID cache\n", args->id_cache_fname);
+    if ( fread(&version, sizeof(version), 1, args->id_cache)!=1 || version!=ID_CACHE_VERSION )
+        error("Unsupported version of the ID cache %s, please recreate it\n", args->id_cache_fname);
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     memset(&args,0,sizeof(args_t));
@@ -185,6 +311,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         {"discard",no_argument,NULL,'d'},
         {"fasta-ref",required_argument,NULL,'f'},
         {"use-id",required_argument,NULL,'i'},
+        {"id-cache",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
     int c;
@@ -201,6 +328,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
                 else error("The source strand convention not recognised: %s\n", optarg);
                 break;
             case 'i': args.dbsnp_fname = optarg; args.mode = MODE_USE_ID; break;
+            case  1 : args.id_cache_fname = optarg; args.mode = MODE_USE_ID; break;
             case 'd': args.discard = 1; break;
             case 'f': ref_fname = optarg; break;
             case 'h':
@@ -209,8 +337,15 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
     }
     if ( !ref_fname ) error("Expected the -f option\n");
-    args.fai = fai_load(ref_fname);
-    if ( !args.fai ) error("Failed to load the fai index: %s\n", ref_fname);
+    args.ref = refseq_init(ref_fname);
+    if ( !args.ref ) error("Failed to load the fai index: %s\n", ref_fname);
+    refseq_set_window(args.ref, REF_WIN_SIZE, REF_WIN_FLANK);
+
+    if ( args.id_cache_fname )
+    {
+        if ( access(args.id_cache_fname, F_OK)!=0 ) id_cache_build(&args);
+        id_cache_open(&args);
+    }
 
     if ( args.mode==MODE_STATS ) return 1;
     return 0;
@@ -245,57 +380,81 @@ static bcf1_t *set_ref_alt(args_t *args, bcf1_t *rec, const char ref, const char
     return rec;
 }
 
-static inline int nt2int(char nt)
+// Returns pointer to the reference sequence [beg,end] or NULL if not available
+// in full, the buffer is valid until the next call
+static const char *fetch_ref_win(args_t *args, bcf1_t *rec, int beg, int end)
 {
-    nt = toupper(nt);
-    if ( nt=='A' ) return 0;
-    if ( nt=='C' ) return 1;
-    if ( nt=='G' ) return 2;
-    if ( nt=='T' ) return 3;
-    return -1;
+    hts_pos_t len;
+    const char *seq = refseq_fetch(args->ref, bcf_seqname(args->hdr,rec), beg, end, &len);
+    if ( !seq || len < end - beg + 1 ) return NULL;  // beyond the end of the sequence
+    return seq;
 }
-#define int2nt(x) "ACGT"[x]
-#define revint(x) ("3210"[x]-'0')
 
-static inline uint32_t parse_rsid(char *name)
+static int fetch_ref(args_t *args, bcf1_t *rec)
 {
-    if ( name[0]!='r' || name[1]!='s' ) 
+    const char *ref = fetch_ref_win(args, rec, rec->pos, rec->pos);
+    if ( ref ) return nt2int(*ref);
+
+    if ( refseq_seq_len(args->ref, bcf_seqname(args->hdr,rec)) < 0 )
     {
-        name = strstr(name, "rs");
-        if ( !name ) return 0;
+        fprintf(stderr,"Ignoring sequence \"%s\"\n", bcf_seqname(args->hdr,rec));
+        args->skip_rid = rec->rid;
+        return -2;
     }
-    char *tmp;
-    name += 2;
-    uint64_t id = strtol(name, &tmp, 10);
-    if ( tmp==name || *tmp ) return 0;
-    if ( id > UINT32_MAX ) error("FIXME: the ID is too big for uint32_t: %s\n", name-2);
-    return id;
+    error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
 }
 
-static int fetch_ref(args_t *args, bcf1_t *rec)
+static inline void dbsnp_add(args_t *args, uint32_t id, uint32_t pos, int ref)
 {
-    // Get the reference allele
-    int len;
-    char *ref = faidx_fetch_seq(args->fai, (char*)bcf_seqname(args->hdr,rec), rec->pos, rec->pos, &len);
-    if ( !ref )
+    int ret, k;
+    k = kh_put(i2m, args->i2m, id, &ret);
+    if ( ret<0 ) error("An error occurred while inserting the key %u\n", id);
+    if ( ret==0 ) return;   // skip ambiguous id
+    kh_val(args->i2m, k).pos = pos;
+    kh_val(args->i2m, k).ref = ref;
+}
+
+// Load all blocks of the chromosome from the binary cache, skipping the rest
+static void dbsnp_init_cached(args_t *args, const char *chr)
+{
+    FILE *fp = args->id_cache;
+    if ( fseek(fp, strlen(ID_CACHE_MAGIC) + sizeof(uint32_t), SEEK_SET)!=0 ) error("Failed to seek in %s\n", args->id_cache_fname);
+    kstring_t name = {0,0,0};
+    uint8_t *buf = NULL;
+    size_t mbuf = 0;
+    uint32_t len, nrec, i;
+    while ( fread(&len, sizeof(len), 1, fp)==1 )
     {
-        if ( faidx_has_seq(args->fai, bcf_seqname(args->hdr,rec))==0 )
+        name.l = 0;
+        ks_resize(&name, len+1);
+        if ( fread(name.s, 1, len, fp)!=len || fread(&nrec, sizeof(nrec), 1, fp)!=1 ) error("Failed to read %s\n", args->id_cache_fname);
+        name.s[len] = 0;
+        size_t size = (size_t)nrec * ID_CACHE_REC_SIZE;
+        if ( strcmp(name.s, chr) )
+        {
+            if ( fseek(fp, size, SEEK_CUR)!=0 ) error("Failed to seek in %s\n", args->id_cache_fname);
+            continue;
+        }
+        if ( mbuf < size ) { mbuf = size; buf = (uint8_t*) realloc(buf, mbuf); }
+        if ( size && fread(buf, size, 1, fp)!=1 ) error("Failed to read %s\n", args->id_cache_fname);
+        for (i=0; i<nrec; i++)
         {
-            fprintf(stderr,"Ignoring sequence \"%s\"\n", bcf_seqname(args->hdr,rec));
-            args->skip_rid = rec->rid;
-            return -2;
+            uint32_t id, pos;
+            uint8_t *ptr = buf + (size_t)i*ID_CACHE_REC_SIZE;
+            memcpy(&id, ptr, 4);
+            memcpy(&pos, ptr+4, 4);
+            dbsnp_add(args, id, pos, ptr[8]);
         }
-        error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1);
     }
-    int ir = nt2int(*ref);
-    free(ref);
-    return ir;
+    free(buf);
+    free(name.s);
 }
 
 static void dbsnp_init(args_t *args, const char *chr)
 {
     if ( args->i2m ) kh_destroy(i2m, args->i2m);
     args->i2m = kh_init(i2m);
+    if ( args->id_cache ) { dbsnp_init_cached(args, chr); return; }
     bcf_srs_t *sr = bcf_sr_init();
     if ( bcf_sr_set_regions(sr, chr, 0) != 0 ) goto done;
     if ( !args->dbsnp_fname ) error("No ID file specified, use -i/--use-id\n");
@@ -311,12 +470,7 @@ static void dbsnp_init(args_t *args, const char *chr)
         uint32_t id = parse_rsid(rec->d.id);
         if ( !id ) continue;
 
-        int ret, k;
-        k = kh_put(i2m, args->i2m, id, &ret);
-        if ( ret<0 ) error("An error occurred while inserting the key %u\n", id);
-        if ( ret==0 ) continue; // skip ambiguous id
-        kh_val(args->i2m, k).pos = (uint32_t)rec->pos;
-        kh_val(args->i2m, k).ref = ref;
+        dbsnp_add(args, id, (uint32_t)rec->pos, ref);
     }
 done:
     bcf_sr_destroy(sr);
@@ -474,10 +628,9 @@ bcf1_t *process(bcf1_t *rec)
         }
         else    // ambiguous pair, sequence walking must be performed
         {
-            int len, win = rec->pos > 100 ? 100 : rec->pos, beg = rec->pos - win, end = rec->pos + win;
-            char *ref = faidx_fetch_seq(args.fai, (char*)bcf_seqname(args.hdr,rec), beg,end, &len);
+            int win = rec->pos > 100 ? 100 : rec->pos, beg = rec->pos - win, end = rec->pos + win;
+            const char *ref = fetch_ref_win(&args, rec, beg, end);
             if ( !ref ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_seqname(args.hdr,rec),(int64_t) rec->pos+1);
-            if ( end - beg + 1 != len ) error("FIXME: check win=%d,len=%d at %s:%"PRId64"  (%d %d)\n", win,len, bcf_seqname(args.hdr,rec),(int64_t) rec->pos+1, end,beg);
 
             int i, mid = rec->pos - beg, strand = 0;
             for (i=1; i<=win; i++)
@@ -490,7 +643,6 @@ bcf1_t *process(bcf1_t *rec)
                 strand = 1 << ra & 0x9 ? 1 : -1;
                 break;
             }
-            free(ref);
             
             if ( strand==1 )
             {
@@ -586,6 +738,7 @@ void destroy(void)
     fprintf(stderr,"NS\tnon-biallelic\t%u\n", args.nonbiallelic);
 
     free(args.gts);
-    if ( args.fai ) fai_destroy(args.fai);
+    if ( args.ref ) refseq_destroy(args.ref);
     if ( args.i2m ) kh_destroy(i2m, args.i2m);
+    if ( args.id_cache ) fclose(args.id_cache);
 }
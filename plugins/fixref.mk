@@ -0,0 +1,2 @@
+plugins/fixref.so: plugins/fixref.c version.h version.c refseq.h refseq.c
+	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(ALL_CPPFLAGS) $(EXTRA_CPPFLAGS) $(LDFLAGS) -o $@ refseq.c version.c $< $(PLUGIN_LIBS) $(LIBS)
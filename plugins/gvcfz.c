@@ -39,6 +39,7 @@
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
 
@@ -53,7 +54,7 @@ typedef struct
 {
     int32_t end, min_dp, gq, pl[3], grp;
     char *gq_key;
-    bcf1_t *rec;
+    bcf1_t *rec;    // the first record of the block, owned by the block and taken over from the reader without copying
 }
 block_t;
 typedef struct
@@ -63,24 +64,40 @@ typedef struct
     filter_t *flt;  // filter
 }
 grp_t;
+
+// The state of a single gVCF file being compressed. With --file-list many
+// files are processed concurrently, each by one worker thread
 typedef struct
 {
     filter_t *filter;
-    char *filter_str;
-    int filter_logic;
     block_t gvcf;
     htsFile *fh_out;
     int ngrp;
     grp_t *grp;
-    char *group_by;
-    int argc, region_is_file, target_is_file, output_type, trim_alts;
-    int32_t *tmpi, mtmpi, mean_min_dp_reported;
-    char **argv, *region, *target, *fname, *output_fname, *keep_tags;
+    int32_t *tmpi, mtmpi;
+    char *fname, *output_fname;
     bcf_hdr_t *hdr_in, *hdr_out;
     bcf_srs_t *sr;
 }
+gvcf_file_t;
+
+typedef struct
+{
+    char *filter_str;
+    int filter_logic;
+    char *group_by;
+    int argc, region_is_file, target_is_file, output_type, trim_alts, n_threads;
+    char **argv, *region, *target, *fname, *output_fname, *keep_tags, *file_list;
+}
 args_t;
 
+typedef struct
+{
+    args_t *args;
+    char *fname, *output_fname;
+}
+gvcfz_job_t;
+
 const char *about(void)
 {
     return "Compress gVCF file by resizing gVCF blocks according to specified criteria.\n";
@@ -98,21 +115,26 @@ static const char *usage_text(void)
         "   -e, --exclude <expr>            exclude sites for which the expression is true\n"
         "   -i, --include <expr>            include sites for which the expression is true\n"
         "   -g, --group-by EXPR             group gVCF blocks according to the expression\n"
+        "   -l, --file-list FILE            compress many gVCFs, FILE lists the input and output file names, two per line\n"
         "   -o, --output FILE               write gVCF output to the FILE\n"
         "   -O, --output-type b|u|z|v       b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n"
+        "       --threads INT               with -l, compress INT files in parallel [0]\n"
         "Examples:\n"
         "   # Compress blocks by GQ and DP. Multiple blocks separated by a semicolon can be defined\n"
         "   bcftools +gvcfz input.bcf -g'PASS:GQ>60 & DP<20; PASS:GQ>40 & DP<15; Flt1:QG>20; Flt2:-'\n"
         "\n"
         "   # Compress all non-reference sites into a single block, remove unused alternate alleles\n"
         "   bcftools +gvcfz input.bcf -a -g'PASS:GT!=\"alt\"'\n"
+        "\n"
+        "   # Compress many files using 16 threads, each line of the list is \"input.g.vcf.gz output.bcf\"\n"
+        "   bcftools +gvcfz -l list.txt --threads 16 -Ob -g'PASS:GT!=\"alt\"'\n"
         "\n";
 }
 
-static void init_groups(args_t *args)
+static void init_groups(args_t *args, gvcf_file_t *file)
 {
-    args->hdr_out = bcf_hdr_dup(args->hdr_in);
-    bcf_hdr_printf(args->hdr_out, "##INFO=<ID=END,Number=1,Type=Integer,Description=\"Stop position of the interval\">");
+    file->hdr_out = bcf_hdr_dup(file->hdr_in);
+    bcf_hdr_printf(file->hdr_out, "##INFO=<ID=END,Number=1,Type=Integer,Description=\"Stop position of the interval\">");
 
     // avoid nested double quotes in FILTER description
     char *hdr_str = strdup(args->group_by);
@@ -138,23 +160,23 @@ static void init_groups(args_t *args)
         char tmp = *end; *end = 0;
         if ( strcmp(flt,"PASS") ) 
         {
-            bcf_hdr_printf(args->hdr_out, "##FILTER=<ID=%s,Description=\"%s\">", flt, hdr_str);
-            if (bcf_hdr_sync(args->hdr_out) < 0)
+            bcf_hdr_printf(file->hdr_out, "##FILTER=<ID=%s,Description=\"%s\">", flt, hdr_str);
+            if (bcf_hdr_sync(file->hdr_out) < 0)
                 error_errno("[%s] Failed to update header", __func__);
         }
-        args->ngrp++;
-        args->grp = (grp_t*) realloc(args->grp,sizeof(grp_t)*args->ngrp);
-        grp_t *grp = args->grp + args->ngrp - 1;
+        file->ngrp++;
+        file->grp = (grp_t*) realloc(file->grp,sizeof(grp_t)*file->ngrp);
+        grp_t *grp = file->grp + file->ngrp - 1;
         grp->expr = strdup(beg);
-        grp->flt_id = bcf_hdr_id2int(args->hdr_out, BCF_DT_ID, flt);
-        if ( !bcf_hdr_idinfo_exists(args->hdr_out, BCF_HL_FLT, grp->flt_id) ) error("Could not initialize the filter \"%s\"\n", flt);
+        grp->flt_id = bcf_hdr_id2int(file->hdr_out, BCF_DT_ID, flt);
+        if ( !bcf_hdr_idinfo_exists(file->hdr_out, BCF_HL_FLT, grp->flt_id) ) error("Could not initialize the filter \"%s\"\n", flt);
         if ( !strcmp(flt,"PASS") ) grp->flt_id = -1;
 
         // remove trailing spaces
         beg = grp->expr + strlen(grp->expr); while ( beg >= grp->expr && isspace(*beg) ) { *beg = 0; beg--; }
         beg = grp->expr; while ( *beg && isspace(*beg) ) beg++;
 
-        grp->flt = strcmp("-",beg) ? filter_init(args->hdr_in, grp->expr) : NULL;
+        grp->flt = strcmp("-",beg) ? filter_init(file->hdr_in, grp->expr) : NULL;
 
         if ( !tmp ) break;
         beg = end + 1;
@@ -163,60 +185,59 @@ static void init_groups(args_t *args)
     free(hdr_str);
 }
 
-static void destroy_data(args_t *args)
+static void destroy_file(gvcf_file_t *file)
 {
     int i;
-    for (i=0; i<args->ngrp; i++)
+    for (i=0; i<file->ngrp; i++)
     {
-        if ( args->grp[i].flt ) filter_destroy(args->grp[i].flt);
-        free(args->grp[i].expr);
+        if ( file->grp[i].flt ) filter_destroy(file->grp[i].flt);
+        free(file->grp[i].expr);
     }
-    free(args->grp);
+    free(file->grp);
 
-    if ( args->filter ) filter_destroy(args->filter);
-    if ( hts_close(args->fh_out)!=0 ) error("failed to close %s\n", args->output_fname);
+    if ( file->filter ) filter_destroy(file->filter);
+    if ( hts_close(file->fh_out)!=0 ) error("failed to close %s\n", file->output_fname);
 
-    bcf_sr_destroy(args->sr);
-    if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
-    if ( args->gvcf.rec ) bcf_destroy(args->gvcf.rec);
-    free(args->tmpi);
-    free(args);
+    bcf_sr_destroy(file->sr);
+    if ( file->hdr_out ) bcf_hdr_destroy(file->hdr_out);
+    if ( file->gvcf.rec ) bcf_destroy(file->gvcf.rec);
+    free(file->tmpi);
 }
 
-static void flush_block(args_t *args, bcf1_t *rec)
+static void flush_block(gvcf_file_t *file, bcf1_t *rec)
 {
-    block_t *gvcf = &args->gvcf;
+    block_t *gvcf = &file->gvcf;
     if ( gvcf->grp < 0 ) return;
     if ( rec && gvcf->end - 1 >= rec->pos ) gvcf->end = rec->pos; // NB: end is 1-based, rec->pos is 0-based
 
-    if ( gvcf->rec->pos+1 < gvcf->end && bcf_update_info_int32(args->hdr_out,gvcf->rec,"END",&gvcf->end,1) != 0 )
-        error("Could not update INFO/END at %s:%"PRId64"\n", bcf_seqname(args->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
-    if ( bcf_update_format_int32(args->hdr_out,gvcf->rec,"DP",&gvcf->min_dp,1) != 0 )
-        error("Could not update FORMAT/DP at %s:%"PRId64"\n", bcf_seqname(args->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
+    if ( gvcf->rec->pos+1 < gvcf->end && bcf_update_info_int32(file->hdr_out,gvcf->rec,"END",&gvcf->end,1) != 0 )
+        error("Could not update INFO/END at %s:%"PRId64"\n", bcf_seqname(file->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
+    if ( bcf_update_format_int32(file->hdr_out,gvcf->rec,"DP",&gvcf->min_dp,1) != 0 )
+        error("Could not update FORMAT/DP at %s:%"PRId64"\n", bcf_seqname(file->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
     if ( gvcf->gq_key )
     {
-        if ( bcf_update_format_int32(args->hdr_out,gvcf->rec,gvcf->gq_key,&gvcf->gq,1) != 0 )
-            error("Could not update FORMAT/%s at %s:%"PRId64"\n", gvcf->gq_key, bcf_seqname(args->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
+        if ( bcf_update_format_int32(file->hdr_out,gvcf->rec,gvcf->gq_key,&gvcf->gq,1) != 0 )
+            error("Could not update FORMAT/%s at %s:%"PRId64"\n", gvcf->gq_key, bcf_seqname(file->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
     }
     if ( gvcf->pl[0] >=0 )
     {
-        if ( bcf_update_format_int32(args->hdr_out,gvcf->rec,"PL",&gvcf->pl,3) != 0 )
-            error("Could not update FORMAT/PL at %s:%"PRId64"\n", bcf_seqname(args->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
+        if ( bcf_update_format_int32(file->hdr_out,gvcf->rec,"PL",&gvcf->pl,3) != 0 )
+            error("Could not update FORMAT/PL at %s:%"PRId64"\n", bcf_seqname(file->hdr_out,gvcf->rec),(int64_t) gvcf->rec->pos+1);
     }
-    if ( gvcf->grp < args->ngrp && args->grp[gvcf->grp].flt_id >= 0 ) 
-        bcf_add_filter(args->hdr_out, gvcf->rec, args->grp[gvcf->grp].flt_id);
+    if ( gvcf->grp < file->ngrp && file->grp[gvcf->grp].flt_id >= 0 ) 
+        bcf_add_filter(file->hdr_out, gvcf->rec, file->grp[gvcf->grp].flt_id);
 
-    if ( bcf_write(args->fh_out, args->hdr_out, gvcf->rec)!=0 ) error("Failed to write the header\n");
+    if ( bcf_write(file->fh_out, file->hdr_out, gvcf->rec)!=0 ) error("Failed to write to %s\n", file->output_fname);
 
     gvcf->grp = -1;
 }
-static void process_gvcf(args_t *args)
+static void process_gvcf(args_t *args, gvcf_file_t *file)
 {
-    bcf1_t *rec = bcf_sr_get_line(args->sr,0);
+    bcf1_t *rec = bcf_sr_get_line(file->sr,0);
 
-    if ( args->filter )
+    if ( file->filter )
     {
-        int pass = filter_test(args->filter, rec, NULL);
+        int pass = filter_test(file->filter, rec, NULL);
         if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
         if ( !pass ) return;
     }
@@ -226,85 +247,164 @@ static void process_gvcf(args_t *args)
         if ( args->trim_alts )
         {
             bcf_unpack(rec, BCF_UN_ALL);
-            if ( bcf_trim_alleles(args->hdr_in, rec)<0 )
-                error("Error: Could not trim alleles at %s:%"PRId64"\n", bcf_seqname(args->hdr_in, rec),(int64_t)  rec->pos+1);
+            if ( bcf_trim_alleles(file->hdr_in, rec)<0 )
+                error("Error: Could not trim alleles at %s:%"PRId64"\n", bcf_seqname(file->hdr_in, rec),(int64_t)  rec->pos+1);
 
             // trim the ref allele if necessary
             if ( rec->d.allele[0][1] )
             {
                 rec->d.allele[0][1] = 0;
-                bcf_update_alleles(args->hdr_in, rec, (const char**)rec->d.allele, 1);
+                bcf_update_alleles(file->hdr_in, rec, (const char**)rec->d.allele, 1);
             }
 
         }
         if ( rec->n_allele > 2 || (rec->n_allele == 2 && strcmp("<NON_REF>",rec->d.allele[1]) && strcmp("<*>",rec->d.allele[1])) )
         {
             // not a gvcf block
-            flush_block(args, rec);
-            if ( bcf_write(args->fh_out, args->hdr_out, rec)!=0 ) error("Failed to write\n");
+            flush_block(file, rec);
+            if ( bcf_write(file->fh_out, file->hdr_out, rec)!=0 ) error("Failed to write to %s\n", file->output_fname);
             return;
         }
     }
 
-    int ret = bcf_get_info_int32(args->hdr_in,rec,"END",&args->tmpi,&args->mtmpi);
-    int32_t end = ret==1 ? args->tmpi[0] : rec->pos + 1;
+    int ret = bcf_get_info_int32(file->hdr_in,rec,"END",&file->tmpi,&file->mtmpi);
+    int32_t end = ret==1 ? file->tmpi[0] : rec->pos + 1;
 
     char *gq_key = GQ_KEY_GQ;
-    ret = bcf_get_format_int32(args->hdr_in,rec,gq_key,&args->tmpi,&args->mtmpi);
+    ret = bcf_get_format_int32(file->hdr_in,rec,gq_key,&file->tmpi,&file->mtmpi);
     if ( ret!=1 )
     {
         gq_key = GQ_KEY_RGQ;
-        if ( ret<1 ) ret = bcf_get_format_int32(args->hdr_in,rec,gq_key,&args->tmpi,&args->mtmpi);
+        if ( ret<1 ) ret = bcf_get_format_int32(file->hdr_in,rec,gq_key,&file->tmpi,&file->mtmpi);
         if ( ret!=1 ) gq_key = GQ_KEY_NONE;
     }
-    int32_t gq = ret==1 ? args->tmpi[0] : 0;
+    int32_t gq = ret==1 ? file->tmpi[0] : 0;
 
     int32_t min_dp = 0;
-    if ( bcf_get_format_int32(args->hdr_in,rec,"MIN_DP",&args->tmpi,&args->mtmpi)==1 )
-        min_dp = args->tmpi[0];
-    else if ( bcf_get_format_int32(args->hdr_in,rec,"DP",&args->tmpi,&args->mtmpi)==1 )
-        min_dp = args->tmpi[0];
+    if ( bcf_get_format_int32(file->hdr_in,rec,"MIN_DP",&file->tmpi,&file->mtmpi)==1 )
+        min_dp = file->tmpi[0];
+    else if ( bcf_get_format_int32(file->hdr_in,rec,"DP",&file->tmpi,&file->mtmpi)==1 )
+        min_dp = file->tmpi[0];
     else
-        error("Expected one FORMAT/MIN_DP or FORMAT/DP value at %s:%"PRId64"\n", bcf_seqname(args->hdr_in,rec),(int64_t) rec->pos+1);
+        error("Expected one FORMAT/MIN_DP or FORMAT/DP value at %s:%"PRId64"\n", bcf_seqname(file->hdr_in,rec),(int64_t) rec->pos+1);
 
     int32_t pl[3] = {-1,-1,-1};
-    ret = bcf_get_format_int32(args->hdr_in,rec,"PL",&args->tmpi,&args->mtmpi);
-    if ( ret>3 ) error("Expected three FORMAT/PL values at %s:%"PRId64"\n", bcf_seqname(args->hdr_in,rec),(int64_t) rec->pos+1);
+    ret = bcf_get_format_int32(file->hdr_in,rec,"PL",&file->tmpi,&file->mtmpi);
+    if ( ret>3 ) error("Expected three FORMAT/PL values at %s:%"PRId64"\n", bcf_seqname(file->hdr_in,rec),(int64_t) rec->pos+1);
     else if ( ret==3 )
     {
-        pl[0] = args->tmpi[0];
-        pl[1] = args->tmpi[1];
-        pl[2] = args->tmpi[2];
+        pl[0] = file->tmpi[0];
+        pl[1] = file->tmpi[1];
+        pl[2] = file->tmpi[2];
     }
 
     int i;
-    for (i=0; i<args->ngrp; i++)
-        if ( !args->grp[i].flt || filter_test(args->grp[i].flt, rec, NULL)==1 ) break;
+    for (i=0; i<file->ngrp; i++)
+        if ( !file->grp[i].flt || filter_test(file->grp[i].flt, rec, NULL)==1 ) break;
 
-    if ( args->gvcf.grp != i ) flush_block(args, rec);      // new block
-    if ( args->gvcf.grp >= 0 && args->gvcf.rec->rid != rec->rid ) flush_block(args, NULL);  // new chromosome
+    if ( file->gvcf.grp != i ) flush_block(file, rec);      // new block
+    if ( file->gvcf.grp >= 0 && file->gvcf.rec->rid != rec->rid ) flush_block(file, NULL);  // new chromosome
 
-    if ( args->gvcf.grp >= 0 ) // extend an existing block
+    if ( file->gvcf.grp >= 0 ) // extend an existing block
     {
-        if ( args->gvcf.end < end ) args->gvcf.end = end;
-        if ( args->gvcf.gq_key!=GQ_KEY_NONE && gq_key!=GQ_KEY_NONE && args->gvcf.gq > gq ) args->gvcf.gq = gq;
-        if ( args->gvcf.min_dp > min_dp ) args->gvcf.min_dp = min_dp;
-        if ( args->gvcf.pl[0] > pl[0] ) args->gvcf.pl[0] = pl[0];
-        if ( args->gvcf.pl[1] > pl[1] ) args->gvcf.pl[1] = pl[1];
-        if ( args->gvcf.pl[2] > pl[2] ) args->gvcf.pl[2] = pl[2];
+        if ( file->gvcf.end < end ) file->gvcf.end = end;
+        if ( file->gvcf.gq_key!=GQ_KEY_NONE && gq_key!=GQ_KEY_NONE && file->gvcf.gq > gq ) file->gvcf.gq = gq;
+        if ( file->gvcf.min_dp > min_dp ) file->gvcf.min_dp = min_dp;
+        if ( file->gvcf.pl[0] > pl[0] ) file->gvcf.pl[0] = pl[0];
+        if ( file->gvcf.pl[1] > pl[1] ) file->gvcf.pl[1] = pl[1];
+        if ( file->gvcf.pl[2] > pl[2] ) file->gvcf.pl[2] = pl[2];
         return;
     }
 
-    // start a new block
-    args->gvcf.rec = bcf_copy(args->gvcf.rec, rec);
-    args->gvcf.grp = i;
-    args->gvcf.min_dp   = min_dp;
-    args->gvcf.end      = end;
-    args->gvcf.pl[0]    = pl[0];
-    args->gvcf.pl[1]    = pl[1];
-    args->gvcf.pl[2]    = pl[2];
-    args->gvcf.gq_key   = gq_key;
-    if ( gq_key!=GQ_KEY_NONE ) args->gvcf.gq = gq;
+    // start a new block: take over the record from the reader, which gets the
+    // already flushed block record in exchange, so that nothing needs to be copied
+    bcf1_t **buf = &file->sr->readers[0].buffer[0];
+    *buf = file->gvcf.rec;
+    file->gvcf.rec = rec;
+    file->gvcf.grp = i;
+    file->gvcf.min_dp   = min_dp;
+    file->gvcf.end      = end;
+    file->gvcf.pl[0]    = pl[0];
+    file->gvcf.pl[1]    = pl[1];
+    file->gvcf.pl[2]    = pl[2];
+    file->gvcf.gq_key   = gq_key;
+    if ( gq_key!=GQ_KEY_NONE ) file->gvcf.gq = gq;
+}
+
+static void process_file(args_t *args, const char *fname, const char *output_fname)
+{
+    gvcf_file_t file;
+    memset(&file, 0, sizeof(file));
+    file.fname = (char*) fname;
+    file.output_fname = (char*) output_fname;
+    file.gvcf.rec = bcf_init();
+    file.gvcf.grp = -1;            // the block is inactive
+    file.sr = bcf_sr_init();
+    if ( !bcf_sr_add_reader(file.sr,fname) ) error("Error: %s: %s\n", bcf_sr_strerror(file.sr->errnum),fname);
+    file.hdr_in = bcf_sr_get_header(file.sr,0);
+    if ( args->filter_str )
+        file.filter = filter_init(file.hdr_in, args->filter_str);
+    init_groups(args, &file);
+    file.fh_out = hts_open(output_fname,hts_bcf_wmode(args->output_type));
+    if ( !file.fh_out ) error("[%s] Error: cannot write to \"%s\": %s\n", __func__, output_fname, strerror(errno));
+    if ( bcf_hdr_write(file.fh_out, file.hdr_out)!=0 ) error("Failed to write the header to %s\n", output_fname);
+    while ( bcf_sr_next_line(file.sr) ) process_gvcf(args, &file);
+    flush_block(&file, NULL);
+    destroy_file(&file);
+}
+
+static void *process_job(void *arg)
+{
+    gvcfz_job_t *job = (gvcfz_job_t*) arg;
+    process_file(job->args, job->fname, job->output_fname);
+    return job;
+}
+
+static void process_file_list(args_t *args)
+{
+    int i, nfiles = 0;
+    char **files = hts_readlines(args->file_list, &nfiles);
+    if ( !files ) error("Failed to read %s\n", args->file_list);
+
+    // two file names per line: the input and the output
+    gvcfz_job_t *jobs = (gvcfz_job_t*) calloc(nfiles, sizeof(gvcfz_job_t));
+    for (i=0; i<nfiles; i++)
+    {
+        char *beg = files[i];
+        while ( *beg && isspace(*beg) ) beg++;
+        char *end = beg;
+        while ( *end && !isspace(*end) ) end++;
+        char *out = end;
+        while ( *out && isspace(*out) ) out++;
+        if ( !*out ) error("Expected two file names per line in %s: %s\n", args->file_list,files[i]);
+        *end = 0;
+        end = out;
+        while ( *end && !isspace(*end) ) end++;
+        *end = 0;
+        jobs[i].args = args;
+        jobs[i].fname = beg;
+        jobs[i].output_fname = out;
+    }
+
+    if ( !args->n_threads )
+    {
+        for (i=0; i<nfiles; i++) process_job(&jobs[i]);
+    }
+    else
+    {
+        hts_tpool *pool = hts_tpool_init(args->n_threads);
+        if ( !pool ) error("Could not initialize threading\n");
+        hts_tpool_process *queue = hts_tpool_process_init(pool, 2*args->n_threads, 1);
+        for (i=0; i<nfiles; i++)
+            if ( hts_tpool_dispatch(pool, queue, process_job, &jobs[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+        hts_tpool_process_flush(queue);
+        hts_tpool_process_destroy(queue);
+        hts_tpool_destroy(pool);
+    }
+
+    for (i=0; i<nfiles; i++) free(files[i]);
+    free(files);
+    free(jobs);
 }
 
 int run(int argc, char **argv)
@@ -319,13 +419,16 @@ int run(int argc, char **argv)
         {"include",required_argument,0,'i'},
         {"exclude",required_argument,0,'e'},
         {"group-by",required_argument,NULL,'g'},
+        {"file-list",required_argument,NULL,'l'},
         {"stats",required_argument,NULL,'s'},
         {"output",required_argument,NULL,'o'},
         {"output-type",required_argument,NULL,'O'},
+        {"threads",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "vr:R:t:T:o:O:g:i:e:a",loptions,NULL)) >= 0)
+    char *tmp;
+    while ((c = getopt_long(argc, argv, "vr:R:t:T:o:O:g:i:e:al:",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
@@ -333,6 +436,7 @@ int run(int argc, char **argv)
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
             case 'g': args->group_by = optarg; break;
+            case 'l': args->file_list = optarg; break;
             case 'o': args->output_fname = optarg; break;
             case 'O':
                       switch (optarg[0]) {
@@ -343,11 +447,26 @@ int run(int argc, char **argv)
                           default: error("The output type \"%s\" not recognised\n", optarg);
                       }
                       break;
+            case  1 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'h':
             case '?':
             default: error("%s", usage_text()); break;
         }
     }
+    if ( !args->group_by ) error("Missing the -g option\n");
+
+    if ( args->file_list )
+    {
+        if ( optind!=argc ) error("%s", usage_text());
+        process_file_list(args);
+        free(args);
+        return 0;
+    }
+    if ( args->n_threads ) error("The --threads option requires -l\n");
+
     if ( optind==argc )
     {
         if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";  // reading from stdin
@@ -356,23 +475,8 @@ int run(int argc, char **argv)
     else if ( optind+1!=argc ) error("%s", usage_text());
     else args->fname = argv[optind];
 
-    if ( !args->group_by ) error("Missing the -g option\n");
+    process_file(args, args->fname, args->output_fname);
 
-    args->gvcf.rec = bcf_init();
-    args->gvcf.grp = -1;            // the block is inactive
-    args->sr = bcf_sr_init();
-    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
-    args->hdr_in = bcf_sr_get_header(args->sr,0);
-    if ( args->filter_str )
-        args->filter = filter_init(args->hdr_in, args->filter_str);
-    init_groups(args);
-    args->fh_out = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
-    if ( bcf_hdr_write(args->fh_out, args->hdr_out)!=0 ) error("Failed to write the header\n");
-    while ( bcf_sr_next_line(args->sr) ) process_gvcf(args);
-    flush_block(args, NULL);
-
-    destroy_data(args);
+    free(args);
     return 0;
 }
-
-
@@ -504,23 +504,23 @@ bcf1_t *process(bcf1_t *rec)
             if ( f==bcf_int32_vector_end ) { warn_ploidy(rec); continue; }
 
             // All M,F,C genotypes are diploid. Missing data are considered consistent.
-            child1 = 1<<bcf_gt_allele(e);
-            child2 = 1<<bcf_gt_allele(f);
-            mother  = bcf_gt_is_missing(a) ? child1|child2 : 1<<bcf_gt_allele(a);
-            mother |= bcf_gt_is_missing(b) || b==bcf_int32_vector_end ? child1|child2 : 1<<bcf_gt_allele(b);
-            father  = bcf_gt_is_missing(c) ? child1|child2 : 1<<bcf_gt_allele(c);
-            father |= bcf_gt_is_missing(d) || d==bcf_int32_vector_end ? child1|child2 : 1<<bcf_gt_allele(d);
+            child1 = 1ULL<<bcf_gt_allele(e);
+            child2 = 1ULL<<bcf_gt_allele(f);
+            mother  = bcf_gt_is_missing(a) ? child1|child2 : 1ULL<<bcf_gt_allele(a);
+            mother |= bcf_gt_is_missing(b) || b==bcf_int32_vector_end ? child1|child2 : 1ULL<<bcf_gt_allele(b);
+            father  = bcf_gt_is_missing(c) ? child1|child2 : 1ULL<<bcf_gt_allele(c);
+            father |= bcf_gt_is_missing(d) || d==bcf_int32_vector_end ? child1|child2 : 1ULL<<bcf_gt_allele(d);
 
             if ( (mother&child1 && father&child2) || (mother&child2 && father&child1) ) is_ok = 1;
         }
         else
         {
-            child1  = 1<<bcf_gt_allele(e);
-            child2  = bcf_gt_is_missing(f) || f==bcf_int32_vector_end ? 0 : 1<<bcf_gt_allele(f);
-            mother |= bcf_gt_is_missing(a) ? 0 : 1<<bcf_gt_allele(a);
-            mother |= bcf_gt_is_missing(b) || b==bcf_int32_vector_end ? 0 : 1<<bcf_gt_allele(b);
-            father |= bcf_gt_is_missing(c) ? 0 : 1<<bcf_gt_allele(c);
-            father |= bcf_gt_is_missing(d) || d==bcf_int32_vector_end ? 0 : 1<<bcf_gt_allele(d);
+            child1  = 1ULL<<bcf_gt_allele(e);
+            child2  = bcf_gt_is_missing(f) || f==bcf_int32_vector_end ? 0 : 1ULL<<bcf_gt_allele(f);
+            mother |= bcf_gt_is_missing(a) ? 0 : 1ULL<<bcf_gt_allele(a);
+            mother |= bcf_gt_is_missing(b) || b==bcf_int32_vector_end ? 0 : 1ULL<<bcf_gt_allele(b);
+            father |= bcf_gt_is_missing(c) ? 0 : 1ULL<<bcf_gt_allele(c);
+            father |= bcf_gt_is_missing(d) || d==bcf_int32_vector_end ? 0 : 1ULL<<bcf_gt_allele(d);
 
             regitr_copy(args.itr, args.itr_ori);
             while ( !is_ok && regitr_overlap(args.itr) )
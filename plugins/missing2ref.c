@@ -29,10 +29,16 @@ DEALINGS IN THE SOFTWARE.  */
 #include <inttypes.h>
 #include <getopt.h>
 
+typedef struct
+{
+    int32_t *gts, mgts;
+    int *arr, marr;
+    uint64_t nchanged;
+}
+ctx_t;
+
 bcf_hdr_t *in_hdr, *out_hdr;
-int32_t *gts = NULL, mgts = 0;
-int *arr = NULL, marr = 0;
-uint64_t nchanged = 0;
+ctx_t global_ctx;   // used by process() when not running in parallel
 int new_gt = bcf_gt_unphased(0);
 int use_major = 0;
 
@@ -86,10 +92,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 0;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static bcf1_t *fill_missing(ctx_t *ctx, bcf1_t *rec)
 {
-    int ngts = bcf_get_genotypes(in_hdr, rec, &gts, &mgts);
+    int ngts = bcf_get_genotypes(in_hdr, rec, &ctx->gts, &ctx->mgts);
     int i, changed = 0;
+    int32_t *gts = ctx->gts;
+    int gt = new_gt;
     
     // Calculating allele frequency for each allele and determining major allele
     // only do this if use_major is true
@@ -97,7 +105,8 @@ bcf1_t *process(bcf1_t *rec)
     int maxAC = -1;
     int an = 0;
     if(use_major == 1){
-        hts_expand(int,rec->n_allele,marr,arr);
+        hts_expand(int,rec->n_allele,ctx->marr,ctx->arr);
+        int *arr = ctx->arr;
         int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
         if(ret > 0){
             for(i=0; i < rec->n_allele; ++i){
@@ -115,9 +124,9 @@ bcf1_t *process(bcf1_t *rec)
 
         // replacing new_gt by major allele
         if(bcf_gt_is_phased(new_gt))
-            new_gt = bcf_gt_phased(majorAllele);
+            gt = bcf_gt_phased(majorAllele);
         else
-            new_gt = bcf_gt_unphased(majorAllele);
+            gt = bcf_gt_unphased(majorAllele);
     }
 
     // replace gts
@@ -125,20 +134,47 @@ bcf1_t *process(bcf1_t *rec)
     {
         if ( gts[i]==bcf_gt_missing )
         {
-            gts[i] = new_gt;
+            gts[i] = gt;
             changed++;
         }
     }
-    nchanged += changed;
+    ctx->nchanged += changed;
     if ( changed ) bcf_update_genotypes(out_hdr, rec, gts, ngts);
     return rec;
 }
 
-void destroy(void)
+bcf1_t *process(bcf1_t *rec)
+{
+    return fill_missing(&global_ctx, rec);
+}
+
+int parallel_safe(void)
+{
+    return 1;
+}
+
+void *init_thread(void)
+{
+    return calloc(1,sizeof(ctx_t));
+}
+
+bcf1_t *process_ctx(void *ctx, bcf1_t *rec)
 {
-    free(arr);
-    fprintf(stderr,"Filled %"PRId64" REF alleles\n", nchanged);
-    free(gts);
+    return fill_missing((ctx_t*)ctx, rec);
 }
 
+void merge_ctx(void *ptr)
+{
+    ctx_t *ctx = (ctx_t*) ptr;
+    global_ctx.nchanged += ctx->nchanged;
+    free(ctx->gts);
+    free(ctx->arr);
+    free(ctx);
+}
 
+void destroy(void)
+{
+    free(global_ctx.arr);
+    fprintf(stderr,"Filled %"PRId64" REF alleles\n", global_ctx.nchanged);
+    free(global_ctx.gts);
+}
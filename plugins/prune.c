@@ -36,9 +36,15 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <errno.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/tbx.h>
+#include <htslib/thread_pool.h>
 #include <assert.h>
 #include "bcftools.h"
 #include "vcfbuf.h"
@@ -61,8 +67,8 @@ typedef struct
     char *ld_annot[VCFBUF_LD_N], *ld_annot_pos[VCFBUF_LD_N];
     int ld_mask;
     int argc, region_is_file, target_is_file, output_type, ld_filter_id, rand_missing, nsites, ld_win;
-    int keep_sites;
-    char **argv, *region, *target, *fname, *output_fname, *ld_filter;
+    int keep_sites, n_threads;
+    char **argv, *region, *target, *fname, *output_fname, *ld_filter, *tmp_dir;
     htsFile *out_fh;
     bcf_hdr_t *hdr;
     bcf_srs_t *sr;
@@ -93,6 +99,7 @@ static const char *usage_text(void)
         "   -o, --output FILE               write output to the FILE [standard output]\n"
         "   -O, --output-type b|u|z|v       b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n"
         "       --randomize-missing         replace missing data with randomly assigned genotype based on site's allele frequency\n"
+        "       --threads INT               process chromosomes in parallel with INT worker threads, requires an indexed file [0]\n"
         "   -r, --regions REGION            restrict to comma-separated list of regions\n"
         "   -R, --regions-file FILE         restrict to regions listed in a file\n"
         "   -t, --targets REGION            similar to -r but streams rather than index-jumps\n"
@@ -116,9 +123,12 @@ static const char *usage_text(void)
         "\n";
 }
 
+static void init_header(args_t *args);
+static void init_prune(args_t *args);
 static void init_data(args_t *args)
 {
     args->sr = bcf_sr_init();
+    if ( args->n_threads ) args->sr->require_index = 1;    // the chromosomes are read via the index
     if ( args->region )
     {
         args->sr->require_index = 1;
@@ -131,6 +141,12 @@ static void init_data(args_t *args)
     args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
 
+    init_header(args);
+    if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    init_prune(args);
+}
+static void init_header(args_t *args)
+{
     if ( args->ld_filter && strcmp(".",args->ld_filter) )
     {
         kstring_t str = {0,0,0};
@@ -175,11 +191,12 @@ static void init_data(args_t *args)
             bcf_hdr_printf(args->hdr,"##INFO=<ID=%s,Number=1,Type=Integer,Description=\"The position of the site for which %s was calculated\">",args->ld_annot_pos[VCFBUF_LD_IDX_HD],args->ld_annot[VCFBUF_LD_IDX_HD]);
         }
     }
-    if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
     args->ld_filter_id = -1;
     if ( args->ld_filter && strcmp(".",args->ld_filter) )
         args->ld_filter_id = bcf_hdr_id2int(args->hdr, BCF_DT_ID, args->ld_filter);
-
+}
+static void init_prune(args_t *args)
+{
     args->vcfbuf = vcfbuf_init(args->hdr, args->ld_win);
     if ( args->ld_max_set[VCFBUF_LD_IDX_R2] ) vcfbuf_set_opt(args->vcfbuf,double,LD_MAX_R2,args->ld_max[VCFBUF_LD_IDX_R2]);
     if ( args->ld_max_set[VCFBUF_LD_IDX_LD] ) vcfbuf_set_opt(args->vcfbuf,double,LD_MAX_LD,args->ld_max[VCFBUF_LD_IDX_LD]);
@@ -259,6 +276,145 @@ static void process(args_t *args)
     flush(args,0);
 }
 
+/*
+ *  Multithreaded processing: the LD windows are never shared between chromosomes,
+ *  so each chromosome is pruned in a separate job with its own reader and vcfbuf.
+ *  The jobs write into temporary files which are appended to the output in order.
+ */
+typedef struct
+{
+    args_t args;        // private copy of the main args
+    const char *seq;
+    char *fname;
+}
+prune_job_t;
+
+static void *prune_seq(void *arg)
+{
+    prune_job_t *job = (prune_job_t*) arg;
+    args_t *args = &job->args;
+
+    args->sr = bcf_sr_init();
+    args->sr->require_index = 1;
+    if ( bcf_sr_set_regions(args->sr, job->seq, 0)<0 ) error("Failed to set the region: %s\n",job->seq);
+    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
+    args->hdr = bcf_sr_get_header(args->sr,0);
+
+    // the same header lines are added as in the main thread, the dictionaries are identical
+    args->output_fname = job->fname;
+    args->out_fh = hts_open(job->fname,"wbu");
+    if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", job->fname, strerror(errno));
+    init_header(args);
+    if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,job->fname);
+    init_prune(args);
+
+    while ( bcf_sr_next_line(args->sr) ) process(args);
+    flush(args,1);
+    if ( args->sr->errnum ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
+
+    if ( args->filter ) filter_destroy(args->filter);
+    if ( hts_close(args->out_fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,job->fname);
+    vcfbuf_destroy(args->vcfbuf);
+    bcf_sr_destroy(args->sr);
+    return job;
+}
+
+static void append_seq(args_t *args, prune_job_t *job, bcf1_t *rec)
+{
+    htsFile *fp = hts_open(job->fname, "r");
+    if ( !fp ) error("Could not read %s: %s\n", job->fname, strerror(errno));
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) error("Could not read the header of %s\n", job->fname);
+    int ret;
+    while ( (ret=bcf_read(fp, hdr, rec))==0 )
+        if ( bcf_write1(args->out_fh, args->hdr, rec)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    if ( ret < -1 ) error("Error reading %s\n", job->fname);
+    bcf_hdr_destroy(hdr);
+    if ( hts_close(fp)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,job->fname);
+    unlink(job->fname);
+    free(job->fname);
+    job->fname = NULL;
+}
+
+static void init_tmp_dir(args_t *args)
+{
+#ifdef _WIN32
+    char tmp_path[MAX_PATH];
+    int ret = GetTempPath(MAX_PATH, tmp_path);
+    if (!ret || ret > MAX_PATH)
+        error("Could not get the path to the temporary folder\n");
+    if (strlen(tmp_path) + strlen("/bcftools-prune.XXXXXX") >= MAX_PATH)
+        error("Full path to the temporary folder is too long\n");
+    strcat(tmp_path, "/bcftools-prune.XXXXXX");
+    args->tmp_dir = strdup(tmp_path);
+    if ( mkdir(mktemp(args->tmp_dir), 0700) ) error("mkdir(%s) failed: %s\n", args->tmp_dir,strerror(errno));
+#else
+    args->tmp_dir = strdup("/tmp/bcftools-prune.XXXXXX");
+    if ( !mkdtemp(args->tmp_dir) ) error("mkdtemp(%s) failed: %s\n", args->tmp_dir,strerror(errno));
+#endif
+}
+
+static void prune_threaded(args_t *args)
+{
+    bcf_sr_t *reader = bcf_sr_get_reader(args->sr, 0);
+    int i, nseq = 0;
+    const char **seq = NULL;
+    if ( reader->tbx_idx ) seq = tbx_seqnames(reader->tbx_idx, &nseq);
+    else if ( reader->bcf_idx ) seq = bcf_index_seqnames(reader->bcf_idx, args->hdr, &nseq);
+    if ( !seq && nseq ) error("Could not read the index of %s\n", args->fname);
+    if ( !nseq ) { free(seq); return; }
+
+    init_tmp_dir(args);
+    hts_tpool *pool = hts_tpool_init(args->n_threads);
+    if ( !pool ) error("Could not initialize threading\n");
+
+    // at most this many chromosomes are being processed or waiting to be output
+    int njob = 2*args->n_threads, nfree = njob;
+    prune_job_t *jobs = (prune_job_t*) calloc(njob, sizeof(prune_job_t));
+    prune_job_t **free_jobs = (prune_job_t**) malloc(sizeof(prune_job_t*)*njob);
+    for (i=0; i<njob; i++) free_jobs[i] = &jobs[i];
+    hts_tpool_process *queue = hts_tpool_process_init(pool, njob, 0);
+
+    bcf1_t *rec = bcf_init1();
+    kstring_t str = {0,0,0};
+    hts_tpool_result *res;
+    for (i=0; i<nseq; i++)
+    {
+        if ( !nfree )
+        {
+            if ( !(res = hts_tpool_next_result_wait(queue)) ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+            prune_job_t *done = (prune_job_t*) hts_tpool_result_data(res);
+            hts_tpool_delete_result(res, 0);
+            append_seq(args, done, rec);
+            free_jobs[nfree++] = done;
+        }
+        prune_job_t *job = free_jobs[--nfree];
+        job->args = *args;
+        job->seq  = seq[i];
+        str.l = 0;
+        ksprintf(&str, "%s/%05d.bcf", args->tmp_dir, i);
+        job->fname = strdup(str.s);
+        if ( hts_tpool_dispatch(pool, queue, prune_seq, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    }
+    while ( nfree<njob )
+    {
+        if ( !(res = hts_tpool_next_result_wait(queue)) ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        prune_job_t *done = (prune_job_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        append_seq(args, done, rec);
+        free_jobs[nfree++] = done;
+    }
+    hts_tpool_process_destroy(queue);
+    hts_tpool_destroy(pool);
+    bcf_destroy1(rec);
+    free(str.s);
+    free(jobs);
+    free(free_jobs);
+    free(seq);
+    rmdir(args->tmp_dir);
+    free(args->tmp_dir);
+}
+
 int run(int argc, char **argv)
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -271,6 +427,7 @@ int run(int argc, char **argv)
         {"keep-sites",no_argument,NULL,'k'},
         {"randomize-missing",no_argument,NULL,1},
         {"AF-tag",required_argument,NULL,2},
+        {"threads",required_argument,NULL,3},
         {"exclude",required_argument,NULL,'e'},
         {"include",required_argument,NULL,'i'},
         {"annotate",required_argument,NULL,'a'},
@@ -292,6 +449,10 @@ int run(int argc, char **argv)
         {
             case  1 : args->rand_missing = 1; break;
             case  2 : args->af_tag = optarg; break;
+            case  3 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'k': args->keep_sites = 1; break;
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
@@ -385,6 +546,8 @@ int run(int argc, char **argv)
     if ( !args->ld_mask && !args->nsites ) error("%sError: Expected pruning (--max,--nsites-per-win) or annotation (--annotate) options\n\n", usage_text());
     if ( args->ld_filter && strcmp(".",args->ld_filter) && !(args->ld_mask & LD_SET_MAX) ) error("The --set-filter option requires --max.\n");
     if ( args->keep_sites && args->nsites ) error("The --keep-sites option cannot be combined with --nsites-per-win\n");
+    if ( args->n_threads && args->rand_missing ) error("The --threads option cannot be combined with --randomize-missing, the results would not be reproducible\n");
+    if ( args->n_threads && (args->region || args->target) ) error("The --threads option cannot be combined with -r/-R/-t/-T\n");
 
     if ( optind==argc )
     {
@@ -395,9 +558,13 @@ int run(int argc, char **argv)
     else args->fname = argv[optind];
 
     init_data(args);
-    
-    while ( bcf_sr_next_line(args->sr) ) process(args);
-    flush(args,1);
+
+    if ( args->n_threads ) prune_threaded(args);
+    else
+    {
+        while ( bcf_sr_next_line(args->sr) ) process(args);
+        flush(args,1);
+    }
 
     destroy_data(args);
     return 0;
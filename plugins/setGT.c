@@ -37,6 +37,8 @@ DEALINGS IN THE SOFTWARE.  */
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+#define BINOM_CACHE_MAX 256     // binomial test results are memoized for read counts smaller than this
+
 typedef int (*cmp_f)(double a, double b);
 
 static int cmp_eq(double a, double b) { return a==b ? 1 : 0; }
@@ -56,7 +58,7 @@ typedef struct
     char *filter_str;
     int filter_logic;
     uint8_t *smpl_pass;
-    double binom_val;
+    double binom_val, *binom_cache;
     char *binom_tag;
     cmp_f binom_cmp;
 }
@@ -296,6 +298,21 @@ static inline double calc_binom(int na, int nb)
     return prob;
 }
 
+// With high-depth data the same read counts come up over and over again
+static inline double calc_binom_cached(int na, int nb)
+{
+    if ( na<0 || nb<0 || na>=BINOM_CACHE_MAX || nb>=BINOM_CACHE_MAX ) return calc_binom(na,nb);
+    if ( !args->binom_cache )
+    {
+        int i;
+        args->binom_cache = (double*) malloc(sizeof(*args->binom_cache)*BINOM_CACHE_MAX*BINOM_CACHE_MAX);
+        for (i=0; i<BINOM_CACHE_MAX*BINOM_CACHE_MAX; i++) args->binom_cache[i] = -1;     // not computed yet
+    }
+    double *prob = &args->binom_cache[na*BINOM_CACHE_MAX + nb];
+    if ( *prob==-1 ) *prob = calc_binom(na,nb);
+    return *prob;
+}
+
 bcf1_t *process(bcf1_t *rec)
 {
     if ( !rec->n_sample ) return rec;
@@ -356,7 +373,7 @@ bcf1_t *process(bcf1_t *rec)
                 error("The sample %s has incorrect number of %s fields at %s:%"PRId64"\n",
                         args->in_hdr->samples[i],args->binom_tag,bcf_seqname(args->in_hdr,rec),(int64_t) rec->pos+1);
 
-            double prob = calc_binom(args->iarr[i*nbinom+ia],args->iarr[i*nbinom+ib]);
+            double prob = calc_binom_cached(args->iarr[i*nbinom+ia],args->iarr[i*nbinom+ib]);
             if ( !args->binom_cmp(prob,args->binom_val) ) continue;
 
             if ( args->new_mask&GT_UNPHASED )
@@ -437,6 +454,7 @@ void destroy(void)
 {
     fprintf(stderr,"Filled %"PRId64" alleles\n", args->nchanged);
     free(args->binom_tag);
+    free(args->binom_cache);
     if ( args->filter ) filter_destroy(args->filter);
     free(args->arr);
     free(args->iarr);
@@ -35,6 +35,7 @@
 #include <htslib/kseq.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
 
@@ -43,6 +44,21 @@
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+#define JOB_NREC 1024   // the number of records processed by a single job with --threads
+
+// genotype types and flags, determined once per record and shared by all filters
+#define GT_MISSING 0
+#define GT_HEMI    1
+#define GT_HET     2
+#define GT_HOM_RR  3
+#define GT_HOM_AA  4
+
+#define GT_NONREF  (1<<0)
+#define GT_SNV     (1<<1)
+#define GT_INDEL   (1<<2)
+#define GT_TS      (1<<3)
+#define GT_TV      (1<<4)
+
 typedef struct
 {
     uint32_t
@@ -69,6 +85,29 @@ typedef struct
 flt_stats_t;
 
 typedef struct
+{
+    uint8_t type, flags, nsingleton;
+}
+gt_t;
+
+typedef struct _args_t args_t;
+
+// The state needed to process a batch of records. Each job has its own
+// filters and counters, these are summed up in report_stats()
+typedef struct
+{
+    args_t *args;
+    flt_stats_t *filters;
+    bcf1_t **rec;
+    int nrec, mrec;
+    gt_t *gt;                       // per-sample genotype classification of the current record
+    uint8_t *als_flags;             // GT_SNV, GT_TS, etc. for each allele of the current record
+    int32_t *gt_arr, *ac;
+    int mgt_arr, mac, mals_flags;
+}
+stats_job_t;
+
+struct _args_t
 {
     int argc, filter_logic, regions_is_file, targets_is_file;
     int nflt_str;
@@ -78,10 +117,9 @@ typedef struct
     bcf_hdr_t *hdr;
     flt_stats_t *filters;
     int nfilters, nsmpl;
-    int32_t *gt_arr, *ac;
-    int mgt_arr, mac;
-}
-args_t;
+    int n_threads, njob;
+    stats_job_t *jobs;
+};
 
 args_t args;
 
@@ -104,6 +142,7 @@ static const char *usage_text(void)
         "   -R, --regions-file FILE     restrict to regions listed in a file\n"
         "   -t, --targets REG           similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file FILE     similar to -R but streams rather than index-jumps\n"
+        "       --threads INT           process batches of records in parallel with INT worker threads [0]\n"
         "\n"
         "Example:\n"
         "   bcftools +smpl-stats -i 'GQ>{10,20,30,40,50}' file.bcf\n"
@@ -151,38 +190,25 @@ static void parse_filters(args_t *args)
     fprintf(stderr,"Collecting data for %d filtering expressions\n", args->nflt_str);
 }
 
-static void init_data(args_t *args)
+static flt_stats_t *init_filters(args_t *args)
 {
-    args->sr = bcf_sr_init();
-    if ( args->regions )
-    {
-        args->sr->require_index = 1;
-        if ( bcf_sr_set_regions(args->sr, args->regions, args->regions_is_file)<0 ) error("Failed to read the regions: %s\n",args->regions);
-    }
-    if ( args->targets && bcf_sr_set_targets(args->sr, args->targets, args->targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n",args->targets);
-    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
-    args->hdr = bcf_sr_get_header(args->sr,0);
-
-    parse_filters(args);
-
     int i;
+    flt_stats_t *filters;
     if ( !args->nflt_str )
     {
-        args->filters = (flt_stats_t*) calloc(1, sizeof(flt_stats_t));
-        args->nfilters = 1;
-        args->filters[0].expr = strdup("all");
+        filters = (flt_stats_t*) calloc(1, sizeof(flt_stats_t));
+        filters[0].expr = strdup("all");
     }
     else
     {
-        args->nfilters = args->nflt_str;
-        args->filters = (flt_stats_t*) calloc(args->nfilters, sizeof(flt_stats_t));
+        filters = (flt_stats_t*) calloc(args->nfilters, sizeof(flt_stats_t));
         for (i=0; i<args->nfilters; i++)
         {
-            args->filters[i].filter = filter_init(args->hdr, args->flt_str[i]);
-            args->filters[i].expr   = strdup(args->flt_str[i]);
+            filters[i].filter = filter_init(args->hdr, args->flt_str[i]);
+            filters[i].expr   = strdup(args->flt_str[i]);
 
             // replace tab's with spaces so that the output stays parsable
-            char *tmp = args->filters[i].expr;
+            char *tmp = filters[i].expr;
             while ( *tmp )
             { 
                 if ( *tmp=='\t' ) *tmp = ' '; 
@@ -190,30 +216,104 @@ static void init_data(args_t *args)
             }
         }
     }
-    args->nsmpl = bcf_hdr_nsamples(args->hdr);
     for (i=0; i<args->nfilters; i++)
-        args->filters[i].stats = (stats_t*) calloc(args->nsmpl,sizeof(stats_t));
+        filters[i].stats = (stats_t*) calloc(args->nsmpl,sizeof(stats_t));
+    return filters;
 }
-static void destroy_data(args_t *args)
+static void destroy_filters(args_t *args, flt_stats_t *filters)
 {
     int i;
     for (i=0; i<args->nfilters; i++)
     {
-        if ( args->filters[i].filter ) filter_destroy(args->filters[i].filter);
-        free(args->filters[i].stats);
-        free(args->filters[i].expr);
+        if ( filters[i].filter ) filter_destroy(filters[i].filter);
+        free(filters[i].stats);
+        free(filters[i].expr);
     }
-    free(args->filters);
+    free(filters);
+}
+
+static void init_data(args_t *args)
+{
+    args->sr = bcf_sr_init();
+    if ( args->regions )
+    {
+        args->sr->require_index = 1;
+        if ( bcf_sr_set_regions(args->sr, args->regions, args->regions_is_file)<0 ) error("Failed to read the regions: %s\n",args->regions);
+    }
+    if ( args->targets && bcf_sr_set_targets(args->sr, args->targets, args->targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n",args->targets);
+    if ( !bcf_sr_add_reader(args->sr,args->fname) ) error("Error: %s\n", bcf_sr_strerror(args->sr->errnum));
+    args->hdr = bcf_sr_get_header(args->sr,0);
+
+    parse_filters(args);
+
+    int i;
+    args->nfilters = args->nflt_str ? args->nflt_str : 1;
+    args->nsmpl    = bcf_hdr_nsamples(args->hdr);
+    args->filters  = init_filters(args);
+
+    // The first job collects the results directly in args->filters, the other
+    // jobs have their own copies of the filters and the counters
+    args->njob = args->n_threads ? args->n_threads : 1;
+    args->jobs = (stats_job_t*) calloc(args->njob, sizeof(stats_job_t));
+    for (i=0; i<args->njob; i++)
+    {
+        stats_job_t *job = &args->jobs[i];
+        job->args    = args;
+        job->filters = i ? init_filters(args) : args->filters;
+        job->gt      = (gt_t*) malloc(sizeof(*job->gt)*args->nsmpl);
+    }
+}
+static void destroy_data(args_t *args)
+{
+    int i,j;
+    for (i=0; i<args->njob; i++)
+    {
+        stats_job_t *job = &args->jobs[i];
+        if ( i ) destroy_filters(args, job->filters);
+        for (j=0; j<job->mrec; j++)
+            if ( job->rec[j] ) bcf_destroy(job->rec[j]);
+        free(job->rec);
+        free(job->gt);
+        free(job->als_flags);
+        free(job->ac);
+        free(job->gt_arr);
+    }
+    free(args->jobs);
+    destroy_filters(args, args->filters);
     for (i=0; i<args->nflt_str; i++) free(args->flt_str[i]);
     free(args->flt_str);
     bcf_sr_destroy(args->sr);
-    free(args->ac);
-    free(args->gt_arr);
     free(args);
 }
+static void stats_add(stats_t *dst, stats_t *src)
+{
+    dst->npass      += src->npass;
+    dst->nnon_ref   += src->nnon_ref;
+    dst->nhomRR     += src->nhomRR;
+    dst->nhomAA     += src->nhomAA;
+    dst->nhemi      += src->nhemi;
+    dst->nhet       += src->nhet;
+    dst->nSNV       += src->nSNV;
+    dst->nIndel     += src->nIndel;
+    dst->nmissing   += src->nmissing;
+    dst->nsingleton += src->nsingleton;
+    dst->nts        += src->nts;
+    dst->ntv        += src->ntv;
+}
 static void report_stats(args_t *args)
 {
-    int i = 0,j;
+    int i,j,k;
+    for (k=1; k<args->njob; k++)
+    {
+        for (i=0; i<args->nfilters; i++)
+        {
+            flt_stats_t *src = &args->jobs[k].filters[i], *dst = &args->filters[i];
+            for (j=0; j<args->nsmpl; j++) stats_add(&dst->stats[j], &src->stats[j]);
+            stats_add(&dst->site_stats, &src->site_stats);
+        }
+    }
+
+    i = 0;
     FILE *fh = !args->output_fname || !strcmp("-",args->output_fname) ? stdout : fopen(args->output_fname,"w");
     if ( !fh ) error("Could not open the file for writing: %s\n", args->output_fname);
     fprintf(fh,"# CMD line shows the command line used to generate this output\n");
@@ -295,7 +395,7 @@ static inline int parse_genotype(int32_t *arr, int ngt1, int idx, int als[2])
     if ( bcf_gt_is_missing(ptr[0]) ) return -1;
     als[0] = bcf_gt_allele(ptr[0]);
 
-    if ( ngt1==1 || ptr[1]==bcf_int32_vector_end ) { ptr[1] = ptr[0]; return -2; }
+    if ( ngt1==1 || ptr[1]==bcf_int32_vector_end ) { als[1] = als[0]; return -2; }
 
     if ( bcf_gt_is_missing(ptr[1]) ) return -1;
     als[1] = bcf_gt_allele(ptr[1]);
@@ -303,9 +403,92 @@ static inline int parse_genotype(int32_t *arr, int ngt1, int idx, int als[2])
     return 0;
 }
 
-static void process_record(args_t *args, bcf1_t *rec, flt_stats_t *flt)
+// Determine once for each allele whether it is a SNV, indel, transition or transversion
+static void init_allele_flags(stats_job_t *job, bcf1_t *rec)
 {
+    int i,k;
+    hts_expand(uint8_t, rec->n_allele, job->mals_flags, job->als_flags);
+    job->als_flags[0] = 0;
+
+    // For ts/tv: numeric code of the reference allele, -1 for insertions
+    int ref = !rec->d.allele[0][1] ? bcf_acgt2int(*rec->d.allele[0]) : -1;
+
+    for (i=1; i<rec->n_allele; i++)
+    {
+        job->als_flags[i] = 0;
+        if ( !rec->d.allele[i][1] && rec->d.allele[i][0]=='*' ) continue;
+        job->als_flags[i] = GT_NONREF;
+
+        int var_type = bcf_get_variant_type(rec, i);
+        if ( var_type==VCF_SNP || var_type==VCF_MNP )
+        {
+            k = 0;
+            while ( rec->d.allele[0][k] && rec->d.allele[i][k] )
+            {
+                if ( rec->d.allele[0][k]==rec->d.allele[i][k] ) { k++; continue; }
+
+                int alt = bcf_acgt2int(rec->d.allele[i][k]);
+                if ( abs(ref-alt)==2 ) job->als_flags[i] |= GT_TS;
+                else job->als_flags[i] |= GT_TV;
+                job->als_flags[i] |= GT_SNV;
+
+                k++;
+            }
+        }
+        else if ( var_type==VCF_INDEL ) job->als_flags[i] |= GT_INDEL;
+    }
+}
+
+// Classify all genotypes of the record, the result is shared by all filters
+static int classify_genotypes(stats_job_t *job, bcf1_t *rec)
+{
+    args_t *args = job->args;
     int i,j;
+
+    // Find out the allele counts. Try to use INFO/AC, if not present, determine from the genotypes
+    hts_expand(int, rec->n_allele, job->mac, job->ac);
+    if ( !bcf_calc_ac(args->hdr, rec, job->ac, BCF_UN_INFO|BCF_UN_FMT) ) return -1;
+
+    // Get the genotypes
+    int ngt = bcf_get_genotypes(args->hdr, rec, &job->gt_arr, &job->mgt_arr);
+    if ( ngt<0 ) return -1;
+    int ngt1 = ngt / rec->n_sample;
+
+    init_allele_flags(job, rec);
+
+    for (i=0; i<args->nsmpl; i++)
+    {
+        gt_t *gt = &job->gt[i];
+        gt->flags = gt->nsingleton = 0;
+
+        // Determine the alternate allele and the genotypes, skip if any of the alleles is missing.
+        int als[2];
+        int ret = parse_genotype(job->gt_arr, ngt1, i, als);
+        if ( ret==-1 ) { gt->type = GT_MISSING; continue; }   // missing allele
+        if ( ret==-2 ) gt->type = GT_HEMI;
+        else if ( als[0]!=als[1] ) gt->type = GT_HET;
+        else if ( als[0]==0 ) gt->type = GT_HOM_RR;
+        else gt->type = GT_HOM_AA;
+
+        // Calculate ts/tv, count SNPs, indels. It does the right thing and handles also HetAA genotypes
+        for (j=0; j<2; j++)
+        {
+            if ( als[j]==0 ) continue;
+            if ( als[j] >= rec->n_allele )
+                error("The GT index is out of range at %s:%"PRId64" in %s\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,args->hdr->samples[i]);
+            if ( !job->als_flags[als[j]] ) continue;    // the * allele
+            gt->flags |= job->als_flags[als[j]];
+            if ( job->ac[als[j]]==1 ) gt->nsingleton++;
+            if ( ret==-2 ) break;
+        }
+    }
+    return 0;
+}
+
+static void process_filter(stats_job_t *job, bcf1_t *rec, flt_stats_t *flt)
+{
+    args_t *args = job->args;
+    int i;
     uint8_t *smpl_pass = NULL;
 
     // Find out which trios pass and if the site passes
@@ -331,100 +514,112 @@ static void process_record(args_t *args, bcf1_t *rec, flt_stats_t *flt)
         else if ( !pass_site ) return;
     }
 
-    // Find out the allele counts. Try to use INFO/AC, if not present, determine from the genotypes
-    hts_expand(int, rec->n_allele, args->mac, args->ac);
-    if ( !bcf_calc_ac(args->hdr, rec, args->ac, BCF_UN_INFO|BCF_UN_FMT) ) return;
-
-    // Get the genotypes
-    int ngt = bcf_get_genotypes(args->hdr, rec, &args->gt_arr, &args->mgt_arr);
-    if ( ngt<0 ) return;
-    int ngt1 = ngt / rec->n_sample;
-    
-
-    // For ts/tv: numeric code of the reference allele, -1 for insertions
-    int ref = !rec->d.allele[0][1] ? bcf_acgt2int(*rec->d.allele[0]) : -1;
-
-    int star_allele = -1;
-    for (i=1; i<rec->n_allele; i++)
-        if ( !rec->d.allele[i][1] && rec->d.allele[i][0]=='*' ) { star_allele = i; break; }
-
     // Run the stats
-    int site_pass      = 0;
-    int site_SNV       = 0;
-    int site_Indel     = 0;
-    int site_has_ts    = 0;
-    int site_has_tv    = 0;
+    int site_pass  = 0;
+    int site_flags = 0;
     int site_singleton = 0;
     for (i=0; i<args->nsmpl; i++)
     {
         if ( smpl_pass && !smpl_pass[i] ) continue;
         stats_t *stats = &flt->stats[i];
+        gt_t *gt = &job->gt[i];
 
-        // Determine the alternate allele and the genotypes, skip if any of the alleles is missing.
-        int als[2];
-        int ret = parse_genotype(args->gt_arr, ngt1, i, als);
-        if ( ret==-1 ) { stats->nmissing++; continue; }   // missing allele
-        if ( ret==-2 ) stats->nhemi++;
-        else if ( als[0]!=als[1] ) stats->nhet++;
-        else if ( als[0]==0 ) stats->nhomRR++;
+        if ( gt->type==GT_MISSING ) { stats->nmissing++; continue; }
+        if ( gt->type==GT_HEMI ) stats->nhemi++;
+        else if ( gt->type==GT_HET ) stats->nhet++;
+        else if ( gt->type==GT_HOM_RR ) stats->nhomRR++;
         else stats->nhomAA++;
 
         stats->npass++;
         site_pass = 1;
 
-        // Is there an alternate allele other than *?
-        int has_nonref = 0;
-        for (j=0; j<2; j++)
-        {
-            if ( als[j]==star_allele ) continue;
-            if ( als[j]==0 ) continue;
-            has_nonref = 1;
-        }
-        if ( !has_nonref ) continue; // only ref or * in this genotype
-        
+        if ( !gt->flags ) continue; // only ref or * in this genotype
+
         stats->nnon_ref++;
+        stats->nsingleton += gt->nsingleton;
+        if ( gt->nsingleton ) site_singleton = 1;
+        if ( gt->flags & GT_TS ) stats->nts++;
+        if ( gt->flags & GT_TV ) stats->ntv++;
+        if ( gt->flags & GT_SNV ) stats->nSNV++;
+        if ( gt->flags & GT_INDEL ) stats->nIndel++;
+        site_flags |= gt->flags;
+    }
+    flt->site_stats.npass  += site_pass;
+    flt->site_stats.nSNV   += site_flags & GT_SNV ? 1 : 0;
+    flt->site_stats.nIndel += site_flags & GT_INDEL ? 1 : 0;
+    flt->site_stats.nts    += site_flags & GT_TS ? 1 : 0;
+    flt->site_stats.ntv    += site_flags & GT_TV ? 1 : 0;
+    flt->site_stats.nsingleton += site_singleton;
+}
 
-        // Calculate ts/tv, count SNPs, indels. It does the right thing and handles also HetAA genotypes
-        {
-            int has_ts = 0, has_tv = 0, has_snv = 0, has_indel = 0;
-            for (j=0; j<2; j++)
-            {
-                if ( als[j]==0 || als[j]==star_allele ) continue;
-                if ( als[j] >= rec->n_allele )
-                    error("The GT index is out of range at %s:%"PRId64" in %s\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,args->hdr->samples[j]);
+static void process_record(stats_job_t *job, bcf1_t *rec)
+{
+    if ( classify_genotypes(job, rec)<0 ) return;
+
+    int i;
+    for (i=0; i<job->args->nfilters; i++)
+        process_filter(job, rec, &job->filters[i]);
+}
 
-                if ( args->ac[als[j]]==1 ) { stats->nsingleton++; site_singleton = 1; }
+static void *process_job(void *arg)
+{
+    stats_job_t *job = (stats_job_t*) arg;
+    int i;
+    for (i=0; i<job->nrec; i++)
+        process_record(job, job->rec[i]);
+    return job;
+}
+
+// The counters are additive, the records are split into batches and each
+// job slot accumulates its own counts, these are summed up in report_stats()
+static void process_threaded(args_t *args)
+{
+    hts_tpool *pool = hts_tpool_init(args->n_threads);
+    if ( !pool ) error("Could not initialize threading\n");
 
-                int var_type = bcf_get_variant_type(rec, als[j]);
-                if ( var_type==VCF_SNP || var_type==VCF_MNP )
+    int i, nfree = args->njob;
+    stats_job_t **free_jobs = (stats_job_t**) malloc(sizeof(stats_job_t*)*args->njob);
+    for (i=0; i<args->njob; i++) free_jobs[i] = &args->jobs[i];
+    hts_tpool_process *queue = hts_tpool_process_init(pool, args->njob, 0);
+
+    hts_tpool_result *res;
+    stats_job_t *job = NULL;
+    while ( 1 )
+    {
+        int eof = bcf_sr_next_line(args->sr) ? 0 : 1;
+        if ( !eof )
+        {
+            if ( !job )
+            {
+                if ( !nfree )
                 {
-                    int k = 0;
-                    while ( rec->d.allele[0][k] && rec->d.allele[als[j]][k] )
-                    {
-                        if ( rec->d.allele[0][k]==rec->d.allele[als[j]][k] ) { k++; continue; }
-
-                        int alt = bcf_acgt2int(rec->d.allele[als[j]][k]);
-                        if ( abs(ref-alt)==2 ) has_ts = 1;
-                        else has_tv = 1;
-                        has_snv = 1;
-
-                        k++;
-                    }
+                    if ( !(res = hts_tpool_next_result_wait(queue)) ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+                    free_jobs[nfree++] = (stats_job_t*) hts_tpool_result_data(res);
+                    hts_tpool_delete_result(res, 0);
                 }
-                else if ( var_type==VCF_INDEL ) has_indel = 1;
+                job = free_jobs[--nfree];
+                job->nrec = 0;
             }
-            if ( has_ts ) { stats->nts++; site_has_ts = 1; }
-            if ( has_tv ) { stats->ntv++; site_has_tv = 1; }
-            if ( has_snv ) { stats->nSNV++; site_SNV = 1; }
-            if ( has_indel ) { stats->nIndel++; site_Indel = 1; }
+            hts_expand0(bcf1_t*, job->nrec+1, job->mrec, job->rec);
+            if ( !job->rec[job->nrec] ) job->rec[job->nrec] = bcf_init();
+            bcf_copy(job->rec[job->nrec++], bcf_sr_get_line(args->sr,0));
         }
+        if ( job && (eof || job->nrec==JOB_NREC) )
+        {
+            if ( hts_tpool_dispatch(pool, queue, process_job, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+            job = NULL;
+        }
+        if ( eof ) break;
     }
-    flt->site_stats.npass  += site_pass;
-    flt->site_stats.nSNV   += site_SNV;
-    flt->site_stats.nIndel += site_Indel;
-    flt->site_stats.nts    += site_has_ts;
-    flt->site_stats.ntv    += site_has_tv;
-    flt->site_stats.nsingleton += site_singleton;
+    while ( nfree<args->njob )
+    {
+        if ( !(res = hts_tpool_next_result_wait(queue)) ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        free_jobs[nfree++] = (stats_job_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+    }
+    hts_tpool_process_destroy(queue);
+    hts_tpool_destroy(pool);
+    free(free_jobs);
 }
 
 int run(int argc, char **argv)
@@ -441,9 +636,11 @@ int run(int argc, char **argv)
         {"regions-file",1,0,'R'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
+        {"threads",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
-    int c, i;
+    int c;
+    char *tmp;
     while ((c = getopt_long(argc, argv, "o:s:i:e:r:R:t:T:",loptions,NULL)) >= 0)
     {
         switch (c) 
@@ -455,6 +652,10 @@ int run(int argc, char **argv)
             case 'r': args->regions = optarg; break;
             case 'R': args->regions = optarg; args->regions_is_file = 1; break;
             case 'o': args->output_fname = optarg; break;
+            case  1 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'h':
             case '?':
             default: error("%s", usage_text()); break;
@@ -470,12 +671,10 @@ int run(int argc, char **argv)
 
     init_data(args);
 
-    while ( bcf_sr_next_line(args->sr) )
-    {
-        bcf1_t *rec = bcf_sr_get_line(args->sr,0);
-        for (i=0; i<args->nfilters; i++)
-            process_record(args, rec, &args->filters[i]);
-    }
+    if ( args->n_threads )
+        process_threaded(args);
+    else
+        while ( bcf_sr_next_line(args->sr) ) process_record(&args->jobs[0], bcf_sr_get_line(args->sr,0));
 
     report_stats(args);
     destroy_data(args);
@@ -91,9 +91,13 @@ typedef struct
         *column_str,    // the --columns option
         *annot_prefix;  // the --annot-prefix option
     void *field2idx,    // VEP field name to index, used in initialization
-        *csq2severity;  // consequence type to severity score
+        *csq2severity,  // consequence type to severity score
+        *csq2cache;     // the whole Consequence field to cached severity, see csq_severity_cached()
     cols_t *cols_tr,    // the current CSQ tag split into transcripts
-        *cols_csq;      // the current CSQ transcript split into fields
+        *cols_csq;      // the current CSQ transcript split into fields, up to max_idx only
+    kstring_t tr_str,   // the buffer for cols_csq
+        csq_str_lc;     // lowercase Consequence field, for severity lookups
+    int max_idx;        // the highest field index needed, the rest of the transcript is not parsed
     int min_severity, max_severity;     // ignore consequences outside this severity range
     int drop_sites;                     // the -x, --drop-sites option
     int select_tr;                      // one of SELECT_TR_*
@@ -524,12 +528,20 @@ static void init_data(args_t *args)
     // The 'CANONICAL' column to look up severity, its name is hardwired for now
     if ( args->select_tr==SELECT_TR_PRIMARY && khash_str2int_get(args->field2idx,"CANONICAL",&args->primary_id)!=0 )
         error("The primary transcript was requested but the field \"CANONICAL\" is not present in INFO/%s: %s\n",args->vep_tag,hrec->vals[ret]);
+
+    args->max_idx = args->csq_idx;
+    for (i=0; i<args->nannot; i++)
+        if ( args->max_idx < args->annot[i].idx ) args->max_idx = args->annot[i].idx;
+    args->csq2cache = khash_str2int_init();
+    args->cols_csq  = (cols_t*) calloc(1,sizeof(*args->cols_csq));
 }
 static void destroy_data(args_t *args)
 {
     free(args->farr);
     free(args->iarr);
     free(args->kstr.s);
+    free(args->tr_str.s);
+    free(args->csq_str_lc.s);
     free(args->column_str);
     free(args->format_str);
     cols_destroy(args->cols_csq);
@@ -549,6 +561,7 @@ static void destroy_data(args_t *args)
     free(args->annot);
     if ( args->field2idx ) khash_str2int_destroy(args->field2idx);
     if ( args->csq2severity ) khash_str2int_destroy(args->csq2severity);
+    if ( args->csq2cache ) khash_str2int_destroy_free(args->csq2cache);
     bcf_sr_destroy(args->sr);
     bcf_hdr_destroy(args->hdr_out);
     free(args->csq_str);
@@ -617,10 +630,8 @@ static void csq_to_severity(args_t *args, char *csq, int *min_severity, int *max
     }
 }
 
-static int csq_severity_pass(args_t *args, char *csq)
+static int csq_severity_test(args_t *args, char *csq)
 {
-    if ( args->min_severity==args->max_severity && args->min_severity==SELECT_CSQ_ANY ) return 1;
-
     int min_severity, max_severity, exact_match = args->min_severity==args->max_severity ? args->min_severity : -1;
     csq_to_severity(args, csq, &min_severity, &max_severity, exact_match);
     if ( max_severity < args->min_severity ) return 0;
@@ -628,12 +639,83 @@ static int csq_severity_pass(args_t *args, char *csq)
     return 1;
 }
 
+/*
+    There are only a few distinct combinations of consequences, such as
+    "missense_variant&splice_region_variant", so the -s test result and the
+    maximum severity are cached for the whole Consequence field. This way
+    the string is not split and looked up term by term for each transcript.
+    Returns the result of the -s test, the maximum severity is set if
+    max_severity is not NULL.
+*/
+static int csq_severity_cached(args_t *args, const char *csq, int *max_severity)
+{
+    int val;
+    if ( khash_str2int_get(args->csq2cache, csq, &val)!=0 )
+    {
+        int min, max, pass = 1;
+        args->csq_str_lc.l = 0;
+        kputs(csq, &args->csq_str_lc);
+        csq_to_severity(args, args->csq_str_lc.s, &min, &max, -1);
+        if ( args->min_severity!=SELECT_CSQ_ANY || args->max_severity!=SELECT_CSQ_ANY )
+            pass = csq_severity_test(args, args->csq_str_lc.s);
+        val = (max + 1)<<1 | pass;
+        khash_str2int_set(args->csq2cache, strdup(csq), val);
+    }
+    if ( max_severity ) *max_severity = (val>>1) - 1;
+    return val & 1;
+}
+
+static int csq_severity_pass(args_t *args, const char *csq)
+{
+    if ( args->min_severity==args->max_severity && args->min_severity==SELECT_CSQ_ANY ) return 1;
+    return csq_severity_cached(args, csq, NULL);
+}
+
+/*
+    Split the transcript into fields, but only as far as the field max_idx,
+    the rest is not parsed. The result is stored in args->cols_csq, unlike
+    cols_split() the buffer is reused between calls.
+*/
+static cols_t *csq_split_fields(args_t *args, const char *tr, int max_idx)
+{
+    const char *ep = tr;
+    int n = 0;
+    while ( *ep )
+    {
+        if ( *ep=='|' && n++==max_idx ) break;
+        ep++;
+    }
+    args->tr_str.l = 0;
+    kputsn(tr, ep - tr, &args->tr_str);
+
+    cols_t *cols = args->cols_csq;
+    char *ss = args->tr_str.s;
+    cols->n = 0;
+    while (1)
+    {
+        char *se = ss;
+        while ( *se && *se!='|' ) se++;
+        char tmp = *se;
+        *se = 0;
+        cols->n++;
+        if ( cols->n > cols->m )
+        {
+            cols->m += 10;
+            cols->off = (char**) realloc(cols->off, sizeof(*cols->off)*cols->m);
+        }
+        cols->off[ cols->n - 1 ] = ss;
+        if ( !tmp ) break;
+        ss = se + 1;
+    }
+    return cols;
+}
+
 static int get_primary_transcript(args_t *args, bcf1_t *rec, cols_t *cols_tr)    // modifies args->cols_csq!
 {
     int i;
     for (i=0; i<cols_tr->n; i++)
     {
-        args->cols_csq = cols_split(cols_tr->off[i], args->cols_csq, '|');
+        csq_split_fields(args, cols_tr->off[i], args->primary_id);
         if ( args->primary_id >= args->cols_csq->n )
             error("Too few columns at %s:%"PRId64" .. %d (Consequence) >= %d\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,args->primary_id,args->cols_csq->n);
         if ( !strcmp("YES",args->cols_csq->off[args->primary_id]) ) return i;
@@ -645,13 +727,13 @@ static int get_worst_transcript(args_t *args, bcf1_t *rec, cols_t *cols_tr)
     int i, max_severity = -1, imax_severity = 0;
     for (i=0; i<cols_tr->n; i++)
     {
-        args->cols_csq = cols_split(cols_tr->off[i], args->cols_csq, '|');
+        csq_split_fields(args, cols_tr->off[i], args->csq_idx);
         if ( args->csq_idx >= args->cols_csq->n )
             error("Too few columns at %s:%"PRId64" .. %d (Consequence) >= %d\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,args->csq_idx,args->cols_csq->n);
         char *csq = args->cols_csq->off[args->csq_idx];
 
-        int min, max;
-        csq_to_severity(args, csq, &min, &max, -1);
+        int max;
+        csq_severity_cached(args, csq, &max);
         if ( max_severity < max ) { imax_severity = i; max_severity = max; }
     }
     return imax_severity;
@@ -785,7 +867,9 @@ static void process_record(args_t *args, bcf1_t *rec)
     static int too_few_fields_warned = 0;
     for (i=itr_min; i<=itr_max; i++)
     {
-        args->cols_csq = cols_split(args->cols_tr->off[i], args->cols_csq, '|');
+        // test the consequence first and parse the requested fields only if it passes
+        char *tr = args->cols_tr->off[i];
+        csq_split_fields(args, tr, args->csq_idx);
         if ( args->csq_idx >= args->cols_csq->n )
             error("Too few columns at %s:%"PRId64" .. %d (Consequence) >= %d\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,args->csq_idx,args->cols_csq->n);
 
@@ -793,6 +877,8 @@ static void process_record(args_t *args, bcf1_t *rec)
         if ( !csq_severity_pass(args, csq) ) continue;
         severity_pass = 1;
 
+        if ( args->max_idx > args->csq_idx ) csq_split_fields(args, tr, args->max_idx);
+
         for (j=0; j<args->nannot; j++)
         {
             annot_t *ann = &args->annot[j];
@@ -37,20 +37,28 @@
 #include <ctype.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
 
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+#define SET_BUF_SIZE (1<<16)    // with --max-open, records are buffered per output up to this many bytes
+
 typedef struct
 {
     char **rename;      // use a new sample name (rename samples)
     int nsmpl, *smpl;   // number of samples to keep and their indices in the input header
-    htsFile *fh;        // output file handle
+    htsFile *fh;        // output file handle, NULL if currently closed (--max-open)
     char *fname;        // output file name
+    char *path;         // output file path
     filter_t *filter;
     bcf_hdr_t *hdr;
+    bcf1_t **buf;       // records waiting to be written, with --max-open
+    int nbuf, mbuf;
+    size_t buf_size;    // the approximate size of the buffered records in bytes
+    uint64_t last_used; // for closing the least recently used outputs first
 }
 subset_t;
 
@@ -67,6 +75,9 @@ typedef struct
     subset_t *sets;
     int nsets, nhts_opts;
     char **hts_opts;
+    int max_open, nopen, n_threads;
+    uint64_t clock;
+    htsThreadPool tpool;
 }
 args_t;
 
@@ -96,6 +107,8 @@ static const char *usage_text(void)
         "   -t, --targets REGION            similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file FILE         similar to -R but streams rather than index-jumps\n"
         "       --hts-opts LIST             low-level options to pass to HTSlib, e.g. block_size=32768\n"
+        "       --max-open INT              keep at most INT output files open, reopening them in append mode as needed [0]\n"
+        "       --threads INT               use INT threads shared by all outputs for compression [0]\n"
         "\n"
         "Examples:\n"
         "   # Split a VCF file\n"
@@ -109,6 +122,9 @@ static const char *usage_text(void)
         "\n"
         "   # Keep all FORMAT tags but drop all INFO tags\n"
         "   bcftools +split input.bcf -Ob -o dir -k FMT\n"
+        "\n"
+        "   # Split a VCF with many samples, keeping at most 500 files open\n"
+        "   bcftools +split input.bcf -Ob -o dir --max-open 500 --threads 4\n"
         "\n";
 }
 
@@ -204,6 +220,68 @@ void init_subsets(args_t *args)
     }
 }
 
+static void set_close(args_t *args, subset_t *set)
+{
+    if ( hts_close(set->fh)!=0 ) error("Error: close failed .. %s\n",set->path);
+    set->fh = NULL;
+    args->nopen--;
+}
+static void set_open(args_t *args, subset_t *set, int append)
+{
+    int i;
+    if ( args->max_open && args->nopen >= args->max_open )
+    {
+        subset_t *lru = NULL;
+        for (i=0; i<args->nsets; i++)
+        {
+            if ( !args->sets[i].fh ) continue;
+            if ( !lru || lru->last_used > args->sets[i].last_used ) lru = &args->sets[i];
+        }
+        set_close(args, lru);
+    }
+    char mode[8];
+    strcpy(mode, hts_bcf_wmode(args->output_type));
+    if ( append ) mode[0] = 'a';
+    set->fh = hts_open(set->path, mode);
+    if ( set->fh == NULL ) error("[%s] Error: cannot write to \"%s\": %s\n", __func__, set->path, strerror(errno));
+    if ( args->hts_opts )
+    {
+        hts_opt *opts = NULL;
+        for (i=0; i<args->nhts_opts; i++)
+            if ( hts_opt_add(&opts,args->hts_opts[i]) ) error("Could not set the HTS option \"%s\"\n",args->hts_opts[i]);
+        if ( hts_opt_apply(set->fh,opts) ) error("Could not apply the HTS options\n");
+        hts_opt_free(opts);
+    }
+    if ( args->tpool.pool ) hts_set_thread_pool(set->fh, &args->tpool);
+    set->last_used = ++args->clock;
+    args->nopen++;
+}
+static void set_flush(args_t *args, subset_t *set)
+{
+    if ( !set->nbuf ) return;
+    if ( !set->fh ) set_open(args, set, 1);
+    bcf_hdr_nsamples(set->hdr) = set->nsmpl;
+    int i;
+    for (i=0; i<set->nbuf; i++)
+        if ( bcf_write(set->fh, set->hdr, set->buf[i])!=0 ) error("[%s] Error: failed to write the record to %s\n", __func__,set->path);
+    set->nbuf = 0;
+    set->buf_size = 0;
+    set->last_used = ++args->clock;
+}
+static void set_write(args_t *args, subset_t *set, bcf1_t *rec)
+{
+    if ( !args->max_open )
+    {
+        if ( bcf_write(set->fh, set->hdr, rec)!=0 ) error("[%s] Error: failed to write the record\n", __func__);
+        return;
+    }
+    hts_expand0(bcf1_t*, set->nbuf+1, set->mbuf, set->buf);
+    if ( !set->buf[set->nbuf] ) set->buf[set->nbuf] = bcf_init();
+    bcf_copy(set->buf[set->nbuf++], rec);
+    set->buf_size += rec->shared.l + rec->indiv.l;
+    if ( set->buf_size >= SET_BUF_SIZE ) set_flush(args, set);
+}
+
 static void init_data(args_t *args)
 {
     args->sr = bcf_sr_init();
@@ -291,6 +369,8 @@ static void init_data(args_t *args)
         if ( bcf_hdr_sync(tmp_hdr)!=0 ) error("Failed to update the VCF header\n");
     }
 
+    if ( args->n_threads > 0 && !(args->tpool.pool = hts_tpool_init(args->n_threads)) ) error("Could not initialize threading\n");
+
     kstring_t str = {0,0,0};
     for (i=0; i<args->nsets; i++)
     {
@@ -304,16 +384,8 @@ static void init_data(args_t *args)
         if ( args->output_type & FT_BCF ) kputs(".bcf", &str);
         else if ( args->output_type & FT_GZ ) kputs(".vcf.gz", &str);
         else kputs(".vcf", &str);
-        set->fh = hts_open(str.s, hts_bcf_wmode(args->output_type));
-        if ( set->fh == NULL ) error("[%s] Error: cannot write to \"%s\": %s\n", __func__, str.s, strerror(errno));
-        if ( args->hts_opts )
-        {
-            hts_opt *opts = NULL;
-            for (j=0; j<args->nhts_opts; j++)
-                if ( hts_opt_add(&opts,args->hts_opts[j]) ) error("Could not set the HTS option \"%s\"\n",args->hts_opts[j]);
-            if ( hts_opt_apply(set->fh,opts) ) return error("Could not apply the HTS options\n");
-            hts_opt_free(opts);
-        }
+        set->path = strdup(str.s);
+        set_open(args, set, 0);
         set->hdr = tmp_hdr;     // dirty: reuse the same header to lower memory for large datasets
         bcf_hdr_nsamples(set->hdr) = set->nsmpl;
         for (j=0; j<set->nsmpl; j++)
@@ -334,8 +406,13 @@ static void destroy_data(args_t *args)
     for (i=0; i<args->nsets; i++)
     {
         subset_t *set = &args->sets[i];
-        if ( hts_close(set->fh)!=0 ) error("Error: close failed .. %s\n",set->fname);
+        set_flush(args, set);
+        if ( set->fh ) set_close(args, set);
+        for (j=0; j<set->mbuf; j++)
+            if ( set->buf[j] ) bcf_destroy(set->buf[j]);
+        free(set->buf);
         free(set->fname);
+        free(set->path);
         free(set->smpl);
         if ( set->filter )
             filter_destroy(set->filter);
@@ -349,6 +426,7 @@ static void destroy_data(args_t *args)
     for (i=0; i<args->nhts_opts; i++) free(args->hts_opts[i]);
     free(args->hts_opts);
     free(args->sets);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
     bcf_sr_destroy(args->sr);
     free(args);
 }
@@ -446,7 +524,7 @@ static void process(args_t *args)
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
         }
         if ( !pass ) continue;
-        if ( bcf_write(set->fh, set->hdr, out)!=0 ) error("[%s] Error: failed to write the record\n", __func__);
+        set_write(args, set, out);
     }
     if ( out ) bcf_destroy(out);
 }
@@ -459,6 +537,8 @@ int run(int argc, char **argv)
     static struct option loptions[] =
     {
         {"hts-opts",required_argument,NULL,1},
+        {"max-open",required_argument,NULL,2},
+        {"threads",required_argument,NULL,3},
         {"keep-tags",required_argument,NULL,'k'},
         {"exclude",required_argument,NULL,'e'},
         {"include",required_argument,NULL,'i'},
@@ -470,11 +550,20 @@ int run(int argc, char **argv)
         {NULL,0,NULL,0}
     };
     int c;
+    char *tmp;
     while ((c = getopt_long(argc, argv, "vr:R:t:T:o:O:i:e:k:S:",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case  1 : args->hts_opts = hts_readlist(optarg,0,&args->nhts_opts); break;
+            case  2 :
+                args->max_open = strtol(optarg,&tmp,10);
+                if ( *tmp || args->max_open<0 ) error("Could not parse: --max-open %s\n", optarg);
+                break;
+            case  3 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'k': args->keep_tags = optarg; break;
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
@@ -50,6 +50,8 @@
 #define iFATHER 1
 #define iMOTHER 2
 
+#define PL2PROB_MAX 1023    // PL values converted to probabilities via a lookup table
+
 typedef struct
 {
     int idx[3];     // VCF sample index for child, father, mother
@@ -72,8 +74,10 @@ typedef struct
     int mpl, mad;
     double min_score;
     double *aprob;  // proband's allele probabilities
-    double *pl3;    // normalized PLs converted to probs for proband,father,mother
+    double *pl3;    // normalized PLs converted to probs for all samples in trios, computed once per record
     int maprob, mpl3, midx, *idx, force_ad;
+    uint8_t *in_trio;   // is the sample a member of any trio?
+    double pl2prob[PL2PROB_MAX+1];
 }
 args_t;
 
@@ -227,10 +231,17 @@ static void init_data(args_t *args)
 
     args->dnm_qual = (int32_t*) malloc(sizeof(*args->dnm_qual)*bcf_hdr_nsamples(args->hdr));
     args->vaf      = (int32_t*) malloc(sizeof(*args->vaf)*bcf_hdr_nsamples(args->hdr));
+
+    // the same sample can be a member of several trios, the PLs are converted only once
+    args->in_trio = (uint8_t*) calloc(bcf_hdr_nsamples(args->hdr),1);
+    for (i=0; i<args->ntrio; i++)
+        for (n=0; n<3; n++) args->in_trio[ args->trio[i].idx[n] ] = 1;
+    for (i=0; i<=PL2PROB_MAX; i++) args->pl2prob[i] = pow(10,-0.1*i);
 }
 static void destroy_data(args_t *args)
 {
     free(args->pl3);
+    free(args->in_trio);
     free(args->aprob);
     free(args->idx);
     free(args->dnm_qual);
@@ -320,20 +331,26 @@ static void process_record(args_t *args, bcf1_t *rec)
     int npl1  = nret/nsmpl;
     if ( npl1!=rec->n_allele*(rec->n_allele+1)/2 )
         error("fixme: not a diploid site at %s:%"PRId64": %d alleles, %d PLs\n", bcf_seqname(args->hdr,rec),(int64_t) rec->pos+1,rec->n_allele,npl1);
-    hts_expand(double,3*npl1,args->mpl3,args->pl3);
+    hts_expand(double,nsmpl*npl1,args->mpl3,args->pl3);
     int i, j, k, al0, al1, write_dnm = 0, ad_set = 0;
+    for (i=0; i<nsmpl; i++)
+    {
+        if ( !args->in_trio[i] ) continue;
+        int32_t *src = args->pl + npl1 * i;
+        double *dst = args->pl3 + npl1 * i;
+        double sum = 0;
+        for (k=0; k<npl1; k++)
+        {
+            dst[k] = src[k]>=0 && src[k]<=PL2PROB_MAX ? args->pl2prob[src[k]] : pow(10,-0.1*src[k]);
+            sum += dst[k];
+        }
+        for (k=0; k<npl1; k++) dst[k] /= sum;
+    }
     for (i=0; i<nsmpl; i++) args->dnm_qual[i] = bcf_int32_missing;
     for (i=0; i<args->ntrio; i++)
     {
         double *ppl[3];
-        for (j=0; j<3; j++)
-        {
-            int32_t *src = args->pl + npl1 * args->trio[i].idx[j];
-            double *dst = ppl[j] = args->pl3 + j*npl1;
-            double sum = 0;
-            for (k=0; k<npl1; k++) { dst[k] = pow(10,-0.1*src[k]); sum += dst[k]; }
-            for (k=0; k<npl1; k++) dst[k] /= sum;
-        }
+        for (j=0; j<3; j++) ppl[j] = args->pl3 + npl1 * args->trio[i].idx[j];
         int32_t score = process_trio(args, rec->n_allele, ppl, npl1, &al0, &al1);
         if ( score >= args->min_score )
         {
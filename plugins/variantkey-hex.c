@@ -44,6 +44,26 @@ static uint64_t nrv; // number of non-reversible variants
 
 bcf_hdr_t *in_hdr;
 
+// Chromosome codes of the header contigs, encoded once per contig rather than for each record
+static uint8_t *chrom_code;
+static int nchrom_code;
+
+static inline uint8_t rid2chrom_code(bcf_hdr_t *hdr, int rid)
+{
+    if ( rid >= nchrom_code )
+    {
+        int i, n = hdr->n[BCF_DT_CTG];
+        chrom_code = (uint8_t*) realloc(chrom_code, n);
+        for (i=nchrom_code; i<n; i++)
+        {
+            const char *key = hdr->id[BCF_DT_CTG][i].key;
+            chrom_code[i] = encode_chrom(key, strlen(key));
+        }
+        nchrom_code = n;
+    }
+    return chrom_code[rid];
+}
+
 const char *about(void)
 {
     return "Generate VariantKey index files\n";
@@ -104,23 +124,21 @@ bcf1_t *process(bcf1_t *rec)
 {
     int len_ref = strlen(rec->d.allele[0]);
     int len_alt = strlen(rec->d.allele[1]);
-    uint64_t vk = variantkey(
-                      in_hdr->id[BCF_DT_CTG][rec->rid].key,
-                      strlen(in_hdr->id[BCF_DT_CTG][rec->rid].key),
+    uint64_t vk = encode_variantkey(
+                      rid2chrom_code(in_hdr, rec->rid),
                       rec->pos,
-                      rec->d.allele[0],
-                      len_ref,
-                      rec->d.allele[1],
-                      len_alt);
+                      encode_refalt(rec->d.allele[0], len_ref, rec->d.allele[1], len_alt));
     char *ptr = rec->d.id;
     ptr += 2; // remove 'rs'
-    uint32_t rs = (uint32_t)strtoul(ptr, NULL, 10);
-    fprintf(fp_vkrs, "%016" PRIx64 "\t%08" PRIx32 "\n", vk, rs); // map VariantKey to rsID
-    fprintf(fp_rsvk, "%08" PRIx32 "\t%016" PRIx64 "\n", rs, vk); // map rsID to VariantKey
+    char vs[17], rs[9];
+    hex_uint64_t(vk, vs);
+    hex_uint32_t((uint32_t)strtoul(ptr, NULL, 10), rs);
+    fprintf(fp_vkrs, "%s\t%s\n", vs, rs); // map VariantKey to rsID
+    fprintf(fp_rsvk, "%s\t%s\n", rs, vs); // map rsID to VariantKey
     if (vk & 1)
     {
         // map VariantKey to REF and ALT
-        fprintf(fp_nrvk, "%016" PRIx64 "\t%s\t%s\n", vk, rec->d.allele[0], rec->d.allele[1]);
+        fprintf(fp_nrvk, "%s\t%s\t%s\n", vs, rec->d.allele[0], rec->d.allele[1]);
         nrv++;
     }
     numvar++;
@@ -131,6 +149,7 @@ void destroy(void)
 {
     fclose(fp_vkrs);
     fclose(fp_rsvk);
+    free(chrom_code);
     printf("VariantKeys: %" PRIu64 "\n", numvar);
     printf("Non-reversible VariantKeys: %" PRIu64 "\n", nrv);
 }
@@ -34,6 +34,8 @@
 #include <gsl/gsl_multifit_nlin.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/kstring.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "peakfit.h"
 
@@ -55,7 +57,7 @@ typedef struct
     dist_t *dist;
     char **argv, *output_dir;
     double fit_th, peak_symmetry, cn_penalty, min_peak_size, min_fraction;
-    int argc, plot, verbose, regions_is_file, targets_is_file, include_aa, force_cn;
+    int argc, plot, verbose, regions_is_file, targets_is_file, include_aa, force_cn, n_threads;
     char *dat_fname, *fname, *regions_list, *targets_list, *sample;
     FILE *dat_fp;
 }
@@ -188,23 +190,29 @@ static void init_data(args_t *args)
     int ret = bcf_hdr_set_samples(hdr, args->sample, 0);
     if ( ret<0 ) error("Error setting the sample: %s\n", args->sample);
 
-    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,bcf_hdr_id2int(hdr,BCF_DT_ID,"BAF")) )
+    int baf_id = bcf_hdr_id2int(hdr,BCF_DT_ID,"BAF");
+    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,baf_id) )
         error("The tag FORMAT/BAF is not present in the VCF: %s\n", args->fname);
+    if ( bcf_hdr_id2type(hdr,BCF_HL_FMT,baf_id)!=BCF_HT_REAL )
+        error("The tag FORMAT/BAF is not defined as Float: %s\n", args->fname);
 
     int i;
     args->xvals = (double*) calloc(args->nbins,sizeof(double));
     for (i=0; i<args->nbins; i++) args->xvals[i] = 1.0*i/(args->nbins-1);
 
     // collect BAF distributions for all chromosomes
-    int idist = -1, nbaf = 0, nprocessed = 0, ntotal = 0, prev_chr = -1;
-    float *baf = NULL;
+    int idist = -1, nprocessed = 0, ntotal = 0, prev_chr = -1;
     while ( bcf_sr_next_line(files) )
     {
         ntotal++;
 
+        // read the value of the single subset sample directly from the decoded
+        // record, there is no need to copy the FORMAT field out
         bcf1_t *line = bcf_sr_get_line(files,0);
-        if ( bcf_get_format_float(hdr,line,"BAF",&baf,&nbaf) != 1 ) continue;
-        if ( bcf_float_is_missing(baf[0]) ) continue;
+        bcf_fmt_t *fmt = bcf_get_fmt_id(line, baf_id);
+        if ( !fmt || fmt->n!=1 || fmt->type!=BCF_BT_FLOAT ) continue;
+        float baf = *((float*)fmt->p);
+        if ( bcf_float_is_missing(baf) ) continue;
 
         nprocessed++;
 
@@ -220,10 +228,9 @@ static void init_data(args_t *args)
             args->dist[idist].nvals = args->nbins;
             prev_chr = line->rid;
         }
-        int bin = baf[0]*(args->nbins-1);
+        int bin = baf*(args->nbins-1);
         args->dist[idist].yvals[bin]++;   // the distribution
     }
-    free(baf);
     bcf_sr_destroy(files);
 
     for (idist=0; idist<args->ndist; idist++)
@@ -368,251 +375,322 @@ static void destroy_data(args_t *args)
     free(args->dat_fname);
 }
 
-static void save_dist(args_t *args, dist_t *dist)
+// One chromosome fit. The output lines are buffered and written by the main
+// thread in the input order, each job has its own solver workspace
+typedef struct
+{
+    args_t *args;
+    dist_t *dist;
+    peakfit_t *pkf;
+    kstring_t out, log;     // the DIST, FIT and CN lines; the verbose report
+}
+fit_job_t;
+
+static void save_dist(fit_job_t *job, dist_t *dist)
 {
     int i;
-    for (i=0; i<args->nbins; i++)
-        fprintf(args->dat_fp,"DIST\t%s\t%f\t%f\n",dist->chr,dist->xvals[i],dist->yvals[i]);
+    for (i=0; i<job->args->nbins; i++)
+        ksprintf(&job->out,"DIST\t%s\t%f\t%f\n",dist->chr,dist->xvals[i],dist->yvals[i]);
 }
-static void fit_curves(args_t *args)
+static void *fit_dist(void *arg)
 {
-    peakfit_t *pkf = peakfit_init();
-    peakfit_verbose(pkf,args->verbose);
+    fit_job_t *job = (fit_job_t*) arg;
+    args_t *args = job->args;
+    dist_t *dist = job->dist;
+    int nmc = 50;
 
-    int i, nmc = 50;
-    for (i=0; i<args->ndist; i++)
+    job->out.l = job->log.l = 0;
+    save_dist(job, dist);
+
+    if ( dist->copy_number!=0 )
     {
-        dist_t *dist = &args->dist[i];
-        save_dist(args, &args->dist[i]);
+        ksprintf(&job->out,"CN\t%s\t%.2f\n", dist->chr,(float)dist->copy_number);
+        return job;
+    }
 
-        if ( dist->copy_number!=0 )
+    if ( args->verbose )
+        ksprintf(&job->log,"%s:\n", dist->chr);
+
+    int nrr_aa  = dist->iaa - dist->irr + 1;
+    int nrr_ra  = dist->ira - dist->irr + 1;
+    int naa_max = dist->nvals - dist->iaa;
+    double xrr  = dist->xvals[dist->irr], *xrr_vals = &dist->xvals[dist->irr], *yrr_vals = &dist->yvals[dist->irr];
+    double xaa  = dist->xvals[dist->iaa], *xaa_vals = &dist->xvals[dist->iaa], *yaa_vals = &dist->yvals[dist->iaa];
+    double xra  = dist->xvals[dist->ira];
+    double xmax = dist->xvals[dist->nvals-1];
+
+    // CN2
+    double cn2aa_fit = 0, cn2ra_fit, cn2_fit;
+    char *cn2aa_func = 0, *cn2ra_func;
+    double cn2aa_params[3] = {1,1,1} ,cn2ra_params[3];
+    if ( args->include_aa )
+    {
+        peakfit_reset(job->pkf);
+        peakfit_add_exp(job->pkf, 1.0,1.0,0.2, 5);
+        peakfit_set_mc(job->pkf, 0.01,0.3,2,nmc);
+        peakfit_set_mc(job->pkf, 0.05,1.0,0,nmc);
+        cn2aa_fit  = peakfit_run(job->pkf, naa_max, xaa_vals, yaa_vals);
+        cn2aa_func = strdup(peakfit_sprint_func(job->pkf));
+        peakfit_get_params(job->pkf,0,cn2aa_params,3);
+    }
+    peakfit_reset(job->pkf);
+    peakfit_add_bounded_gaussian(job->pkf, 1.0,0.5,0.03, 0.45,0.55, 7);
+    peakfit_set_mc(job->pkf, 0.01,0.3,2,nmc);
+    peakfit_set_mc(job->pkf, 0.05,1.0,0,nmc);
+    cn2ra_fit  = peakfit_run(job->pkf, nrr_aa,xrr_vals,yrr_vals);
+    cn2ra_func = strdup(peakfit_sprint_func(job->pkf));
+    cn2_fit    = cn2ra_fit + cn2aa_fit;
+    peakfit_get_params(job->pkf,0,cn2ra_params,3);
+
+    // CN3: fit two peaks, then enforce the symmetry and fit again
+    double cn3rra_params[5], cn3raa_params[5], *cn3aa_params = cn2aa_params;
+    double cn3aa_fit = cn2aa_fit, cn3ra_fit;
+    char *cn3aa_func = cn2aa_func, *cn3ra_func;
+    double min_dx3   = 0.5 - 1./(args->min_fraction+2);
+    peakfit_reset(job->pkf);
+    peakfit_add_bounded_gaussian(job->pkf, 1.0,1/3.,0.03, xrr,xra-min_dx3, 7);
+    peakfit_set_mc(job->pkf, xrr,xra-min_dx3, 1,nmc);
+    peakfit_add_bounded_gaussian(job->pkf, 1.0,2/3.,0.03, xra+min_dx3,xaa, 7);
+    peakfit_set_mc(job->pkf, xra+min_dx3,xaa, 1,nmc);
+    peakfit_run(job->pkf, nrr_aa, xrr_vals, yrr_vals);
+    // force symmetry around x=0.5
+    peakfit_get_params(job->pkf,0,cn3rra_params,5);
+    peakfit_get_params(job->pkf,1,cn3raa_params,5);
+    double cn3_dx = (0.5-cn3rra_params[1] + cn3raa_params[1]-0.5)*0.5;
+    if ( cn3_dx > 0.5/3 ) cn3_dx = 0.5/3;   // CN3 peaks should not be separated by more than 1/3
+    peakfit_reset(job->pkf);
+    peakfit_add_gaussian(job->pkf, cn3rra_params[0],0.5-cn3_dx,cn3rra_params[2], 5);
+    peakfit_add_gaussian(job->pkf, cn3raa_params[0],0.5+cn3_dx,cn3raa_params[2], 5);
+    cn3ra_fit  = peakfit_run(job->pkf, nrr_aa, xrr_vals, yrr_vals);
+    cn3ra_func = strdup(peakfit_sprint_func(job->pkf));
+    // compare peak sizes
+    peakfit_get_params(job->pkf,0,cn3rra_params,3);
+    peakfit_get_params(job->pkf,1,cn3raa_params,3);
+    double cn3rra_size = cn3rra_params[0]*cn3rra_params[0];
+    double cn3raa_size = cn3raa_params[0]*cn3raa_params[0];
+    double cn3_dy      = cn3rra_size > cn3raa_size ? cn3raa_size/cn3rra_size : cn3rra_size/cn3raa_size;
+    double cn3_frac    = (1 - 2*cn3rra_params[1]) / cn3rra_params[1];
+    double cn3_fit     = cn3ra_fit + cn3aa_fit;
+    // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
+    if ( cn3rra_params[2]>0.3  || cn3raa_params[2]>0.3 ) cn3_fit = HUGE_VAL;
+    if ( cn3rra_params[2]<1e-2 || cn3raa_params[2]<1e-2 ) cn3_fit = HUGE_VAL;
+
+    // CN4 (contaminations)
+    // - first fit only the [0,0.5] part of the data, then enforce the symmetry and fit again
+    // - min_frac=1 (resp. 0.5) is interpreted as 50:50% (rep. 75:25%) contamination
+    double cn4AAaa_params[3] = {1,1,1} ,cn4AAra_params[3] = {1,1,1}, cn4RAra_params[3], cn4RArr_params[5], cn4RAaa_params[5];
+    double cn4aa_fit = 0, cn4ra_fit;
+    char *cn4aa_func = 0, *cn4ra_func;
+    double min_dx4   = 0.25*args->min_fraction;
+    if ( args->include_aa )
+    {
+        peakfit_reset(job->pkf);
+        peakfit_add_exp(job->pkf, 0.5,1.0,0.2, 5);
+        peakfit_set_mc(job->pkf, 0.01,0.3,2,nmc);
+        peakfit_add_bounded_gaussian(job->pkf, 0.4,(xaa+xmax)*0.5,2e-2, xaa,xmax, 7);
+        peakfit_set_mc(job->pkf, xaa,xmax, 1,nmc);
+        cn4aa_fit  = peakfit_run(job->pkf, naa_max, xaa_vals,yaa_vals);
+        cn4aa_func = strdup(peakfit_sprint_func(job->pkf));
+        peakfit_get_params(job->pkf,0,cn4AAaa_params,3);
+        peakfit_get_params(job->pkf,1,cn4AAra_params,5);
+    }
+    peakfit_reset(job->pkf);
+    // first fit only the [0,0.5] part of the data
+    peakfit_add_gaussian(job->pkf, 1.0,0.5,0.03, 5);
+    peakfit_add_bounded_gaussian(job->pkf, 0.6,0.3,0.03, xrr,xra-min_dx4, 7);
+    peakfit_set_mc(job->pkf, xrr,xra-min_dx4,2,nmc);
+    peakfit_run(job->pkf, nrr_ra , xrr_vals, yrr_vals);
+    // now forcet symmetry around x=0.5
+    peakfit_get_params(job->pkf,0,cn4RAra_params,3);
+    peakfit_get_params(job->pkf,1,cn4RArr_params,5);
+    double cn4_dx = 0.5-cn4RArr_params[1];
+    if ( cn4_dx > 0.25 ) cn4_dx = 0.25;   // CN4 peaks should not be separated by more than 0.5
+    peakfit_reset(job->pkf);
+    peakfit_add_gaussian(job->pkf, cn4RAra_params[0],0.5,cn4RAra_params[2], 5);
+    peakfit_add_gaussian(job->pkf, cn4RArr_params[0],0.5-cn4_dx,cn4RArr_params[2], 5);
+    peakfit_add_gaussian(job->pkf, cn4RArr_params[0],0.5+cn4_dx,cn4RArr_params[2], 5);
+    peakfit_set_mc(job->pkf, 0.1,cn4RAra_params[0],0,nmc);
+    peakfit_set_mc(job->pkf, 0.01,0.1,2,nmc);
+    cn4ra_fit  = peakfit_run(job->pkf, nrr_aa , xrr_vals, yrr_vals);
+    cn4ra_func = strdup(peakfit_sprint_func(job->pkf));
+    peakfit_get_params(job->pkf,0,cn4RAra_params,3);
+    peakfit_get_params(job->pkf,1,cn4RArr_params,3);
+    peakfit_get_params(job->pkf,2,cn4RAaa_params,3);
+    double cn4RAra_size = cn4RAra_params[0]==0 ? HUGE_VAL : cn4RAra_params[0]*cn4RAra_params[0];
+    double cn4RArr_size = cn4RArr_params[0]*cn4RArr_params[0];
+    double cn4RAaa_size = cn4RAaa_params[0]*cn4RAaa_params[0];
+    double cn4RArr_dy   = cn4RArr_size < cn4RAra_size ? cn4RArr_size/cn4RAra_size : cn4RAra_size/cn4RArr_size;
+    double cn4RAaa_dy   = cn4RAaa_size < cn4RAra_size ? cn4RAaa_size/cn4RAra_size : cn4RAra_size/cn4RAaa_size;
+    double cn4_dy       = cn4RArr_dy < cn4RAaa_dy ? cn4RArr_dy/cn4RAaa_dy : cn4RAaa_dy/cn4RArr_dy;
+    double cn4_ymin     = cn4RArr_size < cn4RAaa_size ? cn4RArr_size/cn4RAra_size : cn4RAaa_size/cn4RAra_size;
+    cn4_dx              = (cn4RAaa_params[1]-0.5) - (0.5-cn4RArr_params[1]);
+    double cn4_frac     = cn4RAaa_params[1] - cn4RArr_params[1];
+    double cn4_fit      = cn4ra_fit + cn4aa_fit;
+    // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
+    if ( cn4RAra_params[2]>0.3 || cn4RArr_params[2]>0.3 || cn4RAaa_params[2]>0.3 ) cn4_fit = HUGE_VAL;
+    if ( cn4RAra_params[2]<1e-2 || cn4RArr_params[2]<1e-2 || cn4RAaa_params[2]<1e-2 ) cn4_fit = HUGE_VAL;
+
+    // Choose the best match
+    char cn2_fail = '*', cn3_fail = '*', cn4_fail = '*';
+    if ( cn2_fit > args->fit_th ) cn2_fail = 'f';
+
+    if ( cn3_fit > args->fit_th ) cn3_fail = 'f';
+    else if ( cn3_dy < args->peak_symmetry ) cn3_fail = 'y';    // size difference is too big
+
+    if ( cn4_fit > args->fit_th ) cn4_fail = 'f';
+    else if ( cn4_ymin < args->min_peak_size ) cn4_fail = 'y';      // side peak is too small
+    else if ( cn4_dy < args->peak_symmetry ) cn4_fail = 'Y';    // size difference is too big
+    else if ( cn4_dx > 0.1 ) cn4_fail = 'x';                    // side peaks placed assymetrically
+
+    double cn = -1, fit = cn2_fit;
+    if ( cn2_fail == '*' ) { cn = 2; fit = cn2_fit; }
+    if ( cn3_fail == '*' )
+    {
+        // Use cn_penalty as a tiebreaker. If set to 0.3, cn3_fit must be 30% smaller than cn2_fit.
+        if ( cn<0 || cn3_fit < (1-args->cn_penalty) * fit )
         {
-            fprintf(args->dat_fp,"CN\t%s\t%.2f\n", dist->chr,(float)dist->copy_number);
-            continue;
+            cn = 2 + cn3_frac; 
+            fit = cn3_fit; 
+            if ( cn2_fail=='*' ) cn2_fail = 'p';
         }
+        else cn3_fail = 'p';
+    }
+    if ( cn4_fail == '*' )
+    {
+        if ( cn<0 || cn4_fit < (1-args->cn_penalty) * fit )
+        {
+            cn = 3 + cn4_frac;
+            fit = cn4_fit;
+            if ( cn2_fail=='*' ) cn2_fail = 'p';
+            if ( cn3_fail=='*' ) cn3_fail = 'p';
+        }
+        else cn4_fail = 'p';
+    }
 
-        if ( args->verbose )
-            fprintf(stderr,"%s:\n", dist->chr);
+    if ( args->verbose )
+    {
+        ksprintf(&job->log,"\tcn2 %c fit=%e\n", cn2_fail, cn2_fit);
+        ksprintf(&job->log,"\t       .. %e\n", cn2ra_fit);
+        ksprintf(&job->log,"\t            RA:   %f %f %f\n", cn2ra_params[0],cn2ra_params[1],cn2ra_params[2]);
+        ksprintf(&job->log,"\t       .. %e\n", cn2aa_fit);
+        ksprintf(&job->log,"\t            AA:   %f %f %f\n", cn2aa_params[0],cn2aa_params[1],cn2aa_params[2]);
+        ksprintf(&job->log,"\t      func:\n");
+        ksprintf(&job->log,"\t            %s\n", cn2ra_func);
+        ksprintf(&job->log,"\t            %s\n", cn2aa_func);
+        ksprintf(&job->log,"\n");
+        ksprintf(&job->log,"\tcn3 %c fit=%e  frac=%f  symmetry=%f\n", cn3_fail, cn3_fit, cn3_frac, cn3_dy);
+        ksprintf(&job->log,"\t       .. %e\n", cn3ra_fit);
+        ksprintf(&job->log,"\t            RRA:  %f %f %f\n", cn3rra_params[0],cn3rra_params[1],cn3rra_params[2]);
+        ksprintf(&job->log,"\t            RAA:  %f %f %f\n", cn3raa_params[0],cn3raa_params[1],cn3raa_params[2]);
+        ksprintf(&job->log,"\t       .. %e\n", cn3aa_fit);
+        ksprintf(&job->log,"\t            AAA:  %f %f %f\n", cn3aa_params[0],cn3aa_params[1],cn3aa_params[2]);
+        ksprintf(&job->log,"\t      func:\n");
+        ksprintf(&job->log,"\t            %s\n", cn3ra_func);
+        ksprintf(&job->log,"\t            %s\n", cn3aa_func);
+        ksprintf(&job->log,"\n");
+        ksprintf(&job->log,"\tcn4 %c fit=%e  frac=%f  symmetry=%f ymin=%f\n", cn4_fail, cn4_fit, cn4_frac, cn4_dy, cn4_ymin);
+        ksprintf(&job->log,"\t       .. %e\n", cn4ra_fit);
+        ksprintf(&job->log,"\t            RArr:  %f %f %f\n", cn4RArr_params[0],cn4RArr_params[1],cn4RArr_params[2]);
+        ksprintf(&job->log,"\t            RAra:  %f %f %f\n", cn4RAra_params[0],cn4RAra_params[1],cn4RAra_params[2]);
+        ksprintf(&job->log,"\t            RAaa:  %f %f %f\n", cn4RAaa_params[0],cn4RAaa_params[1],cn4RAaa_params[2]);
+        ksprintf(&job->log,"\t       .. %e\n", cn4aa_fit);
+        ksprintf(&job->log,"\t            AAaa:  %f %f %f\n", cn4AAaa_params[0],cn4AAaa_params[1],cn4AAaa_params[2]);
+        ksprintf(&job->log,"\t      func:\n");
+        ksprintf(&job->log,"\t            %s\n", cn4ra_func);
+        ksprintf(&job->log,"\t            %s\n", cn4aa_func);
+        ksprintf(&job->log,"\n");
+    }
 
-        int nrr_aa  = dist->iaa - dist->irr + 1;
-        int nrr_ra  = dist->ira - dist->irr + 1;
-        int naa_max = dist->nvals - dist->iaa;
-        double xrr  = dist->xvals[dist->irr], *xrr_vals = &dist->xvals[dist->irr], *yrr_vals = &dist->yvals[dist->irr];
-        double xaa  = dist->xvals[dist->iaa], *xaa_vals = &dist->xvals[dist->iaa], *yaa_vals = &dist->yvals[dist->iaa];
-        double xra  = dist->xvals[dist->ira];
-        double xmax = dist->xvals[dist->nvals-1];
+    if ( args->force_cn==2 || cn2_fail == '*' )
+    {
+        ksprintf(&job->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2ra_fit,dist->irr,dist->iaa,cn2ra_func);
+        if ( cn2aa_func ) ksprintf(&job->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2aa_fit,dist->iaa,dist->nvals-1,cn2aa_func);
+    }
+    if ( args->force_cn==3 || cn3_fail == '*' )
+    {
+        ksprintf(&job->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3ra_fit,dist->irr,dist->iaa,cn3ra_func);
+        if ( cn3aa_func ) ksprintf(&job->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3aa_fit,dist->iaa,dist->nvals-1,cn3aa_func);
+    }
+    if ( args->force_cn==4 || cn4_fail == '*' )
+    {
+        ksprintf(&job->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4ra_fit,dist->irr,dist->iaa,cn4ra_func);
+        if ( cn4aa_func ) ksprintf(&job->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4aa_fit,dist->iaa,dist->nvals-1,cn4aa_func);
+    }
+    ksprintf(&job->out,"CN\t%s\t%.2f\t%f\n", dist->chr, cn, fit);
 
+    free(cn2aa_func);
+    free(cn2ra_func);
+    free(cn3ra_func);
+    free(cn4ra_func);
+    free(cn4aa_func);
 
-        // CN2
-        double cn2aa_fit = 0, cn2ra_fit, cn2_fit;
-        char *cn2aa_func = 0, *cn2ra_func;
-        double cn2aa_params[3] = {1,1,1} ,cn2ra_params[3];
-        if ( args->include_aa )
-        {
-            peakfit_reset(pkf);
-            peakfit_add_exp(pkf, 1.0,1.0,0.2, 5);
-            peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-            peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
-            cn2aa_fit  = peakfit_run(pkf, naa_max, xaa_vals, yaa_vals);
-            cn2aa_func = strdup(peakfit_sprint_func(pkf));
-            peakfit_get_params(pkf,0,cn2aa_params,3);
-        }
-        peakfit_reset(pkf);
-        peakfit_add_bounded_gaussian(pkf, 1.0,0.5,0.03, 0.45,0.55, 7);
-        peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-        peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
-        cn2ra_fit  = peakfit_run(pkf, nrr_aa,xrr_vals,yrr_vals);
-        cn2ra_func = strdup(peakfit_sprint_func(pkf));
-        cn2_fit    = cn2ra_fit + cn2aa_fit;
-        peakfit_get_params(pkf,0,cn2ra_params,3);
-
-
-        // CN3: fit two peaks, then enforce the symmetry and fit again
-        double cn3rra_params[5], cn3raa_params[5], *cn3aa_params = cn2aa_params;
-        double cn3aa_fit = cn2aa_fit, cn3ra_fit;
-        char *cn3aa_func = cn2aa_func, *cn3ra_func;
-        double min_dx3   = 0.5 - 1./(args->min_fraction+2);
-        peakfit_reset(pkf);
-        peakfit_add_bounded_gaussian(pkf, 1.0,1/3.,0.03, xrr,xra-min_dx3, 7);
-        peakfit_set_mc(pkf, xrr,xra-min_dx3, 1,nmc);
-        peakfit_add_bounded_gaussian(pkf, 1.0,2/3.,0.03, xra+min_dx3,xaa, 7);
-        peakfit_set_mc(pkf, xra+min_dx3,xaa, 1,nmc);
-        peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
-        // force symmetry around x=0.5
-        peakfit_get_params(pkf,0,cn3rra_params,5);
-        peakfit_get_params(pkf,1,cn3raa_params,5);
-        double cn3_dx = (0.5-cn3rra_params[1] + cn3raa_params[1]-0.5)*0.5;
-        if ( cn3_dx > 0.5/3 ) cn3_dx = 0.5/3;   // CN3 peaks should not be separated by more than 1/3
-        peakfit_reset(pkf);
-        peakfit_add_gaussian(pkf, cn3rra_params[0],0.5-cn3_dx,cn3rra_params[2], 5);
-        peakfit_add_gaussian(pkf, cn3raa_params[0],0.5+cn3_dx,cn3raa_params[2], 5);
-        cn3ra_fit  = peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
-        cn3ra_func = strdup(peakfit_sprint_func(pkf));
-        // compare peak sizes
-        peakfit_get_params(pkf,0,cn3rra_params,3);
-        peakfit_get_params(pkf,1,cn3raa_params,3);
-        double cn3rra_size = cn3rra_params[0]*cn3rra_params[0];
-        double cn3raa_size = cn3raa_params[0]*cn3raa_params[0];
-        double cn3_dy      = cn3rra_size > cn3raa_size ? cn3raa_size/cn3rra_size : cn3rra_size/cn3raa_size;
-        double cn3_frac    = (1 - 2*cn3rra_params[1]) / cn3rra_params[1];
-        double cn3_fit     = cn3ra_fit + cn3aa_fit;
-        // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
-        if ( cn3rra_params[2]>0.3  || cn3raa_params[2]>0.3 ) cn3_fit = HUGE_VAL;
-        if ( cn3rra_params[2]<1e-2 || cn3raa_params[2]<1e-2 ) cn3_fit = HUGE_VAL;
-
-
-        // CN4 (contaminations)
-        // - first fit only the [0,0.5] part of the data, then enforce the symmetry and fit again
-        // - min_frac=1 (resp. 0.5) is interpreted as 50:50% (rep. 75:25%) contamination
-        double cn4AAaa_params[3] = {1,1,1} ,cn4AAra_params[3] = {1,1,1}, cn4RAra_params[3], cn4RArr_params[5], cn4RAaa_params[5];
-        double cn4aa_fit = 0, cn4ra_fit;
-        char *cn4aa_func = 0, *cn4ra_func;
-        double min_dx4   = 0.25*args->min_fraction;
-        if ( args->include_aa )
-        {
-            peakfit_reset(pkf);
-            peakfit_add_exp(pkf, 0.5,1.0,0.2, 5);
-            peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-            peakfit_add_bounded_gaussian(pkf, 0.4,(xaa+xmax)*0.5,2e-2, xaa,xmax, 7);
-            peakfit_set_mc(pkf, xaa,xmax, 1,nmc);
-            cn4aa_fit  = peakfit_run(pkf, naa_max, xaa_vals,yaa_vals);
-            cn4aa_func = strdup(peakfit_sprint_func(pkf));
-            peakfit_get_params(pkf,0,cn4AAaa_params,3);
-            peakfit_get_params(pkf,1,cn4AAra_params,5);
-        }
-        peakfit_reset(pkf);
-        // first fit only the [0,0.5] part of the data
-        peakfit_add_gaussian(pkf, 1.0,0.5,0.03, 5);
-        peakfit_add_bounded_gaussian(pkf, 0.6,0.3,0.03, xrr,xra-min_dx4, 7);
-        peakfit_set_mc(pkf, xrr,xra-min_dx4,2,nmc);
-        peakfit_run(pkf, nrr_ra , xrr_vals, yrr_vals);
-        // now forcet symmetry around x=0.5
-        peakfit_get_params(pkf,0,cn4RAra_params,3);
-        peakfit_get_params(pkf,1,cn4RArr_params,5);
-        double cn4_dx = 0.5-cn4RArr_params[1];
-        if ( cn4_dx > 0.25 ) cn4_dx = 0.25;   // CN4 peaks should not be separated by more than 0.5
-        peakfit_reset(pkf);
-        peakfit_add_gaussian(pkf, cn4RAra_params[0],0.5,cn4RAra_params[2], 5);
-        peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5-cn4_dx,cn4RArr_params[2], 5);
-        peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5+cn4_dx,cn4RArr_params[2], 5);
-        peakfit_set_mc(pkf, 0.1,cn4RAra_params[0],0,nmc);
-        peakfit_set_mc(pkf, 0.01,0.1,2,nmc);
-        cn4ra_fit  = peakfit_run(pkf, nrr_aa , xrr_vals, yrr_vals);
-        cn4ra_func = strdup(peakfit_sprint_func(pkf));
-        peakfit_get_params(pkf,0,cn4RAra_params,3);
-        peakfit_get_params(pkf,1,cn4RArr_params,3);
-        peakfit_get_params(pkf,2,cn4RAaa_params,3);
-        double cn4RAra_size = cn4RAra_params[0]==0 ? HUGE_VAL : cn4RAra_params[0]*cn4RAra_params[0];
-        double cn4RArr_size = cn4RArr_params[0]*cn4RArr_params[0];
-        double cn4RAaa_size = cn4RAaa_params[0]*cn4RAaa_params[0];
-        double cn4RArr_dy   = cn4RArr_size < cn4RAra_size ? cn4RArr_size/cn4RAra_size : cn4RAra_size/cn4RArr_size;
-        double cn4RAaa_dy   = cn4RAaa_size < cn4RAra_size ? cn4RAaa_size/cn4RAra_size : cn4RAra_size/cn4RAaa_size;
-        double cn4_dy       = cn4RArr_dy < cn4RAaa_dy ? cn4RArr_dy/cn4RAaa_dy : cn4RAaa_dy/cn4RArr_dy;
-        double cn4_ymin     = cn4RArr_size < cn4RAaa_size ? cn4RArr_size/cn4RAra_size : cn4RAaa_size/cn4RAra_size;
-        cn4_dx              = (cn4RAaa_params[1]-0.5) - (0.5-cn4RArr_params[1]);
-        double cn4_frac     = cn4RAaa_params[1] - cn4RArr_params[1];
-        double cn4_fit      = cn4ra_fit + cn4aa_fit;
-        // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
-        if ( cn4RAra_params[2]>0.3 || cn4RArr_params[2]>0.3 || cn4RAaa_params[2]>0.3 ) cn4_fit = HUGE_VAL;
-        if ( cn4RAra_params[2]<1e-2 || cn4RArr_params[2]<1e-2 || cn4RAaa_params[2]<1e-2 ) cn4_fit = HUGE_VAL;
-
-
-        // Choose the best match
-        char cn2_fail = '*', cn3_fail = '*', cn4_fail = '*';
-        if ( cn2_fit > args->fit_th ) cn2_fail = 'f';
-
-        if ( cn3_fit > args->fit_th ) cn3_fail = 'f';
-        else if ( cn3_dy < args->peak_symmetry ) cn3_fail = 'y';    // size difference is too big
-
-        if ( cn4_fit > args->fit_th ) cn4_fail = 'f';
-        else if ( cn4_ymin < args->min_peak_size ) cn4_fail = 'y';      // side peak is too small
-        else if ( cn4_dy < args->peak_symmetry ) cn4_fail = 'Y';    // size difference is too big
-        else if ( cn4_dx > 0.1 ) cn4_fail = 'x';                    // side peaks placed assymetrically
-
-        double cn = -1, fit = cn2_fit;
-        if ( cn2_fail == '*' ) { cn = 2; fit = cn2_fit; }
-        if ( cn3_fail == '*' )
+    return job;
+}
+static void flush_job(args_t *args, fit_job_t *job)
+{
+    if ( job->log.l ) fputs(job->log.s, stderr);
+    if ( job->out.l && fwrite(job->out.s, 1, job->out.l, args->dat_fp)!=job->out.l ) error("Error: failed to write the output\n");
+}
+static void fit_curves(args_t *args)
+{
+    int i, njob = args->n_threads ? 2*args->n_threads : 1;
+    fit_job_t *jobs = (fit_job_t*) calloc(njob,sizeof(*jobs));
+    for (i=0; i<njob; i++)
+    {
+        jobs[i].args = args;
+        jobs[i].pkf  = peakfit_init();
+        peakfit_verbose(jobs[i].pkf,args->verbose);
+    }
+
+    if ( !args->n_threads )
+    {
+        for (i=0; i<args->ndist; i++)
         {
-            // Use cn_penalty as a tiebreaker. If set to 0.3, cn3_fit must be 30% smaller than cn2_fit.
-            if ( cn<0 || cn3_fit < (1-args->cn_penalty) * fit )
-            {
-                cn = 2 + cn3_frac; 
-                fit = cn3_fit; 
-                if ( cn2_fail=='*' ) cn2_fail = 'p';
-            }
-            else cn3_fail = 'p';
+            jobs[0].dist = &args->dist[i];
+            fit_dist(&jobs[0]);
+            flush_job(args, &jobs[0]);
         }
-        if ( cn4_fail == '*' )
+    }
+    else
+    {
+        // The results come back in order, the job i reuses the slot of the job i-njob
+        hts_tpool *pool = hts_tpool_init(args->n_threads);
+        if ( !pool ) error("Failed to initialize %d threads\n", args->n_threads);
+        hts_tpool_process *queue = hts_tpool_process_init(pool, njob, 0);
+        if ( !queue ) error("Failed to initialize the thread pool queue\n");
+        hts_tpool_result *res;
+        int ndone = 0;
+        for (i=0; i<args->ndist; i++)
         {
-            if ( cn<0 || cn4_fit < (1-args->cn_penalty) * fit )
+            if ( i>=njob )
             {
-                cn = 3 + cn4_frac;
-                fit = cn4_fit;
-                if ( cn2_fail=='*' ) cn2_fail = 'p';
-                if ( cn3_fail=='*' ) cn3_fail = 'p';
+                if ( !(res = hts_tpool_next_result_wait(queue)) ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+                flush_job(args, (fit_job_t*) hts_tpool_result_data(res));
+                hts_tpool_delete_result(res, 0);
+                ndone++;
             }
-            else cn4_fail = 'p';
-        }
-
-        if ( args->verbose )
-        {
-            fprintf(stderr,"\tcn2 %c fit=%e\n", cn2_fail, cn2_fit);
-            fprintf(stderr,"\t       .. %e\n", cn2ra_fit);
-            fprintf(stderr,"\t            RA:   %f %f %f\n", cn2ra_params[0],cn2ra_params[1],cn2ra_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn2aa_fit);
-            fprintf(stderr,"\t            AA:   %f %f %f\n", cn2aa_params[0],cn2aa_params[1],cn2aa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn2ra_func);
-            fprintf(stderr,"\t            %s\n", cn2aa_func);
-            fprintf(stderr,"\n");
-            fprintf(stderr,"\tcn3 %c fit=%e  frac=%f  symmetry=%f\n", cn3_fail, cn3_fit, cn3_frac, cn3_dy);
-            fprintf(stderr,"\t       .. %e\n", cn3ra_fit);
-            fprintf(stderr,"\t            RRA:  %f %f %f\n", cn3rra_params[0],cn3rra_params[1],cn3rra_params[2]);
-            fprintf(stderr,"\t            RAA:  %f %f %f\n", cn3raa_params[0],cn3raa_params[1],cn3raa_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn3aa_fit);
-            fprintf(stderr,"\t            AAA:  %f %f %f\n", cn3aa_params[0],cn3aa_params[1],cn3aa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn3ra_func);
-            fprintf(stderr,"\t            %s\n", cn3aa_func);
-            fprintf(stderr,"\n");
-            fprintf(stderr,"\tcn4 %c fit=%e  frac=%f  symmetry=%f ymin=%f\n", cn4_fail, cn4_fit, cn4_frac, cn4_dy, cn4_ymin);
-            fprintf(stderr,"\t       .. %e\n", cn4ra_fit);
-            fprintf(stderr,"\t            RArr:  %f %f %f\n", cn4RArr_params[0],cn4RArr_params[1],cn4RArr_params[2]);
-            fprintf(stderr,"\t            RAra:  %f %f %f\n", cn4RAra_params[0],cn4RAra_params[1],cn4RAra_params[2]);
-            fprintf(stderr,"\t            RAaa:  %f %f %f\n", cn4RAaa_params[0],cn4RAaa_params[1],cn4RAaa_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn4aa_fit);
-            fprintf(stderr,"\t            AAaa:  %f %f %f\n", cn4AAaa_params[0],cn4AAaa_params[1],cn4AAaa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn4ra_func);
-            fprintf(stderr,"\t            %s\n", cn4aa_func);
-            fprintf(stderr,"\n");
-        }
-
-        if ( args->force_cn==2 || cn2_fail == '*' )
-        {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2ra_fit,dist->irr,dist->iaa,cn2ra_func);
-            if ( cn2aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2aa_fit,dist->iaa,dist->nvals-1,cn2aa_func);
-        }
-        if ( args->force_cn==3 || cn3_fail == '*' )
-        {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3ra_fit,dist->irr,dist->iaa,cn3ra_func);
-            if ( cn3aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3aa_fit,dist->iaa,dist->nvals-1,cn3aa_func);
+            fit_job_t *job = &jobs[i%njob];
+            job->dist = &args->dist[i];
+            if ( hts_tpool_dispatch(pool, queue, fit_dist, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
         }
-        if ( args->force_cn==4 || cn4_fail == '*' )
+        while ( ndone<args->ndist )
         {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4ra_fit,dist->irr,dist->iaa,cn4ra_func);
-            if ( cn4aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4aa_fit,dist->iaa,dist->nvals-1,cn4aa_func);
+            if ( !(res = hts_tpool_next_result_wait(queue)) ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+            flush_job(args, (fit_job_t*) hts_tpool_result_data(res));
+            hts_tpool_delete_result(res, 0);
+            ndone++;
         }
-        fprintf(args->dat_fp,"CN\t%s\t%.2f\t%f\n", dist->chr, cn, fit);
-
-        free(cn2aa_func);
-        free(cn2ra_func);
-        free(cn3ra_func);
-        free(cn4ra_func);
-        free(cn4aa_func);
+        hts_tpool_process_destroy(queue);
+        hts_tpool_destroy(pool);
     }
 
-    peakfit_destroy(pkf);
+    for (i=0; i<njob; i++)
+    {
+        peakfit_destroy(jobs[i].pkf);
+        free(jobs[i].out.s);
+        free(jobs[i].log.s);
+    }
+    free(jobs);
 }
 
 static void usage(args_t *args)
@@ -628,6 +706,7 @@ static void usage(args_t *args)
     fprintf(stderr, "    -s, --sample <name>            sample to analyze\n");
     fprintf(stderr, "    -t, --targets <region>         similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>      similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>            fit the chromosomes in parallel in <int> worker threads [0]\n");
     fprintf(stderr, "    -v, --verbose                  \n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Algorithm options:\n");
@@ -660,6 +739,7 @@ int main_polysomy(int argc, char *argv[])
         {"force-cn",1,0,2},         // hidden option
         {"smooth",1,0,'S'},         // hidden option
         {"nbins",1,0,'n'},          // hidden option
+        {"threads",1,0,3},
         {"include-aa",0,0,'i'},
         {"peak-size",1,0,'b'},
         {"min-fraction",1,0,'m'},
@@ -683,6 +763,10 @@ int main_polysomy(int argc, char *argv[])
         {
             case  1 : args->ra_rr_scaling = 0; break;
             case  2 : args->force_cn = atoi(optarg); break;
+            case  3 :
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'n': args->nbins = atoi(optarg); break;
             case 'S': args->smooth = atoi(optarg); break;
             case 'i': args->include_aa = 1; break;
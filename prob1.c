@@ -216,6 +216,26 @@ int bcf_p1_call_gt(const bcf_p1aux_t *ma, double f0, int k, int is_var)
 
 // If likelihoods fall below this they get squashed to 0
 #define TINY 1e-20
+
+/*
+ * One step of the AFS recursion for a diploid sample, z1[_min.._max] is
+ * filled from z0 and its sum returned. The coefficients are calculated in
+ * floating point so that they do not overflow with tens of thousands of
+ * samples, their values are otherwise the same as the exact integer ones.
+ */
+static inline double mc_cal_y_diploid(const double *z0, double *z1, int M0, int _min, int _max, const double p[3])
+{
+    int k = _min;
+    double sum = 0;
+    if (k == 0) sum += z1[0] = (M0+1.) * (M0+2.) * p[0] * z0[0], k++;
+    if (k == 1) sum += z1[1] = (double)M0 * (M0+1.) * p[0] * z0[1] + (M0+1.) * p[1] * z0[0], k++;
+    for (; k <= _max; ++k) {
+        double a = M0-k+1, b = M0-k+2;
+        sum += z1[k] = a * b * p[0] * z0[k] + k * b * p[1] * z0[k-1] + k * (k-1.) * p[2] * z0[k-2];
+    }
+    return sum;
+}
+
 static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
 {
     double *z[2], *tmp, *pdg;
@@ -241,11 +261,7 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             for (; _min < _max && z[0][_min] < TINY; ++_min) z[0][_min] = z[1][_min] = 0.;
             for (; _max > _min && z[0][_max] < TINY; --_max) z[0][_max] = z[1][_max] = 0.;
             _max += 2;
-            if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-            if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-            for (k = _min < 2? 2 : _min; k <= _max; ++k)
-                z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-            for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+            sum = mc_cal_y_diploid(z[0], z[1], M0, _min, _max, p);
             ma->t += log(sum / (M * (M - 1.)));
             for (k = _min; k <= _max; ++k) z[1][k] /= sum;
             if (_min >= 1) z[1][_min-1] = 0.;
@@ -275,10 +291,10 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             if (ma->ploidy[j] == 1) {
                 p[0] = pdg[0]; p[1] = pdg[2];
                 _max++;
-                if (_min == 0) k = 0, z[1][k] = (M0+1-k) * p[0] * z[0][k];
+                sum = 0.;
+                if (_min == 0) k = 0, sum += z[1][k] = (M0+1-k) * p[0] * z[0][k];
                 for (k = _min < 1? 1 : _min; k <= _max; ++k)
-                    z[1][k] = (M0+1-k) * p[0] * z[0][k] + k * p[1] * z[0][k-1];
-                for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+                    sum += z[1][k] = (M0+1-k) * p[0] * z[0][k] + k * p[1] * z[0][k-1];
                 ma->t += log(sum / M);
                 for (k = _min; k <= _max; ++k) z[1][k] /= sum;
                 if (_min >= 1) z[1][_min-1] = 0.;
@@ -287,11 +303,7 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             } else if (ma->ploidy[j] == 2) {
                 p[0] = pdg[0]; p[1] = 2 * pdg[1]; p[2] = pdg[2];
                 _max += 2;
-                if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-                if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
-                for (k = _min < 2? 2 : _min; k <= _max; ++k)
-                    z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-                for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+                sum = mc_cal_y_diploid(z[0], z[1], M0, _min, _max, p);
                 ma->t += log(sum / (M * (M - 1.)));
                 for (k = _min; k <= _max; ++k) z[1][k] /= sum;
                 if (_min >= 1) z[1][_min-1] = 0.;
@@ -303,6 +315,8 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             last_min = _min; last_max = _max;
         }
     }
+    ma->z_beg = last_min;
+    ma->z_end = last_max < ma->M ? last_max : ma->M;
     if (z[0] != ma->z) memcpy(ma->z, z[0], sizeof(double) * (ma->M + 1));
     if (bcf_p1_fp_lk)
         gzwrite(bcf_p1_fp_lk, ma->z, sizeof(double) * (ma->M + 1));
@@ -373,7 +387,7 @@ static double contrast2(bcf_p1aux_t *p1, double ret[3])
     }
     { // compute
         long double suml = 0;
-        for (k = 0; k <= p1->M; ++k) suml += p1->phi[k] * p1->z[k];
+        for (k = p1->z_beg; k <= p1->z_end; ++k) suml += p1->phi[k] * p1->z[k];
         sum = suml;
     }
     { // get the max k1 and k2
@@ -436,23 +450,27 @@ static double mc_cal_afs(bcf_p1aux_t *ma, double *p_ref_folded, double *p_var_fo
     double *phi = ma->is_indel? ma->phi_indel : ma->phi;
     memset(ma->afs1, 0, sizeof(double) * (ma->M + 1));
     mc_cal_y(ma);
+    // z[] and thus afs1[] are zero outside of [beg,end], the sums are unchanged by
+    // skipping the zeros
+    int beg = ma->z_beg, end = ma->z_end;
     // compute AFS
     // MP15: is this using equation 20 from doi:10.1093/bioinformatics/btr509?
-    for (k = 0, sum = 0.; k <= ma->M; ++k)
+    for (k = beg, sum = 0.; k <= end; ++k)
         sum += (long double)phi[k] * ma->z[k];
-    for (k = 0; k <= ma->M; ++k) {
+    for (k = beg; k <= end; ++k) {
         ma->afs1[k] = phi[k] * ma->z[k] / sum;
         if (isnan(ma->afs1[k]) || isinf(ma->afs1[k])) return -1.;
     }
     // compute folded variant probability
-    for (k = 0, sum = 0.; k <= ma->M; ++k)
+    for (k = beg, sum = 0.; k <= end; ++k)
         sum += (long double)(phi[k] + phi[ma->M - k]) / 2. * ma->z[k];
-    for (k = 1, sum2 = 0.; k < ma->M; ++k)
+    for (k = beg > 1 ? beg : 1, sum2 = 0.; k <= end && k < ma->M; ++k)
         sum2 += (long double)(phi[k] + phi[ma->M - k]) / 2. * ma->z[k];
     *p_var_folded = sum2 / sum;
+    k = ma->M;
     *p_ref_folded = (phi[k] + phi[ma->M - k]) / 2. * (ma->z[ma->M] + ma->z[0]) / sum;
     // the expected frequency
-    for (k = 0, sum = 0.; k <= ma->M; ++k) {
+    for (k = beg, sum = 0.; k <= end; ++k) {
         ma->afs[k] += ma->afs1[k];
         sum += k * ma->afs1[k];
     }
@@ -39,6 +39,7 @@ typedef struct {
     double *phi; // Probability of seeing k reference alleles
     double *phi_indel;
     double *z, *zswap; // aux for afs
+    int z_beg, z_end; // z[] is zero outside of [z_beg,z_end], set by mc_cal_y()
     double *z1, *z2, *phi1, *phi2; // only calculated when n1 is set
     double **hg; // hypergeometric distribution
     double *lf; // log factorial
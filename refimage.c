@@ -0,0 +1,114 @@
+/*  refimage.c -- create a memory-mappable reference image.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    The reference image is a plain fasta with each sequence on a single line,
+    which the commands using refseq.h memory-map instead of reading through
+    faidx, see refseq.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <htslib/hts.h>
+#include <htslib/faidx.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Write the reference as an uncompressed fasta with each sequence on a single line,\n");
+    fprintf(stderr, "         and index it. The commands which take a reference (norm, csq, stats, mpileup,\n");
+    fprintf(stderr, "         +fill-from-fasta, +fixref) memory-map such files so that concurrent processes\n");
+    fprintf(stderr, "         share a single copy in the page cache.\n");
+    fprintf(stderr, "Usage:   bcftools refimage [OPTIONS] <ref.fa>|<ref.fa.gz>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -o, --output <file>    output file name\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_refimage(int argc, char *argv[])
+{
+    int c;
+    char *output_fname = NULL;
+    static struct option loptions[] =
+    {
+        {"output",required_argument,NULL,'o'},
+        {"help",no_argument,NULL,'h'},
+        {0,0,0,0}
+    };
+    while ((c = getopt_long(argc, argv, "o:h?",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'o': output_fname = optarg; break;
+            case 'h':
+            case '?':
+            default: usage(); break;
+        }
+    }
+    if ( optind+1!=argc ) usage();
+    if ( !output_fname ) error("Missing the -o option, the image must be a file\n");
+    if ( !strcmp(output_fname,"-") ) error("The image cannot be written to standard output\n");
+
+    char *fname = argv[optind];
+    htsFile *in = hts_open(fname, "r");
+    if ( !in ) error("Failed to open %s: %s\n", fname, strerror(errno));
+    FILE *out = fopen(output_fname, "w");
+    if ( !out ) error("Failed to open %s: %s\n", output_fname, strerror(errno));
+
+    kstring_t str = {0,0,0};
+    int ret, nseq = 0, has_bases = 0;    // has_bases: the sequence line of the current record is open
+    while ( (ret = hts_getline(in, KS_SEP_LINE, &str)) >= 0 )
+    {
+        if ( str.l && str.s[str.l-1]=='\r' ) str.s[--str.l] = 0;
+        if ( !str.l ) continue;
+        if ( str.s[0]=='>' )
+        {
+            // a record with no bases has no sequence line, an empty line would break the index
+            if ( has_bases && fputc('\n', out)==EOF ) break;
+            if ( fputs(str.s, out)==EOF || fputc('\n', out)==EOF ) break;
+            nseq++;
+            has_bases = 0;
+            continue;
+        }
+        if ( !nseq ) error("Could not parse %s, expected a fasta file\n", fname);
+        if ( fwrite(str.s, 1, str.l, out)!=str.l ) break;
+        has_bases = 1;
+    }
+    if ( ret < -1 ) error("Error: failed to read %s\n", fname);
+    if ( ret >= 0 ) error("Error: failed to write %s: %s\n", output_fname, strerror(errno));
+    if ( has_bases && fputc('\n', out)==EOF ) error("Error: failed to write %s: %s\n", output_fname, strerror(errno));
+    if ( fclose(out)!=0 ) error("Error: close failed: %s\n", output_fname);
+    if ( hts_close(in)!=0 ) error("Error: close failed: %s\n", fname);
+    free(str.s);
+
+    if ( fai_build(output_fname)!=0 ) error("Error: failed to index %s\n", output_fname);
+    return 0;
+}
@@ -0,0 +1,263 @@
+/*  refseq.c -- random access to the reference sequence.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include <htslib/hts.h>
+#include <htslib/faidx.h>
+#include <htslib/kstring.h>
+#include <htslib/khash_str2int.h>
+#include "refseq.h"
+
+#define WIN_SIZE (1<<16)
+
+typedef struct
+{
+    char *chr, *seq;    // the contig name and the window's sequence
+    hts_pos_t beg, len; // 0-based start and length of the window
+    int eoc;            // the window reaches the end of the contig
+    uint64_t used;      // the time of the last use, the least recently used window is replaced first
+}
+refwin_t;
+
+typedef struct
+{
+    char *name;
+    hts_pos_t len;
+    uint64_t offset;    // the sequence's offset in the file
+}
+imgseq_t;
+
+struct _refseq_t
+{
+    // the faidx backend
+    faidx_t *fai;
+    refwin_t win[REFSEQ_NWIN];
+    hts_pos_t win_size, win_lpad;
+    uint64_t nused;
+
+    // the reference image backend
+    char *map;
+    size_t map_size;
+    imgseq_t *seq;
+    int nseq, iseq;     // iseq: the sequence of the last lookup
+    void *name2seq;
+};
+
+/*
+    The file is a reference image if it is not compressed and the .fai index
+    says all sequences are on a single line. Returns 0 if the image was mapped,
+    -1 if the file is not an image or could not be mapped and faidx should be
+    used instead.
+*/
+static int image_open(refseq_t *ref, const char *fname)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return -1;
+    unsigned char magic[2];
+    struct stat st;
+    if ( read(fd, magic, 2)!=2 || (magic[0]==0x1f && magic[1]==0x8b) || fstat(fd,&st)!=0 ) { close(fd); return -1; }
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.fai", fname);
+    FILE *fp = fopen(str.s, "r");
+    if ( !fp ) { close(fd); free(str.s); return -1; }
+
+    // name, length, offset, bases per line, bytes per line
+    int ret = 0, mseq = 0, nline = 0;
+    char name[4096];
+    int64_t len, line_blen, line_len;
+    uint64_t offset;
+    while ( !ret && (nline = fscanf(fp, "%4095s %"SCNd64" %"SCNu64" %"SCNd64" %"SCNd64"%*[^\n]", name, &len, &offset, &line_blen, &line_len))==5 )
+    {
+        if ( len > line_blen && len > 0 ) ret = -1;                 // wrapped, not an image
+        else if ( offset + len > (uint64_t)st.st_size ) ret = -1;   // the index does not match the file
+        else
+        {
+            hts_expand(imgseq_t, ref->nseq+1, mseq, ref->seq);
+            ref->seq[ref->nseq].name   = strdup(name);
+            ref->seq[ref->nseq].len    = len;
+            ref->seq[ref->nseq].offset = offset;
+            ref->nseq++;
+        }
+    }
+    if ( nline!=EOF ) ret = -1;
+    fclose(fp);
+    free(str.s);
+
+    if ( !ret && ref->nseq )
+    {
+        ref->map_size = st.st_size;
+        ref->map = mmap(NULL, ref->map_size, PROT_READ, MAP_SHARED, fd, 0);
+        if ( ref->map==MAP_FAILED ) { ref->map = NULL; ret = -1; }
+    }
+    else ret = -1;
+    close(fd);
+
+    if ( ret<0 )
+    {
+        int i;
+        for (i=0; i<ref->nseq; i++) free(ref->seq[i].name);
+        free(ref->seq);
+        ref->seq  = NULL;
+        ref->nseq = 0;
+        return -1;
+    }
+
+    int i;
+    ref->name2seq = khash_str2int_init();
+    for (i=0; i<ref->nseq; i++) khash_str2int_set(ref->name2seq, ref->seq[i].name, i);
+    return 0;
+#endif
+}
+
+refseq_t *refseq_init(const char *fname)
+{
+    refseq_t *ref = (refseq_t*) calloc(1,sizeof(refseq_t));
+    ref->win_size = WIN_SIZE;
+    if ( image_open(ref, fname)==0 ) return ref;
+    ref->fai = fai_load(fname);
+    if ( !ref->fai )
+    {
+        free(ref);
+        return NULL;
+    }
+    return ref;
+}
+
+void refseq_destroy(refseq_t *ref)
+{
+    if ( !ref ) return;
+    int i;
+    if ( ref->fai ) fai_destroy(ref->fai);
+    for (i=0; i<REFSEQ_NWIN; i++)
+    {
+        free(ref->win[i].chr);
+        free(ref->win[i].seq);
+    }
+#ifndef _WIN32
+    if ( ref->map ) munmap(ref->map, ref->map_size);
+#endif
+    for (i=0; i<ref->nseq; i++) free(ref->seq[i].name);
+    free(ref->seq);
+    if ( ref->name2seq ) khash_str2int_destroy(ref->name2seq);
+    free(ref);
+}
+
+void refseq_set_window(refseq_t *ref, hts_pos_t size, hts_pos_t lpad)
+{
+    ref->win_size = size;
+    ref->win_lpad = lpad;
+}
+
+int refseq_is_mapped(refseq_t *ref)
+{
+    return ref->map ? 1 : 0;
+}
+
+static inline int image_seq(refseq_t *ref, const char *chr)
+{
+    if ( ref->iseq < ref->nseq && !strcmp(ref->seq[ref->iseq].name, chr) ) return ref->iseq;
+    int iseq;
+    if ( khash_str2int_get(ref->name2seq, chr, &iseq)<0 ) return -1;
+    ref->iseq = iseq;
+    return iseq;
+}
+
+hts_pos_t refseq_seq_len(refseq_t *ref, const char *chr)
+{
+    if ( !ref->map ) return faidx_seq_len(ref->fai, chr);
+    int iseq = image_seq(ref, chr);
+    return iseq<0 ? -1 : ref->seq[iseq].len;
+}
+
+static const char *image_fetch(refseq_t *ref, const char *chr, hts_pos_t beg, hts_pos_t end, hts_pos_t *len)
+{
+    int iseq = image_seq(ref, chr);
+    if ( iseq<0 ) return NULL;
+    imgseq_t *seq = &ref->seq[iseq];
+    if ( beg > seq->len ) beg = seq->len;
+    if ( end >= seq->len ) end = seq->len - 1;
+    *len = end >= beg ? end - beg + 1 : 0;
+    return ref->map + seq->offset + beg;
+}
+
+static const char *faidx_fetch(refseq_t *ref, const char *chr, hts_pos_t beg, hts_pos_t end, hts_pos_t *len)
+{
+    // Is there a window of this contig? Otherwise replace the least recently used one
+    int i;
+    refwin_t *win = NULL;
+    for (i=0; i<REFSEQ_NWIN; i++)
+        if ( ref->win[i].chr && !strcmp(ref->win[i].chr, chr) ) { win = &ref->win[i]; break; }
+    if ( !win || beg < win->beg || (end >= win->beg + win->len && !win->eoc) )
+    {
+        if ( !win )
+        {
+            win = &ref->win[0];
+            for (i=1; i<REFSEQ_NWIN; i++)
+                if ( ref->win[i].used < win->used ) win = &ref->win[i];
+            free(win->chr);
+            win->chr = strdup(chr);
+        }
+        free(win->seq);
+        hts_pos_t win_beg = beg > ref->win_lpad ? beg - ref->win_lpad : 0;
+        hts_pos_t win_end = end - win_beg + 1 < ref->win_size ? win_beg + ref->win_size - 1 : end;
+        win->seq = faidx_fetch_seq64(ref->fai, chr, win_beg, win_end, &win->len);
+        if ( !win->seq || win->len < 0 )
+        {
+            free(win->seq);
+            free(win->chr);
+            memset(win, 0, sizeof(*win));
+            return NULL;
+        }
+        win->beg = win_beg;
+        win->eoc = win->len < win_end - win_beg + 1 ? 1 : 0;
+    }
+    win->used = ++ref->nused;
+
+    hts_pos_t off = beg - win->beg;
+    if ( off > win->len ) off = win->len;
+    *len = win->len - off;
+    if ( *len > end - beg + 1 ) *len = end - beg + 1;
+    if ( *len < 0 ) *len = 0;
+    return win->seq + off;
+}
+
+const char *refseq_fetch(refseq_t *ref, const char *chr, hts_pos_t beg, hts_pos_t end, hts_pos_t *len)
+{
+    if ( beg < 0 ) beg = 0;
+    if ( ref->map ) return image_fetch(ref, chr, beg, end, len);
+    return faidx_fetch(ref, chr, beg, end, len);
+}
@@ -0,0 +1,87 @@
+/*  refseq.h -- random access to the reference sequence.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Random access to the reference sequence for commands which look it up
+    record by record. There are two backends:
+
+    - A reference image, which is an uncompressed fasta with each sequence on
+      a single line and a .fai index, as written by `bcftools refimage`. The
+      file is memory-mapped and the sequence is returned without copying, all
+      processes on a node share one page-cached copy of the reference.
+
+    - Any other fasta readable by faidx, including bgzip-compressed files. The
+      sequence is read in windows, the last REFSEQ_NWIN windows are kept, at
+      most one per contig, so that nearby lookups do not read the fasta again.
+
+    The sequence is returned as it is in the fasta, case is preserved, and it
+    is not NUL-terminated. For example
+
+        refseq_t *ref = refseq_init("ref.fa");
+        hts_pos_t len;
+        const char *seq = refseq_fetch(ref, "chr1", 999, 1009, &len);   // 0-based, inclusive
+        if ( seq ) printf("%.*s\n", (int)len, seq);
+        refseq_destroy(ref);
+*/
+
+#ifndef __REFSEQ_H__
+#define __REFSEQ_H__
+
+#include <htslib/hts.h>
+
+#define REFSEQ_NWIN 2
+
+typedef struct _refseq_t refseq_t;
+
+/*
+ *  refseq_init() - open the fasta, memory-mapping it if it is a reference
+ *  image. The .fai index is created if it does not exist. Returns NULL on error.
+ */
+refseq_t *refseq_init(const char *fname);
+void refseq_destroy(refseq_t *ref);
+
+/*
+ *  refseq_set_window() - set the minimum length of the windows read by the
+ *  faidx backend and how many bases to read before the requested start, for
+ *  callers which look back a little. The default is 65536 and 0 bases.
+ */
+void refseq_set_window(refseq_t *ref, hts_pos_t size, hts_pos_t lpad);
+
+/* Returns 1 if the reference is a memory-mapped image, 0 otherwise */
+int refseq_is_mapped(refseq_t *ref);
+
+/* Returns the length of the sequence or -1 if there is no such sequence */
+hts_pos_t refseq_seq_len(refseq_t *ref, const char *chr);
+
+/*
+ *  refseq_fetch() - returns the sequence chr:beg-end (0-based, inclusive)
+ *  @len:   the number of bases returned, shorter at the end of the contig
+ *
+ *  Returns NULL if the sequence does not exist or cannot be read. The pointer
+ *  is valid until the window is replaced, which happens after the sequence
+ *  of REFSEQ_NWIN other contigs or of the same contig outside of the window
+ *  was requested. With reference images it is valid until refseq_destroy().
+ */
+const char *refseq_fetch(refseq_t *ref, const char *chr, hts_pos_t beg, hts_pos_t end, hts_pos_t *len);
+
+#endif
@@ -33,6 +33,10 @@
 
 #define iBIN(x) ((x)>>13)
 
+// Build the interval tree when regidx_overlap() would on average have to skip
+// more than this many regions per bin before reaching the first overlap
+#define TREE_MIN_SCAN 16
+
 typedef struct
 {
     uint32_t beg, end;
@@ -53,6 +57,12 @@ typedef struct
     regidx_t *ridx;
     reglist_t *list;
     int active;
+
+    // cursor of regidx_overlap_sorted(): all regions before list.reg[cur_ireg] in
+    // cur_list end before cur_beg, the start of the last query
+    regidx_t *cur_ridx;
+    reglist_t *cur_list;
+    uint32_t cur_beg, cur_ireg;
 }
 _itr_t;
 
@@ -60,6 +70,7 @@ _itr_t;
 struct _reglist_t
 {
     uint32_t *idx, nidx;    // index to list.reg+1
+    uint32_t *tree, ntree;  // implicit max-end tree over list.reg (end+1 stored), ntree leaves, or NULL
     uint32_t nreg, mreg;    // n:used, m:allocated
     reg_t *reg;             // regions
     void *dat;              // payload data
@@ -80,6 +91,7 @@ struct _regidx_t
     void *usr;              // user data to pass to regidx_parse_f
     int payload_size;
     void *payload;          // temporary payload data set by regidx_parse_f (sequence is not known beforehand)
+    int last_rid;           // sequence of the last pushed region, input is usually grouped by sequence
     kstring_t str;
 };
 
@@ -148,9 +160,18 @@ inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg
     if ( end > MAX_COOR_0 ) end = MAX_COOR_0;
 
     int rid;
-    idx->str.l = 0;
-    kputsn(chr_beg, chr_end-chr_beg+1, &idx->str);
-    if ( khash_str2int_get(idx->seq2regs, idx->str.s, &rid)!=0 )
+    size_t len = chr_end - chr_beg + 1;
+    char *last = idx->nseq ? idx->seq_names[idx->last_rid] : NULL;
+    if ( last && !strncmp(last,chr_beg,len) && !last[len] )
+        rid = idx->last_rid;
+    else
+    {
+        idx->str.l = 0;
+        kputsn(chr_beg, len, &idx->str);
+        if ( khash_str2int_get(idx->seq2regs, idx->str.s, &rid)==0 ) idx->last_rid = rid;
+        else rid = -1;
+    }
+    if ( rid<0 )
     {
         // new chromosome
         idx->nseq++;
@@ -159,6 +180,7 @@ inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg
         hts_expand0(char*,idx->nseq,m_prev,idx->seq_names);
         idx->seq_names[idx->nseq-1] = strdup(idx->str.s);
         rid = khash_str2int_inc(idx->seq2regs, idx->seq_names[idx->nseq-1]);
+        idx->last_rid = rid;
     }
 
     reglist_t *list = &idx->seq[rid];
@@ -290,6 +312,7 @@ void regidx_destroy(regidx_t *idx)
         free(list->dat);
         free(list->reg);
         free(list->idx);
+        free(list->tree);
     }
     free(idx->seq_names);
     free(idx->seq);
@@ -299,6 +322,26 @@ void regidx_destroy(regidx_t *idx)
     free(idx);
 }
 
+static void _reglist_build_tree(reglist_t *list);
+
+// Point the iterator to the first matching region, may need to iterate over the matching regions later
+static void _regitr_set(regidx_t *regidx, reglist_t *list, uint32_t beg, uint32_t end, uint32_t ireg, regitr_t *regitr)
+{
+    _itr_t *itr = (_itr_t*)regitr->itr;
+    itr->ridx = regidx;
+    itr->list = list;
+    itr->beg  = beg;
+    itr->end  = end;
+    itr->ireg = ireg;
+    itr->active = 0;
+
+    regitr->seq = list->seq;
+    regitr->beg = list->reg[ireg].beg;
+    regitr->end = list->reg[ireg].end;
+    if ( regidx->payload_size )
+        regitr->payload = (char *)list->dat + regidx->payload_size*ireg;
+}
+
 int _reglist_build_index(regidx_t *regidx, reglist_t *list)
 {
     int i;
@@ -363,9 +406,62 @@ int _reglist_build_index(regidx_t *regidx, reglist_t *list)
         if ( list->nidx < iend+1 ) list->nidx = iend+1;
     }
 
+    // The bins point to the first region overlapping the bin, so a few long regions
+    // make the lookup scan through the many short ones which start before the query.
+    // Estimate the cost and build the interval tree if it is too high.
+    uint64_t nscan = 0;
+    int nbins = 0;
+    for (j=0,k=0; k<list->nidx; k++)
+    {
+        if ( !list->idx[k] ) continue;
+        while ( j<list->nreg && iBIN(list->reg[j].beg) < k ) j++;
+        nscan += j - (list->idx[k] - 1);
+        nbins++;
+    }
+    free(list->tree);
+    list->tree = NULL;
+    if ( nbins && nscan > (uint64_t)TREE_MIN_SCAN*nbins ) _reglist_build_tree(list);
+
     return 0;
 }
 
+/*
+ *  Static implicit tree in the heap layout: the node k has the children 2k and 2k+1,
+ *  the leaves list->ntree+i hold list->reg[i].end+1 and the inner nodes the maximum
+ *  of their subtree, 0 for unused leaves. The regions stay sorted by start so that
+ *  hits are still returned in the same order as with the bin index.
+ */
+static void _reglist_build_tree(reglist_t *list)
+{
+    uint32_t i, n = list->nreg;
+    kroundup32(n);
+    list->ntree = n;
+    list->tree  = (uint32_t*) calloc(2*n, sizeof(uint32_t));
+    for (i=0; i<list->nreg; i++) list->tree[n+i] = list->reg[i].end + 1;
+    for (i=n-1; i>0; i--)
+        list->tree[i] = list->tree[2*i] > list->tree[2*i+1] ? list->tree[2*i] : list->tree[2*i+1];
+}
+
+// Returns the index of the first region at or after ireg which ends at or after beg, or -1
+static int64_t _reglist_tree_next(reglist_t *list, uint32_t ireg, uint32_t beg)
+{
+    if ( ireg >= list->nreg ) return -1;
+    uint32_t *tree = list->tree, k = list->ntree + ireg;
+    while ( tree[k] <= beg )
+    {
+        // next subtree to the right
+        while ( k&1 ) k >>= 1;
+        if ( !k ) return -1;
+        k++;
+    }
+    while ( k < list->ntree )
+    {
+        k <<= 1;
+        if ( tree[k] <= beg ) k++;
+    }
+    return k - list->ntree;
+}
+
 int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end, regitr_t *regitr)
 {
     if ( regitr ) regitr->seq = NULL;
@@ -387,6 +483,14 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
         if ( !list->idx )
             _reglist_build_index(regidx,list);
 
+        if ( list->tree )
+        {
+            int64_t i = _reglist_tree_next(list, 0, beg);
+            if ( i<0 || list->reg[i].beg > end ) return 0;
+            ireg = i;
+            goto found;
+        }
+
         int ibeg = iBIN(beg);
         if ( ibeg >= list->nidx ) return 0;     // beg is too big
 
@@ -410,26 +514,80 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
         if ( ireg >= list->nreg ) return 0;   // no match
     }
 
+found:
     if ( !regitr ) return 1;    // match, but no more info to save
 
-    // may need to iterate over the matching regions later
-    _itr_t *itr = (_itr_t*)regitr->itr;
-    itr->ridx = regidx;
-    itr->list = list;
-    itr->beg  = beg;
-    itr->end  = end;
-    itr->ireg = ireg;
-    itr->active = 0;
+    _regitr_set(regidx, list, beg, end, ireg, regitr);
+    return 1;
+}
 
-    regitr->seq = list->seq;
-    regitr->beg = list->reg[ireg].beg;
-    regitr->end = list->reg[ireg].end;
-    if ( regidx->payload_size )
-        regitr->payload = (char *)list->dat + regidx->payload_size*ireg;
+// Returns the index of the first region which may overlap a query starting at beg
+// and ending anywhere, using the bin index. All preceding regions end before beg.
+static uint32_t _reglist_first_reg(reglist_t *list, uint32_t beg)
+{
+    if ( !list->idx ) return 0;
+    uint32_t i = iBIN(beg);
+    while ( i<list->nidx && !list->idx[i] ) i++;
+    return i<list->nidx ? list->idx[i] - 1 : list->nreg;
+}
+
+int regidx_overlap_sorted(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end, regitr_t *regitr)
+{
+    regitr->seq = NULL;
+
+    _itr_t *itr = (_itr_t*) regitr->itr;
+    reglist_t *list = itr->cur_ridx==regidx ? itr->cur_list : NULL;
+    if ( !list || beg < itr->cur_beg || strcmp(list->seq,chr) )
+    {
+        // new sequence or the query moved backward, start from scratch
+        int iseq;
+        itr->cur_list = NULL;
+        if ( khash_str2int_get(regidx->seq2regs, chr, &iseq)!=0 ) return 0;    // no such sequence
+        list = &regidx->seq[iseq];
+        if ( !list->nreg ) return 0;
+        if ( list->nreg > 1 && !list->idx ) _reglist_build_index(regidx,list);
+        itr->cur_ridx = regidx;
+        itr->cur_list = list;
+        itr->cur_ireg = _reglist_first_reg(list, beg);
+    }
+    itr->cur_beg = beg;
 
+    // The first region ending at or after beg can only move forward as beg increases
+    while ( itr->cur_ireg < list->nreg && list->reg[itr->cur_ireg].end < beg ) itr->cur_ireg++;
+
+    uint32_t ireg;
+    if ( list->tree )
+    {
+        int64_t i = _reglist_tree_next(list, itr->cur_ireg, beg);
+        if ( i<0 || list->reg[i].beg > end ) return 0;
+        ireg = i;
+    }
+    else
+    {
+        for (ireg=itr->cur_ireg; ireg<list->nreg; ireg++)
+        {
+            if ( list->reg[ireg].beg > end ) return 0;   // no match, past the query region
+            if ( list->reg[ireg].end >= beg ) break;     // found
+        }
+        if ( ireg >= list->nreg ) return 0;   // no match
+    }
+
+    _regitr_set(regidx, list, beg, end, ireg, regitr);
     return 1;
 }
 
+// Parse a plain decimal coordinate without the overhead of strtod(), which
+// is left to handle anything unusual, such as "1e6" or hexadecimal numbers
+static inline double _parse_coord(char *ss, char **se)
+{
+    uint64_t val = 0;
+    char *tmp = ss;
+    while ( *tmp>='0' && *tmp<='9' ) { val = val*10 + *tmp - '0'; tmp++; }
+    if ( tmp==ss || tmp-ss>18 || *tmp=='.' || *tmp=='e' || *tmp=='E' || *tmp=='x' || *tmp=='X' ) return strtod(ss, se);
+    *se = tmp;
+    return val;
+}
+
 int regidx_parse_bed(const char *line, char **chr_beg, char **chr_end, uint32_t *beg, uint32_t *end, void *payload, void *usr)
 {
     char *ss = (char*) line;
@@ -452,11 +610,11 @@ int regidx_parse_bed(const char *line, char **chr_beg, char **chr_end, uint32_t
     }
 
     ss = se+1;
-    *beg = strtod(ss, &se);
+    *beg = _parse_coord(ss, &se);
     if ( ss==se ) { fprintf(stderr,"Could not parse bed line: %s\n", line); return -2; }
 
     ss = se+1;
-    *end = strtod(ss, &se) - 1;
+    *end = _parse_coord(ss, &se) - 1;
     if ( ss==se ) { fprintf(stderr,"Could not parse bed line: %s\n", line); return -2; }
     
     return 0;
@@ -484,7 +642,7 @@ int regidx_parse_tab(const char *line, char **chr_beg, char **chr_end, uint32_t
     }
 
     ss = se+1;
-    *beg = strtod(ss, &se);
+    *beg = _parse_coord(ss, &se);
     if ( ss==se ) { fprintf(stderr,"Could not parse tab line: %s\n", line); return -2; }
     if ( *beg==0 ) { fprintf(stderr,"Could not parse tab line, expected 1-based coordinate: %s\n", line); return -2; }
     (*beg)--;
@@ -494,7 +652,7 @@ int regidx_parse_tab(const char *line, char **chr_beg, char **chr_end, uint32_t
     else
     {
         ss = se+1;
-        *end = strtod(ss, &se);
+        *end = _parse_coord(ss, &se);
         if ( ss==se || (*se && !isspace(*se)) ) *end = *beg;
         else if ( *end==0 ) { fprintf(stderr,"Could not parse tab line, expected 1-based coordinate: %s\n", line); return -2; }
         else (*end)--;
@@ -530,7 +688,7 @@ int regidx_parse_reg(const char *line, char **chr_beg, char **chr_end, uint32_t
     }
 
     ss = se+1;
-    *beg = strtod(ss, &se);
+    *beg = _parse_coord(ss, &se);
     if ( ss==se ) { fprintf(stderr,"Could not parse reg line: %s\n", line); return -2; }
     if ( *beg==0 ) { fprintf(stderr,"Could not parse reg line, expected 1-based coordinate: %s\n", line); return -2; }
     (*beg)--;
@@ -540,7 +698,7 @@ int regidx_parse_reg(const char *line, char **chr_beg, char **chr_end, uint32_t
     else
     {
         ss = se+1;
-        *end = strtod(ss, &se);
+        *end = _parse_coord(ss, &se);
         if ( ss==se ) *end = *beg;
         else if ( *end==0 ) { fprintf(stderr,"Could not parse reg line, expected 1-based coordinate: %s\n", line); return -2; }
         else (*end)--;
@@ -587,13 +745,21 @@ int regitr_overlap(regitr_t *regitr)
     reglist_t *list = itr->list;
 
     int i;
-    for (i=itr->ireg; i<list->nreg; i++)
+    if ( list->tree )
     {
-        if ( list->reg[i].beg > itr->end ) return 0;   // no match, past the query region
-        if ( list->reg[i].end >= itr->beg && list->reg[i].beg <= itr->end ) break; // found
+        int64_t inext = _reglist_tree_next(list, itr->ireg, itr->beg);
+        if ( inext<0 || list->reg[inext].beg > itr->end ) return 0;
+        i = inext;
+    }
+    else
+    {
+        for (i=itr->ireg; i<list->nreg; i++)
+        {
+            if ( list->reg[i].beg > itr->end ) return 0;   // no match, past the query region
+            if ( list->reg[i].end >= itr->beg && list->reg[i].beg <= itr->end ) break; // found
+        }
+        if ( i >= list->nreg ) return 0;   // no match
     }
-
-    if ( i >= list->nreg ) return 0;   // no match
 
     itr->ireg = i + 1;
     regitr->seq = list->seq;
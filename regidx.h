@@ -137,10 +137,21 @@ void regidx_destroy(regidx_t *idx);
  *  @param itr:         pointer to iterator, can be NULL if regidx_loop not needed
  *
  *  Returns 0 if there is no overlap or 1 if overlap is found. The overlapping
- *  regions can be iterated as shown in the example above.
+ *  regions can be iterated as shown in the example above. They are returned
+ *  sorted by start; when very long regions overlap many short ones, an interval
+ *  tree is built automatically to avoid scanning through them.
  */
 int regidx_overlap(regidx_t *idx, const char *chr, uint32_t beg, uint32_t end, regitr_t *itr);
 
+/*
+ *  regidx_overlap_sorted() - same as regidx_overlap() but optimized for queries coming
+ *      in increasing order of @beg, such as the positions of a sorted VCF. The iterator
+ *      remembers the last position and the lookup advances from there, falling back to
+ *      a full lookup when the sequence changes or the query moves backward. The @itr
+ *      is required and should not be shared with queries of other indexes.
+ */
+int regidx_overlap_sorted(regidx_t *idx, const char *chr, uint32_t beg, uint32_t end, regitr_t *itr);
+
 /*
  *  regidx_insert() - add a new region. 
  *  regidx_insert_list() - add new regions from a list
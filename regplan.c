@@ -0,0 +1,356 @@
+/*  regplan.c -- planning of balanced region chunks.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <htslib/hts.h>
+#include <htslib/vcf.h>
+#include <htslib/tbx.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "regplan.h"
+
+#define MAX_SLICES 4096     // maximum number of slices per contig
+#define SLICE_RES  16       // number of slices per chunk, the granularity of the split
+
+// A contiguous part of a sequence, the end is inclusive, 0-based
+typedef struct
+{
+    int tid;
+    uint64_t beg, end;
+    double nrec;
+    int whole;      // the whole sequence, the coordinates are not printed
+}
+slice_t;
+
+typedef struct
+{
+    slice_t *slice;
+    int nslice, mslice;
+    regplan_chunk_t *chunk;
+    int nchunk;
+    const char **seq;
+    kstring_t str;
+    int tid;        // the region currently being built in str, merged from adjacent slices
+    uint64_t beg, end;
+    int whole;
+}
+plan_t;
+
+// The compressed file offset where reading of records overlapping beg starts.
+// With last set, the offset where the reading of the sequence ends
+static int64_t index_offset(const hts_idx_t *idx, int tid, uint64_t beg, uint64_t end, int last)
+{
+    hts_itr_t *itr = hts_itr_query(idx, tid, beg, end, NULL);
+    if ( !itr ) return -1;
+    int64_t off = -1;
+    int i;
+    for (i=0; i<itr->n_off; i++)
+    {
+        int64_t o = (last ? itr->off[i].v : itr->off[i].u) >> 16;
+        if ( off<0 || (last && o > off) || (!last && o < off) ) off = o;
+    }
+    hts_itr_destroy(itr);
+    return off;
+}
+
+static void push_slice(plan_t *plan, int tid, uint64_t beg, uint64_t end, double nrec, int whole)
+{
+    plan->nslice++;
+    hts_expand(slice_t, plan->nslice, plan->mslice, plan->slice);
+    slice_t *slice = &plan->slice[plan->nslice-1];
+    slice->tid   = tid;
+    slice->beg   = beg;
+    slice->end   = end;
+    slice->nrec  = nrec;
+    slice->whole = whole;
+}
+
+// Split the sequence into equally long slices and distribute its records by the compressed size of the slices
+static void slice_sequence(plan_t *plan, const hts_idx_t *idx, int tid, uint64_t len, double nrec, int n)
+{
+    if ( n > MAX_SLICES ) n = MAX_SLICES;
+    if ( (uint64_t)n > len ) n = len;
+
+    int i, ok = 1;
+    int64_t *off = (int64_t*) malloc(sizeof(*off)*(n+1));
+    for (i=0; i<n; i++)
+    {
+        off[i] = index_offset(idx, tid, len*i/n, len*i/n + 1, 0);
+        if ( off[i]<0 ) off[i] = i ? off[i-1] : 0;  // no records in the bin
+    }
+    off[n] = index_offset(idx, tid, 0, len, 1);
+    if ( off[n] <= off[0] ) ok = 0;
+    for (i=1; i<=n && ok; i++)
+        if ( off[i] < off[i-1] ) ok = 0;
+
+    for (i=0; i<n; i++)
+    {
+        double frac = ok ? (double)(off[i+1] - off[i]) / (off[n] - off[0]) : 1./n;
+        push_slice(plan, tid, len*i/n, len*(i+1)/n - 1, nrec*frac, 0);
+    }
+    free(off);
+}
+
+static void flush_region(plan_t *plan)
+{
+    if ( plan->tid<0 ) return;
+    if ( plan->str.l ) kputc(',', &plan->str);
+    kputs(plan->seq[plan->tid], &plan->str);
+    if ( !plan->whole ) ksprintf(&plan->str, ":%"PRIu64"-%"PRIu64, plan->beg+1, plan->end+1);
+    plan->tid = -1;
+}
+
+static void close_chunk(plan_t *plan, double nrec)
+{
+    flush_region(plan);
+    regplan_chunk_t *chunk = &plan->chunk[plan->nchunk-1];
+    chunk->regions = strdup(plan->str.s);
+    chunk->nrec = nrec + 0.5;
+    plan->str.l = 0;
+    plan->nchunk++;
+}
+
+regplan_chunk_t *regplan_index(const hts_idx_t *idx, int nseq, const char **seq, const uint64_t *len, int nchunk, int *nout)
+{
+    *nout = 0;
+    if ( nchunk < 1 ) nchunk = 1;
+
+    // The records per sequence. CRAM indexes have no counts and cannot be queried, the length is used
+    // as a proxy, as also when the index has no counts at all
+    int i, j, fmt = hts_idx_fmt((hts_idx_t*)idx);
+    int can_query = fmt==HTS_FMT_CSI || fmt==HTS_FMT_BAI || fmt==HTS_FMT_TBI;
+    double *nrec = (double*) calloc(nseq ? nseq : 1, sizeof(double)), ntot = 0;
+    for (i=0; i<nseq; i++)
+    {
+        uint64_t mapped, unmapped;
+        if ( can_query && hts_idx_get_stat((hts_idx_t*)idx, i, &mapped, &unmapped)==0 ) nrec[i] = mapped;
+        ntot += nrec[i];
+    }
+    if ( !ntot )
+    {
+        // sequences of unknown length may have records too, they get the average length
+        int nlen = 0;
+        for (i=0; i<nseq; i++)
+            if ( len && len[i] ) { ntot += nrec[i] = len[i]; nlen++; }
+        double avg = nlen ? ntot / nlen : 1;
+        for (i=0; i<nseq; i++)
+            if ( !nrec[i] ) ntot += nrec[i] = avg;
+        can_query = 0;
+    }
+    if ( !ntot ) { free(nrec); return NULL; }
+
+    // slice the sequences which do not fit in a chunk
+    plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+    double chunk_size = ntot / nchunk;
+    for (i=0; i<nseq; i++)
+    {
+        if ( !nrec[i] ) continue;
+        if ( nchunk>1 && nrec[i] > chunk_size && len && len[i] )
+        {
+            int n = SLICE_RES * (int)(nrec[i] / chunk_size + 1);
+            if ( can_query )
+                slice_sequence(&plan, idx, i, len[i], nrec[i], n);
+            else
+            {
+                if ( n > MAX_SLICES ) n = MAX_SLICES;
+                if ( (uint64_t)n > len[i] ) n = len[i];
+                for (j=0; j<n; j++) push_slice(&plan, i, len[i]*j/n, len[i]*(j+1)/n - 1, nrec[i]/n, 0);
+            }
+        }
+        else
+            push_slice(&plan, i, 0, len ? len[i] : 0, nrec[i], 1);
+    }
+    free(nrec);
+
+    // Group consecutive slices into chunks of about the same size, adjacent slices of the
+    // same sequence are merged into one region. The target is recalculated from what is
+    // left for the remaining chunks, the last chunk takes the rest
+    plan.chunk = (regplan_chunk_t*) calloc(nchunk, sizeof(regplan_chunk_t));
+    plan.seq = seq;
+    plan.tid = -1;
+    plan.nchunk = 1;
+    double sum = 0, left = ntot;
+    for (i=0; i<plan.nslice; i++)
+    {
+        slice_t *slice = &plan.slice[i];
+        int nleft = nchunk - plan.nchunk;
+        double target = left / (nleft + 1);
+
+        // close the chunk before the slice if that is closer to the target than after
+        if ( nleft && sum > 0 && sum + slice->nrec - target > target - sum )
+        {
+            close_chunk(&plan, sum);
+            left -= sum;
+            sum = 0;
+            nleft--;
+            target = left / (nleft + 1);
+        }
+
+        if ( plan.tid!=slice->tid || plan.whole || slice->whole || plan.end+1!=slice->beg )
+        {
+            flush_region(&plan);
+            plan.tid   = slice->tid;
+            plan.beg   = slice->beg;
+            plan.whole = slice->whole;
+        }
+        plan.end = slice->end;
+        sum += slice->nrec;
+
+        if ( nleft && sum >= target && i+1<plan.nslice )
+        {
+            close_chunk(&plan, sum);
+            left -= sum;
+            sum = 0;
+        }
+    }
+    flush_region(&plan);
+    plan.chunk[plan.nchunk-1].regions = strdup(plan.str.s ? plan.str.s : "");
+    plan.chunk[plan.nchunk-1].nrec = sum + 0.5;
+    free(plan.str.s);
+    free(plan.slice);
+
+    *nout = plan.nchunk;
+    return plan.chunk;
+}
+
+regplan_chunk_t *regplan_vcf(const char *fname, int nchunk, int *nout)
+{
+    *nout = 0;
+    htsFile *fp = hts_open(fname,"r");
+    if ( !fp ) return NULL;
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) { hts_close(fp); return NULL; }
+
+    tbx_t *tbx = NULL;
+    hts_idx_t *idx = NULL;
+    if ( hts_get_format(fp)->format==vcf ) tbx = tbx_index_load(fname);
+    else if ( hts_get_format(fp)->format==bcf ) idx = bcf_index_load(fname);
+
+    regplan_chunk_t *chunks = NULL;
+    if ( tbx || idx )
+    {
+        int i, nseq;
+        const char **seq = tbx ? tbx_seqnames(tbx, &nseq) : bcf_index_seqnames(idx, hdr, &nseq);
+        uint64_t *len = (uint64_t*) calloc(nseq ? nseq : 1, sizeof(uint64_t));
+        for (i=0; i<nseq; i++)
+        {
+            int id = bcf_hdr_name2id(hdr, seq[i]);
+            if ( id>=0 && bcf_hdr_id2length(hdr,BCF_HL_CTG,id) > 0 ) len[i] = bcf_hdr_id2length(hdr,BCF_HL_CTG,id);
+        }
+        chunks = regplan_index(tbx ? tbx->idx : idx, nseq, seq, len, nchunk, nout);
+        free(len);
+        free(seq);
+    }
+    if ( tbx ) tbx_destroy(tbx);
+    if ( idx ) hts_idx_destroy(idx);
+    bcf_hdr_destroy(hdr);
+    if ( hts_close(fp)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,fname);
+    return chunks;
+}
+
+static uint64_t contig_nrec(bcf_sr_t *reader, const char *name)
+{
+    hts_idx_t *idx = reader->tbx_idx ? reader->tbx_idx->idx : reader->bcf_idx;
+    if ( !idx ) return 1;
+    int tid = reader->tbx_idx ? tbx_name2id(reader->tbx_idx, name) : bcf_hdr_name2id(reader->header, name);
+    if ( tid<0 ) return 0;
+    uint64_t mapped, unmapped;
+    if ( hts_idx_get_stat(idx, tid, &mapped, &unmapped)<0 ) return 1;    // no stats, assume non-empty
+    return mapped;
+}
+
+regplan_chunk_t *regplan_contigs(bcf_srs_t *sr, int nchunk, int *nout)
+{
+    *nout = 0;
+    if ( nchunk < 1 ) nchunk = 1;
+    bcf_sr_regions_t *regs = sr->regions;
+    int i, j, n = regs ? regs->nseqs : 0;
+    if ( !n ) return NULL;
+
+    uint64_t *nrec = (uint64_t*) calloc(n, sizeof(*nrec)), ntot = 0, nsum = 0;
+    for (i=0; i<n; i++)
+    {
+        for (j=0; j<sr->nreaders; j++) nrec[i] += contig_nrec(&sr->readers[j], regs->seq_names[i]);
+        ntot += nrec[i];
+    }
+
+    regplan_chunk_t *chunks = (regplan_chunk_t*) calloc(n < nchunk ? n : nchunk, sizeof(regplan_chunk_t));
+    uint64_t target = ntot / nchunk + 1;
+    kstring_t str = {0,0,0};
+    for (i=0; i<n; i++)
+    {
+        if ( !nrec[i] ) continue;
+        if ( str.l ) kputc(',',&str);
+        kputs(regs->seq_names[i], &str);
+        nsum += nrec[i];
+        if ( nsum < target || *nout+1==nchunk ) continue;    // the last chunk takes the rest
+        chunks[*nout].regions = strdup(str.s);
+        chunks[*nout].nrec = nsum;
+        (*nout)++;
+        str.l = 0;
+        nsum = 0;
+    }
+    if ( str.l )
+    {
+        chunks[*nout].regions = strdup(str.s);
+        chunks[*nout].nrec = nsum;
+        (*nout)++;
+    }
+    free(str.s);
+    free(nrec);
+    if ( !*nout ) { free(chunks); return NULL; }
+    return chunks;
+}
+
+void regplan_destroy(regplan_chunk_t *chunks, int nchunk)
+{
+    int i;
+    for (i=0; i<nchunk; i++) free(chunks[i].regions);
+    free(chunks);
+}
+
+char *regplan_tmpdir(const char *dir, const char *def)
+{
+    char *tmp_dir = strdup(dir ? dir : def);
+    size_t len = strlen(tmp_dir);
+    if ( len>=6 && !strcmp("XXXXXX",tmp_dir+len-6) )
+    {
+        if ( !mkdtemp(tmp_dir) ) error("mkdtemp(%s) failed: %s\n", tmp_dir,strerror(errno));
+    }
+    else if ( mkdir(tmp_dir, 0700) && errno!=EEXIST ) error("mkdir(%s) failed: %s\n", tmp_dir,strerror(errno));
+    return tmp_dir;
+}
+
+void regplan_tmpdir_destroy(char *dir)
+{
+    if ( !dir ) return;
+    rmdir(dir);
+    free(dir);
+}
@@ -0,0 +1,110 @@
+/*  regplan.h -- planning of balanced region chunks.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Planning of balanced region chunks for parallel processing.
+
+    The records of an indexed file are split into consecutive chunks with about
+    the same number of records. The per-contig record counts are taken from the
+    index, contigs with more records than fit in a chunk are sliced and the
+    records are distributed between the slices according to their compressed
+    size, estimated from the index offsets. Each chunk is described by a list
+    of regions which can be passed to -r, for example
+
+        int i, n;
+        regplan_chunk_t *chunks = regplan_vcf("in.bcf", 16, &n);
+        for (i=0; i<n; i++)
+            printf("%s\n", chunks[i].regions);  // e.g. "1:1-61000000" or "20,21,22,X"
+        regplan_destroy(chunks, n);
+
+    The commands which process whole contigs in parallel (e.g. merge, annotate,
+    norm, csq or stats with --split-contigs) group the contigs of the synced
+    reader with regplan_contigs() instead, and keep their temporary files in a
+    directory created by regplan_tmpdir().
+
+    Note that a record overlapping two adjacent slices is returned by both
+    regions, use the record position (e.g. -t in addition to -r) to assign
+    it to one chunk only.
+*/
+
+#ifndef __REGPLAN_H__
+#define __REGPLAN_H__
+
+#include <stdint.h>
+#include <htslib/hts.h>
+#include <htslib/synced_bcf_reader.h>
+
+typedef struct
+{
+    char *regions;      // comma-separated list of regions
+    uint64_t nrec;      // estimated number of records
+}
+regplan_chunk_t;
+
+/*
+ *  regplan_index() - plan chunks from an index
+ *  @idx:       CSI, TBI or BAI index. CRAM indexes have no counts, the contigs are then weighted by length
+ *  @nseq:      number of sequences in the index
+ *  @seq:       sequence names, indexed by the index's numeric ids
+ *  @len:       sequence lengths, 0 if not known. Sequences of unknown length are never sliced
+ *  @nchunk:    requested number of chunks
+ *  @nout:      the number of chunks created, can be smaller than nchunk
+ *
+ *  Returns the list of chunks or NULL if there is nothing to split.
+ */
+regplan_chunk_t *regplan_index(const hts_idx_t *idx, int nseq, const char **seq, const uint64_t *len, int nchunk, int *nout);
+
+/*
+ *  regplan_vcf() - same as regplan_index() for an indexed VCF or BCF, the
+ *  contig lengths are taken from the header. Returns NULL on error.
+ */
+regplan_chunk_t *regplan_vcf(const char *fname, int nchunk, int *nout);
+
+/*
+ *  regplan_contigs() - group whole contigs into chunks
+ *  @sr:        synced reader with indexed readers, the contigs are taken from sr->regions
+ *  @nchunk:    requested number of chunks
+ *  @nout:      the number of chunks created, can be smaller than nchunk
+ *
+ *  The number of records of a contig is summed across all readers, contigs
+ *  are never sliced and empty contigs are skipped. The consecutive groups of
+ *  contigs have about the same number of records, the last chunk takes the
+ *  rest. Returns NULL if there is nothing to split.
+ */
+regplan_chunk_t *regplan_contigs(bcf_srs_t *sr, int nchunk, int *nout);
+
+void regplan_destroy(regplan_chunk_t *chunks, int nchunk);
+
+/*
+ *  regplan_tmpdir() - create a directory for the temporary files of chunks
+ *  @dir:       the directory given by the user or NULL for the default
+ *  @def:       the default, e.g. "/tmp/bcftools-merge.XXXXXX"
+ *
+ *  Names ending with XXXXXX are created by mkdtemp(), an existing directory
+ *  is accepted otherwise. Exits on error. The returned name is removed with
+ *  regplan_tmpdir_destroy() once the chunk files have been deleted.
+ */
+char *regplan_tmpdir(const char *dir, const char *def);
+void regplan_tmpdir_destroy(char *dir);
+
+#endif
@@ -529,17 +529,68 @@ static bcf_hdr_t *strip_header(bcf_hdr_t *src, bcf_hdr_t *dst)
     return out;
 }
 
-static void reheader_bcf(args_t *args, int is_compressed)
+/*
+ *  Returns 1 if all FILTER, INFO, FORMAT and contig lines of the old header
+ *  are present in the new header with the same IDX and the number of samples
+ *  did not change. In that case the BCF records do not need to be touched.
+ */
+static int hdr_idx_compatible(const bcf_hdr_t *src, const bcf_hdr_t *dst)
 {
-    htsFile *fp = args->fp;
+    if ( bcf_hdr_nsamples(src)!=bcf_hdr_nsamples(dst) ) return 0;
+    int i;
+    for (i=0; i<src->nhrec; i++)
+    {
+        bcf_hrec_t *src_hrec = src->hrec[i];
+        if ( src_hrec->type!=BCF_HL_FLT && src_hrec->type!=BCF_HL_INFO && src_hrec->type!=BCF_HL_FMT && src_hrec->type!=BCF_HL_CTG ) continue;
+        int j = bcf_hrec_find_key(src_hrec, "ID");
+        if ( j<0 ) return 0;
+        bcf_hrec_t *dst_hrec = bcf_hdr_get_hrec(dst, src_hrec->type, "ID", src_hrec->vals[j], NULL);
+        if ( !dst_hrec ) return 0;
+        int isrc = bcf_hrec_find_key(src_hrec, "IDX");
+        int idst = bcf_hrec_find_key(dst_hrec, "IDX");
+        if ( isrc<0 || idst<0 || strcmp(src_hrec->vals[isrc],dst_hrec->vals[idst]) ) return 0;
+    }
+    return 1;
+}
 
-    if ( args->n_threads > 0 )
+static void reheader_bcf_gz(args_t *args, bcf_hdr_t *hdr_out)
+{
+    BGZF *fp = hts_get_bgzfp(args->fp);
+    if ( !fp ) error("Failed to read %s\n", args->fname);
+
+    // Output the modified header, it is flushed into a separate block
+    htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-","wb");
+    if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
+    if ( bcf_hdr_write(fp_out, hdr_out)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,args->output_fname ? args->output_fname : "standard output");
+    BGZF *bgzf_out = hts_get_bgzfp(fp_out);
+
+    // Output all remainig data read with the header block
+    if ( fp->block_length - fp->block_offset > 0 )
     {
-        args->threads = (htsThreadPool *) calloc(1, sizeof(htsThreadPool));
-        if ( !args->threads ) error("Could not allocate memory\n");
-        if ( !(args->threads->pool = hts_tpool_init(args->n_threads)) ) error("Could not initialize threading\n");
-        hts_set_thread_pool(fp, args->threads);
+        if ( bgzf_write(bgzf_out, (char*)fp->uncompressed_block+fp->block_offset, fp->block_length-fp->block_offset)<0 ) error("Error: %d\n",fp->errcode);
     }
+    if ( bgzf_flush(bgzf_out)<0 ) error("Error: %d\n",bgzf_out->errcode);
+
+    // Stream the rest of the file as it is, without decompressing
+    ssize_t nread;
+    const size_t page_size = 32768;
+    char *buf = (char*) malloc(page_size);
+    while (1)
+    {
+        nread = bgzf_raw_read(fp, buf, page_size);
+        if ( nread<=0 ) break;
+
+        int count = bgzf_raw_write(bgzf_out, buf, nread);
+        if (count != nread) error("Write failed, wrote %d instead of %d bytes.\n", count,(int)nread);
+    }
+    if ( nread<0 ) error("Error reading %s\n", args->fname);
+    free(buf);
+    if ( hts_close(fp_out)!=0 ) error("[%s] Error: failed to close the file %s\n",__func__,args->output_fname ? args->output_fname : "standard output");
+}
+
+static void reheader_bcf(args_t *args, int is_compressed)
+{
+    htsFile *fp = args->fp;
 
     bcf_hdr_t *hdr = bcf_hdr_read(fp); if ( !hdr ) error("Failed to read the header: %s\n", args->fname);
     kstring_t htxt = {0,0,0};
@@ -565,6 +616,27 @@ static void reheader_bcf(args_t *args, int is_compressed)
     if ( bcf_hdr_parse(hdr_out, htxt.s) < 0 ) error("An error occurred while parsing the header\n");
     if ( args->header_fname ) hdr_out = strip_header(hdr, hdr_out);
 
+    // If the dictionary of strings did not change, only the header blocks need rewriting and
+    // the rest can be copied verbatim. The input must not be multithreaded for bgzf_raw_read.
+    if ( args->type.compression==bgzf && hdr_idx_compatible(hdr, hdr_out) )
+    {
+        reheader_bcf_gz(args, hdr_out);
+        free(htxt.s);
+        if ( hts_close(fp)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->fname);
+        bcf_hdr_destroy(hdr_out);
+        bcf_hdr_destroy(hdr);
+        return;
+    }
+
+    // The thread pool can be attached only now, the decompression continues from the next block
+    if ( args->n_threads > 0 )
+    {
+        args->threads = (htsThreadPool *) calloc(1, sizeof(htsThreadPool));
+        if ( !args->threads ) error("Could not allocate memory\n");
+        if ( !(args->threads->pool = hts_tpool_init(args->n_threads)) ) error("Could not initialize threading\n");
+        hts_set_thread_pool(fp, args->threads);
+    }
+
     // write the header and the body
     htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-",is_compressed ? "wb" : "wbu");
     if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
@@ -0,0 +1,311 @@
+/*  test/bench-filter.c -- Filter expressions benchmark on synthetic records.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Generates a set of synthetic records in memory and times filter_init()
+    and filter_test() for a suite of expressions. The records are packed
+    copies, so the time includes unpacking of the queried fields, as with
+    records read from a file. Example:
+
+        ./test/bench-filter -s 10000 -n 2000
+        ./test/bench-filter -s 100 -a 3 -e 'FMT/AD[*:1]>5' -e 'QUAL>10'
+*/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include "filter.h"
+
+#define NREC_POOL 64    // number of distinct records, reused in round-robin
+
+void error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    exit(-1);
+}
+
+static const char *default_exprs[] =
+{
+    "QUAL>50",
+    "INFO/DP>100 && INFO/AF<0.5",
+    "TYPE=\"snp\" && QUAL>50",
+    "FMT/DP>10",
+    "FMT/DP>10 && FMT/GQ>20",
+    "FMT/AD[*:1]>5",
+    "GT=\"alt\"",
+    "N_PASS(GT=\"het\")>10",
+    "F_MISSING<0.1",
+    "MEDIAN(FMT/DP)>10",
+    "SMPL_MAX(FMT/AD)>20",
+    "QUAL>1000 || FMT/DP>10",
+    NULL
+};
+
+static uint64_t rand_state = 0x2545F4914F6CDD1DULL;
+static inline uint32_t rand_next(void)
+{
+    // xorshift64*, deterministic across platforms
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return (rand_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+static double elapsed_ns(struct timespec *beg, struct timespec *end)
+{
+    return (end->tv_sec - beg->tv_sec)*1e9 + (end->tv_nsec - beg->tv_nsec);
+}
+
+static bcf_hdr_t *init_header(int nsmpl)
+{
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    bcf_hdr_append(hdr, "##contig=<ID=1,length=249250621>");
+    bcf_hdr_append(hdr, "##INFO=<ID=DP,Number=1,Type=Integer,Description=\"Total depth\">");
+    bcf_hdr_append(hdr, "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele frequency\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Depth\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype quality\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"Allelic depths\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GL,Number=G,Type=Float,Description=\"Genotype likelihoods\">");
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<nsmpl; i++)
+    {
+        str.l = 0;
+        ksprintf(&str, "S%d", i+1);
+        bcf_hdr_add_sample(hdr, str.s);
+    }
+    bcf_hdr_add_sample(hdr, NULL);
+    if ( bcf_hdr_sync(hdr)!=0 ) error("Failed to initialize the header\n");
+    free(str.s);
+    return hdr;
+}
+
+// Random record with nalt ALT alleles, missing_pct percent of per-sample values are missing
+static bcf1_t *init_record(bcf_hdr_t *hdr, int pos, int nalt, int missing_pct, kstring_t *fmt)
+{
+    static const char acgt[] = "ACGT";
+    int i, j, nsmpl = bcf_hdr_nsamples(hdr), nals = nalt + 1, ngl = nals*(nals+1)/2;
+    bcf1_t *rec = bcf_init();
+    rec->rid = 0;
+    rec->pos = pos;
+    rec->qual = rand_next() % 200;
+
+    kstring_t als = {0,0,0};
+    int is_indel = rand_next() % 10 == 0;
+    kputc(acgt[0], &als);
+    for (i=1; i<nals; i++)
+    {
+        kputc(',', &als);
+        kputc(acgt[i%4], &als);
+        if ( is_indel ) kputc(acgt[(i+1)%4], &als);
+    }
+    bcf_update_alleles_str(hdr, rec, als.s);
+    free(als.s);
+
+    int32_t dp = rand_next() % (nsmpl*30 + 1);
+    bcf_update_info_int32(hdr, rec, "DP", &dp, 1);
+    float *af = (float*) malloc(sizeof(float)*nalt);
+    for (i=0; i<nalt; i++) af[i] = (rand_next() % 1000) / 1000.;
+    bcf_update_info_float(hdr, rec, "AF", af, nalt);
+    free(af);
+
+    int32_t *ivals = (int32_t*) malloc(sizeof(int32_t)*nsmpl*(nals>2?nals:2));
+    float *fvals = (float*) malloc(sizeof(float)*nsmpl*ngl);
+    char *tag = fmt->s;
+    while ( tag && *tag )
+    {
+        char *end = strchr(tag,',');
+        if ( end ) *end = 0;
+        if ( !strcmp(tag,"GT") )
+        {
+            for (i=0; i<nsmpl; i++)
+            {
+                int missing = rand_next() % 100 < missing_pct;
+                for (j=0; j<2; j++)
+                    ivals[i*2+j] = missing ? bcf_gt_missing : bcf_gt_unphased(rand_next() % 3 ? 0 : 1 + rand_next() % nalt);
+            }
+            bcf_update_genotypes(hdr, rec, ivals, nsmpl*2);
+        }
+        else if ( !strcmp(tag,"DP") || !strcmp(tag,"GQ") )
+        {
+            for (i=0; i<nsmpl; i++)
+                ivals[i] = rand_next() % 100 < missing_pct ? bcf_int32_missing : (int32_t)(rand_next() % 60);
+            bcf_update_format_int32(hdr, rec, tag, ivals, nsmpl);
+        }
+        else if ( !strcmp(tag,"AD") )
+        {
+            for (i=0; i<nsmpl; i++)
+            {
+                int missing = rand_next() % 100 < missing_pct;
+                for (j=0; j<nals; j++)
+                    ivals[i*nals+j] = missing ? bcf_int32_missing : (int32_t)(rand_next() % 40);
+            }
+            bcf_update_format_int32(hdr, rec, "AD", ivals, nsmpl*nals);
+        }
+        else if ( !strcmp(tag,"GL") )
+        {
+            for (i=0; i<nsmpl; i++)
+                for (j=0; j<ngl; j++)
+                    fvals[i*ngl+j] = -((rand_next() % 10000) / 100.);
+            bcf_update_format_float(hdr, rec, "GL", fvals, nsmpl*ngl);
+        }
+        else
+            error("The FORMAT tag is not supported: %s\n", tag);
+        if ( !end ) break;
+        *end = ',';
+        tag = end + 1;
+    }
+    free(ivals);
+    free(fvals);
+
+    // pack the record so that filter_test() has to unpack it, as if read from a file
+    bcf1_t *packed = bcf_dup(rec);
+    bcf_destroy(rec);
+    return packed;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Measure the speed of filter expressions on synthetic records\n");
+    fprintf(stderr, "Usage:   bench-filter [options]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -a, --nalt <int>            number of ALT alleles [1]\n");
+    fprintf(stderr, "    -e, --expr <expr>           expression to test, can be given multiple times [standard suite]\n");
+    fprintf(stderr, "    -f, --format <list>         FORMAT tags to generate, any of GT,DP,GQ,AD,GL [GT,DP,GQ,AD]\n");
+    fprintf(stderr, "    -m, --missing <int>         percentage of missing per-sample values [5]\n");
+    fprintf(stderr, "    -n, --nrecords <int>        number of records to test [10000]\n");
+    fprintf(stderr, "    -s, --nsamples <int>        number of samples [1000]\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, nsmpl = 1000, nalt = 1, nrec = 10000, missing_pct = 5, nexpr = 0;
+    char **exprs = NULL;
+    kstring_t fmt = {0,0,0};
+    static struct option loptions[] =
+    {
+        {"nalt",required_argument,NULL,'a'},
+        {"expr",required_argument,NULL,'e'},
+        {"format",required_argument,NULL,'f'},
+        {"missing",required_argument,NULL,'m'},
+        {"nrecords",required_argument,NULL,'n'},
+        {"nsamples",required_argument,NULL,'s'},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    char *tmp;
+    while ((c = getopt_long(argc, argv, "a:e:f:m:n:s:h?",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'a':
+                nalt = strtol(optarg,&tmp,10);
+                if ( *tmp || nalt<1 ) error("Could not parse: --nalt %s\n", optarg);
+                break;
+            case 'e':
+                exprs = (char**) realloc(exprs, sizeof(char*)*(nexpr+1));
+                exprs[nexpr++] = optarg;
+                break;
+            case 'f': fmt.l = 0; kputs(optarg, &fmt); break;
+            case 'm':
+                missing_pct = strtol(optarg,&tmp,10);
+                if ( *tmp || missing_pct<0 || missing_pct>100 ) error("Could not parse: --missing %s\n", optarg);
+                break;
+            case 'n':
+                nrec = strtol(optarg,&tmp,10);
+                if ( *tmp || nrec<1 ) error("Could not parse: --nrecords %s\n", optarg);
+                break;
+            case 's':
+                nsmpl = strtol(optarg,&tmp,10);
+                if ( *tmp || nsmpl<1 ) error("Could not parse: --nsamples %s\n", optarg);
+                break;
+            case 'h':
+            case '?':
+            default: usage(); break;
+        }
+    }
+    if ( !fmt.l ) kputs("GT,DP,GQ,AD", &fmt);
+    if ( !nexpr )
+    {
+        while ( default_exprs[nexpr] ) nexpr++;
+        exprs = (char**) malloc(sizeof(char*)*nexpr);
+        memcpy(exprs, default_exprs, sizeof(char*)*nexpr);
+    }
+
+    bcf_hdr_t *hdr = init_header(nsmpl);
+    bcf1_t *pool[NREC_POOL];
+    int i, j;
+    for (i=0; i<NREC_POOL; i++) pool[i] = init_record(hdr, 100 + i*10, nalt, missing_pct, &fmt);
+
+    // The same records with bcf_copy() only, the cost is included in the timings below
+    struct timespec beg, end;
+    bcf1_t *rec = bcf_init();
+    clock_gettime(CLOCK_MONOTONIC, &beg);
+    for (j=0; j<nrec; j++) bcf_copy(rec, pool[j % NREC_POOL]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("# samples=%d, ALT alleles=%d, FORMAT=%s, missing=%d%%, records=%d\n", nsmpl,nalt,fmt.s,missing_pct,nrec);
+    printf("# [1]init (us)\t[2]ns/record\t[3]ns/sample\t[4]pass\t[5]expression\n");
+    printf("-\t%.1f\t%.3f\t-\t(bcf_copy baseline)\n", elapsed_ns(&beg,&end)/nrec, elapsed_ns(&beg,&end)/nrec/nsmpl);
+
+    for (i=0; i<nexpr; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &beg);
+        filter_t *flt = filter_init(hdr, exprs[i]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double init_ns = elapsed_ns(&beg,&end);
+
+        const uint8_t *smpl_pass = NULL;
+        int npass = 0;
+        clock_gettime(CLOCK_MONOTONIC, &beg);
+        for (j=0; j<nrec; j++)
+        {
+            bcf_copy(rec, pool[j % NREC_POOL]);
+            npass += filter_test(flt, rec, &smpl_pass);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double test_ns = elapsed_ns(&beg,&end);
+        printf("%.1f\t%.1f\t%.3f\t%d\t%s\n", init_ns*1e-3, test_ns/nrec, test_ns/nrec/nsmpl, npass, exprs[i]);
+        filter_destroy(flt);
+    }
+
+    bcf_destroy(rec);
+    for (i=0; i<NREC_POOL; i++) bcf_destroy(pool[i]);
+    bcf_hdr_destroy(hdr);
+    free(exprs);
+    free(fmt.s);
+    return 0;
+}
@@ -0,0 +1,384 @@
+#!/usr/bin/env perl
+#
+#   Copyright (C) 2020 Genome Research Ltd.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+#   Times the main subcommands on synthetic data and writes the throughput
+#   to a tab-delimited file. The data are determined by the options and the
+#   seed, so that runs of different bcftools versions can be compared.
+
+use strict;
+use warnings;
+use Carp;
+use FindBin;
+use Getopt::Long;
+use File::Temp qw/ tempdir /;
+use Time::HiRes qw/ time /;
+
+my @commands = qw(view filter merge norm annotate query stats call csq sort concat);
+
+my $opts = parse_params();
+generate_data($opts);
+run_benchmarks($opts);
+
+exit;
+
+#--------------------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if ( scalar @msg ) { confess @msg; }
+    print
+        "About: Benchmark bcftools subcommands on synthetic data\n",
+        "Usage: bench.pl [OPTIONS]\n",
+        "Options:\n",
+        "   -a, --alts <list>               distribution of the number of ALT alleles [1:0.85,2:0.1,3:0.05]\n",
+        "   -c, --commands <list>           comma-separated list of commands to run [",join(',',@commands),"]\n",
+        "   -e, --exec <tool>=<path>        path to bcftools, bgzip or tabix\n",
+        "   -f, --format <list>             FORMAT tags to generate, a subset of GT,AD,DP,GQ,PL [GT,AD,DP,GQ,PL]\n",
+        "   -i, --indels <float>            fraction of indel sites [0.1]\n",
+        "   -n, --sites <int>               number of sites [100000]\n",
+        "   -o, --output <file>             the results [bench.tsv]\n",
+        "   -r, --repeat <int>              run each command <int> times, report the median and the minimum [3]\n",
+        "   -s, --samples <int>             number of samples [100]\n",
+        "   -S, --seed <int>                random seed [1]\n",
+        "   -t, --temp-dir <path>           keep the data and outputs in <path>, existing data are reused\n",
+        "   -T, --threads <int>             add --threads <int> to the commands which support it [0]\n",
+        "   -h, -?, --help                  This help message.\n",
+        "\n",
+        "Example:\n",
+        "   make bench BENCH_OPTS='-n 1000000 -s 1000 -o bench.1.17.tsv'\n",
+        "\n";
+    exit -1;
+}
+
+sub parse_params
+{
+    my $opts =
+    {
+        bgzip=>"bgzip", tabix=>"tabix", alts=>'1:0.85,2:0.1,3:0.05', format=>'GT,AD,DP,GQ,PL', indels=>0.1,
+        nsites=>100000, nsmpl=>100, repeat=>3, seed=>1, threads=>0, output=>'bench.tsv', commands=>join(',',@commands),
+        keep_files=>'',
+    };
+    my $help;
+    Getopt::Long::Configure('bundling');
+    my $ret = GetOptions (
+            'a|alts=s' => \$$opts{alts},
+            'c|commands=s' => \$$opts{commands},
+            'e|exec=s' => sub { my ($tool, $path) = split /=/, $_[1]; $$opts{$tool} = $path if $path },
+            'f|format=s' => \$$opts{format},
+            'i|indels=f' => \$$opts{indels},
+            'n|sites=i' => \$$opts{nsites},
+            'o|output=s' => \$$opts{output},
+            'r|repeat=i' => \$$opts{repeat},
+            's|samples=i' => \$$opts{nsmpl},
+            'S|seed=i' => \$$opts{seed},
+            't|temp-dir=s' => \$$opts{keep_files},
+            'T|threads=i' => \$$opts{threads},
+            'h|?|help' => \$help
+            );
+    if ( !$ret or $help ) { error(); }
+    if ( $$opts{nsites}<=0 or $$opts{nsmpl}<=0 or $$opts{repeat}<=0 ) { error("Expected positive integers with -n, -s and -r\n"); }
+
+    $$opts{bin} = $FindBin::RealBin;
+    $$opts{bin} =~ s{/test/?$}{};
+    if ( !exists($$opts{bcftools}) ) { $$opts{bcftools} = "$$opts{bin}/bcftools"; }
+
+    $$opts{tmp} = $$opts{keep_files} ? $$opts{keep_files} : tempdir(CLEANUP=>1);
+    if ( $$opts{keep_files} ) { cmd("mkdir -p $$opts{keep_files}"); }
+
+    # cumulative distribution of the number of ALT alleles
+    my $sum = 0;
+    for my $item (split(/,/,$$opts{alts}))
+    {
+        my ($nalt,$frac) = split(/:/,$item);
+        if ( !defined $frac or $nalt!~/^\d+$/ or $nalt<1 or $frac<0 ) { error("Could not parse --alts $$opts{alts}\n"); }
+        $sum += $frac;
+        push @{$$opts{alts_cdf}}, [$nalt,$sum];
+    }
+    if ( !$sum ) { error("Could not parse --alts $$opts{alts}\n"); }
+    for my $item (@{$$opts{alts_cdf}}) { $$item[1] /= $sum; }
+
+    my %known = map { $_=>1 } qw(GT AD DP GQ PL);
+    for my $tag (split(/,/,$$opts{format}))
+    {
+        if ( !$known{$tag} ) { error("The FORMAT tag \"$tag\" is not supported, expected a subset of GT,AD,DP,GQ,PL\n"); }
+        $$opts{fmt}{$tag} = 1;
+    }
+    if ( !$$opts{fmt}{GT} ) { error("The GT tag is required\n"); }
+    $$opts{fmt_str} = join(':', grep { $$opts{fmt}{$_} } qw(GT AD DP GQ PL));   # the order of genotype_pool()
+
+    my %valid = map { $_=>1 } @commands;
+    for my $cmd (split(/,/,$$opts{commands}))
+    {
+        if ( !$valid{$cmd} ) { error("The command \"$cmd\" is not supported\n"); }
+        push @{$$opts{run}}, $cmd;
+    }
+    return $opts;
+}
+
+sub cmd
+{
+    my ($cmd) = @_;
+    open(my $fh,'-|','bash','-o','pipefail','-c',"$cmd 2>&1") or error("Cannot execute the command [$cmd]: $!");
+    my $out = join('',<$fh>);
+    close($fh);
+    if ( $? ) { error("The command failed: $cmd\n", $out); }
+    return $out;
+}
+
+sub random_seq
+{
+    my ($len) = @_;
+    my @acgt = qw(A C G T);
+    return join('', map { $acgt[int(rand(4))] } 1..$len);
+}
+
+sub random_nalt
+{
+    my ($opts) = @_;
+    my $r = rand();
+    for my $item (@{$$opts{alts_cdf}})
+    {
+        if ( $r < $$item[1] ) { return $$item[0]; }
+    }
+    return $$opts{alts_cdf}[-1][0];
+}
+
+# A pool of random sample columns for the given number of alleles. Drawing
+# from the pool keeps the generator fast with many samples while giving each
+# site a realistic mix of genotypes.
+sub genotype_pool
+{
+    my ($opts,$nals) = @_;
+    if ( exists($$opts{gt_pool}{$nals}) ) { return $$opts{gt_pool}{$nals}; }
+    my @pool;
+    for (my $i=0; $i<1024; $i++)
+    {
+        # mostly reference genotypes, the ALT alleles decreasingly frequent
+        my @gt;
+        for my $j (0..1)
+        {
+            my $al = 0;
+            while ( $al<$nals-1 && rand()<0.3 ) { $al++; }
+            push @gt, $al;
+        }
+        @gt = sort { $a<=>$b } @gt;
+        my @fmt = ( rand()<0.02 ? './.' : "$gt[0]/$gt[1]" );
+        my @ad  = map { 0 } 1..$nals;
+        if ( $fmt[0] ne './.' ) { for my $al (@gt) { $ad[$al] += 5 + int(rand(15)); } }
+        my $dp  = 0; $dp += $_ for @ad;
+        if ( $$opts{fmt}{AD} ) { push @fmt, join(',',@ad); }
+        if ( $$opts{fmt}{DP} ) { push @fmt, $dp; }
+        if ( $$opts{fmt}{GQ} ) { push @fmt, int(rand(99)); }
+        if ( $$opts{fmt}{PL} )
+        {
+            my @pl;
+            for my $b (0..$nals-1)
+            {
+                for my $a (0..$b)
+                {
+                    push @pl, ($a==$gt[0] && $b==$gt[1]) ? 0 : 10 + int(rand(200));
+                }
+            }
+            push @fmt, join(',',@pl);
+        }
+        push @pool, join(':',@fmt);
+    }
+    $$opts{gt_pool}{$nals} = \@pool;
+    return \@pool;
+}
+
+sub vcf_header
+{
+    my ($opts,$fh,$prefix) = @_;
+    print $fh "##fileformat=VCFv4.2\n";
+    for my $chr (sort keys %{$$opts{ref}})
+    {
+        print $fh "##contig=<ID=$chr,length=".length($$opts{ref}{$chr}).">\n";
+    }
+    print $fh qq[##INFO=<ID=DP,Number=1,Type=Integer,Description="Total depth">\n];
+    print $fh qq[##FORMAT=<ID=GT,Number=1,Type=String,Description="Genotype">\n];
+    print $fh qq[##FORMAT=<ID=AD,Number=R,Type=Integer,Description="Allelic depths">\n] if $$opts{fmt}{AD};
+    print $fh qq[##FORMAT=<ID=DP,Number=1,Type=Integer,Description="Depth">\n] if $$opts{fmt}{DP};
+    print $fh qq[##FORMAT=<ID=GQ,Number=1,Type=Integer,Description="Genotype quality">\n] if $$opts{fmt}{GQ};
+    print $fh qq[##FORMAT=<ID=PL,Number=G,Type=Integer,Description="Phred-scaled genotype likelihoods">\n] if $$opts{fmt}{PL};
+    print $fh "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT";
+    for (my $i=0; $i<$$opts{nsmpl}; $i++) { print $fh "\t$prefix$i"; }
+    print $fh "\n";
+}
+
+sub generate_data
+{
+    my ($opts) = @_;
+    my $dir = $$opts{tmp};
+    if ( -e "$dir/a.bcf.csi" )
+    {
+        print STDERR "Reusing the data in $dir\n";
+        return;
+    }
+    srand($$opts{seed});
+    print STDERR "Generating $$opts{nsites} sites and $$opts{nsmpl} samples in $dir ...\n";
+
+    # two contigs, so that concat has something to do; sites on average every 50bp
+    my @chrs = ('chr1','chr2');
+    my $chr_len = int($$opts{nsites}/2) * 50 + 10_000;
+    for my $chr (@chrs) { $$opts{ref}{$chr} = random_seq($chr_len); }
+
+    open(my $fa,'>',"$dir/ref.fa") or error("$dir/ref.fa: $!");
+    for my $chr (@chrs)
+    {
+        print $fa ">$chr\n";
+        for (my $i=0; $i<$chr_len; $i+=60) { print $fa substr($$opts{ref}{$chr},$i,60),"\n"; }
+    }
+    close($fa) or error("close failed: $dir/ref.fa");
+
+    # a protein-coding gene every 20kb, one transcript with three 150bp exons
+    open(my $gff,'>',"$dir/genes.gff") or error("$dir/genes.gff: $!");
+    my $igene = 0;
+    for my $chr (@chrs)
+    {
+        for (my $beg=5000; $beg+3000<$chr_len; $beg+=20_000)
+        {
+            $igene++;
+            my $end = $beg + 2150 - 1;
+            print $gff "$chr\t.\tgene\t$beg\t$end\t.\t+\t.\tID=gene:G$igene;Name=G$igene;biotype=protein_coding\n";
+            print $gff "$chr\t.\ttranscript\t$beg\t$end\t.\t+\t.\tID=transcript:T$igene;Parent=gene:G$igene;biotype=protein_coding\n";
+            for my $iexon (0..2)
+            {
+                my $ebeg = $beg + $iexon*1000;
+                my $eend = $ebeg + 149;
+                print $gff "$chr\t.\texon\t$ebeg\t$eend\t.\t+\t.\tParent=transcript:T$igene\n";
+                print $gff "$chr\t.\tCDS\t$ebeg\t$eend\t.\t+\t0\tParent=transcript:T$igene\n";
+            }
+        }
+    }
+    close($gff) or error("close failed: $dir/genes.gff");
+
+    open(my $vcf,"| $$opts{bcftools} view -Ob -o $dir/a.bcf") or error("$$opts{bcftools} view: $!");
+    open(my $tab,"| $$opts{bgzip} -c > $dir/annots.tab.gz") or error("$$opts{bgzip}: $!");
+    vcf_header($opts,$vcf,'A');
+    for my $ichr (0..$#chrs)
+    {
+        my $chr = $chrs[$ichr];
+        my $nsites = $ichr ? $$opts{nsites} - int($$opts{nsites}/2) : int($$opts{nsites}/2);
+        my $pos = 1000;
+        for (my $i=0; $i<$nsites; $i++)
+        {
+            $pos += 1 + int(rand(98));
+            my $ref = substr($$opts{ref}{$chr},$pos-1,1);
+            my $nalt = random_nalt($opts);
+            my @alts;
+            if ( rand() < $$opts{indels} )
+            {
+                # deletions and insertions anchored at the REF base
+                $ref = substr($$opts{ref}{$chr},$pos-1,1+$nalt);
+                for my $j (1..$nalt)
+                {
+                    push @alts, $j%2 ? substr($ref,0,1+$nalt-$j) : $ref.random_seq($j);
+                }
+            }
+            else
+            {
+                my @bases = grep { $_ ne $ref } qw(A C G T);
+                while ( @alts<$nalt && @bases ) { push @alts, splice(@bases,int(rand(scalar @bases)),1); }
+            }
+            my $pool = genotype_pool($opts,1+scalar @alts);
+            my $qual = 10 + int(rand(990));
+            print $vcf "$chr\t$pos\t.\t$ref\t".join(',',@alts)."\t$qual\t.\tDP=".int(rand(10000))."\t$$opts{fmt_str}";
+            for (my $j=0; $j<$$opts{nsmpl}; $j++) { print $vcf "\t", $$pool[int(rand(scalar @$pool))]; }
+            print $vcf "\n";
+            for my $alt (@alts) { print $tab "$chr\t$pos\t$ref\t$alt\t".sprintf("%.3f",rand())."\n"; }
+            $pos += length($ref);
+        }
+    }
+    close($vcf) or error("close failed: $$opts{bcftools} view");
+    close($tab) or error("close failed: $dir/annots.tab.gz");
+
+    cmd("$$opts{tabix} -f -s1 -b2 -e2 $dir/annots.tab.gz");
+    cmd(qq[echo '##INFO=<ID=SCORE,Number=A,Type=Float,Description="Random score">' > $dir/annots.hdr]);
+
+    # the same sites in a second set of samples for merge, and one file per contig for concat
+    cmd(qq[$$opts{bcftools} query -l $dir/a.bcf | sed 's/^A/B/' > $dir/b.samples]);
+    cmd("$$opts{bcftools} reheader -s $dir/b.samples -o $dir/b.bcf $dir/a.bcf");
+    cmd("$$opts{bcftools} index -f $dir/b.bcf");
+    for my $chr (@chrs)
+    {
+        cmd("$$opts{bcftools} view -Ob -o $dir/a.$chr.bcf -t $chr $dir/a.bcf");
+    }
+
+    # the index marks the data as complete, see the check above
+    cmd("$$opts{bcftools} index -f $dir/a.bcf");
+}
+
+sub run_benchmarks
+{
+    my ($opts) = @_;
+    my $bcftools = $$opts{bcftools};
+    my $dir  = $$opts{tmp};
+    my $thr = $$opts{threads} ? "--threads $$opts{threads} " : '';
+    my $out  = "-Ob -o $dir/out.bcf";
+    my %cmds =
+    (
+        view     => "view $thr$out $dir/a.bcf",
+        filter   => "filter $thr-e 'QUAL<100 || INFO/DP<1000' -s LowQual $out $dir/a.bcf",
+        merge    => "merge $thr$out $dir/a.bcf $dir/b.bcf",
+        norm     => "norm $thr-f $dir/ref.fa -m -any $out $dir/a.bcf",
+        annotate => "annotate $thr-a $dir/annots.tab.gz -h $dir/annots.hdr -c CHROM,POS,REF,ALT,SCORE $out $dir/a.bcf",
+        query    => "query -f '%CHROM\\t%POS\\t%REF\\t%ALT[\\t%GT]\\n' -o $dir/out.txt $dir/a.bcf",
+        stats    => "stats $thr-s - $dir/a.bcf > $dir/out.txt",
+        call     => "call $thr-m $out $dir/a.bcf",
+        csq      => "csq $thr-f $dir/ref.fa -g $dir/genes.gff -p a $out $dir/a.bcf",
+        sort     => "sort -T $dir/sort.XXXXXX $out $dir/a.bcf",
+        concat   => "concat $thr$out $dir/a.chr1.bcf $dir/a.chr2.bcf",
+    );
+    if ( !$$opts{fmt}{PL} ) { delete($cmds{call}); }
+
+    my $version = cmd("$bcftools --version-only");
+    chomp($version);
+
+    open(my $fh,'>',$$opts{output}) or error("$$opts{output}: $!");
+    print $fh "# This file was produced by test/bench.pl, bcftools $version\n";
+    print $fh "# sites=$$opts{nsites} samples=$$opts{nsmpl} alts=$$opts{alts} format=$$opts{format} indels=$$opts{indels} seed=$$opts{seed} threads=$$opts{threads} repeat=$$opts{repeat}\n";
+    print $fh "# [1]command\t[2]median seconds\t[3]minimum seconds\t[4]records\t[5]samples\t[6]records/s\t[7]samples*records/s\t[8]command line\n";
+    for my $name (@{$$opts{run}})
+    {
+        if ( !exists($cmds{$name}) ) { print STDERR "Skipping $name, the input has no PL\n"; next; }
+        my $cmd = "$bcftools $cmds{$name}";
+        my @times;
+        for (my $i=0; $i<$$opts{repeat}; $i++)
+        {
+            my $start = time();
+            cmd($cmd);
+            push @times, time() - $start;
+        }
+        @times = sort { $a<=>$b } @times;
+        my $median = $times[int(@times/2)];
+        my $nsmpl  = $name eq 'merge' ? 2*$$opts{nsmpl} : $$opts{nsmpl};
+        my $rate   = $median>0 ? $$opts{nsites}/$median : 0;
+        my @row    = ($name, sprintf("%.3f",$median), sprintf("%.3f",$times[0]), $$opts{nsites}, $nsmpl,
+                      sprintf("%.0f",$rate), sprintf("%.0f",$rate*$nsmpl), $cmd);
+        print $fh join("\t",@row),"\n";
+        printf STDERR "%-10s %8.3fs %12.0f records/s\n", $name, $median, $rate;
+    }
+    close($fh) or error("close failed: $$opts{output}");
+    print STDERR "The results were written to $$opts{output}\n";
+}
@@ -0,0 +1,165 @@
+/*  test/test-hmm.c -- HMM forward-backward test harness.
+
+    Copyright (C) 2020 Genome Research Ltd.
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Runs hmm_run_fwd_bwd() and hmm_run_fwd_bwd_ckpt() on the same random data
+    and checks that the posteriors are bitwise identical.
+*/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "HMM.h"
+
+void error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    exit(-1);
+}
+
+static uint32_t rand_state = 1;
+static uint32_t next_rand(void)
+{
+    rand_state = rand_state*1103515245 + 12345;
+    return (rand_state>>8) & 0xffffff;
+}
+static double next_prob(void) { return (next_rand()+1.0)/(0xffffff+2.0); }
+
+// Distance-dependent modification of the transition matrix, as roh does with a genetic map
+static void set_tprob(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob)
+{
+    int i, j, nstates = hmm_get_nstates(hmm);
+    double scale = 1.0 / (1 + (pos - prev_pos) % 7);
+    for (j=0; j<nstates; j++)
+    {
+        double sum = 0;
+        for (i=0; i<nstates; i++)
+            if ( i!=j ) { MAT(tprob,nstates,i,j) *= scale; sum += MAT(tprob,nstates,i,j); }
+        MAT(tprob,nstates,j,j) = 1 - sum;
+    }
+}
+
+typedef struct
+{
+    int nstates, nsites;
+    double *prob;
+}
+ckpt_dat_t;
+
+static void store_prob(hmm_t *hmm, int isite, double *fwd_bwd, void *data)
+{
+    ckpt_dat_t *dat = (ckpt_dat_t*) data;
+    if ( isite<0 || isite>=dat->nsites ) error("Unexpected site %d, nsites=%d\n", isite,dat->nsites);
+    memcpy(dat->prob + isite*dat->nstates, fwd_bwd, sizeof(double)*dat->nstates);
+}
+
+static hmm_t *init_hmm(int nstates, int ntprob, int user_tprob)
+{
+    int i, j;
+    double *tprob = (double*) malloc(sizeof(double)*nstates*nstates);
+    for (i=0; i<nstates; i++)
+        for (j=0; j<nstates; j++)
+            MAT(tprob,nstates,i,j) = i==j ? 1 - 1e-3*(nstates-1) : 1e-3;
+    hmm_t *hmm = hmm_init(nstates, tprob, ntprob);
+    if ( user_tprob ) hmm_set_tprob_func(hmm, set_tprob, NULL);
+    free(tprob);
+    return hmm;
+}
+
+// Run both algorithms on the same sites, optionally continuing from a snapshot
+static void compare(hmm_t *hmm, hmm_t *hmm_ckpt, int nstates, int nsites, double *eprob, uint32_t *sites, uint32_t snap_pos, const char *desc)
+{
+    int i;
+    void *snap = NULL, *snap_ckpt = NULL;
+    if ( snap_pos )
+    {
+        snap = hmm_snapshot(hmm, NULL, snap_pos);
+        snap_ckpt = hmm_snapshot(hmm_ckpt, NULL, snap_pos);
+    }
+
+    hmm_run_fwd_bwd(hmm, nsites, eprob, sites);
+    double *fwd = hmm_get_fwd_bwd_prob(hmm);
+
+    ckpt_dat_t dat;
+    dat.nstates = nstates;
+    dat.nsites  = nsites;
+    dat.prob    = (double*) malloc(sizeof(double)*nsites*nstates);
+    for (i=0; i<nsites*nstates; i++) dat.prob[i] = -1;
+    hmm_run_fwd_bwd_ckpt(hmm_ckpt, nsites, eprob, sites, store_prob, &dat);
+
+    if ( memcmp(fwd, dat.prob, sizeof(double)*nsites*nstates) )
+    {
+        for (i=0; i<nsites*nstates; i++)
+            if ( fwd[i]!=dat.prob[i] ) break;
+        error("%s: the posteriors differ at site %d, state %d: %e vs %e\n", desc,i/nstates,i%nstates,fwd[i],dat.prob[i]);
+    }
+    free(dat.prob);
+
+    if ( !snap_pos ) return;
+
+    // continue from the snapshot as roh does with buffered sites
+    for (i=0; i<nsites && sites[i]<=snap_pos; i++) ;
+    hmm_restore(hmm, snap);
+    hmm_restore(hmm_ckpt, snap_ckpt);
+    if ( i<nsites ) compare(hmm, hmm_ckpt, nstates, nsites-i, eprob + i*nstates, sites + i, 0, desc);
+    free(snap);
+    free(snap_ckpt);
+}
+
+int main(int argc, char **argv)
+{
+    int nstates_list[] = { 2, 4 }, ntprob_list[] = { 0, 1, 10 }, nsites_list[] = { 1, 2, 3, 10, 99, 100, 101, 1000 };
+    int is, it, in, iu, i;
+    char desc[200];
+    for (is=0; is<2; is++)
+    for (it=0; it<3; it++)
+    for (iu=0; iu<2; iu++)
+    for (in=0; in<8; in++)
+    {
+        int nstates = nstates_list[is], ntprob = ntprob_list[it], nsites = nsites_list[in];
+        double *eprob = (double*) malloc(sizeof(double)*nsites*nstates);
+        uint32_t *sites = (uint32_t*) malloc(sizeof(uint32_t)*nsites);
+        uint32_t pos = 1 + next_rand() % 100;
+        for (i=0; i<nsites; i++)
+        {
+            sites[i] = pos;
+            pos += next_rand() % 4 ? 1 + next_rand() % 30 : 1 + next_rand() % 5000;    // occasional long jumps
+        }
+        for (i=0; i<nsites*nstates; i++) eprob[i] = next_prob();
+
+        snprintf(desc,sizeof(desc),"nstates=%d ntprob=%d set_tprob=%d nsites=%d", nstates,ntprob,iu,nsites);
+        hmm_t *hmm = init_hmm(nstates, ntprob, iu);
+        hmm_t *hmm_ckpt = init_hmm(nstates, ntprob, iu);
+        compare(hmm, hmm_ckpt, nstates, nsites, eprob, sites, nsites>1 ? sites[nsites/2] : 0, desc);
+        hmm_destroy(hmm);
+        hmm_destroy(hmm_ckpt);
+        free(eprob);
+        free(sites);
+    }
+    return 0;
+}
@@ -226,6 +226,96 @@ void test_random(int nregs, uint32_t min, uint32_t max)
     regidx_destroy(idx);
     free(str.s);
 }
+void test_skewed(int nshort, int nlong, uint32_t max)
+{
+    // Many short regions under a few long ones, the case which triggers the interval tree
+    regidx_t *idx = regidx_init(NULL,NULL,NULL,0,NULL);
+    if ( !idx ) error("init failed\n");
+
+    uint32_t *beg = (uint32_t*) malloc(sizeof(*beg)*(nshort+nlong));
+    uint32_t *end = (uint32_t*) malloc(sizeof(*end)*(nshort+nlong));
+    int i, j, n = nshort + nlong;
+    kstring_t str = {0,0,0};
+    for (i=0; i<n; i++)
+    {
+        if ( i<nlong ) get_random_region(0,max/10,&beg[i],&end[i]), end[i] = max - end[i];
+        else { beg[i] = random() % max; end[i] = beg[i] + random() % 100; }
+        str.l = 0;
+        ksprintf(&str,"1\t%"PRIu32"\t%"PRIu32,beg[i]+1,end[i]+1);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+    }
+
+    regitr_t *itr = regitr_init(idx);
+    for (j=0; j<100; j++)
+    {
+        uint32_t qbeg, qend;
+        get_random_region(0,max+max/10,&qbeg,&qend);
+        if ( qend - qbeg > 1000 ) qend = qbeg + 1000;
+        int nexp = 0, nhit = 0;
+        for (i=0; i<n; i++)
+            if ( end[i]>=qbeg && beg[i]<=qend ) nexp++;
+        uint32_t prev_beg = 0;
+        int ret = regidx_overlap(idx,"1",qbeg,qend,itr);
+        while ( ret && regitr_overlap(itr) )
+        {
+            if ( itr->beg > qend || itr->end < qbeg )
+                error("query failed, incorrect hit: %d-%d vs %d-%d\n", qbeg+1,qend+1,itr->beg+1,itr->end+1);
+            if ( itr->beg < prev_beg )
+                error("query failed, hits out of order: %d-%d\n", qbeg+1,qend+1);
+            prev_beg = itr->beg;
+            nhit++;
+        }
+        if ( nexp!=nhit ) error("query failed, expected %d overlap(s), found %d: %d-%d\n",nexp,nhit,qbeg+1,qend+1);
+    }
+
+    regitr_destroy(itr);
+    regidx_destroy(idx);
+    free(beg);
+    free(end);
+    free(str.s);
+}
+void test_sorted(int nregs, uint32_t max)
+{
+    // Queries in increasing order with an occasional jump back and to another sequence
+    // must give the same hits with regidx_overlap_sorted() as with regidx_overlap()
+    regidx_t *idx = regidx_init(NULL,NULL,NULL,0,NULL);
+    if ( !idx ) error("init failed\n");
+
+    int i;
+    kstring_t str = {0,0,0};
+    for (i=0; i<nregs; i++)
+    {
+        uint32_t beg = random() % max, end = beg + (random()%10 ? random() % 100 : random() % max);
+        str.l = 0;
+        ksprintf(&str,"%d\t%"PRIu32"\t%"PRIu32,1+i%2,beg+1,end+1);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+    }
+
+    regitr_t *itr = regitr_init(idx), *exp_itr = regitr_init(idx);
+    uint32_t pos = 0;
+    for (i=0; i<1000; i++)
+    {
+        if ( random()%50 ) pos += random() % (2*max/1000);
+        else pos = random() % max;
+        uint32_t end = pos + random() % 100;
+        const char *chr = (i/100)%2 ? "2" : "1";
+        int ret = regidx_overlap_sorted(idx,chr,pos,end,itr);
+        int exp = regidx_overlap(idx,chr,pos,end,exp_itr);
+        if ( ret!=exp ) error("query failed, expected %d, found %d: %s:%d-%d\n",exp,ret,chr,pos+1,end+1);
+        while ( ret && regitr_overlap(exp_itr) )
+        {
+            if ( !regitr_overlap(itr) ) error("query failed, missing hit %d-%d: %s:%d-%d\n",exp_itr->beg+1,exp_itr->end+1,chr,pos+1,end+1);
+            if ( itr->beg!=exp_itr->beg || itr->end!=exp_itr->end )
+                error("query failed, expected %d-%d, found %d-%d: %s:%d-%d\n",exp_itr->beg+1,exp_itr->end+1,itr->beg+1,itr->end+1,chr,pos+1,end+1);
+        }
+        if ( ret && regitr_overlap(itr) ) error("query failed, extra hit %d-%d: %s:%d-%d\n",itr->beg+1,itr->end+1,chr,pos+1,end+1);
+    }
+
+    regitr_destroy(itr);
+    regitr_destroy(exp_itr);
+    regidx_destroy(idx);
+    free(str.s);
+}
 void test_explicit(char *tgt, char *qry, char *exp)
 {
     regidx_t *idx = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
@@ -438,6 +528,13 @@ int main(int argc, char **argv)
     info("%d randomized tests, %d regions per test. Random seed is %d\n", ntest,nreg,seed);
     for (i=0; i<ntest; i++) test_random(nreg,1,1000);
 
+    info("Testing skewed region lengths\n");
+    for (i=0; i<10; i++) test_skewed(10000,5,10000000);
+
+    info("Testing sorted queries\n");
+    for (i=0; i<10; i++) test_sorted(1000,100000);
+    for (i=0; i<10; i++) test_sorted(10000,10000000);
+
     return 0;
 }
 
@@ -42,11 +42,19 @@ test_vcf_idxstats($opts,in=>'idx',args=>'-s',out=>'idx.out');
 test_vcf_idxstats($opts,in=>'idx',args=>'-n',out=>'idx_count.out');
 test_vcf_idxstats($opts,in=>'empty',args=>'-s',out=>'empty.idx.out');
 test_vcf_idxstats($opts,in=>'empty',args=>'-n',out=>'empty.idx_count.out');
+test_vcf_idxstats($opts,in=>'index.plan',args=>'--plan 1',out=>'index.plan.1.out');
+test_vcf_idxstats($opts,in=>'index.plan',args=>'--plan 3',out=>'index.plan.3.out');
+test_vcf_idxstats($opts,in=>'index.plan',args=>'--plan 4',out=>'index.plan.4.out');
 test_vcf_check($opts,in=>'check',out=>'check.chk');
 test_vcf_check_merge($opts,in=>'check',out=>'check_merge.chk');
 test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.chk',args=>'-s -');
 test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.B.chk',args=>'-s B');
 test_vcf_stats($opts,in=>['stats.counts'],out=>'stats.counts.chk',args=>'-s -');
+test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.chk',args=>'-s - --split-contigs --threads 2');
+test_vcf_stats($opts,in=>['stats.counts'],out=>'stats.counts.chk',args=>'-s - --split-contigs --threads 2');
+test_vcf_stats_partial($opts,in=>['stats.a','stats.b'],out=>'stats.chk',args=>'-s -',regions=>['1:1-1001','1:1002-']);
+test_vcf_stats_partial($opts,in=>['stats.counts'],out=>'stats.counts.chk',args=>'-s -',regions=>['1','X']);
+test_vcf_stats_snapshot($opts,in=>'stats.counts',args=>'-s -',every=>10,targets=>'1');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.out',args=>'-n =2');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.flt.out',args=>'-n =2 -i"STRLEN(REF)==2"');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.both.out',args=>'-n =2 -c both');
@@ -60,6 +68,9 @@ test_vcf_isec($opts,in=>['isec-miss.2.1','isec-miss.2.2','isec-miss.2.3'],out=>'
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.2.out',args=>'--force-samples -Fx');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.3.out',args=>'--force-samples -0');
+test_vcf_merge_parallel($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples');
+test_vcf_merge_parallel($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.2.out',args=>'--force-samples -Fx');
+test_vcf_merge_parallel($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.3.out',args=>'--force-samples -0');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.none.out',args=>'--force-samples -m none');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.both.out',args=>'--force-samples -m both');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.all.out',args=>'--force-samples -m all');
@@ -70,6 +81,7 @@ test_vcf_merge($opts,in=>['merge.gvcf.2.a','merge.gvcf.2.b','merge.gvcf.2.c'],ou
 test_vcf_merge($opts,in=>['merge.gvcf.3.a','merge.gvcf.3.b'],out=>'merge.gvcf.3.out',args=>'--gvcf - -i SRC:join');
 test_vcf_merge($opts,in=>['merge.gvcf.4.a','merge.gvcf.4.b'],out=>'merge.gvcf.4.out',args=>'--gvcf -');
 test_vcf_merge($opts,in=>['merge.5.a','merge.5.b'],out=>'merge.5.out');
+test_vcf_merge_buffer_stats($opts,in=>['merge.dense.a','merge.dense.b'],out=>'merge.dense.buffer-stats.out');
 test_vcf_merge($opts,in=>['merge.6.a','merge.6.b'],out=>'merge.6.out');
 test_vcf_merge($opts,in=>['merge.gvcf.7.a','merge.gvcf.7.b'],out=>'merge.gvcf.7.out',args=>'--gvcf -');
 test_vcf_merge($opts,in=>['merge.gvcf.8.a','merge.gvcf.8.b'],out=>'merge.gvcf.8.out',args=>'--gvcf -');
@@ -90,6 +102,7 @@ test_vcf_query($opts,in=>'query.string',out=>'query.string.1.out',args=>q[-f '%C
 test_vcf_query($opts,in=>'query.string',out=>'query.string.2.out',args=>q[-f '%CHROM\\t%POS\\t%CLNREVSTAT\\n' -i'CLNREVSTAT="criteria_provided" && CLNREVSTAT="_conflicting_interpretations"']);
 test_vcf_query($opts,in=>'query',out=>'query.out',args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n']);
 test_vcf_query($opts,in=>'query.variantkey',out=>'query.variantkey.hex.out',args=>q[-f '%RSX\\t%VKX\\n']);
+test_vcf_query_columnar($opts,in=>'query',fmt=>q[%CHROM\\t%POS\\t%FILTER\\t%REF\\t%ALT\\t%DP4\\t%DP4{1}\\t%AN[\\t%GT\\t%DP]\\n]);
 test_vcf_query($opts,in=>'view.filter',out=>'query.2.out',args=>q[-f'%XRI\\n' -i'XRI[*]>1111']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.3.out',args=>q[-f'%XRF\\n' -i'XRF[*]=2e6']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.4.out',args=>q[-f'%XGS\\n' -i'XGS[5]="PQR"']);
@@ -189,6 +202,7 @@ test_vcf_query($opts,in=>'query.filter.10',out=>'query.74.out',args=>q[-f'%POS
 test_vcf_query($opts,in=>'query',out=>'query.75.out',args=>q[-f '%CHROM:%POS\\t%N_PASS(GT="alt" & GQ>110)\\t[\\t%GT]\\t[\\t%GQ]\n']);
 test_vcf_norm($opts,in=>'norm',out=>'norm.out',fai=>'norm',args=>'-cx');
 test_vcf_norm($opts,in=>'norm.split',out=>'norm.split.out',args=>'-m-');
+test_profile_json($opts,in=>'norm.split',out=>'norm.split.profile.out',cmd=>'norm -m- -o /dev/null');
 test_vcf_norm($opts,in=>'norm.split.2',out=>'norm.split.2.out',args=>'-m-');
 test_vcf_norm($opts,in=>'norm.split.3',out=>'norm.split.3.out',args=>'-m- --force');
 test_vcf_norm($opts,in=>'norm.split.4',out=>'norm.split.4.1.out',args=>'-m-');
@@ -213,6 +227,9 @@ test_vcf_norm($opts,in=>'norm.rmdup.2',out=>'norm.rmdup.2.2.out',args=>'-d any')
 test_vcf_norm($opts,in=>'norm.rmdup.2',out=>'norm.rmdup.2.2.out',args=>'-d both');
 test_vcf_norm($opts,in=>'norm.rmdup.2',out=>'norm.rmdup.2.2.out',args=>'-d snps');
 test_vcf_norm($opts,in=>'norm.2',fai=>'norm.2',out=>'norm.2.out',args=>'');
+test_refimage($opts,fa=>'refimage',out=>'refimage.out');
+test_refimage($opts,fa=>'norm',in=>'norm',cmds=>['norm --no-version -cx -f {REF} {IN}','stats -F {REF} {IN} | grep -v ^# | grep -v ^ID']);
+test_refimage($opts,fa=>'csq',in=>'csq',cmds=>['csq --no-version -f {REF} -g {PATH}/csq.gff3 {IN}']);
 test_vcf_view($opts,in=>'view',out=>'view.1.out',args=>'-aUc1 -C1 -s NA00002 -v snps',reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.2.out',args=>'-f PASS -Xks NA00003',reg=>'-r20,Y');
 test_vcf_view($opts,in=>'view',out=>'view.3.out',args=>'-xs NA00003',reg=>'');
@@ -281,6 +298,8 @@ test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.1.out',args=>'-cv');
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.samples');
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.ped');
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.2.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples');
+test_vcf_filter_perl($opts,in=>'perl-flt',script=>'misc/demo-flt.pl',expr=>q[perl.severity(INFO/CSQ) > 10],batch=>q[perl.batch.severity_batch(INFO/CSQ) > 10]);
+test_vcf_filter_perl($opts,in=>'perl-flt',script=>'misc/demo-flt.pl',expr=>q[POS>1 && perl.severity(INFO/CSQ) > 3],batch=>q[POS>1 && perl.batch.severity_batch(INFO/CSQ) > 3]);
 test_vcf_filter($opts,in=>'view.filter',out=>'view.filter.6.out',args=>q[-S. -e'TXT0="text"'],reg=>'');
 test_vcf_filter($opts,in=>'view.filter',out=>'view.filter.7.out',args=>q[-S. -e'FMT/FRS[*:1]="BB"'],reg=>'');
 test_vcf_filter($opts,in=>'view.filter',out=>'view.filter.8.out',args=>q[-S. -e'FMT/FGS[*:0]="AAAAAA"'],reg=>'');
@@ -350,8 +369,25 @@ test_vcf_filter($opts,in=>'filter.9',out=>'filter.35.out',args=>q[-i 'QUAL/INFO/
 test_vcf_filter($opts,in=>'filter.8',out=>'filter.36.out',args=>q[-S . -e 'ABS(SMPL_MAX(FORMAT/AO))=5']);
 test_vcf_filter($opts,in=>'filter.8',out=>'filter.37.out',args=>q[-S . -e 'PHRED(AO[1:])>-4']);
 test_vcf_filter($opts,in=>'filter.8',out=>'filter.37.out',args=>q[-S . -e 'ABS(AO[1:])==2']);
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-i 'QUAL/2>30'],args=>[q[-i 'QUAL>60'],q[-i 'QUAL>2*30'],q[-i 'QUAL>1+2*3-4/2+55']],fmt=>'%POS\\t%QUAL\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-i 'QUAL/0>1e300'],args=>[q[-i 'QUAL<1/0'],q[-i 'QUAL>-1/0']],fmt=>'%POS\\t%QUAL\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-e 'QUAL<QUAL/0'],args=>[q[-e 'QUAL<1/0'],q[-i 'QUAL>1/0']],fmt=>'%POS\\t%QUAL\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-S . -i 'FMT/DP/2>15'],args=>[q[-S . -i 'FMT/DP>2*(20-5)'],q[-S . -i 'FMT/DP>90/3']],fmt=>'%POS[\\t%GT:%DP]\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-i 'TEST>3 || QUAL>50'],args=>[q[-i 'QUAL>50 || TEST>3'],q[-i 'QUAL>50 | TEST>3']],fmt=>'%POS\\t%QUAL\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-i 'DP4[0]=1 && TEST=5'],args=>[q[-i 'TEST=5 && DP4[0]=1'],q[-i 'TEST=5 & DP4[0]=1']],fmt=>'%POS\\t%QUAL\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-S . -i 'FMT/DP>30 && QUAL>50'],args=>[q[-S . -i 'QUAL>50 && FMT/DP>30'],q[-S . -i 'QUAL>50 & FMT/DP>30']],fmt=>'%POS[\\t%GT:%DP]\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-S . -i 'FMT/DP>30 || QUAL>100'],args=>[q[-S . -i 'QUAL>100 || FMT/DP>30'],q[-S . -i 'QUAL>100 | FMT/DP>30']],fmt=>'%POS[\\t%GT:%DP]\\n');
+test_vcf_filter_same($opts,in=>'filter.2',exp_args=>q[-S . -i 'FMT/GQ>100 && TEST=5'],args=>[q[-S . -i 'TEST=5 && FMT/GQ>100'],q[-S . -i 'TEST>3 && (QUAL>100 || FMT/GQ>100)']],fmt=>'%POS[\\t%GT:%GQ]\\n');
+test_vcf_filter_multi($opts,in=>'filter.2',args=>'-m+',exprs=>[q[-s LowQual -e 'QUAL<50'],q[-s LowDP -e 'FMT/DP<30'],q[-s Test5 -i 'TEST=5']],fmt=>'%POS\\t%FILTER\\n');
+test_vcf_filter_multi($opts,in=>'filter.2',args=>'-m+',exprs=>[q[-s LowDP -e 'FMT/DP<30'],q[-s HighDP -e 'FMT/DP>34 && QUAL>50']],fmt=>'%POS\\t%FILTER\\n');
 test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>q[-m 0],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
 test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>q[-m 1000],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
+test_vcf_sort($opts,in=>'sort',out=>'sort.out',args=>q[-m 0 --threads 2],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
+test_vcf_sort($opts,in=>'sort.runs',out=>'sort.runs.out',args=>q[-m 0],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
+test_vcf_sort($opts,in=>'sort.runs',out=>'sort.runs.out',args=>q[-m 1000],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
+test_vcf_sort($opts,in=>'sort.runs',out=>'sort.runs.out',args=>q[-m 0 --threads 2],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
+test_vcf_sort_partitions($opts,in=>'sort',out=>'sort.out',partitions=>['1','2 1 100','2 101 102','2 103 1000','3'],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
+test_vcf_sort_partitions($opts,in=>'sort.runs',out=>'sort.runs.out',args=>q[-m 0],partitions=>['1 1 105','1 106 1000','2'],fmt=>'%CHROM\\t%POS\\t%REF,%ALT\\n');
 test_vcf_regions($opts,in=>'regions');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>'-c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate2',out=>'annotate2.out',args=>'-c CHROM,POS,-,T_STR');
@@ -396,6 +432,13 @@ test_vcf_plugin($opts,in=>'setGT.2',out=>'setGT.2.out',cmd=>'+setGT --no-version
 test_vcf_plugin($opts,in=>'setGT.2',out=>'setGT.3.out',cmd=>'+setGT --no-version',args=>'-- -t q -n . -i \'GT[@{QPATH}/setGT.samples.txt]="het" & binom(AD[@{QPATH}/setGT.samples.txt])<0.1\'');
 test_vcf_annotate($opts,in=>'annotate9',tab=>'annots9',out=>'annotate9.out',args=>'-c CHROM,POS,REF,ALT,+ID');
 test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version');
+test_vcf_plugin_chain($opts,in=>'plugin1',chain=>['+setGT -- -t . -n 0','+fill-tags -- -t AN,AC']);
+test_vcf_plugin_chain($opts,in=>'view',chain=>['+fill-tags -- -t AC,AN,AF','+setGT -- -t q -n . -i \'FMT/DP<5\'','+missing2ref -- ']);
+test_vcf_plugin_split($opts,in=>'view',args=>'--max-open 1');
+test_vcf_plugin_split($opts,in=>'view',args=>'--max-open 2 --threads 2');
+# fill-tags alone goes through process_batch(), in a chain through process()
+test_vcf_plugin_chain($opts,in=>'fill-tags-hwe',chain=>['+missing2ref -- ','+fill-tags -- -t all,END,TYPE,F_MISSING']);
+test_vcf_plugin_chain($opts,in=>'fill-tags-hemi',chain=>['+missing2ref -- ','+fill-tags -- -d']);
 test_vcf_plugin($opts,in=>'dosage',out=>'dosage.1.out',cmd=>'+dosage',args=>'-- -t PL');
 test_vcf_plugin($opts,in=>'dosage',out=>'dosage.2.out',cmd=>'+dosage',args=>'-- -t GL');
 test_vcf_plugin($opts,in=>'dosage',out=>'dosage.3.out',cmd=>'+dosage',args=>'-- -t GT');
@@ -437,6 +480,7 @@ test_vcf_plugin($opts,in=>'ad-bias',out=>'ad-bias.2.out',cmd=>'+ad-bias',args=>'
 test_vcf_plugin($opts,in=>'ad-bias.2',out=>'ad-bias.2.out',cmd=>'+ad-bias',args=>'--no-version -- -s {PATH}/ad-bias.samples -c | grep -v bcftools');
 test_vcf_plugin($opts,in=>'af-dist',out=>'af-dist.out',cmd=>'+af-dist',args=>' | grep -v bcftools');
 test_vcf_plugin($opts,in=>'fixref.2a',out=>'fixref.2.out',index=>['fixref.2b'],cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa -i {TMP}/fixref.2b.vcf.gz');
+test_vcf_plugin_fixref_cache($opts,in=>'fixref.2a',out=>'fixref.2.out',index=>['fixref.2b'],cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa');
 test_vcf_plugin($opts,in=>'fixref.3',out=>'fixref.3.out',cmd=>'+fixref',args=>'-- -f {PATH}/fixref.3.fa -m top');
 test_vcf_plugin($opts,in=>'fixref.2a',out=>'fixref.4.out',index=>['fixref.2b'],cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa -m ref-alt');
 test_vcf_plugin($opts,in=>'fixref.2a',out=>'fixref.5.out',index=>['fixref.2b'],cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa -m flip');
@@ -457,6 +501,7 @@ test_vcf_plugin($opts,in=>'trio-dnm.2',out=>'trio-dnm.2.out',cmd=>'+trio-dnm',ar
 test_vcf_plugin($opts,in=>'gvcfz',out=>'gvcfz.1.out',cmd=>'+gvcfz',args=>qq[-g 'PASS:GT!="alt"' -a | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%END[\\t%GT][\\t%DP][\\t%GQ][\\t%RGQ]\\n']);
 test_vcf_plugin($opts,in=>'gvcfz',out=>'gvcfz.2.out',cmd=>'+gvcfz',args=>qq[-g 'PASS:GQ>10; FLT:-' -a | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%FILTER\\t%END[\\t%GT][\\t%DP][\\t%GQ][\\t%RGQ]\\n']);
 test_vcf_plugin($opts,in=>'gvcfz.2',out=>'gvcfz.2.1.out',cmd=>'+gvcfz',args=>qq[-g 'PASS:GT!="alt"' -a | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%FILTER\\t%END[\\t%GT][\\t%DP]\\n']);
+test_vcf_plugin_gvcfz_list($opts,in=>['gvcfz','gvcfz.2'],args=>qq[-g 'PASS:GT!="alt"' -a]);
 test_vcf_plugin($opts,in=>'remove-overlaps',out=>'remove-overlaps.1.out',cmd=>'+remove-overlaps',args=>'');
 test_vcf_plugin($opts,in=>'remove-overlaps',out=>'remove-overlaps.2.out',cmd=>'+remove-overlaps',args=>'-d');
 test_vcf_plugin($opts,in=>'split-vep',out=>'split-vep.1.out',cmd=>'+split-vep',args=>qq[-c Consequence -s worst:missense+ | $$opts{bin}/bcftools query -f'%POS\\t%Consequence\\n']);
@@ -510,6 +555,8 @@ test_vcf_reheader($opts,in=>'reheader',out=>'reheader.4.out',samples=>'reheader.
 test_vcf_reheader($opts,in=>'empty',out=>'reheader.empty.out',header=>'reheader.empty.hdr');
 test_vcf_reheader($opts,in=>'reheader.2',out=>'reheader.5.out',args=>'-f {PATH}/reheader.fai',nostdin=>1);
 test_vcf_reheader($opts,in=>'reheader.2',out=>'reheader.5.out',args=>'-h {PATH}/reheader.2.hdr -f {PATH}/reheader.fai',nostdin=>1);
+test_vcf_reheader_bcf($opts,in=>'reheader');
+test_naive_concat_hdrs($opts,in=>'reheader');
 test_rename_chrs($opts,in=>'annotate');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.gen',args=>'-g -,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.samples',args=>'-g .,-');
@@ -532,6 +579,7 @@ test_vcf_convert($opts,in=>'convert',out=>'convert.hs.hap',args=>'--hapsample -,
 test_vcf_convert($opts,in=>'convert',out=>'convert.hs.sample',args=>'--hapsample .,-');
 test_vcf_convert($opts,in=>'convert.hap-missing',out=>'convert.hap-missing.haps',args=>'--haplegendsample -,.,.');
 test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.out',fa=>'gvcf.fa',args=>'--gvcf2vcf -i\'FILTER="PASS"\'');
+test_vcf_convert_bgen($opts,in=>'convert.bgen',out=>'convert.bgen.out');
 test_vcf_convert_tsv2vcf($opts,in=>'convert.23andme',out=>'convert.23andme.vcf',args=>'-c ID,CHROM,POS,AA -s SAMPLE1',fai=>'23andme');
 test_vcf_consensus($opts,in=>'consensus',out=>'consensus.1.out',fa=>'consensus.fa',mask=>'consensus.tab',args=>'');
 test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.1.chain',chain=>'consensus.1.chain',fa=>'consensus.fa',mask=>'consensus.tab',args=>'');
@@ -573,6 +621,9 @@ test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.5.out',args=>q[-a DP,AD,ADF,ADR,SP,INFO/AD,INFO/ADF,INFO/ADR -r17:100-600]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-600 --gvcf 0,2,5]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-200,17:201-300,17:301-400,17:401-500,17:501-600 --gvcf 0,2,5]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-200,17:201-300,17:301-400,17:401-500,17:501-600 --split-regions --threads 2]);
+test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600 --downsample 100000]);
+test_mpileup_downsample($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600],downsample=>2);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -s HG00101,HG00102]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -S {PATH}/mplp.samples]);
 test_mpileup($opts,in=>[qw(mpileup.1 mpileup.2 mpileup.3)],out=>'mpileup/mpileup.8.out',args=>q[-r17:100-150 -s ^HG00101,HG00102]);
@@ -587,6 +638,9 @@ test_mpileup($opts,in=>[qw(mpileup.3 mpileup.4)],out=>'mpileup/mpileup.11.out',a
 test_mpileup($opts,in=>[qw(indel-AD.1)],out=>'mpileup/indel-AD.1.out',ref=>'indel-AD.1.fa',args=>q[-a AD]);
 test_mpileup($opts,in=>[qw(mpileup-SCR)],out=>'mpileup/mpileup-SCR.out',ref=>'mpileup-SCR.fa',args=>q[-a INFO/SCR,FMT/SCR]);
 test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3');
+test_csq_cache($opts,in=>'csq',out=>'csq.1.out',fa=>'csq.fa',gff=>'csq.gff3');
+test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --max-buffer-mem 1');
+test_csq_spill($opts,in=>'csq',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3');
 test_csq_real($opts,in=>'csq');
 test_roh($opts,in=>'roh.1',out=>'roh.1.1.out',args=>q[-Or -G30 --AF-dflt 0.4]);
 test_roh($opts,in=>'roh.1',out=>'roh.1.1.out',args=>q[-Or -G30 --AF-file {PATH}/roh.1.tab.gz]);
@@ -601,6 +655,9 @@ test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.1.out',arg
 test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.1.out',args=>q[-e 0 -u PL,GT]);
 test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.1.out',args=>q[-e 0 -u PL,PL]);
 test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.1.out',args=>q[-e 0 -p s1,s1]);
+test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.1.out',args=>q[-e 0 -u GT,GT],panel=>1);
+test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.1.out',args=>q[-e 0 -u PL,GT],panel=>1);
+test_gtcheck($opts,in=>'gtcheck.1',gts=>'gtcheck.1.gts',out=>'gtcheck.7.out',args=>q[-e 0 -u GT,GT -H],panel=>1);
 test_gtcheck($opts,in=>'gtcheck.2',gts=>'gtcheck.1.gts',out=>'gtcheck.2.out',args=>q[-e 0]);
 test_gtcheck($opts,in=>'gtcheck.3',out=>'gtcheck.3.out',args=>q[-e 0 ]);
 test_gtcheck($opts,in=>'gtcheck.3',out=>'gtcheck.3.out',args=>q[-e 0 -p B,A,C,A,C,B,D,A,D,B,D,C,E,A,E,B,E,C,E,D]);
@@ -959,6 +1016,36 @@ sub test_vcf_stats
     }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats $args{args} $files | grep -v '^#' | grep -v '^ID\t'");
 }
+sub test_vcf_stats_partial
+{
+    my ($opts,%args) = @_;
+    my $files = '';
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        $files .= " $$opts{tmp}/$file.vcf.gz";
+    }
+    my $partials = '';
+    for (my $i=0; $i<@{$args{regions}}; $i++)
+    {
+        my $partial = "$$opts{tmp}/$args{out}.$i.partial";
+        cmd("$$opts{bin}/bcftools stats $args{args} -r $args{regions}[$i] --partial $partial $files");
+        $partials .= " $partial";
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats --merge $partials | grep -v '^#' | grep -v '^ID\t'");
+}
+# The snapshot taken after the records of the targets must be the same as the stats of the targets
+sub test_vcf_stats_snapshot
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $file = "$$opts{tmp}/$args{in}.vcf.gz";
+    my $snapshot = "$$opts{tmp}/$args{in}.snapshot";
+    unlink($snapshot);
+    cmd("$$opts{bin}/bcftools stats $args{args} --snapshot $snapshot --snapshot-every $args{every} $file > /dev/null");
+    my $exp = cmd("$$opts{bin}/bcftools stats $args{args} -t $args{targets} $file | grep -v '^#' | grep -v '^ID\t'");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"grep -q '^# Snapshot after $args{every} records' $snapshot && grep -v '^#' $snapshot | grep -v '^ID\t'");
+}
 sub test_vcf_merge
 {
     my ($opts,%args) = @_;
@@ -974,6 +1061,56 @@ sub test_vcf_merge
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge --no-version $args $files", exp_fix=>1);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools merge -Ob $args $files | $$opts{bin}/bcftools view | grep -v ^##bcftools_", exp_fix => 1);
 }
+# The output of --split-contigs and --fan-in must be identical to a plain merge
+sub test_vcf_merge_parallel
+{
+    my ($opts,%args) = @_;
+    my @files;
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        push @files, "$$opts{tmp}/$file.vcf.gz";
+    }
+    my $args  = exists($args{args}) ? $args{args} : '';
+    my $files = join(' ',@files);
+    my $exp   = cmd("$$opts{bin}/bcftools merge --no-version $args $files");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools merge --no-version --split-contigs --threads 2 $args $files");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools merge --no-version --fan-in 2 --temp-dir $$opts{tmp}/merge.XXXXXX $args $files");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools merge --no-version --fan-in 2 --split-contigs --threads 2 $args $files");
+}
+# The output must not change with --buffer-stats, the per-file record counts are checked and the byte counts must be set
+sub test_vcf_merge_buffer_stats
+{
+    my ($opts,%args) = @_;
+    my @files;
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        push @files, "$$opts{tmp}/$file.vcf.gz";
+    }
+    my $files = join(' ',@files);
+    my $exp   = cmd("$$opts{bin}/bcftools merge --no-version $files");
+    test_cmd($opts,%args,out=>"$args{out}.same",exp=>$exp,cmd=>"$$opts{bin}/bcftools merge --no-version --buffer-stats $files 2>/dev/null");
+    cmd("$$opts{bin}/bcftools merge --no-version --buffer-stats $files 2>$$opts{tmp}/$args{out}.err >/dev/null");
+
+    # the file names are reported with the path and the byte counts depend on the BCF encoding
+    open(my $in,'<',"$$opts{tmp}/$args{out}.err") or error("$$opts{tmp}/$args{out}.err: $!");
+    open(my $out,'>',"$$opts{tmp}/$args{out}.tab") or error("$$opts{tmp}/$args{out}.tab: $!");
+    while (my $line=<$in>)
+    {
+        chomp($line);
+        my @col = split(/\t/,$line);
+        if ( $col[0] eq 'BUF' )
+        {
+            $col[1] =~ s{^.*/}{};
+            if ( !$col[3] ) { $col[2] .= "\tzero bytes"; }
+        }
+        print $out join("\t",@col[0..($#col<2 ? $#col : 2)]),"\n";
+    }
+    close($out) or error("close failed: $$opts{tmp}/$args{out}.tab");
+    close($in);
+    test_cmd($opts,%args,cmd=>"cat $$opts{tmp}/$args{out}.tab");
+}
 sub test_vcf_isec
 {
     my ($opts,%args) = @_;
@@ -1010,6 +1147,81 @@ sub test_vcf_query
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query $args{args} $$opts{tmp}/$args{in}.vcf.gz", exp_fix=>1);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools query $args{args}", exp_fix=>1);
 }
+# Decode the binary output of query --columnar into tab-delimited text, the layout is described in convert.h
+sub columnar_to_text
+{
+    my ($dat) = @_;
+    if ( substr($dat,0,8) ne "BCFCOL1\0" ) { return undef; }
+    my $off = 8;
+    my $ncols = unpack('V',substr($dat,$off,4)); $off += 4;
+    my @types = ();
+    for (my $i=0; $i<$ncols; $i++)
+    {
+        my ($type,$len) = unpack('CV',substr($dat,$off,5));
+        $off += 5 + $len;
+        push @types,$type;
+    }
+    my @dicts = map { [] } @types;
+    my $out = '';
+    while ( $off < length($dat) )
+    {
+        my $nrows = unpack('V',substr($dat,$off,4)); $off += 4;
+        my @cols = ();
+        for (my $i=0; $i<$ncols; $i++)
+        {
+            my @vals = ();
+            if ( $types[$i]==1 || $types[$i]==2 )
+            {
+                my @raw = unpack("V$nrows",substr($dat,$off,4*$nrows));
+                my @num = $types[$i]==1 ? unpack("l<$nrows",substr($dat,$off,4*$nrows)) : unpack("f<$nrows",substr($dat,$off,4*$nrows));
+                @vals = map { ($types[$i]==1 ? $raw[$_]==0x80000000 : $raw[$_]==0x7F800001) ? '.' : $num[$_] } (0..$nrows-1);
+                $off += 4*$nrows;
+            }
+            elsif ( $types[$i]==3 )
+            {
+                my @offs = unpack('V'.($nrows+1),substr($dat,$off,4*($nrows+1)));
+                $off += 4*($nrows+1);
+                @vals = map { substr($dat,$off+$offs[$_],$offs[$_+1]-$offs[$_]) } (0..$nrows-1);
+                $off += $offs[$nrows];
+            }
+            else
+            {
+                my $nnew = unpack('V',substr($dat,$off,4)); $off += 4;
+                for (my $j=0; $j<$nnew; $j++)
+                {
+                    my $len = unpack('V',substr($dat,$off,4));
+                    push @{$dicts[$i]}, substr($dat,$off+4,$len);
+                    $off += 4 + $len;
+                }
+                @vals = map { $dicts[$i][$_] } unpack("l<$nrows",substr($dat,$off,4*$nrows));
+                $off += 4*$nrows;
+            }
+            push @cols,\@vals;
+        }
+        for (my $j=0; $j<$nrows; $j++) { $out .= join("\t", map { $$_[$j] } @cols) . "\n"; }
+    }
+    return $out;
+}
+# The columns decoded from query --columnar must match the text output of the same tab-delimited format
+sub test_vcf_query_columnar
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $test = 'test_vcf_query_columnar';
+    my $exp  = cmd("$$opts{bin}/bcftools query -f '$args{fmt}' $$opts{tmp}/$args{in}.vcf.gz");
+    my $cmd  = "$$opts{bin}/bcftools query --columnar -f '$args{fmt}' $$opts{tmp}/$args{in}.vcf.gz -o $$opts{tmp}/$args{in}.columnar";
+    print "$test:\n\t$cmd\n";
+    my ($ret,$out,$err) = _cmd3($cmd);
+    if ( $ret ) { failed($opts,$test,"Non-zero status $ret\n\t\t$err"); return; }
+    open(my $fh,'<',"$$opts{tmp}/$args{in}.columnar") or error("$$opts{tmp}/$args{in}.columnar: $!");
+    binmode($fh);
+    my $dat = do { local $/; <$fh> };
+    close($fh) or error("close failed: $$opts{tmp}/$args{in}.columnar");
+    my $txt = columnar_to_text($dat);
+    if ( !defined $txt ) { failed($opts,$test,"Not a columnar file: $$opts{tmp}/$args{in}.columnar"); return; }
+    if ( $txt ne $exp ) { failed($opts,$test,"The decoded columns differ from the text output:\n$txt\n-- vs --\n$exp"); return; }
+    passed($opts,$test);
+}
 sub test_vcf_convert
 {
     my ($opts,%args) = @_;
@@ -1040,6 +1252,16 @@ sub test_vcf_convert_gvcf
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert --no-version $args{args} -f $$opts{path}/$args{fa} $$opts{tmp}/$args{in}.vcf.gz");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools convert $args{args} -f $$opts{path}/$args{fa} | grep -v ^##bcftools");
 }
+sub test_vcf_convert_bgen
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $query = "$$opts{bin}/bcftools query -f '%CHROM\\t%POS\\t%ID\\t%REF\\t%ALT[\\t%GT:%GP]\\n'";
+    cmd("$$opts{bin}/bcftools convert --bgen $$opts{tmp}/$args{in}.bgen $$opts{tmp}/$args{in}.vcf.gz");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert --bgen2vcf $$opts{tmp}/$args{in}.bgen | $query");
+    cmd("$$opts{bin}/bcftools convert --threads 2 --bgen $$opts{tmp}/$args{in}.bgen $$opts{tmp}/$args{in}.vcf.gz");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert --bgen2vcf $$opts{tmp}/$args{in}.bgen -Ou | $query");
+}
 sub test_vcf_convert_tsv2vcf
 {
     my ($opts,%args) = @_;
@@ -1059,6 +1281,61 @@ sub test_vcf_norm
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools norm --no-version $params $$opts{tmp}/$args{in}.vcf.gz",exp_fix=>1);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools norm -Ob $params $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools view | grep -v ^##bcftools_",exp_fix=>1);
 }
+# Commands reading a reference image must give the same output as with the fasta read through faidx
+sub test_refimage
+{
+    my ($opts,%args) = @_;
+    my $img = "$$opts{tmp}/$args{fa}.img.fa";
+    unlink("$img.fai");
+    cmd("$$opts{bin}/bcftools refimage -o $img $$opts{path}/$args{fa}.fa");
+
+    # the image is memory-mapped only if the index puts each sequence on a single line
+    if ( exists($args{out}) ) { test_cmd($opts,%args,cmd=>"cat $img; awk '\$2>\$4' $img.fai"); }
+    if ( !exists($args{cmds}) ) { return; }
+
+    bgzip_tabix_vcf($opts,$args{in});
+    for my $cmd (@{$args{cmds}})
+    {
+        my ($exp_cmd,$img_cmd) = ($cmd,$cmd);
+        for my $str ($exp_cmd,$img_cmd)
+        {
+            $str =~ s/{PATH}/$$opts{path}/g;
+            $str =~ s/{IN}/$$opts{tmp}\/$args{in}.vcf.gz/g;
+        }
+        $exp_cmd =~ s/{REF}/$$opts{path}\/$args{fa}.fa/g;
+        $img_cmd =~ s/{REF}/$img/g;
+        my $exp = cmd("$$opts{bin}/bcftools $exp_cmd");
+        test_cmd($opts,%args,out=>"$args{fa}.refimage.same.out",exp=>$exp,cmd=>"$$opts{bin}/bcftools $img_cmd");
+    }
+}
+# The --profile=json report must have all keys, timings are checked only to be numbers
+sub test_profile_json
+{
+    my ($opts,%args) = @_;
+    require JSON::PP;
+    require Scalar::Util;
+    bgzip_tabix_vcf($opts,$args{in});
+    my ($ret,$out,$err) = _cmd3("$$opts{bin}/bcftools $args{cmd} --profile=json $$opts{tmp}/$args{in}.vcf.gz");
+    if ( $ret ) { error("The command failed [$ret]: $args{cmd}\n$err"); }
+    my ($json) = grep { /^\{/ } split(/\n/,$err);
+    if ( !defined $json ) { error("No JSON profile in the output of: $args{cmd}\n$err"); }
+    my @keys;
+    my $flatten;
+    $flatten = sub
+    {
+        my ($prefix,$val) = @_;
+        if ( ref($val) eq 'HASH' ) { for my $key (sort keys %$val) { &$flatten(($prefix eq '' ? '' : "$prefix.").$key, $$val{$key}); } return; }
+        if ( $prefix=~/seconds$/ ) { push @keys, Scalar::Util::looks_like_number($val) && $val>=0 ? $prefix : "$prefix\tnot a number: $val"; }
+        elsif ( $prefix=~/\.calls$/ ) { push @keys, $prefix; }
+        else { push @keys, "$prefix\t$val"; }
+    };
+    &$flatten('',JSON::PP::decode_json($json));
+    my $tab = "$$opts{tmp}/$args{out}.tab";
+    open(my $fh,'>',$tab) or error("$tab: $!");
+    print $fh join("\n",@keys),"\n";
+    close($fh) or error("close failed: $tab");
+    test_cmd($opts,%args,cmd=>"cat $tab");
+}
 sub test_vcf_view
 {
     my ($opts,%args) = @_;
@@ -1109,12 +1386,64 @@ sub test_vcf_filter
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter $args{args} $$opts{path}/$args{in}.vcf | $pipe", exp_fix=>1);
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter -Ob $args{args} $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view | $pipe", exp_fix=>1);
 }
+# The expressions must select the same records as the reference expression, e.g. with folded constants
+sub test_vcf_filter_same
+{
+    my ($opts,%args) = @_;
+    my $exp = cmd("$$opts{bin}/bcftools filter $args{exp_args} $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools query -f '$args{fmt}'");
+    for my $expr (@{$args{args}})
+    {
+        test_vcf_filter($opts,%args,out=>"$args{in}.same.out",exp=>$exp,args=>$expr);
+    }
+}
+# Several -i/-e expressions evaluated in one pass must give the same FILTER labels as a chain of single expressions
+sub test_vcf_filter_multi
+{
+    my ($opts,%args) = @_;
+    my $in    = "$$opts{path}/$args{in}.vcf";
+    my $query = "$$opts{bin}/bcftools query -f '$args{fmt}'";
+    my $chain = "cat $in";
+    for my $expr (@{$args{exprs}}) { $chain .= " | $$opts{bin}/bcftools filter $args{args} $expr"; }
+    my $exp   = cmd("$chain | $query");
+    my $exprs = join(' ',@{$args{exprs}});
+    test_cmd($opts,%args,out=>"$args{in}.multi.out",exp=>$exp,cmd=>"$$opts{bin}/bcftools filter $args{args} $exprs $in | $query");
+    test_cmd($opts,%args,out=>"$args{in}.multi.out",exp=>$exp,cmd=>"$$opts{bin}/bcftools filter --threads 2 $args{args} $exprs $in | $query");
+}
+# Batched perl subroutines must give the same result as the per-record calls, skipped without perl filters
+sub test_vcf_filter_perl
+{
+    my ($opts,%args) = @_;
+    my $in     = "$$opts{path}/$args{in}.vcf";
+    my $script = "$$opts{bin}/$args{script}";
+    my ($ret,$out,$err) = _cmd3("$$opts{bin}/bcftools filter -i 'perl:$script; $args{expr}' $in");
+    if ( $ret && $err=~/--enable-perl-filters/ ) { return; }
+    my $query = "$$opts{bin}/bcftools query -f '%CHROM\\t%POS\\n'";
+    my $exp = cmd("$$opts{bin}/bcftools filter -i 'perl:$script; $args{expr}' $in | $query");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools filter --threads 2 -i 'perl:$script; $args{batch}' $in | $query");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools filter -i 'perl:$script; $args{batch}' $in | $query");
+}
 sub test_vcf_sort
 {
     my ($opts,%args) = @_;
     my $pipe = "$$opts{bin}/bcftools query -f '$args{fmt}'";
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort $args{args} $$opts{path}/$args{in}.vcf | $pipe");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort -Ob $args{args} $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view | $pipe");
+    # already sorted input
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools sort -Ou $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools sort $args{args} | $pipe");
+}
+sub test_vcf_sort_partitions
+{
+    my ($opts,%args) = @_;
+    if ( !exists($args{args}) ) { $args{args} = ''; }
+    my $pipe = "$$opts{bin}/bcftools query -f '$args{fmt}'";
+    open(my $fh,'>',"$$opts{tmp}/$args{in}.partitions") or error("$$opts{tmp}/$args{in}.partitions: $!");
+    print $fh join("\n",@{$args{partitions}}),"\n";
+    close($fh) or error("close failed: $$opts{tmp}/$args{in}.partitions");
+    my $prefix = "$$opts{tmp}/$args{in}.part";
+    cmd("rm -f $prefix.*.bcf");
+    cmd("$$opts{bin}/bcftools sort -Ob $args{args} --partitions $$opts{tmp}/$args{in}.partitions -o $prefix $$opts{path}/$args{in}.vcf");
+    my @shards = map { sprintf("$prefix.%04d.bcf",$_) } (1..scalar @{$args{partitions}});
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools concat --naive @shards | $pipe");
 }
 sub test_vcf_regions
 {
@@ -1302,6 +1631,72 @@ sub test_vcf_plugin
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools $args{cmd} $$opts{tmp}/$args{in}.bcf $args{args} | grep -v ^##bcftools_", exp_fix=>1);
 }
+# The ID cache is built from -i by the first run and read by the later ones, which must give the same output as -i alone
+sub test_vcf_plugin_fixref_cache
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    my $cache = "$$opts{tmp}/$args{index}[0].id-cache";
+    unlink($cache);
+    test_vcf_plugin($opts,%args,args=>"$args{args} -i {TMP}/$args{index}[0].vcf.gz --id-cache $cache");
+    test_vcf_plugin($opts,%args,args=>"$args{args} --id-cache $cache");
+}
+# Files compressed with -l, with and without --threads, must be the same as compressed one by one
+sub test_vcf_plugin_gvcfz_list
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    my $list = "$$opts{tmp}/gvcfz.list";
+    my $exp  = '';
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        $exp .= cmd("$$opts{bin}/bcftools +gvcfz $$opts{tmp}/$file.vcf.gz $args{args} | grep -v ^##bcftools_");
+    }
+    open(my $fh,'>',$list) or error("$list: $!");
+    for my $file (@{$args{in}}) { print $fh "$$opts{tmp}/$file.vcf.gz $$opts{tmp}/$file.gvcfz.vcf\n"; }
+    close($fh) or error("close failed: $list");
+    my $out = join(' ', map { "$$opts{tmp}/$_.gvcfz.vcf" } @{$args{in}});
+    for my $threads ('','--threads 2')
+    {
+        test_cmd($opts,%args,out=>"gvcfz.list.same.out",exp=>$exp,cmd=>"$$opts{bin}/bcftools +gvcfz -l $list $threads $args{args} && cat $out | grep -v ^##bcftools_");
+    }
+}
+# With --max-open the outputs are closed and reopened in append mode, the files must be the same as without the limit
+sub test_vcf_plugin_split
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    bgzip_tabix_vcf($opts,"$args{in}");
+    my $dir = "$$opts{tmp}/$args{in}.split";
+    for my $type ('v','z')
+    {
+        cmd("rm -rf $dir.*");
+        cmd("$$opts{bin}/bcftools +split $$opts{tmp}/$args{in}.vcf.gz -O$type -o $dir.all");
+        my $exp = cmd("for f in $dir.all/*; do echo \$f; $$opts{bin}/bcftools view --no-version \$f; done | sed 's,^$dir.all/,,'");
+        test_cmd($opts,%args,out=>"$args{in}.split.same.out",exp=>$exp,
+            cmd=>"$$opts{bin}/bcftools +split $$opts{tmp}/$args{in}.vcf.gz -O$type -o $dir.lim $args{args} && for f in $dir.lim/*; do echo \$f; $$opts{bin}/bcftools view --no-version \$f; done | sed 's,^$dir.lim/,,'");
+    }
+}
+# A chain of plugins in one invocation must give the same output as the plugins connected by pipes
+sub test_vcf_plugin_chain
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    bgzip_tabix_vcf($opts,"$args{in}");
+    my @plugins = map { my ($name,$opts) = split(/ -- /,$_,2); [$name,$opts] } @{$args{chain}};
+    my $pipe = join(' | ', map { "$$opts{bin}/bcftools $$_[0] --no-version -Ou -- $$_[1]" } @plugins);
+    $pipe =~ s/-Ou -- /-Ou $$opts{tmp}\/$args{in}.vcf.gz -- /;
+    $pipe =~ s/-Ou( -- [^|]*)$/-Ov$1/;
+    my $exp = cmd("$pipe | grep -v ^##bcftools_");
+    my ($first,@rest) = @plugins;
+    my $chain = "$$opts{bin}/bcftools $$first[0] --no-version $$opts{tmp}/$args{in}.vcf.gz -- $$first[1]";
+    for my $plugin (@rest) { $chain .= " -- $$plugin[0] $$plugin[1]"; }
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$chain | grep -v ^##bcftools_");
+}
 sub test_vcf_concat
 {
     my ($opts,%args) = @_;
@@ -1352,6 +1747,59 @@ sub test_vcf_reheader
         test_cmd($opts,%args,%bcf_args,cmd=>"cat $file | $$opts{bin}/bcftools reheader $arg | $$opts{bin}/bcftools view --no-version") unless $args{nostdin};
     }
 }
+# Write the header of the VCF with a new INFO line added at the end (the
+# dictionary of strings is kept) or at the beginning (all IDX are shifted)
+sub write_extra_hdr
+{
+    my ($opts,$in,$out,$where) = @_;
+    my $hdr   = cmd("$$opts{bin}/bcftools view --no-version -h $$opts{path}/$in.vcf");
+    my $extra = qq[##INFO=<ID=EXTRA,Number=1,Type=Integer,Description="Extra tag">\n];
+    if ( $where eq 'end' ) { $hdr =~ s/^#CHROM/$extra#CHROM/m; }
+    else { $hdr =~ s/^(##fileformat[^\n]*\n)/$1$extra/; }
+    open(my $fh,'>',"$$opts{tmp}/$out") or error("$$opts{tmp}/$out: $!");
+    print $fh $hdr;
+    close($fh) or error("close failed: $$opts{tmp}/$out");
+}
+# BCF reheader copies the records verbatim when the IDX of all tags are kept and
+# recodes them otherwise, either way the records must be the same as with VCF
+sub test_vcf_reheader_bcf
+{
+    my ($opts,%args) = @_;
+    cmd("$$opts{bin}/bcftools view --no-version -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
+    for my $where ('end','beg')
+    {
+        my $hdr = "$$opts{tmp}/$args{in}.extra-$where.hdr";
+        write_extra_hdr($opts,$args{in},"$args{in}.extra-$where.hdr",$where);
+        my $exp = cmd("$$opts{bin}/bcftools reheader -h $hdr $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view --no-version | grep -v ^##");
+        test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools reheader -h $hdr $$opts{tmp}/$args{in}.bcf | $$opts{bin}/bcftools view --no-version | grep -v ^##");
+        test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools reheader --threads 2 -h $hdr $$opts{tmp}/$args{in}.bcf | $$opts{bin}/bcftools view --no-version | grep -v ^##");
+    }
+}
+# concat --naive accepts BCFs whose tags missing in the first file have a free IDX
+# and must refuse BCFs with clashing IDX
+sub test_naive_concat_hdrs
+{
+    my ($opts,%args) = @_;
+    my $bcf = "$$opts{tmp}/$args{in}.naive";
+    cmd("$$opts{bin}/bcftools view --no-version -Ob $$opts{path}/$args{in}.vcf > $bcf.bcf");
+    for my $where ('end','beg')
+    {
+        write_extra_hdr($opts,$args{in},"$args{in}.extra-$where.hdr",$where);
+        cmd("$$opts{bin}/bcftools reheader -h $$opts{tmp}/$args{in}.extra-$where.hdr $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view --no-version -Ob > $bcf.$where.bcf");
+    }
+
+    my $exp = cmd("$$opts{bin}/bcftools concat --no-version $bcf.bcf $bcf.end.bcf | $$opts{bin}/bcftools view -H");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$$opts{bin}/bcftools concat --naive $bcf.bcf $bcf.end.bcf | $$opts{bin}/bcftools view -H");
+    test_cmd($opts,%args,exp=>qq[##INFO=<ID=EXTRA,Number=1,Type=Integer,Description="Extra tag">\n],cmd=>"$$opts{bin}/bcftools concat --naive $bcf.bcf $bcf.end.bcf | $$opts{bin}/bcftools view -h | grep ID=EXTRA");
+
+    my $test = 'test_naive_concat_hdrs';
+    my $cmd  = "$$opts{bin}/bcftools concat --naive $bcf.bcf $bcf.beg.bcf -o $bcf.out.bcf";
+    print "$test:\n\t$cmd\n";
+    my ($ret,$out,$err) = _cmd3($cmd);
+    if ( !$ret ) { failed($opts,$test,"Expected a failure, the IDX of the headers clash"); }
+    elsif ( !($err=~/--naive-force/) ) { failed($opts,$test,"Unexpected error: $err"); }
+    else { passed($opts,$test); }
+}
 sub test_rename_chrs
 {
     my ($opts,%args) = @_;
@@ -1437,6 +1885,18 @@ sub test_naive_concat
     test_cmd($opts,exp=>$exp,out=>"concat.naive.vcf.out",cmd=>"$$opts{bin}/bcftools concat --naive $vcfs | $$opts{bin}/bcftools view -H");
 }
 
+# Downsampling is deterministic and reduces the depth
+sub test_mpileup_downsample
+{
+    my ($opts,%args) = @_;
+    my $files = join(' ', map { "$$opts{path}/mpileup/$_.bam" } @{$args{in}});
+    my $cmd   = "$$opts{bin}/bcftools mpileup $args{args} -f $$opts{path}/mpileup/mpileup.ref.fa";
+    my $query = "$$opts{bin}/bcftools query -f '%POS[\\t%DP]\\n'";
+    my $full  = cmd("$cmd $files | $query");
+    my $exp   = cmd("$cmd --downsample $args{downsample} $files | $query");
+    test_cmd($opts,%args,exp=>$exp,cmd=>"$cmd --downsample $args{downsample} $files | $query");
+    if ( $exp eq $full ) { failed($opts,'test_mpileup_downsample',"The output did not change with --downsample $args{downsample}"); }
+}
 sub test_mpileup
 {
     my ($opts,%args) = @_;
@@ -1487,6 +1947,32 @@ sub test_csq
     $args{cmd}  =~ s/{PATH}/$$opts{path}/g;
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools csq $args{cmd} $$opts{path}/$args{in}.vcf | $$opts{bin}/test/csq/sort-csq | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%EXP\\n%POS\\t%REF\\t%ALT\\t%BCSQ\\n\\n'");
 }
+# The output with the GFF read from the --dump-cache file must be the same as with the GFF
+sub test_csq_cache
+{
+    my ($opts,%args) = @_;
+    my $cache = "$$opts{tmp}/$args{in}.gff.cache";
+    unlink($cache);
+    cmd("$$opts{bin}/bcftools csq -g $$opts{path}/$args{gff} --dump-cache $cache");
+    test_csq($opts,%args,cmd=>"-f {PATH}/$args{fa} -g $cache");
+    unlink($cache);
+    test_csq($opts,%args,cmd=>"-f {PATH}/$args{fa} -g {PATH}/$args{gff} --dump-cache $cache");
+    test_csq($opts,%args,cmd=>"-f {PATH}/$args{fa} -g $cache");
+}
+# Records spilled to temporary files with a tiny --max-buffer-mem must come out the same as without spilling
+sub test_csq_spill
+{
+    my ($opts,%args) = @_;
+    $args{cmd} =~ s/{PATH}/$$opts{path}/g;
+    my $csq = "$$opts{bin}/bcftools csq --no-version $args{cmd}";
+    my $in  = "$$opts{path}/$args{in}.vcf";
+    cmd("mkdir -p $$opts{tmp}/csq-spill");
+    for my $fmt ('-Ov','-Ot')
+    {
+        my $exp = cmd("$csq $fmt $in");
+        test_cmd($opts,%args,out=>"$args{in}.spill.out",exp=>$exp,cmd=>"$csq $fmt --max-buffer-mem 1 --temp-dir $$opts{tmp}/csq-spill $in");
+    }
+}
 sub test_csq_real
 {
     my ($opts,%args) = @_;
@@ -1574,6 +2060,12 @@ sub test_gtcheck
     if ( exists($args{gts}) ) { bgzip_tabix_vcf($opts,$args{gts}); }
     my $sort = exists($args{sort}) ? ' | sort' : '';
     my $gts  = exists($args{gts}) ? qq[-g $$opts{tmp}/$args{gts}.vcf.gz] : '';
+    if ( exists($args{panel}) )
+    {
+        # the -g genotypes are read from a panel made by --build-panel
+        cmd("$$opts{bin}/bcftools gtcheck --build-panel $$opts{tmp}/$args{gts}.panel $$opts{tmp}/$args{gts}.vcf.gz");
+        $gts = qq[-g $$opts{tmp}/$args{gts}.panel];
+    }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools gtcheck $args{args} $$opts{tmp}/$args{in}.vcf.gz $gts | grep -v ^# | grep -v ^INFO $sort");
 }
 sub test_vcf_merge_big
@@ -79,14 +79,14 @@ int tsv_parse(tsv_t *tsv, bcf1_t *rec, char *str)
     tsv->ss = tsv->se = str;
     while ( *tsv->ss && tsv->icol < tsv->ncols )
     {
-        while ( *tsv->se && !isspace(*tsv->se) ) tsv->se++;
+        while ( *tsv->se && !tsv_isspace(*tsv->se) ) tsv->se++;
         if ( tsv->cols[tsv->icol].setter )
         {
             int ret = tsv->cols[tsv->icol].setter(tsv,rec,tsv->cols[tsv->icol].usr);
             if ( ret<0 ) return -1;
             status++;
         }
-        while ( *tsv->se && isspace(*tsv->se) ) tsv->se++;
+        while ( *tsv->se && tsv_isspace(*tsv->se) ) tsv->se++;
         tsv->ss = tsv->se;
         tsv->icol++;
     }
@@ -56,6 +56,15 @@ int tsv_register(tsv_t *tsv, const char *id, tsv_setter_t setter, void *usr);
  */
 int tsv_parse(tsv_t *tsv, bcf1_t *rec, char *str);
 
+/**
+ *  tsv_isspace() - the same as isspace() in the C locale, without the
+ *  locale lookup. The field separators are tested for every character
+ */
+static inline int tsv_isspace(char c)
+{
+    return c==' ' || (unsigned char)(c-'\t') < 5;
+}
+
 /**
  *  tstv_next() - position ss,se to next field; first pass with ss=se=str
  *  Returns 0 on success, or -1 if no more fields
@@ -65,12 +74,12 @@ static inline int tsv_next(tsv_t *tsv)
     if ( !*tsv->se ) return -1;
     if ( tsv->ss==tsv->se )
     {
-        while ( *tsv->se && !isspace(*tsv->se) ) tsv->se++;
+        while ( *tsv->se && !tsv_isspace(*tsv->se) ) tsv->se++;
         return 0;
     }
-    while ( *tsv->se && isspace(*tsv->se) ) tsv->se++;
+    while ( *tsv->se && tsv_isspace(*tsv->se) ) tsv->se++;
     tsv->ss = tsv->se;
-    while ( *tsv->se && !isspace(*tsv->se) ) tsv->se++;
+    while ( *tsv->se && !tsv_isspace(*tsv->se) ) tsv->se++;
     return 0;
 }
 
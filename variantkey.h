@@ -569,6 +569,67 @@ static inline size_t variantkey_hex(uint64_t vk, char *str)
     return hex_uint64_t(vk, str);
 }
 
+/** @brief Encodes a batch of VariantKeys from pre-encoded CHROM, POS and REF+ALT arrays.
+ *
+ * The chromosome codes are typically computed once per contig with encode_chrom
+ * and looked up by contig index, so that no strings are touched per variant.
+ *
+ * @param chrom   Encoded chromosomes (see encode_chrom).
+ * @param pos     Positions, with the first base having position 0.
+ * @param refalt  Encoded Reference + Alternate (see encode_refalt).
+ * @param n       Number of variants.
+ * @param vk      Output array of n VariantKey codes.
+ */
+static inline void encode_variantkey_batch(const uint8_t *chrom, const uint32_t *pos, const uint32_t *refalt, size_t n, uint64_t *vk)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        vk[i] = encode_variantkey(chrom[i], pos[i], refalt[i]);
+    }
+}
+
+/** @brief Decodes a batch of VariantKeys into separate CHROM, POS and REF+ALT arrays.
+ *
+ * @param vk      VariantKey codes.
+ * @param n       Number of variants.
+ * @param chrom   Output array of n CHROM codes.
+ * @param pos     Output array of n positions.
+ * @param refalt  Output array of n REF+ALT codes.
+ */
+static inline void decode_variantkey_batch(const uint64_t *vk, size_t n, uint8_t *chrom, uint32_t *pos, uint32_t *refalt)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        chrom[i] = extract_variantkey_chrom(vk[i]);
+        pos[i] = extract_variantkey_pos(vk[i]);
+        refalt[i] = extract_variantkey_refalt(vk[i]);
+    }
+}
+
+/** @brief Writes a batch of VariantKeys as hexadecimal strings, each followed by a separator.
+ *
+ * @param vk    VariantKey codes.
+ * @param n     Number of variants.
+ * @param sep   Character written after each key, for example a newline.
+ * @param str   String buffer to be returned (it must be sized 17*n+1 bytes at least).
+ *
+ * @return      The number of characters written, excluding the terminating null byte.
+ */
+static inline size_t variantkey_hex_batch(const uint64_t *vk, size_t n, char sep, char *str)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        hex_uint64_t(vk[i], str);
+        str[16] = sep;
+        str += 17;
+    }
+    *str = 0;
+    return 17 * n;
+}
+
 /** @brief Parses a VariantKey hexadecimal string and returns the code.
  *
  * @param vs    VariantKey hexadecimal string (it must contain 16 hexadecimal characters).
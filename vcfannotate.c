@@ -39,12 +39,15 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/tbx.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "vcmp.h"
 #include "filter.h"
 #include "convert.h"
 #include "smpl_ilist.h"
 #include "regidx.h"
+#include "regplan.h"
 
 struct _args_t;
 
@@ -111,6 +114,7 @@ typedef struct _args_t
     bcf_hdr_t *hdr, *hdr_out, *tgts_hdr;
     htsFile *out_fh;
     int output_type, n_threads;
+    int read_ahead;     // BGZF blocks of remote inputs to decompress ahead, see sr_set_readahead()
     bcf_sr_regions_t *tgts;
 
     regidx_t *tgt_idx;
@@ -152,27 +156,50 @@ typedef struct _args_t
     char *remove_annots, *columns, *rename_chrs, *sample_names, *mark_sites;
     kstring_t merge_method_str;
     int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic, force, single_overlaps;
+    int sparse_tgts;    // seeking between clusters of records, see sparse_target_regions()
+    int split_contigs;  // annotate groups of contigs in parallel, see annotate_split()
+    char **payload_blk; // the regidx payload lines are stored in large blocks, see parse_with_payload()
+    int npayload_blk, mpayload_blk;
+    size_t payload_used;
+    char *tmp_dir;
+    profile_t prof;
 }
 args_t;
 
 char *msprintf(const char *fmt, ...);
 
+#define PAYLOAD_BLK_SIZE (1<<20)
+
 int parse_with_payload(const char *line, char **chr_beg, char **chr_end, uint32_t *beg, uint32_t *end, void *payload, void *usr)
 {
     args_t *args = (args_t*) usr;
     int ret = args->tgt_is_bed ? regidx_parse_bed(line, chr_beg, chr_end, beg, end, NULL, NULL) : regidx_parse_tab(line, chr_beg, chr_end, beg, end, NULL, NULL);
     if ( ret<0 ) return ret;
-    *((char **)payload) = strdup(line);
+
+    // Copy the line into the current block instead of allocating each line
+    // separately, this makes a big difference in memory and parsing time for
+    // files with hundreds of millions of lines
+    size_t len = strlen(line) + 1;
+    if ( !args->npayload_blk || args->payload_used + len > PAYLOAD_BLK_SIZE )
+    {
+        args->npayload_blk++;
+        hts_expand(char*,args->npayload_blk,args->mpayload_blk,args->payload_blk);
+        args->payload_blk[args->npayload_blk-1] = (char*) malloc(len > PAYLOAD_BLK_SIZE ? len : PAYLOAD_BLK_SIZE);
+        args->payload_used = 0;
+    }
+    char *str = args->payload_blk[args->npayload_blk-1] + args->payload_used;
+    memcpy(str, line, len);
+    args->payload_used += len;
+    *((char **)payload) = str;
     return 0;
 }
-void free_payload(void *payload)
-{
-    char *str = *((char**)payload);
-    free(str);
-}
 
+// The updates are skipped when there is nothing to remove, so that unmodified records
+// are written as they were read, without re-encoding
 void remove_id(args_t *args, bcf1_t *line, rm_tag_t *tag)
 {
+    bcf_unpack(line, BCF_UN_STR);
+    if ( line->d.id[0]=='.' && !line->d.id[1] ) return;
     bcf_update_id(args->hdr,line,NULL);
 }
 void remove_filter(args_t *args, bcf1_t *line, rm_tag_t *tag)
@@ -184,7 +211,12 @@ void remove_filter(args_t *args, bcf1_t *line, rm_tag_t *tag)
               "       Even better, use \"bcftools view -h\" and \"bcftools reheader\" to fix the header!\n"
               );
     }
-    if ( !tag->key ) bcf_update_filter(args->hdr, line, NULL, args->flt_keep_pass);
+    if ( !tag->key )
+    {
+        bcf_unpack(line, BCF_UN_FLT);
+        if ( !line->d.n_flt ) return;
+        bcf_update_filter(args->hdr, line, NULL, args->flt_keep_pass);
+    }
     else bcf_remove_filter(args->hdr, line, tag->hdr_id, args->flt_keep_pass);
 }
 void remove_qual(args_t *args, bcf1_t *line, rm_tag_t *tag)
@@ -651,6 +683,25 @@ static int vcf_setter_info_flag(args_t *args, bcf1_t *line, annot_col_t *col, vo
     bcf_update_info_flag(args->hdr_out,line,col->hdr_key_dst,NULL,flag);
     return 0;
 }
+/*
+    Is the numeric INFO tag present with a non-missing first value? Checked in place,
+    without decoding the whole array. The type must match the header definition.
+*/
+static int info_has_value(bcf_hdr_t *hdr, bcf1_t *line, const char *key, int type)
+{
+    bcf_info_t *inf = bcf_get_info(hdr, line, key);
+    if ( !inf || !inf->vptr || !inf->len ) return 0;
+    if ( bcf_hdr_id2type(hdr,BCF_HL_INFO,inf->key)!=type ) return 0;
+    switch (inf->type)
+    {
+        case BCF_BT_INT8:  return *(int8_t*)inf->vptr!=bcf_int8_missing && *(int8_t*)inf->vptr!=bcf_int8_vector_end ? 1 : 0;
+        case BCF_BT_INT16: return le_to_i16(inf->vptr)!=bcf_int16_missing && le_to_i16(inf->vptr)!=bcf_int16_vector_end ? 1 : 0;
+        case BCF_BT_INT32: return le_to_i32(inf->vptr)!=bcf_int32_missing && le_to_i32(inf->vptr)!=bcf_int32_vector_end ? 1 : 0;
+        case BCF_BT_FLOAT: return bcf_float_is_missing(le_to_float(inf->vptr)) || bcf_float_is_vector_end(le_to_float(inf->vptr)) ? 0 : 1;
+    }
+    return 0;
+}
+
 static int setter_ARinfo_int32(args_t *args, bcf1_t *line, annot_col_t *col, int nals, char **als, int ntmpi)
 {
     if ( col->number==BCF_VL_A && ntmpi!=nals-1 && (ntmpi!=1 || args->tmpi[0]!=bcf_int32_missing || args->tmpi[1]!=bcf_int32_vector_end) )
@@ -760,11 +811,7 @@ static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *d
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_int32(args,line,col,tab->nals,tab->als,ntmpi);
 
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_int32(args->hdr, line, col->hdr_key_dst, &args->tmpi2, &args->mtmpi2);
-        if ( ret>0 && args->tmpi2[0]!=bcf_int32_missing ) return 0;
-    }
+    if ( col->replace==REPLACE_MISSING && info_has_value(args->hdr, line, col->hdr_key_dst, BCF_HT_INT) ) return 0;
 
     bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi,ntmpi);
     return 0;
@@ -778,11 +825,7 @@ static int vcf_setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, voi
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_int32(args,line,col,rec->n_allele,rec->d.allele,ntmpi);
 
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_int32(args->hdr, line, col->hdr_key_dst, &args->tmpi2, &args->mtmpi2);
-        if ( ret>0 && args->tmpi2[0]!=bcf_int32_missing ) return 0;
-    }
+    if ( col->replace==REPLACE_MISSING && info_has_value(args->hdr, line, col->hdr_key_dst, BCF_HT_INT) ) return 0;
 
     bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi,ntmpi);
     return 0;
@@ -896,11 +939,7 @@ static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_real(args,line,col,tab->nals,tab->als,ntmpf);
 
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_float(args->hdr, line, col->hdr_key_dst, &args->tmpf2, &args->mtmpf2);
-        if ( ret>0 && !bcf_float_is_missing(args->tmpf2[0]) ) return 0;
-    }
+    if ( col->replace==REPLACE_MISSING && info_has_value(args->hdr, line, col->hdr_key_dst, BCF_HT_REAL) ) return 0;
 
     bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf,ntmpf);
     return 0;
@@ -914,11 +953,7 @@ static int vcf_setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, vo
     if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
         return setter_ARinfo_real(args,line,col,rec->n_allele,rec->d.allele,ntmpf);
 
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_float(args->hdr, line, col->hdr_key_dst, &args->tmpf2, &args->mtmpf2);
-        if ( ret>0 && !bcf_float_is_missing(args->tmpf2[0]) ) return 0;
-    }
+    if ( col->replace==REPLACE_MISSING && info_has_value(args->hdr, line, col->hdr_key_dst, BCF_HT_REAL) ) return 0;
 
     bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf,ntmpf);
     return 0;
@@ -1525,9 +1560,38 @@ static int determine_ploidy(int nals, int *vals, int nvals1, uint8_t *smpl, int
     }
     return max_ploidy;
 }
+/*
+    When the samples of the annotation file match the target file and the
+    alleles are unchanged, the values of 32-bit integer and float FORMAT fields
+    can be passed from the source record as they are stored, without decoding
+    them into a temporary array. Returns NULL if the field must be decoded.
+*/
+static bcf_fmt_t *format_direct(args_t *args, bcf1_t *line, annot_col_t *col, bcf1_t *rec, int type)
+{
+#ifdef HTS_LITTLE_ENDIAN
+    if ( args->sample_map ) return NULL;
+    bcf_hdr_t *hdr = args->files->readers[1].header;
+    bcf_fmt_t *fmt = bcf_get_fmt(hdr, rec, col->hdr_key_src);
+    if ( !fmt || !fmt->p || fmt->type!=type || ((uintptr_t)fmt->p & 3) ) return NULL;
+    if ( bcf_hdr_id2type(hdr,BCF_HL_FMT,fmt->id)!=(type==BCF_BT_FLOAT ? BCF_HT_REAL : BCF_HT_INT) ) return NULL;
+    if ( col->number==BCF_VL_G || col->number==BCF_VL_R || col->number==BCF_VL_A )
+    {
+        if ( rec->n_allele!=line->n_allele ) return NULL;
+        int i;
+        for (i=0; i<rec->n_allele; i++)
+            if ( strcmp(rec->d.allele[i],line->d.allele[i]) ) return NULL;
+    }
+    return fmt;
+#else
+    return NULL;
+#endif
+}
 static int vcf_setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
+    bcf_fmt_t *fmt = format_direct(args, line, col, rec, BCF_BT_INT32);
+    if ( fmt ) return core_setter_format_int(args,line,col,(int32_t*)fmt->p,fmt->n);
+
     int nsrc = bcf_get_format_int32(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpi,&args->mtmpi);
     if ( nsrc==-3 ) return 0;    // the tag is not present
     if ( nsrc<=0 ) return 1;     // error
@@ -1635,6 +1699,9 @@ static int vcf_setter_format_int(args_t *args, bcf1_t *line, annot_col_t *col, v
 static int vcf_setter_format_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
+    bcf_fmt_t *fmt = format_direct(args, line, col, rec, BCF_BT_FLOAT);
+    if ( fmt ) return core_setter_format_real(args,line,col,(float*)fmt->p,fmt->n);
+
     int nsrc = bcf_get_format_float(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpf,&args->mtmpf);
     if ( nsrc==-3 ) return 0;    // the tag is not present
     if ( nsrc<=0 ) return 1;     // error
@@ -2411,6 +2478,73 @@ static void rename_chrs(args_t *args, char *fname)
     free(map);
 }
 
+/*
+    Sparse targets: when the annotation VCF has many more records than the
+    annotated VCF, streaming through the whole annotation file would decompress
+    mostly records that are never used. Instead, the records of the annotated
+    file are grouped into clusters separated by at least ANNOT_SEEK_GAP bases
+    and the clusters are set as regions so that the synced reader streams the
+    annotations within a cluster and seeks between them.
+*/
+#define ANNOT_SEEK_GAP   100000
+#define ANNOT_SPARSE_FAC 64
+#define ANNOT_CACHE_SIZE (16<<20)
+
+static uint64_t indexed_nrec(const char *fname)
+{
+    htsFile *fp = hts_open(fname, "r");
+    if ( !fp ) return 0;
+    int is_bcf = hts_get_format(fp)->format==bcf ? 1 : 0;
+    hts_close(fp);
+
+    tbx_t *tbx = NULL;
+    hts_idx_t *idx = is_bcf ? bcf_index_load(fname) : NULL;
+    if ( !is_bcf && (tbx = tbx_index_load(fname)) ) idx = tbx->idx;
+    if ( !idx ) return 0;
+
+    int i, nseq = hts_idx_nseq(idx);
+    uint64_t nrec = 0, mapped, unmapped;
+    for (i=0; i<nseq; i++)
+        if ( hts_idx_get_stat(idx, i, &mapped, &unmapped)==0 ) nrec += mapped;
+    if ( tbx ) tbx_destroy(tbx);
+    else hts_idx_destroy(idx);
+    return nrec;
+}
+
+static char *sparse_target_regions(args_t *args, const char *fname)
+{
+    if ( args->regions_list || !strcmp("-",fname) ) return NULL;
+    uint64_t nrec = indexed_nrec(fname), nannot = indexed_nrec(args->targets_fname);
+    if ( !nrec || !nannot || nrec*ANNOT_SPARSE_FAC > nannot ) return NULL;
+
+    htsFile *fp = hts_open(fname, "r");
+    if ( !fp ) return NULL;
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) { hts_close(fp); return NULL; }
+    bcf1_t *rec = bcf_init1();
+    kstring_t str = {0,0,0};
+    int rid = -1;
+    int64_t beg = 0, end = 0;
+    while ( bcf_read(fp, hdr, rec)==0 )
+    {
+        int64_t rec_end = rec->pos + rec->rlen;
+        if ( rec->rid==rid && rec->pos < end + ANNOT_SEEK_GAP )
+        {
+            if ( end < rec_end ) end = rec_end;
+            continue;
+        }
+        if ( rid>=0 ) ksprintf(&str, "%s%s:%"PRId64"-%"PRId64, str.l?",":"", bcf_hdr_id2name(hdr,rid),beg+1,end);
+        rid = rec->rid;
+        beg = rec->pos;
+        end = rec_end;
+    }
+    if ( rid>=0 ) ksprintf(&str, "%s%s:%"PRId64"-%"PRId64, str.l?",":"", bcf_hdr_id2name(hdr,rid),beg+1,end);
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    hts_close(fp);
+    return str.s;
+}
+
 static void init_data(args_t *args)
 {
     args->hdr = args->files->readers[0].header;
@@ -2424,6 +2558,7 @@ static void init_data(args_t *args)
         if ( !bcf_sr_add_reader(args->files, args->targets_fname) )
             error("Failed to open %s: %s\n", args->targets_fname,bcf_sr_strerror(args->files->errnum));
         args->tgts_hdr = args->files->readers[1].header;
+        if ( args->sparse_tgts ) hts_set_cache_size(args->files->readers[1].file, ANNOT_CACHE_SIZE);    // keep recently decompressed blocks
     }
     if ( args->columns ) init_columns(args);
     if ( args->targets_fname && !args->tgts_is_vcf )
@@ -2446,7 +2581,7 @@ static void init_data(args_t *args)
             if ( len>=7 && !strcasecmp(".bed.gz",args->targets_fname+len-7) ) args->tgt_is_bed = 1;
             else if ( len>=8 && !strcasecmp(".bed.bgz",args->targets_fname+len-8) ) args->tgt_is_bed = 1;
             else if ( len>=4 && !strcasecmp(".bed",args->targets_fname+len-4) ) args->tgt_is_bed = 1;
-            args->tgt_idx = regidx_init(args->targets_fname,parse_with_payload,free_payload,sizeof(char*),args);
+            args->tgt_idx = regidx_init(args->targets_fname,parse_with_payload,NULL,sizeof(char*),args);
             if ( !args->tgt_idx ) error("Failed to parse: %s\n", args->targets_fname);
             args->tgt_itr = regitr_init(args->tgt_idx);
             args->nalines++;
@@ -2514,6 +2649,8 @@ static void destroy_data(args_t *args)
         regidx_destroy(args->tgt_idx);
         regitr_destroy(args->tgt_itr);
     }
+    for (i=0; i<args->npayload_blk; i++) free(args->payload_blk[i]);
+    free(args->payload_blk);
     if ( args->tgts ) bcf_sr_regions_destroy(args->tgts);
     free(args->tmpks.s);
     free(args->tmpi);
@@ -2629,7 +2766,7 @@ static void annotate(args_t *args, bcf1_t *line)
 
     if ( args->tgt_idx )
     {
-        if ( regidx_overlap(args->tgt_idx, bcf_seqname(args->hdr,line),line->pos,line->pos+line->rlen-1, args->tgt_itr) )
+        if ( regidx_overlap_sorted(args->tgt_idx, bcf_seqname(args->hdr,line),line->pos,line->pos+line->rlen-1, args->tgt_itr) )
         {
             while ( regitr_overlap(args->tgt_itr) )
             {
@@ -2704,6 +2841,7 @@ static void annotate(args_t *args, bcf1_t *line)
             int replace = 0;
             if ( args->set_ids_replace ) replace = 1;
             else if ( !line->d.id || (line->d.id[0]=='.' && !line->d.id[1]) ) replace = 1;
+            if ( replace && line->d.id && !strcmp(line->d.id,args->tmpks.s) ) replace = 0;   // the same ID, leave the record unmodified
             if ( replace )
                 bcf_update_id(args->hdr_out,line,args->tmpks.s);
         }
@@ -2719,6 +2857,174 @@ static void annotate(args_t *args, bcf1_t *line)
     }
 }
 
+static void annotate_records(args_t *args)
+{
+    static int line_errcode_warned = 0;
+    profile_t *prof = &args->prof;
+    prof->nsmpl = bcf_hdr_nsamples(args->hdr_out);
+    profile_mark(prof);
+    while ( bcf_sr_next_line(args->files) )
+    {
+        profile_lap(prof, PROF_READ);
+        if ( !bcf_sr_has_line(args->files,0) ) continue;
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        prof->nrec_in++;
+        if ( line->errcode )
+        {
+            if ( !args->force )
+                error("Encountered an error, cannot proceed. Please check the error output above.\n"
+                      "If feeling adventurous, use the --force option. (At your own risk!)\n");
+            else if ( !line_errcode_warned )
+            {
+                fprintf(stderr,
+                    "Warning: Encountered an error, proceeding only because --force was given.\n"
+                    "         Note that this can result in a segfault or a silent corruption of the output file!\n");
+                line_errcode_warned = 1;
+                line->errcode = 0;
+            }
+        }
+        if ( args->filter )
+        {
+            int pass = filter_test(args->filter, line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            profile_lap(prof, PROF_FILTER);
+            if ( !pass ) 
+            {
+                if ( !args->keep_sites ) continue;
+                if ( bcf_write1(args->out_fh, args->hdr_out, line)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname);
+                profile_lap(prof, PROF_WRITE);
+                prof->nrec_out++;
+                continue;
+            }
+        }
+        annotate(args, line);
+        profile_lap(prof, PROF_PROCESS);
+        if ( bcf_write1(args->out_fh, args->hdr_out, line)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname);
+        profile_lap(prof, PROF_WRITE);
+        prof->nrec_out++;
+    }
+    profile_lap(prof, PROF_READ);
+}
+
+/*
+    Parallel annotation: the contigs of the indexed input file are split into
+    groups of about the same number of records and each group is annotated by
+    a worker thread with its own readers, annotation structures and filters,
+    into a temporary BCF. The main thread copies the temporary files to the
+    output in the original order of contigs.
+*/
+typedef struct
+{
+    args_t *args;       // the options as parsed from the command line, before init_data()
+    const char *fname;  // the input file
+    char *regions;      // comma-separated list of contigs
+    char *tmp_fname;    // temporary output file
+}
+annot_chunk_t;
+
+static void *annotate_chunk(void *arg)
+{
+    annot_chunk_t *chunk = (annot_chunk_t*) arg;
+    args_t *args = (args_t*) malloc(sizeof(args_t));
+    *args = *chunk->args;
+    args->prof.format = 0;
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->collapse = chunk->args->files->collapse;
+    if ( bcf_sr_set_regions(args->files, chunk->regions, 0)<0 ) error("Failed to set the regions: %s\n", chunk->regions);
+    if ( !bcf_sr_add_reader(args->files, chunk->fname) ) error("Failed to read from %s: %s\n", chunk->fname,bcf_sr_strerror(args->files->errnum));
+    args->output_fname = chunk->tmp_fname;
+    args->output_type  = FT_BCF;
+    args->n_threads    = 0;
+    args->columns = chunk->args->columns ? strdup(chunk->args->columns) : NULL;
+    memset(&args->merge_method_str, 0, sizeof(args->merge_method_str));
+    if ( chunk->args->merge_method_str.l ) kputs(chunk->args->merge_method_str.s, &args->merge_method_str);
+
+    init_data(args);
+    annotate_records(args);
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+    free(args);
+    return chunk;
+}
+
+static void annotate_split(args_t *args, const char *fname)
+{
+    // the command line options are kept untouched for the workers, the main
+    // thread initializes a copy to create the output header
+    args_t *main_args = (args_t*) malloc(sizeof(args_t));
+    *main_args = *args;
+    main_args->columns = args->columns ? strdup(args->columns) : NULL;
+    memset(&main_args->merge_method_str, 0, sizeof(main_args->merge_method_str));
+    if ( args->merge_method_str.l ) kputs(args->merge_method_str.s, &main_args->merge_method_str);
+    if ( !bcf_sr_add_reader(main_args->files, fname) ) error("Failed to read from %s: %s\n", fname,bcf_sr_strerror(main_args->files->errnum));
+    init_data(main_args);
+
+    bcf_sr_t *reader = &main_args->files->readers[0];
+    if ( !reader->tbx_idx && !reader->bcf_idx ) error("The --split-contigs option requires an indexed input file\n");
+
+    // consecutive groups of contigs with similar number of records, empty contigs are skipped
+    int i, nchunks;
+    regplan_chunk_t *plan = regplan_contigs(main_args->files, 4*args->n_threads, &nchunks);
+    char *tmp_dir = nchunks ? regplan_tmpdir(args->tmp_dir, "/tmp/bcftools-annotate.XXXXXX") : NULL;
+    annot_chunk_t *chunks = (annot_chunk_t*) calloc(nchunks ? nchunks : 1, sizeof(annot_chunk_t));
+    kstring_t str = {0,0,0};
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].args  = args;
+        chunks[i].fname = fname;
+        chunks[i].regions = plan[i].regions;
+        str.l = 0;
+        ksprintf(&str, "%s/%05d.bcf", tmp_dir, i);
+        chunks[i].tmp_fname = strdup(str.s);
+    }
+    free(str.s);
+
+    hts_tpool *pool = nchunks ? hts_tpool_init(args->n_threads) : NULL;
+    hts_tpool_process *queue = NULL;
+    if ( nchunks )
+    {
+        if ( !pool ) error("Failed to initialize %d threads\n", args->n_threads);
+        queue = hts_tpool_process_init(pool, nchunks, 0);
+        for (i=0; i<nchunks; i++)
+            if ( hts_tpool_dispatch(pool, queue, annotate_chunk, &chunks[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    }
+
+    // copy the annotated chunks to the output in order
+    bcf1_t *rec = bcf_init1();
+    for (i=0; i<nchunks; i++)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        annot_chunk_t *chunk = (annot_chunk_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        htsFile *fh = hts_open(chunk->tmp_fname, "r");
+        if ( !fh ) error("Could not read %s: %s\n", chunk->tmp_fname, strerror(errno));
+        bcf_hdr_t *hdr = bcf_hdr_read(fh);
+        if ( !hdr ) error("Could not read the header of %s\n", chunk->tmp_fname);
+        int ret;
+        while ( (ret=bcf_read(fh, hdr, rec))==0 )
+            if ( bcf_write1(main_args->out_fh, main_args->hdr_out, rec)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,main_args->output_fname);
+        if ( ret < -1 ) error("Error reading %s\n", chunk->tmp_fname);
+        bcf_hdr_destroy(hdr);
+        if ( hts_close(fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->tmp_fname);
+        unlink(chunk->tmp_fname);
+        free(chunk->tmp_fname);
+    }
+    bcf_destroy1(rec);
+    if ( queue ) hts_tpool_process_destroy(queue);
+    if ( pool ) hts_tpool_destroy(pool);
+    free(chunks);
+    regplan_destroy(plan, nchunks);
+    regplan_tmpdir_destroy(tmp_dir);
+
+    destroy_data(main_args);    // the readers are destroyed by the caller
+    free(main_args);
+    free(args->columns);
+    free(args->merge_method_str.s);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -2740,13 +3046,17 @@ static void usage(args_t *args)
     fprintf(stderr, "       --no-version               do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>            write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "       --profile[=json]           print time spent in reading, filtering, annotating and writing to stderr\n");
     fprintf(stderr, "   -r, --regions <region>         restrict to comma-separated list of regions\n");
+    fprintf(stderr, "       --read-ahead <int>         number of BGZF blocks of remote (URL) inputs to read ahead, 0 to disable [%d]\n", READAHEAD_NBLOCKS);
     fprintf(stderr, "   -R, --regions-file <file>      restrict to regions listed in a file\n");
     fprintf(stderr, "       --rename-chrs <file>       rename sequences according to map file: from\\tto\n");
     fprintf(stderr, "   -s, --samples [^]<list>        comma separated list of samples to annotate (or exclude with \"^\" prefix)\n");
     fprintf(stderr, "   -S, --samples-file [^]<file>   file of samples to annotate (or exclude with \"^\" prefix)\n");
     fprintf(stderr, "       --single-overlaps          keep memory low by avoiding complexities arising from handling multiple overlapping intervals\n");
     fprintf(stderr, "   -x, --remove <list>            list of annotations (e.g. ID,INFO/DP,FORMAT/DP,FILTER) to remove (or keep with \"^\" prefix). See man page for details\n");
+    fprintf(stderr, "       --split-contigs            annotate groups of contigs in parallel in --threads worker threads\n");
+    fprintf(stderr, "       --temp-dir <dir>           temporary files with --split-contigs [/tmp/bcftools-annotate.XXXXXX]\n");
     fprintf(stderr, "       --threads <int>            number of extra output compression threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
@@ -2761,6 +3071,7 @@ int main_vcfannotate(int argc, char *argv[])
     args->output_fname = "-";
     args->output_type = FT_VCF;
     args->n_threads = 0;
+    args->read_ahead = READAHEAD_NBLOCKS;
     args->record_cmd_line = 1;
     args->ref_idx = args->alt_idx = args->chr_idx = args->beg_idx = args->end_idx = -1;
     args->set_ids_replace = 1;
@@ -2774,6 +3085,8 @@ int main_vcfannotate(int argc, char *argv[])
         {"output",required_argument,NULL,'o'},
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
+        {"profile",optional_argument,NULL,13},
+        {"read-ahead",required_argument,NULL,14},
         {"annotations",required_argument,NULL,'a'},
         {"merge-logic",required_argument,NULL,'l'},
         {"collapse",required_argument,NULL,2},
@@ -2790,6 +3103,8 @@ int main_vcfannotate(int argc, char *argv[])
         {"single-overlaps",no_argument,NULL,10},
         {"no-version",no_argument,NULL,8},
         {"force",no_argument,NULL,'f'},
+        {"split-contigs",no_argument,NULL,11},
+        {"temp-dir",required_argument,NULL,12},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "h:?o:O:r:R:a:x:c:i:e:S:s:I:m:kl:f",loptions,NULL)) >= 0)
@@ -2842,6 +3157,18 @@ int main_vcfannotate(int argc, char *argv[])
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
             case 10 : args->single_overlaps = 1; break;
+            case 11 : args->split_contigs = 1; break;
+            case 12 : args->tmp_dir = optarg; break;
+            case 13 :
+                if ( profile_init(&args->prof, "annotate", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
+            case 14 :
+                {
+                    char *tmp;
+                    args->read_ahead = strtol(optarg,&tmp,10);
+                    if ( *tmp || args->read_ahead<0 ) error("Could not parse --read-ahead %s, expected a non-negative integer\n", optarg);
+                }
+                break;
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
         }
@@ -2874,43 +3201,36 @@ int main_vcfannotate(int argc, char *argv[])
             args->files->collapse = collapse ? collapse : COLLAPSE_SOME;
         }
     }
+    if ( args->split_contigs )
+    {
+        if ( args->n_threads<1 ) error("The --split-contigs option requires --threads\n");
+        if ( args->regions_list ) error("The --split-contigs option cannot be combined with -r/-R\n");
+        if ( !strcmp("-",fname) ) error("The --split-contigs option requires an indexed input file\n");
+        args->files->require_index = 1;
+    }
+    char *sparse_regions = args->tgts_is_vcf && !args->split_contigs ? sparse_target_regions(args, fname) : NULL;
+    if ( sparse_regions )
+    {
+        if ( bcf_sr_set_regions(args->files, sparse_regions, 0)<0 ) error("Failed to set the regions: %s\n", sparse_regions);
+        free(sparse_regions);
+        args->sparse_tgts = 1;
+    }
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+    char *sr_fnames[2] = { fname, args->tgts_is_vcf ? args->targets_fname : NULL };
+    if ( sr_set_readahead(args->files, sr_fnames, 2, args->read_ahead)<0 ) error("Failed to create threads\n");
+    if ( args->split_contigs )
+    {
+        annotate_split(args, fname);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to read from %s: %s\n", !strcmp("-",fname)?"standard input":fname,bcf_sr_strerror(args->files->errnum));
 
-    static int line_errcode_warned = 0;
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
-    {
-        if ( !bcf_sr_has_line(args->files,0) ) continue;
-        bcf1_t *line = bcf_sr_get_line(args->files,0);
-        if ( line->errcode )
-        {
-            if ( !args->force )
-                error("Encountered an error, cannot proceed. Please check the error output above.\n"
-                      "If feeling adventurous, use the --force option. (At your own risk!)\n");
-            else if ( !line_errcode_warned )
-            {
-                fprintf(stderr,
-                    "Warning: Encountered an error, proceeding only because --force was given.\n"
-                    "         Note that this can result in a segfault or a silent corruption of the output file!\n");
-                line_errcode_warned = 1;
-                line->errcode = 0;
-            }
-        }
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) 
-            {
-                if ( args->keep_sites && bcf_write1(args->out_fh, args->hdr_out, line)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname);
-                continue;
-            }
-        }
-        annotate(args, line);
-        if ( bcf_write1(args->out_fh, args->hdr_out, line)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname);
-    }
+    annotate_records(args);
     destroy_data(args);
+    profile_report(&args->prof, stderr);
     bcf_sr_destroy(args->files);
     free(args);
     return 0;
@@ -31,10 +31,29 @@
 #include "vcfbuf.h"
 #include "rbuf.h"
 
+// Bit-packed genotypes for the LD calculations, one bit per sample in each of the planes
+#define GT_UNKNOWN  0   // not packed yet
+#define GT_PACKED   1
+#define GT_NOGT     2   // no usable GT
+#define GT_SLOW     3   // ploidy not supported, use the per-sample code
+#define GT_V  0         // the sample has at least one allele
+#define GT_N2 1         //      two alleles
+#define GT_D1 2         //      the alt dosage is at least one
+#define GT_D2 3         //      the alt dosage is two
+#define GT_NPLANES 4
+typedef struct
+{
+    uint64_t *bits;
+    int state, mbits;
+}
+gtbits_t;
+
 typedef struct
 {
     double max[VCFBUF_LD_N];
     int rand_missing, filter1;
+    gtbits_t qgt;       // the packed record passed to the last vcfbuf_ld() call
+    bcf1_t *qrec;
 }
 ld_t;
 
@@ -43,6 +62,7 @@ typedef struct
     bcf1_t *rec;
     double af;
     int af_set:1, filter:1, idx:30;
+    gtbits_t gt;
 }
 vcfrec_t;
 
@@ -78,6 +98,8 @@ struct _vcfbuf_t
     prune_t prune;
     overlap_t overlap;
     rmdup_t rmdup;
+    bcf1_t **pool;      // spare records kept with their grown buffers, see vcfbuf_acquire()
+    int npool, mpool;
 };
 
 vcfbuf_t *vcfbuf_init(bcf_hdr_t *hdr, int win)
@@ -96,8 +118,14 @@ void vcfbuf_destroy(vcfbuf_t *buf)
 {
     int i;
     for (i=0; i<buf->rbuf.m; i++)
+    {
         if ( buf->vcf[i].rec ) bcf_destroy(buf->vcf[i].rec);
+        free(buf->vcf[i].gt.bits);
+    }
     free(buf->vcf);
+    for (i=0; i<buf->npool; i++) bcf_destroy(buf->pool[i]);
+    free(buf->pool);
+    free(buf->ld.qgt.bits);
     free(buf->prune.farr);
     free(buf->prune.vrec);
     free(buf->prune.ac);
@@ -119,6 +147,19 @@ void vcfbuf_set(vcfbuf_t *buf, vcfbuf_opt_t key, void *value)
     if ( key==VCFBUF_RMDUP) { buf->rmdup.active = *((int*)value); return; }
 }
 
+bcf1_t *vcfbuf_acquire(vcfbuf_t *buf)
+{
+    if ( buf->npool ) return buf->pool[--buf->npool];
+    return bcf_init1();
+}
+
+void vcfbuf_release(vcfbuf_t *buf, bcf1_t *rec)
+{
+    if ( !rec ) return;
+    hts_expand(bcf1_t*, buf->npool+1, buf->mpool, buf->pool);
+    buf->pool[buf->npool++] = rec;
+}
+
 int vcfbuf_nsites(vcfbuf_t *buf)
 {
     return buf->rbuf.n;
@@ -129,7 +170,7 @@ bcf1_t *vcfbuf_push(vcfbuf_t *buf, bcf1_t *rec)
     rbuf_expand0(&buf->rbuf, vcfrec_t, buf->rbuf.n+1, buf->vcf);
 
     int i = rbuf_append(&buf->rbuf);
-    if ( !buf->vcf[i].rec ) buf->vcf[i].rec = bcf_init1();
+    if ( !buf->vcf[i].rec ) buf->vcf[i].rec = vcfbuf_acquire(buf);
     
     bcf1_t *ret = buf->vcf[i].rec;
     buf->vcf[i].rec = rec;
@@ -137,6 +178,16 @@ bcf1_t *vcfbuf_push(vcfbuf_t *buf, bcf1_t *rec)
     buf->vcf[i].filter = buf->ld.filter1;
     buf->ld.filter1 = 0;
 
+    // the record was just packed by vcfbuf_ld(), keep the bits
+    buf->vcf[i].gt.state = GT_UNKNOWN;
+    if ( rec==buf->ld.qrec && buf->ld.qgt.state!=GT_UNKNOWN )
+    {
+        gtbits_t tmp = buf->vcf[i].gt;
+        buf->vcf[i].gt = buf->ld.qgt;
+        buf->ld.qgt = tmp;
+    }
+    buf->ld.qrec = NULL;
+
     return ret;
 }
 
@@ -353,6 +404,7 @@ static double _estimate_af(int8_t *ptr, int size, int nvals, int nsamples)
 
     Returns 0 on success, -1 if the values could not be determined (missing genotypes)
 */
+static int _calc_ld_values(double *nhd, double ab, double aa, double bb, double a, double b, int nab, int ndiff, int an_tot, int bn_tot, vcfbuf_ld_t *ld);
 static int _calc_r2_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec, vcfbuf_ld_t *ld)
 {
     if ( arec->n_sample!=brec->n_sample ) error("Different number of samples: %d vs %d\n",arec->n_sample,brec->n_sample);
@@ -435,6 +487,11 @@ static int _calc_r2_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec, vcfbuf_ld_t *l
             nhd[ bdsg*3 + adsg ]++;
         }
     }
+    return _calc_ld_values(nhd, ab, aa, bb, a, b, nab, ndiff, an_tot, bn_tot, ld);
+}
+
+static int _calc_ld_values(double *nhd, double ab, double aa, double bb, double a, double b, int nab, int ndiff, int an_tot, int bn_tot, vcfbuf_ld_t *ld)
+{
     if ( !nab ) return -1;  // no data in common for the two sites
 
     double pa = a/an_tot;
@@ -479,9 +536,100 @@ static int _calc_r2_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec, vcfbuf_ld_t *l
     return 0;
 }
 
+/*
+    Pack the dosages and numbers of alleles as _calc_r2_ld() sees them, so that
+    the sums it needs can be obtained by popcounts over 64 samples at a time.
+*/
+static void _pack_gt(vcfbuf_t *buf, bcf1_t *rec, gtbits_t *gt)
+{
+    gt->state = GT_NOGT;
+    if ( !rec->n_sample ) return;
+
+    int i,j,igt = bcf_hdr_id2int(buf->hdr, BCF_DT_ID, "GT");
+    bcf_unpack(rec, BCF_UN_FMT);
+    bcf_fmt_t *fmt = NULL;
+    for (i=0; i<rec->n_fmt; i++)
+        if ( rec->d.fmt[i].id==igt ) { fmt = &rec->d.fmt[i]; break; }
+    if ( !fmt || fmt->n==0 ) return;
+    if ( fmt->type!=BCF_BT_INT8 ) error("TODO: the GT fmt_type is not int8!\n");
+    if ( fmt->n > 2 ) { gt->state = GT_SLOW; return; }
+
+    int nw = (rec->n_sample + 63) / 64;
+    hts_expand(uint64_t, GT_NPLANES*nw, gt->mbits, gt->bits);
+    memset(gt->bits, 0, sizeof(uint64_t)*GT_NPLANES*nw);
+    uint64_t *v = gt->bits + GT_V*nw, *n2 = gt->bits + GT_N2*nw, *d1 = gt->bits + GT_D1*nw, *d2 = gt->bits + GT_D2*nw;
+    for (i=0; i<rec->n_sample; i++)
+    {
+        int8_t *ptr = (int8_t*) (fmt->p + i*fmt->size);
+        int dsg = 0, an = 0;
+        for (j=0; j<fmt->n; j++)
+        {
+            if ( ptr[j]==bcf_int8_vector_end ) break;
+            if ( ptr[j]==bcf_gt_missing ) break;
+            if ( bcf_gt_allele(ptr[j]) ) dsg += 1;
+            an++;
+        }
+        if ( !an ) continue;
+        uint64_t bit = 1ULL << (i & 63);
+        v[i>>6] |= bit;
+        if ( an==2 ) n2[i>>6] |= bit;
+        if ( dsg>=1 ) d1[i>>6] |= bit;
+        if ( dsg==2 ) d2[i>>6] |= bit;
+    }
+    gt->state = GT_PACKED;
+}
+
+/*
+    The same as _calc_r2_ld() without --randomize-missing, using the packed genotypes.
+    With the dosage split into the d1 and d2 bits, d = d1 + d2 and d^2 = d1 + 3*d2.
+*/
+static int _calc_r2_ld_bits(gtbits_t *agt, gtbits_t *bgt, int nsmpl, vcfbuf_ld_t *ld)
+{
+    int i, nw = (nsmpl + 63) / 64;
+    uint64_t *av = agt->bits, *an2 = av + GT_N2*nw, *ad1 = av + GT_D1*nw, *ad2 = av + GT_D2*nw;
+    uint64_t *bv = bgt->bits, *bn2 = bv + GT_N2*nw, *bd1 = bv + GT_D1*nw, *bd2 = bv + GT_D2*nw;
+    int64_t nab = 0, na2 = 0, nb2 = 0, na1 = 0, naa2 = 0, nb1 = 0, nbb2 = 0, nab11 = 0, nab12 = 0, nab21 = 0, nab22 = 0, ndiff = 0;
+    int64_t nhd[9] = {0,0,0,0,0,0,0,0,0};
+    for (i=0; i<nw; i++)
+    {
+        uint64_t m = av[i] & bv[i];
+        if ( !m ) continue;
+        uint64_t x1 = ad1[i] & m, x2 = ad2[i] & m, y1 = bd1[i] & m, y2 = bd2[i] & m;
+        nab   += popcount64(m);
+        na2   += popcount64(an2[i] & m);
+        nb2   += popcount64(bn2[i] & m);
+        na1   += popcount64(x1);
+        naa2  += popcount64(x2);
+        nb1   += popcount64(y1);
+        nbb2  += popcount64(y2);
+        nab11 += popcount64(x1 & y1);
+        nab12 += popcount64(x1 & y2);
+        nab21 += popcount64(x2 & y1);
+        nab22 += popcount64(x2 & y2);
+        ndiff += popcount64((x1 ^ y1) | (x2 ^ y2));
+
+        // genotype classes of diploid samples: dosage 0, 1, 2
+        uint64_t m2 = m & an2[i] & bn2[i];
+        if ( !m2 ) continue;
+        uint64_t ac[3] = { m2 & ~x1, m2 & x1 & ~x2, m2 & x2 };
+        uint64_t bc[3] = { m2 & ~y1, m2 & y1 & ~y2, m2 & y2 };
+        int j,k;
+        for (j=0; j<3; j++)
+            for (k=0; k<3; k++)
+                nhd[j*3+k] += popcount64(bc[j] & ac[k]);
+    }
+    double dhd[9];
+    for (i=0; i<9; i++) dhd[i] = nhd[i];
+    double a  = na1 + naa2, aa = na1 + 3*naa2;
+    double b  = nb1 + nbb2, bb = nb1 + 3*nbb2;
+    double ab = nab11 + nab12 + nab21 + nab22;
+    return _calc_ld_values(dhd, ab, aa, bb, a, b, nab, ndiff, nab + na2, nab + nb2, ld);
+}
+
 int vcfbuf_ld(vcfbuf_t *buf, bcf1_t *rec, vcfbuf_ld_t *ld)
 {
     int ret = -1;
+    buf->ld.qrec = NULL;
     if ( !buf->rbuf.n ) return ret;
 
     int j, i = buf->rbuf.f;
@@ -497,10 +645,29 @@ int vcfbuf_ld(vcfbuf_t *buf, bcf1_t *rec, vcfbuf_ld_t *ld)
         ld->rec[j] = NULL;
     }
 
+    // Pack the genotypes of the new record once, the records in the buffer are packed
+    // when first needed and keep the bits until they leave the buffer
+    gtbits_t *qgt = NULL;
+    if ( !buf->ld.rand_missing )
+    {
+        qgt = &buf->ld.qgt;
+        _pack_gt(buf, rec, qgt);
+        buf->ld.qrec = rec;
+        if ( qgt->state==GT_NOGT ) return ret;
+    }
+
     for (i=-1; rbuf_next(&buf->rbuf,&i); )
     {   
         if ( buf->vcf[i].filter ) continue;
-        if ( _calc_r2_ld(buf, buf->vcf[i].rec, rec, &tmp) < 0 ) continue;   // missing genotypes
+        gtbits_t *gt = &buf->vcf[i].gt;
+        if ( qgt && qgt->state==GT_PACKED && gt->state==GT_UNKNOWN ) _pack_gt(buf, buf->vcf[i].rec, gt);
+        if ( qgt && qgt->state==GT_PACKED && gt->state==GT_NOGT ) continue;
+        if ( qgt && qgt->state==GT_PACKED && gt->state==GT_PACKED )
+        {
+            if ( buf->vcf[i].rec->n_sample!=rec->n_sample ) error("Different number of samples: %d vs %d\n",buf->vcf[i].rec->n_sample,rec->n_sample);
+            if ( _calc_r2_ld_bits(gt, qgt, rec->n_sample, &tmp) < 0 ) continue;
+        }
+        else if ( _calc_r2_ld(buf, buf->vcf[i].rec, rec, &tmp) < 0 ) continue;   // missing genotypes
 
         int done = 0;
         for (j=0; j<VCFBUF_LD_N; j++)
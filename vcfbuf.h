@@ -64,7 +64,18 @@ vcfbuf_t *vcfbuf_init(bcf_hdr_t *hdr, int win);
 void vcfbuf_destroy(vcfbuf_t *buf);
 
 /*
- *  vcfbuf_push() - push a new site for analysis
+ *  vcfbuf_acquire() - get a spare record from the buffer's pool, kept with the buffers
+ *                     it has grown, or a new one if the pool is empty. The record is owned
+ *                     by the caller until given back with vcfbuf_release() or vcfbuf_push()
+ *  vcfbuf_release() - return a record obtained from vcfbuf_acquire() to the pool
+ */
+bcf1_t *vcfbuf_acquire(vcfbuf_t *buf);
+void vcfbuf_release(vcfbuf_t *buf, bcf1_t *rec);
+
+/*
+ *  vcfbuf_push() - push a new site for analysis. The buffer takes ownership of @rec
+ *                  and returns a spare record in exchange, which the caller owns and
+ *                  can read the next site into. There is no allocation in the steady state.
  */
 bcf1_t *vcfbuf_push(vcfbuf_t *buf, bcf1_t *rec);
 
@@ -77,9 +88,14 @@ bcf1_t *vcfbuf_peek(vcfbuf_t *buf, int idx);
 /*
  *  vcfbuf_remove() - return pointer to i-th record in the buffer and remove it from the buffer
  *  @idx:  0-based index to buffered lines
+ *
+ *  vcfbuf_flush() - return the next record which can leave the buffer, or NULL if none
+ *
+ *  The records returned by vcfbuf_remove() and vcfbuf_flush() remain owned by the buffer
+ *  and are recycled by the next vcfbuf_push(), so they are valid only until then. They
+ *  must not be freed; use bcf_copy() into an acquired record to keep one for longer.
  */
 bcf1_t *vcfbuf_remove(vcfbuf_t *buf, int idx);
-
 bcf1_t *vcfbuf_flush(vcfbuf_t *buf, int flush_all);
 
 /*
@@ -98,6 +114,9 @@ int vcfbuf_nsites(vcfbuf_t *buf);
  *          .. Lewontin's D' (PMID: 19433632)
  *          .. Ragsdale's \hat{D} (doi:10.1093/molbev/msz265)
  *  @rec: corresponding positions or NULL if the value(s) has not been set
+ *
+ *  The genotypes are bit-packed once per record. If @rec is pushed by the next
+ *  vcfbuf_push() call, its packed genotypes are kept; GT must not change in between.
  */
 #define VCFBUF_LD_N 3
 #define VCFBUF_LD_IDX_R2 0
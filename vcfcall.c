@@ -45,6 +45,7 @@ THE SOFTWARE.  */
 #include "gvcf.h"
 #include "regidx.h"
 #include "vcfbuf.h"
+#include "blkpipe.h"
 
 void error(const char *format, ...);
 
@@ -71,6 +72,39 @@ typedef struct
 }
 rec_tgt_t;
 
+/*
+ *  The -t/-T targets of one chromosome, sorted by position. The records come
+ *  sorted, so the lookups move a cursor forward and the missed targets of -i
+ *  are output in a single sweep, see tgt_seek() and tgt_flush().
+ */
+typedef struct
+{
+    char *seq;
+    int n, icur, iflush;    // icur: the first target at or after the last query; iflush: the first target not flushed yet
+    uint32_t *pos;
+    tgt_als_t **als;        // the preparsed alleles with -C alleles, NULL otherwise
+}
+tgt_list_t;
+
+/*
+ *  Multithreaded calling with -m: the main thread reads records in blocks,
+ *  the genotypes are called by worker threads, each block having its own
+ *  copy of the caller's scratch buffers, and the main thread outputs the
+ *  blocks in the input order, see blkpipe.h
+ */
+typedef struct
+{
+    call_t *call;                   // mcall_clone() of args->aux
+    int nsmpl;
+    uint8_t unseen[BLKPIPE_NREC];   // index of the unseen allele, see call_t.unseen
+    uint8_t *ploidy;                // sample ploidies of all records, NULL if not set
+    int ret[BLKPIPE_NREC];          // mcall() return values
+}
+block_t;
+
+static void *call_block(void *arg);
+static void output_block(void *usr, void *arg);
+
 typedef struct
 {
     int flag;   // combination of CF_* flags above
@@ -81,8 +115,10 @@ typedef struct
     int nsamples, *samples_map; // mapping from output sample names to original VCF
     char *regions, *targets;    // regions to process
     int regions_is_file, targets_is_file;
-    regidx_t *tgt_idx;
-    regitr_t *tgt_itr, *tgt_itr_prev, *tgt_itr_tmp;
+    regidx_t *tgt_idx;      // owns the parsed alleles of tgt_list_t
+    tgt_list_t *tgt, *tgt_cur, *tgt_prev;   // all targets, the chromosome of the last lookup and the last record
+    int ntgt, *rid2tgt;     // the targets of VCF chromosomes, -2 if not looked up yet
+    vcmp_t *vcmp;
     vcfbuf_t *vcfbuf;
 
     char *samples_fname;
@@ -96,6 +132,11 @@ typedef struct
     call_t aux;     // parameters and temporary data
     kstring_t str;
 
+    // multithreaded calling, see block_t
+    blkpipe_t *pipe;
+    block_t *blks;
+    int nblk;
+
     int argc;
     char **argv;
 
@@ -108,6 +149,7 @@ typedef struct
     //  int n_perm, *seeds;
     //  double min_perm_p;
     //  void *bed;
+    profile_t prof;
 }
 args_t;
 
@@ -406,18 +448,93 @@ static void tgt_free(void *payload)
     for (i=0; i<als->n; i++) free(als->allele[i]);
     free(als->allele);
 }
-static void tgt_flush_region(args_t *args, char *chr, uint32_t beg, uint32_t end)
+static void tgt_init(args_t *args)
 {
-    if ( !regidx_overlap(args->tgt_idx, chr,beg,end,args->tgt_itr_tmp) ) return;
-    while ( regitr_overlap(args->tgt_itr_tmp) )
+    int i, nseq, constr = args->aux.flag&CALL_CONSTR_ALLELES ? 1 : 0;
+    char **seq = regidx_seq_names(args->tgt_idx, &nseq);
+    regitr_t *itr = regitr_init(args->tgt_idx);
+    args->ntgt = nseq;
+    args->tgt  = (tgt_list_t*) calloc(nseq, sizeof(tgt_list_t));
+    for (i=0; i<nseq; i++)
     {
-        if ( args->tgt_itr_tmp->beg < beg ) continue;
+        tgt_list_t *list = &args->tgt[i];
+        list->seq = seq[i];
+        int m = regidx_seq_nregs(args->tgt_idx, seq[i]);
+        list->pos = (uint32_t*) malloc(sizeof(*list->pos)*m);
+        if ( constr ) list->als = (tgt_als_t**) malloc(sizeof(*list->als)*m);
+        if ( !regidx_overlap(args->tgt_idx, seq[i], 0, REGIDX_MAX, itr) ) continue;
+        while ( regitr_overlap(itr) )
+        {
+            list->pos[list->n] = itr->beg;
+            if ( constr ) list->als[list->n] = &regitr_payload(itr,tgt_als_t);
+            list->n++;
+        }
+    }
+    regitr_destroy(itr);
 
-        tgt_als_t *tgt_als = &regitr_payload(args->tgt_itr_tmp,tgt_als_t);
+    int nctg = args->aux.hdr->n[BCF_DT_CTG];
+    args->rid2tgt = (int*) malloc(sizeof(*args->rid2tgt)*nctg);
+    for (i=0; i<nctg; i++) args->rid2tgt[i] = -2;
+}
+static void tgt_destroy(args_t *args)
+{
+    int i;
+    for (i=0; i<args->ntgt; i++)
+    {
+        free(args->tgt[i].pos);
+        free(args->tgt[i].als);
+    }
+    free(args->tgt);
+    free(args->rid2tgt);
+}
+static tgt_list_t *tgt_list(args_t *args, bcf1_t *rec)
+{
+    int *itgt = &args->rid2tgt[rec->rid];
+    if ( *itgt==-2 )
+    {
+        const char *chr = bcf_seqname(args->aux.hdr,rec);
+        for (*itgt=args->ntgt-1; *itgt>=0; (*itgt)--)
+            if ( !strcmp(chr,args->tgt[*itgt].seq) ) break;
+    }
+    return *itgt>=0 ? &args->tgt[*itgt] : NULL;
+}
+// Returns the index of the first target at the record's position or -1 if there is none.
+// For backward compatibility, the exact position is required, not an interval overlap
+static int tgt_seek(args_t *args, bcf1_t *rec)
+{
+    tgt_list_t *list = tgt_list(args, rec);
+    if ( !list ) return -1;
+    uint32_t pos = rec->pos;
+    if ( list!=args->tgt_cur )
+    {
+        // a new chromosome, find the position by bisection
+        int lo = 0, hi = list->n;
+        while ( lo < hi )
+        {
+            int mid = (lo + hi) / 2;
+            if ( list->pos[mid] < pos ) lo = mid + 1;
+            else hi = mid;
+        }
+        list->icur = lo;
+        args->tgt_cur = list;
+    }
+    while ( list->icur > 0 && list->pos[list->icur-1] >= pos ) list->icur--;     // a step back to the buffered record
+    while ( list->icur < list->n && list->pos[list->icur] < pos ) list->icur++;
+    return list->icur < list->n && list->pos[list->icur]==pos ? list->icur : -1;
+}
+// Output the unused targets at positions up to end, inclusive
+static void tgt_flush_list(args_t *args, tgt_list_t *list, uint32_t end)
+{
+    int rid = -1;
+    while ( list->iflush < list->n && list->pos[list->iflush] <= end )
+    {
+        tgt_als_t *tgt_als = list->als[list->iflush];
+        uint32_t pos = list->pos[list->iflush++];
         if ( tgt_als->used ) continue;
 
-        args->missed_line->rid  = bcf_hdr_name2id(args->aux.hdr,chr);
-        args->missed_line->pos  = args->tgt_itr_tmp->beg;
+        if ( rid<0 ) rid = bcf_hdr_name2id(args->aux.hdr,list->seq);
+        args->missed_line->rid  = rid;
+        args->missed_line->pos  = pos;
         bcf_unpack(args->missed_line,BCF_UN_ALL);
         bcf_update_alleles(args->aux.hdr, args->missed_line, (const char**)tgt_als->allele, tgt_als->n);
         tgt_als->used = 1;
@@ -428,29 +545,19 @@ static void tgt_flush(args_t *args, bcf1_t *rec)
 {
     if ( rec )
     {
-        char *chr = (char*)bcf_seqname(args->aux.hdr,rec);
-
-        if ( !args->tgt_itr_prev )                  // first record
-            tgt_flush_region(args,chr,0,rec->pos-1);
-
-        else if ( strcmp(chr,args->tgt_itr_prev->seq) )  // first record on a new chromosome
-        {
-            tgt_flush_region(args,args->tgt_itr_prev->seq,args->tgt_itr_prev->beg+1,REGIDX_MAX);
-            tgt_flush_region(args,chr,0,rec->pos-1);
-        }
-        else                                        // another record on the same chromosome
-            tgt_flush_region(args,args->tgt_itr_prev->seq,args->tgt_itr_prev->beg,rec->pos-1);
+        tgt_list_t *list = tgt_list(args, rec);
+        if ( args->tgt_prev && args->tgt_prev!=list )   // first record on a new chromosome
+            tgt_flush_list(args, args->tgt_prev, REGIDX_MAX);
+        if ( list && rec->pos > 0 ) tgt_flush_list(args, list, rec->pos-1);
+        args->tgt_prev = list;
     }
     else
     {
         // flush everything
-        if ( args->tgt_itr_prev )
-            tgt_flush_region(args,args->tgt_itr_prev->seq,args->tgt_itr_prev->beg,REGIDX_MAX);
-
-        int i, nchr = 0;
-        char **chr = regidx_seq_names(args->tgt_idx, &nchr);
-        for (i=0; i<nchr; i++)
-            tgt_flush_region(args,chr[i],0,REGIDX_MAX);
+        int i;
+        if ( args->tgt_prev ) tgt_flush_list(args, args->tgt_prev, REGIDX_MAX);
+        for (i=0; i<args->ntgt; i++)
+            tgt_flush_list(args, &args->tgt[i], REGIDX_MAX);
     }
 }
 inline static int is_indel(int nals, char **als)
@@ -477,20 +584,7 @@ bcf1_t *next_line(args_t *args)
         {
             rec = args->aux.srs->readers[0].buffer[0];
             if ( args->aux.srs->errnum || rec->errcode ) error("Error: could not parse the input VCF\n");
-            if ( args->tgt_idx )
-            {
-                if ( !regidx_overlap(args->tgt_idx, bcf_seqname(args->aux.hdr,rec),rec->pos,rec->pos,args->tgt_itr) ) continue;
-
-                // For backward compatibility: require the exact position, not an interval overlap
-                int pos_match = 0;
-                while ( regitr_overlap(args->tgt_itr) )
-                {
-                    if ( args->tgt_itr->beg != rec->pos ) continue;
-                    pos_match = 1;
-                    break;
-                }
-                if ( !pos_match ) continue;
-            }
+            if ( args->tgt_idx && tgt_seek(args, rec)<0 ) continue;
             if ( args->samples_map ) bcf_subset(args->aux.hdr, rec, args->nsamples, args->samples_map);
             bcf_unpack(rec, BCF_UN_STR);
             return rec;
@@ -522,16 +616,7 @@ bcf1_t *next_line(args_t *args)
         {
             rec = args->aux.srs->readers[0].buffer[0];
             if ( args->aux.srs->errnum || rec->errcode ) error("Error: could not parse the input VCF\n");
-            if ( !regidx_overlap(args->tgt_idx, bcf_seqname(args->aux.hdr,rec),rec->pos,rec->pos,args->tgt_itr) ) continue;
-            // as above: require the exact position, not an interval overlap
-            int exact_match = 0;
-            while ( regitr_overlap(args->tgt_itr) )
-            {
-                if ( args->tgt_itr->beg != rec->pos ) continue;
-                exact_match = 1;
-                break;
-            }
-            if ( !exact_match ) continue;
+            if ( tgt_seek(args, rec)<0 ) continue;
 
             if ( args->samples_map ) bcf_subset(args->aux.hdr, rec, args->nsamples, args->samples_map);
             bcf_unpack(rec, BCF_UN_STR);
@@ -543,7 +628,7 @@ bcf1_t *next_line(args_t *args)
     }
 
     nbuf = vcfbuf_nsites(args->vcfbuf);
-    int n, i,j;
+    int n, j;
     for (n=nbuf; n>1; n--)
     {
         recN = vcfbuf_peek(args->vcfbuf, n-1);
@@ -555,48 +640,39 @@ bcf1_t *next_line(args_t *args)
         return NULL;
     }
 
-    // Find the VCF and tab record with the best matching combination of alleles, prioritize 
-    // records of the same type (snp vs indel)
+    // Find the tab record with the best matching combination of alleles for the first of the
+    // buffered VCF records, prioritize records of the same type (snp vs indel). The remaining
+    // duplicates are matched in turn by the next calls
     rec_tgt_t rec_tgt;
     memset(&rec_tgt,0,sizeof(rec_tgt));
-    regidx_overlap(args->tgt_idx, bcf_seqname(args->aux.hdr,rec0),rec0->pos,rec0->pos,args->tgt_itr);
-    regitr_t *tmp_itr = regitr_init(args->tgt_idx);
-    regitr_copy(tmp_itr, args->tgt_itr);
-    for (i=0; i<n; i++)
+    int k, itgt = tgt_seek(args, rec0);
+    tgt_list_t *list = args->tgt_cur;
+    int rec_indel = is_indel(rec0->n_allele, rec0->d.allele) ? 1 : -1;
+    for (k=itgt; itgt>=0 && k<list->n && list->pos[k]==rec0->pos; k++)
     {
-        rec = vcfbuf_peek(args->vcfbuf, i);
-        int rec_indel = is_indel(rec->n_allele, rec->d.allele) ? 1 : -1;
-        while ( regitr_overlap(tmp_itr) )
+        tgt_als_t *als = list->als[k];
+        if ( als->used ) continue;
+        int nmatch_als = 0;
+        int ret = vcmp_set_ref(args->vcmp, rec0->d.allele[0], als->allele[0]);
+        if ( ret==0 )
         {
-            if ( tmp_itr->beg != rec->pos ) continue;
-            tgt_als_t *als = &regitr_payload(tmp_itr,tgt_als_t);
-            if ( als->used ) continue;
-            int nmatch_als = 0;
-            vcmp_t *vcmp = vcmp_init();
-            int ret = vcmp_set_ref(vcmp, rec->d.allele[0], als->allele[0]);
-            if ( ret==0 )
+            nmatch_als++;
+            if ( rec0->n_allele > 1 && als->n > 1 )
             {
-                nmatch_als++;
-                if ( rec->n_allele > 1 && als->n > 1 )
+                for (j=1; j<als->n; j++)
                 {
-                    for (j=1; j<als->n; j++)
-                    {
-                        if ( vcmp_find_allele(vcmp, rec->d.allele+1, rec->n_allele-1, als->allele[j])>=0 ) nmatch_als++;
-                    }
+                    if ( vcmp_find_allele(args->vcmp, rec0->d.allele+1, rec0->n_allele-1, als->allele[j])>=0 ) nmatch_als++;
                 }
             }
-            int als_indel = is_indel(als->n, als->allele) ? 1 : -1;
-            nmatch_als *= rec_indel*als_indel;
-            if ( nmatch_als > rec_tgt.nmatch_als || !rec_tgt.als )
-            {
-                rec_tgt.nmatch_als = nmatch_als;
-                rec_tgt.als  = als;
-                rec_tgt.ibuf = i;
-            }
-            vcmp_destroy(vcmp);
+        }
+        int als_indel = is_indel(als->n, als->allele) ? 1 : -1;
+        nmatch_als *= rec_indel*als_indel;
+        if ( nmatch_als > rec_tgt.nmatch_als || !rec_tgt.als )
+        {
+            rec_tgt.nmatch_als = nmatch_als;
+            rec_tgt.als = als;
         }
     }
-    regitr_destroy(tmp_itr);
 
     args->aux.tgt_als = rec_tgt.als;
     if ( rec_tgt.als ) rec_tgt.als->used = 1;
@@ -613,8 +689,6 @@ static void init_data(args_t *args)
     if ( args->targets )
     {
         args->tgt_idx = regidx_init(args->targets, tgt_parse, args->aux.flag&CALL_CONSTR_ALLELES ? tgt_free : (regidx_free_f) NULL, sizeof(tgt_als_t), args->aux.flag&CALL_CONSTR_ALLELES ? args : NULL);
-        args->tgt_itr = regitr_init(args->tgt_idx);
-        args->tgt_itr_tmp = regitr_init(args->tgt_idx);
     }
 
     if ( args->regions )
@@ -623,6 +697,7 @@ static void init_data(args_t *args)
             error("Failed to read the regions: %s\n", args->regions);
     }
 
+    if ( args->nblk && bcf_sr_set_threads(args->aux.srs, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->aux.srs, args->bcf_fname) )
         error("Failed to read from %s: %s\n", !strcmp("-",args->bcf_fname)?"standard input":args->bcf_fname,bcf_sr_strerror(args->aux.srs->errnum));
     args->aux.hdr = bcf_sr_get_header(args->aux.srs,0);
@@ -684,12 +759,17 @@ static void init_data(args_t *args)
         }
     }
 
+    if ( args->tgt_idx ) tgt_init(args);
     if ( args->aux.flag & CALL_CONSTR_ALLELES )
+    {
         args->vcfbuf = vcfbuf_init(args->aux.hdr, 0);
+        args->vcmp = vcmp_init();
+    }
 
     args->out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Error: cannot write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+    if ( args->nblk ) hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->aux.srs->p);
+    else if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
 
     if ( args->flag & CF_QCALL )
         return;
@@ -707,22 +787,46 @@ static void init_data(args_t *args)
     if ( bcf_hdr_write(args->out_fh, args->aux.hdr)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,args->output_fname);
 
     if ( args->flag&CF_INS_MISSED ) init_missed_line(args);
+
+    if ( args->nblk )
+    {
+        args->blks = (block_t*) calloc(args->nblk, sizeof(block_t));
+        void **data = (void**) malloc(sizeof(void*)*args->nblk);
+        for (i=0; i<args->nblk; i++)
+        {
+            block_t *blk = data[i] = &args->blks[i];
+            blk->call  = mcall_clone(&args->aux);
+            blk->nsmpl = bcf_hdr_nsamples(args->aux.hdr);
+            if ( args->aux.ploidy ) blk->ploidy = (uint8_t*) malloc((size_t)BLKPIPE_NREC*blk->nsmpl);
+        }
+        args->pipe = blkpipe_blocks_init(args->aux.srs->p->pool, args->nblk, data, call_block, output_block, args);
+        free(data);
+    }
 }
 
 static void destroy_data(args_t *args)
 {
+    int i;
+    if ( args->nblk )
+    {
+        blkpipe_destroy(args->pipe);
+        for (i=0; i<args->nblk; i++)
+        {
+            mcall_destroy_clone(args->blks[i].call);
+            free(args->blks[i].ploidy);
+        }
+        free(args->blks);
+    }
     if ( args->vcfbuf ) vcfbuf_destroy(args->vcfbuf);
+    if ( args->vcmp ) vcmp_destroy(args->vcmp);
     if ( args->tgt_idx )
     {
+        tgt_destroy(args);
         regidx_destroy(args->tgt_idx);
-        regitr_destroy(args->tgt_itr);
-        regitr_destroy(args->tgt_itr_tmp);
-        if ( args->tgt_itr_prev ) regitr_destroy(args->tgt_itr_prev);
     }
     if ( args->flag & CF_CCALL ) ccall_destroy(&args->aux);
     else if ( args->flag & CF_MCALL ) mcall_destroy(&args->aux);
     else if ( args->flag & CF_QCALL ) qcall_destroy(&args->aux);
-    int i;
     if ( args->samples )
     {
         for (i=0; i<args->nsamples; i++) free(args->samples[i]);
@@ -810,6 +914,56 @@ static void set_ploidy(args_t *args, bcf1_t *rec)
     int *tmp = args->sex2ploidy; args->sex2ploidy = args->sex2ploidy_prev; args->sex2ploidy_prev = tmp;
 }
 
+static void write_site(args_t *args, bcf1_t *rec, int ret)
+{
+    if ( ret==-1 ) error("Something is wrong\n");
+    else if ( ret==-2 ) return;     // skip the site
+
+    // Normal output
+    if ( (args->aux.flag & CALL_VARONLY) && ret==0 && !args->gvcf ) return;     // not a variant
+    if ( args->gvcf )
+        rec = gvcf_write(args->gvcf, args->out_fh, args->aux.hdr, rec, ret==1?1:0);
+    if ( !rec ) return;
+    if ( bcf_write1(args->out_fh, args->aux.hdr, rec)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args->output_fname);
+    args->prof.nrec_out++;
+}
+
+static void *call_block(void *arg)
+{
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    int i;
+    for (i=0; i<blk->nrec; i++)
+    {
+        bcf_unpack(blk->recs[i], BCF_UN_ALL);
+        dat->call->unseen = dat->unseen[i];
+        if ( dat->ploidy ) memcpy(dat->call->ploidy, dat->ploidy + (size_t)i*dat->nsmpl, dat->nsmpl);
+        dat->ret[i] = mcall(dat->call, blk->recs[i]);
+    }
+    return blk;
+}
+
+static void output_block(void *usr, void *arg)
+{
+    args_t *args = (args_t*) usr;
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    int i;
+    profile_mark(&args->prof);
+    for (i=0; i<blk->nrec; i++) write_site(args, blk->recs[i], dat->ret[i]);
+    profile_lap(&args->prof, PROF_WRITE);
+}
+
+// Takes the current record from the reader, its unseen allele and ploidy must be set
+static void push_site(args_t *args)
+{
+    blkpipe_blk_t *blk = blkpipe_block(args->pipe);
+    block_t *dat = (block_t*) blk->data;
+    dat->unseen[blk->nrec] = args->aux.unseen;
+    if ( dat->ploidy ) memcpy(dat->ploidy + (size_t)blk->nrec*dat->nsmpl, args->aux.ploidy, dat->nsmpl);
+    blkpipe_push(args->pipe, args->aux.srs, 0);
+}
+
 ploidy_t *init_ploidy(char *alias)
 {
     const ploidy_predef_t *pld = ploidy_predefs;
@@ -860,6 +1014,7 @@ static void usage(args_t *args)
     fprintf(stderr, "       --no-version                do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>             write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>     output type: 'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
+    fprintf(stderr, "       --profile[=json]            print time spent in reading, calling and writing to stderr\n");
     fprintf(stderr, "       --ploidy <assembly>[?]      predefined ploidy, 'list' to print available settings, append '?' for details\n");
     fprintf(stderr, "       --ploidy-file <file>        space/tab-delimited list of CHROM,FROM,TO,SEX,PLOIDY\n");
     fprintf(stderr, "   -r, --regions <region>          restrict to comma-separated list of regions\n");
@@ -940,6 +1095,7 @@ int main_vcfcall(int argc, char *argv[])
         {"targets",required_argument,NULL,'t'},
         {"targets-file",required_argument,NULL,'T'},
         {"threads",required_argument,NULL,9},
+        {"profile",optional_argument,NULL,10},
         {"keep-alts",no_argument,NULL,'A'},
         {"insert-missed",no_argument,NULL,'i'},
         {"skip-Ns",no_argument,NULL,'N'},            // now the new default
@@ -1025,6 +1181,9 @@ int main_vcfcall(int argc, char *argv[])
             case 'S': args.samples_fname = optarg; args.samples_is_file = 1; break;
             case  9 : args.n_threads = strtol(optarg, 0, 0); break;
             case  8 : args.record_cmd_line = 0; break;
+            case 10 :
+                if ( profile_init(&args.prof, "call", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
             default: usage(&args);
         }
     }
@@ -1058,11 +1217,19 @@ int main_vcfcall(int argc, char *argv[])
     if ( args.flag & CF_INS_MISSED && !(args.aux.flag&CALL_CONSTR_ALLELES) ) error("The -i option requires -C alleles\n");
     if ( args.aux.flag&CALL_VARONLY && args.gvcf ) error("The two options cannot be combined: --variants-only and --gvcf\n");
     if ( args.aux.sample_groups && !(args.flag & CF_MCALL) ) error("The -G feature is supported only with the -m calling mode\n");
+
+    // Only -m without -C alleles can be parallelized, otherwise the threads are used for the output
+    if ( args.n_threads>0 && args.flag & CF_MCALL && !(args.aux.flag & CALL_CONSTR_ALLELES) ) args.nblk = 2*args.n_threads;
     init_data(&args);
+    args.prof.nsmpl = args.nsamples;
 
     bcf1_t *bcf_rec;
+    profile_mark(&args.prof);
     while ( (bcf_rec = next_line(&args)) )
     {
+        profile_lap(&args.prof, PROF_READ);
+        args.prof.nrec_in++;
+
         // Skip duplicate positions with all matching `-C alleles -T` used up
         if ( args.aux.flag&CALL_CONSTR_ALLELES && !args.aux.tgt_als ) continue;
 
@@ -1088,7 +1255,11 @@ int main_vcfcall(int argc, char *argv[])
         if ( is_ref && args.aux.flag&CALL_VARONLY )
             continue;
 
-        bcf_unpack(bcf_rec, BCF_UN_ALL);
+        if ( !args.nblk )
+        {
+            bcf_unpack(bcf_rec, BCF_UN_ALL);
+            profile_lap(&args.prof, PROF_READ);
+        }
         if ( args.nsex ) set_ploidy(&args, bcf_rec);
 
         // Various output modes: QCall output (todo)
@@ -1101,8 +1272,12 @@ int main_vcfcall(int argc, char *argv[])
         if ( args.flag & CF_INS_MISSED )
         {
             tgt_flush(&args,bcf_rec);
-            if ( !args.tgt_itr_prev ) args.tgt_itr_prev = regitr_init(args.tgt_idx);
-            regitr_copy(args.tgt_itr_prev, args.tgt_itr);
+        }
+
+        if ( args.nblk )
+        {
+            push_site(&args);
+            continue;
         }
 
         // Calling modes which output VCFs
@@ -1111,18 +1286,16 @@ int main_vcfcall(int argc, char *argv[])
             ret = mcall(&args.aux, bcf_rec);
         else
             ret = ccall(&args.aux, bcf_rec);
-        if ( ret==-1 ) error("Something is wrong\n");
-        else if ( ret==-2 ) continue;   // skip the site
-
-        // Normal output
-        if ( (args.aux.flag & CALL_VARONLY) && ret==0 && !args.gvcf ) continue;     // not a variant
-        if ( args.gvcf )
-            bcf_rec = gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, bcf_rec, ret==1?1:0);
-        if ( bcf_rec && bcf_write1(args.out_fh, args.aux.hdr, bcf_rec)!=0 ) error("[%s] Error: failed to write to %s\n", __func__,args.output_fname);
+        profile_lap(&args.prof, PROF_PROCESS);
+        write_site(&args, bcf_rec, ret);
+        profile_lap(&args.prof, PROF_WRITE);
     }
+    profile_lap(&args.prof, PROF_READ);
+    if ( args.nblk ) blkpipe_flush(args.pipe);
     if ( args.gvcf ) gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, NULL, 0);
     if ( args.flag & CF_INS_MISSED ) tgt_flush(&args,NULL);
     destroy_data(&args);
+    profile_report(&args.prof, stderr);
     return 0;
 }
 
@@ -56,6 +56,7 @@
 typedef struct
 {
     float mean, dev2, norm;
+    double sdev;    // sqrt(2*M_PI*dev2), precalculated in set_gauss_params()
 }
 gauss_param_t;
 
@@ -77,6 +78,7 @@ typedef struct _args_t
     bcf_srs_t *files;
     bcf_hdr_t *hdr;
     int prev_rid, ntot, nused;
+    int baf_id, lrr_id;     // header ids of FORMAT/BAF and FORMAT/LRR
     sample_t query_sample, control_sample;
 
     int nstates;    // number of states: N_STATES for one sample, N_STATES^2 for two samples
@@ -265,6 +267,17 @@ static void init_data(args_t *args)
 
         if ( args->control_sample.name ) free(tmp.s);
     }
+    // the values are read directly from the decoded FORMAT fields, see parse_lrr_baf()
+    args->baf_id = bcf_hdr_id2int(args->hdr,BCF_DT_ID,"BAF");
+    if ( !bcf_hdr_idinfo_exists(args->hdr,BCF_HL_FMT,args->baf_id) ) error("The tag FORMAT/BAF is not present in the VCF\n");
+    if ( bcf_hdr_id2type(args->hdr,BCF_HL_FMT,args->baf_id)!=BCF_HT_REAL ) error("The tag FORMAT/BAF is not defined as Float\n");
+    args->lrr_id = bcf_hdr_id2int(args->hdr,BCF_DT_ID,"LRR");
+    if ( args->lrr_bias>0 )
+    {
+        if ( !bcf_hdr_idinfo_exists(args->hdr,BCF_HL_FMT,args->lrr_id) ) error("The tag FORMAT/LRR is not present in the VCF\n");
+        if ( bcf_hdr_id2type(args->hdr,BCF_HL_FMT,args->lrr_id)!=BCF_HT_REAL ) error("The tag FORMAT/LRR is not defined as Float\n");
+    }
+
     args->query_sample.idx = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->query_sample.name);
     args->control_sample.idx = args->control_sample.name ? bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->control_sample.name) : -1;
     args->nstates = args->control_sample.name ? N_STATES*N_STATES : N_STATES;
@@ -619,7 +632,7 @@ static double avg_ii_prob(int n, double *mat)
 
 static inline double norm_prob(double baf, gauss_param_t *param)
 {
-    return exp(-(baf-param->mean)*(baf-param->mean)*0.5/param->dev2) / param->norm / sqrt(2*M_PI*param->dev2);
+    return exp(-(baf-param->mean)*(baf-param->mean)*0.5/param->dev2) / param->norm / param->sdev;
 }
 
 static int set_observed_prob(args_t *args, sample_t *smpl, int isite)
@@ -640,18 +653,22 @@ static int set_observed_prob(args_t *args, sample_t *smpl, int isite)
         return 0;
     }
 
+    // The homozygous peaks at 0 and 1 have identical parameters in all copy
+    // number states, see set_gauss_params(), evaluate them only once
+    double pk_r = norm_prob(baf,GAUSS_CN1_PK_R(smpl));
+    double pk_a = norm_prob(baf,GAUSS_CN1_PK_A(smpl));
     double cn1_baf = 
-        norm_prob(baf,GAUSS_CN1_PK_R(smpl)) * (fRR + fRA*0.5) +
-        norm_prob(baf,GAUSS_CN1_PK_A(smpl)) * (fAA + fRA*0.5) ;
+        pk_r * (fRR + fRA*0.5) +
+        pk_a * (fAA + fRA*0.5) ;
     double cn2_baf = 
-        norm_prob(baf,GAUSS_CN2_PK_RR(smpl)) * fRR + 
+        pk_r * fRR + 
         norm_prob(baf,GAUSS_CN2_PK_RA(smpl)) * fRA + 
-        norm_prob(baf,GAUSS_CN2_PK_AA(smpl)) * fAA;
+        pk_a * fAA;
     double cn3_baf = 
-        norm_prob(baf,GAUSS_CN3_PK_RRR(smpl)) * fRR + 
+        pk_r * fRR + 
         norm_prob(baf,GAUSS_CN3_PK_RRA(smpl)) * fRA*0.5 + 
         norm_prob(baf,GAUSS_CN3_PK_RAA(smpl)) * fRA*0.5 + 
-        norm_prob(baf,GAUSS_CN3_PK_AAA(smpl)) * fAA;
+        pk_a * fAA;
 
     double norm = cn1_baf + cn2_baf + cn3_baf;
     cn1_baf /= norm;
@@ -662,9 +679,13 @@ static int set_observed_prob(args_t *args, sample_t *smpl, int isite)
     if ( args->verbose ) fprintf(stderr,"%f\t%f %f %f\n", baf,cn1_baf,cn2_baf,cn3_baf);
     #endif
 
-    double cn1_lrr = exp(-(lrr + 0.45)*(lrr + 0.45)/smpl->lrr_dev2);
-    double cn2_lrr = exp(-(lrr - 0.00)*(lrr - 0.00)/smpl->lrr_dev2);
-    double cn3_lrr = exp(-(lrr - 0.30)*(lrr - 0.30)/smpl->lrr_dev2);
+    double cn1_lrr = 0, cn2_lrr = 0, cn3_lrr = 0;   // with zero weight the LRR terms do not contribute
+    if ( args->lrr_bias!=0 )
+    {
+        cn1_lrr = exp(-(lrr + 0.45)*(lrr + 0.45)/smpl->lrr_dev2);
+        cn2_lrr = exp(-(lrr - 0.00)*(lrr - 0.00)/smpl->lrr_dev2);
+        cn3_lrr = exp(-(lrr - 0.30)*(lrr - 0.30)/smpl->lrr_dev2);
+    }
 
     smpl->pobs[CN0] = 0;
     smpl->pobs[CN1] = args->err_prob + (1 - args->baf_bias + args->baf_bias*cn1_baf)*(1 - args->lrr_bias + args->lrr_bias*cn1_lrr);
@@ -784,6 +805,8 @@ static void set_gauss_params(args_t *args, sample_t *smpl)
     for (i=0; i<18; i++) smpl->gauss_param[i].dev2 = smpl->baf_dev2;
 
     double dev = sqrt(smpl->baf_dev2);
+    double sdev = sqrt(2*M_PI*smpl->gauss_param[0].dev2);
+    for (i=0; i<18; i++) smpl->gauss_param[i].sdev = sdev;
 
     GAUSS_CN1_PK_R(smpl)->mean = 0;
     GAUSS_CN1_PK_A(smpl)->mean = 1;
@@ -807,10 +830,19 @@ static void set_gauss_params(args_t *args, sample_t *smpl)
     GAUSS_CN3_PK_AAA(smpl)->norm = norm_cdf(GAUSS_CN3_PK_AAA(smpl)->mean,dev);
 }
 
+// Called by hmm_run_fwd_bwd_ckpt() in the reverse order of the sites. The emission
+// probabilities of the site are no longer needed and are replaced by its fwd-bwd
+// probabilities, so that the full forward matrix is never kept in memory
+static void store_fwd_bwd(hmm_t *hmm, int isite, double *fwd_bwd, void *data)
+{
+    args_t *args = (args_t*) data;
+    memcpy(args->eprob + isite*args->nstates, fwd_bwd, sizeof(*fwd_bwd)*args->nstates);
+}
+
 static int update_sample_args(args_t *args, sample_t *smpl, int ismpl)
 {
     hmm_t *hmm = args->hmm;
-    double *fwd = hmm_get_fwd_bwd_prob(hmm);
+    double *fwd = args->eprob;      // fwd-bwd probabilities, see store_fwd_bwd()
     int nstates = hmm_get_nstates(hmm);
 
     // estimate the BAF mean and deviation for CN3
@@ -962,7 +994,7 @@ static void cnv_flush_viterbi(args_t *args)
                 fprintf(stderr,"\t.. %f %f", args->control_sample.cell_frac,args->control_sample.baf_dev2);
             fprintf(stderr,"\n");
             set_emission_probs(args);
-            hmm_run_fwd_bwd(hmm, args->nsites, args->eprob, args->sites);
+            hmm_run_fwd_bwd_ckpt(hmm, args->nsites, args->eprob, args->sites, store_fwd_bwd, args);
         }
         while ( update_args(args) && ++niter<20 );
         if ( niter>=20 )
@@ -1023,12 +1055,12 @@ static void cnv_flush_viterbi(args_t *args)
         }
     }
     hmm_run_viterbi(hmm, args->nsites, args->eprob, args->sites);
-    hmm_run_fwd_bwd(hmm, args->nsites, args->eprob, args->sites);
+    hmm_run_fwd_bwd_ckpt(hmm, args->nsites, args->eprob, args->sites, store_fwd_bwd, args);
 
 
     // Output the results
     uint8_t *vpath = hmm_get_viterbi_path(hmm);
-    double qual = 0, *fwd = hmm_get_fwd_bwd_prob(hmm);
+    double qual = 0, *fwd = args->eprob;
     int i,j, isite, start_cn = vpath[0], start_pos = args->sites[0], istart_pos = 0;
     int ctrl_ntot = 0, smpl_ntot = 0, ctrl_nhet = 0, smpl_nhet = 0;
     for (isite=0; isite<args->nsites; isite++)
@@ -1153,13 +1185,14 @@ static void cnv_next_line(args_t *args, bcf1_t *line)
     args->ntot++;
 
     bcf_fmt_t *baf_fmt, *lrr_fmt = NULL;
-    if ( !(baf_fmt = bcf_get_fmt(args->hdr, line, "BAF")) ) return; 
-    if ( args->lrr_bias>0 && !(lrr_fmt = bcf_get_fmt(args->hdr, line, "LRR")) ) return;
+    if ( !(baf_fmt = bcf_get_fmt_id(line, args->baf_id)) ) return; 
+    if ( args->lrr_bias>0 && !(lrr_fmt = bcf_get_fmt_id(line, args->lrr_id)) ) return;
 
-    float baf1,lrr1,baf2,lrr2;
+    float baf1,lrr1,baf2 = -0.1,lrr2 = 0;
     int ret = 0;
     ret += parse_lrr_baf(&args->query_sample,  baf_fmt,lrr_fmt,&baf1,&lrr1);
-    ret += parse_lrr_baf(&args->control_sample,baf_fmt,lrr_fmt,&baf2,&lrr2);
+    if ( args->control_sample.name )
+        ret += parse_lrr_baf(&args->control_sample,baf_fmt,lrr_fmt,&baf2,&lrr2);
     if ( !ret ) return;
 
     // Realloc buffers needed to store observed data and used by viterbi and fwd-bwd
@@ -39,6 +39,20 @@ THE SOFTWARE.  */
 #include <sys/time.h>
 #include "bcftools.h"
 
+struct _args_t;
+
+// Counts of phase matches in a range of the overlap buffer, computed by one thread, see phased_flush()
+typedef struct
+{
+    struct _args_t *args;
+    int ibeg, iend;             // the range of args->buf
+    int32_t *GTa, *GTb;
+    int mGTa, mGTb;
+    int *nmatch, *nmism;
+    int gt_absent;              // the first record in the range with no GT, -1 if none
+}
+ligate_job_t;
+
 typedef struct _args_t
 {
     bcf_srs_t *files;
@@ -59,6 +73,9 @@ typedef struct _args_t
     int compact_PS, phase_set_changed, naive_concat, naive_concat_trust_headers;
     int verbose;
     htsThreadPool *tpool;
+    ligate_job_t *ljob;
+    int nljob;
+    hts_tpool_process *lqueue;
 }
 args_t;
 
@@ -190,6 +207,19 @@ static void init_data(args_t *args)
         args->phase_qual = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
         args->phase_set  = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
         args->ifname = 0;
+        if ( args->n_threads )
+        {
+            args->nljob = args->n_threads;
+            args->ljob  = (ligate_job_t*) calloc(args->nljob,sizeof(*args->ljob));
+            for (i=0; i<args->nljob; i++)
+            {
+                args->ljob[i].args   = args;
+                args->ljob[i].nmatch = (int*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int));
+                args->ljob[i].nmism  = (int*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int));
+            }
+            args->lqueue = hts_tpool_process_init(args->tpool->pool, 2*args->nljob, 1);
+            if ( !args->lqueue ) error("Failed to initialize the thread pool queue\n");
+        }
     }
 }
 
@@ -205,6 +235,7 @@ static void destroy_data(args_t *args)
         hts_tpool_destroy(args->tpool->pool);
         free(args->tpool);
     }
+    if ( args->lqueue ) hts_tpool_process_destroy(args->lqueue);
     if ( args->files ) bcf_sr_destroy(args->files);
     if ( args->out_hdr ) bcf_hdr_destroy(args->out_hdr);
     free(args->seen_seq);
@@ -218,6 +249,14 @@ static void destroy_data(args_t *args)
     free(args->nmism);
     free(args->phase_qual);
     free(args->phase_set);
+    for (i=0; i<args->nljob; i++)
+    {
+        free(args->ljob[i].GTa);
+        free(args->ljob[i].GTb);
+        free(args->ljob[i].nmatch);
+        free(args->ljob[i].nmism);
+    }
+    free(args->ljob);
     for (i=0; i<args->nfnames; i++) free(args->fnames[i]);
     free(args->fnames);
 }
@@ -240,62 +279,114 @@ static void phase_update(args_t *args, bcf_hdr_t *hdr, bcf1_t *rec)
     bcf_update_genotypes(hdr,rec,args->GTa,nGTs);
 }
 
-static void phased_flush(args_t *args)
+/*
+    Count the phase matches and mismatches between the overlapping record pairs in the
+    range [ibeg,iend) of args->buf. Only reads the shared state, so that disjoint ranges
+    can be processed by different threads, each with its own GT buffers and counts.
+*/
+static void phase_count(args_t *args, ligate_job_t *job)
 {
-    if ( !args->nbuf ) return;
-
     bcf_hdr_t *ahdr = args->files->readers[0].header;
     bcf_hdr_t *bhdr = args->files->readers[1].header;
 
     int i, j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
-    static int gt_absent_warned = 0;
-
-    for (i=0; i<args->nbuf; i+=2)
+    job->gt_absent = -1;
+    for (i=job->ibeg; i<job->iend; i+=2)
     {
         bcf1_t *arec = args->buf[i];
         bcf1_t *brec = args->buf[i+1];
 
-        int nGTs = bcf_get_genotypes(ahdr, arec, &args->GTa, &args->mGTa);
+        int nGTs = bcf_get_genotypes(ahdr, arec, &job->GTa, &job->mGTa);
         if ( nGTs < 0 ) 
         {
-            if ( !gt_absent_warned )
-            {
-                fprintf(stderr,"GT is not present at %s:%"PRId64". (This warning is printed only once.)\n", bcf_seqname(ahdr,arec), (int64_t) arec->pos+1);
-                gt_absent_warned = 1;
-            }
+            if ( job->gt_absent<0 ) job->gt_absent = i;
             continue;
         }
         if ( nGTs != 2*nsmpl ) continue;    // not diploid
-        nGTs = bcf_get_genotypes(bhdr, brec, &args->GTb, &args->mGTb);
+        nGTs = bcf_get_genotypes(bhdr, brec, &job->GTb, &job->mGTb);
         if ( nGTs < 0 )
         {
-            if ( !gt_absent_warned )
-            {
-                fprintf(stderr,"GT is not present at %s:%"PRId64". (This warning is printed only once.)\n", bcf_seqname(bhdr,brec), (int64_t) brec->pos+1);
-                gt_absent_warned = 1;
-            }
+            if ( job->gt_absent<0 ) job->gt_absent = i+1;
             continue;
         }
         if ( nGTs != 2*nsmpl ) continue;    // not diploid
 
         for (j=0; j<nsmpl; j++)
         {
-            int *gta = &args->GTa[j*2];
-            int *gtb = &args->GTb[j*2];
+            int *gta = &job->GTa[j*2];
+            int *gtb = &job->GTb[j*2];
             if ( gta[1]==bcf_int32_vector_end || gtb[1]==bcf_int32_vector_end ) continue;
             if ( bcf_gt_is_missing(gta[0]) || bcf_gt_is_missing(gta[1]) || bcf_gt_is_missing(gtb[0]) || bcf_gt_is_missing(gtb[1]) ) continue;
             if ( !bcf_gt_is_phased(gta[1]) || !bcf_gt_is_phased(gtb[1]) ) continue;
             if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gta[1]) || bcf_gt_allele(gtb[0])==bcf_gt_allele(gtb[1]) ) continue;
             if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[0]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[1]) )
             {
-                if ( args->swap_phase[j] ) args->nmism[j]++; else args->nmatch[j]++;
+                if ( args->swap_phase[j] ) job->nmism[j]++; else job->nmatch[j]++;
             }
             if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[1]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[0]) )
             {
-                if ( args->swap_phase[j] ) args->nmatch[j]++; else args->nmism[j]++;
+                if ( args->swap_phase[j] ) job->nmatch[j]++; else job->nmism[j]++;
+            }
+        }
+    }
+}
+static void *phase_count_job(void *arg)
+{
+    ligate_job_t *job = (ligate_job_t*) arg;
+    phase_count(job->args, job);
+    return NULL;
+}
+
+static void phased_flush(args_t *args)
+{
+    if ( !args->nbuf ) return;
+
+    int i, j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
+    static int gt_absent_warned = 0;
+
+    // With threads, the overlap is split into one range of record pairs per thread. The
+    // per-thread counts are summed at the end, the result is the same as counted serially
+    int npair = args->nbuf/2, njob = args->lqueue ? args->nljob : 1;
+    if ( njob > npair ) njob = npair;
+    int gt_absent = -1;
+    if ( njob<=1 )
+    {
+        ligate_job_t job = { args, 0, args->nbuf, args->GTa, args->GTb, args->mGTa, args->mGTb, args->nmatch, args->nmism, -1 };
+        phase_count(args, &job);
+        args->GTa = job.GTa; args->mGTa = job.mGTa;
+        args->GTb = job.GTb; args->mGTb = job.mGTb;
+        gt_absent = job.gt_absent;
+    }
+    else
+    {
+        for (i=0; i<njob; i++)
+        {
+            ligate_job_t *job = &args->ljob[i];
+            job->ibeg = 2*(int)((int64_t)npair*i/njob);
+            job->iend = 2*(int)((int64_t)npair*(i+1)/njob);
+            memset(job->nmatch,0,sizeof(*job->nmatch)*nsmpl);
+            memset(job->nmism,0,sizeof(*job->nmism)*nsmpl);
+            if ( hts_tpool_dispatch(args->tpool->pool, args->lqueue, phase_count_job, job)!=0 ) error("Failed to dispatch a job\n");
+        }
+        if ( hts_tpool_process_flush(args->lqueue)!=0 ) error("Failed to process the jobs\n");
+        for (i=0; i<njob; i++)
+        {
+            ligate_job_t *job = &args->ljob[i];
+            for (j=0; j<nsmpl; j++)
+            {
+                args->nmatch[j] += job->nmatch[j];
+                args->nmism[j]  += job->nmism[j];
             }
+            if ( gt_absent<0 ) gt_absent = job->gt_absent;
         }
     }
+    if ( gt_absent>=0 && !gt_absent_warned )
+    {
+        bcf_hdr_t *hdr = args->files->readers[gt_absent%2].header;
+        bcf1_t *rec = args->buf[gt_absent];
+        fprintf(stderr,"GT is not present at %s:%"PRId64". (This warning is printed only once.)\n", bcf_seqname(hdr,rec), (int64_t) rec->pos+1);
+        gt_absent_warned = 1;
+    }
     for (i=0; i<args->nbuf/2; i+=2)
     {
         bcf1_t *arec = args->buf[i];
@@ -532,6 +623,7 @@ static void concat(args_t *args)
         kstring_t tmp = {0,0,0};
         int prev_chr_id = -1, prev_pos;
         bcf1_t *line = bcf_init();
+        htsFile *fp_next = NULL;
         for (i=0; i<args->nfnames; i++)
         {
             if ( args->verbose )
@@ -539,8 +631,17 @@ static void concat(args_t *args)
                 fprintf(stderr,"Concatenating %s", args->fnames[i]);
                 gettimeofday(&t0, NULL);
             }
-            htsFile *fp = hts_open(args->fnames[i], "r"); if ( !fp ) error("\nFailed to open: %s\n", args->fnames[i]);
-            if ( args->n_threads ) hts_set_opt(fp, HTS_OPT_THREAD_POOL, args->tpool);
+            htsFile *fp = fp_next ? fp_next : hts_open(args->fnames[i], "r"); if ( !fp ) error("\nFailed to open: %s\n", args->fnames[i]);
+            if ( args->n_threads && !fp_next ) hts_set_opt(fp, HTS_OPT_THREAD_POOL, args->tpool);
+            fp_next = NULL;
+
+            // With threads, open the next file already now so that its decompression starts
+            // in the background while the current one is being written
+            if ( args->n_threads && i+1 < args->nfnames )
+            {
+                fp_next = hts_open(args->fnames[i+1], "r"); if ( !fp_next ) error("\nFailed to open: %s\n", args->fnames[i+1]);
+                hts_set_opt(fp_next, HTS_OPT_THREAD_POOL, args->tpool);
+            }
             bcf_hdr_t *hdr = bcf_hdr_read(fp); if ( !hdr ) error("\nFailed to parse header: %s\n", args->fnames[i]);
             if ( !fp->is_bin && args->output_type&FT_VCF )
             {
@@ -690,11 +791,38 @@ static void _check_hrecs(const bcf_hdr_t *hdr0, const bcf_hdr_t *hdr, char *fnam
             error("Cannot use --naive, use --naive-force instead: different order the tag %s/%s in %s vs %s\n",type,hrec0->vals[itag],fname0,fname);
     }
 }
-static void naive_concat_check_headers(args_t *args)
+/*
+ *  Add tags and contigs of hdr not present in hdr0. The records are copied
+ *  verbatim so the IDX from hdr must be free in hdr0, otherwise the headers
+ *  cannot be reconciled without recoding the records.
+ */
+static void _merge_hrecs(bcf_hdr_t *hdr0, const bcf_hdr_t *hdr, char *fname0, char *fname)
+{
+    int j, nadded = 0;
+    for (j=0; j<hdr->nhrec; j++)
+    {
+        bcf_hrec_t *hrec = hdr->hrec[j];
+        if ( hrec->type!=BCF_HL_FLT && hrec->type!=BCF_HL_INFO && hrec->type!=BCF_HL_FMT && hrec->type!=BCF_HL_CTG ) continue;
+        int itag = bcf_hrec_find_key(hrec, "ID");
+        if ( bcf_hdr_get_hrec(hdr0, hrec->type, "ID", hrec->vals[itag], NULL) ) continue;
+
+        int iidx = bcf_hrec_find_key(hrec, "IDX");
+        if ( iidx<0 )
+            error("Cannot use --naive, use --naive-force instead: the header line ##%s=<ID=%s> in %s has no IDX, its position in the BCF dictionary is unknown\n",hrec->key,hrec->vals[itag],fname);
+        int idx  = atoi(hrec->vals[iidx]);
+        int dict = hrec->type==BCF_HL_CTG ? BCF_DT_CTG : BCF_DT_ID;
+        if ( idx < hdr0->n[dict] && hdr0->id[dict][idx].key && strcmp(hdr0->id[dict][idx].key,hrec->vals[itag]) )
+            error("Cannot use --naive, use --naive-force instead: the tag %s in %s clashes with %s in %s\n",hrec->vals[itag],fname,hdr0->id[dict][idx].key,fname0);
+        if ( bcf_hdr_add_hrec(hdr0, bcf_hrec_dup(hrec)) < 0 ) error("Failed to add the header line %s from %s\n",hrec->vals[itag],fname);
+        nadded++;
+    }
+    if ( nadded && bcf_hdr_sync(hdr0) < 0 ) error_errno("[%s] Failed to update header", __func__);
+}
+static bcf_hdr_t *naive_concat_check_headers(args_t *args)
 {
     fprintf(stderr,"Checking the headers of %d files.\n",args->nfnames);
     bcf_hdr_t *hdr0 = NULL;
-    int i,j;
+    int i,j, is_bcf = 0;
     for (i=0; i<args->nfnames; i++)
     {
         htsFile *fp = hts_open(args->fnames[i], "r"); if ( !fp ) error("Failed to open: %s\n", args->fnames[i]);
@@ -724,18 +852,24 @@ static void naive_concat_check_headers(args_t *args)
             continue;
         }
 
-        _check_hrecs(hdr0,hdr,args->fnames[0],args->fnames[i]);
+        // The headers need not be identical: tags missing in the first file are added to the
+        // output header as long as their IDX is not taken. The output header then differs from
+        // the first file only in the header block and the rest can be still copied verbatim.
+        _merge_hrecs(hdr0,hdr,args->fnames[0],args->fnames[i]);
         _check_hrecs(hdr,hdr0,args->fnames[i],args->fnames[0]);
+        is_bcf = 1;
 
         bcf_hdr_destroy(hdr);
     }
-    if ( hdr0 ) bcf_hdr_destroy(hdr0);
     fprintf(stderr,"Done, the headers are compatible.\n");
+    if ( is_bcf ) return hdr0;
+    if ( hdr0 ) bcf_hdr_destroy(hdr0);
+    return NULL;
 }
 static void naive_concat(args_t *args)
 {
     if ( !args->naive_concat_trust_headers )
-        naive_concat_check_headers(args);
+        args->out_hdr = naive_concat_check_headers(args);
 
     // only compressed BCF atm
     BGZF *bgzf_out = bgzf_open(args->output_fname,"w");;
@@ -777,7 +911,13 @@ static void naive_concat(args_t *args)
             hts_expand(char,tmp.l,tmp.m,tmp.s);
             if ( bgzf_read(fp, tmp.s, tmp.l) != tmp.l ) error("\nFailed to read the BCF header in %s\n", args->fnames[i]);
 
-            // write only the first header
+            // write only the first header or the merged header
+            if ( i==0 && args->out_hdr )
+            {
+                tmp.l = 0;
+                bcf_hdr_format(args->out_hdr, 1, &tmp);
+                kputc('\0', &tmp);
+            }
             if ( i==0 )
             {
                 if ( bgzf_write(bgzf_out, "BCF\2\2", 5) !=5 ) error("\nFailed to write %d bytes to %s\n", 5,args->output_fname);
@@ -32,12 +32,16 @@ THE SOFTWARE.  */
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <math.h>
+#include <zlib.h>
 #include <htslib/faidx.h>
 #include <htslib/vcf.h>
 #include <htslib/bgzf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/kseq.h>
+#include <htslib/thread_pool.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "convert.h"
@@ -64,6 +68,9 @@ struct _args_t
     kstring_t str;
     int32_t *gts;
     float *flt;
+    int mgts, mflt;
+    char *ref_seq;      // --tsv2vcf: the whole sequence of the current chromosome
+    int ref_rid, ref_len;
     int rev_als, output_vcf_ids, hap2dip, output_chrom_first_col;
     int nsamples, *samples, sample_is_file, targets_is_file, regions_is_file, output_type;
     char **argv, *sample_list, *targets_list, *regions_list, *tag, *columns;
@@ -74,6 +81,7 @@ struct _args_t
 static void destroy_data(args_t *args)
 {
     if ( args->ref ) fai_destroy(args->ref);
+    free(args->ref_seq);
     if ( args->convert) convert_destroy(args->convert);
     if ( args->filter ) filter_destroy(args->filter);
     free(args->samples);
@@ -133,7 +141,8 @@ static void open_vcf(args_t *args, const char *format_str)
         }
     }
     if ( format_str ) args->convert = convert_init(args->header, samples, nsamples, format_str);
-    free(samples);
+    args->nsamples = nsamples;
+    args->samples  = samples;
 }
 
 static int tsv_setter_chrom_pos_ref_alt(tsv_t *tsv, bcf1_t *rec, void *usr)
@@ -1100,6 +1109,623 @@ static void vcf_to_hapsample(args_t *args)
     if (hap_fname) free(hap_fname);
 }
 
+/*
+ *  BGEN v1.2, layout 2. Each variant's genotype data block is compressed with
+ *  zlib; zstd-compressed input is not supported because bcftools does not link
+ *  against libzstd. The probabilities are calculated from GT, PL or GP as for
+ *  --gensample. With --threads, the variants are compressed in parallel in jobs
+ *  of BGEN_NVAR variants and written in the input order.
+ */
+#define BGEN_BITS  8
+#define BGEN_NVAR  256
+
+typedef struct
+{
+    int nvar;
+    kstring_t ids, raw, out;            // variant identifying data, uncompressed genotype data, the output
+    int ids_off[BGEN_NVAR], raw_off[BGEN_NVAR];     // end offsets of the variants in ids and raw
+}
+bgen_job_t;
+
+static inline void bgen_set32(uint8_t *p, uint32_t val)
+{
+    p[0] = val; p[1] = val>>8; p[2] = val>>16; p[3] = val>>24;
+}
+static inline void bgen_put16(uint16_t val, kstring_t *str)
+{
+    ks_resize(str, str->l+2);
+    str->s[str->l++] = val & 0xff;
+    str->s[str->l++] = val >> 8;
+}
+static inline void bgen_put32(uint32_t val, kstring_t *str)
+{
+    ks_resize(str, str->l+4);
+    bgen_set32((uint8_t*)str->s+str->l, val);
+    str->l += 4;
+}
+static inline void bgen_put_str16(const char *val, kstring_t *str)
+{
+    int len = strlen(val);
+    bgen_put16(len, str);
+    kputsn(val, len, str);
+}
+
+static void *bgen_compress(void *arg)
+{
+    bgen_job_t *job = (bgen_job_t*) arg;
+    int i, ids_beg = 0, raw_beg = 0;
+    job->out.l = 0;
+    for (i=0; i<job->nvar; i++)
+    {
+        kputsn(job->ids.s+ids_beg, job->ids_off[i]-ids_beg, &job->out);
+
+        uLong nraw = job->raw_off[i] - raw_beg;
+        uLongf nz  = compressBound(nraw);
+        ks_resize(&job->out, job->out.l + nz + 8);
+        uint8_t *p = (uint8_t*)job->out.s + job->out.l;
+        if ( compress2(p+8, &nz, (Bytef*)job->raw.s+raw_beg, nraw, Z_DEFAULT_COMPRESSION)!=Z_OK )
+            error("[%s] Error: failed to compress the genotype data\n", __func__);
+        bgen_set32(p, nz+4);    // C: the compressed data plus D
+        bgen_set32(p+4, nraw);  // D: the uncompressed length
+        job->out.l += nz + 8;
+
+        ids_beg = job->ids_off[i];
+        raw_beg = job->raw_off[i];
+    }
+    return job;
+}
+
+// Quantizes n probabilities to BGEN_BITS bits so that they sum to 2^B-1 exactly,
+// the remainders are distributed to the largest fractions, and stores all but
+// the last
+static void bgen_put_probs(double *prob, int n, uint64_t *acc, int *nacc, kstring_t *raw)
+{
+    const uint32_t scale = (1<<BGEN_BITS) - 1;
+    uint32_t q[3] = {0,0,0};
+    double frac[3], sum = 0;
+    int i, j;
+    for (i=0; i<n; i++) sum += prob[i];
+    if ( sum > 0 )
+    {
+        uint32_t tot = 0;
+        for (i=0; i<n; i++)
+        {
+            double x = prob[i] / sum * scale;
+            q[i] = floor(x);
+            frac[i] = x - q[i];
+            tot += q[i];
+        }
+        while ( tot < scale )
+        {
+            for (i=0,j=1; j<n; j++) if ( frac[j] > frac[i] ) i = j;
+            q[i]++;
+            frac[i] = -1;
+            tot++;
+        }
+    }
+    for (i=0; i<n-1; i++)
+    {
+        *acc |= (uint64_t)q[i] << *nacc;
+        *nacc += BGEN_BITS;
+        while ( *nacc >= 8 )
+        {
+            kputc(*acc & 0xff, raw);
+            *acc >>= 8;
+            *nacc -= 8;
+        }
+    }
+}
+
+static void bgen_add_variant(args_t *args, bgen_job_t *job, bcf1_t *line, int itag)
+{
+    bcf_hdr_t *hdr = args->header;
+
+    // variant identifying data
+    kstring_t *ids = &job->ids;
+    args->str.l = 0;
+    ksprintf(&args->str, "%s:%"PRId64"_%s_%s", bcf_seqname(hdr,line), (int64_t) line->pos+1, line->d.allele[0], line->d.allele[1]);
+    bgen_put_str16(args->str.s, ids);
+    bgen_put_str16(line->d.id, ids);
+    bgen_put_str16(bcf_seqname(hdr,line), ids);
+    bgen_put32(line->pos+1, ids);
+    bgen_put16(2, ids);
+    int i, j;
+    for (i=0; i<2; i++)
+    {
+        int len = strlen(line->d.allele[i]);
+        bgen_put32(len, ids);
+        kputsn(line->d.allele[i], len, ids);
+    }
+    job->ids_off[job->nvar] = ids->l;
+
+    // genotype data
+    int n, nhdr = bcf_hdr_nsamples(hdr);
+    if ( itag==0 ) n = bcf_get_genotypes(hdr, line, &args->gts, &args->mgts);
+    else if ( itag==1 ) n = bcf_get_format_int32(hdr, line, "PL", &args->gts, &args->mgts);
+    else n = bcf_get_format_float(hdr, line, "GP", &args->flt, &args->mflt);
+    if ( n<=0 ) error("Error parsing %s tag at %s:%"PRId64"\n", itag==0 ? "GT" : (itag==1 ? "PL" : "GP"), bcf_seqname(hdr,line),(int64_t) line->pos+1);
+    n /= nhdr;
+
+    // with GT, the site is written as phased when all called diploid genotypes are phased
+    int phased = 0;
+    for (i=0; itag==0 && n==2 && i<args->nsamples; i++)
+    {
+        int32_t *ptr = args->gts + (args->samples ? args->samples[i] : i)*n;
+        if ( ptr[1]==bcf_int32_vector_end || bcf_gt_is_missing(ptr[0]) || bcf_gt_is_missing(ptr[1]) ) continue;
+        if ( !bcf_gt_is_phased(ptr[1]) ) { phased = 0; break; }
+        phased = 1;
+    }
+
+    kstring_t *raw = &job->raw;
+    size_t beg = raw->l;
+    bgen_put32(args->nsamples, raw);
+    bgen_put16(2, raw);
+    ks_resize(raw, raw->l + 2 + args->nsamples + 2);
+    memset(raw->s + raw->l, 0, 2 + args->nsamples);
+    raw->l += 2 + args->nsamples;
+    kputc(phased, raw);
+    kputc(BGEN_BITS, raw);
+
+    uint64_t acc = 0;
+    int nacc = 0, pmin = 2, pmax = 1;
+    for (i=0; i<args->nsamples; i++)
+    {
+        int ismpl = args->samples ? args->samples[i] : i, ploidy = 2, missing = 0;
+        double prob[3] = {0,0,0};
+        if ( itag==0 )
+        {
+            int32_t *ptr = args->gts + ismpl*n;
+            for (j=0; j<n; j++)
+                if ( ptr[j]==bcf_int32_vector_end ) break;
+            if ( j==2 )
+            {
+                if ( bcf_gt_is_missing(ptr[0]) ) missing = 1;
+                else if ( bcf_gt_allele(ptr[0])!=bcf_gt_allele(ptr[1]) ) prob[1] = 1;
+                else if ( bcf_gt_allele(ptr[0])==1 ) prob[2] = 1;
+                else prob[0] = 1;
+            }
+            else if ( j==1 )
+            {
+                ploidy = 1;
+                if ( bcf_gt_is_missing(ptr[0]) ) missing = 1;
+                else if ( bcf_gt_allele(ptr[0])==1 ) prob[1] = 1;
+                else prob[0] = 1;
+            }
+            else error("FIXME: not ready for ploidy %d\n", j);
+        }
+        else if ( itag==1 )
+        {
+            int32_t *ptr = args->gts + ismpl*n;
+            for (j=0; j<n && j<3; j++)
+            {
+                if ( ptr[j]==bcf_int32_vector_end ) break;
+                prob[j] = pow(10,-0.1*ptr[j]);
+            }
+            if ( j==line->n_allele ) ploidy = 1;
+            if ( ptr[0]==bcf_int32_missing ) missing = 1;
+        }
+        else
+        {
+            float *ptr = args->flt + ismpl*n;
+            for (j=0; j<n && j<3; j++)
+            {
+                if ( bcf_float_is_vector_end(ptr[j]) ) break;
+                if ( bcf_float_is_missing(ptr[j]) ) continue;
+                if ( ptr[j]<0 || ptr[j]>1 ) error("[%s:%"PRId64":%f] GP value outside range [0,1]; bcftools convert expects the VCF4.3+ spec for the GP field encoding genotype posterior probabilities", bcf_seqname(hdr,line),(int64_t) line->pos+1,ptr[j]);
+                prob[j] = ptr[j];
+            }
+            if ( j==line->n_allele ) ploidy = 1;
+            if ( prob[0]+prob[1]+prob[2] <= 0 ) missing = 1;
+        }
+        if ( missing ) prob[0] = prob[1] = prob[2] = 0;
+        if ( pmin > ploidy ) pmin = ploidy;
+        if ( pmax < ploidy ) pmax = ploidy;
+        raw->s[beg + 8 + i] = ploidy | (missing ? 0x80 : 0);
+        if ( phased )
+        {
+            // the probabilities of the two alleles for each haplotype
+            int32_t *ptr = args->gts + ismpl*n;
+            for (j=0; j<ploidy; j++)
+            {
+                double hprob[2] = {0,0};
+                if ( !missing ) hprob[bcf_gt_allele(ptr[j])==1 ? 1 : 0] = 1;
+                bgen_put_probs(hprob, 2, &acc, &nacc, raw);
+            }
+        }
+        else
+            bgen_put_probs(prob, ploidy+1, &acc, &nacc, raw);
+    }
+    if ( nacc ) kputc(acc & 0xff, raw);
+    raw->s[beg + 6] = args->nsamples ? pmin : 2;
+    raw->s[beg + 7] = args->nsamples ? pmax : 2;
+    job->raw_off[job->nvar] = raw->l;
+
+    job->nvar++;
+}
+
+static void bgen_write_job(args_t *args, FILE *fp, bgen_job_t *job)
+{
+    if ( job->out.l && fwrite(job->out.s, job->out.l, 1, fp)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->outfname);
+}
+
+static void vcf_to_bgen(args_t *args)
+{
+    open_vcf(args,NULL);
+
+    int i, itag = 0;
+    if ( args->tag && !strcmp(args->tag,"PL") ) itag = 1;
+    else if ( args->tag && !strcmp(args->tag,"GP") ) itag = 2;
+    else if ( args->tag && strcmp(args->tag,"GT") ) error("todo: --tag %s\n", args->tag);
+
+    if ( !args->samples ) args->nsamples = bcf_hdr_nsamples(args->header);
+
+    // The number of variants in the header is updated at the end, the output must be seekable
+    if ( !strcmp("-",args->outfname) ) error("The --bgen output must be a file, not the standard output\n");
+    FILE *fp = fopen(args->outfname, "w");
+    if ( !fp ) error("Could not write %s: %s\n", args->outfname,strerror(errno));
+
+    // the header block followed by the sample identifier block
+    kstring_t str = {0,0,0};
+    uint32_t l_si = 8;
+    for (i=0; i<args->nsamples; i++)
+        l_si += 2 + strlen(args->header->samples[args->samples ? args->samples[i] : i]);
+    bgen_put32(20 + l_si, &str);        // the offset of the first variant block relative to byte 4
+    bgen_put32(20, &str);               // the length of the header block
+    bgen_put32(0, &str);                // the number of variants
+    bgen_put32(args->nsamples, &str);
+    kputsn("bgen", 4, &str);
+    bgen_put32(1 | 2<<2 | 1u<<31, &str);    // zlib, layout 2, sample identifiers present
+    bgen_put32(l_si, &str);
+    bgen_put32(args->nsamples, &str);
+    for (i=0; i<args->nsamples; i++)
+        bgen_put_str16(args->header->samples[args->samples ? args->samples[i] : i], &str);
+    if ( fwrite(str.s, str.l, 1, fp)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->outfname);
+
+    hts_tpool *pool = args->files->p ? args->files->p->pool : NULL;
+    int nblk = pool ? 2*args->n_threads : 1, nfree = nblk;
+    bgen_job_t *jobs = (bgen_job_t*) calloc(nblk, sizeof(bgen_job_t));
+    bgen_job_t **free_jobs = (bgen_job_t**) malloc(sizeof(bgen_job_t*)*nblk);
+    for (i=0; i<nblk; i++) free_jobs[i] = &jobs[i];
+    hts_tpool_process *queue = pool ? hts_tpool_process_init(pool, nblk, 0) : NULL;
+    hts_tpool_result *res;
+
+    uint32_t nvar = 0;
+    int no_alt = 0, non_biallelic = 0, filtered = 0;
+    bgen_job_t *job = NULL;
+    while ( 1 )
+    {
+        if ( !job )
+        {
+            if ( !nfree )
+            {
+                res = hts_tpool_next_result_wait(queue);
+                if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+                free_jobs[nfree++] = (bgen_job_t*) hts_tpool_result_data(res);
+                hts_tpool_delete_result(res, 0);
+                bgen_write_job(args, fp, free_jobs[nfree-1]);
+            }
+            job = free_jobs[--nfree];
+            job->nvar = 0;
+            job->ids.l = job->raw.l = 0;
+        }
+        if ( !bcf_sr_next_line(args->files) ) break;
+
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( args->filter )
+        {
+            int pass = filter_test(args->filter, line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            if ( !pass ) { filtered++; continue; }
+        }
+        if ( line->n_allele<2 ) { no_alt++; continue; }
+        if ( line->n_allele>2 )
+        {
+            if ( !non_biallelic )
+                fprintf(stderr, "Warning: non-biallelic records are skipped. Consider splitting multi-allelic records into biallelic records using 'bcftools norm -m-'.\n");
+            non_biallelic++;
+            continue;
+        }
+        bgen_add_variant(args, job, line, itag);
+        nvar++;
+        if ( job->nvar < BGEN_NVAR ) continue;
+
+        if ( !pool )
+        {
+            bgen_write_job(args, fp, bgen_compress(job));
+            free_jobs[nfree++] = job;
+        }
+        else
+        {
+            if ( hts_tpool_dispatch(pool, queue, bgen_compress, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+            while ( nfree<nblk && (res = hts_tpool_next_result(queue)) )
+            {
+                free_jobs[nfree++] = (bgen_job_t*) hts_tpool_result_data(res);
+                hts_tpool_delete_result(res, 0);
+                bgen_write_job(args, fp, free_jobs[nfree-1]);
+            }
+        }
+        job = NULL;
+    }
+    if ( job->nvar && !pool ) bgen_write_job(args, fp, bgen_compress(job));
+    else if ( job->nvar && hts_tpool_dispatch(pool, queue, bgen_compress, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    if ( !job->nvar || !pool ) free_jobs[nfree++] = job;
+    while ( nfree<nblk )
+    {
+        res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        free_jobs[nfree++] = (bgen_job_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+        bgen_write_job(args, fp, free_jobs[nfree-1]);
+    }
+    if ( queue ) hts_tpool_process_destroy(queue);
+
+    str.l = 0;
+    bgen_put32(nvar, &str);
+    if ( fseek(fp, 8, SEEK_SET)!=0 || fwrite(str.s, 4, 1, fp)!=1 ) error("[%s] Error: cannot update the number of variants in %s\n", __func__,args->outfname);
+    if ( fclose(fp)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->outfname);
+
+    fprintf(stderr, "%u records written, %d skipped: %d/%d/%d no-ALT/non-biallelic/filtered\n",
+        nvar, no_alt+non_biallelic+filtered, no_alt, non_biallelic, filtered);
+
+    for (i=0; i<nblk; i++)
+    {
+        free(jobs[i].ids.s);
+        free(jobs[i].raw.s);
+        free(jobs[i].out.s);
+    }
+    free(jobs);
+    free(free_jobs);
+    free(str.s);
+}
+
+static uint32_t bgen_read(FILE *fp, int nbytes, const char *fname)
+{
+    uint8_t buf[4];
+    if ( fread(buf, nbytes, 1, fp)!=1 ) error("Could not parse %s: unexpected end of file\n", fname);
+    uint32_t val = 0;
+    int i;
+    for (i=nbytes-1; i>=0; i--) val = val<<8 | buf[i];
+    return val;
+}
+static void bgen_read_str(FILE *fp, int nbytes, kstring_t *str, const char *fname)
+{
+    uint32_t len = bgen_read(fp, nbytes, fname);
+    str->l = 0;
+    ks_resize(str, len+1);
+    if ( len && fread(str->s, len, 1, fp)!=1 ) error("Could not parse %s: unexpected end of file\n", fname);
+    str->l = len;
+    str->s[len] = 0;
+}
+
+static void bgen_to_vcf(args_t *args)
+{
+    char *fname = args->infname;
+    FILE *fp = fopen(fname, "r");
+    if ( !fp ) error("Could not read %s: %s\n", fname,strerror(errno));
+
+    uint32_t offset = bgen_read(fp, 4, fname);
+    uint32_t l_h    = bgen_read(fp, 4, fname);
+    uint32_t nvar   = bgen_read(fp, 4, fname);
+    uint32_t nsmpl  = bgen_read(fp, 4, fname);
+    char magic[4];
+    if ( fread(magic, 4, 1, fp)!=1 ) error("Could not parse %s: unexpected end of file\n", fname);
+    if ( memcmp(magic,"bgen",4) && memcmp(magic,"\0\0\0\0",4) ) error("Could not parse %s: not a BGEN file\n", fname);
+    if ( l_h<20 || fseek(fp, l_h-20, SEEK_CUR)!=0 ) error("Could not parse %s: the header block is too short\n", fname);
+    uint32_t flags = bgen_read(fp, 4, fname);
+    int compression = flags & 3, layout = (flags>>2) & 0xf;
+    if ( layout!=2 ) error("Only the BGEN layout 2 is supported, %s uses layout %d\n", fname,layout);
+    if ( compression==2 ) error("The zstd compression of %s is not supported\n", fname);
+
+    args->header = bcf_hdr_init("w");
+    bcf_hdr_t *hdr = args->header;
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GP,Number=G,Type=Float,Description=\"Genotype Probabilities\">");
+    if ( args->record_cmd_line ) bcf_hdr_append_version(hdr, args->argc, args->argv, "bcftools_convert");
+
+    kstring_t str = {0,0,0};
+    uint32_t i, j, k;
+    if ( flags & (1u<<31) )
+    {
+        bgen_read(fp, 4, fname);
+        if ( bgen_read(fp, 4, fname)!=nsmpl ) error("Could not parse %s: the number of samples does not match\n", fname);
+        for (i=0; i<nsmpl; i++)
+        {
+            bgen_read_str(fp, 2, &str, fname);
+            bcf_hdr_add_sample(hdr, str.s);
+        }
+    }
+    else
+    {
+        for (i=0; i<nsmpl; i++)
+        {
+            str.l = 0;
+            ksprintf(&str, "sample_%u", i);
+            bcf_hdr_add_sample(hdr, str.s);
+        }
+    }
+    offset += 4;
+
+    // The contigs must be in the header before the first record is written, collect
+    // them in a quick pass which skips the genotype data
+    void *chrs = khash_str2int_init();
+    if ( fseek(fp, offset, SEEK_SET)!=0 ) error("Could not seek in %s\n", fname);
+    for (i=0; i<nvar; i++)
+    {
+        bgen_read_str(fp, 2, &str, fname);
+        bgen_read_str(fp, 2, &str, fname);
+        bgen_read_str(fp, 2, &str, fname);
+        if ( !khash_str2int_has_key(chrs, str.s) )
+        {
+            khash_str2int_inc(chrs, strdup(str.s));
+            bcf_hdr_printf(hdr, "##contig=<ID=%s,length=%d>", str.s,0x7fffffff);   // MAX_CSI_COOR
+        }
+        bgen_read(fp, 4, fname);
+        uint32_t nals = bgen_read(fp, 2, fname);
+        for (j=0; j<nals; j++)
+        {
+            uint32_t len = bgen_read(fp, 4, fname);
+            if ( fseek(fp, len, SEEK_CUR)!=0 ) error("Could not seek in %s\n", fname);
+        }
+        uint32_t len = bgen_read(fp, 4, fname);
+        if ( fseek(fp, len, SEEK_CUR)!=0 ) error("Could not seek in %s\n", fname);
+    }
+    khash_str2int_destroy_free(chrs);
+    if ( fseek(fp, offset, SEEK_SET)!=0 ) error("Could not seek in %s\n", fname);
+
+    htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
+    if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
+    if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+    if ( bcf_hdr_write(out_fh,hdr)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,args->outfname);
+    bcf1_t *rec = bcf_init();
+
+    kstring_t varid = {0,0,0}, rsid = {0,0,0}, als = {0,0,0}, zdat = {0,0,0}, dat = {0,0,0};
+    int mgts = 0, mgp = 0;
+    for (i=0; i<nvar; i++)
+    {
+        bcf_clear(rec);
+        bgen_read_str(fp, 2, &varid, fname);
+        bgen_read_str(fp, 2, &rsid, fname);
+        bgen_read_str(fp, 2, &str, fname);
+        rec->rid = bcf_hdr_name2id(hdr, str.s);
+        rec->pos = bgen_read(fp, 4, fname) - 1;
+        uint32_t nals = bgen_read(fp, 2, fname);
+        if ( nals<1 ) error("Could not parse %s: no alleles at %s\n", fname,varid.s);
+        als.l = 0;
+        for (j=0; j<nals; j++)
+        {
+            bgen_read_str(fp, 4, &str, fname);
+            if ( j ) kputc(',', &als);
+            kputs(str.s, &als);
+        }
+        bcf_update_alleles_str(hdr, rec, als.s);
+        if ( rsid.l && strcmp(rsid.s,".") ) bcf_update_id(hdr, rec, rsid.s);
+        else if ( varid.l ) bcf_update_id(hdr, rec, varid.s);
+
+        // the genotype data block
+        uint32_t len = bgen_read(fp, 4, fname);
+        if ( compression )
+        {
+            if ( len<4 ) error("Could not parse %s: the genotype data block is too short at %s\n", fname,varid.s);
+            uLongf ndat = bgen_read(fp, 4, fname);
+            ks_resize(&zdat, len-4);
+            ks_resize(&dat, ndat);
+            if ( len>4 && fread(zdat.s, len-4, 1, fp)!=1 ) error("Could not parse %s: unexpected end of file\n", fname);
+            if ( uncompress((Bytef*)dat.s, &ndat, (Bytef*)zdat.s, len-4)!=Z_OK ) error("Could not decompress the genotype data in %s at %s\n", fname,varid.s);
+            dat.l = ndat;
+        }
+        else
+        {
+            ks_resize(&dat, len);
+            if ( len && fread(dat.s, len, 1, fp)!=1 ) error("Could not parse %s: unexpected end of file\n", fname);
+            dat.l = len;
+        }
+        uint8_t *p = (uint8_t*) dat.s, *pend = p + dat.l;
+        if ( dat.l < 10 ) error("Could not parse %s: the genotype data block is too short at %s\n", fname,varid.s);
+        uint32_t n = p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+        int nal = p[4] | p[5]<<8, pmax = p[7];
+        if ( n!=nsmpl ) error("Could not parse %s: the number of samples does not match at %s\n", fname,varid.s);
+        if ( nal!=nals ) error("Could not parse %s: the number of alleles does not match at %s\n", fname,varid.s);
+        if ( pmax>2 ) error("Ploidy bigger than 2 is not supported: %s\n", varid.s);
+        if ( dat.l < 10 + nsmpl ) error("Could not parse %s: the genotype data block is too short at %s\n", fname,varid.s);
+        uint8_t *ploidy = p + 8;
+        int phased = p[8+nsmpl], nbits = p[9+nsmpl];
+        if ( nbits<1 || nbits>32 ) error("Could not parse %s: unexpected number of bits %d at %s\n", fname,nbits,varid.s);
+        p += 10 + nsmpl;
+
+        int ngt = nal*(nal+1)/2;
+        hts_expand(int32_t, nsmpl*2, mgts, args->gts);
+        hts_expand(float, nsmpl*ngt, mgp, args->flt);
+        double scale = nbits==32 ? 4294967295. : (double)((1ul<<nbits) - 1);
+        uint64_t acc = 0, mask = nbits==32 ? 0xffffffff : (1ul<<nbits) - 1;
+        int nacc = 0;
+        double prob[2*nal > ngt ? 2*nal : ngt];
+        for (j=0; j<nsmpl; j++)
+        {
+            int pl = ploidy[j] & 0x7f, is_missing = ploidy[j] & 0x80;
+            if ( pl>2 ) error("Ploidy bigger than 2 is not supported: %s\n", varid.s);
+            int nprob = phased ? pl*nal : (pl==1 ? nal : ngt);
+            double sum = 0;
+            for (k=0; k<nprob; k++)
+            {
+                if ( phased ? (k+1)%nal==0 : k+1==nprob ) { prob[k] = 1 - sum; sum = 0; continue; }
+                while ( nacc < nbits )
+                {
+                    if ( p>=pend ) error("Could not parse %s: the genotype data block is too short at %s\n", fname,varid.s);
+                    acc |= (uint64_t)*p++ << nacc;
+                    nacc += 8;
+                }
+                prob[k] = (acc & mask) / scale;
+                acc >>= nbits;
+                nacc -= nbits;
+                sum += prob[k];
+            }
+            int32_t *gt = args->gts + 2*j;
+            float *gp = args->flt + ngt*j;
+            if ( pl==0 || is_missing )
+            {
+                gt[0] = bcf_gt_missing;
+                gt[1] = pl==2 ? bcf_gt_missing : bcf_int32_vector_end;
+                bcf_float_set_missing(gp[0]);
+                for (k=1; k<ngt; k++) bcf_float_set_vector_end(gp[k]);
+                continue;
+            }
+            if ( phased )
+            {
+                int ih;
+                for (ih=0; ih<pl; ih++)
+                {
+                    int imax = 0;
+                    for (k=1; k<nal; k++) if ( prob[ih*nal+k] > prob[ih*nal+imax] ) imax = k;
+                    gt[ih] = ih ? bcf_gt_phased(imax) : bcf_gt_unphased(imax);
+                }
+                if ( pl==1 ) gt[1] = bcf_int32_vector_end;
+                bcf_float_set_missing(gp[0]);
+                for (k=1; k<ngt; k++) bcf_float_set_vector_end(gp[k]);
+                continue;
+            }
+            int imax = 0;
+            for (k=1; k<nprob; k++) if ( prob[k] > prob[imax] ) imax = k;
+            for (k=0; k<nprob; k++) gp[k] = prob[k];
+            for (; k<ngt; k++) bcf_float_set_vector_end(gp[k]);
+            if ( pl==1 )
+            {
+                gt[0] = bcf_gt_unphased(imax);
+                gt[1] = bcf_int32_vector_end;
+            }
+            else
+            {
+                // the BGEN order of diploid genotypes is the same as in VCF
+                int a = 0, b = 0;
+                while ( (b+1)*(b+2)/2 <= imax ) b++;
+                a = imax - b*(b+1)/2;
+                gt[0] = bcf_gt_unphased(a);
+                gt[1] = bcf_gt_unphased(b);
+            }
+        }
+        if ( bcf_update_genotypes(hdr,rec,args->gts,nsmpl*2) ) error("Could not update GT field\n");
+        if ( bcf_update_format_float(hdr,rec,"GP",args->flt,nsmpl*ngt) ) error("Could not update GP field\n");
+        if ( bcf_write(out_fh, hdr, rec)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->outfname);
+    }
+
+    if ( hts_close(out_fh) ) error("Close failed: %s\n", args->outfname);
+    if ( fclose(fp) ) error("Close failed: %s\n", fname);
+    bcf_hdr_destroy(hdr);
+    args->header = NULL;
+    bcf_destroy(rec);
+    free(str.s);
+    free(varid.s);
+    free(rsid.s);
+    free(als.s);
+    free(zdat.s);
+    free(dat.s);
+    free(args->gts);
+    free(args->flt);
+    args->gts = NULL;
+    args->flt = NULL;
+
+    fprintf(stderr,"Number of processed variants: \t%u\n", nvar);
+}
+
 static void bcf_hdr_set_chrs(bcf_hdr_t *hdr, faidx_t *fai)
 {
     int i, n = faidx_nseq(fai);
@@ -1153,13 +1779,21 @@ static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
 {
     args_t *args = (args_t*) usr;
 
-    int len;
-    char *ref = faidx_fetch_seq(args->ref, (char*)bcf_hdr_id2name(args->header,rec->rid), rec->pos, rec->pos, &len);
-    if ( !ref ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_hdr_id2name(args->header,rec->rid),(int64_t) rec->pos+1);
+    // The input is usually sorted, the whole chromosome is loaded at once rather
+    // than fetching every base separately
+    if ( !args->ref_seq || args->ref_rid!=rec->rid )
+    {
+        const char *chr = bcf_hdr_id2name(args->header,rec->rid);
+        free(args->ref_seq);
+        args->ref_seq = faidx_fetch_seq(args->ref, chr, 0, faidx_seq_len(args->ref,chr)-1, &args->ref_len);
+        if ( !args->ref_seq ) error("faidx_fetch_seq failed for %s\n", chr);
+        args->ref_rid = rec->rid;
+    }
+    if ( rec->pos<0 || rec->pos>=args->ref_len ) error("The position is outside the reference sequence: %s:%"PRId64"\n", bcf_hdr_id2name(args->header,rec->rid),(int64_t) rec->pos+1);
 
     int nals = 1, alleles[5] = { -1, -1, -1, -1, -1 };    // a,c,g,t,n
-    ref[0] = toupper(ref[0]);
-    int iref = acgt_to_5(ref[0]);
+    char ref = toupper(args->ref_seq[rec->pos]);
+    int iref = acgt_to_5(ref);
     alleles[iref] = 0;
 
     rec->n_sample = bcf_hdr_nsamples(args->header);
@@ -1177,13 +1811,12 @@ static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
         if ( ret==-2 ) 
         {
             // something else than a SNP
-            free(ref);
             return -1;
         }
     }
 
     args->str.l = 0;
-    kputc(ref[0], &args->str);
+    kputc(ref, &args->str);
     for (i=0; i<5; i++) 
     {
         if ( alleles[i]>0 )
@@ -1195,7 +1828,6 @@ static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
     bcf_update_alleles_str(args->header, rec, args->str.s);
     if ( bcf_update_genotypes(args->header,rec,args->gts,rec->n_sample*2) ) error("Could not update the GT field\n");
 
-    free(ref);
     return 0;
 }
 
@@ -1408,6 +2040,10 @@ static void usage(void)
     fprintf(stderr, "       --sex <file>            output sex column in the sample-file, input format is: Sample\\t[MF]\n");
     fprintf(stderr, "       --vcf-ids               output VCF IDs in second column instead of CHROM:POS_REF_ALT\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "BGEN conversion (v1.2, layout 2):\n");
+    fprintf(stderr, "       --bgen2vcf <file>       convert BGEN to VCF, the GT and GP fields are filled\n");
+    fprintf(stderr, "       --bgen <file>           convert to BGEN, the --tag option applies as for --gensample\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "gVCF conversion:\n");
     fprintf(stderr, "       --gvcf2vcf              expand gVCF reference blocks\n");
     fprintf(stderr, "   -f, --fasta-ref <file>      reference sequence in fasta format\n");
@@ -1484,6 +2120,8 @@ int main_vcfconvert(int argc, char *argv[])
         {"fasta-ref",required_argument,NULL,'f'},
         {"no-version",no_argument,NULL,10},
         {"keep-duplicates",no_argument,NULL,12},
+        {"bgen",required_argument,NULL,13},
+        {"bgen2vcf",required_argument,NULL,14},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "?h:r:R:s:S:t:T:i:e:g:G:o:O:c:f:H:",loptions,NULL)) >= 0) {
@@ -1524,6 +2162,8 @@ int main_vcfconvert(int argc, char *argv[])
             case 10 : args->record_cmd_line = 0; break;
             case 11 : args->sex_fname = optarg; break;
             case 12 : args->keep_duplicates = 1; break;
+            case 13 : args->convert_func = vcf_to_bgen; args->outfname = optarg; break;
+            case 14 : args->convert_func = bgen_to_vcf; args->infname = optarg; break;
             case '?': usage(); break;
             default: error("Unknown argument: %s\n", optarg);
         }
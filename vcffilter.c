@@ -38,6 +38,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "filter.h"
 #include "rbuf.h"
+#include "blkpipe.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -61,6 +62,9 @@ typedef struct _args_t
     char *soft_filter;  // drop failed sites or annotate FILTER column?
     int annot_mode;     // add to existing FILTER annotation or replace? Otherwise reset FILTER to PASS or leave as it is?
     int flt_fail, flt_pass;     // BCF ids of fail and pass filters
+    int nexpr, *expr_logic, *expr_fail, *expr_pass, nsoft_names;  // multiple -i/-e expressions, each with its own -s name
+    char **expr, **soft_names;
+    filter_set_t *fset;
     int snp_gap, snp_gap_type, indel_gap, IndelGap_id, SnpGap_id;
     char *snp_gap_str;
     int32_t ntmpi, *tmpi, ntmp_ac, *tmp_ac;
@@ -77,48 +81,61 @@ typedef struct _args_t
 }
 args_t;
 
+static int add_filter_hdr_line(args_t *args, const char *soft_filter, const char *filter_str, int filter_logic)
+{
+    kstring_t flt_name = {0,0,0};
+    if ( strcmp(soft_filter,"+") )
+        kputs(soft_filter, &flt_name);
+    else
+    {
+        // Make up a filter name
+        int i = 0, id = -1;
+        do
+        {
+            flt_name.l = 0;
+            ksprintf(&flt_name,"Filter%d", ++i);
+            id = bcf_hdr_id2int(args->hdr,BCF_DT_ID,flt_name.s);
+        }
+        while ( bcf_hdr_idinfo_exists(args->hdr,BCF_HL_FLT,id) );
+    }
+    // escape quotes
+    kstring_t tmp = {0,0,0};
+    const char *t = filter_str;
+    while ( *t )
+    {
+        if ( *t=='"' ) kputc('\\',&tmp);
+        kputc(*t,&tmp);
+        t++;
+    }
+    int ret = bcf_hdr_printf(args->hdr, "##FILTER=<ID=%s,Description=\"Set if %s: %s\">", flt_name.s,filter_logic & FLT_INCLUDE ? "not true" : "true", tmp.s);
+    if ( ret!=0 )
+        error("Failed to append header line: ##FILTER=<ID=%s,Description=\"Set if %s: %s\">\n", flt_name.s,filter_logic & FLT_INCLUDE ? "not true" : "true", tmp.s);
+    int flt_id = bcf_hdr_id2int(args->hdr,BCF_DT_ID,flt_name.s); assert( flt_id>=0 );
+    free(flt_name.s);
+    free(tmp.s);
+    return flt_id;
+}
+
 static void init_data(args_t *args)
 {
     args->out_fh = hts_open(args->output_fname,hts_bcf_wmode(args->output_type));
     if ( args->out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+    if ( args->n_threads ) hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->files->p);
 
     args->hdr = args->files->readers[0].header;
     args->flt_pass = bcf_hdr_id2int(args->hdr,BCF_DT_ID,"PASS"); assert( !args->flt_pass );  // sanity check: required by BCF spec
 
     // -i or -e: append FILTER line
-    if ( args->soft_filter && args->filter_logic )
+    if ( args->nexpr > 1 )
     {
-        kstring_t flt_name = {0,0,0};
-        if ( strcmp(args->soft_filter,"+") )
-            kputs(args->soft_filter, &flt_name);
-        else
-        {
-            // Make up a filter name
-            int i = 0, id = -1;
-            do
-            {
-                ksprintf(&flt_name,"Filter%d", ++i);
-                id = bcf_hdr_id2int(args->hdr,BCF_DT_ID,flt_name.s);
-            }
-            while ( bcf_hdr_idinfo_exists(args->hdr,BCF_HL_FLT,id) );
-        }
-        // escape quotes
-        kstring_t tmp = {0,0,0};
-        char *t = args->filter_str;
-        while ( *t )
-        {
-            if ( *t=='"' ) kputc('\\',&tmp);
-            kputc(*t,&tmp);
-            t++;
-        }
-        int ret = bcf_hdr_printf(args->hdr, "##FILTER=<ID=%s,Description=\"Set if %s: %s\">", flt_name.s,args->filter_logic & FLT_INCLUDE ? "not true" : "true", tmp.s);
-        if ( ret!=0 )
-            error("Failed to append header line: ##FILTER=<ID=%s,Description=\"Set if %s: %s\">\n", flt_name.s,args->filter_logic & FLT_INCLUDE ? "not true" : "true", tmp.s);
-        args->flt_fail = bcf_hdr_id2int(args->hdr,BCF_DT_ID,flt_name.s); assert( args->flt_fail>=0 );
-        free(flt_name.s);
-        free(tmp.s);
+        int i;
+        args->expr_fail = (int*) malloc(sizeof(int)*args->nexpr);
+        args->expr_pass = (int*) malloc(sizeof(int)*args->nexpr);
+        for (i=0; i<args->nexpr; i++)
+            args->expr_fail[i] = add_filter_hdr_line(args, args->soft_names[i], args->expr[i], args->expr_logic[i]);
     }
+    else if ( args->soft_filter && args->filter_logic )
+        args->flt_fail = add_filter_hdr_line(args, args->soft_filter, args->filter_str, args->filter_logic);
 
     if ( args->snp_gap || args->indel_gap )
     {
@@ -154,7 +171,9 @@ static void init_data(args_t *args)
 
     if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_filter");
 
-    if ( args->filter_str )
+    if ( args->nexpr > 1 )
+        args->fset = filter_set_init(args->hdr, args->nexpr, args->expr);
+    else if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
 }
 
@@ -169,6 +188,13 @@ static void destroy_data(args_t *args)
     }
     if ( args->filter )
         filter_destroy(args->filter);
+    if ( args->fset )
+        filter_set_destroy(args->fset);
+    free(args->expr);
+    free(args->expr_logic);
+    free(args->expr_fail);
+    free(args->expr_pass);
+    free(args->soft_names);
     free(args->tmpi);
     free(args->tmp_ac);
 }
@@ -195,7 +221,7 @@ static void flush_buffer(args_t *args, int n)
 }
 
 #define SWAP(type_t, a, b) { type_t t = a; a = b; b = t; }
-static void buffered_filters(args_t *args, bcf1_t *line)
+static void buffered_filters(args_t *args, bcf1_t **rec)
 {
     /**
      *  The logic of SnpGap=3. The SNPs at positions 1 and 7 are filtered,
@@ -224,6 +250,7 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     const int IndelGap_flush = 1 << (8*sizeof(int)/2-2);
 
     int var_type = 0, i;
+    bcf1_t *line = rec ? *rec : NULL;
     if ( line )
     {
         // Still on the same chromosome?
@@ -238,7 +265,7 @@ static void buffered_filters(args_t *args, bcf1_t *line)
         // unused one
         ilast = rbuf_append(&args->rbuf);
         if ( !args->rbuf_lines[ilast] ) args->rbuf_lines[ilast] = bcf_init1();
-        SWAP(bcf1_t*, args->files->readers[0].buffer[0], args->rbuf_lines[ilast]);
+        SWAP(bcf1_t*, *rec, args->rbuf_lines[ilast]);
 
         var_type = bcf_get_variant_types(line);
 
@@ -341,6 +368,15 @@ static void buffered_filters(args_t *args, bcf1_t *line)
     flush_buffer(args, j_flush < k_flush ? j_flush : k_flush);
 }
 
+// Set the FILTER column unless it is set to the same already, the record then stays
+// unmodified and is written as it was read
+static void update_filter(args_t *args, bcf1_t *line, int *flt_ids, int n)
+{
+    bcf_unpack(line, BCF_UN_FLT);
+    if ( line->d.n_flt==n && !memcmp(line->d.flt, flt_ids, sizeof(*flt_ids)*n) ) return;
+    bcf_update_filter(args->hdr, line, flt_ids, n);
+}
+
 static void set_genotypes(args_t *args, bcf1_t *line, int pass_site)
 {
     int i,j;
@@ -368,6 +404,7 @@ static void set_genotypes(args_t *args, bcf1_t *line, int pass_site)
     if ( args->set_gts==SET_GTS_MISSING ) new_gt = bcf_gt_missing;
     else if ( args->set_gts==SET_GTS_REF ) new_gt = bcf_gt_unphased(0);
     else error("todo: set_gts=%d\n", args->set_gts);
+    int nchanged = 0;
     for (i=0; i<bcf_hdr_nsamples(args->hdr); i++)
     {
         if ( args->smpl_pass )
@@ -380,6 +417,8 @@ static void set_genotypes(args_t *args, bcf1_t *line, int pass_site)
         for (j=0; j<ngts; j++)
         {
             if ( gts[j]==bcf_int32_vector_end ) break;
+            if ( gts[j]==new_gt ) continue;
+            nchanged++;
             if ( args->set_gts==SET_GTS_MISSING && !bcf_gt_is_missing(gts[j]) )
             {
                 int ial = bcf_gt_allele(gts[j]);
@@ -395,11 +434,159 @@ static void set_genotypes(args_t *args, bcf1_t *line, int pass_site)
             gts[j] = new_gt;
         }
     }
+
+    // leave the record unmodified if there was nothing to set, it is then written as it was read
+    if ( !nchanged ) return;
+
     bcf_update_genotypes(args->hdr,line,args->tmpi,ngts*bcf_hdr_nsamples(args->hdr));
     if ( has_an ) bcf_update_info_int32(args->hdr,line,"AN",&an,1);
     if ( has_ac )  bcf_update_info_int32(args->hdr,line,"AC",args->tmp_ac,line->n_allele-1);
 }
 
+// Annotate and output the record given the result of filter_test() in
+// @pass, or of filter_set_test() in @expr_pass with multiple expressions
+static void process_record(args_t *args, bcf1_t **rec, int pass, int *expr_pass)
+{
+    bcf1_t *line = *rec;
+    int nfail = 0;
+    if ( args->fset )
+    {
+        // collect the FILTER ids of failed expressions in expr_pass
+        int i;
+        for (i=0; i<args->nexpr; i++)
+        {
+            int fail = expr_pass[i] ? 0 : 1;
+            if ( args->expr_logic[i] & FLT_EXCLUDE ) fail = fail ? 0 : 1;
+            if ( fail ) expr_pass[nfail++] = args->expr_fail[i];
+        }
+        pass = nfail ? 0 : 1;
+    }
+    else if ( args->filter && (args->filter_logic & FLT_EXCLUDE) ) pass = pass ? 0 : 1;
+
+    if ( args->soft_filter || args->set_gts || pass )
+    {
+        if ( pass )
+        {
+            bcf_unpack(line,BCF_UN_FLT);
+            if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
+        }
+        else if ( args->fset )
+        {
+            int i;
+            if ( (args->annot_mode & ANNOT_ADD) )
+                for (i=0; i<nfail; i++) bcf_add_filter(args->hdr, line, expr_pass[i]);
+            else update_filter(args, line, expr_pass, nfail);
+        }
+        else if ( args->soft_filter )
+        {
+            if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
+            else update_filter(args, line, &args->flt_fail, 1);
+        }
+        if ( args->set_gts ) set_genotypes(args, line, pass);
+        if ( !args->rbuf_lines )
+        {
+            if ( bcf_write1(args->out_fh, args->hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+        }
+        else
+            buffered_filters(args, rec);
+    }
+}
+
+/*
+ *  Multithreaded filtering: the main thread reads records in blocks, the
+ *  expressions are evaluated by worker threads, each block having its own
+ *  copy of the filter, and the main thread annotates and outputs the
+ *  blocks in the input order, see blkpipe.h
+ */
+typedef struct
+{
+    int nexpr;
+    filter_t *filter;
+    filter_set_t *fset;
+    int *pass;              // filter_test() results, nexpr per record with multiple expressions
+    uint8_t *smpl_pass;     // sample statuses of all records, allocated only with -S
+}
+block_t;
+
+static void *filter_block(void *arg)
+{
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    int i;
+    if ( dat->fset )
+        for (i=0; i<blk->nrec; i++)
+            filter_set_test(dat->fset, blk->recs[i], dat->pass + i*dat->nexpr, NULL);
+    else
+        filter_test_batch(dat->filter, blk->recs, blk->nrec, dat->pass, dat->smpl_pass);
+    return blk;
+}
+
+static void output_block(void *usr, void *arg)
+{
+    args_t *args = (args_t*) usr;
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    int i, nsmpl = bcf_hdr_nsamples(args->hdr);
+    for (i=0; i<blk->nrec; i++)
+    {
+        if ( dat->smpl_pass ) args->smpl_pass = dat->smpl_pass + (size_t)i*nsmpl;
+        if ( dat->fset )
+            process_record(args, &blk->recs[i], 1, dat->pass + i*args->nexpr);
+        else
+            process_record(args, &blk->recs[i], dat->pass[i], NULL);
+    }
+}
+
+static void filter_threaded(args_t *args)
+{
+    int i, nblk = 2*args->n_threads;
+    block_t *dat = (block_t*) calloc(nblk, sizeof(block_t));
+    void **data = (void**) malloc(sizeof(void*)*nblk);
+    for (i=0; i<nblk; i++)
+    {
+        data[i] = &dat[i];
+        dat[i].nexpr = args->nexpr;
+        if ( args->fset )
+        {
+            dat[i].fset = filter_set_init(args->hdr, args->nexpr, args->expr);
+            dat[i].pass = (int*) malloc(sizeof(int)*BLKPIPE_NREC*args->nexpr);
+        }
+        else
+        {
+            dat[i].filter = filter_init(args->hdr, args->filter_str);
+            dat[i].pass = (int*) malloc(sizeof(int)*BLKPIPE_NREC);
+        }
+        if ( args->set_gts ) dat[i].smpl_pass = (uint8_t*) malloc((size_t)BLKPIPE_NREC*bcf_hdr_nsamples(args->hdr));
+    }
+    blkpipe_t *pipe = blkpipe_blocks_init(args->files->p->pool, nblk, data, filter_block, output_block, args);
+    while ( bcf_sr_next_line(args->files) )
+        blkpipe_push(pipe, args->files, 0);
+    blkpipe_flush(pipe);
+    blkpipe_destroy(pipe);
+
+    for (i=0; i<nblk; i++)
+    {
+        if ( dat[i].fset ) filter_set_destroy(dat[i].fset);
+        if ( dat[i].filter ) filter_destroy(dat[i].filter);
+        free(dat[i].pass);
+        free(dat[i].smpl_pass);
+    }
+    free(dat);
+    free(data);
+    args->smpl_pass = NULL;
+}
+
+static void add_expression(args_t *args, char *str, int logic)
+{
+    args->filter_str = str;
+    args->filter_logic |= logic;
+    args->expr = (char**) realloc(args->expr, sizeof(char*)*(args->nexpr+1));
+    args->expr_logic = (int*) realloc(args->expr_logic, sizeof(int)*(args->nexpr+1));
+    args->expr[args->nexpr] = str;
+    args->expr_logic[args->nexpr] = logic;
+    args->nexpr++;
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -423,6 +610,10 @@ static void usage(args_t *args)
     fprintf(stderr, "    -T, --targets-file <file>     similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "        --threads <int>           use multithreading with <int> worker threads [0]\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "Multiple -i/-e expressions can be given, each paired with its own -s name in the order given,\n");
+    fprintf(stderr, "all are evaluated in a single pass. For example:\n");
+    fprintf(stderr, "    bcftools filter -s LowQual -e 'QUAL<20' -s LowDP -e 'FMT/DP<10' in.vcf.gz\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -500,7 +691,11 @@ int main_vcffilter(int argc, char *argv[])
                     default: error("The output type \"%s\" not recognised\n", optarg);
                 }
                 break;
-            case 's': args->soft_filter = optarg; break;
+            case 's':
+                args->soft_filter = optarg;
+                args->soft_names = (char**) realloc(args->soft_names, sizeof(char*)*(args->nsoft_names+1));
+                args->soft_names[args->nsoft_names++] = optarg;
+                break;
             case 'm':
                 if ( strchr(optarg,'x') ) args->annot_mode |= ANNOT_RESET;
                 if ( strchr(optarg,'+') ) args->annot_mode |= ANNOT_ADD;
@@ -509,8 +704,8 @@ int main_vcffilter(int argc, char *argv[])
             case 'T': args->targets_list = optarg; targets_is_file = 1; break;
             case 'r': args->regions_list = optarg; break;
             case 'R': args->regions_list = optarg; regions_is_file = 1; break;
-            case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
-            case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
+            case 'e': add_expression(args, optarg, FLT_EXCLUDE); break;
+            case 'i': add_expression(args, optarg, FLT_INCLUDE); break;
             case 'S':
                 if ( !strcmp(".",optarg) ) args->set_gts = SET_GTS_MISSING;
                 else if ( !strcmp("0",optarg) ) args->set_gts = SET_GTS_REF;
@@ -524,7 +719,12 @@ int main_vcffilter(int argc, char *argv[])
         }
     }
 
-    if ( args->filter_logic == (FLT_EXCLUDE|FLT_INCLUDE) ) error("Only one of -i or -e can be given.\n");
+    if ( args->nexpr > 1 )
+    {
+        if ( args->nsoft_names!=args->nexpr ) error("Multiple -i/-e expressions require the same number of -s names.\n");
+        if ( args->set_gts ) error("The -S option cannot be combined with multiple -i/-e expressions.\n");
+    }
+    else if ( args->filter_logic == (FLT_EXCLUDE|FLT_INCLUDE) ) error("Only one of -i or -e can be given.\n");
     char *fname = NULL;
     if ( optind>=argc )
     {
@@ -556,38 +756,24 @@ int main_vcffilter(int argc, char *argv[])
         if ( bcf_sr_set_targets(args->files, args->targets_list,targets_is_file, 0)<0 )
             error("Failed to read the targets: %s\n", args->targets_list);
     }
+    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to read from %s: %s\n", !strcmp("-",fname)?"standard input":fname,bcf_sr_strerror(args->files->errnum));
 
     init_data(args);
     if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("[%s] Error: cannot write the header to %s\n", __func__,args->output_fname);
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->n_threads && (args->filter || args->fset) )
+        filter_threaded(args);
+    else
     {
-        bcf1_t *line = bcf_sr_get_line(args->files, 0);
-        int pass = 1;
-        if ( args->filter )
-        {
-            pass = filter_test(args->filter, line, &args->smpl_pass);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-        }
-        if ( args->soft_filter || args->set_gts || pass )
+        while ( bcf_sr_next_line(args->files) )
         {
-            if ( pass )
-            {
-                bcf_unpack(line,BCF_UN_FLT);
-                if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
-            }
-            else if ( args->soft_filter )
-            {
-                if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
-                else bcf_update_filter(args->hdr, line, &args->flt_fail, 1);
-            }
-            if ( args->set_gts ) set_genotypes(args, line, pass);
-            if ( !args->rbuf_lines )
-            {
-                if ( bcf_write1(args->out_fh, args->hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
-            }
-            else
-                buffered_filters(args, line);
+            bcf1_t *line = bcf_sr_get_line(args->files, 0);
+            int pass = 1;
+            if ( args->fset )
+                filter_set_test(args->fset, line, args->expr_pass, NULL);
+            else if ( args->filter )
+                pass = filter_test(args->filter, line, &args->smpl_pass);
+            process_record(args, &args->files->readers[0].buffer[0], pass, args->expr_pass);
         }
     }
     buffered_filters(args, NULL);
@@ -32,11 +32,18 @@ THE SOFTWARE.  */
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include <math.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/kbitset.h>
+#include <htslib/thread_pool.h>
+#include <htslib/hts_endian.h>
+#include <htslib/khash_str2int.h>
 #include <inttypes.h>
 #include <sys/time.h>
 #include "bcftools.h"
@@ -49,19 +56,58 @@ typedef struct
 }
 pair_t;
 
+/* 
+    Generage a 32-bit random number, taken from
+        https://www.pcg-random.org/download.html#minimal-c-implementation
+*/
+typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
+static uint32_t pcg32_random_r(pcg32_random_t* rng)
+{
+    uint64_t oldstate = rng->state;
+    rng->state = oldstate * 6364136223846793005ULL + (rng->inc|1);
+    uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
+    uint32_t rot = oldstate >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+static void pcg32_srandom_r(pcg32_random_t *rng, uint64_t initstate, uint64_t initseq)
+{
+    rng->state = 0U;
+    rng->inc = (initseq << 1u) | 1u;
+    pcg32_random_r(rng);
+    rng->state += initstate;
+    pcg32_random_r(rng);
+}
+
+#define GT_BLOCK 64     // number of sites compared at once, see flush_block()
+
+// A range of query samples (rows of the pair matrix) compared by one thread
 typedef struct
+{
+    struct _args_t *args;
+    int ibeg, iend;
+}
+tile_t;
+
+typedef struct _args_t
 {
     bcf_srs_t *files;           // first reader is the query VCF - single sample normally or multi-sample for cross-check
     bcf_hdr_t *gt_hdr, *qry_hdr; // VCF with genotypes to compare against and the query VCF
+    struct _panel_t *panel;     // -g given as a panel created by --build-panel, gt_hdr is then its dummy header
     char *cwd, **argv, *gt_samples, *qry_samples, *regions, *targets, *qry_fname, *gt_fname, *pair_samples;
     int argc, gt_samples_is_file, qry_samples_is_file, regions_is_file, targets_is_file, pair_samples_is_file;
     int qry_use_GT,gt_use_GT, nqry_smpl,ngt_smpl, *qry_smpl,*gt_smpl;
     double *pdiff, *qry_prob, *gt_prob;
     uint32_t *ndiff,*ncnt,ncmp, npairs;
     int32_t *qry_arr,*gt_arr, nqry_arr,ngt_arr;
-    uint8_t *qry_dsg, *gt_dsg;
+    uint8_t *qry_dsg, *gt_dsg;     // blocks of GT_BLOCK sites [GT_BLOCK*nsmpl], likewise qry_prob,gt_prob [3*GT_BLOCK*nsmpl]
+    uint64_t *qry_bits, *gt_bits;  // with -e 0 --no-HWE-prob: dsg bitplanes [3*nsmpl], one bit per site, see cmp_rows()
+    int nblk;                       // number of sites in the current block
     pair_t *pairs;
-    double *hwe_prob, dsg2prob[8][3], pl2prob[256];
+    double *hwe_prob, *hwe_dsg, dsg2prob[8][3], pl2prob[256];    // hwe_dsg: per-site HWE probs of the block [8*GT_BLOCK]
+    int n_threads, ntiles;
+    hts_tpool *pool;
+    hts_tpool_process *tile_queue;
+    tile_t *tiles;
     double min_inter_err, max_intra_err;
     int all_sites, hom_only, ntop, cross_check, calc_hwe_prob, sort_by_hwe, dry_run, use_PLs;
     FILE *fp;
@@ -72,6 +118,11 @@ typedef struct
     size_t diff_sites_size;
     extsort_t *es;
     char *es_tmp_prefix, *es_max_mem;
+    pcg32_random_t rng;
+    uint64_t nres_max, nres_seen;   // --sample-sites: reservoir of at most nres_max sites out of nres_seen, used instead of extsort
+    uint8_t *res_dat;               // the reservoir [nres_max*diff_sites_size]
+    void **res_ptr;                 // the sorted reservoir for diff_sites_shift()
+    int nres, ires;
 }
 args_t;
 
@@ -161,6 +212,12 @@ static void diff_sites_init(args_t *args)
     size_t n = (args->npairs + KBS_ELTBITS-1) / KBS_ELTBITS;
     assert( n==args->kbs_diff->n );
     args->diff_sites_size = sizeof(diff_sites_t) + (n-1)*sizeof(unsigned long);
+    if ( args->nres_max )
+    {
+        args->res_dat = (uint8_t*) malloc(args->nres_max*args->diff_sites_size);
+        if ( !args->res_dat ) error("Could not allocate %"PRIu64" bytes for --sample-sites\n", args->nres_max*args->diff_sites_size);
+        return;
+    }
     args->es = extsort_alloc();
     extsort_set_opt(args->es,size_t,DAT_SIZE,args->diff_sites_size);
     extsort_set_opt(args->es,const char*,TMP_PREFIX,args->es_tmp_prefix);
@@ -171,40 +228,68 @@ static void diff_sites_init(args_t *args)
 static void diff_sites_destroy(args_t *args)
 {
     kbs_destroy(args->kbs_diff);
-    extsort_destroy(args->es);
+    if ( args->es ) extsort_destroy(args->es);
+    free(args->res_dat);
+    free(args->res_ptr);
 }
 static inline void diff_sites_reset(args_t *args)
 {
     kbs_clear(args->kbs_diff);
 }
-/* 
-    Generage a 32-bit random number, taken from
-        https://www.pcg-random.org/download.html#minimal-c-implementation
+/*
+    With --sample-sites, a uniform random subset of the discordant sites is kept in a fixed-size
+    reservoir (Vitter's algorithm R), the discarded sites are never copied. The memory is then
+    bounded by the reservoir size and the result depends only on the seed, not on the input size.
 */
-typedef struct { uint64_t state;  uint64_t inc; } pcg32_random_t;
-static uint32_t pcg32_random_r(pcg32_random_t* rng)
+static inline diff_sites_t *diff_sites_reservoir_slot(args_t *args)
 {
-    uint64_t oldstate = rng->state;
-    rng->state = oldstate * 6364136223846793005ULL + (rng->inc|1);
-    uint32_t xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
-    uint32_t rot = oldstate >> 59u;
-    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+    uint64_t iseen = args->nres_seen++;
+    if ( iseen < args->nres_max )
+    {
+        args->nres++;
+        return (diff_sites_t*)(args->res_dat + iseen*args->diff_sites_size);
+    }
+    uint64_t irand = ((uint64_t)pcg32_random_r(&args->rng) << 32 | pcg32_random_r(&args->rng)) % (iseen + 1);
+    if ( irand >= args->nres_max ) return NULL;
+    return (diff_sites_t*)(args->res_dat + irand*args->diff_sites_size);
 }
 static inline void diff_sites_push(args_t *args, int ndiff, int rid, int pos)
 {
-    static pcg32_random_t rng = { 0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL };
-    diff_sites_t *dat = (diff_sites_t*) malloc(args->diff_sites_size);
+    diff_sites_t *dat;
+    if ( args->nres_max )
+    {
+        if ( !(dat = diff_sites_reservoir_slot(args)) ) return;
+    }
+    else
+        dat = (diff_sites_t*) malloc(args->diff_sites_size);
     memset(dat,0,sizeof(*dat)); // for debugging: prevent warnings about uninitialized memory coming from struct padding (not needed after rand added)
     dat->ndiff = ndiff;
     dat->rid  = rid;
     dat->pos  = pos;
-    dat->rand = pcg32_random_r(&rng);
+    dat->rand = pcg32_random_r(&args->rng);
     memcpy(dat->kbs_dat,args->kbs_diff->b,args->kbs_diff->n*sizeof(unsigned long));
-    extsort_push(args->es,dat);
+    if ( !args->nres_max ) extsort_push(args->es,dat);
+}
+static void diff_sites_sort(args_t *args)
+{
+    if ( !args->nres_max )
+    {
+        extsort_sort(args->es);
+        return;
+    }
+    int i;
+    args->res_ptr = (void**) malloc(sizeof(*args->res_ptr)*(args->nres ? args->nres : 1));
+    for (i=0; i<args->nres; i++) args->res_ptr[i] = args->res_dat + (size_t)i*args->diff_sites_size;
+    qsort(args->res_ptr, args->nres, sizeof(*args->res_ptr), diff_sites_cmp);
+    args->ires = 0;
 }
 static inline int diff_sites_shift(args_t *args, int *ndiff, int *rid, int *pos)
 {
-    diff_sites_t *dat = (diff_sites_t*) extsort_shift(args->es);
+    diff_sites_t *dat;
+    if ( args->nres_max )
+        dat = args->ires < args->nres ? (diff_sites_t*) args->res_ptr[args->ires++] : NULL;
+    else
+        dat = (diff_sites_t*) extsort_shift(args->es);
     if ( !dat ) return 0;
     *ndiff = dat->ndiff;
     *rid   = dat->rid;
@@ -213,20 +298,326 @@ static inline int diff_sites_shift(args_t *args, int *ndiff, int *rid, int *pos)
     return 1;
 }
 
+/*
+    Genotype panel created by --build-panel. The cohort is extracted once into a compact
+    bit-packed matrix which is then memory-mapped by repeated queries, instead of parsing
+    the -g VCF each time. Diploid genotypes are stored as 2-bit codes, four samples per
+    byte and one row per site: 0 for a missing genotype, 1 for 0/0, 2 for 0/1 and 3 for 1/1,
+    non-reference alleles are treated as ALT just like gt_to_dsg() does. All integers are
+    little-endian:
+
+        char[8]     magic "BCFGTP1\0"
+        uint32      nsmpl, nsites, nchr, row_size (bytes per site)
+        uint64      offset of the site table
+        char[]      nsmpl NUL-terminated sample names, padded with zeros to a multiple of 8 bytes
+        uint8       genotypes [nsites*row_size]
+        uint32      site table [nsites*5]: chromosome index, 0-based position, AC of REF and ALT,
+                    and the offset of the site's alleles
+        uint32      length of the alleles block
+        char[]      alleles, NUL-terminated comma-separated REF,ALT of each site
+        char[]      nchr NUL-terminated chromosome names
+*/
+#define PANEL_MAGIC     "BCFGTP1"
+#define PANEL_HDR_SIZE  32
+#define PANEL_SITE_SIZE 20
+
+typedef struct _panel_t
+{
+    uint8_t *map;       // the whole file
+    size_t size;
+    uint32_t nsmpl, nsites, nchr, row_size;
+    uint8_t *gts, *sites;
+    char *als;
+    int *chr_beg, *chr_end; // the range of sites for each chromosome
+    int *rid2chr, nrid;     // for each query contig its panel chromosome or -1
+    int isite;              // the current site set by panel_find()
+    bcf_hdr_t *hdr;         // dummy header with the sample names to use in place of the -g header
+    kstring_t str;
+}
+panel_t;
+
+static inline uint32_t panel_site(panel_t *panel, int isite, int ifield)
+{
+    return le_to_u32(panel->sites + (size_t)isite*PANEL_SITE_SIZE + 4*ifield);
+}
+static void panel_put_u32(kstring_t *str, uint32_t val)
+{
+    uint8_t buf[4];
+    u32_to_le(val, buf);
+    kputsn((char*)buf, 4, str);
+}
+static int is_panel(const char *fname)
+{
+    char magic[8];
+    FILE *fp = fopen(fname,"rb");
+    if ( !fp ) return 0;
+    int ret = fread(magic,1,8,fp)==8 && !memcmp(magic,PANEL_MAGIC,8) ? 1 : 0;
+    fclose(fp);
+    return ret;
+}
+static void build_panel(args_t *args, const char *fname)
+{
+    bcf_srs_t *files = bcf_sr_init();
+    if ( args->regions && bcf_sr_set_regions(files, args->regions, args->regions_is_file)<0 ) error("Failed to read the regions: %s\n", args->regions);
+    if ( args->targets && bcf_sr_set_targets(files, args->targets, args->targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n", args->targets);
+    if ( !bcf_sr_add_reader(files,args->qry_fname) ) error("Failed to open %s: %s\n", args->qry_fname,bcf_sr_strerror(files->errnum));
+    bcf_hdr_t *hdr = bcf_sr_get_header(files,0);
+    uint32_t i, nsmpl = bcf_hdr_nsamples(hdr), row_size = (nsmpl+3)/4;
+    if ( !nsmpl ) error("No samples in %s?\n", args->qry_fname);
+    if ( bcf_hdr_id2int(hdr,BCF_DT_ID,"GT")<0 ) error("[E::%s] The GT tag is not present in the header of %s\n", __func__, args->qry_fname);
+
+    FILE *fp = fopen(fname,"wb");
+    if ( !fp ) error("Failed to open %s for writing: %s\n", fname, strerror(errno));
+
+    // the counts and the site table offset are filled in at the end
+    kstring_t str = {0,0,0};
+    kputsn(PANEL_MAGIC, 8, &str);
+    while ( str.l < PANEL_HDR_SIZE ) kputc(0, &str);
+    for (i=0; i<nsmpl; i++) kputsn(hdr->samples[i], strlen(hdr->samples[i])+1, &str);
+    while ( str.l % 8 ) kputc(0, &str);
+    uint64_t sites_offset = str.l;
+    if ( fwrite(str.s,1,str.l,fp)!=str.l ) error("Failed to write to %s\n", fname);
+
+    kstring_t sites = {0,0,0}, als = {0,0,0}, chrs = {0,0,0};
+    uint8_t *row = (uint8_t*) malloc(row_size);
+    int32_t *gt_arr = NULL, ngt_arr = 0, *ac = NULL, mac = 0;
+    uint32_t nsites = 0, nchr = 0;
+    int prev_rid = -1, prev_pos = -1;
+    kbitset_t *seen_rid = kbs_init(hdr->n[BCF_DT_CTG]);
+    while ( bcf_sr_next_line(files) )
+    {
+        bcf1_t *rec = bcf_sr_get_line(files,0);
+        int ngt = bcf_get_genotypes(hdr,rec,&gt_arr,&ngt_arr);
+        if ( ngt<=0 || ngt!=2*nsmpl ) continue;     // only diploid data
+        if ( rec->rid!=prev_rid )
+        {
+            if ( kbs_exists(seen_rid,rec->rid) ) error("The file is not sorted, %s appears in multiple blocks: %s\n", bcf_seqname(hdr,rec), args->qry_fname);
+            kbs_insert(seen_rid,rec->rid);
+            kputsn(bcf_seqname(hdr,rec), strlen(bcf_seqname(hdr,rec))+1, &chrs);
+            nchr++;
+            prev_rid = rec->rid;
+        }
+        else if ( rec->pos < prev_pos ) error("The file is not sorted: %s:%"PRId64"\n", bcf_seqname(hdr,rec), (int64_t) rec->pos+1);
+        prev_pos = rec->pos;
+
+        memset(row,0,row_size);
+        for (i=0; i<nsmpl; i++)
+        {
+            int32_t *ptr = gt_arr + 2*i;
+            if ( bcf_gt_is_missing(ptr[0]) || bcf_gt_is_missing(ptr[1]) || ptr[1]==bcf_int32_vector_end ) continue;
+            uint8_t code = 1 + (bcf_gt_allele(ptr[0])?1:0) + (bcf_gt_allele(ptr[1])?1:0);
+            row[i>>2] |= code << (2*(i&3));
+        }
+        if ( fwrite(row,1,row_size,fp)!=row_size ) error("Failed to write to %s\n", fname);
+
+        hts_expand(int32_t, rec->n_allele, mac, ac);
+        if ( bcf_calc_ac(hdr, rec, ac, BCF_UN_INFO|BCF_UN_FMT)!=1 ) error("todo: bcf_calc_ac() failed\n");
+        panel_put_u32(&sites, nchr-1);
+        panel_put_u32(&sites, rec->pos);
+        panel_put_u32(&sites, ac[0]);
+        panel_put_u32(&sites, rec->n_allele>1 ? ac[1] : 0);
+        panel_put_u32(&sites, als.l);
+        for (i=0; i<rec->n_allele; i++)
+        {
+            if ( i ) kputc(',', &als);
+            kputs(rec->d.allele[i], &als);
+        }
+        kputsn("", 1, &als);
+        nsites++;
+    }
+    sites_offset += (uint64_t)nsites*row_size;
+
+    str.l = 0;
+    panel_put_u32(&str, als.l);
+    if ( (sites.l && fwrite(sites.s,1,sites.l,fp)!=sites.l) || fwrite(str.s,1,str.l,fp)!=str.l
+        || (als.l && fwrite(als.s,1,als.l,fp)!=als.l) || (chrs.l && fwrite(chrs.s,1,chrs.l,fp)!=chrs.l) )
+        error("Failed to write to %s\n", fname);
+
+    uint8_t buf[PANEL_HDR_SIZE-8];
+    u32_to_le(nsmpl, buf);
+    u32_to_le(nsites, buf+4);
+    u32_to_le(nchr, buf+8);
+    u32_to_le(row_size, buf+12);
+    u64_to_le(sites_offset, buf+16);
+    if ( fseek(fp,8,SEEK_SET)!=0 || fwrite(buf,1,sizeof(buf),fp)!=sizeof(buf) ) error("Failed to write to %s\n", fname);
+    if ( fclose(fp)!=0 ) error("Close failed: %s\n", fname);
+    fprintf(stderr,"Wrote %"PRIu32" sites of %"PRIu32" samples to %s\n", nsites, nsmpl, fname);
+
+    kbs_destroy(seen_rid);
+    free(row);
+    free(gt_arr);
+    free(ac);
+    free(str.s);
+    free(sites.s);
+    free(als.s);
+    free(chrs.s);
+    bcf_sr_destroy(files);
+}
+static panel_t *panel_open(const char *fname, bcf_hdr_t *qry_hdr)
+{
+    panel_t *panel = (panel_t*) calloc(1,sizeof(panel_t));
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) error("Failed to open %s: %s\n", fname, strerror(errno));
+    struct stat st;
+    if ( fstat(fd,&st)!=0 ) error("Failed to stat %s: %s\n", fname, strerror(errno));
+    panel->size = st.st_size;
+    if ( panel->size < PANEL_HDR_SIZE ) error("The panel is truncated: %s\n", fname);
+#ifndef _WIN32
+    panel->map = mmap(NULL, panel->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( panel->map==MAP_FAILED ) error("Failed to mmap %s: %s\n", fname, strerror(errno));
+#else
+    panel->map = (uint8_t*) malloc(panel->size);
+    size_t nread = 0;
+    while ( nread < panel->size )
+    {
+        ssize_t ret = read(fd, panel->map + nread, panel->size - nread);
+        if ( ret<=0 ) error("Failed to read %s: %s\n", fname, strerror(errno));
+        nread += ret;
+    }
+#endif
+    close(fd);
+
+    uint8_t *map = panel->map, *end = panel->map + panel->size;
+    panel->nsmpl    = le_to_u32(map+8);
+    panel->nsites   = le_to_u32(map+12);
+    panel->nchr     = le_to_u32(map+16);
+    panel->row_size = le_to_u32(map+20);
+    uint64_t sites_offset = le_to_u64(map+24);
+    if ( !panel->nsmpl || panel->row_size!=(panel->nsmpl+3)/4 ) error("Could not parse the panel: %s\n", fname);
+
+    panel->hdr = bcf_hdr_init("w");
+    bcf_hdr_append(panel->hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    char *ptr = (char*) map + PANEL_HDR_SIZE;
+    uint32_t i;
+    for (i=0; i<panel->nsmpl; i++)
+    {
+        char *beg = ptr;
+        while ( (uint8_t*)ptr < end && *ptr ) ptr++;
+        if ( (uint8_t*)ptr >= end ) error("The panel is truncated: %s\n", fname);
+        if ( bcf_hdr_add_sample(panel->hdr, beg)<0 ) error("Failed to add the sample %s from %s\n", beg, fname);
+        ptr++;
+    }
+    if ( bcf_hdr_sync(panel->hdr)<0 ) error("Failed to parse the samples of %s\n", fname);
+
+    size_t off = (uint8_t*)ptr - map;
+    off = (off + 7) & ~(size_t)7;
+    if ( off + (uint64_t)panel->nsites*panel->row_size != sites_offset
+        || sites_offset + (uint64_t)panel->nsites*PANEL_SITE_SIZE + 4 > panel->size ) error("Could not parse the panel: %s\n", fname);
+    panel->gts   = map + off;
+    panel->sites = map + sites_offset;
+    uint32_t nals = le_to_u32(panel->sites + (size_t)panel->nsites*PANEL_SITE_SIZE);
+    panel->als = (char*) panel->sites + (size_t)panel->nsites*PANEL_SITE_SIZE + 4;
+    if ( (uint8_t*)panel->als + nals > end || (nals && panel->als[nals-1]) ) error("Could not parse the panel: %s\n", fname);
+
+    // the sites of each chromosome form a contiguous block sorted by position
+    panel->chr_beg = (int*) malloc(sizeof(int)*panel->nchr);
+    panel->chr_end = (int*) malloc(sizeof(int)*panel->nchr);
+    for (i=0; i<panel->nchr; i++) panel->chr_beg[i] = panel->chr_end[i] = 0;
+    for (i=0; i<panel->nsites; i++)
+    {
+        uint32_t ichr = panel_site(panel,i,0);
+        if ( ichr >= panel->nchr || panel_site(panel,i,4) >= nals ) error("Could not parse the panel: %s\n", fname);
+        if ( !i || ichr!=panel_site(panel,i-1,0) ) panel->chr_beg[ichr] = i;
+        panel->chr_end[ichr] = i + 1;
+    }
+
+    void *chr2idx = khash_str2int_init();
+    ptr = panel->als + nals;
+    for (i=0; i<panel->nchr; i++)
+    {
+        char *beg = ptr;
+        while ( (uint8_t*)ptr < end && *ptr ) ptr++;
+        if ( (uint8_t*)ptr >= end ) error("The panel is truncated: %s\n", fname);
+        khash_str2int_set(chr2idx, beg, i);
+        ptr++;
+    }
+    panel->nrid = qry_hdr->n[BCF_DT_CTG];
+    panel->rid2chr = (int*) malloc(sizeof(int)*(panel->nrid ? panel->nrid : 1));
+    for (i=0; i<panel->nrid; i++)
+        if ( khash_str2int_get(chr2idx, bcf_hdr_id2name(qry_hdr,i), &panel->rid2chr[i])<0 ) panel->rid2chr[i] = -1;
+    khash_str2int_destroy(chr2idx);
+
+    return panel;
+}
+static void panel_destroy(panel_t *panel)
+{
+#ifndef _WIN32
+    munmap(panel->map, panel->size);
+#else
+    free(panel->map);
+#endif
+    bcf_hdr_destroy(panel->hdr);
+    free(panel->chr_beg);
+    free(panel->chr_end);
+    free(panel->rid2chr);
+    free(panel->str.s);
+    free(panel);
+}
+// Locate the panel site with the same position and alleles as rec, returns the site index or -1
+static int panel_find(panel_t *panel, bcf1_t *rec)
+{
+    if ( rec->rid >= panel->nrid || panel->rid2chr[rec->rid]<0 ) return -1;
+    int ichr = panel->rid2chr[rec->rid];
+    int beg = panel->chr_beg[ichr], end = panel->chr_end[ichr];
+    while ( beg < end )
+    {
+        int mid = (beg + end) / 2;
+        if ( panel_site(panel,mid,1) < rec->pos ) beg = mid + 1;
+        else end = mid;
+    }
+    int i;
+    panel->str.l = 0;
+    for (i=0; i<rec->n_allele; i++)
+    {
+        if ( i ) kputc(',', &panel->str);
+        kputs(rec->d.allele[i], &panel->str);
+    }
+    for (; beg < panel->chr_end[ichr] && panel_site(panel,beg,1)==rec->pos; beg++)
+        if ( !strcmp(panel->als + panel_site(panel,beg,4), panel->str.s) ) return panel->isite = beg;
+    return -1;
+}
+// Expand the current site into GT values so that the rest of the code can treat it as a -g record
+static void panel_get_genotypes(panel_t *panel, int32_t **gt_arr, int *ngt_arr)
+{
+    static const int32_t code2gt[4][2] =
+    {
+        { bcf_gt_missing, bcf_gt_missing },
+        { bcf_gt_unphased(0), bcf_gt_unphased(0) },
+        { bcf_gt_unphased(0), bcf_gt_unphased(1) },
+        { bcf_gt_unphased(1), bcf_gt_unphased(1) }
+    };
+    hts_expand(int32_t, 2*panel->nsmpl, *ngt_arr, *gt_arr);
+    uint8_t *row = panel->gts + (size_t)panel->isite*panel->row_size;
+    int32_t *dst = *gt_arr;
+    uint32_t i;
+    for (i=0; i<panel->nsmpl; i++)
+    {
+        int code = (row[i>>2] >> (2*(i&3))) & 3;
+        dst[2*i]   = code2gt[code][0];
+        dst[2*i+1] = code2gt[code][1];
+    }
+}
+
 static void init_data(args_t *args)
 {
     args->files = bcf_sr_init();
     if ( args->regions && bcf_sr_set_regions(args->files, args->regions, args->regions_is_file)<0 ) error("Failed to read the regions: %s\n", args->regions);
     if ( args->targets && bcf_sr_set_targets(args->files, args->targets, args->targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n", args->targets);
 
-    if ( args->gt_fname ) bcf_sr_set_opt(args->files, BCF_SR_REQUIRE_IDX);
+    int use_panel = args->gt_fname && strcmp("-",args->gt_fname) && is_panel(args->gt_fname);
+    if ( args->gt_fname && !use_panel ) bcf_sr_set_opt(args->files, BCF_SR_REQUIRE_IDX);
     if ( !bcf_sr_add_reader(args->files,args->qry_fname) ) error("Failed to open %s: %s\n", args->qry_fname,bcf_sr_strerror(args->files->errnum));
-    if ( args->gt_fname && !bcf_sr_add_reader(args->files, args->gt_fname) )
+    if ( args->gt_fname && !use_panel && !bcf_sr_add_reader(args->files, args->gt_fname) )
         error("Failed to read from %s: %s\n", !strcmp("-",args->gt_fname)?"standard input":args->gt_fname,bcf_sr_strerror(args->files->errnum));
 
     args->qry_hdr = bcf_sr_get_header(args->files,0);
     if ( !bcf_hdr_nsamples(args->qry_hdr) ) error("No samples in %s?\n", args->qry_fname);
-    if ( args->gt_fname )
+    if ( use_panel )
+    {
+        args->panel  = panel_open(args->gt_fname, args->qry_hdr);
+        args->gt_hdr = args->panel->hdr;
+    }
+    else if ( args->gt_fname )
     {
         args->gt_hdr = bcf_sr_get_header(args->files,1);
         if ( !bcf_hdr_nsamples(args->gt_hdr) ) error("No samples in %s?\n", args->gt_fname);
@@ -368,14 +759,22 @@ static void init_data(args_t *args)
     if ( !args->npairs ) args->npairs = args->cross_check ? args->nqry_smpl*(args->nqry_smpl+1)/2 : args->ngt_smpl*args->nqry_smpl;
     if ( !args->pair_samples )
     {
-        args->qry_dsg = (uint8_t*) malloc(args->nqry_smpl);
-        args->gt_dsg  = args->cross_check ? args->qry_dsg : (uint8_t*) malloc(args->ngt_smpl);
+        args->qry_dsg = (uint8_t*) malloc(GT_BLOCK*args->nqry_smpl);
+        args->gt_dsg  = args->cross_check ? args->qry_dsg : (uint8_t*) malloc(GT_BLOCK*args->ngt_smpl);
+        if ( args->calc_hwe_prob ) args->hwe_dsg = (double*) malloc(8*GT_BLOCK*sizeof(*args->hwe_dsg));
+    }
+    if ( !args->pair_samples && !args->use_PLs && !args->calc_hwe_prob )
+    {
+        // Only the numbers of discordant and compared sites are needed, the genotypes
+        // can be accumulated in blocks of 64 sites and compared with bitwise operations
+        args->qry_bits = (uint64_t*) calloc(3*args->nqry_smpl,sizeof(*args->qry_bits));
+        args->gt_bits  = args->cross_check ? args->qry_bits : (uint64_t*) calloc(3*args->ngt_smpl,sizeof(*args->gt_bits));
     }
     if ( args->use_PLs )
     {
         args->pdiff = (double*) calloc(args->npairs,sizeof(*args->pdiff));      // log probability of pair samples being the same
-        args->qry_prob = (double*) malloc(3*args->nqry_smpl*sizeof(*args->qry_prob));
-        args->gt_prob  = args->cross_check ? args->qry_prob : (double*) malloc(3*args->ngt_smpl*sizeof(*args->gt_prob));
+        args->qry_prob = (double*) malloc(3*GT_BLOCK*args->nqry_smpl*sizeof(*args->qry_prob));
+        args->gt_prob  = args->cross_check ? args->qry_prob : (double*) malloc(3*GT_BLOCK*args->ngt_smpl*sizeof(*args->gt_prob));
 
         // dsg2prob: the first index is bitmask of 8 possible dsg combinations (only 1<<0,1<<2,1<<3 are set, accessing
         // anything else indicated an error, this is just to reuse gt_to_dsg()); the second index are the corresponding 
@@ -409,6 +808,33 @@ static void init_data(args_t *args)
 
     if ( args->distinctive_sites ) diff_sites_init(args);
 
+    if ( args->n_threads > 0 && !args->pair_samples && args->nqry_smpl > 1 )
+    {
+        // Split the pair matrix into tiles of consecutive rows with roughly the same number
+        // of pairs, several per thread to balance the load of the triangular cross-check
+        args->ntiles = 4*args->n_threads;
+        if ( args->ntiles > args->nqry_smpl ) args->ntiles = args->nqry_smpl;
+        args->tiles = (tile_t*) calloc(args->ntiles,sizeof(*args->tiles));
+        double npairs_tile = (double)args->npairs / args->ntiles, npairs_row = 0;
+        int itile = 0;
+        args->tiles[0].ibeg = 0;
+        for (i=0; i<args->nqry_smpl; i++)
+        {
+            npairs_row += args->cross_check ? i : args->ngt_smpl;
+            if ( itile+1 < args->ntiles && npairs_row >= (itile+1)*npairs_tile )
+            {
+                args->tiles[itile].iend = i+1;
+                args->tiles[++itile].ibeg = i+1;
+            }
+        }
+        args->tiles[itile].iend = args->nqry_smpl;
+        args->ntiles = itile+1;
+        for (i=0; i<args->ntiles; i++) args->tiles[i].args = args;
+
+        if ( !(args->pool = hts_tpool_init(args->n_threads)) ) error("Failed to initialize %d threads\n", args->n_threads);
+        args->tile_queue = hts_tpool_process_init(args->pool, args->ntiles, 1);
+    }
+
     args->fp = stdout;
     print_header(args, args->fp);
 }
@@ -419,6 +845,15 @@ static void destroy_data(args_t *args)
     free(args->qry_dsg);
     if ( args->gt_prob!=args->qry_prob ) free(args->gt_prob);
     free(args->qry_prob);
+    free(args->hwe_dsg);
+    if ( args->pool )
+    {
+        hts_tpool_process_destroy(args->tile_queue);
+        hts_tpool_destroy(args->pool);
+    }
+    free(args->tiles);
+    if ( args->gt_bits!=args->qry_bits ) free(args->gt_bits);
+    free(args->qry_bits);
     free(args->es_max_mem);
     fclose(args->fp);
     if ( args->distinctive_sites ) diff_sites_destroy(args);
@@ -426,6 +861,7 @@ static void destroy_data(args_t *args)
     free(args->cwd);
     free(args->qry_arr);
     if ( args->gt_hdr ) free(args->gt_arr);
+    if ( args->panel ) panel_destroy(args->panel);
     free(args->pdiff);
     free(args->ndiff);
     free(args->ncnt);
@@ -481,9 +917,113 @@ static inline uint8_t pl_to_prob(args_t *args, int32_t *ptr, double *prob)
     }
     return dsg;
 }
+static inline void set_bits(uint64_t *bits, uint8_t dsg, int ibit)
+{
+    uint64_t mask = 1ULL << ibit;
+    if ( dsg & 1 ) bits[0] |= mask;
+    if ( dsg & 2 ) bits[1] |= mask;
+    if ( dsg & 4 ) bits[2] |= mask;
+}
+/*
+    Compare the accumulated block of sites for the query samples (rows of the
+    pair matrix) ibeg..iend-1. Each pair is visited in the site order, so the
+    results are the same as when comparing site by site. The rows are disjoint
+    and can be processed by multiple threads without any locking.
+
+    With the bitplanes, the three planes of each sample have the bit set at a
+    site when the corresponding dsg bit is set, missing genotypes have no bits
+    set.
+*/
+static void cmp_rows(args_t *args, int ibeg, int iend)
+{
+    int i,j,k, nqry = args->nqry_smpl, ngt_smpl = args->ngt_smpl;
+    for (i=ibeg; i<iend; i++)
+    {
+        int ngt = args->cross_check ? i : ngt_smpl;     // two files or a sub-diagonal cross-check mode?
+        int idx = args->cross_check ? i*(i-1)/2 : i*ngt_smpl;
+        if ( args->qry_bits )
+        {
+            uint64_t *qry = args->qry_bits + 3*i;
+            uint64_t qry_any = qry[0] | qry[1] | qry[2];
+            if ( !qry_any ) continue;
+            for (j=0; j<ngt; j++)
+            {
+                uint64_t *gt = args->gt_bits + 3*j;
+                uint64_t valid = qry_any & (gt[0] | gt[1] | gt[2]);
+                if ( !valid ) continue;
+                uint64_t match = (qry[0] & gt[0]) | (qry[1] & gt[1]) | (qry[2] & gt[2]);
+                args->ncnt[idx+j]  += popcount64(valid);
+                args->ndiff[idx+j] += popcount64(valid & ~match);
+            }
+            continue;
+        }
+        for (k=0; k<args->nblk; k++)
+        {
+            uint8_t qry_dsg = args->qry_dsg[k*nqry + i];
+            if ( !qry_dsg ) continue;                               // missing value
+            uint8_t *gt_dsg = args->gt_dsg + k*ngt_smpl;
+            double *hwe_dsg = args->hwe_dsg + 8*k;
+            if ( !args->use_PLs )
+            {
+                for (j=0; j<ngt; j++)
+                {
+                    if ( !gt_dsg[j] ) continue;                     // missing value
+                    int match = qry_dsg & gt_dsg[j];
+                    if ( !match ) args->ndiff[idx+j]++;
+                    else if ( args->calc_hwe_prob ) args->hwe_prob[idx+j] += hwe_dsg[match];
+                    args->ncnt[idx+j]++;
+                }
+                continue;
+            }
+            double *qry_prob = args->qry_prob + 3*(k*nqry + i);
+            double *gt_prob  = args->gt_prob + 3*k*ngt_smpl;
+            for (j=0; j<ngt; j++)
+            {
+                if ( !gt_dsg[j] ) continue;                         // missing value
+
+                double min = qry_prob[0] + gt_prob[j*3];
+                if ( min > qry_prob[1] + gt_prob[j*3+1] ) min = qry_prob[1] + gt_prob[j*3+1];
+                if ( min > qry_prob[2] + gt_prob[j*3+2] ) min = qry_prob[2] + gt_prob[j*3+2];
+                args->pdiff[idx+j] += min;
+
+                if ( args->calc_hwe_prob )
+                {
+                    int match = qry_dsg & gt_dsg[j];
+                    args->hwe_prob[idx+j] += hwe_dsg[match];
+                }
+                args->ncnt[idx+j]++;
+            }
+        }
+    }
+}
+static void *cmp_tile(void *data)
+{
+    tile_t *tile = (tile_t*) data;
+    cmp_rows(tile->args, tile->ibeg, tile->iend);
+    return NULL;
+}
+static void flush_block(args_t *args)
+{
+    if ( !args->nblk ) return;
+    if ( !args->pool )
+        cmp_rows(args, 0, args->nqry_smpl);
+    else
+    {
+        int i;
+        for (i=0; i<args->ntiles; i++)
+            if ( hts_tpool_dispatch(args->pool, args->tile_queue, cmp_tile, &args->tiles[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+        if ( hts_tpool_process_flush(args->tile_queue)!=0 ) error("[%s] Error: failed to flush the thread pool queue\n", __func__);
+    }
+    if ( args->qry_bits )
+    {
+        memset(args->qry_bits,0,sizeof(*args->qry_bits)*3*args->nqry_smpl);
+        if ( !args->cross_check ) memset(args->gt_bits,0,sizeof(*args->gt_bits)*3*args->ngt_smpl);
+    }
+    args->nblk = 0;
+}
 static void process_line(args_t *args)
 {
-    int i,j,k, nqry1, ngt1;
+    int i,k, nqry1, ngt1;
 
     bcf1_t *gt_rec = NULL, *qry_rec = bcf_sr_get_line(args->files,0);   // the query file
     if ( args->qry_use_GT )
@@ -499,7 +1039,13 @@ static void process_line(args_t *args)
         nqry1 = 3;
     }
 
-    if ( args->gt_hdr )
+    if ( args->panel )
+    {
+        if ( panel_find(args->panel,qry_rec)<0 ) return;
+        panel_get_genotypes(args->panel,&args->gt_arr,&args->ngt_arr);
+        ngt1 = 2;
+    }
+    else if ( args->gt_hdr )
     {
         gt_rec = bcf_sr_get_line(args->files,1);
         if ( args->gt_use_GT )
@@ -527,7 +1073,12 @@ static void process_line(args_t *args)
     if ( args->calc_hwe_prob )
     {
         int ac[2];
-        if ( args->gt_hdr )
+        if ( args->panel )
+        {
+            ac[0] = panel_site(args->panel,args->panel->isite,2);
+            ac[1] = panel_site(args->panel,args->panel->isite,3);
+        }
+        else if ( args->gt_hdr )
         {
             if ( bcf_calc_ac(args->gt_hdr, gt_rec, ac, BCF_UN_INFO|BCF_UN_FMT)!=1 ) error("todo: bcf_calc_ac() failed\n");
         }
@@ -625,83 +1176,45 @@ static void process_line(args_t *args)
         return;
     }
 
-    int idx=0;
-    if ( !args->use_PLs )
+    // All samples: collect the genotypes in blocks of sites, these are compared in flush_block()
+    int nqry = args->nqry_smpl, ngt_smpl = args->ngt_smpl, iblk = args->nblk;
+    uint8_t *qry_dsg = args->qry_dsg + iblk*nqry;
+    uint8_t *gt_dsg  = args->gt_dsg + iblk*ngt_smpl;
+    double *qry_prob = args->use_PLs ? args->qry_prob + 3*iblk*nqry : NULL;
+    double *gt_prob  = args->use_PLs ? args->gt_prob + 3*iblk*ngt_smpl : NULL;
+    if ( args->calc_hwe_prob ) memcpy(args->hwe_dsg + 8*iblk, hwe_dsg, sizeof(hwe_dsg));
+    for (i=0; i<nqry; i++)
     {
-        for (i=0; i<args->nqry_smpl; i++)
-        {
-            int iqry = args->qry_smpl ? args->qry_smpl[i] : i;
-            int32_t *ptr = args->qry_arr + nqry1*iqry;
-            args->qry_dsg[i] = args->qry_use_GT ? gt_to_dsg(ptr) : pl_to_dsg(ptr);
-        }
-        if ( !args->cross_check )   // in this case gt_dsg points to qry_dsg
-        {
-            for (i=0; i<args->ngt_smpl; i++)
-            {
-                int igt = args->gt_smpl ? args->gt_smpl[i] : i;
-                int32_t *ptr = args->gt_arr + ngt1*igt;
-                args->gt_dsg[i] = args->gt_use_GT ? gt_to_dsg(ptr) : pl_to_dsg(ptr);
-                if ( args->hom_only && !(args->gt_dsg[i]&5) ) args->gt_dsg[i] = 0;      // not a hom, set to a missing value
-            }
-        }
-        for (i=0; i<args->nqry_smpl; i++)
-        {
-            int ngt = args->cross_check ? i : args->ngt_smpl;       // two files or a sub-diagonal cross-check mode?
-            if ( !args->qry_dsg[i] ) { idx += ngt; continue; }      // missing value
-            for (j=0; j<ngt; j++)
-            {
-                if ( !args->gt_dsg[j] ) { idx++; continue; }        // missing value
-                int match = args->qry_dsg[i] & args->gt_dsg[j];
-                if ( !match ) args->ndiff[idx]++;
-                else if ( args->calc_hwe_prob ) args->hwe_prob[idx] += hwe_dsg[match];
-                args->ncnt[idx]++;
-                idx++;
-            }
-        }
+        int iqry = args->qry_smpl ? args->qry_smpl[i] : i;
+        int32_t *ptr = args->qry_arr + nqry1*iqry;
+        if ( !args->use_PLs )
+            qry_dsg[i] = args->qry_use_GT ? gt_to_dsg(ptr) : pl_to_dsg(ptr);
+        else
+            qry_dsg[i] = args->qry_use_GT ? gt_to_prob(args,ptr,qry_prob+i*3) : pl_to_prob(args,ptr,qry_prob+i*3);
     }
-    else    // use_PLs set
+    if ( !args->cross_check )   // in this case gt_dsg points to qry_dsg
     {
-        for (i=0; i<args->nqry_smpl; i++)
-        {
-            int iqry = args->qry_smpl ? args->qry_smpl[i] : i;
-            int32_t *ptr = args->qry_arr + nqry1*iqry;
-            args->qry_dsg[i] = args->qry_use_GT ? gt_to_prob(args,ptr,args->qry_prob+i*3) : pl_to_prob(args,ptr,args->qry_prob+i*3);
-        }
-        if ( !args->cross_check )   // in this case gt_dsg points to qry_dsg
+        for (i=0; i<ngt_smpl; i++)
         {
-            for (i=0; i<args->ngt_smpl; i++)
-            {
-                int igt = args->gt_smpl ? args->gt_smpl[i] : i;
-                int32_t *ptr = args->gt_arr + ngt1*igt;
-                args->gt_dsg[i] = args->gt_use_GT ? gt_to_prob(args,ptr,args->gt_prob+i*3) : pl_to_prob(args,ptr,args->gt_prob+i*3);
-                if ( args->hom_only && !(args->gt_dsg[i]&5) ) args->gt_dsg[i] = 0;      // not a hom, set to a missing value
-            }
-        }
-        for (i=0; i<args->nqry_smpl; i++)
-        {
-            int ngt = args->cross_check ? i : args->ngt_smpl;       // two files or a sub-diagonal cross-check mode?
-            if ( !args->qry_dsg[i] ) { idx += ngt; continue; }      // missing value
-            for (j=0; j<ngt; j++)
-            {
-                if ( !args->gt_dsg[j] ) { idx++; continue; }        // missing value
-
-                double min = args->qry_prob[i*3] + args->gt_prob[j*3];
-                if ( min > args->qry_prob[i*3+1] + args->gt_prob[j*3+1] ) min = args->qry_prob[i*3+1] + args->gt_prob[j*3+1];
-                if ( min > args->qry_prob[i*3+2] + args->gt_prob[j*3+2] ) min = args->qry_prob[i*3+2] + args->gt_prob[j*3+2];
-                args->pdiff[idx] += min;
-
-                if ( args->calc_hwe_prob )
-                {
-                    int match = args->qry_dsg[i] & args->gt_dsg[j];
-                    args->hwe_prob[idx] += hwe_dsg[match];
-                }
-                args->ncnt[idx]++;
-                idx++;
-            }
+            int igt = args->gt_smpl ? args->gt_smpl[i] : i;
+            int32_t *ptr = args->gt_arr + ngt1*igt;
+            if ( !args->use_PLs )
+                gt_dsg[i] = args->gt_use_GT ? gt_to_dsg(ptr) : pl_to_dsg(ptr);
+            else
+                gt_dsg[i] = args->gt_use_GT ? gt_to_prob(args,ptr,gt_prob+i*3) : pl_to_prob(args,ptr,gt_prob+i*3);
+            if ( args->hom_only && !(gt_dsg[i]&5) ) gt_dsg[i] = 0;      // not a hom, set to a missing value
         }
     }
-}
+    if ( args->qry_bits )
+    {
+        for (i=0; i<nqry; i++) set_bits(args->qry_bits + 3*i, qry_dsg[i], iblk);
+        if ( !args->cross_check )
+            for (i=0; i<ngt_smpl; i++) set_bits(args->gt_bits + 3*i, gt_dsg[i], iblk);
+    }
 
+    // flush also the first record for a realistic --dry-run estimate
+    if ( ++args->nblk==GT_BLOCK || args->ncmp==1 ) flush_block(args);
+}
 
 typedef struct
 {
@@ -719,7 +1232,7 @@ static int cmp_idbl(const void *_a, const void *_b)
 }
 static void report_distinctive_sites(args_t *args)
 {
-    extsort_sort(args->es);
+    diff_sites_sort(args);
 
     fprintf(args->fp,"# DS, distinctive sites:\n");
     fprintf(args->fp,"#     - chromosome\n");
@@ -951,13 +1464,14 @@ static void usage(void)
     fprintf(stderr, "Options:\n");
     //fprintf(stderr, "    -a, --all-sites                  Output comparison for all sites\n");
     //fprintf(stderr, "    -c, --cluster MIN,MAX            Min inter- and max intra-sample error [0.23,-0.3]\n");
+    fprintf(stderr, "        --build-panel FILE             Save GTs of the input file as a panel to be used with -g, for repeated queries\n");
     fprintf(stderr, "        --distinctive-sites            Find sites that can distinguish between at least NUM sample pairs.\n");
     fprintf(stderr, "                  NUM[,MEM[,TMP]]          If the number is smaller or equal to 1, it is interpreted as the fraction of pairs.\n");
     fprintf(stderr, "                                           The optional MEM string sets the maximum memory used for in-memory sorting [500M]\n");
     fprintf(stderr, "                                           and TMP is a prefix of temporary files used by external sorting [/tmp/bcftools-gtcheck]\n");
     fprintf(stderr, "        --dry-run                      Stop after first record to estimate required time\n");
     fprintf(stderr, "    -e, --error-probability INT        Phred-scaled probability of genotyping error, 0 for faster but less accurate results [40]\n");
-    fprintf(stderr, "    -g, --genotypes FILE               Genotypes to compare against\n");
+    fprintf(stderr, "    -g, --genotypes FILE               Genotypes to compare against, a VCF/BCF or a panel created by --build-panel\n");
     fprintf(stderr, "    -H, --homs-only                    Homozygous genotypes only, useful with low coverage data (requires -g)\n");
     fprintf(stderr, "        --n-matches INT                Print only top INT matches for each sample, 0 for unlimited. Use negative value\n");
     fprintf(stderr, "                                            to sort by HWE probability rather than the number of discordant sites [0]\n");
@@ -966,10 +1480,12 @@ static void usage(void)
     fprintf(stderr, "    -P, --pairs-file FILE              File with tab-delimited sample pairs to compare (qry,gt with -g or qry,qry w/o)\n");
     fprintf(stderr, "    -r, --regions REGION               Restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file FILE            Restrict to regions listed in a file\n");
+    fprintf(stderr, "        --sample-sites INT[,SEED]      With --distinctive-sites, consider only a random subset of INT discordant sites\n");
     fprintf(stderr, "    -s, --samples [qry|gt]:LIST        List of query or -g samples (by default all samples are compared)\n");
     fprintf(stderr, "    -S, --samples-file [qry|gt]:FILE   File with the query or -g samples to compare\n");
     fprintf(stderr, "    -t, --targets REGION               Similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file FILE            Similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads INT                  Number of threads for comparing sample pairs, not used with -p/-P [0]\n");
     fprintf(stderr, "    -u, --use TAG1[,TAG2]              Which tag to use in the query file (TAG1) and the -g file (TAG2) [PL,GT]\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "   # Check discordance of all samples from B against all sample in A\n");
@@ -1001,6 +1517,8 @@ int main_vcfgtcheck(int argc, char *argv[])
     args->es_tmp_prefix = "/tmp/bcftools-gtcheck";
 #endif
     args->es_max_mem = strdup("500M");
+    args->rng.state = 0x853c49e6748fea9bULL;
+    args->rng.inc   = 0xda3e39cb94b95bdbULL;
 
     // In simulated sample swaps the minimum error was 0.3 and maximum intra-sample error was 0.23
     //    - min_inter: pairs with smaller err value will be considered identical 
@@ -1033,9 +1551,12 @@ int main_vcfgtcheck(int argc, char *argv[])
         {"targets-file",1,0,'T'},
         {"pairs",1,0,'p'},
         {"pairs-file",1,0,'P'},
+        {"threads",1,0,7},
+        {"build-panel",1,0,8},
+        {"sample-sites",1,0,9},
         {0,0,0,0}
     };
-    char *tmp;
+    char *tmp, *build_panel_fname = NULL;
     while ((c = getopt_long(argc, argv, "hg:p:s:S:p:P:Hr:R:at:T:G:c:u:e:",loptions,NULL)) >= 0) {
         switch (c) {
             case 'e':
@@ -1073,6 +1594,22 @@ int main_vcfgtcheck(int argc, char *argv[])
             case 3 : args->calc_hwe_prob = 0; break;
             case 4 : error("The option -S, --target-sample has been deprecated\n"); break;
             case 5 : args->dry_run = 1; break;
+            case 7 : 
+                args->n_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                break;
+            case 8 : build_panel_fname = optarg; break;
+            case 9 :
+                args->nres_max = strtoull(optarg,&tmp,10);
+                if ( tmp==optarg || !args->nres_max ) error("Could not parse: --sample-sites %s\n", optarg);
+                if ( *tmp )
+                {
+                    if ( *tmp!=',' ) error("Could not parse: --sample-sites %s\n", optarg);
+                    uint64_t seed = strtoull(tmp+1,&tmp,10);
+                    if ( *tmp ) error("Could not parse: --sample-sites %s\n", optarg);
+                    pcg32_srandom_r(&args->rng, seed, 0xda3e39cb94b95bdbULL);
+                }
+                break;
             case 6 : 
                 args->distinctive_sites = strtod(optarg,&tmp);
                 if ( *tmp )
@@ -1128,11 +1665,20 @@ int main_vcfgtcheck(int argc, char *argv[])
     }
     else args->qry_fname = argv[optind];
     if ( argc>optind+1 ) error("Error: too many files given, run with -h for help\n");  // too many files given
+    if ( build_panel_fname )
+    {
+        build_panel(args, build_panel_fname);
+        free(args->es_max_mem);
+        free(args->cwd);
+        free(args);
+        return 0;
+    }
     if ( args->pair_samples )
     {
         if ( args->gt_samples || args->qry_samples ) error("The -p/-P option cannot be combined with -s/-S\n");
         if ( args->ntop ) error("The --n-matches option cannot be combined with -p/-P\n");
     }
+    if ( args->nres_max && !args->distinctive_sites ) error("The option --sample-sites requires --distinctive-sites\n");
     if ( args->distinctive_sites && !args->pair_samples ) error("The experimental option --distinctive-sites requires -p/-P\n");
     if ( args->hom_only && !args->gt_fname ) error("The option --homs-only requires --genotypes\n");
     if ( args->distinctive_sites && args->use_PLs ) error("The option --distinctive-sites cannot be combined with --error-probability\n");
@@ -1142,7 +1688,7 @@ int main_vcfgtcheck(int argc, char *argv[])
     int ret;
     while ( (ret=bcf_sr_next_line(args->files)) )
     {
-        if ( args->gt_hdr && ret!=2 ) continue;     // not a cross-check mode and lines don't match
+        if ( args->gt_hdr && !args->panel && ret!=2 ) continue;     // not a cross-check mode and lines don't match
 
         // time one record to give the user an estimate with very big files
         struct timeval t0, t1;
@@ -1161,6 +1707,7 @@ int main_vcfgtcheck(int argc, char *argv[])
     }
     if ( !args->dry_run )
     {
+        flush_block(args);
         report(args);
         if ( args->distinctive_sites ) report_distinctive_sites(args);
     }
@@ -34,6 +34,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/kstring.h>
 #include <htslib/bgzf.h>
 #include "bcftools.h"
+#include "regplan.h"
 
 #define BCF_LIDX_SHIFT    14
 
@@ -54,6 +55,7 @@ static void usage(void)
     fprintf(stderr, "Stats options:\n");
     fprintf(stderr, "    -n, --nrecords       print number of records based on existing index file\n");
     fprintf(stderr, "    -s, --stats          print per contig stats based on existing index file\n");
+    fprintf(stderr, "        --plan INT       split the records into INT balanced chunks of regions, based on existing index file\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -121,9 +123,20 @@ int vcf_index_stats(char *fname, int stats)
     return 0;
 }
 
+int vcf_index_plan(char *fname, int nchunk)
+{
+    int i, n;
+    regplan_chunk_t *chunks = regplan_vcf(fname, nchunk, &n);
+    if ( !chunks ) { fprintf(stderr,"Could not plan the chunks, is the file indexed? %s\n", fname); return 1; }
+    for (i=0; i<n; i++)
+        printf("%d\t%" PRIu64 "\t%s\n", i, chunks[i].nrec, chunks[i].regions);
+    regplan_destroy(chunks, n);
+    return 0;
+}
+
 int main_vcfindex(int argc, char *argv[])
 {
-    int c, force = 0, tbi = 0, stats = 0, n_threads = 0;
+    int c, force = 0, tbi = 0, stats = 0, n_threads = 0, nplan = 0;
     int min_shift = BCF_LIDX_SHIFT;
     char *outfn = NULL;
 
@@ -136,6 +149,7 @@ int main_vcfindex(int argc, char *argv[])
         {"stats",no_argument,NULL,'s'},
         {"nrecords",no_argument,NULL,'n'},
         {"threads",required_argument,NULL,9},
+        {"plan",required_argument,NULL,10},
         {"output-file",required_argument,NULL,'o'},
         {"output",required_argument,NULL,'o'},
         {NULL, 0, NULL, 0}
@@ -159,6 +173,10 @@ int main_vcfindex(int argc, char *argv[])
                 n_threads = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse argument: --threads %s\n", optarg);
                 break;
+            case 10:
+                nplan = strtol(optarg,&tmp,10);
+                if ( *tmp || nplan<=0 ) error("Could not parse argument: --plan %s\n", optarg);
+                break;
             case 'o': outfn = optarg; break;
             default: usage();
         }
@@ -187,6 +205,7 @@ int main_vcfindex(int argc, char *argv[])
     }
     else fname = argv[optind];
     if (stats) return vcf_index_stats(fname, stats);
+    if (nplan) return vcf_index_plan(fname, nplan);
 
     kstring_t idx_fname = {0,0,0};
     if (outfn)
@@ -34,6 +34,7 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/hts_os.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "filter.h"
 
@@ -51,6 +52,7 @@ THE SOFTWARE.  */
 typedef struct
 {
     int isec_op, isec_n, *write, iwrite, nwrite, output_type, n_threads;
+    int read_ahead;                 // BGZF blocks of remote inputs to decompress ahead, see sr_set_readahead()
     int nflt, *flt_logic;
     filter_t **flt;
     char **flt_expr;
@@ -59,6 +61,9 @@ typedef struct
     htsFile **fh_out;
     char **argv, *prefix, *output_fname, **fnames, *write_files, *targets_list, *regions_list;
     char *isec_exact;
+    uint64_t *mask, *exact_mask;    // presence bitmask of the current site and of -n~, one bit per reader
+    int nmask;
+    htsThreadPool tpool;            // shared by all output files
     int argc, record_cmd_line;
 }
 args_t;
@@ -143,19 +148,20 @@ void isec_vcf(args_t *args)
     {
         out_fh = hts_open(args->output_fname? args->output_fname : "-",hts_bcf_wmode(args->output_type));
         if ( out_fh == NULL ) error("Can't write to %s: %s\n", args->output_fname? args->output_fname : "standard output", strerror(errno));
-        if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
+        if ( args->tpool.pool ) hts_set_opt(out_fh, HTS_OPT_THREAD_POOL, &args->tpool);
         if (args->record_cmd_line) bcf_hdr_append_version(files->readers[args->iwrite].header,args->argc,args->argv,"bcftools_isec");
         if ( bcf_hdr_write(out_fh, files->readers[args->iwrite].header)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname?args->output_fname:"standard output");
     }
     if ( !args->nwrite && !out_std && !args->prefix )
         fprintf(stderr,"Note: -w option not given, printing list of sites...\n");
 
-    int n;
-    while ( (n=bcf_sr_next_line(files)) )
+    uint64_t *mask = args->mask;
+    while ( bcf_sr_next_line(files) )
     {
         bcf_sr_t *reader = NULL;
         bcf1_t *line = NULL;
-        int i, ret = 0;
+        int i, n = 0;
+        memset(mask, 0, sizeof(*mask)*args->nmask);
         for (i=0; i<files->nreaders; i++)
         {
             if ( !bcf_sr_has_line(files,i) ) continue;
@@ -168,7 +174,6 @@ void isec_vcf(args_t *args)
                 if ( !pass )
                 {
                     files->has_line[i] = 0;
-                    n--;
                     continue;
                 }
             }
@@ -178,19 +183,19 @@ void isec_vcf(args_t *args)
                 line = files->readers[i].buffer[0];
                 reader = &files->readers[i];
             }
-            ret |= 1<<i;    // this may overflow for many files, but will be used only with two (OP_VENN)
+            mask[i>>6] |= 1ULL<<(i&63);
         }
+        for (i=0; i<args->nmask; i++) n += popcount64(mask[i]);
+        if ( !n ) continue;     // all records were filtered out
 
         switch (args->isec_op)
         {
-            case OP_COMPLEMENT: if ( n!=1 || !bcf_sr_has_line(files,0) ) continue; break;
+            case OP_COMPLEMENT: if ( n!=1 || !(mask[0]&1) ) continue; break;
             case OP_EQUAL: if ( n != args->isec_n ) continue; break;
             case OP_PLUS: if ( n < args->isec_n ) continue; break;
             case OP_MINUS: if ( n > args->isec_n ) continue; break;
             case OP_EXACT:
-                for (i=0; i<files->nreaders; i++)
-                    if ( files->has_line[i] != args->isec_exact[i] ) break;
-                if ( i<files->nreaders ) continue;
+                if ( memcmp(mask, args->exact_mask, sizeof(*mask)*args->nmask) ) continue;
                 break;
         }
 
@@ -217,7 +222,7 @@ void isec_vcf(args_t *args)
             }
             kputc('\t', &str);
             for (i=0; i<files->nreaders; i++)
-                kputc(bcf_sr_has_line(files,i)?'1':'0', &str);
+                kputc(mask[i>>6] & (1ULL<<(i&63)) ? '1':'0', &str);
             kputc('\n', &str);
             if ( fwrite(str.s,sizeof(char),str.l,args->fh_sites)!=str.l )
                 error("[%s] Error: failed to write %d bytes to %s\n", __func__,(int)str.l,args->output_fname ? args->output_fname : "standard output");
@@ -225,7 +230,7 @@ void isec_vcf(args_t *args)
 
         if ( args->prefix )
         {
-            if ( args->isec_op==OP_VENN && ret==3 )
+            if ( args->isec_op==OP_VENN && mask[0]==3 )
             {
                 if ( !args->nwrite || args->write[0] )
                 {
@@ -242,7 +247,7 @@ void isec_vcf(args_t *args)
             {
                 for (i=0; i<files->nreaders; i++)
                 {
-                    if ( !bcf_sr_has_line(files,i) ) continue;
+                    if ( !(mask[i>>6] & (1ULL<<(i&63))) ) continue;
                     if ( args->write && !args->write[i] ) continue;
                     if ( bcf_write1(args->fh_out[i], files->readers[i].header, files->readers[i].buffer[0])!=0 ) error("[%s] Error: cannot write\n", __func__);
                 }
@@ -308,8 +313,21 @@ static void init_data(args_t *args)
             error("The number of files does not match the bitmask: %d vs %s\n", args->files->nreaders,args->isec_exact);
         for (i=0; i<args->files->nreaders; i++)
             if ( args->isec_exact[i]!='0' && args->isec_exact[i]!='1' ) error("Unexpected bitmask: %s\n",args->isec_exact);
+    }
+    args->nmask = (args->files->nreaders + 63) / 64;
+    args->mask  = (uint64_t*) calloc(args->nmask, sizeof(*args->mask));
+    if ( args->isec_op==OP_EXACT )
+    {
+        args->exact_mask = (uint64_t*) calloc(args->nmask, sizeof(*args->exact_mask));
         for (i=0; i<args->files->nreaders; i++)
-            args->isec_exact[i] -= '0';
+            if ( args->isec_exact[i]=='1' ) args->exact_mask[i>>6] |= 1ULL<<(i&63);
+    }
+
+    // One pool compresses the blocks of all output files in parallel. With many output
+    // files this is much cheaper than a separate set of threads for each file.
+    if ( args->n_threads > 0 )
+    {
+        if ( !(args->tpool.pool = hts_tpool_init(args->n_threads)) ) error("Could not initialize threading\n");
     }
 
     // Which files to write: parse the string passed with -w
@@ -358,7 +376,7 @@ static void init_data(args_t *args)
                 open_file(&args->fnames[i], NULL, "%s/%04d.%s", args->prefix, i, suffix); \
                 args->fh_out[i] = hts_open(args->fnames[i], hts_bcf_wmode(args->output_type));  \
                 if ( !args->fh_out[i] ) error("Could not open %s\n", args->fnames[i]); \
-                if ( args->n_threads ) hts_set_threads(args->fh_out[i], args->n_threads); \
+                if ( args->tpool.pool ) hts_set_opt(args->fh_out[i], HTS_OPT_THREAD_POOL, &args->tpool); \
                 if (args->record_cmd_line) bcf_hdr_append_version(args->files->readers[j].header,args->argc,args->argv,"bcftools_isec"); \
                 if ( bcf_hdr_write(args->fh_out[i], args->files->readers[j].header)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->fnames[i]); \
             }
@@ -410,6 +428,14 @@ static void init_data(args_t *args)
         else
             args->fh_sites = stdout;
     }
+
+    // Only the list of sites is printed: unless the filters query FORMAT fields, the
+    // genotypes are not needed and the readers can drop them without parsing
+    int sites_only = !args->prefix && !args->nwrite && !(args->targets_list && args->files->nreaders==1);
+    for (i=0; sites_only && i<args->nflt; i++)
+        if ( args->flt[i] && filter_max_unpack(args->flt[i]) & BCF_UN_FMT ) sites_only = 0;
+    for (i=0; sites_only && i<args->files->nreaders; i++)
+        if ( bcf_hdr_set_samples(args->files->readers[i].header, NULL, 0) < 0 ) error("Failed to drop the samples: %s\n", args->files->readers[i].fname);
 }
 
 static void destroy_data(args_t *args)
@@ -450,6 +476,9 @@ static void destroy_data(args_t *args)
         if ( args->fh_sites ) fclose(args->fh_sites);
         if ( args->write ) free(args->write);
     }
+    free(args->mask);
+    free(args->exact_mask);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
 }
 
 static void usage(void)
@@ -471,6 +500,7 @@ static void usage(void)
     fprintf(stderr, "    -p, --prefix <dir>            if given, subset each of the input files accordingly, see also -w\n");
     fprintf(stderr, "    -r, --regions <region>        restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>     restrict to regions listed in a file\n");
+    fprintf(stderr, "        --read-ahead <int>        number of BGZF blocks of remote (URL) inputs to read ahead, 0 to disable [%d]\n", READAHEAD_NBLOCKS);
     fprintf(stderr, "    -t, --targets <region>        similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>     similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "        --threads <int>           use multithreading with <int> worker threads [0]\n");
@@ -504,6 +534,7 @@ int main_vcfisec(int argc, char *argv[])
     args->output_fname = NULL;
     args->output_type = FT_VCF;
     args->n_threads = 0;
+    args->read_ahead = READAHEAD_NBLOCKS;
     args->record_cmd_line = 1;
     int targets_is_file = 0, regions_is_file = 0;
 
@@ -526,6 +557,7 @@ int main_vcfisec(int argc, char *argv[])
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
         {"no-version",no_argument,NULL,8},
+        {"read-ahead",required_argument,NULL,10},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:p:n:w:t:T:Cf:o:O:i:e:",loptions,NULL)) >= 0) {
@@ -579,6 +611,13 @@ int main_vcfisec(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 :
+                {
+                    char *tmp;
+                    args->read_ahead = strtol(optarg,&tmp,10);
+                    if ( *tmp || args->read_ahead<0 ) error("Could not parse --read-ahead %s, expected a non-negative integer\n", optarg);
+                }
+                break;
             case 'h':
             case '?': usage(); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -600,6 +639,7 @@ int main_vcfisec(int argc, char *argv[])
         if ( !args->isec_op ) error("One of the options --complement, --nfiles or --targets must be given with more than two files\n");
     }
     args->files->require_index = 1;
+    if ( sr_set_readahead(args->files, argv+optind, argc-optind, args->read_ahead)<0 ) error("Failed to create threads\n");
     while (optind<argc)
     {
         if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open %s: %s\n", argv[optind],bcf_sr_strerror(args->files->errnum));
@@ -34,11 +34,13 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/faidx.h>
+#include <htslib/thread_pool.h>
 #include <math.h>
 #include <ctype.h>
 #include <time.h>
 #include "bcftools.h"
 #include "regidx.h"
+#include "regplan.h"
 #include "vcmp.h"
 
 #define DBG 0
@@ -144,6 +146,12 @@ typedef struct
     regitr_t *regs_itr;
     int header_only, collapse, output_type, force_samples, merge_by_id, do_gvcf, filter_logic, missing_to_ref;
     char *header_fname, *output_fname, *regions_list, *info_rules, *file_list;
+    char *gvcf_fname, *tmp_dir, *apply_filters;
+    int split_contigs;  // merge groups of contigs in parallel, see merge_split()
+    int fan_in, regions_is_file;    // merge at most fan_in files at once, see merge_tree()
+    int buffer_stats;               // report the maximum number of buffered records and bytes per reader
+    int *buf_nrec_max;
+    size_t *buf_size_max;
     faidx_t *gvcf_fai;
     info_rule_t *rules;
     int nrules;
@@ -155,6 +163,8 @@ typedef struct
     bcf_hdr_t *out_hdr;
     char **argv;
     int argc, n_threads, record_cmd_line;
+    int read_ahead;     // BGZF blocks of remote inputs to decompress ahead, see sr_set_readahead()
+    profile_t prof;
 }
 args_t;
 
@@ -166,21 +176,28 @@ static bcf1_t *maux_get_line(args_t *args, int i)
     return NULL;
 }
 
+#define INT32_IS_MISSING(x) ((x)==bcf_int32_missing)
+
+/*
+    The values of all blocks are reduced into the first block in a single pass
+    over rule->vals, missing values are skipped.
+*/
 static void info_rules_merge_sum(bcf_hdr_t *hdr, bcf1_t *line, info_rule_t *rule)
 {
     if ( !rule->nvals ) return;
     int i, j, ndim = rule->block_size;
     #define BRANCH(type_t,is_missing) { \
         type_t *ptr = (type_t*) rule->vals; \
-        for (i=0; i<rule->nvals; i++) if ( is_missing ) ptr[i] = 0; \
+        for (j=0; j<ndim; j++) if ( is_missing(ptr[j]) ) ptr[j] = 0; \
         for (i=1; i<rule->nblocks; i++) \
         { \
-            for (j=0; j<ndim; j++) ptr[j] += ptr[j+i*ndim]; \
+            type_t *src = ptr + i*ndim; \
+            for (j=0; j<ndim; j++) if ( !is_missing(src[j]) ) ptr[j] += src[j]; \
         } \
     }
     switch (rule->type) {
-        case BCF_HT_INT:  BRANCH(int32_t, ptr[i]==bcf_int32_missing); break;
-        case BCF_HT_REAL: BRANCH(float, bcf_float_is_missing(ptr[i])); break;
+        case BCF_HT_INT:  BRANCH(int32_t, INT32_IS_MISSING); break;
+        case BCF_HT_REAL: BRANCH(float, bcf_float_is_missing); break;
         default: error("TODO: %s:%d .. type=%d\n", __FILE__,__LINE__, rule->type);
     }
     #undef BRANCH
@@ -193,67 +210,59 @@ static void info_rules_merge_avg(bcf_hdr_t *hdr, bcf1_t *line, info_rule_t *rule
     int i, j, ndim = rule->block_size;
     #define BRANCH(type_t,is_missing) { \
         type_t *ptr = (type_t*) rule->vals; \
-        for (i=0; i<rule->nvals; i++) if ( is_missing ) ptr[i] = 0; \
         for (j=0; j<ndim; j++) \
         { \
             double sum = 0; \
-            for (i=0; i<rule->nblocks; i++) sum += ptr[j+i*ndim]; \
+            for (i=0; i<rule->nblocks; i++) \
+            { \
+                type_t val = ptr[j+i*ndim]; \
+                if ( !is_missing(val) ) sum += val; \
+            } \
             ptr[j] = sum / rule->nblocks; \
         } \
     }
     switch (rule->type) {
-        case BCF_HT_INT:  BRANCH(int32_t, ptr[i]==bcf_int32_missing); break;
-        case BCF_HT_REAL: BRANCH(float, bcf_float_is_missing(ptr[i])); break;
+        case BCF_HT_INT:  BRANCH(int32_t, INT32_IS_MISSING); break;
+        case BCF_HT_REAL: BRANCH(float, bcf_float_is_missing); break;
         default: error("TODO: %s:%d .. type=%d\n", __FILE__,__LINE__, rule->type);
     }
     #undef BRANCH
 
     bcf_update_info(hdr,line,rule->hdr_tag,rule->vals,ndim,rule->type);
 }
+// The first block is kept missing only if all blocks are missing
+#define INFO_RULES_MINMAX(type_t,is_missing,cmp) { \
+    type_t *ptr = (type_t*) rule->vals; \
+    for (i=1; i<rule->nblocks; i++) \
+    { \
+        type_t *src = ptr + i*ndim; \
+        for (j=0; j<ndim; j++) \
+            if ( !is_missing(src[j]) && (is_missing(ptr[j]) || src[j] cmp ptr[j]) ) ptr[j] = src[j]; \
+    } \
+}
 static void info_rules_merge_min(bcf_hdr_t *hdr, bcf1_t *line, info_rule_t *rule)
 {
     if ( !rule->nvals ) return;
     int i, j, ndim = rule->block_size;
-    #define BRANCH(type_t,is_missing,set_missing,huge_val) { \
-        type_t *ptr = (type_t*) rule->vals; \
-        for (i=0; i<rule->nvals; i++) if ( is_missing ) ptr[i] = huge_val; \
-        for (i=1; i<rule->nblocks; i++) \
-        { \
-            for (j=0; j<ndim; j++) if ( ptr[j] > ptr[j+i*ndim] ) ptr[j] = ptr[j+i*ndim]; \
-        } \
-        for (i=0; i<rule->nvals; i++) if ( ptr[i]==huge_val ) set_missing; \
-    }
     switch (rule->type) {
-        case BCF_HT_INT:  BRANCH(int32_t, ptr[i]==bcf_int32_missing, ptr[i]=bcf_int32_missing, INT32_MAX); break;
-        case BCF_HT_REAL: BRANCH(float, bcf_float_is_missing(ptr[i]), bcf_float_set_missing(ptr[i]), HUGE_VAL); break;
+        case BCF_HT_INT:  INFO_RULES_MINMAX(int32_t, INT32_IS_MISSING, <); break;
+        case BCF_HT_REAL: INFO_RULES_MINMAX(float, bcf_float_is_missing, <); break;
         default: error("TODO: %s:%d .. type=%d\n", __FILE__,__LINE__, rule->type);
     }
-    #undef BRANCH
-
     bcf_update_info(hdr,line,rule->hdr_tag,rule->vals,ndim,rule->type);
 }
 static void info_rules_merge_max(bcf_hdr_t *hdr, bcf1_t *line, info_rule_t *rule)
 {
     if ( !rule->nvals ) return;
     int i, j, ndim = rule->block_size;
-    #define BRANCH(type_t,is_missing,set_missing,huge_val) { \
-        type_t *ptr = (type_t*) rule->vals; \
-        for (i=0; i<rule->nvals; i++) if ( is_missing ) ptr[i] = huge_val; \
-        for (i=1; i<rule->nblocks; i++) \
-        { \
-            for (j=0; j<ndim; j++) if ( ptr[j] < ptr[j+i*ndim] ) ptr[j] = ptr[j+i*ndim]; \
-        } \
-        for (i=0; i<rule->nvals; i++) if ( ptr[i]==huge_val ) set_missing; \
-    }
     switch (rule->type) {
-        case BCF_HT_INT:  BRANCH(int32_t, ptr[i]==bcf_int32_missing, ptr[i]=bcf_int32_missing, INT32_MIN); break;
-        case BCF_HT_REAL: BRANCH(float, bcf_float_is_missing(ptr[i]), bcf_float_set_missing(ptr[i]), -HUGE_VAL); break;
+        case BCF_HT_INT:  INFO_RULES_MINMAX(int32_t, INT32_IS_MISSING, >); break;
+        case BCF_HT_REAL: INFO_RULES_MINMAX(float, bcf_float_is_missing, >); break;
         default: error("TODO: %s:%d .. type=%d\n", __FILE__,__LINE__, rule->type);
     }
-    #undef BRANCH
-
     bcf_update_info(hdr,line,rule->hdr_tag,rule->vals,ndim,rule->type);
 }
+#undef INFO_RULES_MINMAX
 static void info_rules_merge_join(bcf_hdr_t *hdr, bcf1_t *line, info_rule_t *rule)
 {
     if ( !rule->nvals ) return;
@@ -497,12 +506,13 @@ static int info_rules_add_values(args_t *args, bcf_hdr_t *hdr, bcf1_t *line, inf
 
 int bcf_hdr_sync(bcf_hdr_t *h);
 
-void merge_headers(bcf_hdr_t *hw, const bcf_hdr_t *hr, const char *clash_prefix, int force_samples)
+void merge_headers(bcf_hdr_t *hw, const bcf_hdr_t *hr)
 {
-    // header lines
-    hw = bcf_hdr_merge(hw, hr);
+    if ( !bcf_hdr_merge(hw, hr) ) error("[%s] Error: failed to merge the headers\n", __func__);
+}
 
-    // samples
+void merge_samples(bcf_hdr_t *hw, const bcf_hdr_t *hr, const char *clash_prefix, int force_samples)
+{
     int i;
     for (i=0; i<bcf_hdr_nsamples(hr); i++)
     {
@@ -549,7 +559,7 @@ void normalize_alleles(char **als, int nals)
     if ( !als[0][1] ) return;   // ref is 1base long, we're done
 
     int j, i = 1, done = 0;
-    int *lens = (int*) malloc(sizeof(int)*nals);
+    int lens_buf[16], *lens = nals<=16 ? lens_buf : (int*) malloc(sizeof(int)*nals);
     for (j=0; j<nals; j++) lens[j] = strlen(als[j]);
 
     while ( i<lens[0] )
@@ -568,7 +578,7 @@ void normalize_alleles(char **als, int nals)
         als[0][lens[0]-i] = 0;
         for (j=1; j<nals; j++) als[j][lens[j]-i] = 0;
     }
-    free(lens);
+    if ( lens!=lens_buf ) free(lens);
 }
 
  /**
@@ -591,6 +601,15 @@ void normalize_alleles(char **als, int nals)
  * Here the mapping from the original $a alleles to the new $b alleles is 0->0,
  * 1->2, and 2->3.
  */
+// Case-insensitive comparison of the allele $b and the concatenation of $a and $sfx
+static inline int allele_eq_sfx(const char *b, const char *a, const char *sfx)
+{
+    while ( *a && *b && toupper(*a)==toupper(*b) ) { a++; b++; }
+    if ( *a ) return 0;
+    while ( *sfx && *b && toupper(*sfx)==toupper(*b) ) { sfx++; b++; }
+    return !*sfx && !*b ? 1 : 0;
+}
+
 char **merge_alleles(char **a, int na, int *map, char **b, int *nb, int *mb)
 {
     // reference allele never changes
@@ -644,34 +663,31 @@ char **merge_alleles(char **a, int na, int *map, char **b, int *nb, int *mb)
         }
     }
 
-    // now check if the $a alleles are present and if not add them
+    // now check if the $a alleles are present and if not add them. The
+    // expanded $a alleles are compared in place, a copy is made only for
+    // new alleles
     for (i=1; i<na; i++)
     {
-        int const_ai = 1;
-        char *ai;
-        if ( rlb>rla && a[i][0]!='<' && a[i][0]!='*' )  // $a alleles need expanding and not a symbolic allele or *
-        {
-            int l = strlen(a[i]);
-            ai = (char*) malloc(l+rlb-rla+1);
-            memcpy(ai,a[i],l);
-            memcpy(ai+l,b[0]+rla,rlb-rla+1);
-            const_ai = 0;
-        }
-        else
-            ai = a[i];
-
+        const char *sfx = rlb>rla && a[i][0]!='<' && a[i][0]!='*' ? b[0]+rla : "";  // $a alleles need expanding and not a symbolic allele or *
         for (j=1; j<*nb; j++)
-            if ( !strcasecmp(ai,b[j]) ) break;
+            if ( allele_eq_sfx(b[j],a[i],sfx) ) break;
 
         if ( j<*nb ) // $b already has the same allele
         {
             map[i] = j;
-            if ( !const_ai ) free(ai);
             continue;
         }
         // new allele
         map[i] = *nb;
-        b[*nb] = const_ai ? strdup(ai) : ai;
+        if ( *sfx )
+        {
+            int l = strlen(a[i]), ls = rlb-rla;
+            b[*nb] = (char*) malloc(l+ls+1);
+            memcpy(b[*nb],a[i],l);
+            memcpy(b[*nb]+l,sfx,ls+1);
+        }
+        else
+            b[*nb] = strdup(a[i]);
         (*nb)++;
     }
     return b;
@@ -1658,6 +1674,23 @@ void merge_format_field(args_t *args, bcf_fmt_t **fmt_map, bcf1_t *out)
             if ( (length!=BCF_VL_G && length!=BCF_VL_A && length!=BCF_VL_R) || (line->n_allele==out->n_allele && !ma->buf[i].rec[irec].als_differ) ) \
             { \
                 /* alleles unchanged, copy over */ \
+                if ( sizeof(src_type_t)==sizeof(tgt_type_t) ) \
+                { \
+                    /* same binary representation of missing and vector_end values, copy in bulk */ \
+                    if ( fmt_ori->n==nsize ) \
+                        memcpy(tgt, src, sizeof(tgt_type_t)*nsize*bcf_hdr_nsamples(hdr)); \
+                    else \
+                    { \
+                        for (j=0; j<bcf_hdr_nsamples(hdr); j++) \
+                        { \
+                            memcpy(tgt, src, sizeof(tgt_type_t)*fmt_ori->n); \
+                            tgt += fmt_ori->n; src += fmt_ori->n; \
+                            for (k=fmt_ori->n; k<nsize; k++) { tgt_set_vector_end; tgt++; } \
+                        } \
+                    } \
+                    ismpl += bcf_hdr_nsamples(hdr); \
+                    continue; \
+                } \
                 for (j=0; j<bcf_hdr_nsamples(hdr); j++) \
                 { \
                     for (l=0; l<fmt_ori->n; l++) \
@@ -1847,6 +1880,15 @@ void merge_format(args_t *args, bcf1_t *out)
     out->d.indiv_dirty = 1;
 }
 
+static inline int gvcf_same_alleles(bcf1_t *line, char **als, int nals)
+{
+    if ( line->n_allele!=nals ) return 0;
+    int i;
+    for (i=0; i<nals; i++)
+        if ( strcmp(line->d.allele[i],als[i]) ) return 0;
+    return 1;
+}
+
 void gvcf_set_alleles(args_t *args)
 {
     int i,k;
@@ -1880,6 +1922,11 @@ void gvcf_set_alleles(args_t *args)
                 maux->buf[i].rec[irec].map[k] = k;
             }
         }
+        else if ( gvcf_same_alleles(line, maux->als, maux->nals) )
+        {
+            // the most common case in reference blocks, typically REF,<*>
+            for (k=0; k<maux->nals; k++) maux->buf[i].rec[irec].map[k] = k;
+        }
         else
         {
             maux->als = merge_alleles(line->d.allele, line->n_allele, maux->buf[i].rec[irec].map, maux->als, &maux->nals, &maux->mals);
@@ -1962,7 +2009,10 @@ void gvcf_write_block(args_t *args, int start, int end)
     }
     else
         bcf_update_info_int32(args->out_hdr, out, "END", NULL, 0);
+    profile_lap(&args->prof, PROF_PROCESS);
     if ( bcf_write1(args->out_fh, args->out_hdr, out)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    profile_lap(&args->prof, PROF_WRITE);
+    args->prof.nrec_out++;
     bcf_clear1(out);
 
 
@@ -2140,6 +2190,19 @@ void gvcf_stage(args_t *args, int pos)
 }
 
 
+#define MAX_SPARE_SIZE (1<<20)  // spare records holding more memory are released, see clean_buffer()
+
+static void update_buffer_stats(args_t *args, int ir)
+{
+    bcf_sr_t *reader = bcf_sr_get_reader(args->files,ir);
+    size_t size = 0;
+    int i;
+    for (i=1; i<=reader->nbuffer; i++)
+        size += reader->buffer[i]->shared.l + reader->buffer[i]->indiv.l;
+    if ( args->buf_nrec_max[ir] < reader->nbuffer ) args->buf_nrec_max[ir] = reader->nbuffer;
+    if ( args->buf_size_max[ir] < size ) args->buf_size_max[ir] = size;
+}
+
 void debug_buffers(FILE *fp, bcf_srs_t *files);
 void debug_buffer(FILE *fp, bcf_srs_t *files, int reader);
 
@@ -2171,6 +2234,7 @@ void clean_buffer(args_t *args)
         if ( !reader->nbuffer ) continue;   // nothing to clean
 
         bcf1_t **buf = reader->buffer;
+        if ( args->buffer_stats ) update_buffer_stats(args, ir);
         if ( buf[1]->rid!=ma->buf[ir].rid || buf[1]->pos!=ma->pos ) continue;    // nothing to flush
 
         int a = 1, b = 2;
@@ -2182,6 +2246,15 @@ void clean_buffer(args_t *args)
             a++; b++;
         }
         reader->nbuffer -= b-a;
+
+        // Release the memory held by spare records after a dense cluster of
+        // large records at a single position, otherwise it is kept until the end
+        for (a=reader->nbuffer+1; a<reader->mbuffer; a++)
+        {
+            if ( buf[a]->shared.m + buf[a]->indiv.m < MAX_SPARE_SIZE ) continue;
+            bcf_destroy1(buf[a]);
+            buf[a] = bcf_init1();
+        }
     }
 }
 
@@ -2481,7 +2554,10 @@ void merge_line(args_t *args)
     if ( args->do_gvcf )
         bcf_update_info_int32(args->out_hdr, out, "END", NULL, 0);
     merge_format(args, out);
+    profile_lap(&args->prof, PROF_PROCESS);
     if ( bcf_write1(args->out_fh, args->out_hdr, out)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    profile_lap(&args->prof, PROF_WRITE);
+    args->prof.nrec_out++;
     bcf_clear1(out);
 }
 
@@ -2523,6 +2599,182 @@ void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *c
     error_errno("[%s] Failed to add program information to header", __func__);
 }
 
+// Merge all records of args->files and write them to args->out_fh
+static void merge_records(args_t *args)
+{
+    if ( args->collapse==COLLAPSE_NONE ) args->vcmp = vcmp_init();
+    args->maux = maux_init(args);
+    args->out_line = bcf_init1();
+    args->tmph = kh_init(strdict);
+    if ( args->buffer_stats )
+    {
+        args->buf_nrec_max = (int*) calloc(args->files->nreaders, sizeof(*args->buf_nrec_max));
+        args->buf_size_max = (size_t*) calloc(args->files->nreaders, sizeof(*args->buf_size_max));
+    }
+
+    args->prof.nsmpl = bcf_hdr_nsamples(args->out_hdr);
+    profile_mark(&args->prof);
+    while ( bcf_sr_next_line(args->files) )
+    {
+        profile_lap(&args->prof, PROF_READ);
+        args->prof.nrec_in++;
+
+        // output cached gVCF blocks which end before the new record
+        if ( args->do_gvcf )
+            gvcf_flush(args,0);
+
+        maux_reset(args->maux);
+
+        // determine which of the new records are gvcf blocks
+        if ( args->do_gvcf )
+            gvcf_stage(args, args->maux->pos);
+
+        while ( can_merge(args) )
+        {
+            stage_line(args);
+            merge_line(args);
+        }
+        clean_buffer(args);
+        // debug_state(args);
+        profile_lap(&args->prof, PROF_PROCESS);
+    }
+    profile_lap(&args->prof, PROF_READ);
+    if ( args->do_gvcf )
+        gvcf_flush(args,1);
+
+    if ( args->buffer_stats )
+    {
+        int i;
+        fprintf(stderr,"# BUF, maximum number of records and bytes buffered at a single position\n");
+        fprintf(stderr,"# BUF\t[2]File\t[3]Records\t[4]Bytes\n");
+        for (i=0; i<args->files->nreaders; i++)
+            fprintf(stderr,"BUF\t%s\t%d\t%zu\n", args->files->readers[i].fname,args->buf_nrec_max[i],args->buf_size_max[i]);
+        free(args->buf_nrec_max);
+        free(args->buf_size_max);
+    }
+    maux_destroy(args->maux);
+    bcf_destroy1(args->out_line);
+    kh_destroy(strdict, args->tmph);
+    if ( args->tmps.m ) free(args->tmps.s);
+    if ( args->vcmp ) vcmp_destroy(args->vcmp);
+}
+
+/*
+    Parallel merge: the contigs are split into groups of about the same number
+    of records, as given by the indexes, and each group is merged by a worker
+    thread with its own synced reader into a temporary BCF. The main thread
+    copies the temporary files to the output in the original order of contigs,
+    therefore the output is identical to a serial run. gVCF blocks are always
+    flushed at the end of a contig, so no block spans two groups.
+*/
+typedef struct
+{
+    args_t *args;
+    char *regions;      // comma-separated list of contigs
+    char *fname;        // temporary output file
+}
+merge_chunk_t;
+
+static void *merge_chunk(void *arg)
+{
+    merge_chunk_t *chunk = (merge_chunk_t*) arg;
+    args_t *main_args = chunk->args;
+    args_t args = *main_args;
+    int i;
+
+    args.files = bcf_sr_init();
+    args.files->require_index = 1;
+    args.files->apply_filters = main_args->files->apply_filters;
+    if ( bcf_sr_set_regions(args.files, chunk->regions, 0)<0 ) error("Failed to set the regions: %s\n", chunk->regions);
+    for (i=0; i<main_args->files->nreaders; i++)
+    {
+        const char *fname = main_args->files->readers[i].fname;
+        if ( !bcf_sr_add_reader(args.files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args.files->errnum));
+    }
+    if ( main_args->gvcf_fname )
+    {
+        args.gvcf_fai = fai_load(main_args->gvcf_fname);
+        if ( !args.gvcf_fai ) error("Failed to load the fai index: %s\n", main_args->gvcf_fname);
+    }
+    args.out_fh = hts_open(chunk->fname, "wbu");
+    if ( !args.out_fh ) error("Can't write to \"%s\": %s\n", chunk->fname, strerror(errno));
+    if ( bcf_hdr_write(args.out_fh, args.out_hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,chunk->fname);
+    args.output_fname = chunk->fname;
+    args.rules  = NULL;
+    args.nrules = 0;
+    args.tmps.s = NULL; args.tmps.l = args.tmps.m = 0;
+    args.vcmp = NULL;
+    args.buffer_stats = 0;  // the statistics are collected in serial merges only
+    args.prof.format  = 0;  // and so is the profile
+    info_rules_init(&args);
+
+    merge_records(&args);
+
+    info_rules_destroy(&args);
+    if ( hts_close(args.out_fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->fname);
+    if ( args.gvcf_fai ) fai_destroy(args.gvcf_fai);
+    bcf_sr_destroy(args.files);
+    return chunk;
+}
+
+static void merge_split(args_t *args)
+{
+    // consecutive groups of contigs with similar number of records, empty contigs are skipped
+    int i, nchunks;
+    regplan_chunk_t *plan = regplan_contigs(args->files, 4*args->n_threads, &nchunks);
+    if ( !plan ) return;
+
+    char *tmp_dir = args->tmp_dir;
+    args->tmp_dir = regplan_tmpdir(tmp_dir, "/tmp/bcftools-merge.XXXXXX");
+    merge_chunk_t *chunks = (merge_chunk_t*) calloc(nchunks, sizeof(merge_chunk_t));
+    kstring_t str = {0,0,0};
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].args = args;
+        chunks[i].regions = plan[i].regions;
+        str.l = 0;
+        ksprintf(&str, "%s/%05d.bcf", args->tmp_dir, i);
+        chunks[i].fname = strdup(str.s);
+    }
+    free(str.s);
+
+    hts_tpool *pool = hts_tpool_init(args->n_threads);
+    if ( !pool ) error("Failed to initialize %d threads\n", args->n_threads);
+    hts_tpool_process *queue = hts_tpool_process_init(pool, nchunks, 0);
+    for (i=0; i<nchunks; i++)
+        if ( hts_tpool_dispatch(pool, queue, merge_chunk, &chunks[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+
+    // copy the merged chunks to the output in order
+    bcf1_t *rec = bcf_init1();
+    for (i=0; i<nchunks; i++)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        merge_chunk_t *chunk = (merge_chunk_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        htsFile *fh = hts_open(chunk->fname, "r");
+        if ( !fh ) error("Could not read %s: %s\n", chunk->fname, strerror(errno));
+        bcf_hdr_t *hdr = bcf_hdr_read(fh);
+        if ( !hdr ) error("Could not read the header of %s\n", chunk->fname);
+        int ret;
+        while ( (ret=bcf_read(fh, hdr, rec))==0 )
+            if ( bcf_write1(args->out_fh, args->out_hdr, rec)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+        if ( ret < -1 ) error("Error reading %s\n", chunk->fname);
+        bcf_hdr_destroy(hdr);
+        if ( hts_close(fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->fname);
+        unlink(chunk->fname);
+        free(chunk->fname);
+    }
+    bcf_destroy1(rec);
+    hts_tpool_process_destroy(queue);
+    hts_tpool_destroy(pool);
+    free(chunks);
+    regplan_destroy(plan, nchunks);
+    regplan_tmpdir_destroy(args->tmp_dir);
+    args->tmp_dir = tmp_dir;
+}
+
 void merge_vcf(args_t *args)
 {
     args->out_fh  = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
@@ -2536,11 +2788,17 @@ void merge_vcf(args_t *args)
     }
     else
     {
+        // All header lines are merged before any sample is added. bcf_hdr_merge() syncs the header
+        // whenever a new line is added, and the cost of the sync grows with the number of samples,
+        // which made the startup quadratic with many single-sample inputs. The samples are then
+        // added in bulk and the header is synced only once below.
         int i;
+        for (i=0; i<args->files->nreaders; i++)
+            merge_headers(args->out_hdr, args->files->readers[i].header);
         for (i=0; i<args->files->nreaders; i++)
         {
             char buf[24]; snprintf(buf,sizeof buf,"%d",i+1);
-            merge_headers(args->out_hdr, args->files->readers[i].header,buf,args->force_samples);
+            merge_samples(args->out_hdr, args->files->readers[i].header,buf,args->force_samples);
         }
         if (args->record_cmd_line) bcf_hdr_append_version(args->out_hdr, args->argc, args->argv, "bcftools_merge");
         if (bcf_hdr_sync(args->out_hdr) < 0)
@@ -2557,42 +2815,103 @@ void merge_vcf(args_t *args)
         return;
     }
 
-    if ( args->collapse==COLLAPSE_NONE ) args->vcmp = vcmp_init();
-    args->maux = maux_init(args);
-    args->out_line = bcf_init1();
-    args->tmph = kh_init(strdict);
+    if ( args->split_contigs )
+        merge_split(args);
+    else
+        merge_records(args);
 
-    while ( bcf_sr_next_line(args->files) )
-    {
-        // output cached gVCF blocks which end before the new record
-        if ( args->do_gvcf )
-            gvcf_flush(args,0);
+    info_rules_destroy(args);
+    bcf_hdr_destroy(args->out_hdr);
+    if ( hts_close(args->out_fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->output_fname);
+}
 
-        maux_reset(args->maux);
+static void init_readers(args_t *args, char **fnames, int nfnames)
+{
+    int i;
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->apply_filters = args->apply_filters;
+    if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
+        error("Failed to read the regions: %s\n", args->regions_list);
+    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
+    if ( sr_set_readahead(args->files, fnames, nfnames, args->read_ahead)<0 ) error("Failed to create threads\n");
+    for (i=0; i<nfnames; i++)
+        if ( !bcf_sr_add_reader(args->files, fnames[i]) ) error("Failed to open %s: %s\n", fnames[i],bcf_sr_strerror(args->files->errnum));
+}
 
-        // determine which of the new records are gvcf blocks
-        if ( args->do_gvcf )
-            gvcf_stage(args, args->maux->pos);
+// Remove a temporary file created by merge_tree() and its index, input files are left untouched
+static void remove_tmp_file(args_t *args, const char *fname)
+{
+    size_t len = strlen(args->tmp_dir);
+    if ( strncmp(fname,args->tmp_dir,len) || fname[len]!='/' ) return;
+    unlink(fname);
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.csi", fname);
+    unlink(str.s);
+    free(str.s);
+}
 
-        while ( can_merge(args) )
+/*
+    Tree merge: when there are more than args->fan_in input files, groups of
+    fan_in consecutive files are merged into temporary indexed BCFs, which are
+    then merged again, until the number of files is small enough for the final
+    merge. Only fan_in files are open at any time. The files are kept in the
+    original order, so the alleles and samples come out in the same order as
+    with a single merge. Returns the list of files to merge, the temporary
+    files of the last level are removed by the caller.
+*/
+static char **merge_tree(args_t *args, char **fnames, int *nfnames)
+{
+    int i, j, level = 0, n = *nfnames;
+    kstring_t str = {0,0,0};
+    char **tmp = NULL;
+    args->tmp_dir = regplan_tmpdir(args->tmp_dir, "/tmp/bcftools-merge.XXXXXX");
+    while ( n > args->fan_in )
+    {
+        int ntmp = (n + args->fan_in - 1) / args->fan_in;
+        char **out = (char**) malloc(sizeof(*out)*ntmp);
+        for (i=0; i<ntmp; i++)
+        {
+            int ibeg = i*args->fan_in, nin = n - ibeg < args->fan_in ? n - ibeg : args->fan_in;
+            str.l = 0;
+            ksprintf(&str, "%s/%d.%05d.bcf", args->tmp_dir, level, i);
+            out[i] = strdup(str.s);
+            if ( nin==1 )
+            {
+                // a single leftover file is passed to the next level as it is
+                free(out[i]);
+                out[i] = strdup(fnames[ibeg]);
+                continue;
+            }
+
+            // intermediate files get plain merged headers, the user header and
+            // the command line are applied in the final merge only
+            args_t targs = *args;
+            targs.output_fname  = out[i];
+            targs.output_type   = FT_BCF_GZ;
+            targs.header_fname  = NULL;
+            targs.record_cmd_line = 0;
+            targs.split_contigs = 0;
+            targs.prof.format   = 0;
+            init_readers(&targs, fnames + ibeg, nin);
+            merge_vcf(&targs);
+            bcf_sr_destroy(targs.files);
+            if ( bcf_index_build(out[i], 14)!=0 ) error("Failed to index %s\n", out[i]);
+
+            for (j=ibeg; j<ibeg+nin; j++) remove_tmp_file(args, fnames[j]);
+        }
+        if ( tmp )
         {
-            stage_line(args);
-            merge_line(args);
+            for (i=0; i<n; i++) free(tmp[i]);
+            free(tmp);
         }
-        clean_buffer(args);
-        // debug_state(args);
+        tmp = fnames = out;
+        n = ntmp;
+        level++;
     }
-    if ( args->do_gvcf )
-        gvcf_flush(args,1);
-
-    info_rules_destroy(args);
-    maux_destroy(args->maux);
-    bcf_hdr_destroy(args->out_hdr);
-    if ( hts_close(args->out_fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->output_fname);
-    bcf_destroy1(args->out_line);
-    kh_destroy(strdict, args->tmph);
-    if ( args->tmps.m ) free(args->tmps.s);
-    if ( args->vcmp ) vcmp_destroy(args->vcmp);
+    free(str.s);
+    *nfnames = n;
+    return tmp;
 }
 
 static void usage(void)
@@ -2617,8 +2936,14 @@ static void usage(void)
     fprintf(stderr, "        --no-version                   do not append version and command line to the header\n");
     fprintf(stderr, "    -o, --output <file>                write output to a file [standard output]\n");
     fprintf(stderr, "    -O, --output-type <b|u|z|v>        'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
+    fprintf(stderr, "        --profile[=json]               print time spent in reading, merging and writing to stderr\n");
+    fprintf(stderr, "        --read-ahead <int>             number of BGZF blocks of remote (URL) inputs to read ahead, 0 to disable [%d]\n", READAHEAD_NBLOCKS);
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
+    fprintf(stderr, "        --buffer-stats                 print the maximum number of records and bytes buffered per input file to stderr\n");
+    fprintf(stderr, "        --fan-in <int>                 merge at most <int> files at once via temporary files\n");
+    fprintf(stderr, "        --split-contigs                merge groups of contigs in parallel, requires --threads\n");
+    fprintf(stderr, "        --temp-dir <dir>               temporary files with --fan-in and --split-contigs [/tmp/bcftools-merge.XXXXXX]\n");
     fprintf(stderr, "        --threads <int>                use multithreading with <int> worker threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
@@ -2626,16 +2951,16 @@ static void usage(void)
 
 int main_vcfmerge(int argc, char *argv[])
 {
-    int c;
+    int c, i;
+    char *tmp;
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
-    args->files  = bcf_sr_init();
     args->argc   = argc; args->argv = argv;
     args->output_fname = "-";
     args->output_type = FT_VCF;
     args->n_threads = 0;
+    args->read_ahead = READAHEAD_NBLOCKS;
     args->record_cmd_line = 1;
     args->collapse = COLLAPSE_BOTH;
-    int regions_is_file = 0;
 
     static struct option loptions[] =
     {
@@ -2651,11 +2976,17 @@ int main_vcfmerge(int argc, char *argv[])
         {"output",required_argument,NULL,'o'},
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
+        {"profile",optional_argument,NULL,10},
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
         {"info-rules",required_argument,NULL,'i'},
         {"no-version",no_argument,NULL,8},
         {"filter-logic",required_argument,NULL,'F'},
+        {"split-contigs",no_argument,NULL,4},
+        {"temp-dir",required_argument,NULL,5},
+        {"fan-in",required_argument,NULL,6},
+        {"buffer-stats",no_argument,NULL,7},
+        {"read-ahead",required_argument,NULL,11},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "hm:f:r:R:o:O:i:l:g:F:0",loptions,NULL)) >= 0) {
@@ -2670,6 +3001,7 @@ int main_vcfmerge(int argc, char *argv[])
                 args->do_gvcf = 1;
                 if ( strcmp("-",optarg) )
                 {
+                    args->gvcf_fname = optarg;
                     args->gvcf_fai = fai_load(optarg);
                     if ( !args->gvcf_fai ) error("Failed to load the fai index: %s\n", optarg);
                 }
@@ -2697,14 +3029,28 @@ int main_vcfmerge(int argc, char *argv[])
                 else if ( !strcmp(optarg,"id") ) { args->collapse = COLLAPSE_NONE; args->merge_by_id = 1; }
                 else error("The -m type \"%s\" is not recognised.\n", optarg);
                 break;
-            case 'f': args->files->apply_filters = optarg; break;
+            case 'f': args->apply_filters = optarg; break;
             case 'r': args->regions_list = optarg; break;
-            case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = 1; break;
             case  1 : args->header_fname = optarg; break;
             case  2 : args->header_only = 1; break;
             case  3 : args->force_samples = 1; break;
+            case  4 : args->split_contigs = 1; break;
+            case  5 : args->tmp_dir = optarg; break;
+            case  6 :
+                args->fan_in = strtol(optarg,&tmp,10);
+                if ( *tmp || args->fan_in<2 ) error("Could not parse --fan-in %s, expected an integer bigger than 1\n", optarg);
+                break;
+            case  7 : args->buffer_stats = 1; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 :
+                if ( profile_init(&args->prof, "merge", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
+            case 11 :
+                args->read_ahead = strtol(optarg,&tmp,10);
+                if ( *tmp || args->read_ahead<0 ) error("Could not parse --read-ahead %s, expected a non-negative integer\n", optarg);
+                break;
             case 'h':
             case '?': usage(); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -2712,13 +3058,15 @@ int main_vcfmerge(int argc, char *argv[])
     }
     if ( argc==optind && !args->file_list ) usage();
     if ( argc-optind<2 && !args->file_list ) usage();
+    if ( args->split_contigs )
+    {
+        if ( args->n_threads<1 ) error("The --split-contigs option requires --threads\n");
+        if ( args->regions_list ) error("The --split-contigs option cannot be combined with -r/-R\n");
+    }
 
-    args->files->require_index = 1;
     if ( args->regions_list )
     {
-        if ( bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
-            error("Failed to read the regions: %s\n", args->regions_list);
-        if ( regions_is_file )
+        if ( args->regions_is_file )
             args->regs = regidx_init(args->regions_list,NULL,NULL,sizeof(char*),NULL);
         else
         {
@@ -2730,24 +3078,38 @@ int main_vcfmerge(int argc, char *argv[])
         args->regs_itr = regitr_init(args->regs);
     }
 
-    if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
-    while (optind<argc)
-    {
-        if ( !bcf_sr_add_reader(args->files, argv[optind]) ) error("Failed to open %s: %s\n", argv[optind],bcf_sr_strerror(args->files->errnum));
-        optind++;
-    }
+    int nfnames = argc - optind;
+    char **fnames = (char**) malloc(sizeof(*fnames)*nfnames);
+    for (i=0; i<nfnames; i++) fnames[i] = strdup(argv[optind+i]);
     if ( args->file_list )
     {
-        int nfiles, i;
+        int nfiles;
         char **files = hts_readlines(args->file_list, &nfiles);
         if ( !files ) error("Failed to read from %s\n", args->file_list);
-        for (i=0;i<nfiles; i++)
-            if ( !bcf_sr_add_reader(args->files, files[i]) ) error("Failed to open %s: %s\n", files[i],bcf_sr_strerror(args->files->errnum));
-        for (i=0; i<nfiles; i++) free(files[i]);
+        fnames = (char**) realloc(fnames, sizeof(*fnames)*(nfnames+nfiles));
+        for (i=0; i<nfiles; i++) fnames[nfnames++] = files[i];
         free(files);
     }
+    char **tmp_fnames = NULL;
+    if ( args->fan_in && nfnames > args->fan_in && !args->header_only )
+    {
+        int norig = nfnames;
+        tmp_fnames = merge_tree(args, fnames, &nfnames);
+        for (i=0; i<norig; i++) free(fnames[i]);
+        free(fnames);
+        fnames = tmp_fnames;
+    }
+    init_readers(args, fnames, nfnames);
     merge_vcf(args);
+    profile_report(&args->prof, stderr);
     bcf_sr_destroy(args->files);
+    for (i=0; i<nfnames; i++)
+    {
+        if ( tmp_fnames ) remove_tmp_file(args, fnames[i]);
+        free(fnames[i]);
+    }
+    free(fnames);
+    if ( tmp_fnames ) regplan_tmpdir_destroy(args->tmp_dir);
     if ( args->regs ) regidx_destroy(args->regs);
     if ( args->regs_itr ) regitr_destroy(args->regs_itr);
     if ( args->gvcf_fai ) fai_destroy(args->gvcf_fai);
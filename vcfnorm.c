@@ -35,16 +35,21 @@ THE SOFTWARE.  */
 #include <inttypes.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
-#include <htslib/faidx.h>
+#include <htslib/hts_endian.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/thread_pool.h>
 #include "bcftools.h"
 #include "rbuf.h"
+#include "refseq.h"
+#include "regplan.h"
 
 #define CHECK_REF_EXIT 1
 #define CHECK_REF_WARN 2
 #define CHECK_REF_SKIP 4
 #define CHECK_REF_FIX  8
 
+#define REF_WIN_MIN (1<<16)    // the minimum length of reference sequence to fetch at once, see fetch_ref()
+
 #define MROWS_SPLIT 1
 #define MROWS_MERGE  2
 
@@ -56,19 +61,15 @@ typedef struct
 }
 map_t;
 
-// primitive comparison of two records' alleles via hashes; normalized alleles assumed
-typedef struct
-{
-    int n;  // number of alleles
-    char *ref, *alt;
-    void *hash;
-}
-cmpals1_t;
-
+// duplicate detection at one position: the records' alleles are reduced to a canonical
+// key (upper-cased REF and sorted ALTs) and looked up in a hash; normalized alleles assumed
 typedef struct
 {
-    cmpals1_t *cmpals;
-    int ncmpals, mcmpals;
+    void *hash;         // canonical allele keys seen at the current position
+    kstring_t *keys;    // storage of the keys, reused at each position change
+    int nkeys, mkeys, mals;
+    char **als;
+    kstring_t tmp;
 }
 cmpals_t;
 
@@ -93,12 +94,17 @@ typedef struct
     bcf_srs_t *files;       // using the synced reader only for -r option
     bcf_hdr_t *hdr;
     cmpals_t cmpals_in, cmpals_out;
-    faidx_t *fai;
+    refseq_t *refseq;
+    struct { int rid, len; } ref_ctg;   // the contig of the last fetch_ref() call and its length
+    kstring_t ref_buf;
     struct { int tot, set, swap; } nref;
     char **argv, *output_fname, *ref_fname, *vcf_fname, *region, *targets;
     int argc, rmdup, output_type, n_threads, check_ref, strict_filter, do_indels;
     int nchanged, nskipped, nsplit, ntotal, mrows_op, mrows_collapse, parsimonious;
     int record_cmd_line, force, force_warned, keep_sum_ad;
+    int split_contigs, targets_is_file; // normalize groups of contigs in parallel, see normalize_split()
+    char *tmp_dir;
+    profile_t prof;
 }
 args_t;
 
@@ -134,6 +140,35 @@ static void seq_to_upper(char *seq, int len)
         for (i=0; seq[i]; i++) seq[i] = nt_to_upper(seq[i]);
 }
 
+/*
+    Returns a copy of the reference sequence beg-end (0-based, inclusive) of
+    the contig rid in args->ref_buf, clamped to the contig like
+    faidx_fetch_seq does. The windows read from the fasta start a bit before
+    so that the left-padding in realign() is served from the same window.
+*/
+static char *fetch_ref(args_t *args, int rid, int beg, int end, int *len)
+{
+    const char *chr = args->hdr->id[BCF_DT_CTG][rid].key;
+    if ( args->ref_ctg.rid!=rid )
+    {
+        args->ref_ctg.rid = rid;
+        args->ref_ctg.len = refseq_seq_len(args->refseq, chr);
+    }
+    if ( args->ref_ctg.len <= 0 ) return NULL;
+    if ( end >= args->ref_ctg.len ) end = args->ref_ctg.len - 1;
+    if ( beg < 0 ) beg = 0;
+    else if ( beg >= args->ref_ctg.len ) beg = args->ref_ctg.len - 1;
+    if ( end < beg ) end = beg;
+
+    hts_pos_t nseq;
+    const char *seq = refseq_fetch(args->refseq, chr, beg, end, &nseq);
+    if ( !seq || nseq < end - beg + 1 ) return NULL;
+    *len = nseq;
+    args->ref_buf.l = 0;
+    kputsn(seq, *len, &args->ref_buf);
+    return args->ref_buf.s;
+}
+
 static void fix_ref(args_t *args, bcf1_t *line)
 {
     int reflen = strlen(line->d.allele[0]);
@@ -144,21 +179,20 @@ static void fix_ref(args_t *args, bcf1_t *line)
         if ( maxlen < len ) maxlen = len;
     }
 
-    char *ref = faidx_fetch_seq(args->fai, (char*)bcf_seqname(args->hdr,line), line->pos, line->pos+maxlen-1, &len);
+    char *ref = fetch_ref(args, line->rid, line->pos, line->pos+maxlen-1, &len);
     if ( !ref ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", bcf_seqname(args->hdr,line),(int64_t) line->pos+1);
     replace_iupac_codes(ref,len);
 
     args->nref.tot++;
 
     // is the REF different?
-    if ( !strncasecmp(line->d.allele[0],ref,reflen) ) { free(ref); return; }
+    if ( !strncasecmp(line->d.allele[0],ref,reflen) ) return;
 
     // is the REF allele missing or N?
     if ( reflen==1 && (line->d.allele[0][0]=='.' || line->d.allele[0][0]=='N' || line->d.allele[0][0]=='n') ) 
     { 
         line->d.allele[0][0] = ref[0]; 
         args->nref.set++; 
-        free(ref);
         bcf_update_alleles(args->hdr,line,(const char**)line->d.allele,line->n_allele);
         return;
     }
@@ -168,7 +202,7 @@ static void fix_ref(args_t *args, bcf1_t *line)
     {
         args->nref.set++;
         bcf_update_alleles(args->hdr,line,(const char**)line->d.allele,line->n_allele);
-        if ( !strncasecmp(line->d.allele[0],ref,reflen) ) { free(ref); return; }
+        if ( !strncasecmp(line->d.allele[0],ref,reflen) ) return;
     }
 
     // is it swapped?
@@ -200,7 +234,6 @@ static void fix_ref(args_t *args, bcf1_t *line)
     }
     else
         args->nref.swap++;
-    free(ref);
 
     // swap the alleles
     int j;
@@ -302,7 +335,7 @@ static int realign(args_t *args, bcf1_t *line)
 
     // Sanity check REF
     int i, nref, reflen = strlen(line->d.allele[0]);
-    char *ref = faidx_fetch_seq(args->fai, (char*)args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos, line->pos+reflen-1, &nref);
+    char *ref = fetch_ref(args, line->rid, line->pos, line->pos+reflen-1, &nref);
     if ( !ref ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", args->hdr->id[BCF_DT_CTG][line->rid].key, (int64_t) line->pos+1);
     seq_to_upper(ref,0);
     replace_iupac_codes(ref,nref);  // any non-ACGT character in fasta ref is replaced with N
@@ -314,7 +347,6 @@ static int realign(args_t *args, bcf1_t *line)
             error("Non-ACGTN reference allele at %s:%"PRId64" .. REF_SEQ:'%s' vs VCF:'%s'\n", bcf_seqname(args->hdr,line),(int64_t) line->pos+1,ref,line->d.allele[0]);
         if ( args->check_ref & CHECK_REF_WARN )
             fprintf(stderr,"NON_ACGTN_REF\t%s\t%"PRId64"\t%s\n", bcf_seqname(args->hdr,line),(int64_t) line->pos+1,line->d.allele[0]);
-        free(ref);
         return ERR_REF_MISMATCH;
     }
     if ( strcasecmp(ref,line->d.allele[0]) )
@@ -323,11 +355,8 @@ static int realign(args_t *args, bcf1_t *line)
             error("Reference allele mismatch at %s:%"PRId64" .. REF_SEQ:'%s' vs VCF:'%s'\n", bcf_seqname(args->hdr,line),(int64_t) line->pos+1,ref,line->d.allele[0]);
         if ( args->check_ref & CHECK_REF_WARN )
             fprintf(stderr,"REF_MISMATCH\t%s\t%"PRId64"\t%s\t%s\n", bcf_seqname(args->hdr,line),(int64_t) line->pos+1,line->d.allele[0],ref);
-        free(ref);
         return ERR_REF_MISMATCH;
     }
-    free(ref);
-    ref = NULL;
 
     if ( line->n_allele == 1 ) // a REF
     {
@@ -386,8 +415,7 @@ static int realign(args_t *args, bcf1_t *line)
         if ( pad_from_left )
         {
             int npad = line->pos >= args->aln_win ? args->aln_win : line->pos;
-            free(ref);
-            ref = faidx_fetch_seq(args->fai, (char*)args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad, line->pos-1, &nref);
+            ref = fetch_ref(args, line->rid, line->pos-npad, line->pos-1, &nref);
             if ( !ref ) error("faidx_fetch_seq failed at %s:%"PRId64"\n", args->hdr->id[BCF_DT_CTG][line->rid].key, (int64_t) line->pos-npad+1);
             replace_iupac_codes(ref,nref);
             for (i=0; i<line->n_allele; i++)
@@ -400,7 +428,6 @@ static int realign(args_t *args, bcf1_t *line)
             line->pos -= npad;
         }
     }
-    free(ref);
 
     // trim from left
     int ntrim_left = 0;
@@ -638,20 +665,64 @@ static void split_info_flag(args_t *args, bcf1_t *src, bcf_info_t *info, int ial
     bcf_update_info_flag(args->hdr,dst,tag,NULL,ret);
 }
 
+/*
+    The FORMAT values are read directly from the source record's buffer,
+    taking only the values needed for the ALT being split off; decoding the
+    whole array with bcf_get_format_*() for every ALT is avoided.
+*/
+static inline int32_t fmt_int32_value(bcf_fmt_t *fmt, int ismpl, int i)
+{
+    uint8_t *ptr = fmt->p + ismpl*fmt->size;
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:
+        {
+            int8_t val = le_to_i8(ptr + i);
+            if ( val==bcf_int8_missing ) return bcf_int32_missing;
+            if ( val==bcf_int8_vector_end ) return bcf_int32_vector_end;
+            return val;
+        }
+        case BCF_BT_INT16:
+        {
+            int16_t val = le_to_i16(ptr + 2*i);
+            if ( val==bcf_int16_missing ) return bcf_int32_missing;
+            if ( val==bcf_int16_vector_end ) return bcf_int32_vector_end;
+            return val;
+        }
+        case BCF_BT_INT32: return le_to_i32(ptr + 4*i);
+        case BCF_BT_FLOAT:
+        {
+            float val = le_to_float(ptr + 4*i);
+            if ( bcf_float_is_missing(val) ) return bcf_int32_missing;
+            if ( bcf_float_is_vector_end(val) ) return bcf_int32_vector_end;
+            return val;
+        }
+    }
+    error("Unexpected type %d\n", fmt->type);
+    return 0;
+}
+static inline float fmt_float_value(bcf_fmt_t *fmt, int ismpl, int i)
+{
+    if ( fmt->type==BCF_BT_FLOAT ) return le_to_float(fmt->p + ismpl*fmt->size + 4*i);
+    int32_t ival = fmt_int32_value(fmt, ismpl, i);
+    float val;
+    if ( ival==bcf_int32_missing ) bcf_float_set_missing(val);
+    else if ( ival==bcf_int32_vector_end ) bcf_float_set_vector_end(val);
+    else val = ival;
+    return val;
+}
 static void split_format_genotype(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int ialt, bcf1_t *dst)
 {
-    int ntmp = args->ntmp_arr1 / 4;
-    int ngts = bcf_get_genotypes(args->hdr,src,&args->tmp_arr1,&ntmp);
-    args->ntmp_arr1 = ntmp * 4;
+    int i, j, nsmpl = bcf_hdr_nsamples(args->hdr), ngts = fmt->n;
     assert( ngts >0 );
+    hts_expand(uint8_t, ngts*nsmpl*sizeof(int32_t), args->ntmp_arr1, args->tmp_arr1);
 
     int32_t *gt = (int32_t*) args->tmp_arr1;
-    int i, j, nsmpl = bcf_hdr_nsamples(args->hdr);
-    ngts /= nsmpl;
     for (i=0; i<nsmpl; i++)
     {
         for (j=0; j<ngts; j++)
         {
+            gt[j] = fmt_int32_value(fmt, i, j);
             if ( gt[j]==bcf_int32_vector_end ) break;
             if ( bcf_gt_is_missing(gt[j]) || bcf_gt_allele(gt[j])==0 ) continue; // missing allele or ref: leave as is
             if ( bcf_gt_allele(gt[j])==ialt+1 )
@@ -659,37 +730,37 @@ static void split_format_genotype(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int
             else
                 gt[j] = bcf_gt_unphased(0) | bcf_gt_is_phased(gt[j]); // set to REF
         }
+        for (; j<ngts; j++) gt[j] = bcf_int32_vector_end;
         gt += ngts;
     }
     bcf_update_genotypes(args->hdr,dst,args->tmp_arr1,ngts*nsmpl);
 }
 static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int ialt, bcf1_t *dst)
 {
-    #define BRANCH_NUMERIC(type,type_t,is_vector_end,is_missing,set_vector_end) \
+    #define BRANCH_NUMERIC(type,type_t,get_value,is_vector_end,is_missing,set_vector_end) \
     { \
         const char *tag = bcf_hdr_int2id(args->hdr,BCF_DT_ID,fmt->id); \
-        int ntmp = args->ntmp_arr1 / sizeof(type_t); \
-        int nvals = bcf_get_format_##type(args->hdr,src,tag,&args->tmp_arr1,&ntmp); \
-        args->ntmp_arr1 = ntmp * sizeof(type_t); \
-        assert( nvals>0 ); \
-        type_t *vals = (type_t *) args->tmp_arr1; \
         int len = bcf_hdr_id2length(args->hdr,BCF_HL_FMT,fmt->id); \
-        int i,j, nsmpl = bcf_hdr_nsamples(args->hdr); \
-        if ( nvals==nsmpl ) /* all values are missing */ \
+        int i,j, nsmpl = bcf_hdr_nsamples(args->hdr), nvals = fmt->n; \
+        assert( nvals>0 ); \
+        hts_expand(uint8_t, (nvals>3 ? nvals : 3)*nsmpl*sizeof(type_t), args->ntmp_arr1, args->tmp_arr1); \
+        type_t *vals = (type_t *) args->tmp_arr1, *dst_vals = vals, src_val; \
+        if ( nvals==1 ) /* all values are missing */ \
         { \
+            for (i=0; i<nsmpl; i++) vals[i] = get_value(fmt,i,0); \
             bcf_update_format_##type(args->hdr,dst,tag,vals,nsmpl); \
             return; \
         } \
         if ( len==BCF_VL_A ) \
         { \
-            if ( nvals!=(src->n_allele-1)*nsmpl ) \
+            if ( nvals!=src->n_allele-1 ) \
             { \
                 if ( args->force && !args->force_warned ) \
                 { \
                     fprintf(stderr, \
                         "Warning: wrong number of fields in FMT/%s at %s:%"PRId64", expected %d, found %d. Removing the field.\n" \
                         "         (This warning is printed only once.)\n", \
-                        tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals); \
+                        tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals*nsmpl); \
                     args->force_warned = 1; \
                 } \
                 if ( args->force ) \
@@ -698,28 +769,21 @@ static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int
                     return; \
                 } \
                 error("Error: wrong number of fields in FMT/%s at %s:%"PRId64", expected %d, found %d\n", \
-                    tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals); \
-            } \
-            nvals /= nsmpl; \
-            type_t *src_vals = vals, *dst_vals = vals; \
-            for (i=0; i<nsmpl; i++) \
-            { \
-                dst_vals[0] = src_vals[ialt]; \
-                dst_vals += 1; \
-                src_vals += nvals; \
+                    tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals*nsmpl); \
             } \
+            for (i=0; i<nsmpl; i++) dst_vals[i] = get_value(fmt,i,ialt); \
             bcf_update_format_##type(args->hdr,dst,tag,vals,nsmpl); \
         } \
         else if ( len==BCF_VL_R ) \
         { \
-            if ( nvals!=src->n_allele*nsmpl ) \
+            if ( nvals!=src->n_allele ) \
             { \
                 if ( args->force && !args->force_warned ) \
                 { \
                     fprintf(stderr, \
                         "Warning: wrong number of fields in FMT/%s at %s:%"PRId64", expected %d, found %d. Removing the field.\n" \
                         "         (This warning is printed only once.)\n", \
-                        tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals); \
+                        tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals*nsmpl); \
                     args->force_warned = 1; \
                 } \
                 if ( args->force ) \
@@ -728,44 +792,44 @@ static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int
                     return; \
                 } \
                 error("Error: wrong number of fields in FMT/%s at %s:%"PRId64", expected %d, found %d\n", \
-                    tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,src->n_allele*nsmpl,nvals); \
+                    tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,src->n_allele*nsmpl,nvals*nsmpl); \
             } \
-            nvals /= nsmpl; \
-            type_t *src_vals = vals, *dst_vals = vals; \
             if ( args->keep_sum_ad >= 0 && args->keep_sum_ad==fmt->id ) \
             { \
                 for (i=0; i<nsmpl; i++) \
                 { \
-                    dst_vals[0] = src_vals[0]; \
+                    dst_vals[0] = get_value(fmt,i,0); \
                     for (j=1; j<nvals; j++) \
-                        if ( j!=ialt+1 && !(is_missing) && !(is_vector_end) ) dst_vals[0] += src_vals[j]; \
-                    dst_vals[1] = src_vals[ialt+1]; \
+                    { \
+                        if ( j==ialt+1 ) continue; \
+                        src_val = get_value(fmt,i,j); \
+                        if ( !(is_missing) && !(is_vector_end) ) dst_vals[0] += src_val; \
+                    } \
+                    dst_vals[1] = get_value(fmt,i,ialt+1); \
                     dst_vals += 2; \
-                    src_vals += nvals; \
                 } \
             } \
             else \
             { \
                 for (i=0; i<nsmpl; i++) \
                 { \
-                    dst_vals[0] = src_vals[0]; \
-                    dst_vals[1] = src_vals[ialt+1]; \
+                    dst_vals[0] = get_value(fmt,i,0); \
+                    dst_vals[1] = get_value(fmt,i,ialt+1); \
                     dst_vals += 2; \
-                    src_vals += nvals; \
                 } \
             } \
             bcf_update_format_##type(args->hdr,dst,tag,vals,nsmpl*2); \
         } \
         else if ( len==BCF_VL_G ) \
         { \
-            if ( nvals!=src->n_allele*(src->n_allele+1)/2*nsmpl && nvals!=src->n_allele*nsmpl ) \
+            if ( nvals!=src->n_allele*(src->n_allele+1)/2 && nvals!=src->n_allele ) \
             { \
                 if ( args->force && !args->force_warned ) \
                 { \
                     fprintf(stderr, \
                         "Warning: wrong number of fields in FMT/%s at %s:%"PRId64", expected %d, found %d. Removing the field.\n" \
                         "         (This warning is printed only once.)\n", \
-                        tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals); \
+                        tag,bcf_seqname(args->hdr,src),(int64_t) src->pos+1,(src->n_allele-1)*nsmpl,nvals*nsmpl); \
                     args->force_warned = 1; \
                 } \
                 if ( args->force ) \
@@ -775,41 +839,46 @@ static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int
                 } \
                 error("Error at %s:%"PRId64", the tag %s has wrong number of fields\n", bcf_seqname(args->hdr,src),(int64_t) src->pos+1,bcf_hdr_int2id(args->hdr,BCF_DT_ID,fmt->id)); \
             } \
-            nvals /= nsmpl; \
             int all_haploid = nvals==src->n_allele ? 1 : 0; \
-            type_t *src_vals = vals, *dst_vals = vals; \
+            int i0a = bcf_alleles2gt(0,ialt+1), iaa = bcf_alleles2gt(ialt+1,ialt+1); \
             for (i=0; i<nsmpl; i++) \
             { \
                 int haploid = all_haploid; \
                 if ( !haploid ) \
                 { \
-                    int j; \
-                    for (j=0; j<nvals; j++) if ( is_vector_end ) break; \
+                    for (j=0; j<nvals; j++) \
+                    { \
+                        src_val = get_value(fmt,i,j); \
+                        if ( is_vector_end ) break; \
+                    } \
                     if ( j!=nvals ) haploid = 1; \
                 } \
-                dst_vals[0] = src_vals[0]; \
+                dst_vals[0] = get_value(fmt,i,0); \
                 if ( haploid ) \
                 { \
-                    dst_vals[1] = src_vals[ialt+1]; \
+                    dst_vals[1] = get_value(fmt,i,ialt+1); \
                     if ( !all_haploid ) set_vector_end; \
                 } \
                 else \
                 { \
-                    dst_vals[1] = src_vals[bcf_alleles2gt(0,ialt+1)]; \
-                    dst_vals[2] = src_vals[bcf_alleles2gt(ialt+1,ialt+1)]; \
+                    dst_vals[1] = get_value(fmt,i,i0a); \
+                    dst_vals[2] = get_value(fmt,i,iaa); \
                 } \
                 dst_vals += all_haploid ? 2 : 3; \
-                src_vals += nvals; \
             } \
             bcf_update_format_##type(args->hdr,dst,tag,vals,all_haploid ? nsmpl*2 : nsmpl*3); \
         } \
         else \
-            bcf_update_format_##type(args->hdr,dst,tag,vals,nvals); \
+        { \
+            for (i=0; i<nsmpl; i++) \
+                for (j=0; j<nvals; j++) vals[i*nvals+j] = get_value(fmt,i,j); \
+            bcf_update_format_##type(args->hdr,dst,tag,vals,nvals*nsmpl); \
+        } \
     }
     switch (bcf_hdr_id2type(args->hdr,BCF_HL_FMT,fmt->id))
     {
-        case BCF_HT_INT:  BRANCH_NUMERIC(int32, int32_t, src_vals[j]==bcf_int32_vector_end, src_vals[j]==bcf_int32_missing, dst_vals[2]=bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH_NUMERIC(float, float, bcf_float_is_vector_end(src_vals[j]), bcf_float_is_missing(src_vals[j]), bcf_float_set_vector_end(dst_vals[2])); break;
+        case BCF_HT_INT:  BRANCH_NUMERIC(int32, int32_t, fmt_int32_value, src_val==bcf_int32_vector_end, src_val==bcf_int32_missing, dst_vals[2]=bcf_int32_vector_end); break;
+        case BCF_HT_REAL: BRANCH_NUMERIC(float, float, fmt_float_value, bcf_float_is_vector_end(src_val), bcf_float_is_missing(src_val), bcf_float_set_vector_end(dst_vals[2])); break;
     }
     #undef BRANCH_NUMERIC
 }
@@ -1673,66 +1742,67 @@ static bcf1_t *mrows_flush(args_t *args)
     }
     return NULL;
 }
-static void cmpals_add(cmpals_t *ca, bcf1_t *rec)
+static int cmp_alleles(const void *aptr, const void *bptr)
 {
-    ca->ncmpals++;
-    hts_expand0(cmpals1_t, ca->ncmpals, ca->mcmpals, ca->cmpals);
-    cmpals1_t *cmpals = ca->cmpals + ca->ncmpals - 1;
-    free(cmpals->ref);
-    cmpals->ref = strdup(rec->d.allele[0]);
-    cmpals->n   = rec->n_allele;
-    if ( rec->n_allele==2 )
-    {
-        free(cmpals->alt);
-        cmpals->alt = strdup(rec->d.allele[1]);
-    }
-    else
-    {
-        if ( cmpals->hash ) khash_str2int_destroy_free(cmpals->hash);
-        cmpals->hash = khash_str2int_init();
-        int i;
-        for (i=1; i<rec->n_allele; i++)
-            khash_str2int_inc(cmpals->hash, strdup(rec->d.allele[i]));
-    }
+    return strcasecmp(*((const char**)aptr), *((const char**)bptr));
 }
-static int cmpals_match(cmpals_t *ca, bcf1_t *rec)
+static void cmpals_key(cmpals_t *ca, bcf1_t *rec, kstring_t *str)
 {
-    int i, j;
-    for (i=0; i<ca->ncmpals; i++)
+    int i;
+    str->l = 0;
+    kputs(rec->d.allele[0], str);
+    kputc('\t', str);
+    if ( rec->n_allele==2 )
+        kputs(rec->d.allele[1], str);   // the most frequent case
+    else if ( rec->n_allele > 2 )
     {
-        cmpals1_t *cmpals = ca->cmpals + i;
-        if ( rec->n_allele != cmpals->n ) continue;
-
-        // NB. assuming both are normalized
-        if ( strcasecmp(rec->d.allele[0], cmpals->ref) ) continue;
-
-        // the most frequent case
-        if ( rec->n_allele==2 )
+        hts_expand(char*, rec->n_allele-1, ca->mals, ca->als);
+        for (i=1; i<rec->n_allele; i++) ca->als[i-1] = rec->d.allele[i];
+        qsort(ca->als, rec->n_allele-1, sizeof(*ca->als), cmp_alleles);
+        for (i=0; i<rec->n_allele-1; i++)
         {
-            if ( strcasecmp(rec->d.allele[1], cmpals->alt) ) continue;
-            return 1;
+            if ( i ) kputc(',', str);
+            kputs(ca->als[i], str);
         }
-
-        khash_t(str2int) *hash = (khash_t(str2int)*) cmpals->hash;
-        for (j=1; j<rec->n_allele; j++) 
-            if ( !khash_str2int_has_key(hash, rec->d.allele[j]) ) break;
-        if ( j<rec->n_allele ) continue;
-        return 1;
     }
-    return 0;
+    for (i=0; i<str->l; i++) str->s[i] = toupper(str->s[i]);
+}
+static void cmpals_add(cmpals_t *ca, bcf1_t *rec)
+{
+    if ( !ca->hash ) ca->hash = khash_str2int_init();
+    ca->nkeys++;
+    hts_expand0(kstring_t, ca->nkeys, ca->mkeys, ca->keys);
+    kstring_t *key = &ca->keys[ca->nkeys-1];
+    cmpals_key(ca, rec, key);
+    if ( khash_str2int_has_key(ca->hash, key->s) ) { ca->nkeys--; return; }
+    khash_str2int_inc(ca->hash, key->s);
+}
+static int cmpals_match(cmpals_t *ca, bcf1_t *rec)
+{
+    if ( !ca->nkeys ) return 0;
+    cmpals_key(ca, rec, &ca->tmp);
+    return khash_str2int_has_key(ca->hash, ca->tmp.s);
+}
+static void cmpals_reset(cmpals_t *ca)
+{
+    // the keys are owned by ca->keys and reused, the hash does not free them
+    if ( ca->hash ) khash_str2int_clear(ca->hash);
+    ca->nkeys = 0;
 }
-static void cmpals_reset(cmpals_t *ca) { ca->ncmpals = 0; }
 static void cmpals_destroy(cmpals_t *ca)
 {
     int i;
-    for (i=0; i<ca->mcmpals; i++)
-    {
-        cmpals1_t *cmpals = ca->cmpals + i;
-        free(cmpals->ref);
-        free(cmpals->alt);
-        if ( cmpals->hash ) khash_str2int_destroy_free(cmpals->hash);
-    }
-    free(ca->cmpals);
+    if ( ca->hash ) khash_str2int_destroy(ca->hash);
+    for (i=0; i<ca->mkeys; i++) free(ca->keys[i].s);
+    free(ca->keys);
+    free(ca->als);
+    free(ca->tmp.s);
+}
+
+static inline void write_record(args_t *args, htsFile *file, bcf1_t *line)
+{
+    if ( bcf_write1(file, args->hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    args->prof.nrec_out++;
 }
 
 static void flush_buffer(args_t *args, htsFile *file, int n)
@@ -1748,7 +1818,7 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
             if ( mrows_ready_to_flush(args, args->lines[k]) )
             {
                 while ( (line=mrows_flush(args)) )
-                    if ( bcf_write1(file, args->hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+                    write_record(args, file, line);
             }
             int merge = 1;
             if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
@@ -1781,12 +1851,12 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
             prev_type |= line_type;
             if ( args->rmdup & BCF_SR_PAIR_EXACT ) cmpals_add(&args->cmpals_out, args->lines[k]);
         }
-        if ( bcf_write1(file, args->hdr, args->lines[k])!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+        write_record(args, file, args->lines[k]);
     }
     if ( args->mrows_op==MROWS_MERGE && !args->rbuf.n )
     {
         while ( (line=mrows_flush(args)) )
-            if ( bcf_write1(file, args->hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+            write_record(args, file, line);
     }
 }
 
@@ -1803,10 +1873,12 @@ static void init_data(args_t *args)
 
     rbuf_init(&args->rbuf, 100);
     args->lines = (bcf1_t**) calloc(args->rbuf.m, sizeof(bcf1_t*));
+    args->ref_ctg.rid = -1;
     if ( args->ref_fname )
     {
-        args->fai = fai_load(args->ref_fname);
-        if ( !args->fai ) error("Failed to load the fai index: %s\n", args->ref_fname);
+        args->refseq = refseq_init(args->ref_fname);
+        if ( !args->refseq ) error("Failed to load the fai index: %s\n", args->ref_fname);
+        refseq_set_window(args->refseq, REF_WIN_MIN, args->aln_win);
     }
     if ( args->mrows_op==MROWS_MERGE )
     {
@@ -1851,7 +1923,8 @@ static void destroy_data(args_t *args)
     free(args->tmp_arr2);
     free(args->diploid);
     if ( args->mrow_out ) bcf_destroy1(args->mrow_out);
-    if ( args->fai ) fai_destroy(args->fai);
+    refseq_destroy(args->refseq);
+    free(args->ref_buf.s);
     if ( args->mseq ) free(args->seq);
 }
 
@@ -1859,7 +1932,7 @@ static void destroy_data(args_t *args)
 static void normalize_line(args_t *args, bcf1_t **line_ptr)
 {
     bcf1_t *line = *line_ptr;
-    if ( args->fai )
+    if ( args->refseq )
     {
         if ( args->check_ref & CHECK_REF_FIX ) fix_ref(args, line);
         if ( args->do_indels )
@@ -1897,18 +1970,16 @@ static void normalize_line(args_t *args, bcf1_t **line_ptr)
     }
 }
 
-static void normalize_vcf(args_t *args)
+static void normalize_records(args_t *args, htsFile *out)
 {
-    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
-    if ( out == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads )
-        hts_set_opt(out, HTS_OPT_THREAD_POOL, args->files->p);
-    if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
-    if ( bcf_hdr_write(out, args->hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
-
     int prev_rid = -1, prev_pos = -1, prev_type = 0;
+    profile_t *prof = &args->prof;
+    prof->nsmpl = bcf_hdr_nsamples(args->hdr);
+    profile_mark(prof);
     while ( bcf_sr_next_line(args->files) )
     {
+        profile_lap(prof, PROF_READ);
+        prof->nrec_in++;
         args->ntotal++;
 
         bcf1_t *line = args->files->readers[0].buffer[0];
@@ -1935,7 +2006,11 @@ static void normalize_vcf(args_t *args)
 
         // still on the same chromosome?
         int i,j,ilast = rbuf_last(&args->rbuf);
-        if ( ilast>=0 && line->rid != args->lines[ilast]->rid ) flush_buffer(args, out, args->rbuf.n); // new chromosome
+        if ( ilast>=0 && line->rid != args->lines[ilast]->rid )
+        {
+            flush_buffer(args, out, args->rbuf.n); // new chromosome
+            profile_lap(prof, PROF_WRITE);
+        }
 
         int split = 0;
         if ( args->mrows_op==MROWS_SPLIT )
@@ -1966,16 +2041,176 @@ static void normalize_vcf(args_t *args)
             if ( args->lines[ilast]->pos - args->lines[i]->pos < args->buf_win ) break;
             j++;
         }
-        if ( j>0 ) flush_buffer(args, out, j);
+        profile_lap(prof, PROF_PROCESS);
+        if ( j>0 )
+        {
+            flush_buffer(args, out, j);
+            profile_lap(prof, PROF_WRITE);
+        }
     }
+    profile_lap(prof, PROF_READ);
     flush_buffer(args, out, args->rbuf.n);
-    if ( hts_close(out)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->output_fname);
+    profile_lap(prof, PROF_WRITE);
+}
+
+static htsFile *open_output(args_t *args)
+{
+    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( out == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    if ( args->n_threads )
+        hts_set_opt(out, HTS_OPT_THREAD_POOL, args->files->p);
+    if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
+    if ( bcf_hdr_write(out, args->hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    return out;
+}
 
+static void print_stats(args_t *args)
+{
     fprintf(stderr,"Lines   total/split/realigned/skipped:\t%d/%d/%d/%d\n", args->ntotal,args->nsplit,args->nchanged,args->nskipped);
     if ( args->check_ref & CHECK_REF_FIX )
         fprintf(stderr,"REF/ALT total/modified/added:  \t%d/%d/%d\n", args->nref.tot,args->nref.swap,args->nref.set);
 }
 
+static void normalize_vcf(args_t *args)
+{
+    htsFile *out = open_output(args);
+    normalize_records(args, out);
+    if ( hts_close(out)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->output_fname);
+    print_stats(args);
+}
+
+/*
+    Parallel normalization: the contigs of the indexed input file are split
+    into groups of about the same number of records and each group is
+    normalized by a worker thread with its own reader, buffers and fasta
+    index into a temporary BCF. The main thread copies the temporary files to
+    the output in the original order of contigs. Records are never buffered
+    across contigs, so the output is the same as from the serial run.
+*/
+typedef struct
+{
+    args_t *args;       // the options as parsed from the command line, before init_data()
+    const char *fname;  // the input file
+    char *regions;      // comma-separated list of contigs
+    char *tmp_fname;    // temporary output file
+    int ntotal, nsplit, nchanged, nskipped, nref_tot, nref_set, nref_swap;
+}
+norm_chunk_t;
+
+static void *normalize_chunk(void *arg)
+{
+    norm_chunk_t *chunk = (norm_chunk_t*) arg;
+    args_t *args = (args_t*) malloc(sizeof(args_t));
+    *args = *chunk->args;
+    args->prof.format = 0;
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    if ( args->targets && bcf_sr_set_targets(args->files, args->targets, args->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", args->targets);
+    if ( bcf_sr_set_regions(args->files, chunk->regions, 0)<0 ) error("Failed to set the regions: %s\n", chunk->regions);
+    if ( !bcf_sr_add_reader(args->files, chunk->fname) ) error("Failed to read from %s: %s\n", chunk->fname,bcf_sr_strerror(args->files->errnum));
+    args->n_threads = 0;
+
+    init_data(args);
+    htsFile *out = hts_open(chunk->tmp_fname, "wbu");
+    if ( out == NULL ) error("Can't write to \"%s\": %s\n", chunk->tmp_fname, strerror(errno));
+    if ( bcf_hdr_write(out, args->hdr)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,chunk->tmp_fname);
+    normalize_records(args, out);
+    if ( hts_close(out)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->tmp_fname);
+
+    chunk->ntotal    = args->ntotal;
+    chunk->nsplit    = args->nsplit;
+    chunk->nchanged  = args->nchanged;
+    chunk->nskipped  = args->nskipped;
+    chunk->nref_tot  = args->nref.tot;
+    chunk->nref_set  = args->nref.set;
+    chunk->nref_swap = args->nref.swap;
+
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+    free(args);
+    return chunk;
+}
+
+static void normalize_split(args_t *args, const char *fname)
+{
+    bcf_sr_t *reader = &args->files->readers[0];
+    if ( !reader->tbx_idx && !reader->bcf_idx ) error("The --split-contigs option requires an indexed input file\n");
+    args->hdr = reader->header;
+
+    // consecutive groups of contigs with similar number of records, empty contigs are skipped
+    int i, nchunks;
+    regplan_chunk_t *plan = regplan_contigs(args->files, 4*args->n_threads, &nchunks);
+    char *tmp_dir = regplan_tmpdir(args->tmp_dir, "/tmp/bcftools-norm.XXXXXX");
+    norm_chunk_t *chunks = (norm_chunk_t*) calloc(nchunks ? nchunks : 1, sizeof(norm_chunk_t));
+    kstring_t str = {0,0,0};
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].fname = fname;
+        chunks[i].regions = plan[i].regions;
+        str.l = 0;
+        ksprintf(&str, "%s/%05d.bcf", tmp_dir, i);
+        chunks[i].tmp_fname = strdup(str.s);
+    }
+    free(str.s);
+
+    // the workers get a copy of the options as the main thread keeps updating the counters
+    args_t *opts = (args_t*) malloc(sizeof(args_t));
+    *opts = *args;
+    for (i=0; i<nchunks; i++) chunks[i].args = opts;
+
+    hts_tpool *pool = nchunks ? hts_tpool_init(args->n_threads) : NULL;
+    hts_tpool_process *queue = NULL;
+    if ( nchunks )
+    {
+        if ( !pool ) error("Failed to initialize %d threads\n", args->n_threads);
+        queue = hts_tpool_process_init(pool, nchunks, 0);
+        for (i=0; i<nchunks; i++)
+            if ( hts_tpool_dispatch(pool, queue, normalize_chunk, &chunks[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    }
+
+    // copy the normalized chunks to the output in order
+    htsFile *out = open_output(args);
+    bcf1_t *rec = bcf_init1();
+    for (i=0; i<nchunks; i++)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        norm_chunk_t *chunk = (norm_chunk_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        htsFile *fh = hts_open(chunk->tmp_fname, "r");
+        if ( !fh ) error("Could not read %s: %s\n", chunk->tmp_fname, strerror(errno));
+        bcf_hdr_t *hdr = bcf_hdr_read(fh);
+        if ( !hdr ) error("Could not read the header of %s\n", chunk->tmp_fname);
+        int ret;
+        while ( (ret=bcf_read(fh, hdr, rec))==0 )
+            if ( bcf_write1(out, args->hdr, rec)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+        if ( ret < -1 ) error("Error reading %s\n", chunk->tmp_fname);
+        bcf_hdr_destroy(hdr);
+        if ( hts_close(fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,chunk->tmp_fname);
+        unlink(chunk->tmp_fname);
+
+        args->ntotal   += chunk->ntotal;
+        args->nsplit   += chunk->nsplit;
+        args->nchanged += chunk->nchanged;
+        args->nskipped += chunk->nskipped;
+        args->nref.tot  += chunk->nref_tot;
+        args->nref.set  += chunk->nref_set;
+        args->nref.swap += chunk->nref_swap;
+        free(chunk->tmp_fname);
+    }
+    bcf_destroy1(rec);
+    if ( hts_close(out)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->output_fname);
+    if ( queue ) hts_tpool_process_destroy(queue);
+    if ( pool ) hts_tpool_destroy(pool);
+    free(opts);
+    free(chunks);
+    regplan_destroy(plan, nchunks);
+    regplan_tmpdir_destroy(tmp_dir);
+    print_stats(args);
+}
+
 static void usage(void)
 {
     fprintf(stderr, "\n");
@@ -1996,11 +2231,14 @@ static void usage(void)
     fprintf(stderr, "    -N, --do-not-normalize            do not normalize indels (with -m or -c s)\n");
     fprintf(stderr, "    -o, --output <file>               write output to a file [standard output]\n");
     fprintf(stderr, "    -O, --output-type <type>          'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
+    fprintf(stderr, "        --profile[=json]              print time spent in reading, normalizing and writing to stderr\n");
     fprintf(stderr, "    -r, --regions <region>            restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>         restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --strict-filter               when merging (-m+), merged site is PASS only if all sites being merged PASS\n");
+    fprintf(stderr, "        --split-contigs               normalize groups of contigs in parallel in --threads worker threads\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --temp-dir <dir>              directory for temporary files with --split-contigs [/tmp/bcftools-norm.XXXXXX]\n");
     fprintf(stderr, "        --threads <int>               use multithreading with <int> worker threads [0]\n");
     fprintf(stderr, "    -w, --site-win <int>              buffer for sorting lines which changed position during realignment [1000]\n");
     fprintf(stderr, "\n");
@@ -2049,9 +2287,12 @@ int main_vcfnorm(int argc, char *argv[])
         {"output",required_argument,NULL,'o'},
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
+        {"profile",optional_argument,NULL,13},
         {"check-ref",required_argument,NULL,'c'},
         {"strict-filter",no_argument,NULL,'s'},
         {"no-version",no_argument,NULL,8},
+        {"split-contigs",no_argument,NULL,11},
+        {"temp-dir",required_argument,NULL,12},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -2120,6 +2361,11 @@ int main_vcfnorm(int argc, char *argv[])
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
             case  7 : args->force = 1; break;
+            case 11 : args->split_contigs = 1; break;
+            case 12 : args->tmp_dir = optarg; break;
+            case 13 :
+                if ( profile_init(&args->prof, "norm", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
             case 'h':
             case '?': usage(); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -2138,6 +2384,14 @@ int main_vcfnorm(int argc, char *argv[])
     if ( !args->check_ref && args->ref_fname ) args->check_ref = CHECK_REF_EXIT;
     if ( args->check_ref && !args->ref_fname ) error("Expected --fasta-ref with --check-ref\n");
 
+    if ( args->split_contigs )
+    {
+        if ( args->n_threads<=0 ) error("The --split-contigs option requires --threads\n");
+        if ( args->region ) error("The --split-contigs option cannot be combined with -r/-R\n");
+        if ( !strcmp("-",fname) ) error("The --split-contigs option requires an indexed input file\n");
+        args->files->require_index = 1;
+    }
+    args->targets_is_file = targets_is_file;
     if ( args->region )
     {
         if ( bcf_sr_set_regions(args->files, args->region,region_is_file)<0 )
@@ -2152,9 +2406,15 @@ int main_vcfnorm(int argc, char *argv[])
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to read from %s: %s\n", !strcmp("-",fname)?"standard input":fname,bcf_sr_strerror(args->files->errnum));
     if ( args->mrows_op&MROWS_SPLIT && args->rmdup ) error("Cannot combine -D and -m-\n");
-    init_data(args);
-    normalize_vcf(args);
-    destroy_data(args);
+    if ( args->split_contigs )
+        normalize_split(args, fname);
+    else
+    {
+        init_data(args);
+        normalize_vcf(args);
+        destroy_data(args);
+        profile_report(&args->prof, stderr);
+    }
     bcf_sr_destroy(args->files);
     free(args);
     return 0;
@@ -38,6 +38,7 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
 #include <htslib/khash_str2int.h>
+#include <htslib/thread_pool.h>
 #ifdef _WIN32
 #include <windows.h>
 #else
@@ -73,6 +74,32 @@ typedef struct _plugin_t plugin_t;
  *   bcf1_t *process(bcf1_t *rec)
  *      - called for each VCF record, return NULL for no output
  *
+ *   int process_batch(bcf1_t **rec, int nrec, bcf1_t **out)
+ *      - optional, called instead of process() with blocks of up to
+ *      PLUGIN_BATCH_SIZE consecutive VCF records. Fill out[] with the records
+ *      to output, in the output order; these can be records from rec[] or
+ *      records owned by the plugin, at most nrec. The records are valid only
+ *      for the duration of the call. Return the number of output records, or
+ *      a negative value on critical errors.
+ *
+ *   int batch_api_version(void)
+ *      - required with process_batch(), return BCFTOOLS_PLUGIN_BATCH_API. If
+ *      the version does not match, process_batch() is not used.
+ *
+ *   int parallel_safe(void)
+ *   void *init_thread(void)
+ *   bcf1_t *process_ctx(void *ctx, bcf1_t *rec)
+ *   void merge_ctx(void *ctx)
+ *      - optional, all four are required for parallel execution with --threads.
+ *      parallel_safe() returns non-zero if process_ctx() can be called from
+ *      several threads at once. init_thread() is called after init() and
+ *      returns a new context; a context is never used by two threads at the
+ *      same time. process_ctx() is called instead of process(), it can modify
+ *      the global state set by init() only through ctx, and must return
+ *      either rec, modified in place, or NULL for no output. The output order
+ *      is preserved. merge_ctx() is called before destroy() for each context,
+ *      merges its state (e.g. counts) into the global state and frees it.
+ *
  *   void destroy(void)
  *      - called after all lines have been processed to clean up
  */
@@ -82,6 +109,12 @@ typedef int (*dl_init_f) (int, char **, bcf_hdr_t *, bcf_hdr_t *);
 typedef char* (*dl_about_f) (void);
 typedef char* (*dl_usage_f) (void);
 typedef bcf1_t* (*dl_process_f) (bcf1_t *);
+typedef int (*dl_process_batch_f) (bcf1_t **, int, bcf1_t **);
+typedef int (*dl_batch_api_version_f) (void);
+typedef int (*dl_parallel_safe_f) (void);
+typedef void* (*dl_init_thread_f) (void);
+typedef bcf1_t* (*dl_process_ctx_f) (void *, bcf1_t *);
+typedef void (*dl_merge_ctx_f) (void *);
 typedef void (*dl_destroy_f) (void);
 
 struct _plugin_t
@@ -94,6 +127,10 @@ struct _plugin_t
     dl_about_f about;
     dl_usage_f usage;
     dl_process_f process;
+    dl_process_batch_f process_batch;
+    dl_init_thread_f init_thread;       // set only if the plugin is parallel-safe
+    dl_process_ctx_f process_ctx;
+    dl_merge_ctx_f merge_ctx;
     dl_destroy_f destroy;
     void *handle;
 };
@@ -132,6 +169,9 @@ annot_col_t;
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+// Number of records passed to process_batch() at once
+#define PLUGIN_BATCH_SIZE 1024
+
 typedef struct _args_t
 {
     bcf_srs_t *files;
@@ -144,6 +184,9 @@ typedef struct _args_t
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
 
     plugin_t plugin;
+    plugin_t *chain;        // plugins chained after the first one, records are passed in memory
+    bcf_hdr_t **chain_hdr;  // input headers of the chained plugins, the last plugin writes to hdr_out
+    int nchain;
     int nplugin_paths;
     char **plugin_paths;
 
@@ -293,6 +336,34 @@ static void print_plugin_usage_hint(const char *name)
     }
 }
 
+static void check_batch_api(args_t *args, plugin_t *plugin, int version)
+{
+    if ( version==BCFTOOLS_PLUGIN_BATCH_API )
+    {
+        if ( args->verbose > 1 ) fprintf(stderr,"\tprocess_batch .. ok\n");
+        return;
+    }
+    if ( version<0 )
+        fprintf(stderr,"WARNING: the plugin \"%s\" does not define batch_api_version(), process_batch() will not be used\n", plugin->name);
+    else
+        fprintf(stderr,"WARNING: batch API version mismatch .. bcftools at %d, the plugin \"%s\" at %d, process_batch() will not be used\n",
+                BCFTOOLS_PLUGIN_BATCH_API,plugin->name,version);
+    plugin->process_batch = NULL;
+}
+
+static void check_parallel_api(args_t *args, plugin_t *plugin)
+{
+    if ( plugin->init_thread && plugin->process_ctx && plugin->merge_ctx )
+    {
+        if ( args->verbose > 1 ) fprintf(stderr,"\tparallel .. ok\n");
+        return;
+    }
+    fprintf(stderr,"WARNING: the plugin \"%s\" is parallel_safe() but does not define all of init_thread(), process_ctx() and merge_ctx(), running in a single thread\n", plugin->name);
+    plugin->init_thread = NULL;
+    plugin->process_ctx = NULL;
+    plugin->merge_ctx   = NULL;
+}
+
 static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugin_t *plugin)
 {
     plugin->name = strdup(fname);
@@ -356,6 +427,22 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
         if ( exit_on_error ) error("Could not initialize %s: destroy method not found\n", plugin->name);
         return -1;
     }
+
+    plugin->process_batch = (dl_process_batch_f) GetProcAddress(plugin->handle, "process_batch");
+    if ( plugin->process_batch )
+    {
+        dl_batch_api_version_f batch_api_version = (dl_batch_api_version_f) GetProcAddress(plugin->handle, "batch_api_version");
+        check_batch_api(args, plugin, batch_api_version ? batch_api_version() : -1);
+    }
+
+    dl_parallel_safe_f parallel_safe = (dl_parallel_safe_f) GetProcAddress(plugin->handle, "parallel_safe");
+    if ( parallel_safe && parallel_safe() )
+    {
+        plugin->init_thread = (dl_init_thread_f) GetProcAddress(plugin->handle, "init_thread");
+        plugin->process_ctx = (dl_process_ctx_f) GetProcAddress(plugin->handle, "process_ctx");
+        plugin->merge_ctx   = (dl_merge_ctx_f) GetProcAddress(plugin->handle, "merge_ctx");
+        check_parallel_api(args, plugin);
+    }
 #else
     dlerror();
     plugin->init = (dl_init_f) dlsym(plugin->handle, "init");
@@ -418,24 +505,48 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
         if ( exit_on_error ) error("Could not initialize %s: %s\n", plugin->name, ret);
         return -1;
     }
+
+    plugin->process_batch = (dl_process_batch_f) dlsym(plugin->handle, "process_batch");
+    ret = dlerror();
+    if ( ret )
+        plugin->process_batch = NULL;
+    else
+    {
+        dl_batch_api_version_f batch_api_version = (dl_batch_api_version_f) dlsym(plugin->handle, "batch_api_version");
+        ret = dlerror();
+        check_batch_api(args, plugin, ret ? -1 : batch_api_version());
+    }
+
+    dl_parallel_safe_f parallel_safe = (dl_parallel_safe_f) dlsym(plugin->handle, "parallel_safe");
+    ret = dlerror();
+    if ( !ret && parallel_safe() )
+    {
+        plugin->init_thread = (dl_init_thread_f) dlsym(plugin->handle, "init_thread");
+        if ( dlerror() ) plugin->init_thread = NULL;
+        plugin->process_ctx = (dl_process_ctx_f) dlsym(plugin->handle, "process_ctx");
+        if ( dlerror() ) plugin->process_ctx = NULL;
+        plugin->merge_ctx = (dl_merge_ctx_f) dlsym(plugin->handle, "merge_ctx");
+        if ( dlerror() ) plugin->merge_ctx = NULL;
+        check_parallel_api(args, plugin);
+    }
 #endif
 
     return 0;
 }
 
-static void check_version(args_t *args)
+static void check_version(plugin_t *plugin)
 {
     static int warned_bcftools = 0, warned_htslib = 0;
     const char *bver, *hver;
-    args->plugin.version(&bver, &hver);
+    plugin->version(&bver, &hver);
     if ( strcmp(bver,bcftools_version()) && !warned_bcftools )
     {
-        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),args->plugin.name,bver);
+        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),plugin->name,bver);
         warned_bcftools = 1;
     }
     if ( strcmp(hver,hts_version()) && !warned_htslib )
     {
-        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),args->plugin.name,hver);
+        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),plugin->name,hver);
         warned_htslib = 1;
     }
 }
@@ -444,10 +555,70 @@ static void init_plugin(args_t *args)
 {
     int ret = args->plugin.init(args->plugin.argc,args->plugin.argv,args->hdr,args->hdr_out);
     if ( ret<0 ) error("The plugin exited with an error.\n");
-    check_version(args);
+    check_version(&args->plugin);
     args->drop_header += ret;
 }
 
+// The output header of each plugin is the input header of the next one
+static void init_plugin_chain(args_t *args)
+{
+    int i;
+    args->chain_hdr = (bcf_hdr_t**) malloc(sizeof(bcf_hdr_t*)*args->nchain);
+    for (i=0; i<args->nchain; i++)
+    {
+        plugin_t *plugin = &args->chain[i];
+        args->chain_hdr[i] = args->hdr_out;
+        if ( bcf_hdr_sync(args->chain_hdr[i])<0 ) error("[%s] Error: failed to update the header\n", __func__);
+        args->hdr_out = bcf_hdr_dup(args->chain_hdr[i]);
+        optind = 0;
+        int ret = plugin->init(plugin->argc,plugin->argv,args->chain_hdr[i],args->hdr_out);
+        if ( ret<0 ) error("The plugin %s exited with an error.\n", plugin->name);
+        check_version(plugin);
+        args->drop_header += ret;
+    }
+}
+
+// Split the plugin arguments on "-- +name", or "+name" given right after the input file,
+// which start the arguments of the next plugin in the chain. The arguments of the chained
+// plugin can be also given as "+name -- ARGS".
+static void split_plugin_chain(args_t *args)
+{
+    plugin_t *plugin = &args->plugin;
+    char **argv = args->plugin.argv;
+    int i = 1, j, argc = args->plugin.argc;
+    while ( i<argc )
+    {
+        int iname;
+        if ( i==1 && argv[i][0]=='+' ) iname = i;
+        else if ( !strcmp(argv[i],"--") && i+1<argc && argv[i+1][0]=='+' ) iname = i+1;
+        else { i++; continue; }
+
+        plugin->argc = i - (plugin->argv - argv);
+        args->chain = (plugin_t*) realloc(args->chain, sizeof(plugin_t)*(args->nchain+1));
+        plugin = &args->chain[args->nchain++];
+        memset(plugin, 0, sizeof(plugin_t));
+        load_plugin(args, argv[iname]+1, 1, plugin);
+        if ( plugin->run ) error("The plugin %s cannot be chained with other plugins\n", plugin->name);
+        if ( plugin->handle==args->plugin.handle ) error("The plugin %s can be used only once in a chain\n", plugin->name);
+        for (j=0; j<args->nchain-1; j++)
+            if ( plugin->handle==args->chain[j].handle ) error("The plugin %s can be used only once in a chain\n", plugin->name);
+
+        plugin->argv = argv + iname;    // argv[0] is the plugin name
+        if ( iname+1<argc && !strcmp(argv[iname+1],"--") && !(iname+2<argc && argv[iname+2][0]=='+') ) plugin->argv++;
+        i = plugin->argv - argv + 1;
+    }
+    plugin->argc = argc - (plugin->argv - argv);
+}
+
+static bcf1_t *process_chain(args_t *args, bcf1_t *line)
+{
+    line = args->plugin.process(line);
+    int i;
+    for (i=0; i<args->nchain && line; i++)
+        line = args->chain[i].process(line);
+    return line;
+}
+
 static int cmp_plugin_name(const void *p1, const void *p2)
 {
     plugin_t *a = (plugin_t*) p1;
@@ -515,6 +686,7 @@ static void init_data(args_t *args)
     args->hdr_out = bcf_hdr_dup(args->hdr);
 
     init_plugin(args);
+    if ( args->nchain ) init_plugin_chain(args);
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
@@ -538,10 +710,24 @@ static void destroy_data(args_t *args)
 #else
     dlclose(args->plugin.handle);
 #endif
+    int i;
+    for (i=0; i<args->nchain; i++)
+    {
+        plugin_t *plugin = &args->chain[i];
+        free(plugin->name);
+        if ( plugin->destroy ) plugin->destroy();
+#ifdef _WIN32
+        FreeLibrary(plugin->handle);
+#else
+        dlclose(plugin->handle);
+#endif
+        if ( args->chain_hdr ) bcf_hdr_destroy(args->chain_hdr[i]);
+    }
+    free(args->chain);
+    free(args->chain_hdr);
     if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
     if ( args->nplugin_paths>0 )
     {
-        int i;
         for (i=0; i<args->nplugin_paths; i++) free(args->plugin_paths[i]);
         free(args->plugin_paths);
     }
@@ -550,12 +736,162 @@ static void destroy_data(args_t *args)
     if (args->out_fh && hts_close(args->out_fh)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->output_fname);
 }
 
+static void write_record(args_t *args, bcf1_t *line)
+{
+    if ( line->errcode ) error("[E::main_plugin] Unchecked error (%d), exiting\n",line->errcode);
+    if ( bcf_write1(args->out_fh, args->hdr_out, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+}
+
+// Collect blocks of records which pass the filters and hand them to the plugin at once
+static void process_batches(args_t *args)
+{
+    bcf1_t **rec = (bcf1_t**) malloc(sizeof(*rec)*PLUGIN_BATCH_SIZE);
+    bcf1_t **out = (bcf1_t**) malloc(sizeof(*out)*PLUGIN_BATCH_SIZE);
+    int i, nrec = 0;
+    for (i=0; i<PLUGIN_BATCH_SIZE; i++) rec[i] = bcf_init1();
+    while ( 1 )
+    {
+        int ret = bcf_sr_next_line(args->files);
+        if ( ret )
+        {
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            if ( args->filter )
+            {
+                int pass = filter_test(args->filter, line, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                if ( !pass ) continue;
+            }
+            // The line would be overwritten in the next bcf_sr_next_line call,
+            // swap it with an unused one
+            args->files->readers[0].buffer[0] = rec[nrec];
+            rec[nrec++] = line;
+            if ( nrec < PLUGIN_BATCH_SIZE ) continue;
+        }
+        if ( nrec )
+        {
+            int nout = args->plugin.process_batch(rec, nrec, out);
+            if ( nout<0 ) error("The plugin exited with an error.\n");
+            if ( nout>nrec ) error("The plugin returned too many records: %d > %d\n", nout,nrec);
+            for (i=0; i<nout; i++) write_record(args, out[i]);
+            nrec = 0;
+        }
+        if ( !ret ) break;
+    }
+    for (i=0; i<PLUGIN_BATCH_SIZE; i++) bcf_destroy1(rec[i]);
+    free(rec);
+    free(out);
+}
+
+typedef struct
+{
+    plugin_t *plugin;
+    void *ctx;                  // the plugin's context, one per job slot
+    bcf1_t **rec, **out;
+    int nrec, nout;
+}
+plugin_job_t;
+
+static void *process_job(void *arg)
+{
+    plugin_job_t *job = (plugin_job_t*) arg;
+    int i;
+    job->nout = 0;
+    for (i=0; i<job->nrec; i++)
+    {
+        bcf1_t *line = job->plugin->process_ctx(job->ctx, job->rec[i]);
+        if ( !line ) continue;
+        if ( line!=job->rec[i] ) error("[%s] Error: process_ctx() must return the input record or NULL\n", __func__);
+        job->out[job->nout++] = line;
+    }
+    return job;
+}
+
+static void write_job_result(args_t *args, hts_tpool_process *queue)
+{
+    hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+    if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+    plugin_job_t *job = (plugin_job_t*) hts_tpool_result_data(res);
+    hts_tpool_delete_result(res, 0);
+    int i;
+    for (i=0; i<job->nout; i++) write_record(args, job->out[i]);
+}
+
+// Blocks of records are processed by worker threads, each job slot has its own
+// plugin context. The results come back in the order of dispatch, so a slot can
+// be refilled once the oldest result was written.
+static void process_parallel(args_t *args)
+{
+    int i, j, nslot = 2*args->n_threads;
+    plugin_job_t *jobs = (plugin_job_t*) calloc(nslot, sizeof(*jobs));
+    for (i=0; i<nslot; i++)
+    {
+        jobs[i].plugin = &args->plugin;
+        jobs[i].ctx = args->plugin.init_thread();
+        jobs[i].rec = (bcf1_t**) malloc(sizeof(bcf1_t*)*PLUGIN_BATCH_SIZE);
+        jobs[i].out = (bcf1_t**) malloc(sizeof(bcf1_t*)*PLUGIN_BATCH_SIZE);
+        for (j=0; j<PLUGIN_BATCH_SIZE; j++) jobs[i].rec[j] = bcf_init1();
+    }
+    hts_tpool *pool = hts_tpool_init(args->n_threads);
+    if ( !pool ) error("[%s] Error: failed to create a thread pool\n", __func__);
+    hts_tpool_process *queue = hts_tpool_process_init(pool, nslot, 0);
+    if ( !queue ) error("[%s] Error: failed to create a thread pool queue\n", __func__);
+
+    int islot = 0, ndispatched = 0, nwritten = 0;
+    plugin_job_t *job = NULL;
+    while ( 1 )
+    {
+        int ret = bcf_sr_next_line(args->files);
+        if ( ret )
+        {
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            if ( args->filter )
+            {
+                int pass = filter_test(args->filter, line, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                if ( !pass ) continue;
+            }
+            if ( !job )
+            {
+                // all slots busy, the oldest job is the one in this slot
+                if ( ndispatched - nwritten == nslot ) { write_job_result(args, queue); nwritten++; }
+                job = &jobs[islot];
+                job->nrec = 0;
+            }
+            // swap the line with an unused record, it would be overwritten by the reader
+            args->files->readers[0].buffer[0] = job->rec[job->nrec];
+            job->rec[job->nrec++] = line;
+            if ( job->nrec < PLUGIN_BATCH_SIZE ) continue;
+        }
+        if ( job )
+        {
+            if ( hts_tpool_dispatch(pool, queue, process_job, job)!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+            ndispatched++;
+            islot = (islot + 1) % nslot;
+            job = NULL;
+        }
+        if ( !ret ) break;
+    }
+    while ( nwritten < ndispatched ) { write_job_result(args, queue); nwritten++; }
+    hts_tpool_process_destroy(queue);
+    hts_tpool_destroy(pool);
+
+    for (i=0; i<nslot; i++)
+    {
+        args->plugin.merge_ctx(jobs[i].ctx);
+        for (j=0; j<PLUGIN_BATCH_SIZE; j++) bcf_destroy1(jobs[i].rec[j]);
+        free(jobs[i].rec);
+        free(jobs[i].out);
+    }
+    free(jobs);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
     fprintf(stderr, "About:   Run user defined plugin\n");
     fprintf(stderr, "Usage:   bcftools plugin <name> [OPTIONS] <file> [-- PLUGIN_OPTIONS]\n");
     fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS]\n");
+    fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS] [-- +name2 PLUGIN2_OPTIONS ...]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "VCF input options:\n");
     fprintf(stderr, "   -e, --exclude <expr>        exclude sites for which the expression is true\n");
@@ -568,7 +904,7 @@ static void usage(args_t *args)
     fprintf(stderr, "       --no-version            do not append version and command line to the header\n");
     fprintf(stderr, "   -o, --output <file>         write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <type>    'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
-    fprintf(stderr, "       --threads <int>         use multithreading with <int> worker threads [0]\n");
+    fprintf(stderr, "       --threads <int>         use multithreading with <int> worker threads, also for parallel-safe plugins [0]\n");
     fprintf(stderr, "Plugin options:\n");
     fprintf(stderr, "   -h, --help                  list plugin's options\n");
     fprintf(stderr, "   -l, --list-plugins          list available plugins. See BCFTOOLS_PLUGINS environment variable and man page for details\n");
@@ -622,7 +958,7 @@ int main_plugin(int argc, char *argv[])
         load_plugin(args, plugin_name, 1, &args->plugin);
         if ( args->plugin.run )
         {
-            check_version(args);
+            check_version(&args->plugin);
             int ret = args->plugin.run(argc, argv);
             destroy_data(args);
             free(args);
@@ -699,6 +1035,7 @@ int main_plugin(int argc, char *argv[])
     }
 
     char *fname = NULL;
+    int init_early = 0;
     if ( optind>=argc || (argv[optind][0]=='-' && argv[optind][1]) )
     {
         args->plugin.argc = argc - optind + 1;
@@ -706,11 +1043,7 @@ int main_plugin(int argc, char *argv[])
 
         if ( !isatty(fileno((FILE *)stdin)) ) fname = "-";  // reading from stdin
         else if ( optind>=argc ) usage(args);
-        else
-        {
-            optind = 1;
-            init_plugin(args);
-        }
+        else init_early = 1;
     }
     else
     {
@@ -718,6 +1051,12 @@ int main_plugin(int argc, char *argv[])
         args->plugin.argc = argc - optind;
         args->plugin.argv = argv + optind;
     }
+    split_plugin_chain(args);
+    if ( init_early )
+    {
+        optind = 1;
+        init_plugin(args);
+    }
     optind = 0;
 
     args->files = bcf_sr_init();
@@ -735,20 +1074,23 @@ int main_plugin(int argc, char *argv[])
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to read from %s: %s\n", !strcmp("-",fname)?"standard input":fname,bcf_sr_strerror(args->files->errnum));
 
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->plugin.process_ctx && args->n_threads > 0 && !args->nchain )
+        process_parallel(args);
+    else if ( args->plugin.process_batch && !args->nchain )
+        process_batches(args);
+    else
     {
-        bcf1_t *line = bcf_sr_get_line(args->files,0);
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
-        }
-        line = args->plugin.process(line);
-        if ( line )
+        while ( bcf_sr_next_line(args->files) )
         {
-            if ( line->errcode ) error("[E::main_plugin] Unchecked error (%d), exiting\n",line->errcode);
-            if ( bcf_write1(args->out_fh, args->hdr_out, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            if ( args->filter )
+            {
+                int pass = filter_test(args->filter, line, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                if ( !pass ) continue;
+            }
+            line = process_chain(args, line);
+            if ( line ) write_record(args, line);
         }
     }
     destroy_data(args);
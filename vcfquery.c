@@ -37,12 +37,15 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "filter.h"
 #include "convert.h"
+#include "blkpipe.h"
 
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+#define BATCH_SIZE 65536    // the number of records in a batch of columnar output
+
 typedef struct
 {
     filter_t *filter;
@@ -54,8 +57,9 @@ typedef struct
     bcf_hdr_t *header;
     int nsamples, *samples, sample_is_file;
     char **argv, *format_str, *sample_list, *targets_list, *regions_list, *vcf_list, *fn_out;
-    int argc, list_columns, print_header, allow_undef_tags;
+    int argc, list_columns, print_header, allow_undef_tags, n_threads, columnar;
     FILE *out;
+    profile_t prof;
 }
 args_t;
 
@@ -67,6 +71,14 @@ static void destroy_list(char **list, int n)
     free(list);
 }
 
+static convert_t *init_convert(args_t *args, uint8_t **smpl_pass)
+{
+    convert_t *convert = convert_init(args->header, args->samples, args->nsamples, args->format_str);
+    convert_set_option(convert, subset_samples, smpl_pass);
+    if ( args->allow_undef_tags ) convert_set_option(convert, allow_undef_tags, 1);
+    return convert;
+}
+
 static void init_data(args_t *args)
 {
     args->header = args->files->readers[0].header;
@@ -99,10 +111,9 @@ static void init_data(args_t *args)
             free(smpls);
         }
     }
-    args->convert = convert_init(args->header, samples, nsamples, args->format_str);
-    convert_set_option(args->convert, subset_samples, &args->smpl_pass);
-    if ( args->allow_undef_tags ) convert_set_option(args->convert, allow_undef_tags, 1);
-    free(samples);
+    args->nsamples = nsamples;
+    args->samples  = samples;
+    args->convert  = init_convert(args, &args->smpl_pass);
 
     int max_unpack = convert_max_unpack(args->convert);
     if ( args->filter_str )
@@ -119,57 +130,201 @@ static void destroy_data(args_t *args)
     if ( args->filter )
         filter_destroy(args->filter);
     free(args->samples);
+    args->samples = NULL;
+}
+
+// Returns 1 if the record should be printed, the per-sample statuses are set in *smpl_pass
+static int test_record(args_t *args, filter_t *filter, uint8_t **smpl_pass, bcf1_t *line)
+{
+    if ( !filter ) return 1;
+
+    int i, pass = filter_test(filter, line, (const uint8_t**) smpl_pass);
+    if ( args->filter_logic & FLT_EXCLUDE )
+    {
+        // This code addresses this problem:
+        //  -i can include a site but exclude a sample
+        //  -e exclude a site but include a sample
+
+        if ( pass )
+        {
+            if ( !*smpl_pass ) return 0;
+            if ( !(convert_max_unpack(args->convert) & BCF_UN_FMT) ) return 0;
+
+            pass = 0;
+            for (i=0; i<line->n_sample; i++)
+            {
+                if ( (*smpl_pass)[i] ) (*smpl_pass)[i] = 0;
+                else { (*smpl_pass)[i] = 1; pass = 1; }
+            }
+            return pass;
+        }
+        else if ( *smpl_pass )
+            for (i=0; i<line->n_sample; i++) (*smpl_pass)[i] = 1;
+        return 1;
+    }
+    return pass;
+}
+
+/*
+ *  Multithreaded query: the main thread reads records in blocks, worker
+ *  threads filter and format them, each block having its own copy of the
+ *  filter and the formatter, and the main thread writes the formatted
+ *  blocks in the input order, see blkpipe.h
+ */
+typedef struct
+{
+    args_t *args;
+    filter_t *filter;
+    convert_t *convert;
+    uint8_t *smpl_pass;
+    kstring_t str, tmp;             // the formatted block and a line
+}
+block_t;
+
+static void *query_block(void *arg)
+{
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    args_t *args = dat->args;
+    int i;
+    dat->str.l = 0;
+    for (i=0; i<blk->nrec; i++)
+    {
+        bcf1_t *line = blk->recs[i];
+        bcf_unpack(line, args->files->max_unpack);
+        if ( !test_record(args, dat->filter, &dat->smpl_pass, line) ) continue;
+        dat->tmp.l = 0;
+        convert_line(dat->convert, line, &dat->tmp);
+        kputsn(dat->tmp.s, dat->tmp.l, &dat->str);
+    }
+    return blk;
+}
+
+static void output_block(void *usr, void *arg)
+{
+    args_t *args = (args_t*) usr;
+    block_t *dat = (block_t*) ((blkpipe_blk_t*)arg)->data;
+    profile_mark(&args->prof);
+    if ( dat->str.l && fwrite(dat->str.s, dat->str.l, 1, args->out)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out?args->fn_out:"standard output");
+    profile_lap(&args->prof, PROF_WRITE);
+}
+
+static void query_threaded(args_t *args)
+{
+    int i, nblk = 2*args->n_threads;
+    block_t *dat = (block_t*) calloc(nblk, sizeof(block_t));
+    void **data = (void**) malloc(sizeof(void*)*nblk);
+    for (i=0; i<nblk; i++)
+    {
+        data[i] = &dat[i];
+        dat[i].args = args;
+        dat[i].convert = init_convert(args, &dat[i].smpl_pass);
+        if ( args->filter_str ) dat[i].filter = filter_init(args->header, args->filter_str);
+    }
+    blkpipe_t *pipe = blkpipe_blocks_init(args->files->p->pool, nblk, data, query_block, output_block, args);
+    while ( 1 )
+    {
+        profile_mark(&args->prof);
+        if ( !bcf_sr_next_line(args->files) ) break;
+        profile_lap(&args->prof, PROF_READ);
+        args->prof.nrec_in++;
+        blkpipe_push(pipe, args->files, 0);
+    }
+    blkpipe_flush(pipe);
+    blkpipe_destroy(pipe);
+
+    for (i=0; i<nblk; i++)
+    {
+        convert_destroy(dat[i].convert);
+        if ( dat[i].filter ) filter_destroy(dat[i].filter);
+        free(dat[i].str.s);
+        free(dat[i].tmp.s);
+    }
+    free(dat);
+    free(data);
+}
+
+static void query_columnar(args_t *args)
+{
+    kstring_t str = {0,0,0};
+    convert_columns_header(args->convert, &str);
+    profile_t *prof = &args->prof;
+    profile_mark(prof);
+    while ( bcf_sr_next_line(args->files) )
+    {
+        if ( !bcf_sr_has_line(args->files,0) ) continue;
+        bcf1_t *line = args->files->readers[0].buffer[0];
+        bcf_unpack(line, args->files->max_unpack);
+        profile_lap(prof, PROF_READ);
+        prof->nrec_in++;
+
+        int pass = test_record(args, args->filter, &args->smpl_pass, line);
+        profile_lap(prof, PROF_FILTER);
+        if ( !pass ) continue;
+        prof->nrec_out++;
+        int nbuf = convert_columns_line(args->convert, line);
+        profile_lap(prof, PROF_PROCESS);
+        if ( nbuf < BATCH_SIZE ) continue;
+
+        convert_columns_flush(args->convert, &str);
+        if ( fwrite(str.s, str.l, 1, args->out)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out?args->fn_out:"standard output");
+        profile_lap(prof, PROF_WRITE);
+        str.l = 0;
+    }
+    profile_lap(prof, PROF_READ);
+    convert_columns_flush(args->convert, &str);
+    if ( str.l && fwrite(str.s, str.l, 1, args->out)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out?args->fn_out:"standard output");
+    profile_lap(prof, PROF_WRITE);
+    free(str.s);
 }
 
 static void query_vcf(args_t *args)
 {
     kstring_t str = {0,0,0};
 
+    args->prof.nsmpl = bcf_hdr_nsamples(args->header);
+    if ( args->columnar )
+    {
+        query_columnar(args);
+        return;
+    }
+
     if ( args->print_header )
     {
         convert_header(args->convert,&str);
         if ( fwrite(str.s, str.l, 1, args->out)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out?args->fn_out:"standard output");
     }
 
-    int i,max_convert_unpack = convert_max_unpack(args->convert);
+    // %MASK needs the lines of all readers, only a single reader can be split into blocks
+    if ( args->files->p && args->files->nreaders==1 )
+    {
+        query_threaded(args);
+        free(str.s);
+        return;
+    }
+
+    profile_t *prof = &args->prof;
+    profile_mark(prof);
     while ( bcf_sr_next_line(args->files) )
     {
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = args->files->readers[0].buffer[0];
         bcf_unpack(line, args->files->max_unpack);
+        profile_lap(prof, PROF_READ);
+        prof->nrec_in++;
 
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, line, (const uint8_t**) &args->smpl_pass);
-            if ( args->filter_logic & FLT_EXCLUDE )
-            {
-                // This code addresses this problem:
-                //  -i can include a site but exclude a sample
-                //  -e exclude a site but include a sample
-
-                if ( pass )
-                {
-                    if ( !args->smpl_pass ) continue;
-                    if ( !(max_convert_unpack & BCF_UN_FMT) ) continue;
-
-                    pass = 0;
-                    for (i=0; i<line->n_sample; i++)
-                    {
-                        if ( args->smpl_pass[i] ) args->smpl_pass[i] = 0;
-                        else { args->smpl_pass[i] = 1; pass = 1; }
-                    }
-                    if ( !pass ) continue;
-                }
-                else if ( args->smpl_pass )
-                    for (i=0; i<line->n_sample; i++) args->smpl_pass[i] = 1;
-            }
-            else if ( !pass ) continue;
-        }
+        int pass = test_record(args, args->filter, &args->smpl_pass, line);
+        profile_lap(prof, PROF_FILTER);
+        if ( !pass ) continue;
 
         str.l = 0;
         convert_line(args->convert, line, &str);
+        profile_lap(prof, PROF_PROCESS);
         if ( str.l && fwrite(str.s, str.l, 1, args->out)!=1 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out?args->fn_out:"standard output");
+        profile_lap(prof, PROF_WRITE);
+        prof->nrec_out++;
     }
+    profile_lap(prof, PROF_READ);
     if ( str.m ) free(str.s);
 }
 
@@ -221,18 +376,21 @@ static void usage(void)
     fprintf(stderr, "Usage:   bcftools query [options] <A.vcf.gz> [<B.vcf.gz> [...]]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
+    fprintf(stderr, "        --columnar                    binary columnar output of typed values (see man page for details)\n");
     fprintf(stderr, "    -e, --exclude <expr>              exclude sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -f, --format <string>             see man page for details\n");
     fprintf(stderr, "    -H, --print-header                print header\n");
     fprintf(stderr, "    -i, --include <expr>              select sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -l, --list-samples                print the list of samples and exit\n");
     fprintf(stderr, "    -o, --output <file>               output file name [stdout]\n");
+    fprintf(stderr, "        --profile[=json]              print time spent in reading, filtering, formatting and writing to stderr\n");
     fprintf(stderr, "    -r, --regions <region>            restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>         restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --samples <list>              list of samples to include\n");
     fprintf(stderr, "    -S, --samples-file <file>         file of samples to include\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>               use multithreading with <int> worker threads [0]\n");
     fprintf(stderr, "    -u, --allow-undef-tags            print \".\" for undefined tags\n");
     fprintf(stderr, "    -v, --vcf-list <file>             process multiple VCFs listed in the file\n");
     fprintf(stderr, "\n");
@@ -269,11 +427,19 @@ int main_vcfquery(int argc, char *argv[])
         {"collapse",1,0,'c'},
         {"vcf-list",1,0,'v'},
         {"allow-undef-tags",0,0,'u'},
+        {"threads",1,0,9},
+        {"columnar",0,0,10},
+        {"profile",2,0,11},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hlr:R:f:a:s:S:Ht:T:c:v:i:e:o:u",loptions,NULL)) >= 0) {
         switch (c) {
             case 'o': args->fn_out = optarg; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 : args->columnar = 1; break;
+            case 11 :
+                if ( profile_init(&args->prof, "query", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
             case 'f': args->format_str = strdup(optarg); break;
             case 'H': args->print_header = 1; break;
             case 'v': args->vcf_list = optarg; break;
@@ -336,8 +502,10 @@ int main_vcfquery(int argc, char *argv[])
         if ( argc==1 && !fname ) usage();
         error("Error: Missing the --format option\n");
     }
+    if ( args->columnar && args->vcf_list ) error("Error: the --columnar option cannot be combined with --vcf-list\n");
     args->out = args->fn_out ? fopen(args->fn_out, "w") : stdout;
     if ( !args->out ) error("%s: %s\n", args->fn_out,strerror(errno));
+    setvbuf(args->out, NULL, _IOFBF, 1<<20);    // the output is written one line at a time, avoid many small writes
 
     if ( !args->vcf_list )
     {
@@ -351,6 +519,7 @@ int main_vcfquery(int argc, char *argv[])
             if ( bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
                 error("Failed to read the targets: %s\n", args->targets_list);
         }
+        if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
         while ( fname )
         {
             if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to read from %s: %s\n", !strcmp("-",fname)?"standard input":fname,bcf_sr_strerror(args->files->errnum));
@@ -362,6 +531,7 @@ int main_vcfquery(int argc, char *argv[])
         destroy_data(args);
         bcf_sr_destroy(args->files);
         if ( fclose(args->out)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->fn_out);
+        profile_report(&args->prof, stderr);
         free(args);
         return 0;
     }
@@ -403,6 +573,7 @@ int main_vcfquery(int argc, char *argv[])
         bcf_sr_destroy(args->files);
     }
     if ( fclose(args->out)!=0 ) error("[%s] Error: close failed .. %s\n", __func__,args->fn_out);;
+    profile_report(&args->prof, stderr);
     destroy_list(fnames, nfiles);
     destroy_list(prev_samples, prev_nsamples);
     free(args->format_str);
@@ -37,6 +37,7 @@ THE SOFTWARE.  */
 #include "HMM.h"
 #include "smpl_ilist.h"
 #include "filter.h"
+#include "blkpipe.h"
 
 #define STATE_HW 0        // normal state, follows Hardy-Weinberg allele frequencies
 #define STATE_AZ 1        // autozygous state
@@ -49,6 +50,8 @@ THE SOFTWARE.  */
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+#define OUTPUT_BUF (1<<16)  // unbuffered workers write out when this many bytes accumulate
+
 
 /** Genetic map */
 typedef struct
@@ -76,6 +79,18 @@ typedef struct
 }
 smpl_t;
 
+/** HMM instance and output buffer, one per concurrently processed sample */
+typedef struct
+{
+    struct _args_t *args;
+    hmm_t *hmm;
+    int igenmap;        // current position in genmap
+    int ismpl;          // the sample being processed
+    int buffered;       // keep the whole output in str, the caller writes it out in sample order
+    kstring_t str;
+}
+worker_t;
+
 typedef struct _args_t
 {
     bcf_srs_t *files;
@@ -83,12 +98,15 @@ typedef struct _args_t
     double t2AZ, t2HW;      // P(AZ|HW) and P(HW|AZ) parameters
     double unseen_PL, dflt_AF;
 
-    char *genmap_fname;
+    char *genmap_fname, *genmap_loaded;     // the map file name, possibly a {CHROM} mask, and the file currently loaded
     genmap_t *genmap;
-    int ngenmap, mgenmap, igenmap;
+    int ngenmap, mgenmap;
     double rec_rate;        // constant recombination rate if > 0
 
-    hmm_t *hmm;
+    worker_t *worker;       // worker[0] is used when not processing samples in parallel
+    int nworker;
+    blkpipe_t *pipe;        // the workers 1..nworker-1 with --threads
+    hts_tpool *pool;
     double baum_welch_th;
     int nrids, *rids, *rid_offs;    // multiple chroms with vi_training
     int nbuf_max, nbuf_olap;
@@ -281,11 +299,23 @@ static void init_data(args_t *args)
     MAT(tprob,2,STATE_AZ,STATE_HW) = args->t2AZ;
     MAT(tprob,2,STATE_AZ,STATE_AZ) = 1 - args->t2HW; 
 
-    args->hmm = hmm_init(2, tprob, 10000);
-    if ( args->genmap_fname ) 
-        hmm_set_tprob_func(args->hmm, set_tprob_genmap, args);
-    else if ( args->rec_rate > 0 )
-        hmm_set_tprob_func(args->hmm, set_tprob_rrate, args);
+    // Samples are independent, with multiple threads whole chromosomes of different
+    // samples are run in parallel, each in its own HMM instance
+    if ( args->n_threads > 0 && args->files->p && args->roh_smpl->n > 1 )
+        args->pool = args->files->p->pool;
+    args->nworker = args->pool ? 1 + 2*args->n_threads : 1;
+    args->worker = (worker_t*) calloc(args->nworker,sizeof(worker_t));
+    for (i=0; i<args->nworker; i++)
+    {
+        worker_t *w = &args->worker[i];
+        w->args = args;
+        w->buffered = i ? 1 : 0;
+        w->hmm = hmm_init(2, tprob, 10000);
+        if ( args->genmap_fname ) 
+            hmm_set_tprob_func(w->hmm, set_tprob_genmap, w);
+        else if ( args->rec_rate > 0 )
+            hmm_set_tprob_func(w->hmm, set_tprob_rrate, w);
+    }
 
     args->out = bgzf_open(strcmp("stdout",args->output_fname)?args->output_fname:"-", args->output_type&OUTPUT_GZ ? "wg" : "wu"); 
     if ( !args->out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
@@ -352,16 +382,23 @@ static void destroy_data(args_t *args)
         free(args->smpl[i].rid_off);
         free(args->smpl[i].snapshot);
     }
+    for (i=0; i<args->nworker; i++)
+    {
+        hmm_destroy(args->worker[i].hmm);
+        free(args->worker[i].str.s);
+    }
+    blkpipe_destroy(args->pipe);
+    free(args->worker);
     free(args->str.s);
     free(args->smpl);
     if ( args->af_smpl ) smpl_ilist_destroy(args->af_smpl);
     smpl_ilist_destroy(args->roh_smpl);
     free(args->rids);
     free(args->rid_offs);
-    hmm_destroy(args->hmm);
     bcf_sr_destroy(args->files);
     free(args->AFs); free(args->pdg);
     free(args->genmap);
+    free(args->genmap_loaded);
     free(args->itmp);
     free(args->samples);
 }
@@ -382,10 +419,20 @@ static int load_genmap(args_t *args, const char *chr)
     else
         fname = args->genmap_fname;
 
+    // the same file for all chromosomes or a chromosome revisited, no need to parse it again
+    if ( args->genmap_loaded && !strcmp(args->genmap_loaded,fname) )
+    {
+        free(str.s);
+        return 0;
+    }
+    free(args->genmap_loaded);
+    args->genmap_loaded = NULL;
+
     htsFile *fp = hts_open(fname, "rb");
     if ( !fp )
     {
         args->ngenmap = 0;
+        free(str.s);
         return -1;
     }
 
@@ -393,7 +440,7 @@ static int load_genmap(args_t *args, const char *chr)
     if ( strcmp(str.s,"position COMBINED_rate(cM/Mb) Genetic_Map(cM)") )
         error("Unexpected header in %s, found:\n\t[%s], but expected:\n\t[position COMBINED_rate(cM/Mb) Genetic_Map(cM)]\n", fname, str.s);
 
-    args->ngenmap = args->igenmap = 0;
+    args->ngenmap = 0;
     while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
     {
         args->ngenmap++;
@@ -414,45 +461,79 @@ static int load_genmap(args_t *args, const char *chr)
         gm->rate = strtod(tmp+1, &end);
         if ( tmp+1==end ) error("Could not parse %s: %s\n", fname, str.s);
         gm->rate *= 0.01;
+
+        // the lookup in get_genmap_rate() relies on the map being sorted
+        if ( args->ngenmap > 1 && gm->pos < gm[-1].pos ) error("The genetic map is not sorted: %s\n", fname);
     }
     if ( !args->ngenmap ) error("Genetic map empty?\n");
     if ( hts_close(fp) ) error("Close failed\n");
+    args->genmap_loaded = strdup(fname);
     free(str.s);
     return 0;
 }
 
-static double get_genmap_rate(args_t *args, int start, int end)
+// the first index in [beg,end) with genmap[i].pos >= pos, or end if there is none
+static inline int genmap_lower_bound(genmap_t *genmap, int beg, int end, int pos)
+{
+    while ( beg < end )
+    {
+        int mid = beg + (end - beg)/2;
+        if ( genmap[mid].pos < pos ) beg = mid + 1;
+        else end = mid;
+    }
+    return beg;
+}
+
+static double get_genmap_rate(args_t *args, int *igenmap, int start, int end)
 {
-    // position i to be equal to or smaller than start
-    int i = args->igenmap;
+    // position i to be the last one equal to or smaller than start. The sites come sorted
+    // so the cursor usually moves by a step or two, binary search only when it is far. The
+    // result must not depend on the cursor, the forward-backward algorithm revisits sites
+    int i = *igenmap;
     if ( args->genmap[i].pos > start )
     {
-        while ( i>0 && args->genmap[i].pos > start ) i--;
+        if ( i>0 && args->genmap[i-1].pos > start )
+        {
+            i = genmap_lower_bound(args->genmap, 0, i, start+1) - 1;
+            if ( i<0 ) i = 0;
+        }
+        else if ( i>0 ) i--;
     }
     else
     {
-        while ( i+1<args->ngenmap && args->genmap[i+1].pos < start ) i++;
+        if ( i+2<args->ngenmap && args->genmap[i+2].pos <= start )
+            i = genmap_lower_bound(args->genmap, i+1, args->ngenmap, start+1) - 1;
+        else if ( i+1<args->ngenmap && args->genmap[i+1].pos <= start ) i++;
     }
     // position j to be equal or larger than end
     int j = i;
-    while ( j+1<args->ngenmap && args->genmap[j].pos < end ) j++;
+    if ( j+1<args->ngenmap && args->genmap[j].pos < end )
+    {
+        if ( args->genmap[j+1].pos < end )
+        {
+            j = genmap_lower_bound(args->genmap, j+1, args->ngenmap, end);
+            if ( j==args->ngenmap ) j--;
+        }
+        else j++;
+    }
     if ( i==j )
     {
-        args->igenmap = i;
+        *igenmap = i;
         return 0;
     }
 
     if ( start <  args->genmap[i].pos ) start = args->genmap[i].pos;
     if ( end >  args->genmap[j].pos ) end = args->genmap[j].pos;
     double rate = (args->genmap[j].rate - args->genmap[i].rate)/(args->genmap[j].pos - args->genmap[i].pos) * (end-start);
-    args->igenmap = j;
+    *igenmap = j;
     return rate;
 }
 
 void set_tprob_genmap(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob)
 {
-    args_t *args = (args_t*) data;
-    double ci = get_genmap_rate(args, prev_pos, pos);
+    worker_t *w = (worker_t*) data;
+    args_t *args = w->args;
+    double ci = get_genmap_rate(args, &w->igenmap, prev_pos, pos);
     if ( args->rec_rate ) ci *= args->rec_rate;
     if ( ci > 1 ) ci = 1;
     MAT(tprob,2,STATE_HW,STATE_AZ) *= ci;
@@ -463,7 +544,7 @@ void set_tprob_genmap(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, d
 
 void set_tprob_rrate(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob)
 {
-    args_t *args = (args_t*) data;
+    args_t *args = ((worker_t*) data)->args;
     double ci = (pos - prev_pos) * args->rec_rate;
     if ( ci > 1 ) ci = 1;
     MAT(tprob,2,STATE_HW,STATE_AZ) *= ci;
@@ -498,7 +579,38 @@ void set_tprob_rrate(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, do
  *
  */
 
-static void flush_viterbi(args_t *args, int ismpl)
+static void write_output(args_t *args, kstring_t *str)
+{
+    if ( !str->l ) return;
+    if ( bgzf_write(args->out, str->s, str->l) != str->l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+    str->l = 0;
+}
+
+// Called by hmm_run_fwd_bwd_ckpt() in the reverse order of the sites. The phred
+// quality of the Viterbi state replaces the emission probabilities of the site,
+// which are no longer needed, so that the posteriors of all sites are never kept
+typedef struct
+{
+    double *eprob;
+    uint8_t *vpath;
+    int nsites;     // the number of sites to set, the overlap with the next batch is left intact
+}
+site_qual_t;
+
+static void set_site_qual(hmm_t *hmm, int isite, double *fwd_bwd, void *data)
+{
+    site_qual_t *dat = (site_qual_t*) data;
+    if ( isite >= dat->nsites ) return;
+    int state = dat->vpath[isite*2]==STATE_AZ ? 1 : 0;
+    dat->eprob[isite*2] = phred_score(1.0 - fwd_bwd[state]);
+}
+
+/*
+ *  Run the HMM for one sample. The output is appended to w->str, unbuffered
+ *  workers write it out as it accumulates. Only the sample's own data and the
+ *  worker are modified so that multiple samples can be processed in parallel.
+ */
+static void flush_viterbi(args_t *args, worker_t *w, int ismpl)
 {
     smpl_t *smpl = &args->smpl[ismpl];
     if ( !smpl->nsites ) return;
@@ -509,29 +621,25 @@ static void flush_viterbi(args_t *args, int ismpl)
 
     if ( !args->vi_training ) // single viterbi pass
     {
-        hmm_restore(args->hmm, smpl->snapshot); 
+        hmm_restore(w->hmm, smpl->snapshot); 
         int end = (args->nbuf_max && smpl->nsites >= args->nbuf_max && smpl->nsites > args->nbuf_olap) ? smpl->nsites - args->nbuf_olap : smpl->nsites;
         if ( end < smpl->nsites )
-            smpl->snapshot = hmm_snapshot(args->hmm, smpl->snapshot, smpl->sites[smpl->nsites - args->nbuf_olap - 1]);
+            smpl->snapshot = hmm_snapshot(w->hmm, smpl->snapshot, smpl->sites[smpl->nsites - args->nbuf_olap - 1]);
 
-        args->igenmap = smpl->igenmap;
-        hmm_run_viterbi(args->hmm, smpl->nsites, smpl->eprob, smpl->sites);
-        hmm_run_fwd_bwd(args->hmm, smpl->nsites, smpl->eprob, smpl->sites);
-        double *fwd = hmm_get_fwd_bwd_prob(args->hmm);
+        w->igenmap = smpl->igenmap;
+        hmm_run_viterbi(w->hmm, smpl->nsites, smpl->eprob, smpl->sites);
+        uint8_t *vpath   = hmm_get_viterbi_path(w->hmm);
+        site_qual_t qdat = { smpl->eprob, vpath, end };
+        hmm_run_fwd_bwd_ckpt(w->hmm, smpl->nsites, smpl->eprob, smpl->sites, set_site_qual, &qdat);
 
         const char *chr  = bcf_hdr_id2name(args->hdr,args->prev_rid);
-        uint8_t *vpath   = hmm_get_viterbi_path(args->hmm);
 
         for (i=0; i<end; i++)
         {
             int state = vpath[i*2]==STATE_AZ ? 1 : 0;
-            double qual = phred_score(1.0 - fwd[i*2 + state]);
+            double qual = smpl->eprob[i*2];
             if ( args->output_type & OUTPUT_ST )
-            {
-                args->str.l = 0;
-                ksprintf(&args->str, "ST\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[i]+1, state, qual);
-                if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
-            }
+                ksprintf(&w->str, "ST\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[i]+1, state, qual);
 
             if ( args->output_type & OUTPUT_RG )
             {
@@ -539,10 +647,8 @@ static void flush_viterbi(args_t *args, int ismpl)
                 {
                     if ( !state )   // the region ends, flush
                     {
-                        args->str.l = 0;
-                        ksprintf(&args->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
+                        ksprintf(&w->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
                                 smpl->rg.beg+1,smpl->rg.end+1,smpl->rg.end-smpl->rg.beg+1,smpl->rg.nqual,smpl->rg.qual/smpl->rg.nqual);
-                        if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
                         smpl->rg.state = 0;
                     }
                     else
@@ -562,6 +668,7 @@ static void flush_viterbi(args_t *args, int ismpl)
                     smpl->rg.end  = smpl->sites[i];
                 }
             }
+            if ( !w->buffered && w->str.l > OUTPUT_BUF ) write_output(args, &w->str);
         }
 
         if ( end < smpl->nsites )
@@ -570,7 +677,7 @@ static void flush_viterbi(args_t *args, int ismpl)
             memmove(smpl->sites, smpl->sites + end, sizeof(*smpl->sites)*args->nbuf_olap);
             memmove(smpl->eprob, smpl->eprob + end*2, sizeof(*smpl->eprob)*args->nbuf_olap*2);
             smpl->nsites  = args->nbuf_olap;
-            smpl->igenmap = args->igenmap;
+            smpl->igenmap = w->igenmap;
         }
         else
         {
@@ -579,14 +686,12 @@ static void flush_viterbi(args_t *args, int ismpl)
 
             if ( smpl->rg.state )
             {
-                args->str.l = 0;
-                ksprintf(&args->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
+                ksprintf(&w->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
                         smpl->rg.beg+1,smpl->rg.end+1,smpl->rg.end-smpl->rg.beg+1,smpl->rg.nqual,smpl->rg.qual/smpl->rg.nqual);
-                if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
                 smpl->rg.state = 0;
             }
         }
-
+        if ( !w->buffered ) write_output(args, &w->str);
         return;
     }
 
@@ -595,17 +700,17 @@ static void flush_viterbi(args_t *args, int ismpl)
     double t2az_prev, t2hw_prev;
     double deltaz, delthw;
 
-    double *tprob_arr = hmm_get_tprob(args->hmm);
+    double *tprob_arr = hmm_get_tprob(w->hmm);
     MAT(tprob_arr,2,STATE_HW,STATE_HW) = 1 - args->t2AZ;
     MAT(tprob_arr,2,STATE_HW,STATE_AZ) = args->t2HW;
     MAT(tprob_arr,2,STATE_AZ,STATE_HW) = args->t2AZ;
     MAT(tprob_arr,2,STATE_AZ,STATE_AZ) = 1 - args->t2HW; 
-    hmm_set_tprob(args->hmm, tprob_arr, 10000);
+    hmm_set_tprob(w->hmm, tprob_arr, 10000);
 
     int niter = 0;
     do
     {
-        tprob_arr = hmm_get_tprob(args->hmm);
+        tprob_arr = hmm_get_tprob(w->hmm);
         t2az_prev = MAT(tprob_arr,2,STATE_AZ,STATE_HW); //args->t2AZ;
         t2hw_prev = MAT(tprob_arr,2,STATE_HW,STATE_AZ); //args->t2HW;
         double tprob_new[] = { 0,0,0,0 };
@@ -613,25 +718,24 @@ static void flush_viterbi(args_t *args, int ismpl)
         {
             int ioff = smpl->rid_off[i];
             int nsites = (i+1==smpl->nrid ? smpl->nsites : smpl->rid_off[i+1]) - ioff;
-            args->igenmap = 0;
-            tprob_arr = hmm_run_baum_welch(args->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
+            w->igenmap = 0;
+            tprob_arr = hmm_run_baum_welch(w->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
             for (j=0; j<2; j++)
                 for (k=0; k<2; k++) MAT(tprob_new,2,j,k) += MAT(tprob_arr,2,j,k);
         }
         for (j=0; j<2; j++)
             for (k=0; k<2; k++) MAT(tprob_new,2,j,k) /= smpl->nrid;
 
-        hmm_set_tprob(args->hmm, tprob_new, 10000);
+        hmm_set_tprob(w->hmm, tprob_new, 10000);
 
         deltaz = fabs(MAT(tprob_new,2,STATE_AZ,STATE_HW)-t2az_prev);
         delthw = fabs(MAT(tprob_new,2,STATE_HW,STATE_AZ)-t2hw_prev);
         niter++;
-        args->str.l = 0;
-        ksprintf(&args->str, "VT\t%s\t%d\t%e\t%e\t%e\t%e\t%e\t%e\n", 
+        ksprintf(&w->str, "VT\t%s\t%d\t%e\t%e\t%e\t%e\t%e\t%e\n", 
             name,niter,deltaz,delthw,
             1-MAT(tprob_new,2,STATE_HW,STATE_HW),MAT(tprob_new,2,STATE_AZ,STATE_HW),
             1-MAT(tprob_new,2,STATE_AZ,STATE_AZ),MAT(tprob_new,2,STATE_HW,STATE_AZ));
-        if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+        if ( !w->buffered ) write_output(args, &w->str);
     }
     while ( deltaz > args->baum_welch_th || delthw > args->baum_welch_th );
     
@@ -640,22 +744,63 @@ static void flush_viterbi(args_t *args, int ismpl)
     {
         int ioff = smpl->rid_off[i];
         int nsites = (i+1==smpl->nrid ? smpl->nsites : smpl->rid_off[i+1]) - ioff;
-        args->igenmap = 0;
-        hmm_run_viterbi(args->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
-        hmm_run_fwd_bwd(args->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
-        uint8_t *vpath = hmm_get_viterbi_path(args->hmm);
-        double  *fwd   = hmm_get_fwd_bwd_prob(args->hmm);
+        w->igenmap = 0;
+        hmm_run_viterbi(w->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff);
+        uint8_t *vpath = hmm_get_viterbi_path(w->hmm);
+        site_qual_t qdat = { smpl->eprob+ioff*2, vpath, nsites };
+        hmm_run_fwd_bwd_ckpt(w->hmm, nsites, smpl->eprob+ioff*2, smpl->sites+ioff, set_site_qual, &qdat);
 
         const char *chr = bcf_hdr_id2name(args->hdr,smpl->rid[i]);
         for (j=0; j<nsites; j++)
         {
             int state = vpath[j*2]==STATE_AZ ? 1 : 0;
-            double *pval = fwd + j*2;
-            args->str.l = 0;
-            ksprintf(&args->str, "ROH\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[ioff+j]+1, state, phred_score(1.0-pval[state]));
-            if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+            ksprintf(&w->str, "ROH\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[ioff+j]+1, state, smpl->eprob[(ioff+j)*2]);
+            if ( !w->buffered && w->str.l > OUTPUT_BUF ) write_output(args, &w->str);
         }
     }
+    if ( !w->buffered ) write_output(args, &w->str);
+}
+
+static void *flush_viterbi_job(void *data)
+{
+    worker_t *w = (worker_t*) data;
+    flush_viterbi(w->args, w, w->ismpl);
+    return w;
+}
+
+static void output_viterbi_job(void *usr, void *data)
+{
+    worker_t *w = (worker_t*) data;
+    write_output(w->args, &w->str);
+}
+
+/*
+ *  Flush all samples. With --threads the samples are processed concurrently,
+ *  each by its own worker, and the output is written in the sample order.
+ */
+static void flush_all_viterbi(args_t *args)
+{
+    int i;
+    if ( !args->pool )
+    {
+        for (i=0; i<args->roh_smpl->n; i++) flush_viterbi(args, &args->worker[0], i);
+        return;
+    }
+    if ( !args->pipe )
+    {
+        void **jobs = (void**) malloc(sizeof(void*)*(args->nworker-1));
+        for (i=1; i<args->nworker; i++) jobs[i-1] = &args->worker[i];
+        args->pipe = blkpipe_init(args->pool, args->nworker-1, jobs, flush_viterbi_job, output_viterbi_job, args);
+        free(jobs);
+    }
+    for (i=0; i<args->roh_smpl->n; i++)
+    {
+        if ( !args->smpl[i].nsites ) continue;
+        worker_t *w = (worker_t*) blkpipe_get(args->pipe);
+        w->ismpl = i;
+        blkpipe_dispatch(args->pipe, w);
+    }
+    blkpipe_flush(args->pipe);
 }
 
 int read_AF(bcf_sr_regions_t *tgt, bcf1_t *line, double *alt_freq)
@@ -980,7 +1125,7 @@ int process_line(args_t *args, bcf1_t *line, int ial)
                 smpl->rid_off[smpl->nrid-1] = smpl->nsites - 1;
             }
         }
-        else if ( args->nbuf_max && smpl->nsites >= args->nbuf_max ) flush_viterbi(args, i);
+        else if ( args->nbuf_max && smpl->nsites >= args->nbuf_max ) flush_viterbi(args, &args->worker[0], i);
     }
 
     return 0;
@@ -993,7 +1138,7 @@ static void vcfroh(args_t *args, bcf1_t *line)
     // Are we done?
     if ( !line )
     { 
-        for (i=0; i<args->roh_smpl->n; i++) flush_viterbi(args, i);
+        flush_all_viterbi(args);
         return; 
     }
 
@@ -1021,21 +1166,15 @@ static void vcfroh(args_t *args, bcf1_t *line)
 
     if ( args->snps_only && !bcf_is_snp(line) ) return;
 
-    // Initialize genetic map
+    // New chromosome? This also loads the genetic map for the first one
     int skip_rid = 0;
-    if ( args->prev_rid<0 )
-        skip_rid = load_genmap(args, bcf_seqname(args->hdr,line));
-
-    // New chromosome?
     if ( args->prev_rid!=line->rid )
     {
         if ( !args->vi_training )
         {
+            flush_all_viterbi(args);
             for (i=0; i<args->roh_smpl->n; i++)
-            {
-                flush_viterbi(args, i);
-                hmm_reset(args->hmm, args->smpl[i].snapshot);
-            }
+                hmm_reset(args->worker[0].hmm, args->smpl[i].snapshot);
         }
         args->prev_rid = line->rid;
         args->prev_pos = line->pos;
@@ -1096,7 +1235,7 @@ static void usage(args_t *args)
     fprintf(stderr, "    -S, --samples-file <file>          file of samples to analyze [all samples]\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
-    fprintf(stderr, "        --threads <int>                use multithreading with <int> worker threads [0]\n");
+    fprintf(stderr, "        --threads <int>                use multithreading with <int> worker threads, samples are processed in parallel [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "HMM Options:\n");
     fprintf(stderr, "    -a, --hw-to-az <float>             P(AZ|HW) transition probability from HW (Hardy-Weinberg) to AZ (autozygous) state [6.7e-8]\n");
@@ -37,12 +37,16 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/hts_os.h>
+#include <htslib/thread_pool.h>
 #include <inttypes.h>
 #include "bcftools.h"
+#include "blkpipe.h"
 
 #define SOM_TRAIN    1
 #define SOM_CLASSIFY 2
 
+#define SOM_BATCH 4096  // number of vectors scored by one job with --threads
+
 typedef struct
 {
     int ndim;       // dimension of the map (2D, 3D, ...)
@@ -50,15 +54,31 @@ typedef struct
     int size;       // pow(nbin,ndim)
     int kdim;       // dimension of the input vectors
     int nt, t;      // total number of learning cycles and the current cycle
-    double *w, *c;  // weights and counts (sum of learning influence)
+    double *w, *c;  // weights and counts (sum of learning influence). The weights are stored by
+                    //  dimension, w[k*size+i] is the k-th weight of the i-th node, so that the
+                    //  loops over nodes in som_node_dists() and som_train_site() vectorize
     double learn;   // learning rate
     double bmu_th;  // best-matching unit threshold
     int *a_idx, *b_idx; // temp arrays for traversing variable number of nested loops
     double *div;        // dtto
+    int *coord;         // coordinates of the nodes in the map, coord[i*ndim+j], see som_idx_to_ndim()
+    double *dist, *infl;    // temp arrays for training: node distances and learning influence
 }
 som_t;
 
+// A batch of vectors scored by one job with --threads
 typedef struct
+{
+    struct _args_t *args;
+    int n, m;
+    double *vec;        // the vectors, n*kdim values
+    int *iskip;         // the map to skip for each vector, -1 for none
+    double *score;      // the merged scores
+    double *dist;       // temp array for som_node_dists()
+}
+som_batch_t;
+
+typedef struct _args_t
 {
     // SOM parameters
     double bmu_th, learn;
@@ -79,6 +99,14 @@ typedef struct
     int rand_seed, good_class, bad_class;
     char **argv, *fname, *prefix;
     int argc, action, train_bad, merge;
+
+    // scoring in batches, see score_push()
+    int n_threads, nbatch;
+    hts_tpool *pool;
+    blkpipe_t *pipe;
+    som_batch_t **batch, *cur;
+    double *eval_score;         // scores of the training sites for evaluation
+    int neval;
 }
 args_t;
 
@@ -163,19 +191,24 @@ void annots_reader_close(args_t *args)
     hts_close(args->file);
 }
 
+// The map file stores the weights node by node, as in SOMv1
 static void som_write_map(char *prefix, som_t **som, int nsom)
 {
     FILE *fp = open_file(NULL,"w","%s.som",prefix);
-    size_t nw;
-    if ( (nw=fwrite("SOMv1",5,1,fp))!=5 ) error("Failed to write 5 bytes\n");
-    if ( (nw=fwrite(&nsom,sizeof(int),1,fp))!=sizeof(int) ) error("Failed to write %zu bytes\n",sizeof(int));
-    int i;
+    if ( fwrite("SOMv1",5,1,fp)!=1 ) error("Failed to write 5 bytes\n");
+    if ( fwrite(&nsom,sizeof(int),1,fp)!=1 ) error("Failed to write %zu bytes\n",sizeof(int));
+    int i, j, k;
     for (i=0; i<nsom; i++)
     {
-        if ( (nw=fwrite(&som[i]->size,sizeof(int),1,fp))!=sizeof(int) ) error("Failed to write %zu bytes\n",sizeof(int));
-        if ( (nw=fwrite(&som[i]->kdim,sizeof(int),1,fp))!=sizeof(int) ) error("Failed to write %zu bytes\n",sizeof(int));
-        if ( (nw=fwrite(som[i]->w,sizeof(double),som[i]->size*som[i]->kdim,fp))!=sizeof(double)*som[i]->size*som[i]->kdim ) error("Failed to write %zu bytes\n",sizeof(double)*som[i]->size*som[i]->kdim);
-        if ( (nw=fwrite(som[i]->c,sizeof(double),som[i]->size,fp))!=sizeof(double)*som[i]->size ) error("Failed to write %zu bytes\n",sizeof(double)*som[i]->size);
+        size_t nw = (size_t)som[i]->size*som[i]->kdim;
+        double *w = (double*) malloc(sizeof(double)*nw);
+        for (j=0; j<som[i]->size; j++)
+            for (k=0; k<som[i]->kdim; k++) w[(size_t)j*som[i]->kdim+k] = som[i]->w[(size_t)k*som[i]->size+j];
+        if ( fwrite(&som[i]->size,sizeof(int),1,fp)!=1 ) error("Failed to write %zu bytes\n",sizeof(int));
+        if ( fwrite(&som[i]->kdim,sizeof(int),1,fp)!=1 ) error("Failed to write %zu bytes\n",sizeof(int));
+        if ( fwrite(w,sizeof(double),nw,fp)!=nw ) error("Failed to write %zu bytes\n",sizeof(double)*nw);
+        if ( fwrite(som[i]->c,sizeof(double),som[i]->size,fp)!=som[i]->size ) error("Failed to write %zu bytes\n",sizeof(double)*som[i]->size);
+        free(w);
     }
     if ( fclose(fp) ) error("%s.som: fclose failed\n",prefix);
 }
@@ -188,16 +221,21 @@ static som_t** som_load_map(char *prefix, int *nsom)
     if ( fread(nsom,sizeof(int),1,fp)!=1 ) error("Could not read %s.som\n", prefix);
     som_t **som = (som_t**)malloc(*nsom*sizeof(som_t*));
 
-    int i;
+    int i, j, k;
     for (i=0; i<*nsom; i++)
     {
         som[i] = (som_t*) calloc(1,sizeof(som_t));
         if ( fread(&som[i]->size,sizeof(int),1,fp) != 1 ) error("Could not read %s.som\n", prefix);
         if ( fread(&som[i]->kdim,sizeof(int),1,fp) != 1 ) error("Could not read %s.som\n", prefix);
-        som[i]->w = (double*) malloc(sizeof(double)*som[i]->size*som[i]->kdim);
+        size_t nw = (size_t)som[i]->size*som[i]->kdim;
+        double *w = (double*) malloc(sizeof(double)*nw);
+        som[i]->w = (double*) malloc(sizeof(double)*nw);
         som[i]->c = (double*) malloc(sizeof(double)*som[i]->size);
-        if ( fread(som[i]->w,sizeof(double),som[i]->size*som[i]->kdim,fp) != som[i]->size*som[i]->kdim ) error("Could not read from %s.som\n", prefix);
+        if ( fread(w,sizeof(double),nw,fp) != nw ) error("Could not read from %s.som\n", prefix);
         if ( fread(som[i]->c,sizeof(double),som[i]->size,fp) != som[i]->size ) error("Could not read from %s.som\n", prefix);
+        for (j=0; j<som[i]->size; j++)
+            for (k=0; k<som[i]->kdim; k++) som[i]->w[(size_t)k*som[i]->size+j] = w[(size_t)j*som[i]->kdim+k];
+        free(w);
     }
     if ( fclose(fp) ) error("%s.som: fclose failed\n",prefix);
     return som;
@@ -241,47 +279,51 @@ static void som_create_plot(som_t *som, char *prefix)
     fclose(fp);
     free(fname);
 }
+// Squared Euclidean distances of all nodes from the input vector. The inner
+// loop runs over contiguous nodes and vectorizes, the sum for each node is
+// accumulated in the same order as when looping over the dimensions of a node
+static inline void som_node_dists(som_t *som, const double *vec, double *restrict dist)
+{
+    int i, k, size = som->size;
+    for (i=0; i<size; i++) dist[i] = 0;
+    for (k=0; k<som->kdim; k++)
+    {
+        const double *restrict w = som->w + (size_t)k*size;
+        double v = vec[k];
+        for (i=0; i<size; i++)
+        {
+            double d = v - w[i];
+            dist[i] += d*d;
+        }
+    }
+}
 // Find the best matching unit: the node with minimum distance from the input vector
-static inline int som_find_bmu(som_t *som, double *vec, double *dist)
+static inline int som_find_bmu(som_t *som, double *vec, double *tmp, double *dist)
 {
-    double *ptr = som->w;
-    double min_dist = HUGE_VAL;
-    int min_idx = 0;
+    som_node_dists(som, vec, tmp);
 
-    int i, k;
+    double min_dist = HUGE_VAL;
+    int i, min_idx = 0;
     for (i=0; i<som->size; i++)
     {
-        double dist = 0;
-        for (k=0; k<som->kdim; k++)
-            dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
-        if ( dist < min_dist )
+        if ( tmp[i] < min_dist )
         {
-            min_dist = dist;
+            min_dist = tmp[i];
             min_idx  = i;
         }
-        ptr += som->kdim;
     }
 
     if ( dist ) *dist = min_dist;
     return min_idx;
 }
-static inline double som_get_score(som_t *som, double *vec, double bmu_th)
+static inline double som_get_score(som_t *som, double *vec, double bmu_th, double *tmp)
 {
-    double *ptr = som->w;
-    double min_dist = HUGE_VAL;
+    som_node_dists(som, vec, tmp);
 
-    int i, k;
+    double min_dist = HUGE_VAL;
+    int i;
     for (i=0; i<som->size; i++)
-    {
-        if ( som->c[i] >= bmu_th )
-        {
-            double dist = 0;
-            for (k=0; k<som->kdim; k++)
-                dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
-            if ( dist < min_dist ) min_dist = dist;
-        }
-        ptr += som->kdim;
-    }
+        if ( som->c[i] >= bmu_th && tmp[i] < min_dist ) min_dist = tmp[i];
     return sqrt(min_dist);
 }
 // Convert flat index to that of a k-dimensional cube
@@ -306,32 +348,36 @@ static void som_train_site(som_t *som, double *vec, int update_counts)
     double radius = som->nbin * dt; radius *= radius;
 
     // find the best matching unit and its indexes
-    int min_idx = som_find_bmu(som, vec, NULL);
-    som_idx_to_ndim(som, min_idx, som->a_idx);
+    int min_idx = som_find_bmu(som, vec, som->dist, NULL);
+    int *a_idx  = som->coord + min_idx*som->ndim;
 
-    // update the weights: traverse the map and make all nodes within the
-    // radius more similar to the input vector
-    double *ptr = som->w;
-    double *cnt = som->c;
+    // update the weights: make all nodes within the radius more similar to
+    // the input vector. The influence is zero outside of the radius, the
+    // weights of those nodes are unchanged
     int i, j, k;
     for (i=0; i<som->size; i++)
     {
-        som_idx_to_ndim(som, i, som->b_idx);
+        int *b_idx = som->coord + i*som->ndim;
         double dist = 0;
         for (j=0; j<som->ndim; j++)
-            dist += (som->a_idx[j] - som->b_idx[j]) * (som->a_idx[j] - som->b_idx[j]);
+            dist += (a_idx[j] - b_idx[j]) * (a_idx[j] - b_idx[j]);
+        som->infl[i] = 0;
         if ( dist <= radius )
         {
-            double influence = exp(-dist*dist*0.5/radius) * learning_rate;
-            for (k=0; k<som->kdim; k++)
-                ptr[k] += influence * (vec[k] - ptr[k]);
+            som->infl[i] = exp(-dist*dist*0.5/radius) * learning_rate;
 
             // Bad sites may help to shape the map, but only nodes with big enough
             // influence will be used for classification.
-            if ( update_counts ) *cnt += influence;
+            if ( update_counts ) som->c[i] += som->infl[i];
         }
-        ptr += som->kdim;
-        cnt++;
+    }
+    for (k=0; k<som->kdim; k++)
+    {
+        double *restrict w = som->w + (size_t)k*som->size;
+        const double *restrict infl = som->infl;
+        double v = vec[k];
+        for (i=0; i<som->size; i++)
+            w[i] += infl[i] * (v - w[i]);
     }
 }
 static void som_norm_counts(som_t *som)
@@ -356,20 +402,27 @@ static som_t *som_init(args_t *args)
     som->w = (double*) malloc(sizeof(double)*som->size*som->kdim);
     if ( !som->w ) error("Could not alloc %"PRIu64" bytes [nbin=%d ndim=%d kdim=%d]\n", (uint64_t)(sizeof(double)*som->size*som->kdim),som->nbin,som->ndim,som->kdim);
     som->c = (double*) calloc(som->size,sizeof(double));
-    if ( !som->w ) error("Could not alloc %"PRIu64" bytes [nbin=%d ndim=%d]\n", (uint64_t)(sizeof(double)*som->size),som->nbin,som->ndim);
-    int i;
-    for (i=0; i<som->size*som->kdim; i++)
-        som->w[i] = random();
+    if ( !som->c ) error("Could not alloc %"PRIu64" bytes [nbin=%d ndim=%d]\n", (uint64_t)(sizeof(double)*som->size),som->nbin,som->ndim);
+    int i, k;
+    for (i=0; i<som->size; i++)    // the same sequence of random numbers as with the weights stored node by node
+        for (k=0; k<som->kdim; k++)
+            som->w[(size_t)k*som->size+i] = random();
     som->a_idx = (int*) malloc(sizeof(int)*som->ndim);
     som->b_idx = (int*) malloc(sizeof(int)*som->ndim);
     som->div   = (double*) malloc(sizeof(double)*som->ndim);
     for (i=0; i<som->ndim; i++)
         som->div[i] = pow(som->nbin,som->ndim-i-1);
+    som->coord = (int*) malloc(sizeof(int)*som->size*som->ndim);
+    for (i=0; i<som->size; i++)
+        som_idx_to_ndim(som, i, som->coord + i*som->ndim);
+    som->dist = (double*) malloc(sizeof(double)*som->size);
+    som->infl = (double*) malloc(sizeof(double)*som->size);
     return som;
 }
 static void som_destroy(som_t *som)
 {
     free(som->a_idx); free(som->b_idx); free(som->div);
+    free(som->coord); free(som->dist); free(som->infl);
     free(som->w); free(som->c);
     free(som);
 }
@@ -382,6 +435,9 @@ static void init_data(args_t *args)
 
     if ( args->action==SOM_CLASSIFY )
         args->som = som_load_map(args->prefix,&args->nfold);
+
+    if ( args->n_threads>0 && !(args->pool = hts_tpool_init(args->n_threads)) )
+        error("Could not initialize %d threads\n", args->n_threads);
 }
 static void destroy_data(args_t *args)
 {
@@ -395,47 +451,173 @@ static void destroy_data(args_t *args)
     free(args->som);
     free(args->vals);
     free(args->str.s);
+    if ( args->pool ) hts_tpool_destroy(args->pool);
 }
 
 #define MERGE_MIN 0
 #define MERGE_MAX 1
 #define MERGE_AVG 2
-static double get_min_score(args_t *args, int iskip)
+static double get_min_score(args_t *args, double *vec, int iskip, double *tmp)
 {
     int i;
     double score, min_score = HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vec, args->bmu_th, tmp);
         if ( i==0 || score < min_score ) min_score = score;
     }
     return min_score;
 }
-static double get_max_score(args_t *args, int iskip)
+static double get_max_score(args_t *args, double *vec, int iskip, double *tmp)
 {
     int i;
     double score, max_score = -HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vec, args->bmu_th, tmp);
         if ( i==0 || max_score < score ) max_score = score;
     }
     return max_score;
 }
-static double get_avg_score(args_t *args, int iskip)
+static double get_avg_score(args_t *args, double *vec, int iskip, double *tmp)
 {
     int i, n = 0;
     double score = 0;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score += som_get_score(args->som[i], args->vals, args->bmu_th);
+        score += som_get_score(args->som[i], vec, args->bmu_th, tmp);
         n++;
     }
     return score/n;
 }
+// The score of the vector merged across the maps, 1 is the best, 0 the worst
+static double get_score(args_t *args, double *vec, int iskip, double *tmp)
+{
+    double score = 0;
+    switch (args->merge)
+    {
+        case MERGE_MIN: score = get_min_score(args, vec, iskip, tmp); break;
+        case MERGE_MAX: score = get_max_score(args, vec, iskip, tmp); break;
+        case MERGE_AVG: score = get_avg_score(args, vec, iskip, tmp); break;
+    }
+    return 1.0 - score/sqrt(args->som[0]->kdim);
+}
+
+/*
+    With --threads, the maps are trained in parallel, each by its own worker
+    thread, and the sites are scored in parallel in batches of SOM_BATCH
+    vectors. The maps are independent and each sees its training sites in the
+    same order as without threads, so the results do not depend on the number
+    of threads.
+*/
+typedef struct
+{
+    args_t *args;
+    int isom, ntrain;
+}
+train_job_t;
+
+static void *train_map(void *arg)
+{
+    train_job_t *job = (train_job_t*) arg;
+    args_t *args = job->args;
+    int i;
+    for (i=0; i<job->ntrain; i++)
+    {
+        int is_good = args->train_class[i] & 1;
+        int isom    = args->train_class[i] >> 1;
+        if ( isom!=job->isom ) continue;
+        if ( is_good || args->train_bad )
+            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+    }
+    return job;
+}
+
+static som_batch_t *batch_init(args_t *args)
+{
+    som_batch_t *batch = (som_batch_t*) calloc(1,sizeof(som_batch_t));
+    batch->args  = args;
+    batch->m     = SOM_BATCH;
+    batch->vec   = (double*) malloc(sizeof(double)*batch->m*args->mvals);
+    batch->iskip = (int*) malloc(sizeof(int)*batch->m);
+    batch->score = (double*) malloc(sizeof(double)*batch->m);
+    batch->dist  = (double*) malloc(sizeof(double)*args->som[0]->size);
+    return batch;
+}
+static void batch_destroy(som_batch_t *batch)
+{
+    free(batch->vec);
+    free(batch->iskip);
+    free(batch->score);
+    free(batch->dist);
+    free(batch);
+}
+static void *score_batch(void *arg)
+{
+    som_batch_t *batch = (som_batch_t*) arg;
+    args_t *args = batch->args;
+    int i;
+    for (i=0; i<batch->n; i++)
+        batch->score[i] = get_score(args, batch->vec+i*args->mvals, batch->iskip[i], batch->dist);
+    return batch;
+}
+static void output_batch(void *usr, void *arg)
+{
+    args_t *args = (args_t*) usr;
+    som_batch_t *batch = (som_batch_t*) arg;
+    int i;
+    if ( args->action==SOM_CLASSIFY )
+        for (i=0; i<batch->n; i++) printf("%e\n", batch->score[i]);
+    else
+        for (i=0; i<batch->n; i++) args->eval_score[args->neval++] = batch->score[i];
+}
+static void scores_init(args_t *args)
+{
+    int i;
+    args->nbatch = args->pool ? 2*args->n_threads : 1;
+    args->batch  = (som_batch_t**) malloc(sizeof(som_batch_t*)*args->nbatch);
+    for (i=0; i<args->nbatch; i++) args->batch[i] = batch_init(args);
+    args->pipe = blkpipe_init(args->pool, args->nbatch, (void**)args->batch, score_batch, output_batch, args);
+}
+// Schedule the vector for scoring, the scores are output in the input order by output_batch()
+static void score_push(args_t *args, double *vec, int iskip)
+{
+    if ( !args->cur )
+    {
+        args->cur = (som_batch_t*) blkpipe_get(args->pipe);
+        args->cur->n = 0;
+    }
+    som_batch_t *batch = args->cur;
+    memcpy(batch->vec + batch->n*args->mvals, vec, sizeof(double)*args->mvals);
+    batch->iskip[batch->n] = iskip;
+    if ( ++batch->n < batch->m ) return;
+    args->cur = NULL;
+    blkpipe_dispatch(args->pipe, batch);
+}
+static void scores_flush(args_t *args)
+{
+    if ( args->cur )
+    {
+        if ( args->cur->n ) blkpipe_dispatch(args->pipe, args->cur);
+        else blkpipe_release(args->pipe, args->cur);
+        args->cur = NULL;
+    }
+    blkpipe_flush(args->pipe);
+}
+static void scores_destroy(args_t *args)
+{
+    int i;
+    blkpipe_destroy(args->pipe);
+    args->pipe = NULL;
+    for (i=0; i<args->nbatch; i++) batch_destroy(args->batch[i]);
+    free(args->batch);
+    args->batch  = NULL;
+    args->nbatch = 0;
+}
+
 static int cmpfloat_desc(const void *a, const void *b)
 {
     float fa = *((float*)a);
@@ -514,14 +696,30 @@ static void do_train(args_t *args)
     args->som = (som_t**) malloc(sizeof(som_t*)*args->nfold);
     for (i=0; i<args->nfold; i++) args->som[i] = som_init(args);
 
-    // train
-    for (i=0; i<ntrain; i++)
+    // train, the maps are independent
+    train_job_t *jobs = (train_job_t*) malloc(sizeof(train_job_t)*args->nfold);
+    for (i=0; i<args->nfold; i++)
     {
-        int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;
-        if ( is_good || args->train_bad )
-            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+        jobs[i].args   = args;
+        jobs[i].isom   = i;
+        jobs[i].ntrain = ntrain;
     }
+    if ( args->pool )
+    {
+        hts_tpool_process *queue = hts_tpool_process_init(args->pool, args->nfold, 0);
+        for (i=0; i<args->nfold; i++)
+            if ( hts_tpool_dispatch(args->pool, queue, train_map, &jobs[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+        for (i=0; i<args->nfold; i++)
+        {
+            hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+            if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+            hts_tpool_delete_result(res, 0);
+        }
+        hts_tpool_process_destroy(queue);
+    }
+    else
+        for (i=0; i<args->nfold; i++) train_map(&jobs[i]);
+    free(jobs);
 
     // norm and create plots
     for (i=0; i<args->nfold; i++)
@@ -538,27 +736,28 @@ static void do_train(args_t *args)
     // evaluate
     float *good = (float*) malloc(sizeof(float)*ngood); assert(good);
     float *bad  = (float*) malloc(sizeof(float)*nbad); assert(bad);
+    args->eval_score = (double*) malloc(sizeof(double)*ntrain);
+    args->neval = 0;
+    scores_init(args);
+    for (i=0; i<ntrain; i++)
+    {
+        int isom = args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
+        if ( args->nfold==1 ) isom = -1;
+        score_push(args, args->train_dat+i*args->mvals, isom);
+    }
+    scores_flush(args);
+    scores_destroy(args);
     igood = ibad = 0;
-    double max_score = sqrt(args->som[0]->kdim);
     for (i=0; i<ntrain; i++)
     {
-        double score = 0;
         int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
-        if ( args->nfold==1 ) isom = -1;
-        memcpy(args->vals, args->train_dat+i*args->mvals, args->mvals*sizeof(double));
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, isom); break;
-            case MERGE_MAX: score = get_max_score(args, isom); break;
-            case MERGE_AVG: score = get_avg_score(args, isom); break;
-        }
-        score = 1.0 - score/max_score;
         if ( is_good )
-            good[igood++] = score;
+            good[igood++] = args->eval_score[i];
         else
-            bad[ibad++] = score;
+            bad[ibad++] = args->eval_score[i];
     }
+    free(args->eval_score);
+    args->eval_score = NULL;
     qsort(good, ngood, sizeof(float), cmpfloat_desc);
     qsort(bad, nbad, sizeof(float), cmpfloat_desc);
     FILE *fp = NULL;
@@ -598,18 +797,11 @@ static void do_train(args_t *args)
 static void do_classify(args_t *args)
 {
     annots_reader_reset(args);
-    double max_score = sqrt(args->som[0]->kdim);
+    scores_init(args);
     while ( annots_reader_next(args) )
-    {
-        double score = 0;
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, -1); break;
-            case MERGE_MAX: score = get_max_score(args, -1); break;
-            case MERGE_AVG: score = get_avg_score(args, -1); break;
-        }
-        printf("%e\n", 1.0 - score/max_score);
-    }
+        score_push(args, args->vals, -1);
+    scores_flush(args);
+    scores_destroy(args);
     annots_reader_close(args);
 }
 
@@ -625,6 +817,7 @@ static void usage(void)
     fprintf(stderr, "    -p, --prefix <string>              prefix of output files\n");
     fprintf(stderr, "    -s, --size <int>                   map size [20]\n");
     fprintf(stderr, "    -t, --train                        \n");
+    fprintf(stderr, "        --threads <int>                train the maps and score the sites in <int> worker threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Classifying options:\n");
     fprintf(stderr, "    -c, --classify                     \n");
@@ -672,11 +865,13 @@ int main_vcfsom(int argc, char *argv[])
         {"merge",1,0,'m'},
         {"train",0,0,'t'},
         {"classify",0,0,'c'},
+        {"threads",1,0,1},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "htcp:n:r:b:l:s:f:d:m:e",loptions,NULL)) >= 0) {
         switch (c) {
             case 'e': args->train_bad = 0; break;
+            case  1 : args->n_threads = strtol(optarg, 0, 0); break;
             case 'm':
                 if ( !strcmp(optarg,"min") ) args->merge = MERGE_MIN;
                 else if ( !strcmp(optarg,"max") ) args->merge = MERGE_MAX;
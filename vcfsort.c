@@ -35,12 +35,17 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #ifdef _WIN32
 #include <windows.h>
 #endif
 #include <htslib/vcf.h>
 #include <htslib/kstring.h>
 #include <htslib/hts_os.h>
+#include <htslib/thread_pool.h>
+#include <htslib/hts_endian.h>
+#include <htslib/bgzf.h>
+#include <inttypes.h>
 #include "kheap.h"
 #include "bcftools.h"
 
@@ -52,15 +57,69 @@ typedef struct
 }
 blk_t;
 
+// Sort key of a record held in the arena, see buf_push()
+typedef struct
+{
+    int32_t rid;
+    hts_pos_t pos;
+    uint8_t *dat;   // the record serialized exactly as in a BCF file
+}
+sort_key_t;
+
+#define SLAB_SIZE (1<<22)
+
+// Records are kept serialized in large slabs rather than as bcf1_t structs, only the keys are sorted
+typedef struct
+{
+    uint8_t **slab;
+    int nslab, mslab;
+    size_t slab_used, slab_free;    // bytes used and left in the last slab
+    sort_key_t *key;
+    size_t nkey, mkey;
+    size_t mem;             // the total allocated memory, slabs and keys
+}
+buf_t;
+
+#define MAX_RUNS 16
+
+// A run of records which came in sorted order, streamed directly to a temporary file without buffering
+typedef struct
+{
+    htsFile *fh;
+    kstring_t last;     // the last record written, serialized
+}
+run_t;
+
+struct _args_t;
+
+// A full buffer sorted and written to a temporary file by the background thread
+typedef struct
+{
+    struct _args_t *args;
+    buf_t *buf;
+    char *fname;
+}
+sort_job_t;
+
 typedef struct _args_t
 {
     bcf_hdr_t *hdr;
     char **argv, *fname, *output_fname, *tmp_dir;
-    int argc, output_type;
-    size_t max_mem, mem;
-    bcf1_t **buf;
-    size_t nbuf, mbuf, nblk;
+    int argc, output_type, n_threads;
+    size_t max_mem, buf_mem;        // buf_mem: the limit for one buffer, with --threads two are held at a time
+    buf_t bufs[2], *buf, *buf2;     // the buffer being filled and the one being sorted in the background
+    size_t nblk;
     blk_t *blk;
+    htsThreadPool tpool;
+    pthread_t sorter;
+    int sorter_running;
+    sort_job_t job;
+    char *partitions_fname;         // --partitions: the output is split into one shard per partition
+    int npart, *part_rid;
+    hts_pos_t *part_beg, *part_end;
+    run_t run[MAX_RUNS];
+    int nrun, irun;                 // irun: the run used last
+    kstring_t str;                  // the current record serialized
 }
 args_t;
 
@@ -117,12 +176,109 @@ int cmp_bcf_pos(const void *aptr, const void *bptr)
     return 0;
 }
 
-void buf_flush(args_t *args)
+// Compare the alleles of two serialized records case-insensitively, like strcasecmp() in cmp_bcf_pos()
+static int cmp_dat_alleles(const uint8_t *a, const uint8_t *b)
 {
-    if ( !args->nbuf ) return;
+    int ia, na = le_to_u32(a+24) >> 16;
+    int ib, nb = le_to_u32(b+24) >> 16;
+    int type;
+    uint8_t *pa = (uint8_t*)a + 32, *pb = (uint8_t*)b + 32;
+    ia = bcf_dec_size(pa, &pa, &type); pa += ia;      // skip ID
+    ib = bcf_dec_size(pb, &pb, &type); pb += ib;
+    int i;
+    for (i=0; i<na; i++)
+    {
+        if ( i >= nb ) return 1;
+        uint8_t *sa, *sb;
+        int la = bcf_dec_size(pa, &sa, &type);
+        int lb = bcf_dec_size(pb, &sb, &type);
+        pa = sa + la;
+        pb = sb + lb;
+        int j;
+        for (j=0; j<la && sa[j]; j++)
+        {
+            if ( j>=lb || !sb[j] ) return 1;
+            int ret = tolower(sa[j]) - tolower(sb[j]);
+            if ( ret ) return ret;
+        }
+        if ( j<lb && sb[j] ) return -1;
+    }
+    if ( na < nb ) return -1;
+    return 0;
+}
+static inline int cmp_dat(const uint8_t *a, const uint8_t *b)
+{
+    int32_t arid = le_to_i32(a+8), brid = le_to_i32(b+8);
+    if ( arid < brid ) return -1;
+    if ( arid > brid ) return 1;
+    int32_t apos = le_to_i32(a+12), bpos = le_to_i32(b+12);
+    if ( apos < bpos ) return -1;
+    if ( apos > bpos ) return 1;
+    return cmp_dat_alleles(a, b);
+}
+static int cmp_key(const void *aptr, const void *bptr)
+{
+    sort_key_t *a = (sort_key_t*)aptr;
+    sort_key_t *b = (sort_key_t*)bptr;
+    if ( a->rid < b->rid ) return -1;
+    if ( a->rid > b->rid ) return 1;
+    if ( a->pos < b->pos ) return -1;
+    if ( a->pos > b->pos ) return 1;
+    return cmp_dat_alleles(a->dat, b->dat);
+}
 
-    qsort(args->buf, args->nbuf, sizeof(*args->buf), cmp_bcf_pos);
+static void buf_reset(buf_t *buf)
+{
+    int i;
+    for (i=0; i<buf->nslab; i++) free(buf->slab[i]);
+    buf->nslab = 0;
+    buf->slab_used = buf->slab_free = 0;
+    buf->nkey = 0;
+    buf->mem  = buf->mkey*sizeof(*buf->key) + buf->mslab*sizeof(*buf->slab);
+}
+static void buf_destroy(buf_t *buf)
+{
+    buf_reset(buf);
+    free(buf->slab);
+    free(buf->key);
+}
 
+static void blk_write(args_t *args, buf_t *buf, const char *fname)
+{
+    qsort(buf->key, buf->nkey, sizeof(*buf->key), cmp_key);
+
+    // With --threads the temporary files are compressed by the pool, this reduces the I/O
+    // at little cost. Otherwise they are left uncompressed
+    htsFile *fh = hts_open(fname, args->n_threads ? "wb1" : "wbu");
+    if ( fh == NULL ) clean_files_and_throw(args, "Cannot write %s: %s\n", fname, strerror(errno));
+    if ( args->n_threads ) hts_set_opt(fh, HTS_OPT_THREAD_POOL, &args->tpool);
+    if ( bcf_hdr_write(fh, args->hdr)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,fname);
+
+    size_t i;
+    for (i=0; i<buf->nkey; i++)
+    {
+        uint8_t *dat = buf->key[i].dat;
+        size_t len = 8 + (size_t)le_to_u32(dat) + le_to_u32(dat+4);
+        if ( bgzf_write(fh->fp.bgzf, dat, len)!=len ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,fname);
+    }
+    if ( hts_close(fh)!=0 ) clean_files_and_throw(args, "[%s] Error: close failed .. %s\n", __func__,fname);
+    buf_reset(buf);
+}
+static void *sort_job(void *arg)
+{
+    sort_job_t *job = (sort_job_t*) arg;
+    blk_write(job->args, job->buf, job->fname);
+    return NULL;
+}
+static void buf_wait(args_t *args)
+{
+    if ( !args->sorter_running ) return;
+    if ( pthread_join(args->sorter, NULL)!=0 ) clean_files_and_throw(args, "[%s] Error: pthread_join failed\n", __func__);
+    args->sorter_running = 0;
+}
+
+static blk_t *blk_new(args_t *args)
+{
     args->nblk++;
     args->blk = (blk_t*) realloc(args->blk, sizeof(blk_t)*args->nblk);
     blk_t *blk = args->blk + args->nblk - 1;
@@ -132,31 +288,149 @@ void buf_flush(args_t *args)
     blk->fname = str.s;
     blk->rec   = NULL;
     blk->fh    = NULL;
+    return blk;
+}
 
-    htsFile *fh = hts_open(blk->fname, "wbu");
-    if ( fh == NULL ) clean_files_and_throw(args, "Cannot write %s: %s\n", blk->fname, strerror(errno));
-    if ( bcf_hdr_write(fh, args->hdr)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,blk->fname);
-    
-    int i;
-    for (i=0; i<args->nbuf; i++)
+void buf_flush(args_t *args)
+{
+    if ( !args->buf->nkey ) return;
+
+    // the background thread must be done with the previous block before its buffer can be reused
+    buf_wait(args);
+
+    blk_t *blk = blk_new(args);
+
+    if ( !args->n_threads )
+        blk_write(args, args->buf, blk->fname);
+    else
     {
-        if ( bcf_write(fh, args->hdr, args->buf[i])!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,blk->fname);
-        bcf_destroy(args->buf[i]);
+        // sort and write the full buffer in the background while the next one is being filled
+        args->job.args  = args;
+        args->job.buf   = args->buf;
+        args->job.fname = blk->fname;
+        if ( pthread_create(&args->sorter, NULL, sort_job, &args->job)!=0 ) clean_files_and_throw(args, "[%s] Error: pthread_create failed\n", __func__);
+        args->sorter_running = 1;
+
+        buf_t *tmp = args->buf; args->buf = args->buf2; args->buf2 = tmp;
     }
-    if ( hts_close(fh)!=0 ) clean_files_and_throw(args, "[%s] Error: close failed .. %s\n", __func__,blk->fname);
+}
 
-    args->nbuf = 0;
-    args->mem  = 0;
+// Serialize the record in the BCF on-disk layout
+static void rec_serialize(args_t *args, bcf1_t *rec, kstring_t *str)
+{
+    if ( rec->pos > INT32_MAX || rec->rlen > INT32_MAX )
+        clean_files_and_throw(args, "[%s] Error: the position is too large for BCF: %s:%"PRId64"\n", __func__,bcf_seqname(args->hdr,rec),(int64_t)rec->pos+1);
+
+    str->l = 0;
+    if ( ks_resize(str, 32 + rec->shared.l + rec->indiv.l)<0 ) clean_files_and_throw(args, "[%s] Error: could not allocate memory\n", __func__);
+    uint8_t *dat = (uint8_t*) str->s;
+    u32_to_le(rec->shared.l + 24, dat);
+    u32_to_le(rec->indiv.l, dat+4);
+    i32_to_le(rec->rid, dat+8);
+    i32_to_le(rec->pos, dat+12);
+    i32_to_le(rec->rlen, dat+16);
+    float_to_le(rec->qual, dat+20);
+    u32_to_le((uint32_t)rec->n_allele<<16 | rec->n_info, dat+24);
+    u32_to_le((uint32_t)rec->n_fmt<<24 | rec->n_sample, dat+28);
+    memcpy(dat+32, rec->shared.s, rec->shared.l);
+    memcpy(dat+32+rec->shared.l, rec->indiv.s, rec->indiv.l);
+    str->l = 32 + rec->shared.l + rec->indiv.l;
 }
 
-void buf_push(args_t *args, bcf1_t *rec)
+// Copy the serialized record into the arena, the memory used is accounted exactly
+void buf_push(args_t *args, kstring_t *str)
+{
+    buf_t *buf = args->buf;
+    size_t len = str->l;
+    size_t slab_size = 0, mkey = buf->mkey;
+    if ( len > buf->slab_free )
+    {
+        slab_size = args->buf_mem < SLAB_SIZE ? args->buf_mem : SLAB_SIZE;
+        if ( slab_size < len ) slab_size = len;
+    }
+    if ( buf->nkey == buf->mkey ) mkey = mkey ? 2*mkey : 1024;
+    size_t delta = slab_size + (mkey - buf->mkey)*sizeof(*buf->key);
+    if ( buf->nkey && buf->mem + delta > args->buf_mem )
+    {
+        buf_flush(args);
+        buf_push(args, str);
+        return;
+    }
+    if ( mkey != buf->mkey )
+    {
+        sort_key_t *tmp = (sort_key_t*) realloc(buf->key, mkey*sizeof(*buf->key));
+        if ( !tmp ) clean_files_and_throw(args, "[%s] Error: could not allocate %zu bytes\n", __func__,mkey*sizeof(*buf->key));
+        buf->key  = tmp;
+        buf->mem += (mkey - buf->mkey)*sizeof(*buf->key);
+        buf->mkey = mkey;
+    }
+    if ( slab_size )
+    {
+        if ( buf->nslab == buf->mslab )
+        {
+            buf->mslab = buf->mslab ? 2*buf->mslab : 16;
+            buf->slab  = (uint8_t**) realloc(buf->slab, buf->mslab*sizeof(*buf->slab));
+            if ( !buf->slab ) clean_files_and_throw(args, "[%s] Error: could not allocate memory\n", __func__);
+        }
+        if ( !(buf->slab[buf->nslab++] = (uint8_t*) malloc(slab_size)) )
+            clean_files_and_throw(args, "[%s] Error: could not allocate %zu bytes\n", __func__,slab_size);
+        buf->slab_used = 0;
+        buf->slab_free = slab_size;
+        buf->mem += slab_size;
+    }
+
+    uint8_t *dat = buf->slab[buf->nslab-1] + buf->slab_used;
+    memcpy(dat, str->s, len);
+    buf->slab_used += len;
+    buf->slab_free -= len;
+
+    sort_key_t *key = &buf->key[buf->nkey++];
+    key->rid = le_to_i32(dat+8);
+    key->pos = le_to_i32(dat+12);
+    key->dat = dat;
+}
+
+/*
+    Records which come in order are appended to one of up to MAX_RUNS sorted runs, each
+    streamed to its own temporary file, and only the records which fit none of the runs are
+    buffered and sorted. The runs are merged together with the sorted blocks at the end.
+    Inputs which are sorted or nearly sorted, such as concatenated shards, then need no sorting
+    and little memory. Returns 0 if the record does not fit any run and all runs are taken.
+*/
+static int run_push(args_t *args, kstring_t *str)
+{
+    int i, irun = -1;
+    for (i=0; i<args->nrun; i++)
+    {
+        int j = (args->irun + i) % args->nrun;   // the run used last is most likely to fit
+        if ( cmp_dat((uint8_t*)args->run[j].last.s, (uint8_t*)str->s) <= 0 ) { irun = j; break; }
+    }
+    if ( irun<0 )
+    {
+        if ( args->nrun==MAX_RUNS ) return 0;
+        blk_t *blk = blk_new(args);
+        run_t *run = &args->run[args->nrun];
+        run->fh = hts_open(blk->fname, args->n_threads ? "wb1" : "wbu");
+        if ( run->fh == NULL ) clean_files_and_throw(args, "Cannot write %s: %s\n", blk->fname, strerror(errno));
+        if ( args->n_threads ) hts_set_opt(run->fh, HTS_OPT_THREAD_POOL, &args->tpool);
+        if ( bcf_hdr_write(run->fh, args->hdr)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,blk->fname);
+        irun = args->nrun++;
+    }
+    run_t *run = &args->run[irun];
+    if ( bgzf_write(run->fh->fp.bgzf, str->s, str->l)!=str->l ) clean_files_and_throw(args, "[%s] Error: cannot write a temporary file\n", __func__);
+    run->last.l = 0;
+    kputsn(str->s, str->l, &run->last);
+    args->irun = irun;
+    return 1;
+}
+static void run_close(args_t *args)
 {
-    int delta = sizeof(bcf1_t) + rec->shared.l + rec->indiv.l + sizeof(bcf1_t*);
-    if ( args->mem + delta > args->max_mem ) buf_flush(args);
-    args->nbuf++;
-    args->mem += delta;
-    hts_expand(bcf1_t*, args->nbuf, args->mbuf, args->buf);
-    args->buf[args->nbuf-1] = rec;
+    int i;
+    for (i=0; i<args->nrun; i++)
+    {
+        if ( hts_close(args->run[i].fh)!=0 ) clean_files_and_throw(args, "[%s] Error: close failed\n", __func__);
+        free(args->run[i].last.s);
+    }
 }
 
 void sort_blocks(args_t *args) 
@@ -165,22 +439,27 @@ void sort_blocks(args_t *args)
     if ( !in ) clean_files_and_throw(args, "Could not read %s\n", args->fname);
     args->hdr = bcf_hdr_read(in);
     if ( !args->hdr) clean_files_and_throw(args, "Could not read VCF/BCF headers from %s\n", args->fname);
+    if ( args->n_threads ) hts_set_opt(in, HTS_OPT_THREAD_POOL, &args->tpool);
 
+    args->buf  = &args->bufs[0];
+    args->buf2 = &args->bufs[1];
+    bcf1_t *rec = bcf_init();
     while ( 1 )
     {
-        bcf1_t *rec = bcf_init();
         int ret = bcf_read1(in, args->hdr, rec);
         if ( ret < -1 ) clean_files_and_throw(args,"Error encountered while parsing the input\n");
-        if ( ret == -1 )
-        {
-            bcf_destroy(rec);
-            break;
-        }
+        if ( ret == -1 ) break;
         if ( rec->errcode ) clean_files_and_throw(args,"Error encountered while parsing the input at %s:%d\n",bcf_seqname(args->hdr,rec),rec->pos+1);
-        buf_push(args, rec);
+        rec_serialize(args, rec, &args->str);
+        if ( !run_push(args, &args->str) ) buf_push(args, &args->str);
     }
+    bcf_destroy(rec);
+    free(args->str.s);
+    run_close(args);
     buf_flush(args);
-    free(args->buf);
+    buf_wait(args);
+    buf_destroy(&args->bufs[0]);
+    buf_destroy(&args->bufs[1]);
 
     if ( hts_close(in)!=0 ) clean_files_and_throw(args,"Close failed: %s\n", args->fname);
 }
@@ -209,6 +488,72 @@ void blk_read(args_t *args, khp_blk_t *bhp, bcf_hdr_t *hdr, blk_t *blk)
     khp_insert(blk, bhp, &blk);
 }
 
+/*
+    Read the --partitions file, one region per line given as CHR or CHR BEG END (1-based, inclusive).
+    The partitions must follow the order of the contigs in the header and must not overlap, so that
+    the shards can be concatenated with `bcftools concat --naive` in the order given
+*/
+static void init_partitions(args_t *args)
+{
+    int i, nlines;
+    char **lines = hts_readlist(args->partitions_fname, 1, &nlines);
+    if ( !lines ) clean_files_and_throw(args, "Could not read the file: %s\n", args->partitions_fname);
+    args->part_rid = (int*) malloc(sizeof(*args->part_rid)*(nlines ? nlines : 1));
+    args->part_beg = (hts_pos_t*) malloc(sizeof(*args->part_beg)*(nlines ? nlines : 1));
+    args->part_end = (hts_pos_t*) malloc(sizeof(*args->part_end)*(nlines ? nlines : 1));
+    for (i=0; i<nlines; i++)
+    {
+        char *ptr = lines[i];
+        while ( *ptr && isspace(*ptr) ) ptr++;
+        if ( !*ptr || *ptr=='#' ) { free(lines[i]); continue; }
+        char *chr = ptr;
+        while ( *ptr && !isspace(*ptr) ) ptr++;
+        if ( *ptr ) *ptr++ = 0;
+        int rid = bcf_hdr_name2id(args->hdr, chr);
+        if ( rid<0 ) clean_files_and_throw(args, "The sequence \"%s\" from %s is not present in the header\n", chr, args->partitions_fname);
+        hts_pos_t beg = 0, end = HTS_POS_MAX;
+        while ( *ptr && isspace(*ptr) ) ptr++;
+        if ( *ptr )
+        {
+            char *tmp;
+            beg = strtoll(ptr, &tmp, 10) - 1;
+            if ( tmp==ptr || beg<0 ) clean_files_and_throw(args, "Could not parse the line in %s: %s\n", args->partitions_fname, lines[i]);
+            end = strtoll(tmp, &ptr, 10) - 1;
+            if ( ptr==tmp || end<beg ) clean_files_and_throw(args, "Could not parse the line in %s: %s\n", args->partitions_fname, lines[i]);
+        }
+        int n = args->npart;
+        if ( n && (rid < args->part_rid[n-1] || (rid==args->part_rid[n-1] && beg <= args->part_end[n-1])) )
+            clean_files_and_throw(args, "The partitions in %s overlap or are not in the order of the header: %s\n", args->partitions_fname, chr);
+        args->part_rid[n] = rid;
+        args->part_beg[n] = beg;
+        args->part_end[n] = end;
+        args->npart++;
+        free(lines[i]);
+    }
+    free(lines);
+    if ( !args->npart ) clean_files_and_throw(args, "No partitions in %s\n", args->partitions_fname);
+}
+static htsFile *open_output(args_t *args, int ipart, kstring_t *fname)
+{
+    fname->l = 0;
+    if ( ipart<0 )
+        kputs(args->output_fname, fname);
+    else
+    {
+        const char *suffix = args->output_type & FT_BCF ? "bcf" : (args->output_type & FT_GZ ? "vcf.gz" : "vcf");
+        ksprintf(fname, "%s.%04d.%s", args->output_fname, ipart+1, suffix);
+    }
+    htsFile *out = hts_open(fname->s, hts_bcf_wmode(args->output_type));
+    if ( !out ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,fname->s);
+    if ( args->n_threads ) hts_set_opt(out, HTS_OPT_THREAD_POOL, &args->tpool);
+    if ( bcf_hdr_write(out, args->hdr)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,fname->s);
+    return out;
+}
+static void close_output(args_t *args, htsFile *out, kstring_t *fname)
+{
+    if ( hts_close(out)!=0 ) clean_files_and_throw(args, "Close failed: %s\n", fname->s);
+}
+
 void merge_blocks(args_t *args) 
 {
     fprintf(stderr,"Merging %d temporary files\n", (int)args->nblk);
@@ -227,16 +572,34 @@ void merge_blocks(args_t *args)
         blk_read(args, bhp, args->hdr, blk);
     }
 
-    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
-    if ( bcf_hdr_write(out, args->hdr)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+    // with --partitions the sorted stream is split at the partition boundaries, one shard
+    // is written for each partition, including the empty ones
+    kstring_t fname = {0,0,0};
+    int ipart = 0;
+    if ( args->partitions_fname ) init_partitions(args);
+    htsFile *out = open_output(args, args->partitions_fname ? 0 : -1, &fname);
     while ( bhp->ndat )
     {
         blk_t *blk = bhp->dat[0];
-        if ( bcf_write(out, args->hdr, blk->rec)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,args->output_fname);
+        bcf1_t *rec = blk->rec;
+        if ( args->partitions_fname )
+        {
+            while ( ipart < args->npart && (rec->rid > args->part_rid[ipart] || (rec->rid==args->part_rid[ipart] && rec->pos > args->part_end[ipart])) )
+            {
+                close_output(args, out, &fname);
+                if ( ++ipart < args->npart ) out = open_output(args, ipart, &fname);
+            }
+            if ( ipart==args->npart || rec->rid < args->part_rid[ipart] || rec->pos < args->part_beg[ipart] )
+                clean_files_and_throw(args, "The record %s:%"PRId64" is not covered by any partition in %s\n", bcf_seqname(args->hdr,rec),(int64_t)rec->pos+1,args->partitions_fname);
+        }
+        if ( bcf_write(out, args->hdr, rec)!=0 ) clean_files_and_throw(args, "[%s] Error: cannot write to %s\n", __func__,fname.s);
         khp_delete(blk, bhp);
         blk_read(args, bhp, args->hdr, blk);
     }
-    if ( hts_close(out)!=0 ) clean_files_and_throw(args, "Close failed: %s\n", args->output_fname);
+    close_output(args, out, &fname);
+    while ( args->partitions_fname && ++ipart < args->npart )
+        close_output(args, open_output(args, ipart, &fname), &fname);
+    free(fname.s);
 
     clean_files(args);
 
@@ -255,7 +618,9 @@ static void usage(args_t *args)
     fprintf(stderr, "    -m, --max-mem <float>[kMG]    maximum memory to use [768M]\n");    // using metric units, 1M=1e6
     fprintf(stderr, "    -o, --output <file>           output file name [stdout]\n");
     fprintf(stderr, "    -O, --output-type <b|u|z|v>   b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "        --partitions <file>       write one shard per region in <file>, named <output>.NNNN.bcf, see the man page\n");
     fprintf(stderr, "    -T, --temp-dir <dir>          temporary files [/tmp/bcftools-sort.XXXXXX]\n");
+    fprintf(stderr, "        --threads <int>           use multithreading with <int> worker threads [0]\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -304,10 +669,19 @@ static void init(args_t *args)
     }
 
     fprintf(stderr,"Writing to %s\n", args->tmp_dir);
+
+    // With threads, one buffer is being sorted and written while another is being filled
+    args->buf_mem = args->n_threads ? args->max_mem/2 : args->max_mem;
+    if ( args->n_threads && !(args->tpool.pool = hts_tpool_init(args->n_threads)) )
+        error("Failed to initialize %d threads\n", args->n_threads);
 }
 static void destroy(args_t *args)
 {
     bcf_hdr_destroy(args->hdr);
+    free(args->part_rid);
+    free(args->part_beg);
+    free(args->part_end);
+    if ( args->tpool.pool ) hts_tpool_destroy(args->tpool.pool);
     free(args->tmp_dir);
     free(args);
 }
@@ -315,6 +689,7 @@ static void destroy(args_t *args)
 int main_sort(int argc, char *argv[])
 {
     int c;
+    char *tmp;
     args_t *args  = (args_t*) calloc(1,sizeof(args_t));
     args->argc    = argc; args->argv = argv;
     args->max_mem = 768*1000*1000;
@@ -327,6 +702,8 @@ int main_sort(int argc, char *argv[])
         {"output-type",required_argument,NULL,'O'},
         {"output-file",required_argument,NULL,'o'},
         {"output",required_argument,NULL,'o'},
+        {"threads",required_argument,NULL,9},
+        {"partitions",required_argument,NULL,10},
         {"help",no_argument,NULL,'h'},
         {0,0,0,0}
     };
@@ -337,6 +714,11 @@ int main_sort(int argc, char *argv[])
             case 'm': args->max_mem = parse_mem_string(optarg); break;
             case 'T': args->tmp_dir = optarg; break;
             case 'o': args->output_fname = optarg; break;
+            case 10 : args->partitions_fname = optarg; break;
+            case  9 :
+                      args->n_threads = strtol(optarg, &tmp, 10);
+                      if ( *tmp || args->n_threads<0 ) error("Could not parse: --threads %s\n", optarg);
+                      break;
             case 'O':
                       switch (optarg[0]) {
                           case 'b': args->output_type = FT_BCF_GZ; break;
@@ -359,6 +741,8 @@ int main_sort(int argc, char *argv[])
     }
     else args->fname = argv[optind];
 
+    if ( args->partitions_fname && !strcmp("-",args->output_fname) ) error("The --partitions option requires -o, the prefix of the output shards\n");
+
     init(args);
     sort_blocks(args);
     merge_blocks(args);
@@ -33,14 +33,19 @@ THE SOFTWARE.  */
 #include <getopt.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
-#include <htslib/faidx.h>
+#include <htslib/thread_pool.h>
 #include <inttypes.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "bin.h"
+#include "refseq.h"
+#include "regplan.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -113,17 +118,11 @@ typedef struct
 }
 gtcmp_t;
 
+#define IC_REF_WIN (1<<16)     // the reference is fetched in windows of this size and reused by nearby indels
 typedef struct
 {
-    char *seq;
-    int pos, cnt, len;
-}
-_idc1_t;
-typedef struct
-{
-    faidx_t *ref;
-    _idc1_t *dat;
-    int ndat, mdat;
+    refseq_t *ref;      // read in windows, nearby indels are served from the same window
+    kstring_t seq;      // upper-case copy of the sequence around the indel
 }
 indel_ctx_t;
 
@@ -133,6 +132,8 @@ typedef struct
     stats_t stats[3];
     int *tmp_iaf, ntmp_iaf, m_af, m_qual, naf_hwe, mtmp_frm;
     uint8_t *tmp_frm;
+    int8_t *tmp_gt[2];      // per-sample genotype types of biallelic sites, see gt_types_int8()
+    int mtmp_gt[2];
     int dp_min, dp_max, dp_step;
     gtcmp_t *smpl_gts_snps, *smpl_gts_indels;
     gtcmp_t *af_gts_snps, *af_gts_indels; // first bin of af_* stats are singletons
@@ -159,6 +160,22 @@ typedef struct
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
     int n_threads;
+
+    // file and sample names for the output; point to args->files or, with --merge, read from the partial files
+    int nreaders, nsmpl, nhdr_smpl[2];
+    char **fnames, **smpl_names;
+
+    int split_contigs, targets_is_file, regions_is_file;   // collect stats for groups of contigs in parallel, see stats_split()
+    int merge;              // the input files are partial stats written with --partial
+    char *partial_fname;
+
+    // cumulative stats written periodically with --snapshot, every snapshot_every records or seconds
+    char *snapshot_fname;
+    int snapshot_every, snapshot_secs;
+    uint64_t nread, snapshot_next;
+    time_t snapshot_time;
+    FILE *out;
+    profile_t prof;
 }
 args_t;
 
@@ -195,90 +212,42 @@ static inline int clip_nonnegative(float x, int limit)
 }
 
 #define IC_DBG 0
-#if IC_DBG
-static void _indel_ctx_print1(_idc1_t *idc)
-{
-    int i;
-    fprintf(stdout, "%d\t", idc->cnt);
-    for (i=0; i<idc->len; i++)
-        fputc(idc->seq[i], stdout);
-    fputc('\n', stdout);
-}
-static void _indel_ctx_print(indel_ctx_t *ctx)
-{
-    int i;
-    for (i=0; i<ctx->ndat; i++)
-        _indel_ctx_print1(&ctx->dat[i]);
-    fputc('\n',stdout);
-}
-#endif
-static int _indel_ctx_lookup(indel_ctx_t *ctx, char *seq, int seq_len, int *hit)
-{
-    // binary search
-    int min = 0, max = ctx->ndat - 1;
-    while ( min<=max )
-    {
-        int i = (min+max)/2;
-        int cmp = strncmp(seq, ctx->dat[i].seq, seq_len);
-        if ( cmp<0 ) max = i - 1;
-        else if ( cmp>0 ) min = i + 1;
-        else
-        {
-            if ( seq_len==ctx->dat[i].len )
-            {
-                *hit = 1;
-                return i;
-            }
-            else if ( seq_len<ctx->dat[i].len ) max = i - 1;
-            else min = i + 1;
-        }
-    }
-    *hit = 0;
-    return max;
-}
-static void _indel_ctx_insert(indel_ctx_t *ctx, char *seq, int seq_len, int pos)
-{
-    int idat, hit, i;
-    idat = _indel_ctx_lookup(ctx, seq, seq_len, &hit);
-    if ( !hit )
-    {
-        if ( pos>0 ) return;
-        idat++;
-        ctx->ndat++;
-        hts_expand(_idc1_t, ctx->ndat+1, ctx->mdat, ctx->dat);
-        if ( idat<ctx->ndat && ctx->ndat>1 )
-            memmove(&ctx->dat[idat+1], &ctx->dat[idat], (ctx->ndat - idat - 1)*sizeof(_idc1_t));
-        ctx->dat[idat].len = seq_len;
-        ctx->dat[idat].cnt = 1;
-        ctx->dat[idat].pos = pos;
-        ctx->dat[idat].seq = (char*) malloc(sizeof(char)*(seq_len+1));
-        for (i=0; i<seq_len; i++) ctx->dat[idat].seq[i] = seq[i];
-        ctx->dat[idat].seq[i] = 0;
-        return;
-    }
-    if ( ctx->dat[idat].pos + seq_len == pos )
-    {
-        ctx->dat[idat].cnt++;
-        ctx->dat[idat].pos = pos;
-    }
-}
 indel_ctx_t *indel_ctx_init(char *fa_ref_fname)
 {
     indel_ctx_t *ctx = (indel_ctx_t *) calloc(1,sizeof(indel_ctx_t));
-    ctx->ref = fai_load(fa_ref_fname);
+    ctx->ref = refseq_init(fa_ref_fname);
     if ( !ctx->ref )
     {
         free(ctx);
         return NULL;
     }
+    refseq_set_window(ctx->ref, IC_REF_WIN, 0);
     return ctx;
 }
 void indel_ctx_destroy(indel_ctx_t *ctx)
 {
-    fai_destroy(ctx->ref);
-    if ( ctx->mdat ) free(ctx->dat);
+    refseq_destroy(ctx->ref);
+    free(ctx->seq.s);
     free(ctx);
 }
+/*
+    Returns the upper-case reference sequence beg..end (0-based, inclusive) or
+    shorter at the end of the chromosome
+*/
+static char *indel_ctx_fetch(indel_ctx_t *ctx, char *chr, int beg, int end, int *len)
+{
+    hts_pos_t nseq;
+    const char *seq = refseq_fetch(ctx->ref, chr, beg, end, &nseq);
+    if ( !seq ) error("Failed to fetch the sequence %s:%d-%d\n", chr, beg+1, end+1);
+    int i;
+    ctx->seq.l = 0;
+    ks_resize(&ctx->seq, nseq+1);
+    for (i=0; i<nseq; i++)
+        ctx->seq.s[i] = (int)seq[i]>96 ? seq[i] - 32 : seq[i];
+    ctx->seq.s[nseq] = 0;
+    *len = nseq;
+    return ctx->seq.s;
+}
 /**
  * indel_ctx_type() - determine indel context type
  * @ctx:
@@ -302,43 +271,34 @@ int indel_ctx_type(indel_ctx_t *ctx, char *chr, int pos, char *ref, char *alt, i
     while ( alt[alt_len] && alt[alt_len]!=',' ) alt_len++;
 
     int i, fai_ref_len;
-    char *fai_ref = faidx_fetch_seq(ctx->ref, chr, pos-1, pos+win_size, &fai_ref_len);
-    for (i=0; i<fai_ref_len; i++)
-        if ( (int)fai_ref[i]>96 ) fai_ref[i] -= 32;
+    char *fai_ref = indel_ctx_fetch(ctx, chr, pos-1, pos+win_size, &fai_ref_len);
 
     // Sanity check: the reference sequence must match the REF allele
     for (i=0; i<fai_ref_len && i<ref_len; i++)
         if ( ref[i] != fai_ref[i] && ref[i] - 32 != fai_ref[i] && !iupac_consistent(fai_ref[i], ref[i]) )
             error("\nSanity check failed, the reference sequence differs: %s:%d+%d .. %c vs %c\n", chr, pos, i, ref[i],fai_ref[i]);
 
-    // Count occurrences of all possible kmers
-    ctx->ndat = 0;
-    for (i=0; i<win_size; i++)
+    // For each repeat unit length, count the consecutive copies of the unit which
+    // starts after the first REF base, the repeats must end within the window
+    int max_cnt = 0, max_len = 0, end = fai_ref_len <= win_size ? fai_ref_len - 1 : win_size;
+    for (i=1; i<=rep_len && i<=end; i++)
     {
-        int k, kmax = rep_len <= i ? rep_len : i+1;
-        for (k=0; k<kmax; k++)
-            _indel_ctx_insert(ctx, &fai_ref[i-k+1], k+1, i-k);
+        int cnt = 1, beg = 1 + i;
+        while ( beg + i - 1 <= end && !memcmp(fai_ref + beg, fai_ref + 1, i) ) { cnt++; beg += i; }
+        if ( max_cnt < cnt || (max_cnt==cnt && max_len < i) )
+        {
+            max_cnt = cnt;
+            max_len = i;
+        }
     }
 
     #if IC_DBG
     fprintf(stdout,"ref: %s\n", ref);
     fprintf(stdout,"alt: %s\n", alt);
-    fprintf(stdout,"ctx: %s\n", fai_ref);
-    _indel_ctx_print(ctx);
+    fprintf(stdout,"ctx: %.*s\n", fai_ref_len, fai_ref);
+    fprintf(stdout,"rep: %d x %d\n", max_cnt, max_len);
     #endif
 
-    int max_cnt = 0, max_len = 0;
-    for (i=0; i<ctx->ndat; i++)
-    {
-        if ( max_cnt < ctx->dat[i].cnt || (max_cnt==ctx->dat[i].cnt && max_len < ctx->dat[i].len) )
-        {
-            max_cnt = ctx->dat[i].cnt;
-            max_len = ctx->dat[i].len;
-        }
-        free(ctx->dat[i].seq);
-    }
-    free(fai_ref);
-
     *nrep = max_cnt;
     *nlen = max_len;
     return alt_len - ref_len;
@@ -392,12 +352,109 @@ static void init_user_stats(args_t *args, bcf_hdr_t *hdr, stats_t *stats)
         user_stats_t *usr = &stats->usr[i];
         usr->vals_ts = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
         usr->vals_tv = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
+        if ( !hdr ) continue;   // --merge, the type is known from the partial stats
         int id = bcf_hdr_id2int(hdr,BCF_DT_ID,usr->tag);
         if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,id) ) error("The INFO tag \"%s\" is not defined in the header\n", usr->tag);
         usr->type = bcf_hdr_id2type(hdr,BCF_HL_INFO,id);
         if ( usr->type!=BCF_HT_REAL && usr->type!=BCF_HT_INT ) error("The INFO tag \"%s\" is not of Float or Integer type (%d)\n", usr->tag, usr->type);
     }
 }
+static void init_names(args_t *args)
+{
+    int i;
+    args->nreaders = args->files->nreaders;
+    args->fnames = (char**) malloc(sizeof(char*)*args->nreaders);
+    for (i=0; i<args->nreaders; i++)
+    {
+        args->fnames[i] = args->files->readers[i].fname;
+        args->nhdr_smpl[i] = bcf_hdr_nsamples(args->files->readers[i].header);
+    }
+    args->nsmpl = args->files->n_smpl;
+    args->smpl_names = args->files->samples;
+}
+static void init_gt_types(void)
+{
+    type2dosage[GT_HOM_RR] = 0;
+    type2dosage[GT_HET_RA] = 1;
+    type2dosage[GT_HOM_AA] = 2;
+    type2dosage[GT_HET_AA] = 2;
+    type2dosage[GT_HAPL_R] = 0;
+    type2dosage[GT_HAPL_A] = 1;
+
+    type2ploidy[GT_HOM_RR] = 1;
+    type2ploidy[GT_HET_RA] = 1;
+    type2ploidy[GT_HOM_AA] = 1;
+    type2ploidy[GT_HET_AA] = 1;
+    type2ploidy[GT_HAPL_R] = -1;
+    type2ploidy[GT_HAPL_A] = -1;
+
+    type2stats[GT_HOM_RR] = 0;
+    type2stats[GT_HET_RA] = 1;
+    type2stats[GT_HOM_AA] = 2;
+    type2stats[GT_HET_AA] = 3;
+    type2stats[GT_HAPL_R] = 0;
+    type2stats[GT_HAPL_A] = 2;
+    type2stats[GT_UNKN]   = 4;
+}
+// allocate the counters; the sizes depend only on the options, so that stats of the
+// same run collected in parallel or written with --partial can be summed up
+static void alloc_stats(args_t *args)
+{
+    int i;
+    if ( args->nsmpl )
+    {
+        args->af_gts_snps     = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        args->af_gts_indels   = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        args->smpl_gts_snps   = (gtcmp_t *) calloc(args->nsmpl,sizeof(gtcmp_t));
+        args->smpl_gts_indels = (gtcmp_t *) calloc(args->nsmpl,sizeof(gtcmp_t));
+    }
+    for (i=0; i<args->nstats; i++)
+    {
+        stats_t *stats = &args->stats[i];
+        stats->m_indel     = 60;
+        stats->insertions  = (int*) calloc(stats->m_indel,sizeof(int));
+        stats->deletions   = (int*) calloc(stats->m_indel,sizeof(int));
+        stats->af_ts       = (int*) calloc(args->m_af,sizeof(int));
+        stats->af_tv       = (int*) calloc(args->m_af,sizeof(int));
+        stats->af_snps     = (int*) calloc(args->m_af,sizeof(int));
+        int j;
+        for (j=0; j<3; j++) stats->af_repeats[j] = (int*) calloc(args->m_af,sizeof(int));
+        #if QUAL_STATS
+            stats->qual_ts     = (int*) calloc(args->m_qual,sizeof(int));
+            stats->qual_tv     = (int*) calloc(args->m_qual,sizeof(int));
+            stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
+            stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
+        #endif
+        if ( args->nsmpl )
+        {
+            stats->smpl_missing = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_hets   = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_homAA  = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_homRR  = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_hapRef = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_hapAlt = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_ins_hets = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_del_hets = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_ins_homs = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_del_homs = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_ts     = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_tv     = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_indels = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_dp     = (unsigned long int *) calloc(args->nsmpl,sizeof(unsigned long int));
+            stats->smpl_ndp    = (int *) calloc(args->nsmpl,sizeof(int));
+            stats->smpl_sngl   = (int *) calloc(args->nsmpl,sizeof(int));
+            #if HWE_STATS
+                stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
+            #endif
+            if ( args->exons_fname )
+                stats->smpl_frm_shifts = (int*) calloc(args->nsmpl*3,sizeof(int));
+            stats->nvaf = (uint32_t*) calloc(stats->m_indel*2+1,sizeof(*stats->nvaf));
+            stats->dvaf = (double*) calloc(stats->m_indel*2+1,sizeof(*stats->dvaf));
+        }
+        idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
+        idist_init(&stats->dp_sites, args->dp_min,args->dp_max,args->dp_step);
+    }
+}
 static void init_stats(args_t *args)
 {
     int i;
@@ -449,58 +506,11 @@ static void init_stats(args_t *args)
                 error("No sample columns in %s\n", args->files->readers[0].fname);
             error("Unable to parse the samples: \"%s\"\n", args->samples_list);
         }
-        args->af_gts_snps     = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
-        args->af_gts_indels   = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
-        args->smpl_gts_snps   = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
-        args->smpl_gts_indels = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
     }
+    init_names(args);
+    alloc_stats(args);
     for (i=0; i<args->nstats; i++)
-    {
-        stats_t *stats = &args->stats[i];
-        stats->m_indel     = 60;
-        stats->insertions  = (int*) calloc(stats->m_indel,sizeof(int));
-        stats->deletions   = (int*) calloc(stats->m_indel,sizeof(int));
-        stats->af_ts       = (int*) calloc(args->m_af,sizeof(int));
-        stats->af_tv       = (int*) calloc(args->m_af,sizeof(int));
-        stats->af_snps     = (int*) calloc(args->m_af,sizeof(int));
-        int j;
-        for (j=0; j<3; j++) stats->af_repeats[j] = (int*) calloc(args->m_af,sizeof(int));
-        #if QUAL_STATS
-            stats->qual_ts     = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_tv     = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
-        #endif
-        if ( args->files->n_smpl )
-        {
-            stats->smpl_missing = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_hets   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homAA  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homRR  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_hapRef = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_hapAlt = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_ins_hets = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_del_hets = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_ins_homs = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_del_homs = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_ts     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_tv     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indels = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_dp     = (unsigned long int *) calloc(args->files->n_smpl,sizeof(unsigned long int));
-            stats->smpl_ndp    = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_sngl   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            #if HWE_STATS
-                stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
-            #endif
-            if ( args->exons_fname )
-                stats->smpl_frm_shifts = (int*) calloc(args->files->n_smpl*3,sizeof(int));
-            stats->nvaf = (uint32_t*) calloc(stats->m_indel*2+1,sizeof(*stats->nvaf));
-            stats->dvaf = (double*) calloc(stats->m_indel*2+1,sizeof(*stats->dvaf));
-        }
-        idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
-        idist_init(&stats->dp_sites, args->dp_min,args->dp_max,args->dp_step);
-        init_user_stats(args, i!=1 ? args->files->readers[0].header : args->files->readers[1].header, stats);
-    }
+        init_user_stats(args, i!=1 ? args->files->readers[0].header : args->files->readers[1].header, &args->stats[i]);
 
     if ( args->exons_fname )
     {
@@ -513,29 +523,6 @@ static void init_stats(args_t *args)
     if ( args->ref_fname )
         args->indel_ctx = indel_ctx_init(args->ref_fname);
     #endif
-
-    type2dosage[GT_HOM_RR] = 0;
-    type2dosage[GT_HET_RA] = 1;
-    type2dosage[GT_HOM_AA] = 2;
-    type2dosage[GT_HET_AA] = 2;
-    type2dosage[GT_HAPL_R] = 0;
-    type2dosage[GT_HAPL_A] = 1;
-
-    type2ploidy[GT_HOM_RR] = 1;
-    type2ploidy[GT_HET_RA] = 1;
-    type2ploidy[GT_HOM_AA] = 1;
-    type2ploidy[GT_HET_AA] = 1;
-    type2ploidy[GT_HAPL_R] = -1;
-    type2ploidy[GT_HAPL_A] = -1;
-
-    type2stats[GT_HOM_RR] = 0;
-    type2stats[GT_HET_RA] = 1;
-    type2stats[GT_HOM_AA] = 2;
-    type2stats[GT_HET_AA] = 3;
-    type2stats[GT_HAPL_R] = 0;
-    type2stats[GT_HAPL_A] = 2;
-    type2stats[GT_UNKN]   = 4;
-
 }
 static void destroy_stats(args_t *args)
 {
@@ -584,15 +571,15 @@ static void destroy_stats(args_t *args)
             free(stats->usr[j].val);
         }
         free(stats->usr);
-        if ( args->exons ) free(stats->smpl_frm_shifts);
+        free(stats->smpl_frm_shifts);
         free(stats->nvaf);
         free(stats->dvaf);
     }
-    for (j=0; j<args->nusr; j++) free(args->usr[j].tag);
     if ( args->af_bins ) bin_destroy(args->af_bins);
     free(args->farr);
-    free(args->usr);
     free(args->tmp_frm);
+    free(args->tmp_gt[0]);
+    free(args->tmp_gt[1]);
     free(args->tmp_iaf);
     if (args->exons) bcf_sr_regions_destroy(args->exons);
     free(args->af_gts_snps);
@@ -602,6 +589,7 @@ static void destroy_stats(args_t *args)
     if (args->indel_ctx) indel_ctx_destroy(args->indel_ctx);
     if (args->filter[0]) filter_destroy(args->filter[0]);
     if (args->filter[1]) filter_destroy(args->filter[1]);
+    free(args->fnames);
 }
 
 static void init_iaf(args_t *args, bcf_sr_t *reader)
@@ -883,6 +871,73 @@ static inline void update_dvaf(stats_t *stats, bcf1_t *line, bcf_fmt_t *fmt, int
     stats->dvaf[bin] += dvaf; 
 }
 
+/*
+    The common case of diploid genotypes at biallelic sites stored as int8: the
+    genotype types of all samples are determined in a single branch-free pass over
+    the GT vector by table lookups and the per-sample counters, kept as separate
+    arrays, are then updated without the per-sample calls of bcf_gt_type().
+    Allele codes: 0 missing, 1 REF, 2 ALT, 3 other (not handled), 4 vector_end
+*/
+static const int8_t gt_type_lut[5][5] =
+{
+    { GT_UNKN, GT_UNKN,   GT_UNKN,   GT_UNKN, GT_UNKN   },
+    { GT_UNKN, GT_HOM_RR, GT_HET_RA, -1,      GT_HAPL_R },
+    { GT_UNKN, GT_HET_RA, GT_HOM_AA, -1,      GT_HAPL_A },
+    { -1,      -1,        -1,        -1,      -1        },
+    { GT_UNKN, GT_UNKN,   GT_UNKN,   GT_UNKN, GT_UNKN   },
+};
+static inline int gt_code_int8(int8_t val)
+{
+    uint8_t code = (uint8_t)val >> 1;
+    return val==bcf_int8_vector_end ? 4 : (code < 3 ? code : 3);
+}
+static int gt_types_int8(args_t *args, bcf1_t *line, bcf_fmt_t *fmt, int *samples, int igt)
+{
+    if ( line->n_allele!=2 || fmt->type!=BCF_BT_INT8 || fmt->n!=2 ) return 0;
+    int is, nsmpl = args->files->n_smpl, nbad = 0;
+    hts_expand(int8_t, nsmpl, args->mtmp_gt[igt], args->tmp_gt[igt]);
+    int8_t *gt = args->tmp_gt[igt];
+    for (is=0; is<nsmpl; is++)
+    {
+        int8_t *p = (int8_t*) (fmt->p + 2*samples[is]);
+        gt[is] = gt_type_lut[gt_code_int8(p[0])][gt_code_int8(p[1])];
+        nbad += gt[is]<0;
+    }
+    return nbad ? 0 : 1;
+}
+static void do_snp_sample_stats(args_t *args, stats_t *stats, bcf1_t *line, int *nref_tot, int *nhet_tot, int *nalt_tot)
+{
+    int is, nsmpl = args->files->n_smpl, n_nref = 0, i_nref = 0, nref = 0, nhet = 0, nalt = 0;
+    int ref = bcf_acgt2int(*line->d.allele[0]);
+    int alt = bcf_acgt2int(*line->d.allele[1]);
+    int is_ts = alt>=0 && abs(ref-alt)==2 ? 1 : 0;
+    int is_tv = alt>=0 && !is_ts ? 1 : 0;
+    int8_t *gt = args->tmp_gt[0];
+    for (is=0; is<nsmpl; is++)
+    {
+        int hom_rr = gt[is]==GT_HOM_RR, het = gt[is]==GT_HET_RA, hom_aa = gt[is]==GT_HOM_AA;
+        int nonref = het | hom_aa;
+        stats->smpl_missing[is] += gt[is]==GT_UNKN;
+        stats->smpl_hapRef[is]  += gt[is]==GT_HAPL_R;
+        stats->smpl_hapAlt[is]  += gt[is]==GT_HAPL_A;
+        stats->smpl_homRR[is]   += hom_rr;
+        stats->smpl_hets[is]    += het;
+        stats->smpl_homAA[is]   += hom_aa;
+        stats->smpl_ts[is]      += nonref & is_ts;
+        stats->smpl_tv[is]      += nonref & is_tv;
+        n_nref += nonref;
+        if ( nonref ) i_nref = is;
+        nref += hom_rr;
+        nhet += het;
+        nalt += hom_aa;
+    }
+    if ( n_nref==1 ) stats->smpl_sngl[i_nref]++;
+    #if HWE_STATS
+        *nref_tot += nref;
+        *nhet_tot += nhet;
+        *nalt_tot += nalt;
+    #endif
+}
 static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int matched)
 {
     bcf_srs_t *files = args->files;
@@ -891,7 +946,11 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
     int nref_tot = 0, nhet_tot = 0, nalt_tot = 0;
     int line_type = bcf_get_variant_types(line);
 
-    if ( (fmt_ptr = bcf_get_fmt(reader->header,reader->buffer[0],"GT")) )
+    int gt_fast = 0;
+    if ( (fmt_ptr = bcf_get_fmt(reader->header,reader->buffer[0],"GT")) && line_type==VCF_SNP
+            && (gt_fast = gt_types_int8(args, line, fmt_ptr, reader->samples, 0)) )
+        do_snp_sample_stats(args, stats, line, &nref_tot, &nhet_tot, &nalt_tot);
+    else if ( fmt_ptr )
     {
         bcf_fmt_t *ad_fmt_ptr = bcf_get_variant_types(line)&VCF_INDEL ? bcf_get_fmt(reader->header,reader->buffer[0],"AD") : NULL;
 
@@ -1069,12 +1128,19 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
         gtcmp_t *af_stats = line_type&VCF_SNP ? args->af_gts_snps : args->af_gts_indels;
         gtcmp_t *smpl_stats = line_type&VCF_SNP ? args->smpl_gts_snps : args->smpl_gts_indels;
 
+        int8_t *gts0 = NULL, *gts1 = NULL;
+        if ( (gt_fast || gt_types_int8(args, files->readers[0].buffer[0], fmt0, files->readers[0].samples, 0))
+                && gt_types_int8(args, files->readers[1].buffer[0], fmt1, files->readers[1].samples, 1) )
+        {
+            gts0 = args->tmp_gt[0];
+            gts1 = args->tmp_gt[1];
+        }
         for (is=0; is<files->n_smpl; is++)
         {
             // Simplified comparison: only 0/0, 0/1, 1/1 is looked at as the identity of
             //  actual alleles can be enforced by running without the -c option.
-            int gt0 = bcf_gt_type(fmt0, files->readers[0].samples[is], NULL, NULL);
-            int gt1 = bcf_gt_type(fmt1, files->readers[1].samples[is], NULL, NULL);
+            int gt0 = gts0 ? gts0[is] : bcf_gt_type(fmt0, files->readers[0].samples[is], NULL, NULL);
+            int gt1 = gts1 ? gts1[is] : bcf_gt_type(fmt1, files->readers[1].samples[is], NULL, NULL);
 
             int idx0 = type2stats[gt0];
             int idx1 = type2stats[gt1];
@@ -1129,12 +1195,38 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
     }
 }
 
+static void write_snapshot(args_t *args, uint64_t nread);
+static inline void check_snapshot(args_t *args)
+{
+    // called before the next record is processed, the stats include nread records
+    uint64_t nread = args->nread++;
+    if ( !args->snapshot_secs )
+    {
+        if ( nread < args->snapshot_next ) return;
+        args->snapshot_next += args->snapshot_every;
+    }
+    else
+    {
+        if ( !nread || nread % 1024 ) return;   // do not query the time too often
+        if ( time(NULL) < args->snapshot_time ) return;
+        args->snapshot_time = time(NULL) + args->snapshot_every;
+    }
+    write_snapshot(args, nread);
+}
+
 static void do_vcf_stats(args_t *args)
 {
     bcf_srs_t *files = args->files;
     assert( sizeof(int)>files->nreaders );
+    profile_t *prof = &args->prof;
+    prof->nsmpl = files->n_smpl;
+    profile_mark(prof);
     while ( bcf_sr_next_line(files) )
     {
+        profile_lap(prof, PROF_READ);
+        prof->nrec_in++;
+        if ( args->snapshot_fname ) check_snapshot(args);
+
         bcf_sr_t *reader = NULL;
         bcf1_t *line = NULL;
         int ret = 0, i, pass = 1;
@@ -1155,7 +1247,9 @@ static void do_vcf_stats(args_t *args)
             }
 
         }
+        if ( args->filter_str ) profile_lap(prof, PROF_FILTER);
         if ( !pass ) continue;
+        prof->nrec_out++;
 
         int line_type = bcf_get_variant_types(line);
         init_iaf(args, reader);
@@ -1188,44 +1282,489 @@ static void do_vcf_stats(args_t *args)
 
         if ( bcf_get_info_int32(reader->header,line,"DP",&args->tmp_iaf,&args->ntmp_iaf)==1 )
             (*idist(&stats->dp_sites, args->tmp_iaf[0]))++;    
+        profile_lap(prof, PROF_PROCESS);
+    }
+    profile_lap(prof, PROF_READ);
+}
+
+/*
+    The counters are sums and histograms of the same dimensions for the same options,
+    so that stats collected in parallel by --split-contigs or written by --partial
+    and read by --merge can be added up element-wise. stats_arrays() lists all of
+    them in a fixed order.
+*/
+#define ST_INT    0
+#define ST_UINT32 1
+#define ST_UINT64 2
+#define ST_ULONG  3
+#define ST_DOUBLE 4
+#define ST_GTCMP  5
+
+typedef struct
+{
+    void *dat;
+    int type, n;
+}
+stats_arr_t;
+
+typedef struct
+{
+    stats_arr_t *arr;
+    int narr, marr;
+}
+stats_arrs_t;
+
+static inline void stats_arr_add(stats_arrs_t *arrs, void *dat, int type, int n)
+{
+    if ( !dat || n<=0 ) return;
+    arrs->narr++;
+    hts_expand(stats_arr_t, arrs->narr, arrs->marr, arrs->arr);
+    arrs->arr[arrs->narr-1].dat  = dat;
+    arrs->arr[arrs->narr-1].type = type;
+    arrs->arr[arrs->narr-1].n    = n;
+}
+static void stats_arrays(args_t *args, stats_arrs_t *arrs)
+{
+    int id, j;
+    arrs->narr = 0;
+    for (id=0; id<args->nstats; id++)
+    {
+        stats_t *stats = &args->stats[id];
+        stats_arr_add(arrs, &stats->n_snps, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_indels, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_mnps, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_others, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_mals, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_snp_mals, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_records, ST_UINT32, 1);
+        stats_arr_add(arrs, &stats->n_noalts, ST_UINT32, 1);
+        stats_arr_add(arrs, stats->af_ts, ST_INT, args->m_af);
+        stats_arr_add(arrs, stats->af_tv, ST_INT, args->m_af);
+        stats_arr_add(arrs, stats->af_snps, ST_INT, args->m_af);
+        #if HWE_STATS
+            stats_arr_add(arrs, stats->af_hwe, ST_INT, args->m_af*args->naf_hwe);
+        #endif
+        #if IRC_STATS
+            stats_arr_add(arrs, &stats->n_repeat[0][0], ST_INT, IRC_RLEN*4);
+            stats_arr_add(arrs, &stats->n_repeat_na, ST_INT, 1);
+            for (j=0; j<3; j++) stats_arr_add(arrs, stats->af_repeats[j], ST_INT, args->m_af);
+        #endif
+        stats_arr_add(arrs, &stats->ts_alt1, ST_INT, 1);
+        stats_arr_add(arrs, &stats->tv_alt1, ST_INT, 1);
+        #if QUAL_STATS
+            stats_arr_add(arrs, stats->qual_ts, ST_INT, args->m_qual);
+            stats_arr_add(arrs, stats->qual_tv, ST_INT, args->m_qual);
+            stats_arr_add(arrs, stats->qual_snps, ST_INT, args->m_qual);
+            stats_arr_add(arrs, stats->qual_indels, ST_INT, args->m_qual);
+        #endif
+        stats_arr_add(arrs, stats->insertions, ST_INT, stats->m_indel);
+        stats_arr_add(arrs, stats->deletions, ST_INT, stats->m_indel);
+        stats_arr_add(arrs, &stats->in_frame, ST_INT, 1);
+        stats_arr_add(arrs, &stats->out_frame, ST_INT, 1);
+        stats_arr_add(arrs, &stats->na_frame, ST_INT, 1);
+        stats_arr_add(arrs, &stats->in_frame_alt1, ST_INT, 1);
+        stats_arr_add(arrs, &stats->out_frame_alt1, ST_INT, 1);
+        stats_arr_add(arrs, &stats->na_frame_alt1, ST_INT, 1);
+        stats_arr_add(arrs, stats->subst, ST_INT, 15);
+        stats_arr_add(arrs, stats->smpl_hets, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_homRR, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_homAA, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_ts, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_tv, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_indels, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_ndp, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_sngl, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_hapRef, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_hapAlt, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_missing, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_ins_hets, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_del_hets, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_ins_homs, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_del_homs, ST_INT, args->nsmpl);
+        stats_arr_add(arrs, stats->smpl_frm_shifts, ST_INT, args->nsmpl*3);
+        stats_arr_add(arrs, stats->smpl_dp, ST_ULONG, args->nsmpl);
+        stats_arr_add(arrs, stats->dp.vals, ST_UINT64, stats->dp.m_vals);
+        stats_arr_add(arrs, stats->dp_sites.vals, ST_UINT64, stats->dp_sites.m_vals);
+        for (j=0; j<stats->nusr; j++)
+        {
+            stats_arr_add(arrs, stats->usr[j].vals_ts, ST_UINT64, stats->usr[j].nbins);
+            stats_arr_add(arrs, stats->usr[j].vals_tv, ST_UINT64, stats->usr[j].nbins);
+        }
+        stats_arr_add(arrs, stats->dvaf, ST_DOUBLE, stats->m_indel*2+1);
+        stats_arr_add(arrs, stats->nvaf, ST_UINT32, stats->m_indel*2+1);
+    }
+    stats_arr_add(arrs, args->af_gts_snps, ST_GTCMP, args->m_af);
+    stats_arr_add(arrs, args->af_gts_indels, ST_GTCMP, args->m_af);
+    stats_arr_add(arrs, args->smpl_gts_snps, ST_GTCMP, args->nsmpl);
+    stats_arr_add(arrs, args->smpl_gts_indels, ST_GTCMP, args->nsmpl);
+}
+static size_t stats_arr_size(int type)
+{
+    switch (type)
+    {
+        case ST_INT:    return sizeof(int);
+        case ST_UINT32: return sizeof(uint32_t);
+        case ST_UINT64: return sizeof(uint64_t);
+        case ST_ULONG:  return sizeof(unsigned long int);
+        case ST_DOUBLE: return sizeof(double);
+        case ST_GTCMP:  return sizeof(gtcmp_t);
+    }
+    error("Unexpected type: %d\n", type);
+    return 0;
+}
+#define SUM_ARRAY(type_t,dst,src,n) { type_t *_dst = (type_t*)(dst), *_src = (type_t*)(src); for (j=0; j<(n); j++) _dst[j] += _src[j]; }
+static void stats_merge(args_t *dst, args_t *src)
+{
+    stats_arrs_t a = {0,0,0}, b = {0,0,0};
+    stats_arrays(dst, &a);
+    stats_arrays(src, &b);
+    assert( a.narr==b.narr );
+    int i, j, k;
+    for (i=0; i<a.narr; i++)
+    {
+        stats_arr_t *x = &a.arr[i], *y = &b.arr[i];
+        assert( x->type==y->type && x->n==y->n );
+        switch (x->type)
+        {
+            case ST_INT:    SUM_ARRAY(int, x->dat, y->dat, x->n); break;
+            case ST_UINT32: SUM_ARRAY(uint32_t, x->dat, y->dat, x->n); break;
+            case ST_UINT64: SUM_ARRAY(uint64_t, x->dat, y->dat, x->n); break;
+            case ST_ULONG:  SUM_ARRAY(unsigned long int, x->dat, y->dat, x->n); break;
+            case ST_DOUBLE: SUM_ARRAY(double, x->dat, y->dat, x->n); break;
+            case ST_GTCMP:
+            {
+                gtcmp_t *d = (gtcmp_t*) x->dat, *s = (gtcmp_t*) y->dat;
+                for (k=0; k<x->n; k++)
+                {
+                    SUM_ARRAY(uint64_t, &d[k].gt2gt[0][0], &s[k].gt2gt[0][0], 25);
+                    d[k].y  += s[k].y;
+                    d[k].yy += s[k].yy;
+                    d[k].x  += s[k].x;
+                    d[k].xx += s[k].xx;
+                    d[k].yx += s[k].yx;
+                    d[k].n  += s[k].n;
+                }
+                break;
+            }
+        }
+    }
+    free(a.arr);
+    free(b.arr);
+}
+#undef SUM_ARRAY
+
+/*
+    The --partial file: magic string, a header with the options and names needed
+    to check the compatibility and print the stats, then the raw counters in the
+    order of stats_arrays(). The counters are stored in the native byte order and
+    must be merged on the same architecture.
+*/
+#define PARTIAL_MAGIC "BCFSTAT\1"
+
+typedef struct
+{
+    FILE *fp;
+    const char *fname;
+    int is_write;
+}
+partial_t;
+
+static void partial_io(partial_t *io, void *dat, size_t size, size_t n)
+{
+    if ( !n ) return;
+    size_t ret = io->is_write ? fwrite(dat, size, n, io->fp) : fread(dat, size, n, io->fp);
+    if ( ret!=n )
+    {
+        if ( io->is_write ) error("Error: failed to write to %s\n", io->fname);
+        error("Error: failed to read from %s, truncated file?\n", io->fname);
+    }
+}
+static inline void partial_int(partial_t *io, int *val) { partial_io(io, val, sizeof(int), 1); }
+static void partial_str(partial_t *io, char **str)
+{
+    int len = 0;
+    if ( io->is_write ) len = *str ? strlen(*str) : -1;
+    partial_int(io, &len);
+    if ( io->is_write ) { partial_io(io, *str, 1, len>0 ? len : 0); return; }
+    if ( len<0 ) { *str = NULL; return; }
+    *str = (char*) malloc(len+1);
+    partial_io(io, *str, 1, len);
+    (*str)[len] = 0;
+}
+static void partial_header(partial_t *io, args_t *args)
+{
+    int i, nbins = 0, one = 1, size = sizeof(unsigned long int);
+    partial_int(io, &one);
+    partial_int(io, &size);
+    if ( one!=1 || size!=sizeof(unsigned long int) ) error("The partial stats in %s were created on a different architecture\n", io->fname);
+
+    partial_int(io, &args->nreaders);
+    partial_int(io, &args->nstats);
+    partial_int(io, &args->split_by_id);
+    partial_int(io, &args->m_af);
+    partial_int(io, &args->m_qual);
+    partial_int(io, &args->naf_hwe);
+    partial_int(io, &args->nsmpl);
+    partial_int(io, &args->dp_min);
+    partial_int(io, &args->dp_max);
+    partial_int(io, &args->dp_step);
+    partial_int(io, &args->nusr);
+    if ( args->nreaders<1 || args->nreaders>2 || args->nstats<1 || args->nstats>3 || args->nsmpl<0 || args->nusr<0 )
+        error("Could not parse the partial stats in %s\n", io->fname);
+    if ( !io->is_write )
+    {
+        args->fnames = (char**) calloc(args->nreaders, sizeof(char*));
+        args->smpl_names = (char**) calloc(args->nsmpl, sizeof(char*));
+        args->usr = (user_stats_t*) calloc(args->nusr, sizeof(user_stats_t));
+    }
+    for (i=0; i<args->nreaders; i++)
+    {
+        partial_str(io, &args->fnames[i]);
+        partial_int(io, &args->nhdr_smpl[i]);
+    }
+    for (i=0; i<args->nsmpl; i++) partial_str(io, &args->smpl_names[i]);
+    for (i=0; i<args->nusr; i++)
+    {
+        user_stats_t *usr = &args->usr[i];
+        if ( io->is_write ) usr->type = args->stats[0].usr[i].type;    // set by init_user_stats()
+        partial_str(io, &usr->tag);
+        partial_io(io, &usr->min, sizeof(float), 1);
+        partial_io(io, &usr->max, sizeof(float), 1);
+        partial_int(io, &usr->nbins);
+        partial_int(io, &usr->type);
+    }
+    partial_str(io, &args->exons_fname);
+    partial_str(io, &args->ref_fname);
+
+    if ( io->is_write ) nbins = args->af_bins ? bin_get_size(args->af_bins) : 0;
+    partial_int(io, &nbins);
+    if ( io->is_write )
+    {
+        for (i=0; i<nbins; i++)
+        {
+            float val = bin_get_value(args->af_bins, i);
+            partial_io(io, &val, sizeof(float), 1);
+        }
+    }
+    else if ( nbins )
+    {
+        kstring_t str = {0,0,0};
+        for (i=0; i<nbins; i++)
+        {
+            float val;
+            partial_io(io, &val, sizeof(float), 1);
+            if ( i ) kputc(',', &str);
+            ksprintf(&str, "%.9g", val);
+        }
+        args->af_bins = bin_init(str.s, 0, 0);
+        free(str.s);
+    }
+}
+static void partial_counters(partial_t *io, args_t *args)
+{
+    stats_arrs_t arrs = {0,0,0};
+    stats_arrays(args, &arrs);
+    int i;
+    for (i=0; i<arrs.narr; i++)
+        partial_io(io, arrs.arr[i].dat, stats_arr_size(arrs.arr[i].type), arrs.arr[i].n);
+    free(arrs.arr);
+}
+static void write_partial(args_t *args)
+{
+    partial_t io = { NULL, args->partial_fname, 1 };
+    io.fp = strcmp("-",io.fname) ? fopen(io.fname, "wb") : stdout;
+    if ( !io.fp ) error("Failed to open %s: %s\n", io.fname, strerror(errno));
+    partial_io(&io, PARTIAL_MAGIC, 1, 8);
+    partial_header(&io, args);
+    partial_counters(&io, args);
+    if ( io.fp!=stdout && fclose(io.fp)!=0 ) error("Error: close failed .. %s\n", io.fname);
+}
+static void destroy_partial(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nreaders; i++) free(args->fnames[i]);
+    for (i=0; i<args->nsmpl; i++) free(args->smpl_names[i]);
+    free(args->smpl_names);
+    free(args->exons_fname);
+    free(args->ref_fname);
+}
+static void merge_check(args_t *args, args_t *tmp, const char *fname)
+{
+    #define CHECK(cond,what) if ( !(cond) ) error("The partial stats in %s are not compatible with the previous files: %s differ\n", fname,what)
+    int i;
+    CHECK(args->nreaders==tmp->nreaders, "the number of input files");
+    CHECK(args->nstats==tmp->nstats && args->split_by_id==tmp->split_by_id, "the sets");
+    CHECK(args->m_af==tmp->m_af, "the allele frequency bins");
+    CHECK(args->m_qual==tmp->m_qual && args->naf_hwe==tmp->naf_hwe, "the QUAL or HWE bins");
+    CHECK(args->dp_min==tmp->dp_min && args->dp_max==tmp->dp_max && args->dp_step==tmp->dp_step, "the --depth bins");
+    CHECK(!args->exons_fname==!tmp->exons_fname, "the --exons options");
+    CHECK(!args->ref_fname==!tmp->ref_fname, "the --fasta-ref options");
+    CHECK(args->nsmpl==tmp->nsmpl, "the samples");
+    for (i=0; i<args->nsmpl; i++) CHECK(!strcmp(args->smpl_names[i],tmp->smpl_names[i]), "the samples");
+    CHECK(args->nusr==tmp->nusr, "the --user-tstv options");
+    for (i=0; i<args->nusr; i++)
+        CHECK(!strcmp(args->usr[i].tag,tmp->usr[i].tag) && args->usr[i].nbins==tmp->usr[i].nbins
+            && args->usr[i].min==tmp->usr[i].min && args->usr[i].max==tmp->usr[i].max, "the --user-tstv options");
+    CHECK(!args->af_bins==!tmp->af_bins, "the allele frequency bins");
+    for (i=0; args->af_bins && i<args->m_af; i++)
+        CHECK(bin_get_value(args->af_bins,i)==bin_get_value(tmp->af_bins,i), "the allele frequency bins");
+    #undef CHECK
+}
+static void merge_partial(args_t *args, const char *fname)
+{
+    args_t *tmp = args->nstats ? (args_t*) calloc(1,sizeof(args_t)) : args;
+    partial_t io = { NULL, fname, 0 };
+    io.fp = strcmp("-",fname) ? fopen(fname, "rb") : stdin;
+    if ( !io.fp ) error("Failed to open %s: %s\n", fname, strerror(errno));
+    char magic[8];
+    partial_io(&io, magic, 1, 8);
+    if ( memcmp(magic, PARTIAL_MAGIC, 8) ) error("The file %s was not created by bcftools stats --partial\n", fname);
+    partial_header(&io, tmp);
+    if ( tmp!=args ) merge_check(args, tmp, fname);
+    alloc_stats(tmp);
+    int i;
+    for (i=0; i<tmp->nstats; i++) init_user_stats(tmp, NULL, &tmp->stats[i]);
+    partial_counters(&io, tmp);
+    if ( io.fp!=stdin ) fclose(io.fp);
+    if ( tmp==args ) return;
+
+    stats_merge(args, tmp);
+    destroy_partial(tmp);
+    destroy_stats(tmp);
+    for (i=0; i<tmp->nusr; i++) free(tmp->usr[i].tag);
+    free(tmp->usr);
+    free(tmp);
+}
+
+typedef struct
+{
+    args_t *args, *stats;
+    char *regions;
+}
+stats_chunk_t;
+
+static void *stats_chunk(void *arg)
+{
+    stats_chunk_t *chunk = (stats_chunk_t*) arg;
+    args_t *opts = chunk->args;
+
+    // the options only, the worker has its own readers and counters
+    args_t *args = (args_t*) calloc(1,sizeof(args_t));
+    args->dp_min = opts->dp_min; args->dp_max = opts->dp_max; args->dp_step = opts->dp_step;
+    args->nusr = opts->nusr; args->usr = opts->usr;
+    args->ref_fname = opts->ref_fname;
+    args->exons_fname = opts->exons_fname;
+    args->samples_list = opts->samples_list;
+    args->samples_is_file = opts->samples_is_file;
+    args->af_bins_list = opts->af_bins_list;
+    args->af_tag = opts->af_tag;
+    args->first_allele_only = opts->first_allele_only;
+    args->split_by_id = opts->split_by_id;
+    args->filter_str = opts->filter_str;
+    args->filter_logic = opts->filter_logic;
+
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->collapse = opts->files->collapse;
+    args->files->apply_filters = opts->files->apply_filters;
+    args->files->max_unpack = opts->files->max_unpack;
+    if ( opts->targets_list && bcf_sr_set_targets(args->files, opts->targets_list, opts->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", opts->targets_list);
+    if ( bcf_sr_set_regions(args->files, chunk->regions, 0)<0 ) error("Failed to set the regions: %s\n", chunk->regions);
+    int i;
+    for (i=0; i<opts->files->nreaders; i++)
+    {
+        const char *fname = opts->files->readers[i].fname;
+        if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to read from %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
+    }
+
+    init_stats(args);
+    do_vcf_stats(args);
+    chunk->stats = args;
+    return chunk;
+}
+
+static void stats_split(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    int i;
+    for (i=0; i<files->nreaders; i++)
+        if ( !files->readers[i].tbx_idx && !files->readers[i].bcf_idx ) error("The --split-contigs option requires indexed input files\n");
+
+    // consecutive groups of contigs with similar number of records, empty contigs are skipped
+    int nchunks;
+    regplan_chunk_t *plan = regplan_contigs(files, 4*args->n_threads, &nchunks);
+    stats_chunk_t *chunks = (stats_chunk_t*) calloc(nchunks ? nchunks : 1, sizeof(stats_chunk_t));
+    for (i=0; i<nchunks; i++)
+    {
+        chunks[i].args = args;
+        chunks[i].regions = plan[i].regions;
     }
+
+    hts_tpool *pool = nchunks ? hts_tpool_init(args->n_threads) : NULL;
+    hts_tpool_process *queue = NULL;
+    if ( nchunks )
+    {
+        if ( !pool ) error("Failed to initialize %d threads\n", args->n_threads);
+        queue = hts_tpool_process_init(pool, nchunks, 0);
+        for (i=0; i<nchunks; i++)
+            if ( hts_tpool_dispatch(pool, queue, stats_chunk, &chunks[i])!=0 ) error("[%s] Error: failed to dispatch a job\n", __func__);
+    }
+
+    // reduce the per-thread counters
+    for (i=0; i<nchunks; i++)
+    {
+        hts_tpool_result *res = hts_tpool_next_result_wait(queue);
+        if ( !res ) error("[%s] Error: failed to retrieve a result from the thread pool\n", __func__);
+        stats_chunk_t *chunk = (stats_chunk_t*) hts_tpool_result_data(res);
+        hts_tpool_delete_result(res, 0);
+
+        stats_merge(args, chunk->stats);
+        destroy_stats(chunk->stats);
+        bcf_sr_destroy(chunk->stats->files);
+        free(chunk->stats);
+    }
+    if ( queue ) hts_tpool_process_destroy(queue);
+    if ( pool ) hts_tpool_destroy(pool);
+    free(chunks);
+    regplan_destroy(plan, nchunks);
 }
 
 static void print_header(args_t *args)
 {
     int i;
-    printf("# This file was produced by bcftools stats (%s+htslib-%s) and can be plotted using plot-vcfstats.\n", bcftools_version(),hts_version());
-    printf("# The command line was:\tbcftools %s ", args->argv[0]);
+    fprintf(args->out, "# This file was produced by bcftools stats (%s+htslib-%s) and can be plotted using plot-vcfstats.\n", bcftools_version(),hts_version());
+    fprintf(args->out, "# The command line was:\tbcftools %s ", args->argv[0]);
     for (i=1; i<args->argc; i++)
-        printf(" %s",args->argv[i]);
-    printf("\n#\n");
+        fprintf(args->out, " %s",args->argv[i]);
+    fprintf(args->out, "\n#\n");
 
-    printf("# Definition of sets:\n# ID\t[2]id\t[3]tab-separated file names\n");
-    if ( args->files->nreaders==1 )
+    fprintf(args->out, "# Definition of sets:\n# ID\t[2]id\t[3]tab-separated file names\n");
+    if ( args->nreaders==1 )
     {
-        const char *fname = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
+        const char *fname = strcmp("-",args->fnames[0]) ? args->fnames[0] : "<STDIN>";
         if ( args->split_by_id )
         {
-            printf("ID\t0\t%s:known (sites with ID different from \".\")\n", fname);
-            printf("ID\t1\t%s:novel (sites where ID column is \".\")\n", fname);
+            fprintf(args->out, "ID\t0\t%s:known (sites with ID different from \".\")\n", fname);
+            fprintf(args->out, "ID\t1\t%s:novel (sites where ID column is \".\")\n", fname);
         }
         else
-            printf("ID\t0\t%s\n", fname);
+            fprintf(args->out, "ID\t0\t%s\n", fname);
     }
     else
     {
-        const char *fname0 = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
-        const char *fname1 = strcmp("-",args->files->readers[1].fname) ? args->files->readers[1].fname : "<STDIN>";
-        printf("ID\t0\t%s\n", fname0);
-        printf("ID\t1\t%s\n", fname1);
-        printf("ID\t2\t%s\t%s\n", fname0,fname1);
+        const char *fname0 = strcmp("-",args->fnames[0]) ? args->fnames[0] : "<STDIN>";
+        const char *fname1 = strcmp("-",args->fnames[1]) ? args->fnames[1] : "<STDIN>";
+        fprintf(args->out, "ID\t0\t%s\n", fname0);
+        fprintf(args->out, "ID\t1\t%s\n", fname1);
+        fprintf(args->out, "ID\t2\t%s\t%s\n", fname0,fname1);
 
         if ( args->verbose_sites )
         {
-            printf(
+            fprintf(args->out,
                     "# Verbose per-site discordance output.\n"
                     "# PSD\t[2]CHROM\t[3]POS\t[4]Number of matches\t[5]Number of mismatches\t[6]NRD\n");
-            printf(
+            fprintf(args->out,
                     "# Verbose per-site and per-sample output. Genotype codes: %d:HomRefRef, %d:HomAltAlt, %d:HetAltRef, %d:HetAltAlt, %d:haploidRef, %d:haploidAlt\n"
                     "# DBG\t[2]CHROM\t[3]POS\t[4]Sample\t[5]GT in %s\t[6]GT in %s\n",
                     GT_HOM_RR, GT_HOM_AA, GT_HET_RA, GT_HET_AA, GT_HAPL_R, GT_HAPL_A, fname0,fname1);
@@ -1237,57 +1776,57 @@ static void print_header(args_t *args)
 static void print_stats(args_t *args)
 {
     int i, j,k, id;
-    printf("# SN, Summary numbers:\n");
-    printf("#   number of records   .. number of data rows in the VCF\n");
-    printf("#   number of no-ALTs   .. reference-only sites, ALT is either \".\" or identical to REF\n");
-    printf("#   number of SNPs      .. number of rows with a SNP\n");
-    printf("#   number of MNPs      .. number of rows with a MNP, such as CC>TT\n");
-    printf("#   number of indels    .. number of rows with an indel\n");
-    printf("#   number of others    .. number of rows with other type, for example a symbolic allele or\n");
-    printf("#                          a complex substitution, such as ACT>TCGA\n");
-    printf("#   number of multiallelic sites     .. number of rows with multiple alternate alleles\n");
-    printf("#   number of multiallelic SNP sites .. number of rows with multiple alternate alleles, all SNPs\n");
-    printf("# \n");
-    printf("#   Note that rows containing multiple types will be counted multiple times, in each\n");
-    printf("#   counter. For example, a row with a SNP and an indel increments both the SNP and\n");
-    printf("#   the indel counter.\n");
-    printf("# \n");
-    printf("# SN\t[2]id\t[3]key\t[4]value\n");
-    for (id=0; id<args->files->nreaders; id++)
-        printf("SN\t%d\tnumber of samples:\t%d\n", id, bcf_hdr_nsamples(args->files->readers[id].header));
+    fprintf(args->out, "# SN, Summary numbers:\n");
+    fprintf(args->out, "#   number of records   .. number of data rows in the VCF\n");
+    fprintf(args->out, "#   number of no-ALTs   .. reference-only sites, ALT is either \".\" or identical to REF\n");
+    fprintf(args->out, "#   number of SNPs      .. number of rows with a SNP\n");
+    fprintf(args->out, "#   number of MNPs      .. number of rows with a MNP, such as CC>TT\n");
+    fprintf(args->out, "#   number of indels    .. number of rows with an indel\n");
+    fprintf(args->out, "#   number of others    .. number of rows with other type, for example a symbolic allele or\n");
+    fprintf(args->out, "#                          a complex substitution, such as ACT>TCGA\n");
+    fprintf(args->out, "#   number of multiallelic sites     .. number of rows with multiple alternate alleles\n");
+    fprintf(args->out, "#   number of multiallelic SNP sites .. number of rows with multiple alternate alleles, all SNPs\n");
+    fprintf(args->out, "# \n");
+    fprintf(args->out, "#   Note that rows containing multiple types will be counted multiple times, in each\n");
+    fprintf(args->out, "#   counter. For example, a row with a SNP and an indel increments both the SNP and\n");
+    fprintf(args->out, "#   the indel counter.\n");
+    fprintf(args->out, "# \n");
+    fprintf(args->out, "# SN\t[2]id\t[3]key\t[4]value\n");
+    for (id=0; id<args->nreaders; id++)
+        fprintf(args->out, "SN\t%d\tnumber of samples:\t%d\n", id, args->nhdr_smpl[id]);
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
-        printf("SN\t%d\tnumber of records:\t%u\n", id, stats->n_records);
-        printf("SN\t%d\tnumber of no-ALTs:\t%u\n", id, stats->n_noalts);
-        printf("SN\t%d\tnumber of SNPs:\t%u\n", id, stats->n_snps);
-        printf("SN\t%d\tnumber of MNPs:\t%u\n", id, stats->n_mnps);
-        printf("SN\t%d\tnumber of indels:\t%u\n", id, stats->n_indels);
-        printf("SN\t%d\tnumber of others:\t%u\n", id, stats->n_others);
-        printf("SN\t%d\tnumber of multiallelic sites:\t%u\n", id, stats->n_mals);
-        printf("SN\t%d\tnumber of multiallelic SNP sites:\t%u\n", id, stats->n_snp_mals);
-    }
-    printf("# TSTV, transitions/transversions:\n# TSTV\t[2]id\t[3]ts\t[4]tv\t[5]ts/tv\t[6]ts (1st ALT)\t[7]tv (1st ALT)\t[8]ts/tv (1st ALT)\n");
+        fprintf(args->out, "SN\t%d\tnumber of records:\t%u\n", id, stats->n_records);
+        fprintf(args->out, "SN\t%d\tnumber of no-ALTs:\t%u\n", id, stats->n_noalts);
+        fprintf(args->out, "SN\t%d\tnumber of SNPs:\t%u\n", id, stats->n_snps);
+        fprintf(args->out, "SN\t%d\tnumber of MNPs:\t%u\n", id, stats->n_mnps);
+        fprintf(args->out, "SN\t%d\tnumber of indels:\t%u\n", id, stats->n_indels);
+        fprintf(args->out, "SN\t%d\tnumber of others:\t%u\n", id, stats->n_others);
+        fprintf(args->out, "SN\t%d\tnumber of multiallelic sites:\t%u\n", id, stats->n_mals);
+        fprintf(args->out, "SN\t%d\tnumber of multiallelic SNP sites:\t%u\n", id, stats->n_snp_mals);
+    }
+    fprintf(args->out, "# TSTV, transitions/transversions:\n# TSTV\t[2]id\t[3]ts\t[4]tv\t[5]ts/tv\t[6]ts (1st ALT)\t[7]tv (1st ALT)\t[8]ts/tv (1st ALT)\n");
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
         int ts=0,tv=0;
         for (i=0; i<args->m_af; i++) { ts += stats->af_ts[i]; tv += stats->af_tv[i];  }
-        printf("TSTV\t%d\t%d\t%d\t%.2f\t%d\t%d\t%.2f\n", id,ts,tv,tv?(float)ts/tv:0, stats->ts_alt1,stats->tv_alt1,stats->tv_alt1?(float)stats->ts_alt1/stats->tv_alt1:0);
+        fprintf(args->out, "TSTV\t%d\t%d\t%d\t%.2f\t%d\t%d\t%.2f\n", id,ts,tv,tv?(float)ts/tv:0, stats->ts_alt1,stats->tv_alt1,stats->tv_alt1?(float)stats->ts_alt1/stats->tv_alt1:0);
     }
     if ( args->exons_fname )
     {
-        printf("# FS, Indel frameshifts:\n# FS\t[2]id\t[3]in-frame\t[4]out-frame\t[5]not applicable\t[6]out/(in+out) ratio\t[7]in-frame (1st ALT)\t[8]out-frame (1st ALT)\t[9]not applicable (1st ALT)\t[10]out/(in+out) ratio (1st ALT)\n");
+        fprintf(args->out, "# FS, Indel frameshifts:\n# FS\t[2]id\t[3]in-frame\t[4]out-frame\t[5]not applicable\t[6]out/(in+out) ratio\t[7]in-frame (1st ALT)\t[8]out-frame (1st ALT)\t[9]not applicable (1st ALT)\t[10]out/(in+out) ratio (1st ALT)\n");
         for (id=0; id<args->nstats; id++)
         {
             int in=args->stats[id].in_frame, out=args->stats[id].out_frame, na=args->stats[id].na_frame;
             int in1=args->stats[id].in_frame_alt1, out1=args->stats[id].out_frame_alt1, na1=args->stats[id].na_frame_alt1;
-            printf("FS\t%d\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%.2f\n", id, in,out,na,out?(float)out/(in+out):0,in1,out1,na1,out1?(float)out1/(in1+out1):0);
+            fprintf(args->out, "FS\t%d\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%.2f\n", id, in,out,na,out?(float)out/(in+out):0,in1,out1,na1,out1?(float)out1/(in1+out1):0);
         }
     }
-    if ( args->indel_ctx )
+    if ( args->ref_fname )
     {
-        printf("# ICS, Indel context summary:\n# ICS\t[2]id\t[3]repeat-consistent\t[4]repeat-inconsistent\t[5]not applicable\t[6]c/(c+i) ratio\n");
+        fprintf(args->out, "# ICS, Indel context summary:\n# ICS\t[2]id\t[3]repeat-consistent\t[4]repeat-inconsistent\t[5]not applicable\t[6]c/(c+i) ratio\n");
         for (id=0; id<args->nstats; id++)
         {
             int nc = 0, ni = 0, na = args->stats[id].n_repeat_na;
@@ -1296,25 +1835,25 @@ static void print_stats(args_t *args)
                 nc += args->stats[id].n_repeat[i][0] + args->stats[id].n_repeat[i][2];
                 ni += args->stats[id].n_repeat[i][1] + args->stats[id].n_repeat[i][3];
             }
-            printf("ICS\t%d\t%d\t%d\t%d\t%.4f\n", id, nc,ni,na,nc+ni ? (float)nc/(nc+ni) : 0.0);
+            fprintf(args->out, "ICS\t%d\t%d\t%d\t%d\t%.4f\n", id, nc,ni,na,nc+ni ? (float)nc/(nc+ni) : 0.0);
         }
-        printf("# ICL, Indel context by length:\n# ICL\t[2]id\t[3]length of repeat element\t[4]repeat-consistent deletions)\t[5]repeat-inconsistent deletions\t[6]consistent insertions\t[7]inconsistent insertions\t[8]c/(c+i) ratio\n");
+        fprintf(args->out, "# ICL, Indel context by length:\n# ICL\t[2]id\t[3]length of repeat element\t[4]repeat-consistent deletions)\t[5]repeat-inconsistent deletions\t[6]consistent insertions\t[7]inconsistent insertions\t[8]c/(c+i) ratio\n");
         for (id=0; id<args->nstats; id++)
         {
             for (i=1; i<IRC_RLEN; i++)
             {
                 int nc = args->stats[id].n_repeat[i][0]+args->stats[id].n_repeat[i][2], ni = args->stats[id].n_repeat[i][1]+args->stats[id].n_repeat[i][3];
-                printf("ICL\t%d\t%d\t%d\t%d\t%d\t%d\t%.4f\n", id, i+1,
+                fprintf(args->out, "ICL\t%d\t%d\t%d\t%d\t%d\t%d\t%.4f\n", id, i+1,
                     args->stats[id].n_repeat[i][0],args->stats[id].n_repeat[i][1],args->stats[id].n_repeat[i][2],args->stats[id].n_repeat[i][3],
                     nc+ni ? (float)nc/(nc+ni) : 0.0);
             }
         }
     }
-    printf("# SiS, Singleton stats:\n# SiS\t[2]id\t[3]allele count\t[4]number of SNPs\t[5]number of transitions\t[6]number of transversions\t[7]number of indels\t[8]repeat-consistent\t[9]repeat-inconsistent\t[10]not applicable\n");
+    fprintf(args->out, "# SiS, Singleton stats:\n# SiS\t[2]id\t[3]allele count\t[4]number of SNPs\t[5]number of transitions\t[6]number of transversions\t[7]number of indels\t[8]repeat-consistent\t[9]repeat-inconsistent\t[10]not applicable\n");
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
-        printf("SiS\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", id,1,stats->af_snps[0],stats->af_ts[0],stats->af_tv[0],
+        fprintf(args->out, "SiS\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", id,1,stats->af_snps[0],stats->af_ts[0],stats->af_tv[0],
             stats->af_repeats[0][0]+stats->af_repeats[1][0]+stats->af_repeats[2][0],stats->af_repeats[0][0],stats->af_repeats[1][0],stats->af_repeats[2][0]);
         // put the singletons stats into the first AF bin, note that not all of the stats is transferred (i.e. nrd mismatches)
         stats->af_snps[1]       += stats->af_snps[0];
@@ -1342,7 +1881,7 @@ static void print_stats(args_t *args)
         args->af_gts_indels[1].n  += args->af_gts_indels[0].n;
     }
 
-    printf("# AF, Stats by non-reference allele frequency:\n# AF\t[2]id\t[3]allele frequency\t[4]number of SNPs\t[5]number of transitions\t[6]number of transversions\t[7]number of indels\t[8]repeat-consistent\t[9]repeat-inconsistent\t[10]not applicable\n");
+    fprintf(args->out, "# AF, Stats by non-reference allele frequency:\n# AF\t[2]id\t[3]allele frequency\t[4]number of SNPs\t[5]number of transitions\t[6]number of transversions\t[7]number of indels\t[8]repeat-consistent\t[9]repeat-inconsistent\t[10]not applicable\n");
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
@@ -1350,25 +1889,25 @@ static void print_stats(args_t *args)
         {
             if ( stats->af_snps[i]+stats->af_ts[i]+stats->af_tv[i]+stats->af_repeats[0][i]+stats->af_repeats[1][i]+stats->af_repeats[2][i] == 0  ) continue;
             double af = args->af_bins ? (bin_get_value(args->af_bins,i)+bin_get_value(args->af_bins,i-1))*0.5 : (double)(i-1)/(args->m_af-1);
-            printf("AF\t%d\t%f\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", id,af,stats->af_snps[i],stats->af_ts[i],stats->af_tv[i],
+            fprintf(args->out, "AF\t%d\t%f\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", id,af,stats->af_snps[i],stats->af_ts[i],stats->af_tv[i],
                 stats->af_repeats[0][i]+stats->af_repeats[1][i]+stats->af_repeats[2][i],stats->af_repeats[0][i],stats->af_repeats[1][i],stats->af_repeats[2][i]);
         }
     }
     #if QUAL_STATS
-        printf("# QUAL, Stats by quality:\n# QUAL\t[2]id\t[3]Quality\t[4]number of SNPs\t[5]number of transitions (1st ALT)\t[6]number of transversions (1st ALT)\t[7]number of indels\n");
+        fprintf(args->out, "# QUAL, Stats by quality:\n# QUAL\t[2]id\t[3]Quality\t[4]number of SNPs\t[5]number of transitions (1st ALT)\t[6]number of transversions (1st ALT)\t[7]number of indels\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
             for (i=0; i<args->m_qual; i++)
             {
                 if ( stats->qual_snps[i]+stats->qual_ts[i]+stats->qual_tv[i]+stats->qual_indels[i] == 0  ) continue;
-                printf("QUAL\t%d\t%d\t%d\t%d\t%d\t%d\n", id,i,stats->qual_snps[i],stats->qual_ts[i],stats->qual_tv[i],stats->qual_indels[i]);
+                fprintf(args->out, "QUAL\t%d\t%d\t%d\t%d\t%d\t%d\n", id,i,stats->qual_snps[i],stats->qual_ts[i],stats->qual_tv[i],stats->qual_indels[i]);
             }
         }
     #endif
     for (i=0; i<args->nusr; i++)
     {
-        printf("# USR:%s, Stats by %s:\n# USR:%s\t[2]id\t[3]%s\t[4]number of SNPs\t[5]number of transitions (1st ALT)\t[6]number of transversions (1st ALT)\n",
+        fprintf(args->out, "# USR:%s, Stats by %s:\n# USR:%s\t[2]id\t[3]%s\t[4]number of SNPs\t[5]number of transitions (1st ALT)\t[6]number of transversions (1st ALT)\n",
             args->usr[i].tag,args->usr[i].tag,args->usr[i].tag,args->usr[i].tag);
         for (id=0; id<args->nstats; id++)
         {
@@ -1379,11 +1918,11 @@ static void print_stats(args_t *args)
                 if ( usr->vals_ts[j]+usr->vals_tv[j] == 0 ) continue;   // skip empty bins
                 float val = usr->min + (usr->max - usr->min)*j/(usr->nbins-1);
                 const char *fmt = usr->type==BCF_HT_REAL ? "USR:%s\t%d\t%e\t%d\t%d\t%d\n" : "USR:%s\t%d\t%.0f\t%d\t%d\t%d\n";
-                printf(fmt,usr->tag,id,val,usr->vals_ts[j]+usr->vals_tv[j],usr->vals_ts[j],usr->vals_tv[j]);
+                fprintf(args->out, fmt,usr->tag,id,val,usr->vals_ts[j]+usr->vals_tv[j],usr->vals_ts[j],usr->vals_tv[j]);
             }
         }
     }
-    printf("# IDD, InDel distribution:\n# IDD\t[2]id\t[3]length (deletions negative)\t[4]number of sites\t[5]number of genotypes\t[6]mean VAF\n");
+    fprintf(args->out, "# IDD, InDel distribution:\n# IDD\t[2]id\t[3]length (deletions negative)\t[4]number of sites\t[5]number of genotypes\t[6]mean VAF\n");
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
@@ -1392,38 +1931,38 @@ static void print_stats(args_t *args)
             if ( !stats->deletions[i] ) continue;
             // whops, differently organized arrow, dels are together with ins
             int bin = stats->m_indel - i - 1;
-            printf("IDD\t%d\t%d\t%d\t", id,-i-1,stats->deletions[i]);
+            fprintf(args->out, "IDD\t%d\t%d\t%d\t", id,-i-1,stats->deletions[i]);
             if ( stats->nvaf && stats->nvaf[bin] )
-                printf("%u\t%.2f",stats->nvaf[bin],stats->dvaf[bin]/stats->nvaf[bin]);
+                fprintf(args->out, "%u\t%.2f",stats->nvaf[bin],stats->dvaf[bin]/stats->nvaf[bin]);
             else
-                printf("0\t.");
-            printf("\n");
+                fprintf(args->out, "0\t.");
+            fprintf(args->out, "\n");
         }
         for (i=0; i<stats->m_indel; i++)
         {
             if ( !stats->insertions[i] ) continue;
             int bin = stats->m_indel + i + 1;
-            printf("IDD\t%d\t%d\t%d\t", id,i+1,stats->insertions[i]);
+            fprintf(args->out, "IDD\t%d\t%d\t%d\t", id,i+1,stats->insertions[i]);
             if ( stats->nvaf && stats->nvaf[bin] )
-                printf("%u\t%.2f",stats->nvaf[bin],stats->dvaf[bin]/stats->nvaf[bin]);
+                fprintf(args->out, "%u\t%.2f",stats->nvaf[bin],stats->dvaf[bin]/stats->nvaf[bin]);
             else
-                printf("0\t.");
-            printf("\n");
+                fprintf(args->out, "0\t.");
+            fprintf(args->out, "\n");
         }
     }
-    printf("# ST, Substitution types:\n# ST\t[2]id\t[3]type\t[4]count\n");
+    fprintf(args->out, "# ST, Substitution types:\n# ST\t[2]id\t[3]type\t[4]count\n");
     for (id=0; id<args->nstats; id++)
     {
         int t;
         for (t=0; t<15; t++)
         {
             if ( t>>2 == (t&3) ) continue;
-            printf("ST\t%d\t%c>%c\t%d\n", id, bcf_int2acgt(t>>2),bcf_int2acgt(t&3),args->stats[id].subst[t]);
+            fprintf(args->out, "ST\t%d\t%c>%c\t%d\n", id, bcf_int2acgt(t>>2),bcf_int2acgt(t&3),args->stats[id].subst[t]);
         }
     }
-    if ( args->files->nreaders>1 && args->files->n_smpl )
+    if ( args->nreaders>1 && args->nsmpl )
     {
-        printf("SN\t%d\tnumber of samples:\t%d\n", 2, args->files->n_smpl);
+        fprintf(args->out, "SN\t%d\tnumber of samples:\t%d\n", 2, args->nsmpl);
 
         int x;
         for (x=0; x<2; x++)     // x=0: snps, x=1: indels
@@ -1431,12 +1970,12 @@ static void print_stats(args_t *args)
             gtcmp_t *stats;
             if ( x==0 )
             {
-                printf("# GCsAF, Genotype concordance by non-reference allele frequency (SNPs)\n# GCsAF\t[2]id\t[3]allele frequency\t[4]RR Hom matches\t[5]RA Het matches\t[6]AA Hom matches\t[7]RR Hom mismatches\t[8]RA Het mismatches\t[9]AA Hom mismatches\t[10]dosage r-squared\t[11]number of genotypes\n");
+                fprintf(args->out, "# GCsAF, Genotype concordance by non-reference allele frequency (SNPs)\n# GCsAF\t[2]id\t[3]allele frequency\t[4]RR Hom matches\t[5]RA Het matches\t[6]AA Hom matches\t[7]RR Hom mismatches\t[8]RA Het mismatches\t[9]AA Hom mismatches\t[10]dosage r-squared\t[11]number of genotypes\n");
                 stats = args->af_gts_snps;
             }
             else
             {
-                printf("# GCiAF, Genotype concordance by non-reference allele frequency (indels)\n# GCiAF\t[2]id\t[3]allele frequency\t[4]RR Hom matches\t[5]RA Het matches\t[6]AA Hom matches\t[7]RR Hom mismatches\t[8]RA Het mismatches\t[9]AA Hom mismatches\t[10]dosage r-squared\t[11]number of genotypes\n");
+                fprintf(args->out, "# GCiAF, Genotype concordance by non-reference allele frequency (indels)\n# GCiAF\t[2]id\t[3]allele frequency\t[4]RR Hom matches\t[5]RA Het matches\t[6]AA Hom matches\t[7]RR Hom mismatches\t[8]RA Het mismatches\t[9]AA Hom mismatches\t[10]dosage r-squared\t[11]number of genotypes\n");
                 stats = args->af_gts_indels;
             }
             uint64_t nrd_m[4] = {0,0,0,0}, nrd_mm[4] = {0,0,0,0};   // across all bins
@@ -1470,30 +2009,30 @@ static void print_stats(args_t *args)
                     r2 *= r2;
                 }
                 double af = args->af_bins ? (bin_get_value(args->af_bins,i)+bin_get_value(args->af_bins,i-1))*0.5 : (double)(i-1)/(args->m_af-1);
-                printf("GC%cAF\t2\t%f", x==0 ? 's' : 'i', af);
-                printf("\t%"PRId64"\t%"PRId64"\t%"PRId64"", m[T2S(GT_HOM_RR)],m[T2S(GT_HET_RA)],m[T2S(GT_HOM_AA)]);
-                printf("\t%"PRId64"\t%"PRId64"\t%"PRId64"", mm[T2S(GT_HOM_RR)],mm[T2S(GT_HET_RA)],mm[T2S(GT_HOM_AA)]);
-                if ( stats[i].n && !isnan(r2) ) printf("\t%f", r2);
-                else printf("\t"NA_STRING);
-                printf("\t%.0f\n", stats[i].n);
+                fprintf(args->out, "GC%cAF\t2\t%f", x==0 ? 's' : 'i', af);
+                fprintf(args->out, "\t%"PRId64"\t%"PRId64"\t%"PRId64"", m[T2S(GT_HOM_RR)],m[T2S(GT_HET_RA)],m[T2S(GT_HOM_AA)]);
+                fprintf(args->out, "\t%"PRId64"\t%"PRId64"\t%"PRId64"", mm[T2S(GT_HOM_RR)],mm[T2S(GT_HET_RA)],mm[T2S(GT_HOM_AA)]);
+                if ( stats[i].n && !isnan(r2) ) fprintf(args->out, "\t%f", r2);
+                else fprintf(args->out, "\t"NA_STRING);
+                fprintf(args->out, "\t%.0f\n", stats[i].n);
             }
 
             if ( x==0 )
             {
-                printf("# NRD and discordance is calculated as follows:\n");
-                printf("#   m .. number of matches\n");
-                printf("#   x .. number of mismatches\n");
-                printf("#   NRD = (xRR + xRA + xAA) / (xRR + xRA + xAA + mRA + mAA)\n");
-                printf("#   RR discordance = xRR / (xRR + mRR)\n");
-                printf("#   RA discordance = xRA / (xRA + mRA)\n");
-                printf("#   AA discordance = xAA / (xAA + mAA)\n");
-                printf("# Non-Reference Discordance (NRD), SNPs\n# NRDs\t[2]id\t[3]NRD\t[4]Ref/Ref discordance\t[5]Ref/Alt discordance\t[6]Alt/Alt discordance\n");
+                fprintf(args->out, "# NRD and discordance is calculated as follows:\n");
+                fprintf(args->out, "#   m .. number of matches\n");
+                fprintf(args->out, "#   x .. number of mismatches\n");
+                fprintf(args->out, "#   NRD = (xRR + xRA + xAA) / (xRR + xRA + xAA + mRA + mAA)\n");
+                fprintf(args->out, "#   RR discordance = xRR / (xRR + mRR)\n");
+                fprintf(args->out, "#   RA discordance = xRA / (xRA + mRA)\n");
+                fprintf(args->out, "#   AA discordance = xAA / (xAA + mAA)\n");
+                fprintf(args->out, "# Non-Reference Discordance (NRD), SNPs\n# NRDs\t[2]id\t[3]NRD\t[4]Ref/Ref discordance\t[5]Ref/Alt discordance\t[6]Alt/Alt discordance\n");
             }
             else
-                printf("# Non-Reference Discordance (NRD), indels\n# NRDi\t[2]id\t[3]NRD\t[4]Ref/Ref discordance\t[5]Ref/Alt discordance\t[6]Alt/Alt discordance\n");
+                fprintf(args->out, "# Non-Reference Discordance (NRD), indels\n# NRDi\t[2]id\t[3]NRD\t[4]Ref/Ref discordance\t[5]Ref/Alt discordance\t[6]Alt/Alt discordance\n");
             uint64_t m  = nrd_m[T2S(GT_HET_RA)] + nrd_m[T2S(GT_HOM_AA)] + nrd_m[T2S(GT_HET_AA)];
             uint64_t mm = nrd_mm[T2S(GT_HOM_RR)] + nrd_mm[T2S(GT_HET_RA)] + nrd_mm[T2S(GT_HOM_AA)] + nrd_mm[T2S(GT_HET_AA)];
-            printf("NRD%c\t2\t%f\t%f\t%f\t%f\n", x==0 ? 's' : 'i',
+            fprintf(args->out, "NRD%c\t2\t%f\t%f\t%f\t%f\n", x==0 ? 's' : 'i',
                     m+mm ? mm*100.0/(m+mm) : 0,
                     nrd_m[T2S(GT_HOM_RR)]+nrd_mm[T2S(GT_HOM_RR)] ? nrd_mm[T2S(GT_HOM_RR)]*100.0/(nrd_m[T2S(GT_HOM_RR)]+nrd_mm[T2S(GT_HOM_RR)]) : 0,
                     nrd_m[T2S(GT_HET_RA)]+nrd_mm[T2S(GT_HET_RA)] ? nrd_mm[T2S(GT_HET_RA)]*100.0/(nrd_m[T2S(GT_HET_RA)]+nrd_mm[T2S(GT_HET_RA)]) : 0,
@@ -1506,15 +2045,15 @@ static void print_stats(args_t *args)
             gtcmp_t *stats;
             if ( x==0 )
             {
-                printf("# GCsS, Genotype concordance by sample (SNPs)\n# GCsS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
+                fprintf(args->out, "# GCsS, Genotype concordance by sample (SNPs)\n# GCsS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
                 stats = args->smpl_gts_snps;
             }
             else
             {
-                printf("# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
+                fprintf(args->out, "# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
                 stats = args->smpl_gts_indels;
             }
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
                 uint64_t mm = 0, m = stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HET_RA)] + stats[i].gt2gt[T2S(GT_HOM_AA)][T2S(GT_HOM_AA)];
                 for (j=0; j<3; j++)
@@ -1529,74 +2068,74 @@ static void print_stats(args_t *args)
                     r2 /= sqrt((stats[i].xx - stats[i].x*stats[i].x/stats[i].n) * (stats[i].yy - stats[i].y*stats[i].y/stats[i].n));
                     r2 *= r2;
                 }
-                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->files->samples[i], m+mm ? mm*100.0/(m+mm) : 0);
-                printf("\t%"PRId64"\t%"PRId64"\t%"PRId64"", 
+                fprintf(args->out, "GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->smpl_names[i], m+mm ? mm*100.0/(m+mm) : 0);
+                fprintf(args->out, "\t%"PRId64"\t%"PRId64"\t%"PRId64"", 
                     stats[i].gt2gt[T2S(GT_HOM_RR)][T2S(GT_HOM_RR)],
                     stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HET_RA)],
                     stats[i].gt2gt[T2S(GT_HOM_AA)][T2S(GT_HOM_AA)]);
-                printf("\t%"PRId64"\t%"PRId64"\t%"PRId64"",
+                fprintf(args->out, "\t%"PRId64"\t%"PRId64"\t%"PRId64"",
                     stats[i].gt2gt[T2S(GT_HOM_RR)][T2S(GT_HET_RA)] + stats[i].gt2gt[T2S(GT_HOM_RR)][T2S(GT_HOM_AA)],
                     stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HOM_RR)] + stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HOM_AA)],
                     stats[i].gt2gt[T2S(GT_HOM_AA)][T2S(GT_HOM_RR)] + stats[i].gt2gt[T2S(GT_HOM_AA)][T2S(GT_HET_RA)]);
-                if ( stats[i].n && !isnan(r2) ) printf("\t%f\n", r2);
-                else printf("\t"NA_STRING"\n");
+                if ( stats[i].n && !isnan(r2) ) fprintf(args->out, "\t%f\n", r2);
+                else fprintf(args->out, "\t"NA_STRING"\n");
             }
         }
         for (x=0; x<2; x++) // x=0: snps, x=1: indels
         {
-                //printf("# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
+                //fprintf(args->out, "# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
 
             gtcmp_t *stats;
             if ( x==0 )
             {
-                printf("# GCTs, Genotype concordance table (SNPs)\n# GCTs");
+                fprintf(args->out, "# GCTs, Genotype concordance table (SNPs)\n# GCTs");
                 stats = args->smpl_gts_snps;
             }
             else
             {
-                printf("# GCTi, Genotype concordance table (indels)\n# GCTi");
+                fprintf(args->out, "# GCTi, Genotype concordance table (indels)\n# GCTi");
                 stats = args->smpl_gts_indels;
             }
             i = 1;
-            printf("\t[%d]sample", ++i);
-            printf("\t[%d]RR Hom -> RR Hom", ++i);
-            printf("\t[%d]RR Hom -> RA Het", ++i);
-            printf("\t[%d]RR Hom -> AA Hom", ++i);
-            printf("\t[%d]RR Hom -> AA Het", ++i);
-            printf("\t[%d]RR Hom -> missing", ++i);
-            printf("\t[%d]RA Het -> RR Hom", ++i);
-            printf("\t[%d]RA Het -> RA Het", ++i);
-            printf("\t[%d]RA Het -> AA Hom", ++i);
-            printf("\t[%d]RA Het -> AA Het", ++i);
-            printf("\t[%d]RA Het -> missing", ++i);
-            printf("\t[%d]AA Hom -> RR Hom", ++i);
-            printf("\t[%d]AA Hom -> RA Het", ++i);
-            printf("\t[%d]AA Hom -> AA Hom", ++i);
-            printf("\t[%d]AA Hom -> AA Het", ++i);
-            printf("\t[%d]AA Hom -> missing", ++i);
-            printf("\t[%d]AA Het -> RR Hom", ++i);
-            printf("\t[%d]AA Het -> RA Het", ++i);
-            printf("\t[%d]AA Het -> AA Hom", ++i);
-            printf("\t[%d]AA Het -> AA Het", ++i);
-            printf("\t[%d]AA Het -> missing", ++i);
-            printf("\t[%d]missing -> RR Hom", ++i);
-            printf("\t[%d]missing -> RA Het", ++i);
-            printf("\t[%d]missing -> AA Hom", ++i);
-            printf("\t[%d]missing -> AA Het", ++i);
-            printf("\t[%d]missing -> missing\n", ++i);
-
-            for (i=0; i<args->files->n_smpl; i++)
+            fprintf(args->out, "\t[%d]sample", ++i);
+            fprintf(args->out, "\t[%d]RR Hom -> RR Hom", ++i);
+            fprintf(args->out, "\t[%d]RR Hom -> RA Het", ++i);
+            fprintf(args->out, "\t[%d]RR Hom -> AA Hom", ++i);
+            fprintf(args->out, "\t[%d]RR Hom -> AA Het", ++i);
+            fprintf(args->out, "\t[%d]RR Hom -> missing", ++i);
+            fprintf(args->out, "\t[%d]RA Het -> RR Hom", ++i);
+            fprintf(args->out, "\t[%d]RA Het -> RA Het", ++i);
+            fprintf(args->out, "\t[%d]RA Het -> AA Hom", ++i);
+            fprintf(args->out, "\t[%d]RA Het -> AA Het", ++i);
+            fprintf(args->out, "\t[%d]RA Het -> missing", ++i);
+            fprintf(args->out, "\t[%d]AA Hom -> RR Hom", ++i);
+            fprintf(args->out, "\t[%d]AA Hom -> RA Het", ++i);
+            fprintf(args->out, "\t[%d]AA Hom -> AA Hom", ++i);
+            fprintf(args->out, "\t[%d]AA Hom -> AA Het", ++i);
+            fprintf(args->out, "\t[%d]AA Hom -> missing", ++i);
+            fprintf(args->out, "\t[%d]AA Het -> RR Hom", ++i);
+            fprintf(args->out, "\t[%d]AA Het -> RA Het", ++i);
+            fprintf(args->out, "\t[%d]AA Het -> AA Hom", ++i);
+            fprintf(args->out, "\t[%d]AA Het -> AA Het", ++i);
+            fprintf(args->out, "\t[%d]AA Het -> missing", ++i);
+            fprintf(args->out, "\t[%d]missing -> RR Hom", ++i);
+            fprintf(args->out, "\t[%d]missing -> RA Het", ++i);
+            fprintf(args->out, "\t[%d]missing -> AA Hom", ++i);
+            fprintf(args->out, "\t[%d]missing -> AA Het", ++i);
+            fprintf(args->out, "\t[%d]missing -> missing\n", ++i);
+
+            for (i=0; i<args->nsmpl; i++)
             {
-                printf("GCT%c\t%s",  x==0 ? 's' : 'i', args->files->samples[i]);
+                fprintf(args->out, "GCT%c\t%s",  x==0 ? 's' : 'i', args->smpl_names[i]);
                 for (j=0; j<5; j++)
                     for (k=0; k<5; k++)
-                        printf("\t%"PRId64, stats[i].gt2gt[j][k]);
-                printf("\n");
+                        fprintf(args->out, "\t%"PRId64, stats[i].gt2gt[j][k]);
+                fprintf(args->out, "\n");
             }
         }
     }
 
-    printf("# DP, Depth distribution\n# DP\t[2]id\t[3]bin\t[4]number of genotypes\t[5]fraction of genotypes (%%)\t[6]number of sites\t[7]fraction of sites (%%)\n");
+    fprintf(args->out, "# DP, Depth distribution\n# DP\t[2]id\t[3]bin\t[4]number of genotypes\t[5]fraction of genotypes (%%)\t[6]number of sites\t[7]fraction of sites (%%)\n");
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
@@ -1605,54 +2144,54 @@ static void print_stats(args_t *args)
         for (i=0; i<stats->dp.m_vals; i++)
         {
             if ( stats->dp.vals[i]==0 && stats->dp_sites.vals[i]==0 ) continue;
-            printf("DP\t%d\t", id);
-            if ( i==0 ) printf("<%d", stats->dp.min);
-            else if ( i+1==stats->dp.m_vals ) printf(">%d", stats->dp.max);
-            else printf("%d", idist_i2bin(&stats->dp,i));
-            printf("\t%"PRId64"\t%f", stats->dp.vals[i], sum ? stats->dp.vals[i]*100./sum : 0);
-            printf("\t%"PRId64"\t%f\n", stats->dp_sites.vals[i], sum_sites ? stats->dp_sites.vals[i]*100./sum_sites : 0);
+            fprintf(args->out, "DP\t%d\t", id);
+            if ( i==0 ) fprintf(args->out, "<%d", stats->dp.min);
+            else if ( i+1==stats->dp.m_vals ) fprintf(args->out, ">%d", stats->dp.max);
+            else fprintf(args->out, "%d", idist_i2bin(&stats->dp,i));
+            fprintf(args->out, "\t%"PRId64"\t%f", stats->dp.vals[i], sum ? stats->dp.vals[i]*100./sum : 0);
+            fprintf(args->out, "\t%"PRId64"\t%f\n", stats->dp_sites.vals[i], sum_sites ? stats->dp_sites.vals[i]*100./sum_sites : 0);
         }
     }
 
-    if ( args->files->n_smpl )
+    if ( args->nsmpl )
     {
-        printf("# PSC, Per-sample counts. Note that the ref/het/hom counts include only SNPs, for indels see PSI. The rest include both SNPs and indels.\n");
-        printf("# PSC\t[2]id\t[3]sample\t[4]nRefHom\t[5]nNonRefHom\t[6]nHets\t[7]nTransitions\t[8]nTransversions\t[9]nIndels\t[10]average depth\t[11]nSingletons"
+        fprintf(args->out, "# PSC, Per-sample counts. Note that the ref/het/hom counts include only SNPs, for indels see PSI. The rest include both SNPs and indels.\n");
+        fprintf(args->out, "# PSC\t[2]id\t[3]sample\t[4]nRefHom\t[5]nNonRefHom\t[6]nHets\t[7]nTransitions\t[8]nTransversions\t[9]nIndels\t[10]average depth\t[11]nSingletons"
             "\t[12]nHapRef\t[13]nHapAlt\t[14]nMissing\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
                 float dp = stats->smpl_ndp[i] ? stats->smpl_dp[i]/(float)stats->smpl_ndp[i] : 0;
-                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\t%d\t%d\t%d\n", id,args->files->samples[i],
+                fprintf(args->out, "PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\t%d\t%d\t%d\n", id,args->smpl_names[i],
                     stats->smpl_homRR[i], stats->smpl_homAA[i], stats->smpl_hets[i], stats->smpl_ts[i],
                     stats->smpl_tv[i], stats->smpl_indels[i],dp, stats->smpl_sngl[i], stats->smpl_hapRef[i],
                     stats->smpl_hapAlt[i], stats->smpl_missing[i]);
             }
         }
 
-        printf("# PSI, Per-Sample Indels. Note that alt-het genotypes with both ins and del allele are counted twice, in both nInsHets and nDelHets.\n");
-        printf("# PSI\t[2]id\t[3]sample\t[4]in-frame\t[5]out-frame\t[6]not applicable\t[7]out/(in+out) ratio\t[8]nInsHets\t[9]nDelHets\t[10]nInsAltHoms\t[11]nDelAltHoms\n");
+        fprintf(args->out, "# PSI, Per-Sample Indels. Note that alt-het genotypes with both ins and del allele are counted twice, in both nInsHets and nDelHets.\n");
+        fprintf(args->out, "# PSI\t[2]id\t[3]sample\t[4]in-frame\t[5]out-frame\t[6]not applicable\t[7]out/(in+out) ratio\t[8]nInsHets\t[9]nDelHets\t[10]nInsAltHoms\t[11]nDelAltHoms\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->nsmpl; i++)
             {
                 int na = 0, in = 0, out = 0;
-                if ( args->exons )
+                if ( stats->smpl_frm_shifts )
                 {
                     na  = stats->smpl_frm_shifts[i*3 + 0];
                     in  = stats->smpl_frm_shifts[i*3 + 1];
                     out = stats->smpl_frm_shifts[i*3 + 2];
                 }
-                printf("PSI\t%d\t%s\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%d\n", id,args->files->samples[i], in,out,na,in+out?1.0*out/(in+out):0,
+                fprintf(args->out, "PSI\t%d\t%s\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%d\n", id,args->smpl_names[i], in,out,na,in+out?1.0*out/(in+out):0,
                     stats->smpl_ins_hets[i],stats->smpl_del_hets[i],stats->smpl_ins_homs[i],stats->smpl_del_homs[i]);
             }
         }
 
         #ifdef HWE_STATS
-        printf("# HWE\n# HWE\t[2]id\t[3]1st ALT allele frequency\t[4]Number of observations\t[5]25th percentile\t[6]median\t[7]75th percentile\n");
+        fprintf(args->out, "# HWE\n# HWE\t[2]id\t[3]1st ALT allele frequency\t[4]Number of observations\t[5]25th percentile\t[6]median\t[7]75th percentile\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
@@ -1667,34 +2206,76 @@ static void print_stats(args_t *args)
                 double af = args->af_bins ? (bin_get_value(args->af_bins,i)+bin_get_value(args->af_bins,i-1))*0.5 : (double)(i-1)/(args->m_af-1);
 
                 int nprn = 3;
-                printf("HWE\t%d\t%f\t%d",id,af,sum_tot);
+                fprintf(args->out, "HWE\t%d\t%f\t%d",id,af,sum_tot);
                 for (j=0; j<args->naf_hwe; j++)
                 {
                     sum_tmp += ptr[j];
                     float frac = (float)sum_tmp/sum_tot;
                     if ( frac >= 0.75 )
                     {
-                        while (nprn>0) { printf("\t%f", (float)j/args->naf_hwe); nprn--; }
+                        while (nprn>0) { fprintf(args->out, "\t%f", (float)j/args->naf_hwe); nprn--; }
                         break;
                     }
                     if ( frac >= 0.5 )
                     {
-                        while (nprn>1) { printf("\t%f", (float)j/args->naf_hwe); nprn--; }
+                        while (nprn>1) { fprintf(args->out, "\t%f", (float)j/args->naf_hwe); nprn--; }
                         continue;
                     }
                     if ( frac >= 0.25 )
                     {
-                        while (nprn>2) { printf("\t%f", (float)j/args->naf_hwe); nprn--; }
+                        while (nprn>2) { fprintf(args->out, "\t%f", (float)j/args->naf_hwe); nprn--; }
                     }
                 }
                 assert(nprn==0);
-                printf("\n");
+                fprintf(args->out, "\n");
             }
         }
         #endif
     }
 }
 
+/*
+    print_stats() folds some of the bins, therefore the snapshot is printed from
+    a copy of the counters summed into a fresh set and the collection can continue
+*/
+static void write_snapshot(args_t *args, uint64_t nread)
+{
+    args_t *snap = (args_t*) calloc(1,sizeof(args_t));
+    snap->argc = args->argc; snap->argv = args->argv;
+    snap->nstats = args->nstats; snap->split_by_id = args->split_by_id;
+    snap->m_af = args->m_af; snap->m_qual = args->m_qual; snap->naf_hwe = args->naf_hwe;
+    snap->dp_min = args->dp_min; snap->dp_max = args->dp_max; snap->dp_step = args->dp_step;
+    snap->nusr = args->nusr; snap->usr = args->usr;
+    snap->exons_fname = args->exons_fname; snap->ref_fname = args->ref_fname;
+    snap->af_bins = args->af_bins;
+    snap->nreaders = args->nreaders; snap->fnames = args->fnames;
+    snap->nhdr_smpl[0] = args->nhdr_smpl[0]; snap->nhdr_smpl[1] = args->nhdr_smpl[1];
+    snap->nsmpl = args->nsmpl; snap->smpl_names = args->smpl_names;
+    alloc_stats(snap);
+    int i, j;
+    for (i=0; i<snap->nstats; i++)
+    {
+        init_user_stats(snap, NULL, &snap->stats[i]);
+        for (j=0; j<snap->nusr; j++) snap->stats[i].usr[j].type = args->stats[i].usr[j].type;
+    }
+    stats_merge(snap, args);
+
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s.tmp", args->snapshot_fname);
+    snap->out = fopen(str.s, "w");
+    if ( !snap->out ) error("Failed to open %s: %s\n", str.s, strerror(errno));
+    print_header(snap);
+    fprintf(snap->out, "# Snapshot after %"PRIu64" records\n", nread);
+    print_stats(snap);
+    if ( fclose(snap->out)!=0 ) error("Error: close failed .. %s\n", str.s);
+    if ( rename(str.s, args->snapshot_fname)!=0 ) error("Failed to rename %s to %s: %s\n", str.s, args->snapshot_fname, strerror(errno));
+    free(str.s);
+
+    snap->af_bins = NULL;   // owned by args
+    snap->fnames  = NULL;
+    destroy_stats(snap);
+    free(snap);
+}
 static void usage(void)
 {
     fprintf(stderr, "\n");
@@ -1716,10 +2297,16 @@ static void usage(void)
     fprintf(stderr, "    -F, --fasta-ref <file>             faidx indexed reference sequence file to determine INDEL context\n");
     fprintf(stderr, "    -i, --include <expr>               select sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -I, --split-by-ID                  collect stats for sites with ID separately (known vs novel)\n");
+    fprintf(stderr, "        --merge                        the input files are partial stats created with --partial, sum and print them\n");
+    fprintf(stderr, "        --partial <file>               write the collected counters to a binary file instead of printing the stats\n");
+    fprintf(stderr, "        --profile[=json]               print time spent in reading, filtering, collecting and printing the stats to stderr\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
+    fprintf(stderr, "        --snapshot <file>              write cumulative stats periodically to <file>, see also --snapshot-every\n");
+    fprintf(stderr, "        --snapshot-every <int>[s]      write the snapshot every <int> records or, with the suffix \"s\", seconds [1000000]\n");
     fprintf(stderr, "    -s, --samples <list>               list of samples for sample stats, \"-\" to include all samples\n");
     fprintf(stderr, "    -S, --samples-file <file>          file of samples to include\n");
+    fprintf(stderr, "        --split-contigs                collect stats for groups of contigs in parallel in --threads worker threads\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "    -u, --user-tstv <TAG[:min:max:n]>  collect Ts/Tv stats for any tag using the given binning [0:1:100]\n");
@@ -1736,8 +2323,8 @@ int main_vcfstats(int argc, char *argv[])
     args->files  = bcf_sr_init();
     args->argc   = argc; args->argv = argv;
     args->dp_min = 0; args->dp_max = 500; args->dp_step = 1;
-    int regions_is_file = 0, targets_is_file = 0;
-
+    args->snapshot_every = 1000000;
+    args->out = stdout;
     static struct option loptions[] =
     {
         {"af-bins",1,0,1},
@@ -1761,6 +2348,12 @@ int main_vcfstats(int argc, char *argv[])
         {"fasta-ref",1,0,'F'},
         {"user-tstv",1,0,'u'},
         {"threads",1,0,9},
+        {"split-contigs",0,0,10},
+        {"partial",1,0,11},
+        {"merge",0,0,12},
+        {"snapshot",1,0,13},
+        {"snapshot-every",1,0,14},
+        {"profile",2,0,15},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:e:s:S:d:i:t:T:F:f:1u:vIE:",loptions,NULL)) >= 0) {
@@ -1771,7 +2364,7 @@ int main_vcfstats(int argc, char *argv[])
             case '1': args->first_allele_only = 1; break;
             case 'F': args->ref_fname = optarg; break;
             case 't': args->targets_list = optarg; break;
-            case 'T': args->targets_list = optarg; targets_is_file = 1; break;
+            case 'T': args->targets_list = optarg; args->targets_is_file = 1; break;
             case 'c':
                 if ( !strcmp(optarg,"snps") ) args->files->collapse |= COLLAPSE_SNPS;
                 else if ( !strcmp(optarg,"indels") ) args->files->collapse |= COLLAPSE_INDELS;
@@ -1791,7 +2384,7 @@ int main_vcfstats(int argc, char *argv[])
                 break;
             case 'f': args->files->apply_filters = optarg; break;
             case 'r': args->regions_list = optarg; break;
-            case 'R': args->regions_list = optarg; regions_is_file = 1; break;
+            case 'R': args->regions_list = optarg; args->regions_is_file = 1; break;
             case 'E': args->exons_fname = optarg; break;
             case 's': args->samples_list = optarg; break;
             case 'S': args->samples_list = optarg; args->samples_is_file = 1; break;
@@ -1799,6 +2392,22 @@ int main_vcfstats(int argc, char *argv[])
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 : args->split_contigs = 1; break;
+            case 11 : args->partial_fname = optarg; break;
+            case 12 : args->merge = 1; break;
+            case 13 : args->snapshot_fname = optarg; break;
+            case 14 :
+            {
+                char *tmp;
+                args->snapshot_every = strtol(optarg, &tmp, 10);
+                if ( *tmp=='s' && !tmp[1] ) { args->snapshot_secs = 1; tmp++; }
+                if ( *tmp || args->snapshot_every<=0 ) error("Could not parse --snapshot-every %s\n", optarg);
+                if ( args->snapshot_secs ) args->snapshot_time = time(NULL) + args->snapshot_every;
+                break;
+            }
+            case 15 :
+                if ( profile_init(&args->prof, "stats", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
             case 'h':
             case '?': usage(); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -1812,18 +2421,52 @@ int main_vcfstats(int argc, char *argv[])
     }
     else fname = argv[optind];
 
+    if ( args->merge )
+    {
+        if ( args->split_contigs || args->partial_fname ) error("The --merge option cannot be combined with --split-contigs or --partial\n");
+        init_gt_types();
+        while (fname)
+        {
+            merge_partial(args, fname);
+            fname = ++optind < argc ? argv[optind] : NULL;
+        }
+        print_header(args);
+        print_stats(args);
+        destroy_partial(args);
+        destroy_stats(args);
+        for (c=0; c<args->nusr; c++) free(args->usr[c].tag);
+        free(args->usr);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
+
     if ( argc-optind>2 ) usage();
     if ( argc-optind>1 )
     {
         args->files->require_index = 1;
         if ( args->split_by_id ) error("Only one file can be given with -i.\n");
     }
+    if ( args->split_contigs )
+    {
+        if ( args->n_threads<=0 ) error("The --split-contigs option requires --threads\n");
+        if ( args->regions_list ) error("The --split-contigs option cannot be combined with -r/-R\n");
+        if ( args->verbose_sites ) error("The --split-contigs option cannot be combined with -v\n");
+        if ( !strcmp("-",fname) ) error("The --split-contigs option requires indexed input files\n");
+        args->files->require_index = 1;
+    }
+    if ( args->partial_fname && args->verbose_sites ) error("The --partial option cannot be combined with -v\n");
+    if ( args->snapshot_fname )
+    {
+        if ( args->split_contigs ) error("The --snapshot option cannot be combined with --split-contigs\n");
+        args->snapshot_next = args->snapshot_every;
+    }
     if ( !args->samples_list ) args->files->max_unpack = BCF_UN_INFO;
-    if ( args->targets_list && bcf_sr_set_targets(args->files, args->targets_list, targets_is_file, 0)<0 )
+    if ( args->targets_list && bcf_sr_set_targets(args->files, args->targets_list, args->targets_is_file, 0)<0 )
         error("Failed to read the targets: %s\n", args->targets_list);
-    if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, regions_is_file)<0 )
+    if ( args->regions_list && bcf_sr_set_regions(args->files, args->regions_list, args->regions_is_file)<0 )
         error("Failed to read the regions: %s\n", args->regions_list);
-    if ( args->n_threads && bcf_sr_set_threads(args->files, args->n_threads)<0)
+    if ( args->n_threads && !args->split_contigs && bcf_sr_set_threads(args->files, args->n_threads)<0)
         error("Failed to create threads\n");
 
     while (fname)
@@ -1833,11 +2476,23 @@ int main_vcfstats(int argc, char *argv[])
         fname = ++optind < argc ? argv[optind] : NULL;
     }
 
+    init_gt_types();
     init_stats(args);
-    print_header(args);
-    do_vcf_stats(args);
-    print_stats(args);
+    if ( !args->partial_fname ) print_header(args);
+    if ( args->split_contigs )
+        stats_split(args);
+    else
+        do_vcf_stats(args);
+    profile_mark(&args->prof);
+    if ( args->partial_fname )
+        write_partial(args);
+    else
+        print_stats(args);
+    profile_lap(&args->prof, PROF_WRITE);
     destroy_stats(args);
+    profile_report(&args->prof, stderr);
+    for (c=0; c<args->nusr; c++) free(args->usr[c].tag);
+    free(args->usr);
     bcf_sr_destroy(args->files);
     free(args);
     return 0;
@@ -38,6 +38,7 @@ THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "blkpipe.h"
 #include "htslib/khash_str2int.h"
 
 #define FLT_INCLUDE 1
@@ -68,7 +69,8 @@ typedef struct _args_t
     int argc, clevel, n_threads, output_type, print_header, update_info, header_only, n_samples, *imap, calc_ac;
     int trim_alts, sites_only, known, novel, min_alleles, max_alleles, private_vars, uncalled, phased;
     int min_ac, min_ac_type, max_ac, max_ac_type, min_af_type, max_af_type, gt_type;
-    int *ac, mac;
+    int *ac, mac, *ac_sub, mac_sub;
+    kstring_t indiv;    // the subset FORMAT block
     float min_af, max_af;
     char *fn_ref, *fn_out, **samples;
     int sample_is_file, force_samples;
@@ -76,6 +78,7 @@ typedef struct _args_t
     int include, exclude;
     int record_cmd_line;
     htsFile *out;
+    profile_t prof;
 }
 args_t;
 
@@ -251,6 +254,14 @@ static void init_data(args_t *args)
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
+
+    // Sites-only output and nothing needs the genotypes: tell the reader to drop the
+    // samples, the FORMAT fields are then neither parsed (VCF) nor subset (BCF)
+    if ( args->sites_only && !args->n_samples && !args->calc_ac && !args->gt_type && !args->phased
+            && (!args->filter || !(filter_max_unpack(args->filter) & BCF_UN_FMT)) )
+    {
+        if ( bcf_hdr_set_samples(args->hdr, NULL, 0) < 0 ) error("Failed to drop the samples\n");
+    }
 }
 
 static void destroy_data(args_t *args)
@@ -267,49 +278,100 @@ static void destroy_data(args_t *args)
     if ( args->filter )
         filter_destroy(args->filter);
     free(args->ac);
+    free(args->ac_sub);
+    free(args->indiv.s);
 }
 
-// true if all samples are phased.
-// haploid genotypes are considered phased
-// ./. => not phased, .|. => phased
-int bcf_all_phased(const bcf_hdr_t *header, bcf1_t *line)
+/*
+ *  One pass over GT collecting everything the filters need: allele counts and
+ *  the genotype classes present, as bcf_calc_ac() and bcf_gt_type() would, and
+ *  whether all samples are phased. Haploid genotypes are considered phased;
+ *  ./. and .|. are not phased. Returns 0 if there is no GT.
+ */
+typedef struct
 {
+    int nhet, nhom, nmiss, all_phased;
+}
+gt_stats_t;
+
+static int scan_gt(const bcf_hdr_t *hdr, bcf1_t *line, int *ac, gt_stats_t *st)
+{
+    memset(ac, 0, sizeof(*ac)*line->n_allele);
+    memset(st, 0, sizeof(*st));
+    st->all_phased = 1;
+
     bcf_unpack(line, BCF_UN_FMT);
-    bcf_fmt_t *fmt_ptr = bcf_get_fmt(header, line, "GT");
-    int all_phased = 1;
-    if ( fmt_ptr )
+    bcf_fmt_t *fmt = bcf_get_fmt(hdr, line, "GT");
+    if ( !fmt ) return 0;
+
+    int i, isample, nsmpl = line->n_sample;
+    #define BRANCH_INT(type_t,vector_end) { \
+        for (isample=0; isample<nsmpl; isample++) \
+        { \
+            type_t *p = (type_t*) (fmt->p + isample*fmt->size); \
+            int nals = 0, first = -1, het = 0, missing = 0, phased = fmt->n==1 ? 1 : 0; \
+            for (i=0; i<fmt->n; i++) \
+            { \
+                if ( p[i] == vector_end ) { if ( i==1 ) phased = 1; break; } /* smaller ploidy, haploid are phased */ \
+                if ( bcf_gt_is_missing(p[i]) ) { missing = 1; continue; } \
+                int al = bcf_gt_allele(p[i]); \
+                if ( al >= line->n_allele ) error("Incorrect allele (\"%d\") at %s:%"PRId64"\n", al, bcf_seqname(hdr,line), (int64_t) line->pos+1); \
+                ac[al]++; \
+                if ( p[i]&1 ) phased = 1; \
+                if ( !nals++ ) first = al; \
+                else if ( al!=first ) het = 1; \
+            } \
+            if ( missing || !nals ) st->nmiss = 1; \
+            else if ( het ) st->nhet = 1; \
+            else st->nhom = 1; \
+            if ( !phased ) st->all_phased = 0; \
+        } \
+    }
+    switch (fmt->type) {
+        case BCF_BT_INT8:  BRANCH_INT(int8_t,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH_INT(int16_t, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH_INT(int32_t, bcf_int32_vector_end); break;
+        default: error("[%s] todo: fmt_type %d\n", __func__, fmt->type); break;
+    }
+    #undef BRANCH_INT
+    return 1;
+}
+
+/*
+ *  Subset the samples directly in the packed FORMAT block. Each field is a
+ *  typed vector with a fixed number of bytes per sample, so the subset is built by
+ *  copying byte ranges, runs of consecutive samples in one go. Returns -1 if the
+ *  FORMAT fields were modified and the packed block is not up to date.
+ */
+static int subset_indiv(args_t *args, bcf1_t *line)
+{
+    if ( line->d.indiv_dirty ) return -1;
+
+    kstring_t *str = &args->indiv;
+    uint8_t *ptr = (uint8_t*) line->indiv.s, *end = ptr + line->indiv.l;
+    int i, j, k, type, nsmpl = line->n_sample;
+    str->l = 0;
+    for (i=0; i<line->n_fmt; i++)
     {
-        int i, isample;
-        for (isample=0; isample<line->n_sample; isample++)
+        uint8_t *beg = ptr;
+        bcf_dec_typed_int1(ptr, &ptr);          // the tag id
+        int n = bcf_dec_size(ptr, &ptr, &type);
+        if ( ptr > end ) return -1;
+        size_t size = (size_t)n << bcf_type_shift[type];
+        if ( ptr + size*nsmpl > end ) return -1;
+        kputsn((char*)beg, ptr - beg, str);
+        for (j=0; j<args->n_samples; j=k)
         {
-            int sample_phased = 0;
-            #define BRANCH_INT(type_t,vector_end) { \
-                type_t *p = (type_t*) (fmt_ptr->p + isample*fmt_ptr->size); \
-                for (i=0; i<fmt_ptr->n; i++) \
-                { \
-                    if (fmt_ptr->n == 1 || (p[i] == vector_end && i == 1)) { sample_phased = 1; break; } /* haploid phased by definition */ \
-                    if ( p[i] == vector_end ) { break; }; /* smaller ploidy */ \
-                    if ( bcf_gt_is_missing(p[i]) ) continue; /* missing allele */ \
-                    if ((p[i])&1) { \
-                        sample_phased = 1; \
-                        break; \
-                    } \
-                } \
-            }
-            switch (fmt_ptr->type) {
-                case BCF_BT_INT8:  BRANCH_INT(int8_t,  bcf_int8_vector_end); break;
-                case BCF_BT_INT16: BRANCH_INT(int16_t, bcf_int16_vector_end); break;
-                case BCF_BT_INT32: BRANCH_INT(int32_t, bcf_int32_vector_end); break;
-                default: fprintf(stderr, "[E::%s] todo: fmt_type %d\n", __func__, fmt_ptr->type); exit(1); break;
-            }
-            #undef BRANCH_INT
-            if (!sample_phased) {
-                all_phased = 0;
-                break;
-            }
+            for (k=j+1; k<args->n_samples && args->imap[k]==args->imap[k-1]+1; k++) ;
+            kputsn((char*)ptr + args->imap[j]*size, (k-j)*size, str);
         }
+        ptr += size*nsmpl;
     }
-    return all_phased;
+
+    kstring_t tmp = line->indiv; line->indiv = *str; *str = tmp;
+    line->n_sample = args->n_samples;
+    line->unpacked &= ~BCF_UN_FMT;             // the FORMAT pointers must be set anew
+    return 0;
 }
 
 int subset_vcf(args_t *args, bcf1_t *line)
@@ -337,9 +399,20 @@ int subset_vcf(args_t *args, bcf1_t *line)
     }
 
     hts_expand(int, line->n_allele, args->mac, args->ac);
+    hts_expand(int, line->n_allele, args->mac_sub, args->ac_sub);
     int i, an = 0, non_ref_ac = 0;
+    int has_gt = 0, has_st = 0;     // has_st: the stats were collected from the current subset of samples
+    gt_stats_t st;
     if (args->calc_ac) {
-        bcf_calc_ac(args->hdr, line, args->ac, BCF_UN_INFO|BCF_UN_FMT); // get original AC and AN values from INFO field if available, otherwise calculate
+        memset(args->ac, 0, sizeof(*args->ac)*line->n_allele);
+
+        // get original AC and AN values from INFO field if available, otherwise calculate. With a subset
+        // the original values matter only for the private sites, the rest uses the subset's counts
+        if ( !bcf_calc_ac(args->hdr, line, args->ac, BCF_UN_INFO) && (!args->n_samples || args->private_vars) )
+        {
+            has_gt = scan_gt(args->hdr, line, args->ac, &st);
+            has_st = !args->n_samples;
+        }
         for (i=1; i<line->n_allele; i++)
             non_ref_ac += args->ac[i];
         for (i=0; i<line->n_allele; i++)
@@ -349,12 +422,16 @@ int subset_vcf(args_t *args, bcf1_t *line)
     int update_ac = args->calc_ac;
     if (args->n_samples)
     {
-        int non_ref_ac_sub = 0, *ac_sub = (int*) calloc(line->n_allele,sizeof(int));
-        bcf_subset(args->hdr, line, args->n_samples, args->imap);
-        if ( args->calc_ac && !bcf_get_fmt(args->hdr,line,"GT") ) update_ac = 0;
+        int non_ref_ac_sub = 0, *ac_sub = args->ac_sub;
+        if ( subset_indiv(args, line)<0 ) bcf_subset(args->hdr, line, args->n_samples, args->imap);
+        if ( update_ac || args->gt_type || args->phased )
+        {
+            has_gt = scan_gt(args->hdr, line, ac_sub, &st);
+            has_st = 1;
+        }
+        if ( args->calc_ac && !has_gt ) update_ac = 0;
         if ( update_ac )
         {
-            bcf_calc_ac(args->hsub, line, ac_sub, BCF_UN_FMT); // recalculate AC and AN
             an = 0;
             for (i=0; i<line->n_allele; i++) {
                 args->ac[i] = ac_sub[i];
@@ -363,40 +440,23 @@ int subset_vcf(args_t *args, bcf1_t *line)
             for (i=1; i<line->n_allele; i++)
                 non_ref_ac_sub += ac_sub[i];
             if (args->private_vars) {
-                if (args->private_vars == FLT_INCLUDE && !(non_ref_ac_sub > 0 && non_ref_ac == non_ref_ac_sub)) { free(ac_sub); return 0; } // select private sites
-                if (args->private_vars == FLT_EXCLUDE && non_ref_ac_sub > 0 && non_ref_ac == non_ref_ac_sub) { free(ac_sub); return 0; } // exclude private sites
+                if (args->private_vars == FLT_INCLUDE && !(non_ref_ac_sub > 0 && non_ref_ac == non_ref_ac_sub)) return 0; // select private sites
+                if (args->private_vars == FLT_EXCLUDE && non_ref_ac_sub > 0 && non_ref_ac == non_ref_ac_sub) return 0; // exclude private sites
             }
             non_ref_ac = non_ref_ac_sub;
         }
-        free(ac_sub);
     }
+    if ( (args->gt_type || args->phased) && !has_st )
+        has_gt = scan_gt(args->hdr, line, args->ac_sub, &st);
 
-    bcf_fmt_t *gt_fmt;
-    if ( args->gt_type && (gt_fmt=bcf_get_fmt(args->hdr,line,"GT")) )
+    if ( args->gt_type && has_gt )
     {
-        int nhet = 0, nhom = 0, nmiss = 0;
-        for (i=0; i<bcf_hdr_nsamples(args->hdr); i++)
-        {
-            int type = bcf_gt_type(gt_fmt,i,NULL,NULL);
-            if ( type==GT_HET_RA || type==GT_HET_AA )
-            {
-                if ( args->gt_type==GT_NO_HET ) return 0;
-                nhet = 1;
-            }
-            else if ( type==GT_UNKN )
-            {
-                if ( args->gt_type==GT_NO_MISSING ) return 0;
-                nmiss = 1;
-            }
-            else
-            {
-                if ( args->gt_type==GT_NO_HOM ) return 0;
-                nhom = 1;
-            }
-        }
-        if ( args->gt_type==GT_NEED_HOM && !nhom ) return 0;
-        else if ( args->gt_type==GT_NEED_HET && !nhet ) return 0;
-        else if ( args->gt_type==GT_NEED_MISSING && !nmiss ) return 0;
+        if ( args->gt_type==GT_NO_HET && st.nhet ) return 0;
+        else if ( args->gt_type==GT_NO_MISSING && st.nmiss ) return 0;
+        else if ( args->gt_type==GT_NO_HOM && st.nhom ) return 0;
+        else if ( args->gt_type==GT_NEED_HOM && !st.nhom ) return 0;
+        else if ( args->gt_type==GT_NEED_HET && !st.nhet ) return 0;
+        else if ( args->gt_type==GT_NEED_MISSING && !st.nmiss ) return 0;
     }
 
     int minor_ac = 0;
@@ -449,7 +509,10 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if (args->uncalled == FLT_INCLUDE && an > 0) return 0; // select uncalled
         if (args->uncalled == FLT_EXCLUDE && an == 0) return 0; // skip if uncalled
     }
-    if (update_ac && args->update_info) {
+    // Without a subset, AC and AN were either taken from INFO, in which case they are left
+    // alone so that the record is not marked as modified and is written as read, or were
+    // counted from the genotypes because they were missing
+    if (update_ac && args->update_info && (args->n_samples || has_gt)) {
         bcf_update_info_int32(args->hdr, line, "AC", &args->ac[1], line->n_allele-1);
         bcf_update_info_int32(args->hdr, line, "AN", &an, 1);
     }
@@ -459,9 +522,8 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if ( ret<0 ) error("Error: Could not trim alleles at %s:%"PRId64"\n", bcf_seqname(args->hsub ? args->hsub : args->hdr, line), (int64_t) line->pos+1);
     }
     if (args->phased) {
-        int phased = bcf_all_phased(args->hdr, line);
-        if (args->phased == FLT_INCLUDE && !phased) { return 0; } // skip unphased
-        if (args->phased == FLT_EXCLUDE && phased) { return 0; } // skip phased
+        if (args->phased == FLT_INCLUDE && !st.all_phased) { return 0; } // skip unphased
+        if (args->phased == FLT_EXCLUDE && st.all_phased) { return 0; } // skip phased
     }
     if (args->sites_only) bcf_subset(args->hsub ? args->hsub : args->hdr, line, 0, 0);
     return 1;
@@ -490,6 +552,89 @@ void set_allele_type (int *atype, char *atype_string)
     }
 }
 
+/*
+ *  Multithreaded processing: the main thread reads records in blocks, worker
+ *  threads filter and subset them with their own copy of the filter and
+ *  scratch buffers, and the main thread outputs the blocks in the input order,
+ *  see blkpipe.h
+ */
+typedef struct
+{
+    args_t args;                    // shallow copy of the main args with private filter and buffers
+    bcf_hdr_t *out_hdr;
+    int keep[BLKPIPE_NREC];         // subset_vcf() results
+}
+block_t;
+
+static void *subset_block(void *arg)
+{
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    int i;
+    for (i=0; i<blk->nrec; i++)
+        dat->keep[i] = subset_vcf(&dat->args, blk->recs[i]);
+    return blk;
+}
+
+static void output_block(void *usr, void *arg)
+{
+    args_t *args = (args_t*) usr;
+    blkpipe_blk_t *blk = (blkpipe_blk_t*) arg;
+    block_t *dat = (block_t*) blk->data;
+    int i;
+    profile_mark(&args->prof);
+    for (i=0; i<blk->nrec; i++)
+    {
+        if ( !dat->keep[i] ) continue;
+        if ( bcf_write1(args->out, dat->out_hdr, blk->recs[i])!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out);
+        args->prof.nrec_out++;
+    }
+    profile_lap(&args->prof, PROF_WRITE);
+}
+
+static void view_threaded(args_t *args, bcf_hdr_t *out_hdr)
+{
+    int i, nblk = 2*args->n_threads;
+    block_t *dat = (block_t*) calloc(nblk, sizeof(block_t));
+    void **data = (void**) malloc(sizeof(void*)*nblk);
+    for (i=0; i<nblk; i++)
+    {
+        data[i] = &dat[i];
+        dat[i].args = *args;
+        dat[i].args.ac  = NULL;
+        dat[i].args.mac = 0;
+        dat[i].args.ac_sub  = NULL;
+        dat[i].args.mac_sub = 0;
+        memset(&dat[i].args.indiv, 0, sizeof(dat[i].args.indiv));
+        if ( args->filter_str ) dat[i].args.filter = filter_init(args->hdr, args->filter_str);
+        dat[i].out_hdr = out_hdr;
+    }
+    blkpipe_t *pipe = blkpipe_blocks_init(args->files->p->pool, nblk, data, subset_block, output_block, args);
+    while ( 1 )
+    {
+        profile_mark(&args->prof);
+        int eof = bcf_sr_next_line(args->files) ? 0 : 1;
+        profile_lap(&args->prof, PROF_READ);
+        if ( eof ) break;
+        args->prof.nrec_in++;
+        bcf1_t *line = args->files->readers[0].buffer[0];
+        if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
+        blkpipe_push(pipe, args->files, 0);
+    }
+    blkpipe_flush(pipe);
+    blkpipe_destroy(pipe);
+
+    for (i=0; i<nblk; i++)
+    {
+        if ( dat[i].args.filter ) filter_destroy(dat[i].args.filter);
+        free(dat[i].args.ac);
+        free(dat[i].args.ac_sub);
+        free(dat[i].args.indiv.s);
+    }
+    free(dat);
+    free(data);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -503,6 +648,7 @@ static void usage(args_t *args)
     fprintf(stderr, "          --no-version                  do not append version and command line to the header\n");
     fprintf(stderr, "    -o,   --output <file>               output file name [stdout]\n");
     fprintf(stderr, "    -O,   --output-type <b|u|z|v>       b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "          --profile[=json]              print time spent in reading, processing and writing to stderr\n");
     fprintf(stderr, "    -r, --regions <region>              restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>           restrict to regions listed in a file\n");
     fprintf(stderr, "    -t, --targets [^]<region>           similar to -r but streams rather than index-jumps. Exclude regions with \"^\" prefix\n");
@@ -589,6 +735,7 @@ int main_vcfview(int argc, char *argv[])
         {"phased",no_argument,NULL,'p'},
         {"exclude-phased",no_argument,NULL,'P'},
         {"no-version",no_argument,NULL,8},
+        {"profile",optional_argument,NULL,10},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -699,6 +846,9 @@ int main_vcfview(int argc, char *argv[])
             }
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 :
+                if ( profile_init(&args->prof, "view", optarg)<0 ) error("The --profile format not recognised: %s\n", optarg);
+                break;
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
         }
@@ -754,18 +904,36 @@ int main_vcfview(int argc, char *argv[])
         error("BCF output requires header, cannot proceed with -H\n");
 
     int ret = 0;
-    if (!args->header_only)
+    args->prof.nsmpl = bcf_hdr_nsamples(args->hdr);
+    if ( !args->header_only && args->n_threads > 0 )
+    {
+        view_threaded(args, out_hdr);
+        ret = args->files->errnum;
+        if ( ret ) fprintf(stderr,"Error: %s\n", bcf_sr_strerror(args->files->errnum));
+    }
+    else if (!args->header_only)
     {
+        profile_t *prof = &args->prof;
+        profile_mark(prof);
         while ( bcf_sr_next_line(args->files) )
         {
+            profile_lap(prof, PROF_READ);
+            prof->nrec_in++;
             bcf1_t *line = args->files->readers[0].buffer[0];
             if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
-            if ( subset_vcf(args, line) && bcf_write1(args->out, out_hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out);
+            int pass = subset_vcf(args, line);
+            profile_lap(prof, PROF_PROCESS);
+            if ( !pass ) continue;
+            if ( bcf_write1(args->out, out_hdr, line)!=0 ) error("[%s] Error: cannot write to %s\n", __func__,args->fn_out);
+            prof->nrec_out++;
+            profile_lap(prof, PROF_WRITE);
         }
+        profile_lap(prof, PROF_READ);
         ret = args->files->errnum;
         if ( ret ) fprintf(stderr,"Error: %s\n", bcf_sr_strerror(args->files->errnum));
     }
     hts_close(args->out);
+    profile_report(&args->prof, stderr);
     destroy_data(args);
     bcf_sr_destroy(args->files);
     free(args);
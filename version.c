@@ -26,6 +26,9 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
 #include <htslib/hts.h>
 #include "bcftools.h"
 #include "version.h"
@@ -69,4 +72,74 @@ const char *hts_bcf_wmode(int file_type)
     return "w";                                 // uncompressed VCF
 }
 
+int is_url(const char *fname)
+{
+    static const char uri_scheme_chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+.-";
+    return fname[strspn(fname, uri_scheme_chars)] == ':';
+}
+
+int sr_set_readahead(bcf_srs_t *sr, char **fnames, int nfnames, int nblocks)
+{
+    if ( nblocks<=0 ) return 0;
+    int i, nremote = 0;
+    for (i=0; i<nfnames; i++)
+        if ( fnames[i] && is_url(fnames[i]) ) nremote++;
+    if ( !nremote ) return 0;
+    if ( !sr->p )
+    {
+        if ( bcf_sr_set_threads(sr, nremote < READAHEAD_MAX_THREADS ? nremote : READAHEAD_MAX_THREADS)!=0 ) return -1;
+    }
+    sr->p->qsize = nblocks;
+    return 0;
+}
 
+uint64_t profile_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+int profile_init(profile_t *prof, const char *cmd, const char *format)
+{
+    memset(prof, 0, sizeof(*prof));
+    if ( !format || !strcmp(format,"text") ) prof->format = PROF_FMT_TEXT;
+    else if ( !strcmp(format,"json") ) prof->format = PROF_FMT_JSON;
+    else return -1;
+    prof->cmd   = cmd;
+    prof->start = prof->last = profile_clock();
+    return 0;
+}
+
+void profile_report(profile_t *prof, FILE *fp)
+{
+    if ( !prof->format ) return;
+
+    static const char *names[PROF_NSTAGE] = {"read","filter","process","write"};
+    uint64_t total = profile_clock() - prof->start, other = total;
+    int i;
+    for (i=0; i<PROF_NSTAGE; i++) other = other > prof->nsec[i] ? other - prof->nsec[i] : 0;
+
+    if ( prof->format==PROF_FMT_JSON )
+    {
+        fprintf(fp, "{\"command\":\"%s\",\"stages\":{", prof->cmd);
+        for (i=0; i<PROF_NSTAGE; i++)
+            fprintf(fp, "\"%s\":{\"seconds\":%.6f,\"calls\":%"PRIu64"},", names[i], prof->nsec[i]*1e-9, prof->ncalls[i]);
+        fprintf(fp, "\"other\":{\"seconds\":%.6f}},", other*1e-9);
+        fprintf(fp, "\"total_seconds\":%.6f,\"records_in\":%"PRIu64",\"records_out\":%"PRIu64",\"samples\":%"PRIu64"}\n",
+            total*1e-9, prof->nrec_in, prof->nrec_out, prof->nsmpl);
+        return;
+    }
+
+    fprintf(fp, "Profile of bcftools %s:\n", prof->cmd);
+    fprintf(fp, "    %-10s %12s %8s %12s\n", "stage", "seconds", "%", "calls");
+    for (i=0; i<PROF_NSTAGE; i++)
+    {
+        if ( !prof->ncalls[i] ) continue;
+        fprintf(fp, "    %-10s %12.3f %8.1f %12"PRIu64"\n", names[i], prof->nsec[i]*1e-9, total ? 100.*prof->nsec[i]/total : 0, prof->ncalls[i]);
+    }
+    fprintf(fp, "    %-10s %12.3f %8.1f\n", "other", other*1e-9, total ? 100.*other/total : 0);
+    fprintf(fp, "    %-10s %12.3f\n", "total", total*1e-9);
+    fprintf(fp, "    records in/out: %"PRIu64"/%"PRIu64", samples: %"PRIu64"\n", prof->nrec_in, prof->nrec_out, prof->nsmpl);
+}